@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+"""End-to-end performance regression harness of wfmash on the bundled datasets.
+
+Runs standard configurations at several thread counts, keeps the fastest of a few
+repeats of each, and writes their wall time, CPU time, peak RSS and throughput as TSV.
+Given a baseline written by an earlier run, it reports the runs that got slower, or
+bigger, by more than a tolerance and exits with 1 if any did.
+"""
+
+import argparse
+import os
+import platform
+import subprocess
+import sys
+import time
+
+# name, arguments, prefix of the query sequences the throughput counts (None for all)
+CONFIGURATIONS = [
+    ('lpa-self', ['data/LPA.subset.fa.gz', '-p', '80', '-n', '5'], None),
+    ('lpa-no-split', ['data/LPA.subset.fa.gz', '-p', '80', '-N'], None),
+    ('lpa-sam', ['data/LPA.subset.fa.gz', '-p', '80', '-n', '5', '-a'], None),
+    ('yeast-all-vs-all-map', ['data/scerevisiae8.fa.gz', '-p', '95', '-n', '7', '-m', '-Y', '#'], None),
+    ('yeast-batched-index-map', ['data/scerevisiae8.fa.gz', '-p', '95', '-n', '7', '-m', '-Y', '#', '-b', '20m'], None),
+    ('yeast-pair-align', ['data/scerevisiae8.fa.gz', '-T', 'S288C', '-Q', 'Y12'], 'Y12'),
+]
+
+COLUMNS = ['configuration', 'threads', 'wall_seconds', 'cpu_seconds', 'peak_rss_kb', 'bp_per_second']
+
+
+def query_bases(fasta, prefix):
+    total = 0
+    with open(fasta + '.fai', 'r') as fai:
+        for line in fai:
+            fields = line.split('\t')
+            if prefix is None or fields[0].startswith(prefix):
+                total += int(fields[1])
+    return total
+
+
+def run_once(command, output):
+    """Wall seconds, CPU seconds and peak RSS in kB of command, its output sent to output."""
+    start = time.monotonic()
+    with open(output, 'w') as out:
+        process = subprocess.Popen(command, stdout=out, stderr=subprocess.DEVNULL)
+        _, status, usage = os.wait4(process.pid, 0)
+    wall = time.monotonic() - start
+    if os.waitstatus_to_exitcode(status) != 0:
+        sys.exit('[perf_regression] ERROR, failed: ' + ' '.join(command))
+    return wall, usage.ru_utime + usage.ru_stime, usage.ru_maxrss
+
+
+def read_table(path):
+    rows = {}
+    with open(path, 'r') as table:
+        for line in table:
+            if line.startswith('#') or not line.strip():
+                continue
+            fields = line.rstrip('\n').split('\t')
+            rows[(fields[0], int(fields[1]))] = dict(zip(COLUMNS, fields))
+    return rows
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('-w', '--wfmash', default='build/bin/wfmash', help='wfmash binary [build/bin/wfmash]')
+    parser.add_argument('-t', '--threads', default='1,4,8', help='comma-separated thread counts [1,4,8]')
+    parser.add_argument('-r', '--repeats', type=int, default=3, help='runs of each, the fastest kept [3]')
+    parser.add_argument('-c', '--configurations', default=None,
+                        help='comma-separated configurations to run [all: ' + ','.join(c[0] for c in CONFIGURATIONS) + ']')
+    parser.add_argument('-o', '--output', default='perf.tsv', help='TSV of this run [perf.tsv]')
+    parser.add_argument('-b', '--baseline', default=None, help='compare with the TSV of an earlier run')
+    parser.add_argument('--tolerance', type=float, default=0.2,
+                        help='report runs slower, or with a larger peak RSS, than the baseline by this fraction [0.2]')
+    parser.add_argument('-d', '--data-dir', default='.', help='directory holding data/ [.]')
+    args = parser.parse_args()
+
+    selected = CONFIGURATIONS
+    if args.configurations:
+        names = args.configurations.split(',')
+        unknown = set(names) - set(c[0] for c in CONFIGURATIONS)
+        if unknown:
+            sys.exit('[perf_regression] ERROR, unknown configurations: ' + ','.join(sorted(unknown)))
+        selected = [c for c in CONFIGURATIONS if c[0] in names]
+    threads = [int(t) for t in args.threads.split(',')]
+    baseline = read_table(args.baseline) if args.baseline else {}
+
+    wfmash = os.path.abspath(args.wfmash)
+    output = os.path.abspath(args.output)
+    version = subprocess.run([wfmash, '--version'], capture_output=True, text=True).stdout.strip()
+    os.chdir(args.data_dir)
+    scratch = output + '.out'
+    regressions = []
+    with open(output, 'w') as table:
+        table.write('# wfmash ' + version + ' on ' + platform.node() + ', ' + str(os.cpu_count()) + ' cpus\n')
+        table.write('#' + '\t'.join(COLUMNS) + '\n')
+        for name, arguments, prefix in selected:
+            bases = query_bases(arguments[0], prefix)
+            for thread_count in threads:
+                command = [wfmash] + arguments + ['-t', str(thread_count)]
+                runs = [run_once(command, scratch) for _ in range(args.repeats)]
+                wall, cpu, rss = min(runs)
+                row = [name, str(thread_count), '%.3f' % wall, '%.3f' % cpu, str(rss), '%.0f' % (bases / wall)]
+                table.write('\t'.join(row) + '\n')
+                table.flush()
+                line = '\t'.join(row)
+                before = baseline.get((name, thread_count))
+                if before:
+                    wall_ratio = wall / float(before['wall_seconds'])
+                    rss_ratio = rss / float(before['peak_rss_kb'])
+                    line += '\twall x%.2f\trss x%.2f' % (wall_ratio, rss_ratio)
+                    if wall_ratio > 1 + args.tolerance or rss_ratio > 1 + args.tolerance:
+                        regressions.append('%s -t %d: wall x%.2f, peak RSS x%.2f of the baseline'
+                                           % (name, thread_count, wall_ratio, rss_ratio))
+                print(line, flush=True)
+    os.remove(scratch)
+
+    for regression in regressions:
+        print('[perf_regression] REGRESSION, ' + regression, file=sys.stderr)
+    sys.exit(1 if regressions else 0)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,25 @@
+#!/bin/bash
+
+BASELINE=$1
+PAF=$2
+RECALL=$3
+
+# Fraction of the query bases mapped in BASELINE that PAF maps too
+awk -v OFS='\t' '{print $1, $3, $4}' $BASELINE | bedtools sort | bedtools merge > $PAF.baseline.bed
+awk -v OFS='\t' '{print $1, $3, $4}' $PAF | bedtools sort | bedtools merge > $PAF.query.bed
+bedtools intersect -a $PAF.baseline.bed -b $PAF.query.bed > $PAF.recalled.bed
+
+awk -v threshold=$RECALL 'BEGIN{FS=OFS="\t"}{
+    if(FILENAME == ARGV[1]){
+        total += $3 - $2
+    } else {
+        recalled += $3 - $2
+    }
+} END {
+    recall = total > 0 ? recalled / total : 1
+    printf("recall\t%f\n", recall)
+    if (recall < threshold) {
+        print "Low recall " recall " of the query bases mapped in the baseline";
+        exit 1
+    }
+}' $PAF.baseline.bed $PAF.recalled.bed
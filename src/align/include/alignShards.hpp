@@ -0,0 +1,165 @@
+/**
+ * @file    alignShards.hpp
+ * @brief   Split of the mappings between alignment jobs by estimated cost, and the merge
+ *          of the outputs of those jobs
+ */
+
+#ifndef ALIGN_SHARDS_HPP
+#define ALIGN_SHARDS_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <ostream>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace align
+{
+  namespace shards
+  {
+    /**
+     * @brief   shard of each mapping record, by its estimated cost
+     * @details the costliest record goes first to the least loaded shard, the lower one on
+     *          a tie, so the shards add up to about the same cost and every job derives the
+     *          same split from the same mappings
+     */
+    inline std::vector<uint32_t> assign(const std::vector<double>& costs, uint32_t count)
+    {
+      std::vector<uint64_t> byCost(costs.size());
+      for (uint64_t i = 0; i < byCost.size(); ++i) {
+        byCost[i] = i;
+      }
+      std::stable_sort(byCost.begin(), byCost.end(), [&](uint64_t a, uint64_t b) { return costs[a] > costs[b]; });
+
+      typedef std::pair<double, uint32_t> load_t;   // cost assigned and shard
+      std::priority_queue<load_t, std::vector<load_t>, std::greater<load_t>> loads;
+      for (uint32_t shard = 0; shard < count; ++shard) {
+        loads.emplace(0.0, shard);
+      }
+      std::vector<uint32_t> shardOf(costs.size());
+      for (const uint64_t record : byCost) {
+        load_t least = loads.top();
+        loads.pop();
+        shardOf[record] = least.second;
+        least.first += costs[record];
+        loads.push(least);
+      }
+      return shardOf;
+    }
+
+    /**
+     * @brief   the mapping record of each block of a shard's output and its bytes, one
+     *          "record<TAB>bytes" line per block written, in output order
+     */
+    typedef std::vector<std::pair<uint64_t, uint64_t>> Records;
+
+    inline Records readRecords(const std::string& fileName)
+    {
+      std::ifstream in(fileName);
+      if (!in) {
+        throw std::runtime_error("[wfmash::align] Error! Failed to open the shard records " + fileName);
+      }
+      Records records;
+      uint64_t record = 0;
+      uint64_t bytes = 0;
+      while (in >> record >> bytes) {
+        if (!records.empty() && record <= records.back().first) {
+          throw std::runtime_error("[wfmash::align] Error! The shard records " + fileName + " are out of order");
+        }
+        records.emplace_back(record, bytes);
+      }
+      if (!in.eof()) {
+        throw std::runtime_error("[wfmash::align] Error! Malformed shard records " + fileName);
+      }
+      return records;
+    }
+
+    // Copy the next bytes of in to out
+    inline void copy(std::istream& in, uint64_t bytes, std::ostream& out)
+    {
+      std::vector<char> buffer(1 << 16);
+      while (bytes > 0) {
+        const size_t chunk = std::min<uint64_t>(bytes, buffer.size());
+        if (!in.read(buffer.data(), chunk)) {
+          throw std::runtime_error("[wfmash::align] Error! Failed to read a shard output");
+        }
+        out.write(buffer.data(), chunk);
+        bytes -= chunk;
+      }
+    }
+
+    /**
+     * @brief   write the outputs of all the shards as one, in the order of the mapping
+     *          records, the same whatever the number of shards
+     * @details the bytes of an output before its first record are its header, written
+     *          once from the first output
+     */
+    inline void merge(const std::vector<std::string>& outputs, const std::vector<std::string>& recordFiles, std::ostream& out)
+    {
+      if (outputs.size() != recordFiles.size()) {
+        throw std::runtime_error("[wfmash::align] Error! --merge-align-shards takes as many outputs as --align-shard-records files");
+      }
+      std::vector<Records> records;
+      std::vector<std::ifstream> inputs;
+      for (size_t i = 0; i < outputs.size(); ++i) {
+        records.push_back(readRecords(recordFiles[i]));
+        uint64_t recordBytes = 0;
+        for (const auto& block : records.back()) {
+          recordBytes += block.second;
+        }
+        std::error_code ec;
+        const uint64_t size = std::filesystem::file_size(outputs[i], ec);
+        if (ec || size < recordBytes) {
+          throw std::runtime_error("[wfmash::align] Error! The shard output " + outputs[i] + " is shorter than its records "
+                                   + recordFiles[i] + " say");
+        }
+        inputs.emplace_back(outputs[i], std::ios::binary);
+        if (!inputs.back()) {
+          throw std::runtime_error("[wfmash::align] Error! Failed to open the shard output " + outputs[i]);
+        }
+        const uint64_t header = size - recordBytes;
+        if (i == 0) {
+          copy(inputs.back(), header, out);
+        } else {
+          inputs.back().seekg(header);
+        }
+      }
+
+      typedef std::pair<uint64_t, size_t> next_t;   // next record of a shard and the shard
+      std::priority_queue<next_t, std::vector<next_t>, std::greater<next_t>> next;
+      std::vector<size_t> done(records.size(), 0);
+      for (size_t i = 0; i < records.size(); ++i) {
+        if (!records[i].empty()) {
+          next.emplace(records[i].front().first, i);
+        }
+      }
+      uint64_t last = std::numeric_limits<uint64_t>::max();
+      while (!next.empty()) {
+        const next_t top = next.top();
+        next.pop();
+        if (top.first == last) {
+          throw std::runtime_error("[wfmash::align] Error! Mapping record " + std::to_string(top.first)
+                                   + " is in more than one of the shard outputs");
+        }
+        last = top.first;
+        const size_t i = top.second;
+        copy(inputs[i], records[i][done[i]].second, out);
+        if (++done[i] < records[i].size()) {
+          next.emplace(records[i][done[i]].first, i);
+        }
+      }
+      if (!out.flush()) {
+        throw std::runtime_error("[wfmash::align] Error! Failed to write the merged shard outputs");
+      }
+    }
+  }
+}
+
+#endif
@@ -24,9 +24,11 @@ struct Parameters {
 
     //wflambda
     uint16_t wflambda_segment_length;             //segment length for wflambda
+    bool wflambda_adaptive_tiles = false;         //Size the wflambda tiles of each mapping by its identity and length ratio
 
     bool force_biwfa_alignment;				   //force biwfa alignment
     bool force_wflign;                          //force alignment with WFlign instead of the default biWFA
+    int patching_threads = 1;                   //threads each WFlign alignment aligns its patches on
 
     int wfa_mismatch_score;
     int wfa_gap_opening_score;
@@ -51,18 +53,56 @@ struct Parameters {
     int kmerSize;                                 //kmer size for pre-checking before aligning a fragment
     int64_t chain_gap;                            //max distance for 2d range union-find mapping chaining;
     int wflign_min_inv_patch_len;                 //minimum length of an inverted patch
+    bool inversion_hints = false;                 //Try inverted patches only in mappings whose strand votes hint at an inversion
     int wflign_max_patching_score;                //maximum score allowed for patching
 
     std::vector<std::string> refSequences;        //reference sequence(s)
     std::vector<std::string> querySequences;      //query sequence(s)
     std::string mashmapPafFile;                   //mashmap paf mapping file
     std::string pafOutputFile;                    //paf/sam output file name
+    std::string checkpoint_file;                  //records aligned and output bytes written, kept up as the output is written in PAF order
+    bool resume = false;                          //skip the records aligned per checkpoint_file, appending to the output
+    uint64_t align_shard_index = 0;               //With align_shard_count, the shard of the mappings aligned
+    uint64_t align_shard_count = 0;               //Shards the mappings are split into by estimated cost, 0 for none
+    std::string align_shard_records;              //Where a shard saves the mapping record of each block of its output
+    std::vector<std::string> merge_align_shards;  //Shard outputs to merge in PAF order instead of aligning
+    std::vector<std::string> merge_align_shard_records; //The align_shard_records of each of merge_align_shards
+    bool bgzip_output;                            //Write the paf/sam output as BGZF, compressed on the threads
+    std::string bgzip_index_file;                 //With bgzip_output, where to save the .gzi index, empty for none
+    std::string interval_index_file;              //Where to save the interval index of the PAF output, empty for none
+    bool sort_output = false;                     //Write the output sorted by target and position
+    std::string sort_prefix;                      //With sort_output, prefix of the sorted run files
+    uint64_t sort_memory = 1ULL << 30;            //With sort_output, bytes of lines held before spilling a run
 
     bool emit_md_tag;                             //Output the MD tag
     bool sam_format;                              //Emit the output in SAM format (PAF default)
+    bool bam_format;                              //Write the SAM records as BAM through htslib
+    bool cram_format;                             //Write the SAM records as CRAM against the target FASTA
     bool no_seq_in_sam;                           //Do not fill the SEQ field in SAM format
     bool multithread_fasta_input;                 //Multithreaded fasta input
+    bool packed_sequences;                        //Read sequences from 2-bit packed stores built beside the FASTAs
+    bool huge_pages = false;                      //Back the packed stores with transparent huge pages
+    bool dedup_queries = false;                   //Align the records of queries of the same sequence once, writing the lines for each
+    uint64_t wfa_high_memory_budget;              //Predicted wavefront bytes up to which biWFA keeps the full backtrace
+    bool longest_first;                           //Align the costliest mappings first, writing the output in PAF order
+    bool target_order = false;                    //Align the mappings by target and position, writing the output in PAF order
+    uint64_t parallel_alignment_min_length;       //Mappings at least this long are aligned in pieces cut at exact anchors, 0 for never
+    bool banded_alignment;                        //Confine full backtrace biWFA to a band around the diagonal of the mapping
+    bool chain_alignment;                         //Start each segment of a chain where the one before it ends
+    bool mirror_alignments;                       //Also write each PAF record mirrored, query and target swapped
+    double identity_gate_margin = -1;             //Mappings whose identity upper bound is this far below min_identity are not aligned, negative for none
+    bool stats_only = false;                      //Write the PAF statistics of score-only edit distance alignments, without CIGARs
+    double cluster_overlap = 0;                   //Mappings overlapping by this fraction of the shorter on query and target are aligned once as their union, 0 for none
+    double alignment_timeout;                     //Seconds an alignment may take before its fallback, 0 for no limit
+    uint64_t alignment_memory_limit;              //Wavefront bytes an alignment may hold before its fallback, 0 for no limit
+    uint64_t wflambda_sketch_memory;              //Bytes of wflambda tile sketches kept per thread before the least recently used are dropped
     uint64_t target_padding;                      //Additional padding around target sequence
+    uint64_t queue_memory = 0;                    //Bytes of sequence queued or aligning at once, 0 for no limit
+    bool shared_sequences = false;                //Read the sequences the mapping kept packed in memory, the others from the FASTAs
+    bool sequence_readahead = false;              //Hint the kernel to read ahead the FASTA bytes of the records queued
+    std::string telemetry_file;                   //TSV of the method, cost and time of each alignment, empty for none
+    bool cost_tags = false;                       //Tag each alignment with its time and method
+    bool pair_list = false;                       //mashmapPafFile lists region pairs to align instead of mappings
 
 #ifdef WFA_PNG_TSV_TIMING
     // plotting
@@ -7,8 +7,11 @@
 #ifndef ALIGN_TYPES_MAP_HPP 
 #define ALIGN_TYPES_MAP_HPP
 
+#include <string>
+#include <string_view>
 #include <tuple>
 #include <unordered_map>
+#include <vector>
 
 namespace align
 {
@@ -18,14 +21,16 @@ namespace align
   {
     uint16_t rankMapping;             //rank of the mapping for the query qId. It has the same variable type of num_mappings_for_segments (used for the SAM output format)
 
-    std::string qId;                    //query sequence(s) 
-    std::string refId;                  //reference sequence(s)
+    uint32_t qId;                       //query sequence, by its id in the query SequenceNames
+    uint32_t refId;                     //reference sequence, by its id in the reference SequenceNames
     skch::offset_t qStartPos;           //mapping boundary start offset on query
     skch::offset_t qEndPos;             //mapping boundary end offset on query
     skch::offset_t rStartPos;           //mapping boundary start offset on ref
     skch::offset_t rEndPos;             //mapping boundary end offset on ref
     skch::strand_t strand;              //mapping strand
     float mashmap_estimated_identity;
+    float mashmap_identity_upper_bound = 0;  //upper bound of the estimate, 0 if the mapping did not give it
+    int32_t opposing_strand_votes = -1;      //most sketch elements of a fragment voting for the other strand, -1 if the mapping did not give them
 
     // Chain metadata
     int32_t chain_id{-1};               // Unique ID for this chain (-1 if not part of chain)
@@ -34,6 +39,54 @@ namespace align
   };
 
   typedef std::unordered_map <std::string, std::string> refSequenceMap_t;
+
+  /**
+   * @brief   sequence names of an index, interned as integer ids, so mapping rows refer to
+   *          sequences without holding a copy of their name
+   * @details filled once before the rows are parsed and only read afterwards, so it is
+   *          shared by the parsing threads without locks
+   */
+  class SequenceNames
+  {
+    public:
+
+      static constexpr uint32_t missing = uint32_t(-1);
+
+      SequenceNames() = default;
+      SequenceNames(const SequenceNames&) = delete;
+      SequenceNames& operator=(const SequenceNames&) = delete;
+
+      void assign(std::vector<std::string> sequenceNames)
+      {
+        names = std::move(sequenceNames);
+        ids.clear();
+        ids.reserve(names.size());
+        for (uint32_t i = 0; i < names.size(); ++i)
+          ids.emplace(names[i], i);
+      }
+
+      //id of the name, or missing
+      uint32_t id(std::string_view name) const
+      {
+        auto it = ids.find(name);
+        return it == ids.end() ? missing : it->second;
+      }
+
+      const std::string& name(uint32_t id) const
+      {
+        return names[id];
+      }
+
+      size_t size() const
+      {
+        return names.size();
+      }
+
+    private:
+
+      std::vector<std::string> names;
+      std::unordered_map<std::string_view, uint32_t> ids;    //views of names
+  };
 }
 
 #endif
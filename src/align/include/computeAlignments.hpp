@@ -10,25 +10,51 @@
 
 #include <vector>
 #include <algorithm>
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <condition_variable>
+#include <filesystem>
 #include <fstream>
+#include <functional>
+#include <iomanip>
+#include <limits>
 #include <sstream>
+#include <string_view>
 #include <zlib.h>
 #include <cassert>
 #include <thread>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <htslib/faidx.h>
+#include <htslib/sam.h>
 
 //Own includes
 #include "align/include/align_types.hpp"
 #include "align/include/align_parameters.hpp"
+#include "align/include/sequenceCache.hpp"
+#include "align/include/faidxPool.hpp"
+#include "align/include/packedSequences.hpp"
+#include "align/include/sequenceReadahead.hpp"
 #include "map/include/base_types.hpp"
 #include "map/include/commonFunc.hpp"
+#include "map/include/binaryMappings.hpp"
+#include "align/include/alignShards.hpp"
+#include "map/include/memoryReport.hpp"
 
 //External includes
 #include "common/wflign/src/wflign.hpp"
+#include "common/wflign/src/alignment_printer.hpp"
 #include "common/atomic_queue/atomic_queue.h"
 #include "common/seqiter.hpp"
 #include "common/progress.hpp"
+#include "common/queue_budget.hpp"
+#include "common/sampling_profiler.hpp"
+#include "common/bgzfstream.hpp"
+#include "common/interval_index.hpp"
+#include "common/sorted_output.hpp"
 #include "common/utils.hpp"
 
 namespace align
@@ -44,34 +70,112 @@ long double float2phred(long double prob) {
         return p;
 }
 
+/**
+ * @brief Whole lines of the mapping file, or the rows of a binary mapping file, queued to
+ *        the processors together
+ */
+struct mapping_batch_t {
+    std::string lines;
+    std::vector<MappingBoundaryRow> rows;   // rows decoded from a binary mapping file, instead of lines
+    std::vector<uint64_t> order;    // PAF order of each line or row, when not queued in it
+};
+
+/**
+ * @brief Tiles the segments of each chain as its rows are read in file order, which is
+ *        query order: a segment starts where the one before it ends, on the query and
+ *        on the target, so the segments align end to end, neither aligning the padding
+ *        or overlap they share twice nor leaving out the gap between them. A segment
+ *        that does not follow the one before it, on its target and strand, is kept.
+ */
+struct chain_tiler_t {
+    struct chain_end_t {
+        uint32_t refId;
+        skch::strand_t strand;
+        skch::offset_t qEndPos;
+        skch::offset_t rPos;                // target end of the segment, its start on the reverse strand
+    };
+    std::unordered_map<uint64_t, chain_end_t> open;   // last segment of each chain, by query and chain id
+
+    void tile(MappingBoundaryRow& row) {
+        if (row.chain_id < 0 || row.chain_length <= 1) {
+            return;
+        }
+        const uint64_t key = (uint64_t)row.qId << 32 | (uint32_t)row.chain_id;
+        const bool forward = row.strand == skch::strnd::FWD;
+        auto found = open.find(key);
+        if (found != open.end() && row.chain_pos > 1) {
+            const chain_end_t& previous = found->second;
+            if (previous.refId == row.refId && previous.strand == row.strand && previous.qEndPos < row.qEndPos
+                && (forward ? previous.rPos < row.rEndPos : previous.rPos > row.rStartPos)) {
+                row.qStartPos = previous.qEndPos;
+                (forward ? row.rStartPos : row.rEndPos) = previous.rPos;
+            }
+        }
+        if (row.chain_pos >= row.chain_length) {
+            open.erase(key);
+        } else {
+            open[key] = {row.refId, row.strand, row.qEndPos, forward ? row.rEndPos : row.rStartPos};
+        }
+    }
+};
+
 struct seq_record_t {
     MappingBoundaryRow currentRecord;
-    std::string mappingRecordLine;
+    uint64_t order = 0;             // PAF order of the mapping, when not queued in it
     std::string refSequence;  
     std::string querySequence;
+    bool queryReversed = false;     // querySequence is the reverse complement, of valid DNA
     uint64_t refStartPos;
     uint64_t refLen;
     uint64_t refTotalLength;
     uint64_t queryStartPos;
     uint64_t queryLen;
     uint64_t queryTotalLength;
+    std::vector<MappingBoundaryRow> members;  // mappings currentRecord is the union of, under param.cluster_overlap
+};
 
-    seq_record_t(const MappingBoundaryRow& c, const std::string& r, 
-                 const std::string& ref, uint64_t refStart, uint64_t refLength, uint64_t refTotalLength,
-                 const std::string& query, uint64_t queryStart, uint64_t queryLength, uint64_t queryTotalLength)
-        : currentRecord(c)
-        , mappingRecordLine(r)
-        , refSequence(ref)
-        , querySequence(query)
-        , refStartPos(refStart)
-        , refLen(refLength)
-        , refTotalLength(refTotalLength)
-        , queryStartPos(queryStart)
-        , queryLen(queryLength)
-        , queryTotalLength(queryTotalLength)
-        { }
+/**
+ * @brief What a record's alignment depends on besides the names of its sequences: the
+ *        hashes of the sequences it fetched and its coordinates on them
+ */
+struct alignment_key_t {
+    uint64_t query_hash[2];
+    uint64_t ref_hash[2];
+    uint64_t query_start;
+    uint64_t query_len;
+    uint64_t query_total;
+    uint64_t ref_fetched;                   // start of the fetched target, with its padding
+    uint64_t ref_start;
+    uint64_t ref_end;
+    uint64_t ref_total;
+    int strand;
+    float identity;
+
+    auto tie() const {
+        return std::tie(query_hash[0], query_hash[1], ref_hash[0], ref_hash[1], query_start, query_len,
+                        query_total, ref_fetched, ref_start, ref_end, ref_total, strand, identity);
+    }
+    bool operator<(const alignment_key_t& other) const { return tie() < other.tie(); }
 };
 
+/**
+ * @brief Lines of an alignment shared by the records of repeated queries, written under
+ *        the names of the record that aligned it
+ */
+struct shared_alignment_t {
+    std::string query_name;
+    std::string ref_name;
+    std::string lines;
+    bool done = false;                      // lines set, guarded by the aligner's shared mutex
+};
+
+/**
+ * @brief Records aligned and handed back by the workers, for the processors to refill;
+ *        their sequence strings keep the capacity they grew to, so filling a recycled
+ *        record allocates nothing once the pool has warmed up.
+ */
+typedef atomic_queue::AtomicQueue<seq_record_t*, 1024, nullptr, true, true, false, false> seq_record_pool_t;
+
 /**
  * @brief A single-producer, multi-consumer (SPMC) atomic queue for storing pointers to seq_record_t objects.
  *
@@ -80,17 +184,37 @@ struct seq_record_t {
  * Multiple consumers dequeue these pointers and perform long-running alignment processes on the sequences.
  *
  * The queue has the following characteristics:
- * - Capacity: 1024 elements
+ * - Capacity: 8192 elements, the bytes of their sequences bounded by the queue budget
  * - Default value for empty elements: nullptr
  * - MINIMIZE_CONTENTION: true (minimizes contention among consumers)
  * - MAXIMIZE_THROUGHPUT: true (optimized for high throughput)
  * - TOTAL_ORDER: false (relaxed memory ordering for better performance)
  * - SPSC: false (single-producer, multi-consumer mode)
  */
-typedef atomic_queue::AtomicQueue<seq_record_t*, 1024, nullptr, true, true, false, false> seq_atomic_queue_t;
+typedef atomic_queue::AtomicQueue<seq_record_t*, 8192, nullptr, true, true, false, false> seq_atomic_queue_t;
 
 /**
- * @brief A multi-producer, single-consumer (MPSC) atomic queue for storing pointers to std::string objects.
+ * @brief Formatted alignment records of a worker, with the PAF order of their mapping when
+ *        the output is reordered; for BAM or CRAM output the worker parses its SAM text
+ *        into records, leaving the writer only their compression
+ */
+struct alignment_output_t {
+    uint64_t order = 0;
+    std::string text;
+    std::vector<bam1_t*> records;
+    std::vector<wflign::wavefront::paf_record_t> alignments;    // instead of text, for Aligner::compute(rows, ...)
+
+    ~alignment_output_t() {
+        for (bam1_t* b : records) {
+            bam_destroy1(b);
+        }
+    }
+};
+
+typedef atomic_queue::AtomicQueue<mapping_batch_t*, 1024> line_atomic_queue_t;
+
+/**
+ * @brief A multi-producer, single-consumer (MPSC) atomic queue for storing pointers to alignment outputs.
  *
  * This queue is designed for a setup where there are multiple producers and a single consumer.
  * Multiple producers enqueue pointers to std::string objects, which represent PAF (Pairwise Alignment Format) strings.
@@ -104,7 +228,205 @@ typedef atomic_queue::AtomicQueue<seq_record_t*, 1024, nullptr, true, true, fals
  * - TOTAL_ORDER: false (relaxed memory ordering for better performance)
  * - SPSC: false (multi-producer, single-consumer mode)
  */
-typedef atomic_queue::AtomicQueue<std::string*, 1024, nullptr, true, true, false, false> paf_atomic_queue_t;
+typedef atomic_queue::AtomicQueue<alignment_output_t*, 1024, nullptr, true, true, false, false> paf_atomic_queue_t;
+
+/**
+ * @brief Stream buffer appending to a string, so the alignment records are formatted
+ *        straight into a worker's output block, reused from one record to the next.
+ */
+class StringAppendBuffer : public std::streambuf
+{
+  public:
+
+    explicit StringAppendBuffer(std::string* out) : out(out) {}
+
+    void reset(std::string* target) { out = target; }
+
+  protected:
+
+    int_type overflow(int_type c) override {
+        if (c != traits_type::eof()) {
+            out->push_back(traits_type::to_char_type(c));
+        }
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        out->append(s, n);
+        return n;
+    }
+
+  private:
+
+    std::string* out;
+};
+
+/**
+ * @brief Counters of the align pipeline, shown on its progress line and summed up at the
+ *        end of the run, to tell whether reading, sequence fetching, alignment or writing
+ *        holds it back
+ */
+struct AlignStatus {
+    std::atomic<uint64_t> aligned{0};               // records aligned
+    std::atomic<size_t> processors{0};              // pool threads fetching the sequences of records
+    std::unique_ptr<std::atomic<int64_t>[]> started;   // start of each worker's alignment in ns, 0 while idle
+    std::unique_ptr<std::atomic<uint64_t>[]> length;   // query bp of that alignment
+    std::atomic<int64_t> longest_ns{0};             // longest alignment done, and its query bp
+    std::atomic<uint64_t> longest_length{0};
+
+    // Queue depths sampled by the pool threads, summed over the samples, of queues holding
+    // capacity entries each
+    uint64_t capacity = 0;
+    uint64_t samples = 0;
+    uint64_t line_depth = 0;
+    uint64_t seq_depth = 0;
+    uint64_t paf_depth = 0;
+    uint64_t seq_empty = 0;                         // samples with the workers out of records
+    uint64_t processor_count = 0;
+    const int64_t start_ns = now_ns();
+
+    explicit AlignStatus(size_t workers)
+        : started(new std::atomic<int64_t>[workers]), length(new std::atomic<uint64_t>[workers]) {
+        for (size_t i = 0; i < workers; ++i) {
+            started[i].store(0);
+            length[i].store(0);
+        }
+    }
+
+    static int64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void begin(uint64_t worker, uint64_t bp) {
+        length[worker].store(bp, std::memory_order_relaxed);
+        started[worker].store(now_ns(), std::memory_order_relaxed);
+    }
+
+    void end(uint64_t worker) {
+        const int64_t ns = now_ns() - started[worker].load(std::memory_order_relaxed);
+        started[worker].store(0, std::memory_order_relaxed);
+        aligned.fetch_add(1, std::memory_order_relaxed);
+        int64_t longest = longest_ns.load(std::memory_order_relaxed);
+        while (ns > longest && !longest_ns.compare_exchange_weak(longest, ns)) {
+        }
+        if (ns >= longest) {
+            longest_length.store(length[worker].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+    }
+};
+
+/**
+ * @brief What fetching the sequences of records needs, held by one pool thread at a time:
+ *        index handles, empty with packed stores, and block caches of their own
+ */
+struct RecordFetcher {
+    std::mutex busy;
+    FaidxPool::Handle ref_handle;
+    FaidxPool::Handle query_handle;
+    SequenceBlockCache ref_cache;
+    SequenceBlockCache query_cache;
+
+    RecordFetcher(FaidxPool::Handle ref, FaidxPool::Handle query, int64_t block_size, size_t blocks)
+        : ref_handle(std::move(ref)), query_handle(std::move(query)),
+          ref_cache(ref_handle.get(), block_size, blocks), query_cache(query_handle.get(), block_size, blocks) {}
+};
+
+/**
+ * @brief The queues and fetchers the align pool threads share, with what tells them the
+ *        mapping records are all fetched and wakes them when records are queued
+ */
+struct AlignPool {
+    line_atomic_queue_t& line_queue;
+    seq_atomic_queue_t& seq_queue;
+    paf_atomic_queue_t& paf_queue;
+    std::atomic<bool>& reader_done;
+    std::vector<std::unique_ptr<RecordFetcher>> fetchers;
+    std::atomic<size_t> fetching{0};                // threads fetching a batch
+    std::atomic<bool> all_fetched{false};
+    std::atomic<int64_t> next_sample_ns{0};
+    std::atomic<size_t> waiting{0};
+    std::mutex mutex;
+    std::condition_variable wakeup;
+
+    static constexpr int64_t sample_interval_ns = 100000000;
+
+    AlignPool(line_atomic_queue_t& line_queue, seq_atomic_queue_t& seq_queue, paf_atomic_queue_t& paf_queue,
+              std::atomic<bool>& reader_done)
+        : line_queue(line_queue), seq_queue(seq_queue), paf_queue(paf_queue), reader_done(reader_done) {}
+
+    // The batches are read and none is left or being fetched; the queue is checked before
+    // the count, which a batch is added to before it leaves the queue
+    bool fetched() {
+        if (!all_fetched.load() && reader_done.load() && line_queue.was_empty() && fetching.load() == 0) {
+            all_fetched.store(true);
+        }
+        return all_fetched.load();
+    }
+
+    void wake() {
+        if (waiting.load(std::memory_order_relaxed) > 0) {
+            wakeup.notify_one();
+        }
+    }
+
+    // Wait for records to be queued, or a millisecond, for batches a reader queues
+    void idle() {
+        std::unique_lock<std::mutex> lock(mutex);
+        waiting.fetch_add(1);
+        wakeup.wait_for(lock, std::chrono::milliseconds(1));
+        waiting.fetch_sub(1);
+    }
+
+    // Add the queue depths to status, if due, by whichever thread finds it so first
+    void sample(AlignStatus& status) {
+        const int64_t now = AlignStatus::now_ns();
+        int64_t due = next_sample_ns.load(std::memory_order_relaxed);
+        if (now < due || !next_sample_ns.compare_exchange_strong(due, now + sample_interval_ns)) {
+            return;
+        }
+        const size_t queue_size = seq_queue.was_size();
+        const size_t processors = fetching.load(std::memory_order_relaxed);
+        status.processors.store(processors, std::memory_order_relaxed);
+        ++status.samples;
+        status.line_depth += line_queue.was_size();
+        status.seq_depth += queue_size;
+        status.paf_depth += paf_queue.was_size();
+        status.seq_empty += queue_size == 0;
+        status.processor_count += processors;
+    }
+};
+
+/**
+ * Total of the progress meter as the mappings are read in their one pass: the query bases
+ * of those read so far, scaled up to the whole input by the bytes they were read from
+ * when its size is known, as it is not on a pipe, and exact once all are read
+ */
+struct InputProgress {
+    progress_meter::ProgressMeter* progress = nullptr;   // none when the total is known up front
+    uint64_t input_bytes = 0;                            // 0 when not known
+    uint64_t read_bytes = 0;
+    uint64_t read_length = 0;
+
+    void read(uint64_t bytes, uint64_t length) {
+        read_bytes += bytes;
+        read_length += length;
+        if (progress) {
+            uint64_t total = read_length;
+            if (read_bytes > 0 && input_bytes > read_bytes) {
+                total = (double)read_length * input_bytes / read_bytes;
+            }
+            // never below what may already be aligned
+            progress->total = std::max(total, read_length);
+        }
+    }
+
+    void done() {
+        if (progress) {
+            progress->total = read_length;
+        }
+    }
+};
 
 
   /**
@@ -119,21 +441,283 @@ typedef atomic_queue::AtomicQueue<std::string*, 1024, nullptr, true, true, false
       //algorithm parameters
       const align::Parameters &param;
 
-      faidx_t* ref_faidx;
-      faidx_t* query_faidx;
+      //faidx handles of the two FASTAs, lent to the sequence fetchers; shared when target
+      //and query are the same file
+      std::shared_ptr<FaidxPool> refFaidx;
+      std::shared_ptr<FaidxPool> queryFaidx;
+
+      //Sequence names of the two indexes, which the mapping rows refer to by id
+      SequenceNames refNames;
+      SequenceNames queryNames;
+
+      //Under param.pair_list, the lengths of the sequences of the two indexes by id, which
+      //the pairs are checked against
+      std::vector<int64_t> refLengths;
+      std::vector<int64_t> queryLengths;
+
+      //Input read in blocks of about this many bytes, cut at line ends
+      static constexpr size_t lineBatchBytes = 1 << 16;
+
+      //Rows of a binary mapping file queued to the processors together
+      static constexpr size_t rowBatchSize = 1024;
+
+      //Spare records, and the largest sequences a record keeps room for when recycled
+      seq_record_pool_t recordPool;
+      static constexpr size_t recycledRecordMaxBytes = 1 << 20;
+
+      //Alignment records a worker formats before queueing them to the writer, in bytes
+      static constexpr size_t outputBatchBytes = 1 << 16;
+
+      //Sequence blocks each processor keeps decoded, per index
+      static constexpr int64_t sequenceBlockSize = 1 << 18;
+      static constexpr size_t sequenceCacheBlocks = 32;
+
+      //Bases of target whose records param.target_order keeps together when longest first,
+      //as many as a processor's sequence cache holds
+      static constexpr uint64_t targetOrderWindow = sequenceBlockSize * sequenceCacheBlocks;
+
+      //Packed stores read instead of the faidx indexes with --packed-sequences, or laid out
+      //from the sequences the mapping kept with --share-sequences, which may miss some;
+      //shared when target and query are the same file
+      std::shared_ptr<PackedSequenceStore> refStore;
+      std::shared_ptr<PackedSequenceStore> queryStore;
+
+      //With param.sequence_readahead, the readahead of the FASTAs read through faidx, hinted
+      //by the reader thread as it queues the records; shared when they are the same file
+      std::shared_ptr<SequenceReadahead> refReadahead;
+      std::shared_ptr<SequenceReadahead> queryReadahead;
+
+      //Bytes of the packed stores in the memory report
+      skch::memory::Account memoryAccount;
+
+      //Header of BAM or CRAM output, which the workers parse their SAM records against;
+      //null for text output
+      sam_hdr_t* bam_header = nullptr;
+
+      //Stream the text output is written to instead of param.pafOutputFile, if given
+      std::ostream* alignmentOut = nullptr;
+
+      //Under compute(rows, onAlignment), where the writer passes the PAF records on, in the
+      //order of the rows; the workers add them to their blocks as fields instead of text
+      std::function<void(wflign::wavefront::paf_record_t&)> onAlignment;
+
+      //Under param.checkpoint_file the output is written in PAF order and the records
+      //written, with the output bytes they make up, saved every checkpointSeconds; a
+      //resumed job skips those records and appends to the output cut back to those bytes
+      uint64_t resumeRecords = 0;
+      uint64_t resumeBytes = 0;
+      bool resumeOutput = false;
+      static constexpr int checkpointSeconds = 10;
+
+      //Under param.align_shard_count, whether each mapping record, by its PAF order, is
+      //in the shard aligned; the shard's output is written in PAF order, the record and
+      //bytes of each block saved to param.align_shard_records for the merge
+      std::vector<bool> inShard;
+
+      // Sketch elements of a fragment voting for the other strand that hint at an inversion in it
+      static constexpr int inversionHintVotes = 2;
+
+      // Mappings left unaligned by belowIdentityGate
+      std::atomic<uint64_t> gatedRecords{0};
+
+      /**
+       * @brief   whether the identity upper bound of the mapping is param.identity_gate_margin
+       *          or more below param.min_identity, so its alignment would not reach it
+       */
+      bool belowIdentityGate(const MappingBoundaryRow& row) const {
+          if (param.identity_gate_margin < 0 || param.min_identity <= 0 || row.mashmap_identity_upper_bound <= 0) {
+              return false;
+          }
+          return row.mashmap_identity_upper_bound < param.min_identity - param.identity_gate_margin;
+      }
+
+      // Records written in PAF order, restored by the writer from the order of each
+      bool orderedOutput() const {
+          return onAlignment || reorderedJobs() || !param.checkpoint_file.empty() || param.align_shard_count > 0;
+      }
+
+      // Mappings aligned as part of the union of a cluster, and the clusters
+      std::atomic<uint64_t> clusteredRecords{0};
+      std::atomic<uint64_t> clusters{0};
+
+      // Whether overlapping mappings are aligned once as their union; a record stands
+      // for many, so not when each is written in PAF order or shares its alignment
+      bool clusterOverlaps() const {
+          return param.cluster_overlap > 0 && !orderedOutput() && !param.chain_alignment && !param.dedup_queries;
+      }
+
+      /**
+       * @brief   group the mappings of a batch whose query and target spans both overlap
+       *          by param.cluster_overlap of the shorter, for the same query, target and
+       *          strand, sorting rows
+       * @param[out] unions   the span of each cluster, its lowest identity and the chain
+       *                      of its first mapping
+       * @param[out] members  the mappings of each cluster, none for a mapping alone
+       */
+      void clusterMappings(std::vector<MappingBoundaryRow>& rows, std::vector<MappingBoundaryRow>& unions,
+                           std::vector<std::vector<MappingBoundaryRow>>& members) const {
+          std::sort(rows.begin(), rows.end(), [](const MappingBoundaryRow& a, const MappingBoundaryRow& b) {
+              return std::tie(a.qId, a.refId, a.strand, a.qStartPos, a.rStartPos)
+                  < std::tie(b.qId, b.refId, b.strand, b.qStartPos, b.rStartPos);
+          });
+          const auto overlaps = [&](int64_t start, int64_t end, int64_t otherStart, int64_t otherEnd) {
+              const int64_t overlap = std::min(end, otherEnd) - std::max(start, otherStart);
+              return overlap > 0 && overlap >= param.cluster_overlap * std::min(end - start, otherEnd - otherStart);
+          };
+          unions.clear();
+          members.clear();
+          size_t keyBegin = 0;
+          for (const MappingBoundaryRow& row : rows) {
+              if (keyBegin < unions.size() && std::tie(row.qId, row.refId, row.strand)
+                  != std::tie(unions[keyBegin].qId, unions[keyBegin].refId, unions[keyBegin].strand)) {
+                  keyBegin = unions.size();
+              }
+              size_t joined = unions.size();
+              for (size_t i = keyBegin; i < unions.size(); ++i) {
+                  const MappingBoundaryRow& u = unions[i];
+                  if (overlaps(row.qStartPos, row.qEndPos, u.qStartPos, u.qEndPos)
+                      && overlaps(row.rStartPos, row.rEndPos, u.rStartPos, u.rEndPos)) {
+                      joined = i;
+                      break;
+                  }
+              }
+              if (joined == unions.size()) {
+                  unions.push_back(row);
+                  members.emplace_back();
+                  continue;
+              }
+              MappingBoundaryRow& u = unions[joined];
+              if (members[joined].empty()) {
+                  members[joined].push_back(u);
+              }
+              members[joined].push_back(row);
+              u.qStartPos = std::min(u.qStartPos, row.qStartPos);
+              u.qEndPos = std::max(u.qEndPos, row.qEndPos);
+              u.rStartPos = std::min(u.rStartPos, row.rStartPos);
+              u.rEndPos = std::max(u.rEndPos, row.rEndPos);
+              u.mashmap_estimated_identity = std::min(u.mashmap_estimated_identity, row.mashmap_estimated_identity);
+              u.mashmap_identity_upper_bound = std::max(u.mashmap_identity_upper_bound, row.mashmap_identity_upper_bound);
+          }
+      }
+
+      //Telemetry of the alignments, which each worker gathers in blocks of about
+      //telemetryBatchBytes before writing them; closed unless param.telemetry_file is set
+      std::ofstream telemetryOut;
+      std::mutex telemetryMutex;
+      static constexpr size_t telemetryBatchBytes = 1 << 16;
+
+      //Under param.dedup_queries, the queries whose length another query has, by id, and
+      //the alignments of their records; a record aligning the same sequences at the same
+      //coordinates as one before it writes its lines, renamed, instead of aligning again
+      std::vector<char> repeatedQueryLength;
+      std::map<alignment_key_t, std::shared_ptr<shared_alignment_t>> sharedAlignments;
+      std::mutex sharedMutex;
+      std::condition_variable sharedReady;
+
+      static std::vector<std::string> faidxNames(const faidx_t* fai) {
+          std::vector<std::string> names;
+          for (int i = 0; i < faidx_nseq(fai); ++i) {
+              names.emplace_back(faidx_iseq(fai, i));
+          }
+          return names;
+      }
 
     public:
 
-      explicit Aligner(const align::Parameters &p) : param(p) {
+      explicit Aligner(const align::Parameters &p, std::ostream* out = nullptr) : param(p), alignmentOut(out) {
+          queue_budget::shared().set_limit(param.queue_memory);
           assert(param.refSequences.size() == 1);
           assert(param.querySequences.size() == 1);
-          ref_faidx = fai_load(param.refSequences.front().c_str());
-          query_faidx = fai_load(param.querySequences.front().c_str());
+          refFaidx = std::make_shared<FaidxPool>(param.refSequences.front());
+          queryFaidx = param.querySequences.front() == param.refSequences.front()
+              ? refFaidx : std::make_shared<FaidxPool>(param.querySequences.front());
+          // the handles go back to the pools for the first fetcher
+          refNames.assign(faidxNames(refFaidx->acquire().get()));
+          queryNames.assign(faidxNames(queryFaidx->acquire().get()));
+          if (param.packed_sequences) {
+              refStore = std::make_shared<PackedSequenceStore>(param.refSequences.front());
+              queryStore = param.querySequences.front() == param.refSequences.front()
+                  ? refStore : std::make_shared<PackedSequenceStore>(param.querySequences.front());
+              if (param.huge_pages) {
+                  refStore->adviseHugePages();
+                  queryStore->adviseHugePages();
+              }
+              memoryAccount.set(skch::memory::PACKED_SEQUENCES, refStore->memoryBytes()
+                                + (queryStore != refStore ? queryStore->memoryBytes() : 0));
+          } else if (param.shared_sequences) {
+              // The sequences the mapping kept, laid out as stores missing the others
+              refStore = std::make_shared<PackedSequenceStore>(refFaidx->acquire().get(),
+                                                               shared_sequences::shared().get(param.refSequences.front()));
+              queryStore = param.querySequences.front() == param.refSequences.front()
+                  ? refStore : std::make_shared<PackedSequenceStore>(queryFaidx->acquire().get(),
+                                                                     shared_sequences::shared().get(param.querySequences.front()));
+              shared_sequences::shared().clear();
+              memoryAccount.set(skch::memory::PACKED_SEQUENCES, refStore->memoryBytes()
+                                + (queryStore != refStore ? queryStore->memoryBytes() : 0));
+              std::cerr << "[wfmash::align] Reading " << (refStore->complete() && queryStore->complete() ? "all" : "some")
+                        << " sequences from those the mapping kept, "
+                        << refStore->memoryBytes() + (queryStore != refStore ? queryStore->memoryBytes() : 0) << " bytes" << std::endl;
+          }
+          if (param.sequence_readahead) {
+              if (!refStore || !refStore->complete()) {
+                  refReadahead = std::make_shared<SequenceReadahead>(param.refSequences.front());
+              }
+              if (!queryStore || !queryStore->complete()) {
+                  queryReadahead = param.querySequences.front() == param.refSequences.front() && refReadahead
+                      ? refReadahead : std::make_shared<SequenceReadahead>(param.querySequences.front());
+              }
+          }
+          if (param.pair_list) {
+              auto lengths = [](const SequenceNames& names, const std::shared_ptr<PackedSequenceStore>& store, FaidxPool& faidx) {
+                  auto handle = faidx.acquire();
+                  std::vector<int64_t> lengths(names.size());
+                  for (size_t id = 0; id < lengths.size(); ++id) {
+                      lengths[id] = store ? store->length(id) : faidx_seq_len(handle.get(), names.name(id).c_str());
+                  }
+                  return lengths;
+              };
+              refLengths = lengths(refNames, refStore, *refFaidx);
+              queryLengths = lengths(queryNames, queryStore, *queryFaidx);
+          }
+          if (param.dedup_queries) {
+              auto handle = queryFaidx->acquire();
+              std::unordered_map<int64_t, size_t> lengthCounts;
+              std::vector<int64_t> lengths(queryNames.size());
+              for (size_t id = 0; id < lengths.size(); ++id) {
+                  lengths[id] = queryStore ? queryStore->length(id) : faidx_seq_len(handle.get(), queryNames.name(id).c_str());
+                  ++lengthCounts[lengths[id]];
+              }
+              repeatedQueryLength.resize(lengths.size());
+              for (size_t id = 0; id < lengths.size(); ++id) {
+                  repeatedQueryLength[id] = lengthCounts[lengths[id]] > 1;
+              }
+          }
+          if (param.resume && !param.checkpoint_file.empty()) {
+              std::ifstream checkpoint(param.checkpoint_file);
+              if (checkpoint >> resumeRecords >> resumeBytes) {
+                  resumeOutput = true;
+                  std::cerr << "[wfmash::align] Resuming after the " << resumeRecords << " records aligned before" << std::endl;
+              }
+          }
+          if (!param.telemetry_file.empty()) {
+              telemetryOut.open(param.telemetry_file);
+              if (!telemetryOut) {
+                  throw std::runtime_error("[wfmash::align] Error! Failed to open the telemetry file: " + param.telemetry_file);
+              }
+              telemetryOut << "query_name\tquery_start\tquery_end\tstrand\ttarget_name\ttarget_start\ttarget_end"
+                           << "\tmethod\tquery_length\ttarget_length\tpieces\tscore"
+                           << "\tpredicted_wavefront_bytes\twavefront_bytes\tseconds\tthread\n";
+          }
       }
 
       ~Aligner() {
-          fai_destroy(ref_faidx);
-          fai_destroy(query_faidx);  
+          seq_record_t* rec = nullptr;
+          while (recordPool.try_pop(rec)) {
+              delete rec;
+          }
+          if (bam_header) {
+              sam_hdr_destroy(bam_header);
+          }
       }
       
       /**
@@ -142,105 +726,406 @@ typedef atomic_queue::AtomicQueue<std::string*, 1024, nullptr, true, true, false
 
       void compute()
       {
-        this->computeAlignments();
+        this->computeAlignments(nullptr);
+      }
+
+      /**
+       * @brief                 align the rows, with the ids of queryId and refId, passing the
+       *                        PAF record of each alignment to onAlignment in the order of the
+       *                        rows, as its fields; for PAF output, with none of the options
+       *                        that rewrite its lines (mirrors, clusters, shared alignments,
+       *                        cost tags, statistics only) nor those of the output file
+       */
+      void compute(const std::vector<MappingBoundaryRow>& rows,
+                   std::function<void(wflign::wavefront::paf_record_t&)> onAlignment)
+      {
+        this->onAlignment = std::move(onAlignment);
+        this->computeAlignments(nullptr, &rows);
+        this->onAlignment = nullptr;
+      }
+
+      /**
+       * @brief                 ids of the query and target sequences the rows refer to,
+       *                        SequenceNames::missing for a name not in their FASTA
+       */
+      uint32_t queryId(std::string_view name) const
+      {
+        return queryNames.id(name);
+      }
+      uint32_t refId(std::string_view name) const
+      {
+        return refNames.id(name);
+      }
+
+      /**
+       * @brief                 compute alignments of the mappings read from a stream as
+       *                        they are written to it, until it ends
+       */
+      void compute(std::istream& mappings)
+      {
+        this->computeAlignments(&mappings);
       }
 
       /**
        * @brief       parse mashmap row sequence
+       * @details     splits the row into views of its whitespace separated fields and converts
+       *              them in place, so a row is parsed without allocating
        * @param[in]   mappingRecordLine
        * @param[out]  currentRecord
        */
-      inline static void parseMashmapRow(const std::string &mappingRecordLine, MappingBoundaryRow &currentRecord, const uint64_t target_padding) {
-          std::stringstream ss(mappingRecordLine); // Insert the string into a stream
-          std::string word; // Have a buffer string
-
-          vector<std::string> tokens; // Create vector to hold our words
-
-          while (ss >> word) {
-              tokens.push_back(word);
+      inline static void parseMashmapRow(std::string_view mappingRecordLine, MappingBoundaryRow &currentRecord, const uint64_t target_padding,
+                                         const SequenceNames& queryNames, const SequenceNames& refNames) {
+          auto invalidRecord = [&]() {
+              return std::runtime_error("[wfmash::align::parseMashmapRow] Error! Invalid mashmap mapping record: " + std::string(mappingRecordLine));
+          };
+
+          // The first 17 fields, and how many there are
+          std::array<std::string_view, 17> tokens;
+          size_t tokenCount = 0;
+          for (size_t pos = 0; pos < mappingRecordLine.size();) {
+              while (pos < mappingRecordLine.size() && std::isspace((unsigned char)mappingRecordLine[pos])) {
+                  ++pos;
+              }
+              size_t end = pos;
+              while (end < mappingRecordLine.size() && !std::isspace((unsigned char)mappingRecordLine[end])) {
+                  ++end;
+              }
+              if (end > pos) {
+                  if (tokenCount < tokens.size()) {
+                      tokens[tokenCount] = mappingRecordLine.substr(pos, end - pos);
+                  }
+                  ++tokenCount;
+              }
+              pos = end;
           }
 
           // Check if the number of tokens is at least 13
-          if (tokens.size() < 13) {
-              throw std::runtime_error("[wfmash::align::parseMashmapRow] Error! Invalid mashmap mapping record: " + mappingRecordLine);
+          if (tokenCount < 13) {
+              throw invalidRecord();
           }
 
+          auto toInteger = [&](std::string_view token, auto& value) {
+              auto [ptr, ec] = std::from_chars(token.data(), token.data() + token.size(), value);
+              if (ec != std::errc() || ptr != token.data() + token.size()) {
+                  throw invalidRecord();
+              }
+          };
+
+          auto sequenceId = [&](const SequenceNames& names, std::string_view name) {
+              const uint32_t id = names.id(name);
+              if (id == SequenceNames::missing) {
+                  throw std::runtime_error("[wfmash::align::parseMashmapRow] Error! Sequence " + std::string(name) + " is not in the index");
+              }
+              return id;
+          };
+
           // Extract the mashmap identity from the string
-          const vector<string> mm_id_vec = skch::CommonFunc::split(tokens[12], ':');
+          std::string_view mm_id_str = tokens[12].substr(tokens[12].rfind(':') + 1);
           // if the estimated identity is missing, avoid assuming too low values
-          const float mm_id = wfmash::is_a_number(mm_id_vec.back()) ? std::stof(mm_id_vec.back()) : skch::fixed::percentage_identity;
+          float mm_id = skch::fixed::percentage_identity;
+          if (!mm_id_str.empty() && mm_id_str.find_first_not_of("0123456789.") == std::string_view::npos
+              && std::count(mm_id_str.begin(), mm_id_str.end(), '.') < 2) {
+              std::from_chars(mm_id_str.data(), mm_id_str.data() + mm_id_str.size(), mm_id);
+          }
 
           // Parse chain info if present (expecting format "chain:i:id.pos.len" in tokens[14])
           int32_t chain_id = -1;
           int32_t chain_length = 1;
           int32_t chain_pos = 1;
-          if (tokens.size() > 14) {
-              const vector<string> chain_vec = skch::CommonFunc::split(tokens[14], ':');
-              if (chain_vec.size() == 3 && chain_vec[0] == "chain" && chain_vec[1] == "i") {
-                  // Split the id.pos.len format
-                  const vector<string> chain_parts = skch::CommonFunc::split(chain_vec[2], '.');
-                  if (chain_parts.size() == 3) {
-                      chain_id = std::stoi(chain_parts[0]);
-                      chain_pos = std::stoi(chain_parts[1]); 
-                      chain_length = std::stoi(chain_parts[2]);
+          if (tokenCount > 14 && tokens[14].substr(0, 8) == "chain:i:") {
+              const std::string_view chain = tokens[14].substr(8);
+              const size_t dot1 = chain.find('.');
+              const size_t dot2 = dot1 == std::string_view::npos ? dot1 : chain.find('.', dot1 + 1);
+              if (dot2 != std::string_view::npos && chain.find('.', dot2 + 1) == std::string_view::npos
+                  && chain.find(':') == std::string_view::npos) {
+                  toInteger(chain.substr(0, dot1), chain_id);
+                  toInteger(chain.substr(dot1 + 1, dot2 - dot1 - 1), chain_pos);
+                  toInteger(chain.substr(dot2 + 1), chain_length);
+              }
+          }
+
+          // The identity upper bound and strand votes follow the other tags, if the mapping gave them
+          float mm_id_upper = 0;
+          int32_t opposing_votes = -1;
+          for (size_t i = 13; i < std::min(tokenCount, tokens.size()); ++i) {
+              if (tokens[i].substr(0, 5) == "ub:f:") {
+                  const std::string_view upper = tokens[i].substr(5);
+                  if (std::from_chars(upper.data(), upper.data() + upper.size(), mm_id_upper).ec != std::errc()) {
+                      mm_id_upper = 0;
+                  }
+              } else if (tokens[i].substr(0, 5) == "iv:i:") {
+                  const std::string_view votes = tokens[i].substr(5);
+                  if (std::from_chars(votes.data(), votes.data() + votes.size(), opposing_votes).ec != std::errc()) {
+                      opposing_votes = -1;
                   }
               }
           }
 
           // Save words into currentRecord
           {
-              currentRecord.qId = tokens[0];
-              currentRecord.qStartPos = std::stoi(tokens[2]);
-              currentRecord.qEndPos = std::stoi(tokens[3]);
+              currentRecord.qId = sequenceId(queryNames, tokens[0]);
+              toInteger(tokens[2], currentRecord.qStartPos);
+              toInteger(tokens[3], currentRecord.qEndPos);
               currentRecord.strand = (tokens[4] == "+" ? skch::strnd::FWD : skch::strnd::REV);
-              currentRecord.refId = tokens[5];
-              const uint64_t ref_len = std::stoi(tokens[6]);
+              currentRecord.refId = sequenceId(refNames, tokens[5]);
+              uint64_t ref_len;
+              toInteger(tokens[6], ref_len);
               currentRecord.chain_id = chain_id;
               currentRecord.chain_length = chain_length;
               currentRecord.chain_pos = chain_pos;
               
-              // Apply target padding while ensuring we don't go below 0 or above reference length
-              uint64_t rStartPos = std::stoi(tokens[7]);
-              uint64_t rEndPos = std::stoi(tokens[8]);
-              
-              // Always apply target padding
-              if (target_padding > 0) {
-                  if (rStartPos >= target_padding) {
-                      rStartPos -= target_padding;
-                  } else {
-                      rStartPos = 0;
-                  }
-                  if (rEndPos + target_padding <= ref_len) {
-                      rEndPos += target_padding;
-                  } else {
-                      rEndPos = ref_len;
+              uint64_t rStartPos;
+              uint64_t rEndPos;
+              toInteger(tokens[7], rStartPos);
+              toInteger(tokens[8], rEndPos);
+              setPaddedTargetRange(currentRecord, rStartPos, rEndPos, ref_len, target_padding);
+              currentRecord.mashmap_estimated_identity = mm_id;
+              currentRecord.mashmap_identity_upper_bound = mm_id_upper;
+              currentRecord.opposing_strand_votes = opposing_votes;
+          }
+      }
+
+      /**
+       * @brief       sequence ids the names of a binary mapping file's name table have in the
+       *              query and reference indexes, SequenceNames::missing where they lack one
+       */
+      struct BinaryMappingIds
+      {
+          std::vector<std::string> names;
+          std::vector<uint32_t> query;
+          std::vector<uint32_t> ref;
+      };
+
+      /**
+       * @brief       read the header of a binary mapping file and resolve its names
+       */
+      static BinaryMappingIds readBinaryMappingIds(std::istream& in, const SequenceNames& queryNames, const SequenceNames& refNames) {
+          BinaryMappingIds ids;
+          if (!skch::readBinaryMappingHeader(in, ids.names)) {
+              throw std::runtime_error("[wfmash::align] Error! Malformed header of the binary mapping file");
+          }
+          ids.query.reserve(ids.names.size());
+          ids.ref.reserve(ids.names.size());
+          for (const auto& name : ids.names) {
+              ids.query.push_back(queryNames.id(name));
+              ids.ref.push_back(refNames.id(name));
+          }
+          return ids;
+      }
+
+      /**
+       * @brief       row of a binary mapping record, with the same target padding and checks
+       *              as parseMashmapRow
+       */
+      inline static void binaryMappingRow(const skch::BinaryMapping& mapping, MappingBoundaryRow &currentRecord, const uint64_t target_padding,
+                                          const BinaryMappingIds& ids) {
+          auto sequenceId = [&](const std::vector<uint32_t>& idOf, uint32_t seqId) {
+              if (seqId >= ids.names.size()) {
+                  throw std::runtime_error("[wfmash::align] Error! Binary mapping record refers to sequence " + std::to_string(seqId)
+                                           + " of a name table of " + std::to_string(ids.names.size()));
+              }
+              if (idOf[seqId] == SequenceNames::missing) {
+                  throw std::runtime_error("[wfmash::align] Error! Sequence " + ids.names[seqId] + " is not in the index");
+              }
+              return idOf[seqId];
+          };
+          if (mapping.queryStartPos < 0 || mapping.queryEndPos < mapping.queryStartPos
+              || mapping.refStartPos < 0 || mapping.refEndPos < mapping.refStartPos) {
+              throw std::runtime_error("[wfmash::align] Error! Invalid binary mapping record of query " + ids.names[std::min<size_t>(mapping.querySeqId, ids.names.size() - 1)]);
+          }
+
+          currentRecord.qId = sequenceId(ids.query, mapping.querySeqId);
+          currentRecord.qStartPos = mapping.queryStartPos;
+          currentRecord.qEndPos = mapping.queryEndPos;
+          currentRecord.strand = mapping.strand == skch::strnd::REV ? skch::strnd::REV : skch::strnd::FWD;
+          currentRecord.refId = sequenceId(ids.ref, mapping.refSeqId);
+          currentRecord.chain_id = mapping.chainId;
+          currentRecord.chain_length = mapping.chainLength;
+          currentRecord.chain_pos = mapping.chainPos;
+          setPaddedTargetRange(currentRecord, mapping.refStartPos, mapping.refEndPos, mapping.refLen, target_padding);
+          currentRecord.mashmap_estimated_identity = mapping.nucIdentity;
+          currentRecord.mashmap_identity_upper_bound = mapping.nucIdentityUpperBound;
+          currentRecord.opposing_strand_votes = (int32_t)mapping.opposingStrandVotes - 1;
+      }
+
+      /**
+       * @brief       call fn on the row of each record of a binary mapping file, its header read
+       */
+      template <typename Fn>
+      void forEachBinaryMapping(std::istream& in, const BinaryMappingIds& ids, Fn&& fn) const {
+          skch::BinaryMapping mapping;
+          MappingBoundaryRow row;
+          while (skch::readBinaryMapping(in, mapping)) {
+              binaryMappingRow(mapping, row, param.target_padding, ids);
+              fn(row);
+          }
+          if (in.bad()) {
+              throw std::runtime_error("[wfmash::align] Error! Truncated binary mapping file: " + param.mashmapPafFile);
+          }
+      }
+
+      /**
+       * @brief       parse a line of a pair list, `query start end target start end [strand]`
+       *              with 0-based half-open intervals, into a row with the target padding of
+       *              parseMashmapRow; false for a blank line or a # comment
+       */
+      bool parsePairRow(std::string_view line, MappingBoundaryRow &currentRecord) const {
+          auto invalidPair = [&]() {
+              return std::runtime_error("[wfmash::align] Error! Invalid pair: " + std::string(line));
+          };
+
+          std::array<std::string_view, 7> tokens;
+          size_t tokenCount = 0;
+          for (size_t pos = 0; pos < line.size();) {
+              while (pos < line.size() && std::isspace((unsigned char)line[pos])) {
+                  ++pos;
+              }
+              size_t end = pos;
+              while (end < line.size() && !std::isspace((unsigned char)line[end])) {
+                  ++end;
+              }
+              if (end > pos) {
+                  if (tokenCount < tokens.size()) {
+                      tokens[tokenCount] = line.substr(pos, end - pos);
                   }
+                  ++tokenCount;
               }
+              pos = end;
+          }
+          if (tokenCount == 0 || tokens[0][0] == '#') {
+              return false;
+          }
+          if (tokenCount < 6 || tokenCount > 7 || (tokenCount == 7 && tokens[6] != "+" && tokens[6] != "-")) {
+              throw invalidPair();
+          }
 
-              // Validate coordinates against reference length
-              if (rStartPos >= ref_len || rEndPos > ref_len) {
-                  std::cerr << "[parse-debug] ERROR: Coordinates exceed reference length!" << std::endl;
-                  throw std::runtime_error("[wfmash::align::parseMashmapRow] Error! Coordinates exceed reference length: " 
-                                         + std::to_string(rStartPos) + "-" + std::to_string(rEndPos) 
-                                         + " (ref_len=" + std::to_string(ref_len) + ")");
+          auto toInteger = [&](std::string_view token) {
+              uint64_t value = 0;
+              auto [ptr, ec] = std::from_chars(token.data(), token.data() + token.size(), value);
+              if (ec != std::errc() || ptr != token.data() + token.size()) {
+                  throw invalidPair();
               }
-              
-              currentRecord.rStartPos = rStartPos;
-              currentRecord.rEndPos = rEndPos;
-              currentRecord.mashmap_estimated_identity = mm_id;
+              return value;
+          };
+          auto sequenceId = [&](const SequenceNames& names, std::string_view name) {
+              const uint32_t id = names.id(name);
+              if (id == SequenceNames::missing) {
+                  throw std::runtime_error("[wfmash::align] Error! Sequence " + std::string(name) + " is not in the index");
+              }
+              return id;
+          };
+
+          const uint32_t qId = sequenceId(queryNames, tokens[0]);
+          const uint64_t qStartPos = toInteger(tokens[1]);
+          const uint64_t qEndPos = toInteger(tokens[2]);
+          const uint32_t refId = sequenceId(refNames, tokens[3]);
+          const uint64_t rStartPos = toInteger(tokens[4]);
+          const uint64_t rEndPos = toInteger(tokens[5]);
+          if (qStartPos >= qEndPos || qEndPos > uint64_t(queryLengths[qId]) || rStartPos >= rEndPos) {
+              throw invalidPair();
           }
+
+          currentRecord.qId = qId;
+          currentRecord.qStartPos = qStartPos;
+          currentRecord.qEndPos = qEndPos;
+          currentRecord.strand = tokenCount == 7 && tokens[6] == "-" ? skch::strnd::REV : skch::strnd::FWD;
+          currentRecord.refId = refId;
+          currentRecord.chain_id = -1;
+          currentRecord.chain_length = 1;
+          currentRecord.chain_pos = 1;
+          setPaddedTargetRange(currentRecord, rStartPos, rEndPos, refLengths[refId], param.target_padding);
+          currentRecord.mashmap_estimated_identity = skch::fixed::percentage_identity;
+          currentRecord.mashmap_identity_upper_bound = 0;
+          currentRecord.opposing_strand_votes = -1;
+          return true;
+      }
+
+      /**
+       * @brief       call fn on the row of each pair of a pair list
+       */
+      template <typename Fn>
+      void forEachPair(std::istream& in, Fn&& fn) const {
+          std::string line;
+          MappingBoundaryRow row;
+          while (std::getline(in, line)) {
+              if (parsePairRow(line, row)) {
+                  fn(row);
+              }
+          }
+          if (in.bad()) {
+              throw std::runtime_error("[wfmash::align] Error! Failed reading the pair list: " + param.mashmapPafFile);
+          }
+      }
+
+      /**
+       * @brief       set the target range of a row, widened by the target padding within the
+       *              reference length
+       */
+      inline static void setPaddedTargetRange(MappingBoundaryRow &currentRecord, uint64_t rStartPos, uint64_t rEndPos,
+                                              const uint64_t ref_len, const uint64_t target_padding) {
+          // Apply target padding while ensuring we don't go below 0 or above reference length
+          if (target_padding > 0) {
+              if (rStartPos >= target_padding) {
+                  rStartPos -= target_padding;
+              } else {
+                  rStartPos = 0;
+              }
+              if (rEndPos + target_padding <= ref_len) {
+                  rEndPos += target_padding;
+              } else {
+                  rEndPos = ref_len;
+              }
+          }
+
+          // Validate coordinates against reference length
+          if (rStartPos >= ref_len || rEndPos > ref_len) {
+              std::cerr << "[parse-debug] ERROR: Coordinates exceed reference length!" << std::endl;
+              throw std::runtime_error("[wfmash::align::parseMashmapRow] Error! Coordinates exceed reference length: " 
+                                     + std::to_string(rStartPos) + "-" + std::to_string(rEndPos) 
+                                     + " (ref_len=" + std::to_string(ref_len) + ")");
+          }
+
+          currentRecord.rStartPos = rStartPos;
+          currentRecord.rEndPos = rEndPos;
       }
 
   private:
 
+/**
+ * @brief   a record to fill, recycled from the pool when one is spare
+ */
+seq_record_t* acquireRecord() {
+    seq_record_t* rec = nullptr;
+    if (!recordPool.try_pop(rec)) {
+        rec = new seq_record_t();
+    }
+    return rec;
+}
+
+/**
+ * @brief   hand an aligned record back to the pool, unless the pool is full or the record
+ *          holds onto more memory than is worth keeping
+ */
+void releaseRecord(seq_record_t* rec) {
+    skch::memory::add(skch::memory::ALIGN_RECORDS, -recordBytes(rec));
+    queue_budget::shared().release(recordBytes(rec));
+    if (rec->refSequence.capacity() + rec->querySequence.capacity() > recycledRecordMaxBytes
+        || !recordPool.try_push(rec)) {
+        delete rec;
+    }
+}
+
 seq_record_t* createSeqRecord(const MappingBoundaryRow& currentRecord, 
-                              const std::string& mappingRecordLine,
                               faidx_t* ref_faidx,
-                              faidx_t* query_faidx) {
+                              faidx_t* query_faidx,
+                              SequenceBlockCache& ref_cache,
+                              SequenceBlockCache& query_cache) {
+    const char* refName = refNames.name(currentRecord.refId).c_str();
+    const char* queryName = queryNames.name(currentRecord.qId).c_str();
     // Get the reference sequence length
-    const int64_t ref_size = faidx_seq_len(ref_faidx, currentRecord.refId.c_str());
+    const int64_t ref_size = refStore ? refStore->length(currentRecord.refId) : faidx_seq_len(ref_faidx, refName);
     // Get the query sequence length
-    const int64_t query_size = faidx_seq_len(query_faidx, currentRecord.qId.c_str());
+    const int64_t query_size = queryStore ? queryStore->length(currentRecord.qId) : faidx_seq_len(query_faidx, queryName);
 
     // Compute padding for sequence extraction
     const uint64_t head_padding = currentRecord.rStartPos >= param.wflign_max_len_minor
@@ -248,290 +1133,1238 @@ seq_record_t* createSeqRecord(const MappingBoundaryRow& currentRecord,
     const uint64_t tail_padding = ref_size - currentRecord.rEndPos >= param.wflign_max_len_minor
         ? param.wflign_max_len_minor : ref_size - currentRecord.rEndPos;
 
-    // Extract reference sequence
-    int64_t ref_len;
-    char* ref_seq = faidx_fetch_seq64(ref_faidx, currentRecord.refId.c_str(),
-                                      currentRecord.rStartPos - head_padding, 
-                                      currentRecord.rEndPos - 1 + tail_padding, &ref_len);
+    seq_record_t* rec = acquireRecord();
 
-    // Extract query sequence
-    int64_t query_len;
-    char* query_seq = faidx_fetch_seq64(query_faidx, currentRecord.qId.c_str(),
-                                        currentRecord.qStartPos, currentRecord.qEndPos - 1, &query_len);
-
-    // Create a new seq_record_t object for the alignment
-    seq_record_t* rec = new seq_record_t(currentRecord, mappingRecordLine,
-                                         std::string(ref_seq, ref_len), 
-                                         currentRecord.rStartPos - head_padding, ref_len, ref_size,
-                                         std::string(query_seq, query_len), 
-                                         currentRecord.qStartPos, query_len, query_size);
+    // Extract reference sequence, from the packed store or the blocks of it already
+    // decoded where possible, into the record's buffer
+    const int64_t ref_start = currentRecord.rStartPos - head_padding;
+    const int64_t ref_end = currentRecord.rEndPos - 1 + tail_padding;
+    if (refStore && refStore->has(currentRecord.refId)) {
+        refStore->extract(currentRecord.refId, ref_start, ref_end, rec->refSequence);
+    } else {
+        ref_cache.fetch(currentRecord.refId, refName, ref_size, ref_start, ref_end, rec->refSequence);
+    }
 
-    // Clean up
-    free(ref_seq);
-    free(query_seq);
+    // Extract query sequence; a reverse strand one read from the FASTA is cut from the
+    // reverse complemented blocks of the cache, made once for the segments of its chain
+    rec->queryReversed = false;
+    if (queryStore && queryStore->has(currentRecord.qId)) {
+        queryStore->extract(currentRecord.qId, currentRecord.qStartPos, currentRecord.qEndPos - 1, rec->querySequence);
+    } else if (currentRecord.strand != skch::strnd::FWD) {
+        query_cache.fetchReverseComplement(currentRecord.qId, queryName, query_size,
+                                           currentRecord.qStartPos, currentRecord.qEndPos - 1, rec->querySequence);
+        rec->queryReversed = true;
+    } else {
+        query_cache.fetch(currentRecord.qId, queryName, query_size,
+                          currentRecord.qStartPos, currentRecord.qEndPos - 1, rec->querySequence);
+    }
 
+    rec->currentRecord = currentRecord;
+    rec->order = 0;
+    rec->refStartPos = currentRecord.rStartPos - head_padding;
+    rec->refLen = rec->refSequence.size();
+    rec->refTotalLength = ref_size;
+    rec->queryStartPos = currentRecord.qStartPos;
+    rec->queryLen = rec->querySequence.size();
+    rec->queryTotalLength = query_size;
+    skch::memory::add(skch::memory::ALIGN_RECORDS, recordBytes(rec));
     return rec;
 }
 
-std::string processAlignment(seq_record_t* rec) {
-    std::string& ref_seq = rec->refSequence;
-    std::string& query_seq = rec->querySequence;
+/**
+ * @brief   hint the readahead of the FASTA blocks the records of batch will fetch, as
+ *          createSeqRecord's sequence caches fetch them
+ */
+void readAhead(const mapping_batch_t& batch) {
+    if (!refReadahead && !queryReadahead) {
+        return;
+    }
+    const auto blockStart = [](int64_t pos) { return pos / sequenceBlockSize * sequenceBlockSize; };
+    const auto hint = [&](const MappingBoundaryRow& row) {
+        if (refReadahead && !(refStore && refStore->has(row.refId))) {
+            const int64_t start = row.rStartPos - std::min<int64_t>(row.rStartPos, param.wflign_max_len_minor);
+            const int64_t end = row.rEndPos + param.wflign_max_len_minor;
+            refReadahead->hint(row.refId, blockStart(start), blockStart(end - 1) + sequenceBlockSize);
+        }
+        if (queryReadahead && !(queryStore && queryStore->has(row.qId))) {
+            queryReadahead->hint(row.qId, blockStart(row.qStartPos), blockStart(row.qEndPos - 1) + sequenceBlockSize);
+        }
+    };
+    if (!batch.rows.empty()) {
+        for (const MappingBoundaryRow& row : batch.rows) {
+            hint(row);
+        }
+    } else {
+        MappingBoundaryRow row;
+        forEachLine(batch.lines, [&](std::string_view line) {
+            parseMashmapRow(line, row, param.target_padding, queryNames, refNames);
+            hint(row);
+        });
+    }
+}
+
+/**
+ * @brief   bytes of the sequences of a record read and not yet aligned, in the memory report
+ */
+static int64_t recordBytes(const seq_record_t* rec) {
+    return sizeof(seq_record_t) + rec->refSequence.size() + rec->querySequence.size();
+}
+
+/**
+ * @brief   a CIGAR seen from its target: insertions become deletions, and with reverse
+ *          the runs are read from the other end
+ */
+static std::string mirroredCigar(std::string_view cigar, const bool reverse) {
+    std::vector<std::pair<std::string_view, char>> runs;
+    for (size_t begin = 0, i = 0; i < cigar.size(); ++i) {
+        if (!std::isdigit((unsigned char)cigar[i])) {
+            runs.emplace_back(cigar.substr(begin, i - begin), cigar[i] == 'I' ? 'D' : cigar[i] == 'D' ? 'I' : cigar[i]);
+            begin = i + 1;
+        }
+    }
+    if (reverse) {
+        std::reverse(runs.begin(), runs.end());
+    }
+    std::string mirrored;
+    mirrored.reserve(cigar.size());
+    for (const auto& run : runs) {
+        mirrored.append(run.first);
+        mirrored += run.second;
+    }
+    return mirrored;
+}
+
+/**
+ * @brief   write each line of lines followed by its mirror, its query and target swapped
+ *          as do_biwfa_alignment writes them under param.mirror_alignments, and its CIGAR
+ *          by mirroredCigar; a line aligning a sequence to itself has no mirror
+ */
+static void writeMirrored(std::string_view lines, std::ostream& output) {
+    std::vector<std::string_view> fields;
+    std::string mirrored;
+    forEachLine(lines, [&](std::string_view line) {
+        output.write(line.data(), line.size());
+        output.put('\n');
+        fields.clear();
+        for (size_t begin = 0;;) {
+            const size_t end = line.find('\t', begin);
+            fields.push_back(line.substr(begin, end == std::string_view::npos ? end : end - begin));
+            if (end == std::string_view::npos) {
+                break;
+            }
+            begin = end + 1;
+        }
+        if (fields.size() < 12 || fields[0] == fields[5]) {
+            return;
+        }
+        mirrored.clear();
+        for (const size_t field : {5, 6, 7, 8, 4, 0, 1, 2, 3, 9, 10, 11}) {
+            mirrored.append(fields[field]);
+            mirrored += '\t';
+        }
+        for (size_t field = 12; field < fields.size(); ++field) {
+            if (fields[field].substr(0, 5) == "cg:Z:") {
+                mirrored.append("cg:Z:").append(mirroredCigar(fields[field].substr(5), fields[4] == "-"));
+            } else {
+                mirrored.append(fields[field]);
+            }
+            mirrored += '\t';
+        }
+        mirrored.back() = '\n';
+        output.write(mirrored.data(), mirrored.size());
+    });
+}
+
+/**
+ * @brief   align a record by WFlign on tiles of segment_length under budget, writing its
+ *          PAF or SAM lines to output, under param.mirror_alignments each with its mirror;
+ *          false if the alignment ran out of budget
+ */
+bool wflignAlign(seq_record_t* rec, std::ostream& output, char* query, char* ref,
+                 const int segment_length, wflign::wavefront::alignment_budget_t& budget) {
+    // With mirrors the lines are gathered first, to be written by writeMirrored
+    static thread_local std::string lines;
+    lines.clear();
+    StringAppendBuffer buffer(&lines);
+    std::ostream gathered(&buffer);
+    std::ostream& out = param.mirror_alignments ? gathered : output;
+
+    const bool reverse = rec->currentRecord.strand != skch::strnd::FWD;
+    const uint64_t refLength = rec->currentRecord.rEndPos - rec->currentRecord.rStartPos;
+
+    // Under param.inversion_hints, inverted patches are only tried where the strand votes point to one
+    const int min_inversion_length = param.inversion_hints && rec->currentRecord.opposing_strand_votes >= 0
+        && rec->currentRecord.opposing_strand_votes < inversionHintVotes
+        ? std::numeric_limits<int>::max() : param.wflign_min_inv_patch_len;
+    wflign::wavefront::WFlign wflign(
+        std::min<int>(segment_length, UINT16_MAX), param.min_identity, true,
+        param.wfa_mismatch_score, param.wfa_gap_opening_score, param.wfa_gap_extension_score,
+        param.wfa_patching_mismatch_score,
+        param.wfa_patching_gap_opening_score1, param.wfa_patching_gap_extension_score1,
+        param.wfa_patching_gap_opening_score2, param.wfa_patching_gap_extension_score2,
+        rec->currentRecord.mashmap_estimated_identity,
+        param.wflign_mismatch_score, param.wflign_gap_opening_score, param.wflign_gap_extension_score,
+        param.wflign_max_mash_dist, param.wflign_min_wavefront_length, param.wflign_max_distance_threshold,
+        param.wflign_max_len_major, param.wflign_max_len_minor,
+        param.wflign_erode_k, param.chain_gap, min_inversion_length, param.wflign_max_patching_score,
+        param.wflambda_sketch_memory);
+#ifdef WFA_PNG_TSV_TIMING
+    const std::string noPlots;
+#endif
+    wflign.set_output(
+        &out,
+#ifdef WFA_PNG_TSV_TIMING
+        false, nullptr, noPlots, 0, false, nullptr,
+#endif
+        true, param.emit_md_tag, !param.sam_format, param.no_seq_in_sam);
+    wflign.set_budget(&budget);
+    wflign.set_adaptive_tiles(param.wflambda_adaptive_tiles);
+    wflign.set_patching_threads(param.patching_threads);
+    wflign.wflign_affine_wavefront(
+        queryNames.name(rec->currentRecord.qId), query, rec->queryTotalLength, rec->queryStartPos, rec->queryLen, reverse,
+        refNames.name(rec->currentRecord.refId), ref, rec->refTotalLength, rec->currentRecord.rStartPos, refLength);
+    if (budget.expired()) {
+        return false;
+    }
+    if (param.mirror_alignments) {
+        writeMirrored(lines, output);
+    }
+    return true;
+}
+
+/**
+ * @brief   write a record that ran out of its alignment budget some other way: aligned
+ *          again by wflign on tiles four times coarser, under a budget of its own, or
+ *          failing that its mapping as it is, tagged fb:Z: with why (PAF only). Under
+ *          param.mirror_alignments each is written with its mirror, as biWFA writes them
+ */
+void writeFallback(seq_record_t* rec, std::ostream& output, char* query, char* ref,
+                   const wflign::wavefront::alignment_budget_t& spent,
+                   wflign::wavefront::biwfa_telemetry_t* telemetry) {
+    wflign::wavefront::alignment_budget_t budget(param.alignment_timeout, param.alignment_memory_limit);
+    if (wflignAlign(rec, output, query, ref, param.wflambda_segment_length * 4, budget)) {
+        if (telemetry) {
+            telemetry->method = "wflign-fallback";
+        }
+        return;
+    }
+
+    if (telemetry) {
+        telemetry->method = "mapping-fallback";
+    }
+    if (param.sam_format) {
+        return;
+    }
+    // With mirrors the line is gathered first, to be written by writeMirrored
+    static thread_local std::string lines;
+    lines.clear();
+    StringAppendBuffer buffer(&lines);
+    std::ostream gathered(&buffer);
+    std::ostream& out = param.mirror_alignments ? gathered : output;
+
+    const std::string& queryName = queryNames.name(rec->currentRecord.qId);
+    const std::string& refName = refNames.name(rec->currentRecord.refId);
+    const bool reverse = rec->currentRecord.strand != skch::strnd::FWD;
+    const uint64_t refLength = rec->currentRecord.rEndPos - rec->currentRecord.rStartPos;
+    const float identity = rec->currentRecord.mashmap_estimated_identity;
+    const uint64_t block = std::max<uint64_t>(rec->queryLen, refLength);
+    const int mapq = identity >= 1 ? 255 : (int)std::round(-10.0 * std::log10(1 - identity));
+    if (auto* sink = wflign::wavefront::paf_record_t::sink_for_this_thread()) {
+        wflign::wavefront::paf_record_t& record = sink->emplace_back();
+        record.query_name = queryName;
+        record.query_length = rec->queryTotalLength;
+        record.query_start = rec->queryStartPos;
+        record.query_end = rec->queryStartPos + rec->queryLen;
+        record.reverse = reverse;
+        record.target_name = refName;
+        record.target_length = rec->refTotalLength;
+        record.target_start = rec->currentRecord.rStartPos;
+        record.target_end = rec->currentRecord.rEndPos;
+        record.matches = (uint64_t)std::round(identity * block);
+        record.block_length = block;
+        record.mapq = mapq;
+        record.estimated_identity = identity;
+        record.fallback = spent.exceeded.load();
+        return;
+    }
+    out << queryName << '\t' << rec->queryTotalLength
+           << '\t' << rec->queryStartPos << '\t' << rec->queryStartPos + rec->queryLen
+           << '\t' << (reverse ? '-' : '+')
+           << '\t' << refName << '\t' << rec->refTotalLength
+           << '\t' << rec->currentRecord.rStartPos << '\t' << rec->currentRecord.rEndPos
+           << '\t' << (uint64_t)std::round(identity * block) << '\t' << block
+           << '\t' << mapq
+           << "\tmd:f:" << identity << "\tfb:Z:" << spent.exceeded.load() << '\n';
+    if (param.mirror_alignments) {
+        writeMirrored(lines, output);
+    }
+}
+
+/**
+ * @brief   align a record and write its PAF or SAM lines to output; a reverse strand
+ *          query is complemented into strand_buffer, the worker's own, unless it was
+ *          fetched reverse complemented already. One that runs
+ *          out of the time or memory it is given is written by writeFallback instead.
+ *          Under param.force_wflign it is aligned by WFlign rather than biWFA
+ */
+void processAlignment(seq_record_t* rec, std::ostream& output, std::string& strand_buffer,
+                      wflign::wavefront::biwfa_telemetry_t* telemetry = nullptr) {
+    std::string& ref_seq = rec->refSequence;
+    std::string& query_seq = rec->querySequence;
+
+    skch::CommonFunc::makeUpperCaseAndValidDNA(ref_seq.data(), ref_seq.length());
+    if (!rec->queryReversed) {
+        skch::CommonFunc::makeUpperCaseAndValidDNA(query_seq.data(), query_seq.length());
+    }
+
+    // Adjust the reference sequence to start from the original start position
+    char* ref_seq_ptr = &ref_seq[rec->currentRecord.rStartPos - rec->refStartPos];
+
+    // The forward strand is aligned in place; both strings end in a NUL
+    char* queryRegionStrand = query_seq.data();
+    if (rec->currentRecord.strand != skch::strnd::FWD && !rec->queryReversed) {
+        strand_buffer.resize(query_seq.size());
+        skch::CommonFunc::reverseComplement(query_seq.data(), strand_buffer.data(), query_seq.size());
+        queryRegionStrand = strand_buffer.data();
+    }
+
+    if (param.stats_only) {
+        wflign::wavefront::do_biwfa_stats(
+            queryNames.name(rec->currentRecord.qId),
+            queryRegionStrand,
+            rec->queryTotalLength,
+            rec->queryStartPos,
+            rec->queryLen,
+            rec->currentRecord.strand != skch::strnd::FWD,
+            refNames.name(rec->currentRecord.refId),
+            ref_seq_ptr,
+            rec->refTotalLength,
+            rec->currentRecord.rStartPos,
+            rec->currentRecord.rEndPos - rec->currentRecord.rStartPos,
+            output,
+            param.min_identity,
+            rec->currentRecord.mashmap_estimated_identity,
+            param.mirror_alignments,
+            telemetry);
+        return;
+    }
+
+    // Set up penalties for biWFA
+    wflign_penalties_t wfa_penalties;
+    wfa_penalties.match = 0;
+    wfa_penalties.mismatch = param.wfa_patching_mismatch_score;
+    wfa_penalties.gap_opening1 = param.wfa_patching_gap_opening_score1;
+    wfa_penalties.gap_extension1 = param.wfa_patching_gap_extension_score1;
+    wfa_penalties.gap_opening2 = param.wfa_patching_gap_opening_score2;
+    wfa_penalties.gap_extension2 = param.wfa_patching_gap_extension_score2;
+
+    if (!rec->members.empty()) {
+        alignCluster(rec, output, queryRegionStrand, ref_seq_ptr, wfa_penalties, telemetry);
+        return;
+    }
+
+    wflign::wavefront::alignment_budget_t budget(param.alignment_timeout, param.alignment_memory_limit);
+    if (param.force_wflign) {
+        if (wflignAlign(rec, output, queryRegionStrand, ref_seq_ptr, param.wflambda_segment_length, budget)) {
+            if (telemetry) {
+                telemetry->method = "wflign";
+            }
+        } else {
+            writeFallback(rec, output, queryRegionStrand, ref_seq_ptr, budget, telemetry);
+        }
+        return;
+    }
+
+    // Do direct biWFA alignment
+    biwfaAlign(rec, output, queryRegionStrand, ref_seq_ptr, wfa_penalties, budget, telemetry);
+    if (budget.expired()) {
+        writeFallback(rec, output, queryRegionStrand, ref_seq_ptr, budget, telemetry);
+    }
+}
+
+/**
+ * @brief   align the query of a record, in the strand of its mapping, to its target by
+ *          biWFA under budget, writing its PAF or SAM lines to output
+ */
+void biwfaAlign(seq_record_t* rec, std::ostream& output, char* query, char* ref,
+                const wflign_penalties_t& penalties,
+                wflign::wavefront::alignment_budget_t& budget,
+                wflign::wavefront::biwfa_telemetry_t* telemetry) {
+    wflign::wavefront::do_biwfa_alignment(
+        queryNames.name(rec->currentRecord.qId),
+        query,
+        rec->queryTotalLength,
+        rec->queryStartPos,
+        rec->queryLen,
+        rec->currentRecord.strand != skch::strnd::FWD,
+        refNames.name(rec->currentRecord.refId),
+        ref,
+        rec->refTotalLength,
+        rec->currentRecord.rStartPos,
+        rec->currentRecord.rEndPos - rec->currentRecord.rStartPos,
+        output,
+        penalties,
+        param.emit_md_tag,
+        !param.sam_format,
+        param.no_seq_in_sam,
+        param.min_identity,
+        param.wflign_max_len_minor,
+        rec->currentRecord.mashmap_estimated_identity,
+        rec->currentRecord.chain_id,
+        rec->currentRecord.chain_length,
+        rec->currentRecord.chain_pos,
+        param.wfa_high_memory_budget,
+        param.parallel_alignment_min_length,
+        param.threads,
+        param.banded_alignment,
+        param.mirror_alignments,
+        &budget,
+        telemetry);
+}
+
+/**
+ * @brief   align the union of the mappings of a cluster once and write the line of each
+ *          mapping from the part of its CIGAR within the mapping's query span; if the
+ *          union does not align as one line, each mapping is aligned on its own
+ */
+void alignCluster(seq_record_t* rec, std::ostream& output, char* query, char* ref,
+                  const wflign_penalties_t& penalties,
+                  wflign::wavefront::biwfa_telemetry_t* telemetry) {
+    static thread_local std::string lines;
+    lines.clear();
+    {
+        StringAppendBuffer buffer(&lines);
+        std::ostream out(&buffer);
+        wflign::wavefront::alignment_budget_t budget(param.alignment_timeout, param.alignment_memory_limit);
+        biwfaAlign(rec, out, query, ref, penalties, budget, telemetry);
+        if (!budget.expired() && writeClipped(rec, lines, output)) {
+            clusteredRecords.fetch_add(rec->members.size(), std::memory_order_relaxed);
+            clusters.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+
+    const MappingBoundaryRow whole = rec->currentRecord;
+    const uint64_t queryStart = rec->queryStartPos;
+    const uint64_t queryLen = rec->queryLen;
+    for (const MappingBoundaryRow& m : rec->members) {
+        rec->currentRecord = m;
+        rec->queryStartPos = m.qStartPos;
+        rec->queryLen = m.qEndPos - m.qStartPos;
+        // The reverse strand query holds the reverse complement of the union
+        char* member_query = query + (m.strand == skch::strnd::FWD ? m.qStartPos - queryStart
+                                                                   : queryStart + queryLen - m.qEndPos);
+        char* member_ref = ref + (m.rStartPos - whole.rStartPos);
+        wflign::wavefront::alignment_budget_t budget(param.alignment_timeout, param.alignment_memory_limit);
+        biwfaAlign(rec, output, member_query, member_ref, penalties, budget, telemetry);
+        if (budget.expired()) {
+            writeFallback(rec, output, member_query, member_ref, budget, telemetry);
+        }
+    }
+    rec->currentRecord = whole;
+    rec->queryStartPos = queryStart;
+    rec->queryLen = queryLen;
+}
+
+/**
+ * @brief   write the PAF line of each member of rec clipped from lines, the single PAF
+ *          line of the alignment of their union; false if lines is not one with a CIGAR.
+ *          Under param.mirror_alignments the line may be followed by its mirror, and the
+ *          members are written with theirs by writeMirrored
+ */
+bool writeClipped(const seq_record_t* rec, std::string_view lines, std::ostream& output) {
+    if (param.mirror_alignments && lines.find('\n') + 1 < lines.size()) {
+        lines = lines.substr(0, lines.find('\n') + 1);
+    }
+    if (lines.empty() || lines.find('\n') != lines.size() - 1) {
+        return false;
+    }
+    std::array<std::string_view, 9> fields;
+    std::string_view cigar;
+    size_t field = 0;
+    for (size_t begin = 0; begin < lines.size() - 1; ++field) {
+        const size_t end = std::min(lines.find('\t', begin), lines.size() - 1);
+        const std::string_view value = lines.substr(begin, end - begin);
+        if (field < fields.size()) {
+            fields[field] = value;
+        } else if (value.substr(0, 5) == "cg:Z:") {
+            cigar = value.substr(5);
+        }
+        begin = end + 1;
+    }
+    int64_t queryStart = 0, queryEnd = 0, refStart = 0;
+    const auto number = [](std::string_view s, int64_t& value) {
+        return std::from_chars(s.data(), s.data() + s.size(), value).ec == std::errc();
+    };
+    if (field < fields.size() || cigar.empty() || !number(fields[2], queryStart)
+        || !number(fields[3], queryEnd) || !number(fields[7], refStart)) {
+        return false;
+    }
+
+    const bool reverse = rec->currentRecord.strand != skch::strnd::FWD;
+    const std::string& queryName = queryNames.name(rec->currentRecord.qId);
+    const std::string& refName = refNames.name(rec->currentRecord.refId);
+    alignment_t aln;
+    aln.ok = true;
+    aln.i = 0;
+    aln.j = 0;
+    aln.is_rev = false;
+    std::string clipped;
+    static thread_local std::string memberLines;
+    memberLines.clear();
+    StringAppendBuffer buffer(&memberLines);
+    std::ostream gathered(&buffer);
+    std::ostream& out = param.mirror_alignments ? gathered : output;
+    for (const MappingBoundaryRow& m : rec->members) {
+        // Query positions along the CIGAR: forward ones, or on the reverse strand from queryEnd down
+        const int64_t lo = reverse ? queryEnd - (int64_t)m.qEndPos : m.qStartPos;
+        const int64_t hi = reverse ? queryEnd - (int64_t)m.qStartPos : m.qEndPos;
+        int64_t q = reverse ? 0 : queryStart;
+        int64_t t = refStart;
+        int64_t clipStart = -1, clipEnd = -1, clipRef = 0, refEnd = 0;
+        clipped.clear();
+        for (size_t i = 0; i < cigar.size() && q < hi;) {
+            int64_t length = 0;
+            while (i < cigar.size() && std::isdigit((unsigned char)cigar[i])) {
+                length = length * 10 + (cigar[i++] - '0');
+            }
+            if (i == cigar.size()) {
+                break;
+            }
+            const char op = cigar[i++];
+            if (op == 'D') {
+                if (clipStart >= 0 && q > lo) {
+                    clipped += std::to_string(length);
+                    clipped += op;
+                    refEnd = t + length;
+                }
+                t += length;
+                continue;
+            }
+            const bool consumesRef = op != 'I';
+            const int64_t from = std::max(q, lo);
+            const int64_t to = std::min(q + length, hi);
+            if (from < to) {
+                if (clipStart < 0) {
+                    clipStart = from;
+                    clipRef = t + (consumesRef ? from - q : 0);
+                }
+                clipEnd = to;
+                clipped += std::to_string(to - from);
+                clipped += op;
+                refEnd = consumesRef ? t + (to - q) : t;
+            }
+            q += length;
+            if (consumesRef) {
+                t += length;
+            }
+        }
+        if (clipStart < 0) {
+            continue;
+        }
+        const uint64_t queryOffset = reverse ? queryEnd - clipEnd : clipStart;
+        wflign::wavefront::write_alignment_paf(
+            out, aln, clipped, queryName, rec->queryTotalLength, queryOffset, clipEnd - clipStart, reverse,
+            refName, rec->refTotalLength, clipRef, refEnd - clipRef, param.min_identity, m.mashmap_estimated_identity);
+    }
+    if (param.mirror_alignments) {
+        writeMirrored(memberLines, output);
+    }
+    return true;
+}
+
+/**
+ * @brief   the alignment shared by the records aligning the same sequences at the same
+ *          coordinates as rec, null unless its query has the length of another
+ * @param[out] first    true if rec is the first such record, which aligns it and
+ *                      publishes its lines with publishSharedAlignment
+ */
+std::shared_ptr<shared_alignment_t> sharedAlignment(const seq_record_t* rec, bool& first) {
+    first = false;
+    if (repeatedQueryLength.empty() || !repeatedQueryLength[rec->currentRecord.qId]) {
+        return nullptr;
+    }
+    alignment_key_t key;
+    MurmurHash3_x64_128(rec->querySequence.data(), rec->querySequence.size(), 0, key.query_hash);
+    MurmurHash3_x64_128(rec->refSequence.data(), rec->refSequence.size(), 0, key.ref_hash);
+    key.query_start = rec->queryStartPos;
+    key.query_len = rec->queryLen;
+    key.query_total = rec->queryTotalLength;
+    key.ref_fetched = rec->refStartPos;
+    key.ref_start = rec->currentRecord.rStartPos;
+    key.ref_end = rec->currentRecord.rEndPos;
+    key.ref_total = rec->refTotalLength;
+    key.strand = rec->currentRecord.strand;
+    key.identity = rec->currentRecord.mashmap_estimated_identity;
+
+    std::lock_guard<std::mutex> lock(sharedMutex);
+    auto& shared = sharedAlignments[key];
+    if (!shared) {
+        shared = std::make_shared<shared_alignment_t>();
+        shared->query_name = queryNames.name(rec->currentRecord.qId);
+        shared->ref_name = refNames.name(rec->currentRecord.refId);
+        first = true;
+    }
+    return shared;
+}
+
+void publishSharedAlignment(shared_alignment_t& shared, std::string_view lines) {
+    {
+        std::lock_guard<std::mutex> lock(sharedMutex);
+        shared.lines.assign(lines.data(), lines.size());
+        shared.done = true;
+    }
+    sharedReady.notify_all();
+}
+
+/**
+ * @brief   write the lines of a shared alignment for rec, once its first record has
+ *          aligned it: the query and target fields name those of rec, in lines where
+ *          they are swapped as well
+ */
+void writeSharedAlignment(shared_alignment_t& shared, const seq_record_t* rec, std::ostream& output) {
+    {
+        std::unique_lock<std::mutex> lock(sharedMutex);
+        sharedReady.wait(lock, [&]() { return shared.done; });
+    }
+    const std::string& queryName = queryNames.name(rec->currentRecord.qId);
+    const std::string& refName = refNames.name(rec->currentRecord.refId);
+    const int targetField = param.sam_format ? 2 : 5;
+    forEachLine(shared.lines, [&](std::string_view line) {
+        int field = 0;
+        for (size_t pos = 0; pos <= line.size(); ++field) {
+            size_t end = line.find('\t', pos);
+            if (end == std::string_view::npos) {
+                end = line.size();
+            }
+            const std::string_view text = line.substr(pos, end - pos);
+            if (field > 0) {
+                output << '\t';
+            }
+            if ((field == 0 || field == targetField) && text == shared.query_name) {
+                output << queryName;
+            } else if ((field == 0 || field == targetField) && text == shared.ref_name) {
+                output << refName;
+            } else {
+                output << text;
+            }
+            pos = end + 1;
+        }
+        output << '\n';
+    });
+}
+
+/**
+ * @brief   append the telemetry line of an aligned record to a worker's block
+ */
+void appendTelemetry(std::string& block, const seq_record_t* rec, const wflign::wavefront::biwfa_telemetry_t& telemetry,
+                     const double seconds, const uint64_t tid) const {
+    const MappingBoundaryRow& row = rec->currentRecord;
+    std::ostringstream line;
+    line << queryNames.name(row.qId) << '\t' << row.qStartPos << '\t' << row.qEndPos
+         << '\t' << (row.strand == skch::strnd::FWD ? '+' : '-')
+         << '\t' << refNames.name(row.refId) << '\t' << row.rStartPos << '\t' << row.rEndPos
+         << '\t' << telemetry.method << '\t' << rec->queryLen << '\t' << row.rEndPos - row.rStartPos
+         << '\t' << telemetry.pieces << '\t' << telemetry.score
+         << '\t' << telemetry.predicted_wavefront_bytes << '\t' << telemetry.wavefront_bytes
+         << '\t' << seconds << '\t' << tid << '\n';
+    block += line.str();
+}
 
-    skch::CommonFunc::makeUpperCaseAndValidDNA(ref_seq.data(), ref_seq.length());
-    skch::CommonFunc::makeUpperCaseAndValidDNA(query_seq.data(), query_seq.length());
+/**
+ * @brief   append the seconds and method of aligning a record, as the at:f: and am:Z:
+ *          tags, to each line it wrote to text from start
+ */
+static void appendCostTags(std::string& text, const size_t start, const double seconds, const char* method) {
+    std::ostringstream tags;
+    tags << "\tat:f:" << seconds << "\tam:Z:" << method;
+    std::string tagged;
+    forEachLine(std::string_view(text).substr(start), [&](std::string_view line) {
+        tagged.append(line);
+        tagged += tags.str();
+        tagged += '\n';
+    });
+    text.replace(start, std::string::npos, tagged);
+}
 
-    // Adjust the reference sequence to start from the original start position
-    char* ref_seq_ptr = &ref_seq[rec->currentRecord.rStartPos - rec->refStartPos];
+/**
+ * @brief   write a worker's block of telemetry lines and empty it
+ */
+void flushTelemetry(std::string& block) {
+    if (block.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(telemetryMutex);
+    telemetryOut.write(block.data(), block.size());
+    block.clear();
+}
 
-    std::vector<char> queryRegionStrand(query_seq.size() + 1);
+/**
+ * @brief   call fn on each non-empty line of a block
+ */
+template <typename Fn>
+static void forEachLine(std::string_view text, Fn&& fn) {
+    for (size_t pos = 0; pos < text.size();) {
+        size_t end = text.find('\n', pos);
+        if (end == std::string_view::npos) {
+            end = text.size();
+        }
+        if (end > pos) {
+            fn(text.substr(pos, end - pos));
+        }
+        pos = end + 1;
+    }
+}
 
-    if(rec->currentRecord.strand == skch::strnd::FWD) {
-        std::copy(query_seq.begin(), query_seq.end(), queryRegionStrand.begin());
-    } else {
-        skch::CommonFunc::reverseComplement(query_seq.data(), queryRegionStrand.data(), query_seq.size());
+/**
+ * @brief   query bases of a mapping line, from its query start and end fields alone, for
+ *          the progress total; 0 for a line too short to have them
+ */
+static uint64_t mappingQueryLength(std::string_view line) {
+    uint64_t fields[4] = {0, 0, 0, 0};
+    size_t pos = 0;
+    for (int field = 0; field < 4; ++field) {
+        pos = line.find_first_not_of(" \t", pos);
+        if (pos == std::string_view::npos) {
+            return 0;
+        }
+        size_t end = line.find_first_of(" \t", pos);
+        if (end == std::string_view::npos) {
+            end = line.size();
+        }
+        std::from_chars(line.data() + pos, line.data() + end, fields[field]);
+        pos = end;
     }
+    return fields[3] > fields[2] ? fields[3] - fields[2] : 0;
+}
 
-    // Set up penalties for biWFA
-    wflign_penalties_t wfa_penalties;
-    wfa_penalties.match = 0;
-    wfa_penalties.mismatch = param.wfa_patching_mismatch_score;
-    wfa_penalties.gap_opening1 = param.wfa_patching_gap_opening_score1;
-    wfa_penalties.gap_extension1 = param.wfa_patching_gap_extension_score1;
-    wfa_penalties.gap_opening2 = param.wfa_patching_gap_opening_score2;
-    wfa_penalties.gap_extension2 = param.wfa_patching_gap_extension_score2;
+/**
+ * @brief   cost of aligning a mapping, its length times the score its estimated
+ *          divergence predicts; WFA's time grows with both
+ */
+static double estimatedAlignmentCost(const MappingBoundaryRow& row) {
+    const double identity = std::max(0.0, std::min(1.0, (double)row.mashmap_estimated_identity));
+    const double length = std::max(row.qEndPos - row.qStartPos, row.rEndPos - row.rStartPos);
+    return length * (length * (1.0 - identity) + 1);
+}
 
-    std::stringstream output;
+// What the records are reordered by before they are aligned
+struct job_key_t {
+    double cost;
+    uint32_t refId;
+    uint64_t rStart;
+};
 
-    // Do direct biWFA alignment
-    wflign::wavefront::do_biwfa_alignment(
-        rec->currentRecord.qId,
-        queryRegionStrand.data(),
-        rec->queryTotalLength,
-        rec->queryStartPos,
-        rec->queryLen,
-        rec->currentRecord.strand != skch::strnd::FWD,
-        rec->currentRecord.refId,
-        ref_seq_ptr,
-        rec->refTotalLength,
-        rec->currentRecord.rStartPos,
-        rec->currentRecord.rEndPos - rec->currentRecord.rStartPos,
-        output,
-        wfa_penalties,
-        param.emit_md_tag,
-        !param.sam_format,
-        param.no_seq_in_sam,
-        param.min_identity,
-        param.wflign_max_len_minor,
-        rec->currentRecord.mashmap_estimated_identity,
-        rec->currentRecord.chain_id,
-        rec->currentRecord.chain_length,
-        rec->currentRecord.chain_pos);
+static job_key_t jobKey(const MappingBoundaryRow& row) {
+    return {estimatedAlignmentCost(row), row.refId, uint64_t(row.rStartPos)};
+}
 
-    return output.str();
+// Whether the records are all read and reordered before they are aligned
+bool reorderedJobs() const {
+    return param.longest_first || param.target_order;
 }
 
-void single_reader_thread(const std::string& input_file,
-                          atomic_queue::AtomicQueue<std::string*, 1024>& line_queue,
-                          std::atomic<bool>& reader_done) {
-    std::ifstream mappingListStream(input_file);
-    if (!mappingListStream.is_open()) {
-        throw std::runtime_error("[wfmash::align] Error! Failed to open input mapping file: " + input_file);
+/**
+ * @brief   the order to align the records in: costliest first with param.longest_first;
+ *          by target and position with param.target_order, so the records of a batch
+ *          fetch the blocks of the same region, the costliest windows of targetOrderWindow
+ *          bases first when both
+ */
+std::vector<uint64_t> jobOrder(const std::vector<job_key_t>& keys) const {
+    std::vector<uint64_t> order(keys.size());
+    for (uint64_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    const auto window = [&](uint64_t i) { return std::make_pair(keys[i].refId, keys[i].rStart / targetOrderWindow); };
+    if (!param.target_order) {
+        std::stable_sort(order.begin(), order.end(), [&](uint64_t a, uint64_t b) { return keys[a].cost > keys[b].cost; });
+    } else if (!param.longest_first) {
+        std::stable_sort(order.begin(), order.end(), [&](uint64_t a, uint64_t b) {
+            return std::tie(keys[a].refId, keys[a].rStart) < std::tie(keys[b].refId, keys[b].rStart);
+        });
+    } else {
+        std::map<std::pair<uint32_t, uint64_t>, double> windowCost;
+        for (uint64_t i = 0; i < keys.size(); ++i) {
+            windowCost[window(i)] += keys[i].cost;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](uint64_t a, uint64_t b) {
+            const double costA = windowCost[window(a)];
+            const double costB = windowCost[window(b)];
+            if (costA != costB) {
+                return costA > costB;
+            }
+            return std::tie(keys[a].refId, keys[a].rStart) < std::tie(keys[b].refId, keys[b].rStart);
+        });
     }
+    return order;
+}
 
+/**
+ * @brief   read the whole mapping list and queue its lines in jobOrder, so the long
+ *          alignments do not run alone at the end or neighbouring ones run together;
+ *          each line keeps its PAF order for the writer to restore
+ */
+void reordering_reader_thread(std::istream& mappingListStream,
+                              line_atomic_queue_t& line_queue,
+                              std::atomic<bool>& reader_done,
+                              InputProgress& input) {
+    // Tiled chains are queued as their rows, the tiling done in file order
+    std::vector<std::string> lines;
+    std::vector<MappingBoundaryRow> rows;
+    std::vector<job_key_t> keys;
+    chain_tiler_t tiler;
     std::string line;
+    MappingBoundaryRow row;
     while (std::getline(mappingListStream, line)) {
         if (!line.empty()) {
-            std::string* line_ptr = new std::string(std::move(line));
-            line_queue.push(line_ptr);
+            parseMashmapRow(line, row, param.target_padding, queryNames, refNames);
+            if (param.chain_alignment) {
+                tiler.tile(row);
+            }
+            keys.push_back(jobKey(row));
+            input.read(line.size() + 1, row.qEndPos - row.qStartPos);
+            if (param.chain_alignment) {
+                rows.push_back(row);
+            } else {
+                lines.push_back(std::move(line));
+            }
         }
     }
-
-    mappingListStream.close();
-    reader_done.store(true);
-}
-
-void processor_thread(std::atomic<size_t>& total_alignments_queued,
-                      std::atomic<bool>& reader_done,
-                      atomic_queue::AtomicQueue<std::string*, 1024>& line_queue,
-                      seq_atomic_queue_t& seq_queue,
-                      std::atomic<bool>& thread_should_exit) {
-    faidx_t* local_ref_faidx = fai_load(param.refSequences.front().c_str());
-    faidx_t* local_query_faidx = fai_load(param.querySequences.front().c_str());
-
-    while (!thread_should_exit.load()) {
-        std::string* line_ptr = nullptr;
-        if (line_queue.try_pop(line_ptr)) {
-            MappingBoundaryRow currentRecord;
-            parseMashmapRow(*line_ptr, currentRecord, param.target_padding);
-            
-            // Process the record and create seq_record_t
-            seq_record_t* rec = createSeqRecord(currentRecord, *line_ptr, local_ref_faidx, local_query_faidx);
-
-            while (!seq_queue.try_push(rec)) {
-                if (thread_should_exit.load()) {
-                    delete rec;
-                    delete line_ptr;
-                    goto cleanup;
-                }
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
-            }
-
-            ++total_alignments_queued;
-            delete line_ptr;
-        } else if (reader_done.load() && line_queue.was_empty()) {
-            break;
+    mapping_batch_t* batch = new mapping_batch_t();
+    for (const uint64_t job : jobOrder(keys)) {
+        if (param.chain_alignment) {
+            batch->rows.push_back(rows[job]);
         } else {
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            batch->lines.append(lines[job]).push_back('\n');
+            std::string().swap(lines[job]);
+        }
+        batch->order.push_back(job);
+        if (batch->lines.size() >= lineBatchBytes || batch->rows.size() >= rowBatchSize) {
+            readAhead(*batch);
+            line_queue.push(batch);
+            batch = new mapping_batch_t();
         }
     }
+    if (!batch->lines.empty() || !batch->rows.empty()) {
+        readAhead(*batch);
+        line_queue.push(batch);
+    } else {
+        delete batch;
+    }
+    input.done();
+    reader_done.store(true);
+}
 
-cleanup:
-    fai_destroy(local_ref_faidx);
-    fai_destroy(local_query_faidx);
+/**
+ * @brief   read a binary mapping file, its rows queued by row_reader_thread
+ */
+void binary_reader_thread(std::istream& mappingListStream,
+                          line_atomic_queue_t& line_queue,
+                          std::atomic<bool>& reader_done,
+                          InputProgress& input) {
+    const BinaryMappingIds ids = readBinaryMappingIds(mappingListStream, queryNames, refNames);
+    row_reader_thread(mappingListStream, [&](auto&& fn) { forEachBinaryMapping(mappingListStream, ids, fn); },
+                      line_queue, reader_done, input);
+}
+
+/**
+ * @brief   read a pair list, its pairs queued as rows by row_reader_thread
+ */
+void pair_reader_thread(std::istream& mappingListStream,
+                        line_atomic_queue_t& line_queue,
+                        std::atomic<bool>& reader_done,
+                        InputProgress& input) {
+    row_reader_thread(mappingListStream, [&](auto&& fn) { forEachPair(mappingListStream, fn); },
+                      line_queue, reader_done, input);
 }
 
-void processor_manager(seq_atomic_queue_t& seq_queue,
-                       atomic_queue::AtomicQueue<std::string*, 1024>& line_queue,
-                       std::atomic<size_t>& total_alignments_queued,
+/**
+ * @brief   queue the rows forEachRow reads from the stream in batches in file order, or all
+ *          of them in jobOrder with their file order when reordered; the chains are tiled
+ *          with param.chain_alignment
+ */
+template <typename ForEachRow>
+void row_reader_thread(std::istream& mappingListStream,
+                       ForEachRow&& forEachRow,
+                       line_atomic_queue_t& line_queue,
                        std::atomic<bool>& reader_done,
-                       std::atomic<bool>& processor_done,
-                       size_t max_processors) {
-    std::vector<std::thread> processor_threads;
-    std::vector<std::atomic<bool>> thread_should_exit(max_processors);
-
-    const size_t queue_capacity = seq_queue.capacity();
-    const size_t low_threshold = 1;
-    const size_t high_threshold = queue_capacity * 0.8;
-
-    auto spawn_processor = [&](size_t id) {
-        thread_should_exit[id].store(false);
-        processor_threads.emplace_back([this, &total_alignments_queued, &reader_done, &line_queue, &seq_queue, &thread_should_exit, id]() {
-            this->processor_thread(total_alignments_queued, reader_done, line_queue, seq_queue, thread_should_exit[id]);
-        });
+                       InputProgress& input) {
+    mapping_batch_t* batch = new mapping_batch_t();
+    chain_tiler_t tiler;
+    // The bytes read are only looked up once a batch of rows is, and only when they count
+    uint64_t position = 0;
+    uint64_t length = 0;
+    auto tiled = [&](MappingBoundaryRow row) {
+        if (param.chain_alignment) {
+            tiler.tile(row);
+        }
+        length += row.qEndPos - row.qStartPos;
+        return row;
     };
-
-    // Start with one processor
-    spawn_processor(0);
-    size_t current_processors = 1;
-    uint64_t exhausted = 0;
-
-    while (!reader_done.load() || !line_queue.was_empty() || !seq_queue.was_empty()) {
-        size_t queue_size = seq_queue.was_size();
-
-        if (param.multithread_fasta_input) {
-            if (queue_size < low_threshold && current_processors < max_processors) {
-                ++exhausted;
-            } else if (queue_size > high_threshold && current_processors > 1) {
-                thread_should_exit[--current_processors].store(true);
+    auto account = [&]() {
+        uint64_t bytes = 0;
+        if (input.input_bytes > 0) {
+            const std::streamoff at = mappingListStream.tellg();
+            if (at >= 0) {
+                bytes = at - position;
+                position = at;
+            }
+        }
+        input.read(bytes, length);
+        length = 0;
+    };
+    if (reorderedJobs()) {
+        std::vector<MappingBoundaryRow> rows;
+        std::vector<job_key_t> keys;
+        forEachRow([&](const MappingBoundaryRow& row) {
+            rows.push_back(tiled(row));
+            keys.push_back(jobKey(rows.back()));
+            if (rows.size() % rowBatchSize == 0) {
+                account();
             }
+        });
+        for (const uint64_t job : jobOrder(keys)) {
+            batch->rows.push_back(rows[job]);
+            batch->order.push_back(job);
+            if (batch->rows.size() >= rowBatchSize) {
+                readAhead(*batch);
+                line_queue.push(batch);
+                batch = new mapping_batch_t();
+            }
+        }
+    } else {
+        uint64_t order = 0;
+        forEachRow([&](const MappingBoundaryRow& row) {
+            batch->rows.push_back(tiled(row));
+            if (orderedOutput()) {
+                batch->order.push_back(order++);
+            }
+            if (batch->rows.size() >= rowBatchSize) {
+                account();
+                readAhead(*batch);
+                line_queue.push(batch);
+                batch = new mapping_batch_t();
+            }
+        });
+    }
+    if (!batch->rows.empty()) {
+        readAhead(*batch);
+        line_queue.push(batch);
+    } else {
+        delete batch;
+    }
+    input.done();
+    reader_done.store(true);
+}
 
-            if (exhausted > 20 && queue_size < low_threshold) {
-                spawn_processor(current_processors++);
-                exhausted = 0;
+/**
+ * @brief   read the mapping list in blocks of whole lines, each queued as one batch, as
+ *          its rows with their chains tiled when param.chain_alignment
+ */
+void single_reader_thread(std::istream& mappingListStream,
+                          line_atomic_queue_t& line_queue,
+                          std::atomic<bool>& reader_done,
+                          InputProgress& input) {
+    chain_tiler_t tiler;
+    uint64_t order = 0;
+    auto queue_batch = [&](mapping_batch_t* batch) {
+        if (orderedOutput()) {
+            forEachLine(batch->lines, [&](std::string_view) { batch->order.push_back(order++); });
+        }
+        uint64_t length = 0;
+        if (param.chain_alignment) {
+            MappingBoundaryRow row;
+            forEachLine(batch->lines, [&](std::string_view line) {
+                parseMashmapRow(line, row, param.target_padding, queryNames, refNames);
+                tiler.tile(row);
+                batch->rows.push_back(row);
+                length += row.qEndPos - row.qStartPos;
+            });
+            input.read(batch->lines.size(), length);
+            std::string().swap(batch->lines);
+        } else {
+            if (input.progress) {
+                forEachLine(batch->lines, [&](std::string_view line) { length += mappingQueryLength(line); });
             }
+            input.read(batch->lines.size(), length);
         }
+        readAhead(*batch);
+        line_queue.push(batch);
+    };
 
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    // The partial line at the end of a block starts the next one
+    std::string carry;
+    std::vector<char> block(lineBatchBytes);
+    while (mappingListStream) {
+        mappingListStream.read(block.data(), block.size());
+        const size_t got = mappingListStream.gcount();
+        if (got == 0) {
+            break;
+        }
+        const std::string_view text(block.data(), got);
+        const size_t lastNewline = text.rfind('\n');
+        if (lastNewline == std::string_view::npos) {
+            carry.append(text);
+            continue;
+        }
+        mapping_batch_t* batch = new mapping_batch_t();
+        batch->lines.reserve(carry.size() + lastNewline + 1);
+        batch->lines.append(carry).append(text.substr(0, lastNewline + 1));
+        carry.assign(text.substr(lastNewline + 1));
+        queue_batch(batch);
     }
-
-    // Signal all remaining threads to exit
-    for (size_t i = 0; i < current_processors; ++i) {
-        thread_should_exit[i].store(true);
+    if (!carry.empty()) {
+        mapping_batch_t* batch = new mapping_batch_t();
+        batch->lines = std::move(carry);
+        queue_batch(batch);
     }
 
-    // Wait for all processor threads to finish
-    for (auto& thread : processor_threads) {
-        thread.join();
-    }
-    processor_done.store(true);
+    input.done();
+    reader_done.store(true);
 }
 
-void worker_thread(uint64_t tid,
-                   std::atomic<bool>& is_working,
-                   seq_atomic_queue_t& seq_queue,
-                   paf_atomic_queue_t& paf_queue,
-                   std::atomic<bool>& reader_done,
-                   std::atomic<bool>& processor_done,
-                   progress_meter::ProgressMeter& progress,
-                   std::atomic<uint64_t>& processed_alignment_length) {
-    is_working.store(true);
-    while (true) {
-        seq_record_t* rec = nullptr;
-        if (seq_queue.try_pop(rec)) {
-            is_working.store(true);
-            std::string alignment_output = processAlignment(rec);
-
-            // Parse the alignment output to find CIGAR string and coordinates
-            std::stringstream ss(alignment_output);
-            std::string line;
-            while (std::getline(ss, line)) {
-                if (line.empty()) continue;
-                
-                std::vector<std::string> fields;
-                std::stringstream field_ss(line);
-                std::string field;
-                while (field_ss >> field) {
-                    fields.push_back(field);
-                }
-
-                // Find the CIGAR string field (should be after cg:Z:)
-                auto cigar_it = std::find_if(fields.begin(), fields.end(),
-                    [](const std::string& s) { return s.substr(0, 5) == "cg:Z:"; });
-                
-                if (cigar_it != fields.end()) {
-                    std::string cigar = cigar_it->substr(5); // Remove cg:Z: prefix
-                    uint64_t ref_start = std::stoull(fields[7]);
-                    uint64_t ref_end = std::stoull(fields[8]);
+/**
+ * @brief   one of the param.threads threads of the align pool, which both fetch the
+ *          sequences of the mapping records read and align them, started once for the run.
+ *          Records are aligned while enough are queued to keep every thread busy; short of
+ *          that a thread fetches a batch of them, if a fetcher is free, aligning one itself
+ *          whenever the record queue is full, so no thread blocks on another
+ */
+void pool_thread(uint64_t tid,
+                 AlignPool& pool,
+                 progress_meter::ProgressMeter& progress,
+                 std::atomic<uint64_t>& processed_alignment_length,
+                 std::atomic<size_t>& total_alignments_queued,
+                 AlignStatus& status) {
+    // Records are formatted into a block of output, queued once it is full or the
+    // thread runs out of records; when the writer restores the PAF order, each record
+    // is a block of its own, if empty
+    alignment_output_t* block = new alignment_output_t();
+    StringAppendBuffer buffer(&block->text);
+    std::ostream output(&buffer);
+    std::string strand_buffer;
+    std::string telemetry_block;
+    kstring_t sam_line = KS_INITIALIZE;
+    // Under onAlignment the records go to the block as fields
+    std::vector<wflign::wavefront::paf_record_t>*& sink = wflign::wavefront::paf_record_t::sink_for_this_thread();
+    sink = onAlignment ? &block->alignments : nullptr;
+    auto queue_block = [&](bool always) {
+        if (always || !block->text.empty() || !block->alignments.empty()) {
+            if (bam_header) {
+                forEachLine(block->text, [&](std::string_view line) {
+                    sam_line.l = 0;
+                    kputsn(line.data(), line.size(), &sam_line);
+                    bam1_t* b = bam_init1();
+                    block->records.push_back(b);
+                    if (sam_parse1(&sam_line, bam_header, b) < 0) {
+                        throw std::runtime_error("[wfmash::align] Error! Failed to convert an alignment of "
+                                                 + std::string(line.substr(0, line.find('\t'))) + " to BAM");
+                    }
+                });
+                block->text.clear();
+            }
+            pool.paf_queue.push(block);
+            block = new alignment_output_t();
+            buffer.reset(&block->text);
+            if (sink) {
+                sink = &block->alignments;
+            }
+        }
+    };
 
+    auto align_record = [&](seq_record_t* rec) {
+        block->order = rec->order;
+        status.begin(tid, rec->currentRecord.qEndPos - rec->currentRecord.qStartPos);
+        bool first = false;
+        const auto shared = sharedAlignment(rec, first);
+        const size_t lines_start = block->text.size();
+        wflign::wavefront::biwfa_telemetry_t telemetry;
+        std::chrono::duration<double> seconds(0);
+        if (telemetryOut.is_open() || param.cost_tags) {
+            const auto start = std::chrono::steady_clock::now();
+            if (shared && !first) {
+                writeSharedAlignment(*shared, rec, output);
+                telemetry.method = "shared";
+            } else {
+                processAlignment(rec, output, strand_buffer, &telemetry);
+            }
+            seconds = std::chrono::steady_clock::now() - start;
+            if (telemetryOut.is_open()) {
+                appendTelemetry(telemetry_block, rec, telemetry, seconds.count(), tid);
+                if (telemetry_block.size() >= telemetryBatchBytes) {
+                    flushTelemetry(telemetry_block);
+                }
+            }
+        } else if (shared && !first) {
+            writeSharedAlignment(*shared, rec, output);
+        } else {
+            processAlignment(rec, output, strand_buffer);
+        }
+        if (first) {
+            publishSharedAlignment(*shared, std::string_view(block->text).substr(lines_start));
+        }
+        if (param.cost_tags) {
+            appendCostTags(block->text, lines_start, seconds.count(), telemetry.method);
+        }
+        status.end(tid);
+
+        // Update progress meter and processed alignment length, by the mappings of a cluster
+        uint64_t alignment_length = rec->currentRecord.qEndPos - rec->currentRecord.qStartPos;
+        if (!rec->members.empty()) {
+            alignment_length = 0;
+            for (const MappingBoundaryRow& m : rec->members) {
+                alignment_length += m.qEndPos - m.qStartPos;
+            }
+        }
+        progress.increment(alignment_length);
+        processed_alignment_length.fetch_add(alignment_length, std::memory_order_relaxed);
 
-                    // Just pass through the CIGAR string and coordinates unchanged
-                    // The trimming is now handled in wflign namespace
+        releaseRecord(rec);
+        if (orderedOutput() || block->text.size() >= outputBatchBytes || pool.seq_queue.was_empty()) {
+            queue_block(orderedOutput());
+        }
+    };
 
-                    // Reconstruct the line
-                    std::string new_line;
-                    for (const auto& f : fields) {
-                        if (!new_line.empty()) new_line += '\t';
-                        new_line += f;
-                    }
-                    new_line += '\n';
-                    
-                    // Push the modified alignment output to the paf_queue
-                    paf_queue.push(new std::string(std::move(new_line)));
-                } else {
-                    // If no CIGAR string found, output the line unchanged
-                    paf_queue.push(new std::string(line + '\n'));
+    // Fetch the records of a batch of mappings, false if no fetcher or batch was free
+    auto fetch_batch = [&]() {
+        std::unique_lock<std::mutex> held;
+        RecordFetcher* fetcher = nullptr;
+        for (auto& candidate : pool.fetchers) {
+            std::unique_lock<std::mutex> lock(candidate->busy, std::try_to_lock);
+            if (lock.owns_lock()) {
+                held = std::move(lock);
+                fetcher = candidate.get();
+                break;
+            }
+        }
+        if (!fetcher) {
+            return false;
+        }
+        // Counted before the pop, for the batches to be seen all fetched only once they are
+        pool.fetching.fetch_add(1);
+        mapping_batch_t* batch = nullptr;
+        if (!pool.line_queue.try_pop(batch)) {
+            pool.fetching.fetch_sub(1);
+            return false;
+        }
+        size_t line_index = 0;
+        const bool clustering = clusterOverlaps();
+        std::vector<MappingBoundaryRow> clustered;
+        auto queue_record = [&](const MappingBoundaryRow& currentRecord, uint64_t order,
+                                std::vector<MappingBoundaryRow>* members) {
+            seq_record_t* rec = createSeqRecord(currentRecord, fetcher->ref_handle.get(), fetcher->query_handle.get(),
+                                                fetcher->ref_cache, fetcher->query_cache);
+            rec->order = order;
+            rec->members.clear();
+            if (members) {
+                rec->members.swap(*members);
+            }
+            const size_t mappings = std::max<size_t>(1, rec->members.size());
+
+            // Over the queue budget, queued records are aligned until this one fits; it is
+            // queued regardless once none is left, the others being aligned already
+            while (!queue_budget::shared().try_acquire(recordBytes(rec))) {
+                seq_record_t* queued = nullptr;
+                if (!pool.seq_queue.try_pop(queued)) {
+                    queue_budget::shared().force_acquire(recordBytes(rec));
+                    break;
+                }
+                align_record(queued);
+            }
+            while (!pool.seq_queue.try_push(rec)) {
+                seq_record_t* queued = nullptr;
+                if (pool.seq_queue.try_pop(queued)) {
+                    align_record(queued);
+                }
+            }
+            total_alignments_queued += mappings;
+            pool.wake();
+        };
+        auto queue_row = [&](const MappingBoundaryRow& currentRecord) {
+            const uint64_t order = batch->order.empty() ? 0 : batch->order[line_index];
+            ++line_index;
+            if (!inShard.empty() && !inShard[order]) {
+                return;
+            }
+            if (!batch->order.empty() && order < resumeRecords) {
+                // aligned and written by the job resumed
+                const uint64_t alignment_length = currentRecord.qEndPos - currentRecord.qStartPos;
+                progress.increment(alignment_length);
+                processed_alignment_length.fetch_add(alignment_length, std::memory_order_relaxed);
+                return;
+            }
+            if (belowIdentityGate(currentRecord)) {
+                // Not fetched or aligned; in PAF order it leaves an empty block for its place
+                const uint64_t alignment_length = currentRecord.qEndPos - currentRecord.qStartPos;
+                progress.increment(alignment_length);
+                gatedRecords.fetch_add(1, std::memory_order_relaxed);
+                if (orderedOutput()) {
+                    block->order = order;
+                    queue_block(true);
                 }
+                return;
+            }
+            if (clustering) {
+                clustered.push_back(currentRecord);
+                return;
+            }
+            queue_record(currentRecord, order, nullptr);
+        };
+        if (!batch->rows.empty()) {
+            for (const auto& row : batch->rows) {
+                queue_row(row);
+            }
+        } else {
+            forEachLine(batch->lines, [&](std::string_view line) {
+                MappingBoundaryRow currentRecord;
+                parseMashmapRow(line, currentRecord, param.target_padding, queryNames, refNames);
+                queue_row(currentRecord);
+            });
+        }
+        if (clustering) {
+            std::vector<MappingBoundaryRow> unions;
+            std::vector<std::vector<MappingBoundaryRow>> members;
+            clusterMappings(clustered, unions, members);
+            for (size_t i = 0; i < unions.size(); ++i) {
+                queue_record(unions[i], 0, members[i].empty() ? nullptr : &members[i]);
             }
-            
-            // Update progress meter and processed alignment length
-            uint64_t alignment_length = rec->currentRecord.qEndPos - rec->currentRecord.qStartPos;
-            progress.increment(alignment_length);
-            processed_alignment_length.fetch_add(alignment_length, std::memory_order_relaxed);
-            
-            delete rec;
-        } else if (reader_done.load() && processor_done.load() && seq_queue.was_empty()) {
+        }
+        delete batch;
+        pool.fetching.fetch_sub(1);
+        return true;
+    };
+
+    const size_t healthy = std::max(1, param.threads);
+    while (true) {
+        pool.sample(status);
+        seq_record_t* rec = nullptr;
+        if (pool.seq_queue.was_size() < healthy && fetch_batch()) {
+            continue;
+        } else if (pool.seq_queue.try_pop(rec)) {
+            align_record(rec);
+        } else if (fetch_batch()) {
+            continue;
+        } else if (pool.fetched() && pool.seq_queue.was_empty()) {
             break;
         } else {
-            is_working.store(false);
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            queue_block(false);
+            pool.idle();
         }
     }
-    is_working.store(false);
+    flushTelemetry(telemetry_block);
+    queue_block(false);
+    sink = nullptr;
+    delete block;
+    ks_free(&sam_line);
 }
 
-void write_sam_header(std::ofstream& outstream) {
+void write_sam_header(std::ostream& outstream) {
     for(const auto &fileName : param.refSequences) {
         // check if there is a .fai
-        std::string fai_name = fileName + ".fai";
-        if (fs::exists(fai_name)) {
-            // if so, process the .fai to determine our sequence length
-            std::string line;
-            std::ifstream in(fai_name.c_str());
-            while (std::getline(in, line)) {
-                auto line_split = skch::CommonFunc::split(line, '\t');
-                const std::string seq_name = line_split[0];
-                const uint64_t seq_len = std::stoull(line_split[1]);
-                outstream << "@SQ\tSN:" << seq_name << "\tLN:" << seq_len << "\n";
+        if (const auto names = seqiter::fai_names_t::of(fileName)) {
+            // if so, take the sequence lengths from it, as read for the sequence ids
+            for (const auto& entry : names->entries()) {
+                outstream << "@SQ\tSN:" << entry.name << "\tLN:" << entry.length << "\n";
             }
         } else {
             // if not, warn that this is expensive
@@ -541,7 +2374,7 @@ void write_sam_header(std::ofstream& outstream) {
                 [&](const std::string& seq_name,
                     const std::string& seq) {
                     outstream << "@SQ\tSN:" << seq_name << "\tLN:" << seq.length() << "\n";
-                });
+                }, param.threads);
         }
     }
     outstream << "@PG\tID:wfmash\tPN:wfmash\tVN:" << WFMASH_GIT_VERSION << "\tCL:wfmash\n";
@@ -550,69 +2383,296 @@ void write_sam_header(std::ofstream& outstream) {
 void writer_thread(const std::string& output_file,
                    paf_atomic_queue_t& paf_queue,
                    std::atomic<bool>& reader_done,
-                   std::atomic<bool>& processor_done,
-                   const std::vector<std::atomic<bool>>& worker_working) {
-    std::ofstream outstream(output_file);
-    // if the output file is SAM, we write the header
-    if (param.sam_format) {
-        write_sam_header(outstream);
+                   std::atomic<bool>& processor_done) {
+    // BAM and CRAM are written through htslib, compressed on a thread pool of its own;
+    // text goes straight to the file, or through BGZF compressed on the threads
+    std::unique_ptr<std::ostream> outstream;
+    std::ostream* text_out = alignmentOut;
+    htsFile* hts_out = nullptr;
+    if (bam_header) {
+        hts_out = hts_open(output_file.c_str(), param.cram_format ? "wc" : "wb");
+        if (!hts_out) {
+            throw std::runtime_error("[wfmash::align] Error! Failed to open output file: " + output_file);
+        }
+        if (param.cram_format && hts_set_fai_filename(hts_out, param.refSequences.front().c_str()) < 0) {
+            throw std::runtime_error("[wfmash::align] Error! Failed to set the CRAM reference: " + param.refSequences.front());
+        }
+        hts_set_threads(hts_out, std::max(1, param.threads));
+        if (sam_hdr_write(hts_out, bam_header) < 0) {
+            throw std::runtime_error("[wfmash::align] Error! Failed to write the header of " + output_file);
+        }
+    } else if (!onAlignment) {
+        if (text_out) {
+            // written as is, whatever the output options
+        } else if (param.bgzip_output) {
+            auto bgzf_out = std::make_unique<wfmash::obgzfstream>(output_file, std::max(1, param.threads), param.bgzip_index_file);
+            if (!bgzf_out->is_open()) {
+                throw std::runtime_error("[wfmash::align] Error! Failed to open output file: " + output_file);
+            }
+            outstream = std::move(bgzf_out);
+        } else if (resumeOutput) {
+            // Cut back to what the records resumed after make up, the rest written again
+            std::error_code ec;
+            if (!std::filesystem::is_regular_file(output_file, ec) || std::filesystem::file_size(output_file, ec) < resumeBytes || ec) {
+                throw std::runtime_error("[wfmash::align] Error! --resume appends to the output of the interrupted job, "
+                                         + std::to_string(resumeBytes) + " bytes of which are missing from " + output_file
+                                         + "; redirect it with >> rather than >");
+            }
+            std::filesystem::resize_file(output_file, resumeBytes, ec);
+            auto file_out = std::make_unique<std::ofstream>(output_file, std::ios::app);
+            if (ec || !file_out->is_open()) {
+                throw std::runtime_error("[wfmash::align] Error! Failed to open output file: " + output_file);
+            }
+            outstream = std::move(file_out);
+        } else {
+            auto file_out = std::make_unique<std::ofstream>(output_file);
+            if (!file_out->is_open()) {
+                throw std::runtime_error("[wfmash::align] Error! Failed to open output file: " + output_file);
+            }
+            outstream = std::move(file_out);
+        }
+        if (!text_out) {
+            text_out = outstream.get();
+        }
+        // if the output file is SAM, we write the header
+        if (param.sam_format && !resumeOutput) {
+            write_sam_header(*text_out);
+        }
     }
-
-    if (!outstream.is_open()) {
-        throw std::runtime_error("[wfmash::align] Error! Failed to open output file: " + output_file);
+    std::ofstream shard_records;
+    if (!param.align_shard_records.empty()) {
+        shard_records.open(param.align_shard_records);
+        if (!shard_records) {
+            throw std::runtime_error("[wfmash::align] Error! Failed to open the shard records " + param.align_shard_records);
+        }
     }
+    // The records of the PAF are indexed as they are written, the index saved once it is closed
+    std::unique_ptr<interval_index::Writer> record_index(
+        param.interval_index_file.empty() || hts_out ? nullptr : new interval_index::Writer());
+    // Under param.sort_output, the lines are sorted and written once all are done
+    std::unique_ptr<sorted_output::Sorter> sorter(
+        !param.sort_output || hts_out ? nullptr
+        : new sorted_output::Sorter(param.sort_prefix, param.sort_memory, param.threads, param.sam_format,
+                                    [this](std::string_view name) -> uint64_t {
+                                        const uint32_t id = refNames.id(name);
+                                        return id == SequenceNames::missing ? std::numeric_limits<uint64_t>::max() : id;
+                                    }));
+    auto write_block = [&](alignment_output_t* block) {
+        if (onAlignment) {
+            for (auto& alignment : block->alignments) {
+                onAlignment(alignment);
+            }
+            delete block;
+            return;
+        }
+        if (shard_records.is_open() && !block->text.empty()) {
+            shard_records << block->order << "\t" << block->text.size() << "\n";
+        }
+        if (hts_out) {
+            for (const bam1_t* b : block->records) {
+                if (sam_write1(hts_out, bam_header, b) < 0) {
+                    throw std::runtime_error("[wfmash::align] Error! Failed to write to " + output_file);
+                }
+            }
+        } else if (sorter) {
+            sorter->add(block->text);
+        } else {
+            *text_out << block->text;
+            if (record_index) {
+                record_index->add(block->text);
+            }
+        }
+        delete block;
+    };
 
-    auto all_workers_done = [&]() {
-        return std::all_of(worker_working.begin(), worker_working.end(),
-                           [](const std::atomic<bool>& w) { return !w.load(); });
+    // Reorder buffer of the records done ahead of the next one in PAF order
+    std::map<uint64_t, alignment_output_t*> pending;
+    uint64_t next_order = resumeRecords;
+
+    // The records written and their bytes, renamed into place so never seen half written;
+    // only a regular output file can be cut back to them on resume
+    bool checkpointing = !param.checkpoint_file.empty() && !hts_out && !param.bgzip_output && !alignmentOut && !onAlignment;
+    if (checkpointing) {
+        std::error_code ec;
+        if (!std::filesystem::is_regular_file(output_file, ec)) {
+            std::cerr << "[wfmash::align] WARNING, the output is not a regular file, so the alignment cannot be resumed" << std::endl;
+            checkpointing = false;
+        }
+    }
+    auto saved = std::chrono::steady_clock::now();
+    auto save_checkpoint = [&]() {
+        text_out->flush();
+        std::error_code ec;
+        const uint64_t bytes = std::filesystem::file_size(output_file, ec);
+        if (!*text_out || ec) {
+            throw std::runtime_error("[wfmash::align] Error! Failed to write to " + output_file);
+        }
+        const std::string partial = param.checkpoint_file + ".tmp";
+        std::ofstream out(partial, std::ios::trunc);
+        out << next_order << "\t" << bytes << "\n";
+        out.close();
+        std::filesystem::rename(partial, param.checkpoint_file, ec);
+        if (!out || ec) {
+            throw std::runtime_error("[wfmash::align] Error! Failed to write the checkpoint " + param.checkpoint_file);
+        }
+        saved = std::chrono::steady_clock::now();
     };
 
     while (true) {
-        std::string* paf_output = nullptr;
+        alignment_output_t* paf_output = nullptr;
         if (paf_queue.try_pop(paf_output)) {
-            outstream << *paf_output;
-            outstream.flush();
-            delete paf_output;
-        } else if (reader_done.load() && processor_done.load() && paf_queue.was_empty() && all_workers_done()) {
+            if (!orderedOutput()) {
+                write_block(paf_output);
+                continue;
+            }
+            pending.emplace(paf_output->order, paf_output);
+            for (auto it = pending.begin(); it != pending.end() && it->first == next_order; it = pending.erase(it)) {
+                write_block(it->second);
+                ++next_order;
+            }
+            if (checkpointing && std::chrono::steady_clock::now() - saved >= std::chrono::seconds(checkpointSeconds)) {
+                save_checkpoint();
+            }
+        } else if (reader_done.load() && processor_done.load() && paf_queue.was_empty()) {
             break;
         } else {
             std::this_thread::sleep_for(std::chrono::milliseconds(10));
         }
     }
+    for (auto& p : pending) {
+        write_block(p.second);
+    }
+    if (checkpointing) {
+        save_checkpoint();
+    }
+    if (shard_records.is_open() && !shard_records.flush()) {
+        throw std::runtime_error("[wfmash::align] Error! Failed to write the shard records " + param.align_shard_records);
+    }
+    if (sorter) {
+        // The sorted lines are indexed as they go out
+        std::unique_ptr<interval_index::indexing_streambuf> indexing(
+            record_index ? new interval_index::indexing_streambuf(text_out->rdbuf(), *record_index) : nullptr);
+        std::ostream indexed(indexing.get());
+        if (!sorter->merge(indexing ? indexed : *text_out)) {
+            throw std::runtime_error("[wfmash::align] Error! Failed sorting the output through " + param.sort_prefix + ".*");
+        }
+        sorter.reset();
+    }
 
-    outstream.close();
+    if (hts_out) {
+        if (hts_close(hts_out) < 0) {
+            throw std::runtime_error("[wfmash::align] Error! Failed to close output file: " + output_file);
+        }
+    } else if (param.bgzip_output && outstream) {
+        auto* bgzf_out = static_cast<wfmash::obgzfstream*>(outstream.get());
+        bgzf_out->close();
+        if (!*bgzf_out) {
+            throw std::runtime_error("[wfmash::align] Error! Failed to close output file: " + output_file);
+        }
+    }
+    if (record_index) {
+        if (!record_index->write(param.interval_index_file, param.bgzip_output ? param.bgzip_index_file : "")) {
+            throw std::runtime_error("[wfmash::align] Error! Failed to write the interval index " + param.interval_index_file);
+        }
+        std::cerr << "[wfmash::align] Interval index of " << record_index->size() << " records saved to: "
+                  << param.interval_index_file << std::endl;
+    }
 }
 
-void computeAlignments() {
+/**
+ * @brief   align the mappings of param.mashmapPafFile, standard input for "-", those
+ *          streamed in when streamed is given, or the rows when they are
+ */
+void computeAlignments(std::istream* streamed, const std::vector<MappingBoundaryRow>* rows = nullptr) {
+    sampling_profiler::ScopedStage profile_stage(sampling_profiler::ALIGN);
     std::atomic<size_t> total_alignments_queued(0);
     std::atomic<bool> reader_done(false);
     std::atomic<bool> processor_done(false);
 
     // Create queues
-    atomic_queue::AtomicQueue<std::string*, 1024> line_queue;
+    line_atomic_queue_t line_queue;
     seq_atomic_queue_t seq_queue;
     paf_atomic_queue_t paf_queue;  // Add this line
 
-    // Calculate max_processors based on the number of worker threads
-    size_t max_processors = std::max(1UL, static_cast<unsigned long>(param.threads));
+    // Each pool thread may fetch records with packed stores, whose handles cost nothing,
+    // or when asked to; otherwise one at a time shares a single set of index handles
+    AlignPool pool(line_queue, seq_queue, paf_queue, reader_done);
+    const bool refStored = refStore && refStore->complete();
+    const bool queryStored = queryStore && queryStore->complete();
+    const size_t max_processors = (refStored && queryStored) || param.multithread_fasta_input
+        ? std::max(1, param.threads) : 1;
+    for (size_t i = 0; i < max_processors; ++i) {
+        pool.fetchers.emplace_back(new RecordFetcher(
+            refStored ? FaidxPool::Handle() : refFaidx->acquire(),
+            queryStored ? FaidxPool::Handle() : queryFaidx->acquire(),
+            sequenceBlockSize, sequenceCacheBlocks));
+    }
 
-    // Calculate total alignment length
+    // The mappings are read in one pass, the progress total estimated as they are, except
+    // for a shard, whose records are only known once the costs of all of them are
+    const bool fromStdin = !streamed && !rows && param.mashmapPafFile == "-";
     uint64_t total_alignment_length = 0;
-    {
-        std::ifstream mappingListStream(param.mashmapPafFile);
-        std::string mappingRecordLine;
-        MappingBoundaryRow currentRecord;
+    InputProgress input;
+    if (param.align_shard_count > 0) {
+        std::vector<double> costs;
+        std::vector<uint64_t> lengths;
+        auto count = [&](const MappingBoundaryRow& row) {
+            costs.push_back(estimatedAlignmentCost(row));
+            lengths.push_back(row.qEndPos - row.qStartPos);
+        };
+        std::ifstream mappingListStream(param.mashmapPafFile, std::ios::binary);
+        if (skch::isBinaryMappingStream(mappingListStream)) {
+            const BinaryMappingIds ids = readBinaryMappingIds(mappingListStream, queryNames, refNames);
+            forEachBinaryMapping(mappingListStream, ids, count);
+        } else if (param.pair_list) {
+            forEachPair(mappingListStream, count);
+        } else {
+            std::string mappingRecordLine;
+            MappingBoundaryRow currentRecord;
 
-        while(std::getline(mappingListStream, mappingRecordLine)) {
-            if (!mappingRecordLine.empty()) {
-                parseMashmapRow(mappingRecordLine, currentRecord, param.target_padding);
-                total_alignment_length += currentRecord.qEndPos - currentRecord.qStartPos;
+            while(std::getline(mappingListStream, mappingRecordLine)) {
+                if (!mappingRecordLine.empty()) {
+                    parseMashmapRow(mappingRecordLine, currentRecord, param.target_padding, queryNames, refNames);
+                    count(currentRecord);
+                }
             }
         }
+        const std::vector<uint32_t> shardOf = shards::assign(costs, param.align_shard_count);
+        inShard.assign(shardOf.size(), false);
+        uint64_t records = 0;
+        for (uint64_t i = 0; i < shardOf.size(); ++i) {
+            if (shardOf[i] == param.align_shard_index) {
+                inShard[i] = true;
+                total_alignment_length += lengths[i];
+                ++records;
+            }
+        }
+        std::cerr << "[wfmash::align] Aligning shard " << param.align_shard_index << " of " << param.align_shard_count
+                  << ", " << records << " of " << shardOf.size() << " mapping records" << std::endl;
+    } else if (!streamed && !rows && !fromStdin) {
+        std::error_code ec;
+        const uint64_t size = std::filesystem::file_size(param.mashmapPafFile, ec);
+        input.input_bytes = ec ? 0 : size;
+    }
+
+    // The BAM or CRAM header is made before the workers, which parse their records against it
+    if ((param.bam_format || param.cram_format) && !bam_header) {
+        std::ostringstream header_text;
+        write_sam_header(header_text);
+        const std::string text = header_text.str();
+        bam_header = sam_hdr_parse(text.size(), text.c_str());
+        if (!bam_header) {
+            throw std::runtime_error("[wfmash::align] Error! Failed to make the BAM header");
+        }
     }
 
-    // Create progress meter
-    progress_meter::ProgressMeter progress(total_alignment_length, "[wfmash::align] aligned");
+    // Create progress meter, its line followed by the state of the pipeline
+    AlignStatus status(param.threads);
+    progress_meter::ProgressMeter progress(total_alignment_length, "[wfmash::align] aligned",
+        [&]() { return statusLine(status, line_queue, seq_queue, paf_queue, max_processors); });
+    if (param.align_shard_count == 0) {
+        input.progress = &progress;
+    }
 
     // Create atomic counter for processed alignment length
     std::atomic<uint64_t> processed_alignment_length(0);
@@ -621,37 +2681,61 @@ void computeAlignments() {
     auto start_time = std::chrono::high_resolution_clock::now();
 
     // Launch single reader thread
-    std::thread single_reader([this, &line_queue, &reader_done]() {
-        this->single_reader_thread(param.mashmapPafFile, line_queue, reader_done);
-    });
-
-    // Launch processor manager
-    std::thread processor_manager_thread([this, &seq_queue, &line_queue, &total_alignments_queued, &reader_done, &processor_done, max_processors]() {
-        this->processor_manager(seq_queue, line_queue, total_alignments_queued, reader_done, processor_done, max_processors);
+    std::thread single_reader([this, &line_queue, &reader_done, &input, streamed, rows, fromStdin]() {
+        sampling_profiler::name_thread("paf-reader", sampling_profiler::ALIGN);
+        if (rows) {
+            std::istringstream none;
+            this->row_reader_thread(none, [&](auto&& fn) { std::for_each(rows->begin(), rows->end(), fn); },
+                                    line_queue, reader_done, input);
+            return;
+        }
+        std::ifstream mappingListFile;
+        if (!streamed && !fromStdin) {
+            mappingListFile.open(param.mashmapPafFile, std::ios::binary);
+            if (!mappingListFile.is_open()) {
+                throw std::runtime_error("[wfmash::align] Error! Failed to open input mapping file: " + param.mashmapPafFile);
+            }
+        }
+        std::istream& mappingListStream = streamed ? *streamed : fromStdin ? std::cin : mappingListFile;
+        if (!streamed && skch::isBinaryMappingStream(mappingListStream)) {
+            this->binary_reader_thread(mappingListStream, line_queue, reader_done, input);
+        } else if (param.pair_list) {
+            this->pair_reader_thread(mappingListStream, line_queue, reader_done, input);
+        } else if (reorderedJobs()) {
+            this->reordering_reader_thread(mappingListStream, line_queue, reader_done, input);
+        } else {
+            this->single_reader_thread(mappingListStream, line_queue, reader_done, input);
+        }
     });
 
-    // Launch worker threads
+    // Launch the pool, which fetches and aligns the records
+    status.capacity = seq_queue.capacity();
     std::vector<std::thread> workers;
-    std::vector<std::atomic<bool>> worker_working(param.threads);
     for (uint64_t t = 0; t < param.threads; ++t) {
-        workers.emplace_back([this, t, &worker_working, &seq_queue, &paf_queue, &reader_done, &processor_done, &progress, &processed_alignment_length]() {
-            this->worker_thread(t, worker_working[t], seq_queue, paf_queue, reader_done, processor_done, progress, processed_alignment_length);
+        workers.emplace_back([this, t, &pool, &progress, &processed_alignment_length, &total_alignments_queued, &status]() {
+            sampling_profiler::name_thread("align", sampling_profiler::ALIGN, t);
+            this->pool_thread(t, pool, progress, processed_alignment_length, total_alignments_queued, status);
         });
     }
 
-    // Launch writer thread
-    std::thread writer([this, &paf_queue, &reader_done, &processor_done, &worker_working]() {
-        this->writer_thread(param.pafOutputFile, paf_queue, reader_done, processor_done, worker_working);
+    // Launch writer thread, done once the pool is
+    std::thread writer([this, &paf_queue, &reader_done, &processor_done]() {
+        sampling_profiler::name_thread("writer", sampling_profiler::ALIGN);
+        this->writer_thread(param.pafOutputFile, paf_queue, reader_done, processor_done);
     });
 
     // Wait for all threads to complete
     single_reader.join();
-    processor_manager_thread.join();
     for (auto& worker : workers) {
         worker.join();
     }
+    processor_done.store(true);
     writer.join();
 
+    if (telemetryOut.is_open() && !telemetryOut.flush()) {
+        throw std::runtime_error("[wfmash::align] Error! Failed writing the telemetry file: " + param.telemetry_file);
+    }
+
     // Stop timing
     auto end_time = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::seconds>(end_time - start_time);
@@ -659,10 +2743,77 @@ void computeAlignments() {
     // Finish progress meter
     progress.finish();
 
+    skch::memory::phase("alignment");
+
     std::cerr << "[wfmash::align] "
               << "total aligned records = " << total_alignments_queued.load() 
               << ", total aligned bp = " << processed_alignment_length.load()
               << ", time taken = " << duration.count() << " seconds" << std::endl;
+    if (gatedRecords.load() > 0) {
+        std::cerr << "[wfmash::align] skipped " << gatedRecords.load() << " mappings whose identity upper bound is "
+                  << param.identity_gate_margin * 100 << "% or more below --min-identity" << std::endl;
+    }
+    if (clusters.load() > 0) {
+        std::cerr << "[wfmash::align] aligned " << clusteredRecords.load() << " overlapping mappings as the unions of "
+                  << clusters.load() << " clusters" << std::endl;
+    }
+    reportStatus(status, std::chrono::duration<double>(end_time - start_time).count(),
+                 processed_alignment_length.load(), max_processors);
+}
+
+/**
+ * @brief   rates, queue depths, processors and the longest alignment in flight, for the
+ *          progress line
+ */
+std::string statusLine(const AlignStatus& status, line_atomic_queue_t& line_queue, seq_atomic_queue_t& seq_queue,
+                       paf_atomic_queue_t& paf_queue, size_t max_processors) const {
+    const int64_t now = AlignStatus::now_ns();
+    int64_t oldest = 0;
+    uint64_t oldest_length = 0;
+    for (uint64_t t = 0; t < param.threads; ++t) {
+        const int64_t started = status.started[t].load(std::memory_order_relaxed);
+        if (started != 0 && (oldest == 0 || started < oldest)) {
+            oldest = started;
+            oldest_length = status.length[t].load(std::memory_order_relaxed);
+        }
+    }
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(1)
+         << status.aligned.load(std::memory_order_relaxed) / std::max(1e-9, (now - status.start_ns) * 1e-9) << " aln/s"
+         << " queues line " << line_queue.was_size() << " seq " << seq_queue.was_size()
+         << " paf " << paf_queue.was_size() << "/" << seq_queue.capacity()
+         << " processors " << status.processors.load(std::memory_order_relaxed) << "/" << max_processors;
+    if (oldest != 0) {
+        line << " longest " << oldest_length << "bp " << (now - oldest) * 1e-9 << "s";
+    }
+    return line.str();
+}
+
+/**
+ * @brief   log the throughput, the mean queue depths and processors, and the stage they
+ *          point at as holding the run back: a queue the stage after it drains is empty,
+ *          one it cannot keep up with fills
+ */
+void reportStatus(const AlignStatus& status, double seconds, uint64_t aligned_bp, size_t max_processors) const {
+    const double samples = std::max<uint64_t>(status.samples, 1);
+    const double capacity = status.capacity;
+    const double line_depth = status.line_depth / samples;
+    const double seq_depth = status.seq_depth / samples;
+    const double paf_depth = status.paf_depth / samples;
+    const char* bound = "alignment";
+    if (paf_depth >= capacity / 2) {
+        bound = "output";
+    } else if (status.seq_empty >= samples / 2) {
+        bound = line_depth >= capacity / 2 ? "sequence fetching" : "mapping input";
+    }
+    seconds = std::max(seconds, 1e-9);
+    std::cerr << std::fixed << std::setprecision(1)
+              << "[wfmash::align] " << status.aligned.load() / seconds << " alignments/s, "
+              << aligned_bp / seconds << " bp/s; mean queue depth line " << line_depth
+              << ", seq " << seq_depth << ", paf " << paf_depth << " of " << capacity
+              << "; mean processors " << status.processor_count / samples << " of " << max_processors
+              << "; longest alignment " << status.longest_length.load() << "bp in " << status.longest_ns.load() * 1e-9
+              << "s; bound by " << bound << std::defaultfloat << std::endl;
 }
       
   };
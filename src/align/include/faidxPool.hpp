@@ -0,0 +1,103 @@
+/**
+ * @file    faidxPool.hpp
+ * @brief   Pool of faidx handles of one FASTA, lent to one thread at a time
+ */
+
+#ifndef FAIDX_POOL_HPP
+#define FAIDX_POOL_HPP
+
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <htslib/faidx.h>
+
+namespace align
+{
+  /**
+   * @brief   faidx handles of a FASTA, opened on demand and kept for the next borrower
+   * @details A faidx_t is not thread safe, so each fetching thread needs its own. Opening
+   *          one parses the whole .fai, and the .gzi of a BGZF FASTA; the pool does it once
+   *          per handle concurrently in use rather than once per thread started, as the
+   *          aligner starts and retires its sequence fetchers with the load.
+   */
+  class FaidxPool
+  {
+    public:
+
+      /**
+       * @brief   a handle borrowed from a pool, returned to it on destruction; empty when
+       *          default constructed
+       */
+      class Handle
+      {
+        public:
+
+          Handle() = default;
+          Handle(FaidxPool* pool, faidx_t* fai) : pool(pool), fai(fai) {}
+          Handle(Handle&& other) noexcept : pool(other.pool), fai(other.fai) { other.fai = nullptr; }
+          Handle& operator=(Handle&& other) noexcept
+          {
+            std::swap(pool, other.pool);
+            std::swap(fai, other.fai);
+            return *this;
+          }
+          Handle(const Handle&) = delete;
+          Handle& operator=(const Handle&) = delete;
+
+          ~Handle()
+          {
+            if (fai) {
+              pool->release(fai);
+            }
+          }
+
+          faidx_t* get() const { return fai; }
+
+        private:
+
+          FaidxPool* pool = nullptr;
+          faidx_t* fai = nullptr;
+      };
+
+      explicit FaidxPool(const std::string& fasta) : fasta(fasta) {}
+
+      ~FaidxPool()
+      {
+        for (faidx_t* fai : idle) {
+          fai_destroy(fai);
+        }
+      }
+
+      Handle acquire()
+      {
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          if (!idle.empty()) {
+            faidx_t* fai = idle.back();
+            idle.pop_back();
+            return Handle(this, fai);
+          }
+        }
+        faidx_t* fai = fai_load(fasta.c_str());
+        if (!fai) {
+          throw std::runtime_error("[wfmash::align] Error! Failed to load the FASTA index of " + fasta);
+        }
+        return Handle(this, fai);
+      }
+
+    private:
+
+      void release(faidx_t* fai)
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        idle.push_back(fai);
+      }
+
+      const std::string fasta;
+      std::mutex mutex;
+      std::vector<faidx_t*> idle;
+  };
+}
+
+#endif
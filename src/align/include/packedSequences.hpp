@@ -0,0 +1,427 @@
+/**
+ * @file    packedSequences.hpp
+ * @brief   Memory mapped 2-bit packed copy of the sequences of a FASTA file
+ */
+
+#ifndef PACKED_SEQUENCES_HPP
+#define PACKED_SEQUENCES_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <htslib/faidx.h>
+
+#include "map/include/commonFunc.hpp"
+#include "map/include/hugePages.hpp"
+#include "common/shared_sequences.hpp"
+
+namespace align
+{
+  /**
+   * @brief   The sequences of a FASTA file, uppercased and validated, packed 4 bases a byte
+   * @details Built once into <fasta>.wfpk and memory mapped afterwards, so a window of a
+   *          sequence is decoded from the packed bytes without going through faidx. Anything
+   *          but ACGT is N after validation and kept as runs of N beside the packed bases;
+   *          the soft masking is dropped as the aligner uppercases anyway. The file is
+   *          rebuilt when the FASTA's size or modification time differ from the ones it was
+   *          built from. Read only once open, so one store is shared by all threads.
+   *          A store can also be laid out in memory from the sequences the mapping kept
+   *          (common/shared_sequences.hpp), missing those it did not.
+   *
+   *          Layout: Header, packed bases (each sequence starting on a byte), Entry per
+   *          sequence, NRun per run of N (by sequence, then start), sequence names.
+   */
+  class PackedSequenceStore
+  {
+    public:
+
+      explicit PackedSequenceStore(const std::string& fasta)
+      {
+        const std::string path = fasta + ".wfpk";
+        struct stat st;
+        if (stat(fasta.c_str(), &st) != 0) {
+          throw std::runtime_error("[wfmash::align] Error! Cannot stat " + fasta);
+        }
+        if (!open(path, st)) {
+          build(fasta, path, st);
+          if (!open(path, st)) {
+            throw std::runtime_error("[wfmash::align] Error! Cannot read packed sequences " + path);
+          }
+        }
+      }
+
+      /**
+       * @brief   the sequences of the FASTA indexed by fai that the mapping kept, in the
+       *          order of the index; the others are missing, for the caller to read
+       */
+      PackedSequenceStore(const faidx_t* fai, const shared_sequences::Sequences& kept)
+      {
+        const int sequences = faidx_nseq(fai);
+        present.assign(sequences, false);
+        uint64_t packedBytes = 0;
+        uint64_t runCount = 0;
+        uint64_t namesSize = 0;
+        for (int i = 0; i < sequences; ++i) {
+          const char* name = faidx_iseq(fai, i);
+          const auto found = kept.find(name);
+          if (found != kept.end() && int64_t(found->second->length) == faidx_seq_len64(fai, name)) {
+            present[i] = true;
+            packedBytes += found->second->bases.size();
+            runCount += found->second->runs.size();
+          }
+          namesSize += std::strlen(name);
+        }
+
+        Header h{};
+        h.magic = magic;
+        h.sequences = sequences;
+        h.packedOffset = sizeof(Header);
+        h.entriesOffset = h.packedOffset + ((packedBytes + 7) & ~uint64_t(7));
+        h.runsOffset = h.entriesOffset + sequences * sizeof(Entry);
+        h.runs = runCount;
+        h.namesOffset = h.runsOffset + runCount * sizeof(NRun);
+        h.fileSize = h.namesOffset + namesSize;
+        buffer.assign(h.fileSize, 0);
+        std::memcpy(buffer.data(), &h, sizeof(h));
+
+        uint64_t packedOffset = 0;
+        uint64_t runOffset = 0;
+        uint64_t nameOffset = 0;
+        for (int i = 0; i < sequences; ++i) {
+          const char* name = faidx_iseq(fai, i);
+          Entry e{uint64_t(faidx_seq_len64(fai, name)), packedOffset, runOffset, 0, nameOffset, std::strlen(name)};
+          if (present[i]) {
+            const shared_sequences::Packed& packed = *kept.find(name)->second;
+            std::memcpy(buffer.data() + h.packedOffset + packedOffset, packed.bases.data(), packed.bases.size());
+            std::memcpy(buffer.data() + h.runsOffset + runOffset * sizeof(NRun), packed.runs.data(),
+                        packed.runs.size() * sizeof(NRun));
+            packedOffset += packed.bases.size();
+            runOffset += packed.runs.size();
+            e.nRunsCount = packed.runs.size();
+          }
+          std::memcpy(buffer.data() + h.entriesOffset + i * sizeof(Entry), &e, sizeof(e));
+          std::memcpy(buffer.data() + h.namesOffset + nameOffset, name, e.nameLength);
+          nameOffset += e.nameLength;
+        }
+        if (std::find(present.begin(), present.end(), false) == present.end()) {
+          present.clear();
+        }
+        data = buffer.data();
+        mappingSize = buffer.size();
+        bind();
+      }
+
+      ~PackedSequenceStore()
+      {
+        if (mapping != nullptr) {
+          munmap(mapping, mappingSize);
+        }
+      }
+
+      PackedSequenceStore(const PackedSequenceStore&) = delete;
+      PackedSequenceStore& operator=(const PackedSequenceStore&) = delete;
+
+      size_t size() const
+      {
+        return header->sequences;
+      }
+
+      // Back the store with transparent huge pages, where the kernel allows it for its file
+      void adviseHugePages() const
+      {
+        skch::hugePages::advise(data, mappingSize);
+      }
+
+      // Bytes of the store in memory, counting a mapped file whole
+      size_t memoryBytes() const
+      {
+        return mapping != nullptr ? mappingSize : buffer.capacity();
+      }
+
+      int64_t length(uint32_t id) const
+      {
+        return entries[id].length;
+      }
+
+      // Whether sequence id is in the store, as all are but in one laid out from the mapping
+      bool has(uint32_t id) const
+      {
+        return present.empty() || present[id];
+      }
+
+      bool complete() const
+      {
+        return present.empty();
+      }
+
+      std::vector<std::string> names() const
+      {
+        std::vector<std::string> result;
+        result.reserve(size());
+        for (size_t i = 0; i < size(); ++i) {
+          result.emplace_back(nameBytes + entries[i].nameOffset, entries[i].nameLength);
+        }
+        return result;
+      }
+
+      /**
+       * @brief   decode the bases [start, end] of sequence id into out, which has room for
+       *          them; end is clamped to the sequence like faidx_fetch_seq64 does
+       * @return  number of bases written
+       */
+      int64_t extract(uint32_t id, int64_t start, int64_t end, char* out) const
+      {
+        const Entry& entry = entries[id];
+        end = std::min<int64_t>(end, entry.length - 1);
+        if (start > end) {
+          return 0;
+        }
+        const uint8_t* packed = data + header->packedOffset + entry.packedOffset;
+        const int64_t len = end - start + 1;
+        int64_t pos = start;
+        char* o = out;
+        for (; pos <= end && (pos & 3) != 0; ++pos) {
+          *o++ = "ACGT"[(packed[pos >> 2] >> (2 * (pos & 3))) & 3];
+        }
+        for (; pos + 3 <= end; pos += 4) {
+          std::memcpy(o, decoded[packed[pos >> 2]].data(), 4);
+          o += 4;
+        }
+        for (; pos <= end; ++pos) {
+          *o++ = "ACGT"[(packed[pos >> 2] >> (2 * (pos & 3))) & 3];
+        }
+
+        // Overlay the runs of N reaching into the window
+        const NRun* first = runs + entry.nRunsBegin;
+        const NRun* last = first + entry.nRunsCount;
+        for (const NRun* run = std::upper_bound(first, last, uint64_t(start),
+                 [](uint64_t pos, const NRun& r) { return pos < r.end; });
+             run != last && int64_t(run->start) <= end; ++run) {
+          const int64_t from = std::max<int64_t>(start, run->start);
+          const int64_t to = std::min<int64_t>(end + 1, run->end);
+          std::memset(out + (from - start), 'N', to - from);
+        }
+        return len;
+      }
+
+      /**
+       * @brief   the bases [start, end] of sequence id into seq, whose capacity is reused
+       */
+      void extract(uint32_t id, int64_t start, int64_t end, std::string& seq) const
+      {
+        seq.resize(std::max<int64_t>(0, std::min<int64_t>(end, length(id) - 1) - start + 1));
+        extract(id, start, end, &seq[0]);
+      }
+
+    private:
+
+      static constexpr uint64_t magic = 0x3130304b50465721ULL;     //"!WFPK001"
+
+      //Bases fetched from faidx at a time while building
+      static constexpr int64_t buildChunkSize = 1 << 24;
+
+      struct Header
+      {
+        uint64_t magic;
+        uint64_t fastaSize;
+        int64_t fastaMtime;
+        uint64_t sequences;
+        uint64_t packedOffset;
+        uint64_t entriesOffset;
+        uint64_t runsOffset;
+        uint64_t runs;
+        uint64_t namesOffset;
+        uint64_t fileSize;
+      };
+
+      struct Entry
+      {
+        uint64_t length;
+        uint64_t packedOffset;            //from Header::packedOffset
+        uint64_t nRunsBegin;
+        uint64_t nRunsCount;
+        uint64_t nameOffset;              //from Header::namesOffset
+        uint64_t nameLength;
+      };
+
+      typedef shared_sequences::NRun NRun;
+
+      static std::array<std::array<char, 4>, 256> makeDecodeTable()
+      {
+        std::array<std::array<char, 4>, 256> t;
+        for (int b = 0; b < 256; ++b) {
+          for (int i = 0; i < 4; ++i) {
+            t[b][i] = "ACGT"[(b >> (2 * i)) & 3];
+          }
+        }
+        return t;
+      }
+
+      static inline const std::array<std::array<char, 4>, 256> decoded = makeDecodeTable();
+
+      /**
+       * @brief   map the store at path if it was built from the FASTA whose stat is st,
+       *          reading it in if mmap fails
+       */
+      bool open(const std::string& path, const struct stat& st)
+      {
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+          return false;
+        }
+        struct stat pst;
+        if (fstat(fd, &pst) != 0 || size_t(pst.st_size) < sizeof(Header)) {
+          close(fd);
+          return false;
+        }
+        mappingSize = pst.st_size;
+        void* m = mmap(nullptr, mappingSize, PROT_READ, MAP_SHARED, fd, 0);
+        if (m != MAP_FAILED) {
+          mapping = m;
+          data = static_cast<const uint8_t*>(m);
+        } else {
+          buffer.resize(mappingSize);
+          size_t got = 0;
+          while (got < mappingSize) {
+            const ssize_t r = read(fd, buffer.data() + got, mappingSize - got);
+            if (r <= 0) {
+              break;
+            }
+            got += r;
+          }
+          if (got < mappingSize) {
+            close(fd);
+            buffer.clear();
+            return false;
+          }
+          data = buffer.data();
+        }
+        close(fd);
+
+        header = reinterpret_cast<const Header*>(data);
+        if (header->magic != magic || header->fileSize != mappingSize
+            || header->fastaSize != uint64_t(st.st_size) || header->fastaMtime != int64_t(st.st_mtime)) {
+          if (mapping != nullptr) {
+            munmap(mapping, mappingSize);
+            mapping = nullptr;
+          }
+          buffer.clear();
+          header = nullptr;
+          data = nullptr;
+          return false;
+        }
+        bind();
+        return true;
+      }
+
+      // Point at the parts of the store laid out in data
+      void bind()
+      {
+        header = reinterpret_cast<const Header*>(data);
+        entries = reinterpret_cast<const Entry*>(data + header->entriesOffset);
+        runs = reinterpret_cast<const NRun*>(data + header->runsOffset);
+        nameBytes = reinterpret_cast<const char*>(data + header->namesOffset);
+      }
+
+      /**
+       * @brief   pack the sequences of fasta, through its faidx index, into path; written
+       *          to a temporary file renamed into place so concurrent runs never read half
+       *          a store
+       */
+      static void build(const std::string& fasta, const std::string& path, const struct stat& st)
+      {
+        faidx_t* fai = fai_load(fasta.c_str());
+        if (fai == nullptr) {
+          throw std::runtime_error("[wfmash::align] Error! Failed to load the index of " + fasta);
+        }
+        const std::string tmp = path + ".tmp" + std::to_string(getpid());
+        std::ofstream out(tmp, std::ios::binary);
+        if (!out) {
+          fai_destroy(fai);
+          throw std::runtime_error("[wfmash::align] Error! Cannot write packed sequences " + tmp);
+        }
+
+        Header h{};
+        h.magic = magic;
+        h.fastaSize = st.st_size;
+        h.fastaMtime = st.st_mtime;
+        h.sequences = faidx_nseq(fai);
+        h.packedOffset = sizeof(Header);
+        out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+
+        std::vector<Entry> entries;
+        std::vector<NRun> runs;
+        std::string names;
+        std::vector<uint8_t> packed;
+        uint64_t packedBytes = 0;
+        for (int i = 0; i < faidx_nseq(fai); ++i) {
+          const char* name = faidx_iseq(fai, i);
+          const int64_t len = faidx_seq_len64(fai, name);
+          Entry e{uint64_t(len), packedBytes, runs.size(), 0, names.size(), std::strlen(name)};
+          names.append(name);
+
+          for (int64_t from = 0; from < len; from += buildChunkSize) {
+            const int64_t to = std::min(len, from + buildChunkSize);
+            int64_t got = 0;
+            char* seq = faidx_fetch_seq64(fai, name, from, to - 1, &got);
+            if (seq == nullptr || got != to - from) {
+              free(seq);
+              fai_destroy(fai);
+              throw std::runtime_error("[wfmash::align] Error! Failed to fetch sequence " + std::string(name));
+            }
+            skch::CommonFunc::makeUpperCaseAndValidDNA(seq, got);
+
+            // Chunks are a multiple of 4 bases, so each starts on a byte
+            packed.clear();
+            shared_sequences::pack(seq, got, from, packed, runs, e.nRunsBegin, true);
+            free(seq);
+            out.write(reinterpret_cast<const char*>(packed.data()), packed.size());
+            packedBytes += packed.size();
+          }
+          e.nRunsCount = runs.size() - e.nRunsBegin;
+          entries.push_back(e);
+        }
+        fai_destroy(fai);
+
+        h.entriesOffset = h.packedOffset + ((packedBytes + 7) & ~uint64_t(7));
+        out.write("\0\0\0\0\0\0\0", h.entriesOffset - h.packedOffset - packedBytes);
+        out.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(Entry));
+        h.runsOffset = h.entriesOffset + entries.size() * sizeof(Entry);
+        h.runs = runs.size();
+        out.write(reinterpret_cast<const char*>(runs.data()), runs.size() * sizeof(NRun));
+        h.namesOffset = h.runsOffset + runs.size() * sizeof(NRun);
+        out.write(names.data(), names.size());
+        h.fileSize = h.namesOffset + names.size();
+        out.seekp(0);
+        out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+        out.close();
+        if (!out || std::rename(tmp.c_str(), path.c_str()) != 0) {
+          std::remove(tmp.c_str());
+          throw std::runtime_error("[wfmash::align] Error! Cannot write packed sequences " + path);
+        }
+      }
+
+      void* mapping = nullptr;
+      size_t mappingSize = 0;
+      std::vector<uint8_t> buffer;      //the file read in, when it could not be mapped, or the store laid out
+      std::vector<bool> present;        //of each sequence, in a store missing some, else empty
+      const uint8_t* data = nullptr;
+      const Header* header = nullptr;
+      const Entry* entries = nullptr;
+      const NRun* runs = nullptr;
+      const char* nameBytes = nullptr;
+  };
+}
+
+#endif
@@ -0,0 +1,131 @@
+/**
+ * @file    sequenceCache.hpp
+ * @brief   LRU cache of decoded sequence blocks of a faidx index
+ */
+
+#ifndef SEQUENCE_CACHE_HPP
+#define SEQUENCE_CACHE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <list>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <htslib/faidx.h>
+#include "common/dna_kernels.hpp"
+
+namespace align
+{
+  /**
+   * @brief   Fixed size blocks of the sequences of one faidx index, kept once fetched
+   * @details The mappings of a chain fetch overlapping windows of the same sequences one
+   *          after the other. Fetching whole blocks and keeping the most recently used lets
+   *          those windows be cut from blocks already decoded, which on bgzipped FASTA
+   *          saves decompressing them again. The reverse strand windows of a chain are cut
+   *          likewise from the reverse complement of the blocks, made the first time one
+   *          of them is asked for. Not thread safe; each reader has its own.
+   */
+  class SequenceBlockCache
+  {
+    public:
+
+      SequenceBlockCache(faidx_t* fai, int64_t blockSize, size_t maxBlocks)
+        : fai(fai), blockSize(blockSize), maxBlocks(std::max<size_t>(1, maxBlocks)) {}
+
+      /**
+       * @brief   the bases [start, end] of sequence seqId, named name, of length seqLen,
+       *          into seq, whose capacity is reused; end is clamped to the sequence like
+       *          faidx_fetch_seq64 does
+       */
+      void fetch(uint32_t seqId, const char* name, int64_t seqLen, int64_t start, int64_t end, std::string& seq)
+      {
+        end = std::min(end, seqLen - 1);
+        seq.clear();
+        if (start > end) {
+          return;
+        }
+        seq.reserve(end - start + 1);
+        for (int64_t b = start / blockSize; b <= end / blockSize; ++b) {
+          const std::string& data = block(seqId, name, seqLen, b).data;
+          const int64_t from = std::max(start, b * blockSize) - b * blockSize;
+          const int64_t to = std::min(end, (b + 1) * blockSize - 1) - b * blockSize;
+          seq.append(data, from, to - from + 1);
+        }
+      }
+
+      /**
+       * @brief   the reverse complement of the bases fetch would give, uppercased with
+       *          anything but ACGT made N, into seq
+       */
+      void fetchReverseComplement(uint32_t seqId, const char* name, int64_t seqLen,
+                                  int64_t start, int64_t end, std::string& seq)
+      {
+        end = std::min(end, seqLen - 1);
+        seq.clear();
+        if (start > end) {
+          return;
+        }
+        seq.reserve(end - start + 1);
+        for (int64_t b = end / blockSize; b >= start / blockSize; --b) {
+          Block& cached = block(seqId, name, seqLen, b);
+          if (cached.reversed.empty()) {
+            std::string valid = cached.data;
+            dna_kernels::make_upper_valid_dna(&valid[0], valid.size());
+            cached.reversed.resize(valid.size());
+            dna_kernels::reverse_complement(valid.data(), &cached.reversed[0], valid.size());
+          }
+          const int64_t last = cached.data.size() - 1;
+          const int64_t from = std::max(start, b * blockSize) - b * blockSize;
+          const int64_t to = std::min(end, (b + 1) * blockSize - 1) - b * blockSize;
+          seq.append(cached.reversed, last - to, to - from + 1);
+        }
+      }
+
+    private:
+
+      struct Block
+      {
+        std::string data;
+        std::string reversed;                                   //empty until asked for
+      };
+
+      typedef std::list<std::pair<uint64_t, Block>> Blocks;
+
+      Block& block(uint32_t seqId, const char* name, int64_t seqLen, int64_t b)
+      {
+        const uint64_t key = uint64_t(seqId) << 32 | uint64_t(b);
+        auto found = index.find(key);
+        if (found != index.end()) {
+          blocks.splice(blocks.begin(), blocks, found->second);
+          return found->second->second;
+        }
+
+        int64_t len = 0;
+        char* data = faidx_fetch_seq64(fai, name, b * blockSize,
+                                       std::min((b + 1) * blockSize, seqLen) - 1, &len);
+        if (data == nullptr || len < 0) {
+          throw std::runtime_error("[wfmash::align] Error! Failed to fetch sequence " + std::string(name));
+        }
+        blocks.emplace_front(key, Block{std::string(data, len), std::string()});
+        free(data);
+        index[key] = blocks.begin();
+
+        if (blocks.size() > maxBlocks) {
+          index.erase(blocks.back().first);
+          blocks.pop_back();
+        }
+        return blocks.front().second;
+      }
+
+      faidx_t* fai;
+      const int64_t blockSize;
+      const size_t maxBlocks;
+      Blocks blocks;                                            //most recently used first
+      std::unordered_map<uint64_t, Blocks::iterator> index;
+  };
+}
+
+#endif
@@ -0,0 +1,146 @@
+/**
+ * @file    sequenceReadahead.hpp
+ * @brief   Kernel readahead of the parts of a FASTA the queued alignment records fetch
+ */
+
+#ifndef SEQUENCE_READAHEAD_HPP
+#define SEQUENCE_READAHEAD_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace align
+{
+  /**
+   * @brief   Asks the kernel to read ahead the bytes of a FASTA holding given bases
+   * @details The records waiting in the line queue name the windows the processors will
+   *          fetch through faidx. Hinting their bytes as they are queued lets the kernel
+   *          read them in the background, so a processor finds them in the page cache
+   *          instead of waiting on the disk or a network filesystem. Positions are turned
+   *          into file offsets through the .fai, and on a bgzipped FASTA into the offsets
+   *          of the BGZF blocks holding them through its .gzi. A hint within the last one
+   *          is skipped. Not thread safe; the reader thread alone hints.
+   */
+  class SequenceReadahead
+  {
+    public:
+
+      explicit SequenceReadahead(const std::string& fasta)
+      {
+        fd = ::open(fasta.c_str(), O_RDONLY);
+        if (fd < 0) {
+          return;
+        }
+        struct stat st;
+        fileSize = fstat(fd, &st) == 0 ? st.st_size : 0;
+
+        std::ifstream fai(fasta + ".fai");
+        std::string line;
+        while (std::getline(fai, line)) {
+          std::istringstream fields(line);
+          std::string name;
+          Entry e;
+          if (fields >> name >> e.length >> e.offset >> e.lineBases >> e.lineWidth && e.lineBases > 0) {
+            entries.push_back(e);
+          } else {
+            entries.push_back(Entry());
+          }
+        }
+
+        // Pairs of compressed and uncompressed offsets of the blocks after the first
+        std::ifstream gzi(fasta + ".gzi", std::ios::binary);
+        uint64_t count = 0;
+        if (gzi.read(reinterpret_cast<char*>(&count), sizeof(count))) {
+          blocks.resize(count + 1);
+          blocks[0] = {0, 0};
+          if (!gzi.read(reinterpret_cast<char*>(blocks.data() + 1), count * sizeof(Block))) {
+            blocks.clear();
+          }
+        }
+        bgzipped = !blocks.empty();
+      }
+
+      ~SequenceReadahead()
+      {
+        if (fd >= 0) {
+          ::close(fd);
+        }
+      }
+
+      SequenceReadahead(const SequenceReadahead&) = delete;
+      SequenceReadahead& operator=(const SequenceReadahead&) = delete;
+
+      /**
+       * @brief   hint the bytes of the bases [start, end) of sequence id, clamped to it
+       */
+      void hint(uint32_t id, int64_t start, int64_t end)
+      {
+        if (fd < 0 || id >= entries.size() || entries[id].lineBases == 0) {
+          return;
+        }
+        const Entry& e = entries[id];
+        start = std::max<int64_t>(0, start);
+        end = std::min<int64_t>(end, e.length);
+        if (start >= end) {
+          return;
+        }
+        uint64_t begin = offset(e, start);
+        uint64_t last = offset(e, end - 1) + 1;
+        if (bgzipped) {
+          // From the block holding the first byte to the one after the block holding the last
+          auto after = [&](uint64_t uncompressed) {
+            return std::upper_bound(blocks.begin(), blocks.end(), uncompressed,
+                                    [](uint64_t u, const Block& b) { return u < b.uncompressed; });
+          };
+          begin = std::prev(after(begin))->compressed;
+          const auto next = after(last - 1);
+          last = next != blocks.end() ? next->compressed : fileSize;
+        }
+        if (begin >= hintedBegin && last <= hintedEnd) {
+          return;
+        }
+        hintedBegin = begin;
+        hintedEnd = last;
+        posix_fadvise(fd, begin, last - begin, POSIX_FADV_WILLNEED);
+      }
+
+    private:
+
+      struct Entry
+      {
+        int64_t length = 0;
+        uint64_t offset = 0;
+        uint64_t lineBases = 0;
+        uint64_t lineWidth = 0;
+      };
+
+      struct Block
+      {
+        uint64_t compressed;
+        uint64_t uncompressed;
+      };
+
+      // Uncompressed file offset of base pos of a sequence
+      static uint64_t offset(const Entry& e, int64_t pos)
+      {
+        return e.offset + pos / e.lineBases * e.lineWidth + pos % e.lineBases;
+      }
+
+      int fd = -1;
+      uint64_t fileSize = 0;
+      bool bgzipped = false;
+      std::vector<Entry> entries;       //by the id of the sequence, its line in the .fai
+      std::vector<Block> blocks;        //of a bgzipped FASTA, by offset
+      uint64_t hintedBegin = 0;
+      uint64_t hintedEnd = 0;
+  };
+}
+
+#endif
@@ -0,0 +1,133 @@
+/**
+ * @file    bgzfstream.hpp
+ * @brief   output stream writing a BGZF (bgzip) file through htslib, whose thread pool
+ *          compresses the blocks in parallel and writes them in order
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <htslib/bgzf.h>
+
+namespace wfmash {
+
+class bgzfstreambuf : public std::streambuf {
+  public:
+    /**
+     * @param   filename        file to write, "-" for stdout
+     * @param   threads         compression threads, 1 to compress on the writing thread
+     * @param   index_filename  where to save the .gzi index of the file on close, empty
+     *                          for none
+     */
+    bgzfstreambuf(const std::string& filename, const int threads, const std::string& index_filename)
+        : index_filename(index_filename), buffer(bufferSize) {
+        fp = bgzf_open(filename.c_str(), "w");
+        if (!fp) {
+            return;
+        }
+        if (threads > 1) {
+            bgzf_mt(fp, threads, 256);
+        }
+        if (!index_filename.empty()) {
+            bgzf_index_build_init(fp);
+        }
+        setp(buffer.data(), buffer.data() + buffer.size());
+    }
+
+    ~bgzfstreambuf() { close(); }
+
+    bool is_open() const { return fp != nullptr; }
+
+    /**
+     * @brief   write out what is buffered, the index if any, and the EOF block
+     * @return  0 on success
+     */
+    int close() {
+        if (!fp) {
+            return 0;
+        }
+        int ret = flush_buffer();
+        if (!index_filename.empty() && bgzf_index_dump(fp, index_filename.c_str(), nullptr) < 0) {
+            ret = -1;
+        }
+        if (bgzf_close(fp) < 0) {
+            ret = -1;
+        }
+        fp = nullptr;
+        return ret;
+    }
+
+  protected:
+    int_type overflow(int_type c) override {
+        if (flush_buffer() < 0) {
+            return traits_type::eof();
+        }
+        if (c != traits_type::eof()) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        if (n < epptr() - pptr()) {
+            std::memcpy(pptr(), s, n);
+            pbump((int)n);
+            return n;
+        }
+        // Large writes go to BGZF directly, past the buffer
+        if (flush_buffer() < 0 || bgzf_write(fp, s, n) < 0) {
+            return 0;
+        }
+        return n;
+    }
+
+    // Hands the buffer to BGZF, which keeps filling its block; flushing the stream does
+    // not cut the blocks short
+    int sync() override { return flush_buffer() < 0 ? -1 : 0; }
+
+  private:
+    static constexpr size_t bufferSize = 1 << 16;
+
+    int flush_buffer() {
+        const std::ptrdiff_t n = pptr() - pbase();
+        if (n > 0 && bgzf_write(fp, pbase(), n) < 0) {
+            return -1;
+        }
+        pbump(-(int)n);
+        return 0;
+    }
+
+    BGZF* fp = nullptr;
+    std::string index_filename;
+    std::vector<char> buffer;
+};
+
+class obgzfstream : public std::ostream {
+  public:
+    obgzfstream(const std::string& filename, const int threads, const std::string& index_filename = "")
+        : std::ostream(nullptr), buf(filename, threads, index_filename) {
+        rdbuf(&buf);
+        if (!buf.is_open()) {
+            setstate(std::ios::badbit);
+        }
+    }
+
+    bool is_open() const { return buf.is_open(); }
+
+    void close() {
+        if (buf.close() != 0) {
+            setstate(std::ios::badbit);
+        }
+    }
+
+  private:
+    bgzfstreambuf buf;
+};
+
+}
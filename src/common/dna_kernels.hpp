@@ -0,0 +1,217 @@
+#pragma once
+
+/**
+ * Vectorized per-base kernels for DNA sequences
+ *
+ * - make_upper_valid_dna: upper-case ACGT, everything else becomes 'N'
+ * - reverse_complement:   A<->T, C<->G, any other byte copied unchanged
+ *
+ * AVX2 and SSE4.2 variants are selected at runtime from the running CPU
+ * (so generic builds still use them), NEON is used when compiled for ARM,
+ * and the scalar loops are the fallback and handle tails.
+ */
+
+#include <array>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DNA_KERNELS_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define DNA_KERNELS_NEON 1
+#endif
+
+namespace dna_kernels {
+
+constexpr std::array<char, 256> make_upper_valid_table() {
+    std::array<char, 256> t{};
+    for (auto& c : t) c = 'N';
+    t['A'] = 'A'; t['C'] = 'C'; t['G'] = 'G'; t['T'] = 'T';
+    t['a'] = 'A'; t['c'] = 'C'; t['g'] = 'G'; t['t'] = 'T';
+    return t;
+}
+constexpr std::array<char, 256> upper_valid_table = make_upper_valid_table();
+
+constexpr std::array<char, 256> make_complement_table() {
+    std::array<char, 256> t{};
+    for (int i = 0; i < 256; ++i) t[i] = static_cast<char>(i);
+    t['A'] = 'T'; t['C'] = 'G'; t['G'] = 'C'; t['T'] = 'A';
+    return t;
+}
+constexpr std::array<char, 256> complement_table = make_complement_table();
+
+inline void make_upper_valid_dna_scalar(char* seq, int64_t len) {
+    for (int64_t i = 0; i < len; ++i) {
+        seq[i] = upper_valid_table[static_cast<uint8_t>(seq[i])];
+    }
+}
+
+// Complement src[begin, end) into dest, reversed relative to the full length
+inline void reverse_complement_scalar(const char* src, char* dest, int64_t len,
+                                      int64_t begin = 0) {
+    for (int64_t i = begin; i < len; ++i) {
+        dest[len - i - 1] = complement_table[static_cast<uint8_t>(src[i])];
+    }
+}
+
+#ifdef DNA_KERNELS_X86
+
+// Clearing bit 5 upper-cases letters; only a/A, c/C, g/G, t/T land on ACGT
+__attribute__((target("avx2")))
+inline void make_upper_valid_dna_avx2(char* seq, int64_t len) {
+    const __m256i case_mask = _mm256_set1_epi8((char)0xDF);
+    const __m256i A = _mm256_set1_epi8('A'), C = _mm256_set1_epi8('C');
+    const __m256i G = _mm256_set1_epi8('G'), T = _mm256_set1_epi8('T');
+    const __m256i N = _mm256_set1_epi8('N');
+    int64_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(seq + i));
+        __m256i up = _mm256_and_si256(v, case_mask);
+        __m256i ok = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(up, A), _mm256_cmpeq_epi8(up, C)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(up, G), _mm256_cmpeq_epi8(up, T)));
+        _mm256_storeu_si256((__m256i*)(seq + i), _mm256_blendv_epi8(N, up, ok));
+    }
+    make_upper_valid_dna_scalar(seq + i, len - i);
+}
+
+__attribute__((target("sse4.2")))
+inline void make_upper_valid_dna_sse42(char* seq, int64_t len) {
+    const __m128i case_mask = _mm_set1_epi8((char)0xDF);
+    const __m128i A = _mm_set1_epi8('A'), C = _mm_set1_epi8('C');
+    const __m128i G = _mm_set1_epi8('G'), T = _mm_set1_epi8('T');
+    const __m128i N = _mm_set1_epi8('N');
+    int64_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(seq + i));
+        __m128i up = _mm_and_si128(v, case_mask);
+        __m128i ok = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(up, A), _mm_cmpeq_epi8(up, C)),
+            _mm_or_si128(_mm_cmpeq_epi8(up, G), _mm_cmpeq_epi8(up, T)));
+        _mm_storeu_si128((__m128i*)(seq + i), _mm_blendv_epi8(N, up, ok));
+    }
+    make_upper_valid_dna_scalar(seq + i, len - i);
+}
+
+// Swap A<->T and C<->G, leaving every other byte untouched
+__attribute__((target("avx2")))
+inline __m256i complement_avx2(__m256i v) {
+    const __m256i A = _mm256_set1_epi8('A'), C = _mm256_set1_epi8('C');
+    const __m256i G = _mm256_set1_epi8('G'), T = _mm256_set1_epi8('T');
+    __m256i r = _mm256_blendv_epi8(v, T, _mm256_cmpeq_epi8(v, A));
+    r = _mm256_blendv_epi8(r, A, _mm256_cmpeq_epi8(v, T));
+    r = _mm256_blendv_epi8(r, G, _mm256_cmpeq_epi8(v, C));
+    return _mm256_blendv_epi8(r, C, _mm256_cmpeq_epi8(v, G));
+}
+
+__attribute__((target("avx2")))
+inline void reverse_complement_avx2(const char* src, char* dest, int64_t len) {
+    const __m256i reverse_lanes = _mm256_setr_epi8(
+        15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+        15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    int64_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+        v = _mm256_shuffle_epi8(complement_avx2(v), reverse_lanes);
+        v = _mm256_permute4x64_epi64(v, 0x4E);
+        _mm256_storeu_si256((__m256i*)(dest + len - i - 32), v);
+    }
+    reverse_complement_scalar(src, dest, len, i);
+}
+
+__attribute__((target("sse4.2")))
+inline void reverse_complement_sse42(const char* src, char* dest, int64_t len) {
+    const __m128i A = _mm_set1_epi8('A'), C = _mm_set1_epi8('C');
+    const __m128i G = _mm_set1_epi8('G'), T = _mm_set1_epi8('T');
+    const __m128i reverse = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    int64_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i r = _mm_blendv_epi8(v, T, _mm_cmpeq_epi8(v, A));
+        r = _mm_blendv_epi8(r, A, _mm_cmpeq_epi8(v, T));
+        r = _mm_blendv_epi8(r, G, _mm_cmpeq_epi8(v, C));
+        r = _mm_blendv_epi8(r, C, _mm_cmpeq_epi8(v, G));
+        _mm_storeu_si128((__m128i*)(dest + len - i - 16), _mm_shuffle_epi8(r, reverse));
+    }
+    reverse_complement_scalar(src, dest, len, i);
+}
+
+#endif // DNA_KERNELS_X86
+
+#ifdef DNA_KERNELS_NEON
+
+inline void make_upper_valid_dna_neon(char* seq, int64_t len) {
+    const uint8x16_t case_mask = vdupq_n_u8(0xDF);
+    const uint8x16_t A = vdupq_n_u8('A'), C = vdupq_n_u8('C');
+    const uint8x16_t G = vdupq_n_u8('G'), T = vdupq_n_u8('T');
+    const uint8x16_t N = vdupq_n_u8('N');
+    int64_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t up = vandq_u8(vld1q_u8((const uint8_t*)(seq + i)), case_mask);
+        uint8x16_t ok = vorrq_u8(vorrq_u8(vceqq_u8(up, A), vceqq_u8(up, C)),
+                                 vorrq_u8(vceqq_u8(up, G), vceqq_u8(up, T)));
+        vst1q_u8((uint8_t*)(seq + i), vbslq_u8(ok, up, N));
+    }
+    make_upper_valid_dna_scalar(seq + i, len - i);
+}
+
+inline void reverse_complement_neon(const char* src, char* dest, int64_t len) {
+    const uint8x16_t A = vdupq_n_u8('A'), C = vdupq_n_u8('C');
+    const uint8x16_t G = vdupq_n_u8('G'), T = vdupq_n_u8('T');
+    int64_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t*)(src + i));
+        uint8x16_t r = vbslq_u8(vceqq_u8(v, A), T, v);
+        r = vbslq_u8(vceqq_u8(v, T), A, r);
+        r = vbslq_u8(vceqq_u8(v, C), G, r);
+        r = vbslq_u8(vceqq_u8(v, G), C, r);
+        r = vrev64q_u8(r);
+        r = vcombine_u8(vget_high_u8(r), vget_low_u8(r));
+        vst1q_u8((uint8_t*)(dest + len - i - 16), r);
+    }
+    reverse_complement_scalar(src, dest, len, i);
+}
+
+#endif // DNA_KERNELS_NEON
+
+using upper_fn_t = void (*)(char*, int64_t);
+using revcomp_fn_t = void (*)(const char*, char*, int64_t);
+
+inline upper_fn_t resolve_make_upper_valid_dna() {
+#if defined(DNA_KERNELS_X86)
+    if (__builtin_cpu_supports("avx2")) return make_upper_valid_dna_avx2;
+    if (__builtin_cpu_supports("sse4.2")) return make_upper_valid_dna_sse42;
+#elif defined(DNA_KERNELS_NEON)
+    return make_upper_valid_dna_neon;
+#endif
+    return make_upper_valid_dna_scalar;
+}
+
+inline revcomp_fn_t resolve_reverse_complement() {
+#if defined(DNA_KERNELS_X86)
+    if (__builtin_cpu_supports("avx2")) return reverse_complement_avx2;
+    if (__builtin_cpu_supports("sse4.2")) return reverse_complement_sse42;
+#elif defined(DNA_KERNELS_NEON)
+    return reverse_complement_neon;
+#endif
+    return [](const char* src, char* dest, int64_t len) { reverse_complement_scalar(src, dest, len); };
+}
+
+/**
+ * Upper-case seq in place, turning every non-ACGT byte into 'N'
+ */
+inline void make_upper_valid_dna(char* seq, int64_t len) {
+    static const upper_fn_t fn = resolve_make_upper_valid_dna();
+    fn(seq, len);
+}
+
+/**
+ * Write the reverse complement of src[0, len) to dest (must not overlap src)
+ */
+inline void reverse_complement(const char* src, char* dest, int64_t len) {
+    static const revcomp_fn_t fn = resolve_reverse_complement();
+    fn(src, dest, len);
+}
+
+} // namespace dna_kernels
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include <htslib/faidx.h>
+
+namespace seqiter {
+
+// Sequence names and lengths of a FASTA's .fai, in file order, with a sorted view of the
+// names so a selection by prefix or by name only looks at the entries it matches
+class fai_names_t {
+public:
+    struct entry_t {
+        std::string name;
+        uint64_t length;
+    };
+
+    // The names of the .fai of fasta, read once and shared by every caller, and read again
+    // only if the .fai changed; null if it does not exist
+    static std::shared_ptr<const fai_names_t> of(const std::string& fasta) {
+        static std::mutex mutex;
+        static std::map<std::string, std::shared_ptr<fai_names_t>> loaded;
+        const std::string fai_name = fasta + ".fai";
+        std::error_code ec;
+        const auto modified = std::filesystem::last_write_time(fai_name, ec);
+        if (ec) {
+            return nullptr;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& names = loaded[fasta];
+        if (!names || names->modified != modified) {
+            std::ifstream in(fai_name);
+            if (!in.good()) {
+                return nullptr;
+            }
+            // callers still holding the old names keep them
+            names.reset(new fai_names_t(in));
+            names->modified = modified;
+        }
+        return names;
+    }
+
+    const std::vector<entry_t>& entries() const { return in_file_order; }
+
+    // File positions of the entries whose name starts with one of prefixes, in file order
+    std::vector<size_t> with_prefixes(const std::vector<std::string>& prefixes) const {
+        std::vector<size_t> selected;
+        for (const auto& prefix : prefixes) {
+            auto it = std::lower_bound(by_name.begin(), by_name.end(), prefix,
+                                       [&](const size_t i, const std::string& p) { return in_file_order[i].name < p; });
+            for (; it != by_name.end() && in_file_order[*it].name.compare(0, prefix.size(), prefix) == 0; ++it) {
+                selected.push_back(*it);
+            }
+        }
+        return in_order(selected);
+    }
+
+    // File positions of the entries named in names, in file order
+    std::vector<size_t> named(const std::unordered_set<std::string>& names) const {
+        std::vector<size_t> selected;
+        for (const auto& name : names) {
+            auto it = std::lower_bound(by_name.begin(), by_name.end(), name,
+                                       [&](const size_t i, const std::string& n) { return in_file_order[i].name < n; });
+            for (; it != by_name.end() && in_file_order[*it].name == name; ++it) {
+                selected.push_back(*it);
+            }
+        }
+        return in_order(selected);
+    }
+
+private:
+    explicit fai_names_t(std::istream& fai) {
+        std::string line;
+        while (std::getline(fai, line)) {
+            const size_t tab = line.find('\t');
+            if (tab == std::string::npos) {
+                continue;
+            }
+            in_file_order.push_back(entry_t{line.substr(0, tab), std::strtoull(line.c_str() + tab + 1, nullptr, 10)});
+        }
+        by_name.resize(in_file_order.size());
+        for (size_t i = 0; i < by_name.size(); ++i) {
+            by_name[i] = i;
+        }
+        std::stable_sort(by_name.begin(), by_name.end(),
+                         [&](const size_t a, const size_t b) { return in_file_order[a].name < in_file_order[b].name; });
+    }
+
+    // Overlapping prefixes may select an entry more than once
+    static std::vector<size_t> in_order(std::vector<size_t>& selected) {
+        std::sort(selected.begin(), selected.end());
+        selected.erase(std::unique(selected.begin(), selected.end()), selected.end());
+        return std::move(selected);
+    }
+
+    std::vector<entry_t> in_file_order;
+    std::vector<size_t> by_name;
+    std::filesystem::file_time_type modified;
+};
+
+// Whether fasta lacks its .fai, or the .gzi it needs if it is compressed
+inline bool fai_missing(const std::string& fasta) {
+    auto ends_with = [&](const std::string& suffix) {
+        return fasta.size() >= suffix.size() && fasta.compare(fasta.size() - suffix.size(), suffix.size(), suffix) == 0;
+    };
+    return !std::filesystem::exists(fasta + ".fai")
+        || ((ends_with(".gz") || ends_with(".bgz")) && !std::filesystem::exists(fasta + ".gzi"));
+}
+
+// Builds the missing .fai, and .gzi of BGZF FASTAs, of fastas, each on a thread of its own
+// as each build is a pass over the whole file; returns the FASTAs that could not be indexed
+inline std::vector<std::string> build_missing_fai(const std::vector<std::string>& fastas) {
+    std::vector<std::string> missing;
+    for (const auto& fasta : fastas) {
+        if (fai_missing(fasta) && std::find(missing.begin(), missing.end(), fasta) == missing.end()) {
+            missing.push_back(fasta);
+        }
+    }
+    std::vector<char> failed(missing.size(), 0);
+    std::vector<std::thread> builders;
+    for (size_t i = 0; i < missing.size(); ++i) {
+        builders.emplace_back([&, i]() { failed[i] = fai_build(missing[i].c_str()) != 0; });
+    }
+    for (auto& builder : builders) {
+        builder.join();
+    }
+    std::vector<std::string> unindexed;
+    for (size_t i = 0; i < missing.size(); ++i) {
+        if (failed[i]) {
+            unindexed.push_back(missing[i]);
+        }
+    }
+    return unindexed;
+}
+
+} // namespace seqiter
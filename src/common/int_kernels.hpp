@@ -0,0 +1,98 @@
+#pragma once
+
+/**
+ * Vectorized reductions over 32-bit integer arrays
+ *
+ * - max_int32: largest value of an array, such as the hit counts swept in L1 mapping
+ *
+ * As in dna_kernels.hpp, AVX2 and SSE4.1 variants are selected at runtime from the
+ * running CPU, so retargetable builds use them too; NEON is used when compiled for AArch64
+ * and the scalar loop is the fallback and handles tails.
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define INT_KERNELS_X86 1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define INT_KERNELS_NEON 1
+#endif
+
+namespace int_kernels {
+
+inline int32_t max_int32_scalar(const int32_t* v, size_t n) {
+    int32_t best = std::numeric_limits<int32_t>::min();
+    for (size_t i = 0; i < n; ++i) {
+        best = std::max(best, v[i]);
+    }
+    return best;
+}
+
+#ifdef INT_KERNELS_X86
+
+__attribute__((target("avx2")))
+inline int32_t max_int32_avx2(const int32_t* v, size_t n) {
+    __m256i best = _mm256_set1_epi32(std::numeric_limits<int32_t>::min());
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        best = _mm256_max_epi32(best, _mm256_loadu_si256((const __m256i*)(v + i)));
+    }
+    __m128i m = _mm_max_epi32(_mm256_castsi256_si128(best), _mm256_extracti128_si256(best, 1));
+    m = _mm_max_epi32(m, _mm_shuffle_epi32(m, 0x4E));
+    m = _mm_max_epi32(m, _mm_shuffle_epi32(m, 0xB1));
+    return std::max<int32_t>(_mm_cvtsi128_si32(m), max_int32_scalar(v + i, n - i));
+}
+
+__attribute__((target("sse4.1")))
+inline int32_t max_int32_sse41(const int32_t* v, size_t n) {
+    __m128i best = _mm_set1_epi32(std::numeric_limits<int32_t>::min());
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        best = _mm_max_epi32(best, _mm_loadu_si128((const __m128i*)(v + i)));
+    }
+    best = _mm_max_epi32(best, _mm_shuffle_epi32(best, 0x4E));
+    best = _mm_max_epi32(best, _mm_shuffle_epi32(best, 0xB1));
+    return std::max<int32_t>(_mm_cvtsi128_si32(best), max_int32_scalar(v + i, n - i));
+}
+
+#endif // INT_KERNELS_X86
+
+#ifdef INT_KERNELS_NEON
+
+inline int32_t max_int32_neon(const int32_t* v, size_t n) {
+    int32x4_t best = vdupq_n_s32(std::numeric_limits<int32_t>::min());
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        best = vmaxq_s32(best, vld1q_s32(v + i));
+    }
+    return std::max<int32_t>(vmaxvq_s32(best), max_int32_scalar(v + i, n - i));
+}
+
+#endif // INT_KERNELS_NEON
+
+using max_fn_t = int32_t (*)(const int32_t*, size_t);
+
+inline max_fn_t resolve_max_int32() {
+#if defined(INT_KERNELS_X86)
+    if (__builtin_cpu_supports("avx2")) return max_int32_avx2;
+    if (__builtin_cpu_supports("sse4.1")) return max_int32_sse41;
+#elif defined(INT_KERNELS_NEON)
+    return max_int32_neon;
+#endif
+    return max_int32_scalar;
+}
+
+/**
+ * Largest of v[0, n), INT32_MIN when n is 0
+ */
+inline int32_t max_int32(const int32_t* v, size_t n) {
+    static const max_fn_t fn = resolve_max_int32();
+    return fn(v, n);
+}
+
+} // namespace int_kernels
@@ -0,0 +1,287 @@
+#pragma once
+
+/**
+ * Interval index of the PAF records of an output, built as they are written
+ *
+ * The writer of the output hands every byte it writes to the index, which notes where
+ * each PAF line starts and the query and target intervals it covers. Once the output is
+ * closed the intervals are sorted and saved, so the records over a region are found
+ * without reading the PAF again. Offsets are from the start of the output; those of a
+ * BGZF output are turned into virtual offsets through its .gzi once it is complete.
+ *
+ * The file is little-endian:
+ *   magic "wfpafidx", version, flags (VIRTUAL_OFFSETS), number of names       4 x uint64
+ *   each name: its length as a uint32, then its bytes
+ *   by target, then by query:
+ *     number of sequences with records                                        uint64
+ *     each: its name's place among the names as a uint32, its number of
+ *     intervals as a uint64, then the intervals sorted by start and end       Interval
+ * The max_end of an interval is the largest end of those up to it, so the ones over
+ * [start, end) are among those before the first starting at end, back to the first
+ * whose max_end is at most start.
+ */
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace interval_index {
+
+static constexpr uint64_t magic = 0x7864696661706677ULL;   // "wfpafidx"
+static constexpr uint64_t version = 1;
+static constexpr uint64_t VIRTUAL_OFFSETS = 1;
+
+struct Interval {
+    int64_t start;
+    int64_t end;
+    int64_t max_end;
+    uint64_t offset;                    // of the line, virtual in a BGZF output
+    uint64_t length;                    // of the line with its newline, uncompressed
+};
+
+class Writer {
+private:
+    struct Record {
+        uint32_t query;
+        uint32_t target;
+        int64_t query_start;
+        int64_t query_end;
+        int64_t target_start;
+        int64_t target_end;
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    struct Block {
+        uint64_t compressed;
+        uint64_t uncompressed;
+    };
+
+    std::unordered_map<std::string, uint32_t> ids;
+    std::vector<std::string> names;
+    std::vector<Record> records;
+    std::string partial;                // line split across the writes
+    std::string key;
+    uint64_t bytes = 0;                 // handed to the index so far
+    uint64_t line_start = 0;            // of the line being written
+
+    uint32_t id(std::string_view name) {
+        key.assign(name);
+        const auto found = ids.find(key);
+        if (found != ids.end()) {
+            return found->second;
+        }
+        names.push_back(key);
+        return ids.emplace(key, uint32_t(names.size() - 1)).first->second;
+    }
+
+    static bool number(std::string_view field, int64_t& value) {
+        const auto [ptr, ec] = std::from_chars(field.data(), field.data() + field.size(), value);
+        return ec == std::errc() && ptr == field.data() + field.size();
+    }
+
+    // Note a PAF line starting at offset; headers and lines that are not PAF are left out
+    void add_line(std::string_view line, uint64_t offset) {
+        if (line.empty() || line[0] == '#' || line[0] == '@') {
+            return;
+        }
+        std::string_view fields[9];
+        size_t count = 0;
+        for (size_t pos = 0; pos < line.size() && count < 9;) {
+            while (pos < line.size() && (line[pos] == '\t' || line[pos] == ' ')) {
+                ++pos;
+            }
+            size_t end = pos;
+            while (end < line.size() && line[end] != '\t' && line[end] != ' ') {
+                ++end;
+            }
+            if (end > pos) {
+                fields[count++] = line.substr(pos, end - pos);
+            }
+            pos = end;
+        }
+        Record record;
+        if (count < 9 || !number(fields[2], record.query_start) || !number(fields[3], record.query_end)
+            || !number(fields[7], record.target_start) || !number(fields[8], record.target_end)) {
+            return;
+        }
+        record.query = id(fields[0]);
+        record.target = id(fields[5]);
+        record.offset = offset;
+        record.length = line.size() + 1;
+        records.push_back(record);
+    }
+
+    template <typename T>
+    static void put(std::ostream& out, const T& value) {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+public:
+    // Index text, the next bytes of the output; a line may be split across calls
+    void add(std::string_view text) {
+        const uint64_t begin = bytes;
+        bytes += text.size();
+        for (size_t pos = 0; pos < text.size();) {
+            const size_t end = text.find('\n', pos);
+            if (end == std::string_view::npos) {
+                partial.append(text.substr(pos));
+                return;
+            }
+            if (partial.empty()) {
+                add_line(text.substr(pos, end - pos), line_start);
+            } else {
+                partial.append(text.substr(pos, end - pos));
+                add_line(partial, line_start);
+                partial.clear();
+            }
+            pos = end + 1;
+            line_start = begin + pos;
+        }
+    }
+
+    uint64_t size() const {
+        return records.size();
+    }
+
+    /**
+     * Save the index to filename; with gzi, the .gzi of the BGZF output, its offsets as
+     * virtual ones. False if the .gzi could not be read or the index written
+     */
+    bool write(const std::string& filename, const std::string& gzi = "") const {
+        std::vector<Block> blocks;
+        if (!gzi.empty()) {
+            // Pairs of compressed and uncompressed offsets of the blocks after the first
+            std::ifstream in(gzi, std::ios::binary);
+            uint64_t count = 0;
+            if (!in.read(reinterpret_cast<char*>(&count), sizeof(count))) {
+                return false;
+            }
+            blocks.resize(count + 1);
+            blocks[0] = {0, 0};
+            if (!in.read(reinterpret_cast<char*>(blocks.data() + 1), count * sizeof(Block))) {
+                return false;
+            }
+        }
+        auto offset = [&](uint64_t uncompressed) {
+            if (blocks.empty()) {
+                return uncompressed;
+            }
+            const auto block = std::prev(std::upper_bound(blocks.begin(), blocks.end(), uncompressed,
+                                                          [](uint64_t u, const Block& b) { return u < b.uncompressed; }));
+            return block->compressed << 16 | (uncompressed - block->uncompressed);
+        };
+
+        std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+        put(out, magic);
+        put(out, version);
+        put(out, uint64_t(blocks.empty() ? 0 : VIRTUAL_OFFSETS));
+        put(out, uint64_t(names.size()));
+        for (const std::string& name : names) {
+            put(out, uint32_t(name.size()));
+            out.write(name.data(), name.size());
+        }
+
+        std::vector<std::pair<uint32_t, Interval>> intervals(records.size());
+        for (const bool by_target : {true, false}) {
+            for (size_t i = 0; i < records.size(); ++i) {
+                const Record& r = records[i];
+                intervals[i] = by_target
+                    ? std::make_pair(r.target, Interval{r.target_start, r.target_end, 0, offset(r.offset), r.length})
+                    : std::make_pair(r.query, Interval{r.query_start, r.query_end, 0, offset(r.offset), r.length});
+            }
+            std::sort(intervals.begin(), intervals.end(), [](const auto& a, const auto& b) {
+                return std::make_tuple(a.first, a.second.start, a.second.end, a.second.offset)
+                    < std::make_tuple(b.first, b.second.start, b.second.end, b.second.offset);
+            });
+            uint64_t sequences = 0;
+            for (size_t i = 0; i < intervals.size(); ++i) {
+                sequences += i == 0 || intervals[i].first != intervals[i - 1].first;
+            }
+            put(out, sequences);
+            for (size_t i = 0; i < intervals.size();) {
+                size_t end = i;
+                int64_t max_end = intervals[i].second.end;
+                for (; end < intervals.size() && intervals[end].first == intervals[i].first; ++end) {
+                    max_end = std::max(max_end, intervals[end].second.end);
+                    intervals[end].second.max_end = max_end;
+                }
+                put(out, intervals[i].first);
+                put(out, uint64_t(end - i));
+                for (; i < end; ++i) {
+                    put(out, intervals[i].second);
+                }
+            }
+        }
+        out.close();
+        return bool(out);
+    }
+};
+
+// Passes what is written on to another streambuf, indexing it as it goes
+class indexing_streambuf : public std::streambuf {
+public:
+    indexing_streambuf(std::streambuf* sink, Writer& index) : sink(sink), index(index) {}
+
+protected:
+    int overflow(int c) override {
+        if (c == traits_type::eof()) {
+            return traits_type::not_eof(c);
+        }
+        const char ch = traits_type::to_char_type(c);
+        if (sink->sputc(ch) == traits_type::eof()) {
+            return traits_type::eof();
+        }
+        index.add(std::string_view(&ch, 1));
+        return c;
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        const std::streamsize written = sink->sputn(s, n);
+        index.add(std::string_view(s, written));
+        return written;
+    }
+
+    int sync() override {
+        return sink->pubsync();
+    }
+
+private:
+    std::streambuf* sink;
+    Writer& index;
+};
+
+// An output stream indexing what it writes to the stream it owns
+class indexed_ostream : public std::ostream {
+public:
+    explicit indexed_ostream(std::unique_ptr<std::ostream> out)
+        : std::ostream(nullptr), out(std::move(out)), buf(this->out->rdbuf(), index) {
+        rdbuf(&buf);
+    }
+
+    std::ostream& inner() {
+        return *out;
+    }
+
+    const Writer& records() const {
+        return index;
+    }
+
+private:
+    std::unique_ptr<std::ostream> out;
+    Writer index;
+    indexing_streambuf buf;
+};
+
+}
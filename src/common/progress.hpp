@@ -1,56 +1,122 @@
 #pragma once
 
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <atomic>
 #include <thread>
 #include <chrono>
+#include <cmath>
 #include <iomanip>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <algorithm>
+#include <functional>
+
+#include "sampling_profiler.hpp"
 
 namespace progress_meter {
 
+// Each thread increments its own counter of a meter, on its own cache line; the counters
+// are only summed when the meter is printed. Threads beyond counter_slots share slots.
+static const size_t counter_slots = 256;
+
+struct alignas(64) PaddedCounter {
+    std::atomic<uint64_t> value{0};
+};
+
+inline size_t thread_slot() {
+    static std::atomic<size_t> next_slot{0};
+    thread_local const size_t slot = next_slot.fetch_add(1, std::memory_order_relaxed) % counter_slots;
+    return slot;
+}
+
+class ProgressMeter;
+
+// One reporter thread for all the meters, started with the first of them, printing those
+// that are running every update interval
+class ProgressService {
+private:
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::vector<ProgressMeter*> meters;
+    std::thread reporter;
+    bool stopping = false;
+    void run();
+
+public:
+    static ProgressService& instance() {
+        static ProgressService service;
+        return service;
+    }
+    void add(ProgressMeter* meter);
+    void remove(ProgressMeter* meter);
+    ~ProgressService() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeup.notify_all();
+        if (reporter.joinable()) {
+            reporter.join();
+        }
+    }
+};
+
 class ProgressMeter {
 private:
     const uint64_t update_interval = 500; // ms between updates
     const uint64_t min_progress_for_update = 1000; // Minimum progress before showing an update
     std::atomic<bool> running;
     std::chrono::time_point<std::chrono::steady_clock> last_update;
+    uint64_t last_completed = 0;
+    size_t status_width = 0;
+    std::unique_ptr<PaddedCounter[]> counters;
+    friend class ProgressService;
+
+    // Called by the reporter thread every poll
+    void poll(const std::chrono::time_point<std::chrono::steady_clock>& now) {
+        auto time_since_update = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_update).count();
+        uint64_t current_completed = completed();
+        if (time_since_update >= update_interval &&
+            (current_completed - last_completed >= min_progress_for_update ||
+             current_completed >= total)) {
+            do_print();
+            last_completed = current_completed;
+            last_update = now;
+        }
+    }
 
 public:
     std::string banner;
     std::atomic<uint64_t> total;
-    std::atomic<uint64_t> completed;
     std::chrono::time_point<std::chrono::steady_clock> start_time;
-    std::thread logger;
-    ProgressMeter(uint64_t _total, const std::string& _banner)
-        : total(_total), banner(_banner), running(true) {
+    const std::function<std::string()> status;  // appended to each line printed, if given; called by the reporter thread
+    ProgressMeter(uint64_t _total, const std::string& _banner, std::function<std::string()> _status = nullptr)
+        : running(true), counters(new PaddedCounter[counter_slots]), banner(_banner), total(_total), status(std::move(_status)) {
         start_time = std::chrono::steady_clock::now();
         last_update = start_time;
-        completed = 0;
-        
-        logger = std::thread([this]() {
-            uint64_t last_completed = 0;
-            
-            while (running.load(std::memory_order_relaxed)) {
-                auto now = std::chrono::steady_clock::now();
-                auto time_since_update = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_update).count();
-                uint64_t current_completed = completed.load(std::memory_order_relaxed);
-                
-                if (time_since_update >= update_interval && 
-                    (current_completed - last_completed >= min_progress_for_update ||
-                     current_completed >= total)) {
-                    do_print();
-                    last_completed = current_completed;
-                    last_update = now;
-                }
-                
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            }
-        });
+        ProgressService::instance().add(this);
     };
+    ProgressMeter(const ProgressMeter&) = delete;
+    ProgressMeter& operator=(const ProgressMeter&) = delete;
+    // Sum of the increments of all threads, total once finished
+    uint64_t completed(void) const {
+        if (!running.load(std::memory_order_relaxed)) {
+            return total;
+        }
+        uint64_t sum = 0;
+        for (size_t i = 0; i < counter_slots; ++i) {
+            sum += counters[i].value.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
     void do_print(void) {
         auto curr = std::chrono::steady_clock::now();
         std::chrono::duration<double> elapsed_seconds = curr-start_time;
+        const uint64_t completed = this->completed();
         double rate = completed / elapsed_seconds.count();
         double seconds_to_completion = (completed > 0 ? (total - completed) / rate : 0);
         std::cerr << "\r" << banner << " "
@@ -63,13 +129,17 @@ public:
                   << "in: " << print_time(elapsed_seconds.count()) << " "
                   << "todo: " << print_time(seconds_to_completion) << " @"
                   << std::setw(4) << std::scientific << rate << "/s";
+        if (status) {
+            // Padded to the longest status yet, to cover what is left of it on the line
+            const std::string text = status();
+            status_width = std::max(status_width, text.size());
+            std::cerr << std::defaultfloat << " " << std::left << std::setw(status_width) << text << std::right;
+        }
     }
     void finish() {
+        // Once removed the reporter no longer prints this meter
+        ProgressService::instance().remove(this);
         running.store(false, std::memory_order_relaxed);
-        if (logger.joinable()) {
-            logger.join();
-        }
-        completed.store(total);
         do_print();
         std::cerr << std::endl;
     }
@@ -95,7 +165,7 @@ public:
         //std::cerr << input_seconds << " seconds is " << days << " days, " << hours << " hours, " << minutes << " minutes, and " << seconds << " seconds." << std::endl;
     }
     void increment(const uint64_t& incr) {
-        completed.fetch_add(incr, std::memory_order_relaxed);
+        counters[thread_slot()].value.fetch_add(incr, std::memory_order_relaxed);
     }
     ~ProgressMeter() {
         if (running.load(std::memory_order_relaxed)) {
@@ -104,4 +174,36 @@ public:
     }
 };
 
+inline void ProgressService::add(ProgressMeter* meter) {
+    std::lock_guard<std::mutex> lock(mutex);
+    meters.push_back(meter);
+    if (!reporter.joinable()) {
+        reporter = std::thread([this]() {
+            sampling_profiler::name_thread("progress", sampling_profiler::OTHER);
+            run();
+        });
+    }
+    wakeup.notify_all();
+}
+
+inline void ProgressService::remove(ProgressMeter* meter) {
+    std::lock_guard<std::mutex> lock(mutex);
+    meters.erase(std::remove(meters.begin(), meters.end(), meter), meters.end());
+}
+
+inline void ProgressService::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+        if (meters.empty()) {
+            wakeup.wait(lock, [this]() { return stopping || !meters.empty(); });
+            continue;
+        }
+        auto now = std::chrono::steady_clock::now();
+        for (auto* meter : meters) {
+            meter->poll(now);
+        }
+        wakeup.wait_for(lock, std::chrono::milliseconds(100));
+    }
+}
+
 }
@@ -0,0 +1,92 @@
+#pragma once
+
+/**
+ * Byte budget of the sequences held in the pipeline queues, shared by mapping and alignment
+ *
+ * A producer acquires the bytes of an item before queueing it and whoever frees the item
+ * releases them, so the budget covers what is queued and what the threads are working on.
+ * Queues still bound their item counts, but set high enough for short sequences to fill
+ * the threads; the budget is what stops long ones from piling up. An item is admitted
+ * while nothing else is held, however large, so no producer waits forever.
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+namespace queue_budget {
+
+class Budget {
+private:
+    std::atomic<uint64_t> limit_bytes{0};
+    std::atomic<uint64_t> used_bytes{0};
+    std::atomic<int> waiters{0};
+    std::mutex mutex;
+    std::condition_variable freed;
+
+    bool admits(uint64_t used, uint64_t bytes) const {
+        const uint64_t limit = limit_bytes.load(std::memory_order_relaxed);
+        return limit == 0 || used == 0 || used + bytes <= limit;
+    }
+
+public:
+    // 0 for no limit
+    void set_limit(uint64_t bytes) {
+        limit_bytes.store(bytes);
+        freed.notify_all();
+    }
+
+    uint64_t limit() const {
+        return limit_bytes.load(std::memory_order_relaxed);
+    }
+
+    uint64_t used() const {
+        return used_bytes.load(std::memory_order_relaxed);
+    }
+
+    // Take bytes if they fit now, false otherwise
+    bool try_acquire(uint64_t bytes) {
+        uint64_t used = used_bytes.load();
+        while (admits(used, bytes)) {
+            if (used_bytes.compare_exchange_weak(used, used + bytes)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Take bytes, waiting for others to be released while they do not fit
+    void acquire(uint64_t bytes) {
+        if (try_acquire(bytes)) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        waiters.fetch_add(1);
+        freed.wait(lock, [&]() { return try_acquire(bytes); });
+        waiters.fetch_sub(1);
+    }
+
+    // Take bytes whether they fit or not, for an item that must be queued anyway
+    void force_acquire(uint64_t bytes) {
+        used_bytes.fetch_add(bytes);
+    }
+
+    void release(uint64_t bytes) {
+        if (bytes == 0) {
+            return;
+        }
+        used_bytes.fetch_sub(bytes);
+        if (waiters.load() > 0) {
+            { std::lock_guard<std::mutex> lock(mutex); }
+            freed.notify_all();
+        }
+    }
+};
+
+inline Budget& shared() {
+    static Budget budget;
+    return budget;
+}
+
+}
@@ -0,0 +1,276 @@
+#pragma once
+
+/**
+ * Sampling profiler of the pipeline stages, usable in release builds
+ *
+ * Once started, SIGPROF interrupts the threads as they use CPU time and the handler counts
+ * the stack it interrupted in a table allocated up front, so nothing is allocated or locked
+ * while sampling. Each thread names itself with name_thread(), which sets its name for the
+ * system tools and the stage its samples count towards; a ScopedStage switches the stage of
+ * the current thread. When stopped, the stacks are symbolized and written per stage as
+ * folded stacks, one "thread;outermost;...;innermost count" line each, for flame graphs.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <csignal>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+namespace sampling_profiler {
+
+enum Stage : int { OTHER, INDEX, MAP, ALIGN, STAGE_COUNT };
+
+static constexpr const char* stage_names[STAGE_COUNT] = {"other", "index", "map", "align"};
+
+static const int max_depth = 64;            // frames kept of each stack
+static const size_t table_size = 1 << 15;   // distinct stacks kept, a power of two
+
+struct StackEntry {
+    std::atomic<uint64_t> key{0};           // hash of the stack, 0 while the entry is free
+    std::atomic<uint64_t> count{0};
+    int stage;
+    const char* role;
+    int depth;
+    void* frames[max_depth];                // innermost first
+};
+
+struct Profiler {
+    std::atomic<bool> sampling{false};
+    std::string prefix;
+    std::unique_ptr<StackEntry[]> table;
+    std::atomic<uint64_t> dropped{0};       // samples of stacks that found the table full
+};
+
+inline Profiler& profiler() {
+    static Profiler p;
+    return p;
+}
+
+struct ThreadInfo {
+    int stage = OTHER;
+    const char* role = "unnamed";
+};
+
+inline ThreadInfo& thread_info() {
+    thread_local ThreadInfo info;
+    return info;
+}
+
+/**
+ * Name the calling thread "wfm-<role>[-<index>]" and count its samples towards stage; role
+ * must outlive the profiler, a string literal
+ */
+inline void name_thread(const char* role, int stage, int index = -1) {
+    ThreadInfo& info = thread_info();
+    info.role = role;
+    info.stage = stage;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    char name[16];      // the system keeps 15 characters
+    if (index >= 0) {
+        snprintf(name, sizeof(name), "wfm-%s-%d", role, index);
+    } else {
+        snprintf(name, sizeof(name), "wfm-%s", role);
+    }
+#if defined(__APPLE__)
+    pthread_setname_np(name);
+#else
+    pthread_setname_np(pthread_self(), name);
+#endif
+}
+
+// Stage of the calling thread, for the threads it starts
+inline int thread_stage() {
+    return thread_info().stage;
+}
+
+/**
+ * Count the samples of the calling thread towards a stage for the scope of the object
+ */
+class ScopedStage {
+private:
+    int previous;
+
+public:
+    explicit ScopedStage(int stage) : previous(thread_info().stage) {
+        thread_info().stage = stage;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+    }
+    ~ScopedStage() {
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        thread_info().stage = previous;
+    }
+    ScopedStage(const ScopedStage&) = delete;
+    ScopedStage& operator=(const ScopedStage&) = delete;
+};
+
+inline void on_sample(int) {
+    Profiler& p = profiler();
+    if (!p.sampling.load(std::memory_order_relaxed)) {
+        return;
+    }
+    const int saved_errno = errno;
+    // The first two frames are this handler and the signal trampoline
+    void* frames[max_depth + 2];
+    const int skip = 2;
+    const int depth = std::max(backtrace(frames, max_depth + 2) - skip, 0);
+    const ThreadInfo& info = thread_info();
+
+    uint64_t key = 0xcbf29ce484222325ULL ^ (uint64_t(info.stage) << 56) ^ reinterpret_cast<uintptr_t>(info.role);
+    for (int i = 0; i < depth; ++i) {
+        key = (key ^ reinterpret_cast<uintptr_t>(frames[i + skip])) * 0x100000001b3ULL;
+    }
+    key = key ? key : 1;
+
+    bool counted = false;
+    for (size_t probe = 0; probe < table_size && !counted; ++probe) {
+        StackEntry& entry = p.table[(key + probe) & (table_size - 1)];
+        uint64_t found = entry.key.load(std::memory_order_relaxed);
+        if (found == 0 && entry.key.compare_exchange_strong(found, key)) {
+            entry.stage = info.stage;
+            entry.role = info.role;
+            entry.depth = depth;
+            std::memcpy(entry.frames, frames + skip, depth * sizeof(void*));
+            found = key;
+        }
+        if (found == key) {
+            entry.count.fetch_add(1, std::memory_order_relaxed);
+            counted = true;
+        }
+    }
+    if (!counted) {
+        p.dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    errno = saved_errno;
+}
+
+/**
+ * Start sampling every thread at hz samples per second of the CPU time it uses; the stacks
+ * are written to <prefix>.<stage>.folded when stopped
+ */
+inline void start(const std::string& prefix, int hz = 99) {
+    Profiler& p = profiler();
+    p.prefix = prefix;
+    p.table.reset(new StackEntry[table_size]);
+    name_thread("main", thread_stage());
+
+    // The first backtrace loads the unwinder, which is not safe in the handler
+    void* warmup[1];
+    backtrace(warmup, 1);
+
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = on_sample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, nullptr);
+    p.sampling.store(true);
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / hz;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+}
+
+inline std::string frame_name(void* address, bool return_address) {
+    // A return address may be just past the end of the calling function
+    void* lookup = return_address ? static_cast<char*>(address) - 1 : address;
+    Dl_info info;
+    if (dladdr(lookup, &info) && info.dli_sname) {
+        int status = 0;
+        char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+        std::string name = status == 0 && demangled ? demangled : info.dli_sname;
+        free(demangled);
+        return name;
+    }
+    char name[64];
+    if (dladdr(lookup, &info) && info.dli_fname) {
+        const char* module = strrchr(info.dli_fname, '/');
+        snprintf(name, sizeof(name), "[%s+0x%lx]", module ? module + 1 : info.dli_fname,
+                 (unsigned long)(static_cast<char*>(lookup) - static_cast<char*>(info.dli_fbase)));
+    } else {
+        snprintf(name, sizeof(name), "[0x%lx]", (unsigned long)reinterpret_cast<uintptr_t>(lookup));
+    }
+    return name;
+}
+
+/**
+ * Stop sampling and write the folded stacks of each stage that has samples
+ * @return  false if a file could not be written
+ */
+inline bool stop() {
+    Profiler& p = profiler();
+    if (!p.sampling.load()) {
+        return true;
+    }
+    struct itimerval timer;
+    std::memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    p.sampling.store(false);
+
+    bool written = true;
+    std::unordered_map<void*, std::string> names[2];
+    auto name_of = [&](void* address, bool return_address) -> const std::string& {
+        auto& cache = names[return_address];
+        auto found = cache.find(address);
+        if (found == cache.end()) {
+            found = cache.emplace(address, frame_name(address, return_address)).first;
+        }
+        return found->second;
+    };
+    for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+        // Stacks through different addresses of the same functions are merged
+        std::map<std::string, uint64_t> stacks;
+        uint64_t samples = 0;
+        for (size_t i = 0; i < table_size; ++i) {
+            const StackEntry& entry = p.table[i];
+            const uint64_t count = entry.count.load();
+            if (count == 0 || entry.stage != stage) {
+                continue;
+            }
+            std::string stack = entry.role;
+            for (int f = entry.depth - 1; f >= 0; --f) {
+                // Only the interrupted frame is not a return address
+                stack += ";" + name_of(entry.frames[f], f > 0);
+            }
+            stacks[stack] += count;
+            samples += count;
+        }
+        if (!stacks.empty()) {
+            const std::string filename = p.prefix + "." + stage_names[stage] + ".folded";
+            std::ofstream out(filename);
+            for (const auto& stack : stacks) {
+                out << stack.first << " " << stack.second << "\n";
+            }
+            out.close();
+            if (out) {
+                std::cerr << "[wfmash] Profile of the " << stage_names[stage] << " stage, " << samples
+                          << " samples, saved to: " << filename << std::endl;
+            } else {
+                written = false;
+            }
+        }
+    }
+    if (p.dropped.load() > 0) {
+        std::cerr << "[wfmash] WARNING, " << p.dropped.load()
+                  << " profile samples dropped once their table was full" << std::endl;
+    }
+    // The table is kept, a sample taken as the timer stopped may still be counting in it
+    return written;
+}
+
+}
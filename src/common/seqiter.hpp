@@ -4,8 +4,26 @@
 #include <functional>
 #include <cassert>
 #include <unordered_set>
+#include <memory>
+#include <cstdlib>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <iterator>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "gzstream.h"
+#include "fai_names.hpp"
+#include "sampling_profiler.hpp"
 #include <htslib/faidx.h>
+#include <htslib/bgzf.h>
 
 namespace seqiter {
 
@@ -15,94 +33,364 @@ bool fai_index_exists(const std::string& filename) {
   return f.good();
 }
 
-void for_each_seq_in_file(
+// A piece of an unindexed FASTA/FASTQ holding whole records, and the records parsed out of
+// it: the bytes at [begin, end), those of text or of a mapped file
+struct seq_block_t {
+    std::string text;
+    const char* begin = nullptr;
+    const char* end = nullptr;
+    std::vector<std::pair<std::string, std::string>> records;
+};
+
+// Moves cut to the end of the whole records at the front of text, looking at what was
+// appended since scanned
+inline void advance_records_end(const std::string& text, const bool fastq, size_t& scanned, uint64_t& lines, size_t& cut) {
+    if (fastq) {
+        // four lines to a record, as '@' may also start a quality line
+        for (size_t i = text.find('\n', scanned); i != std::string::npos; i = text.find('\n', i + 1)) {
+            if (++lines % 4 == 0) {
+                cut = i + 1;
+            }
+        }
+    } else {
+        for (size_t i = text.find("\n>", scanned > 0 ? scanned - 1 : 0); i != std::string::npos; i = text.find("\n>", i + 1)) {
+            cut = i + 1;
+        }
+    }
+    scanned = text.size();
+}
+
+// The end of the line at pos, its newline or end
+inline const char* line_end(const char* pos, const char* end) {
+    const char* eol = static_cast<const char*>(std::memchr(pos, '\n', end - pos));
+    return eol ? eol : end;
+}
+
+// The start of the FASTA record after pos, or end
+inline const char* next_fasta_record(const char* pos, const char* end) {
+    while (pos < end) {
+        const char* eol = line_end(pos, end);
+        if (eol + 1 < end && eol[1] == '>') {
+            return eol + 1;
+        }
+        pos = eol + 1;
+    }
+    return end;
+}
+
+inline void parse_seq_block(
+    seq_block_t& block,
+    const bool fastq,
+    const std::unordered_set<std::string>& keep_seq,
+    const std::string& keep_prefix) {
+    const char* const end = block.end;
+    auto next_line = [&](const char* pos) {
+        return std::min(line_end(pos, end) + 1, end);
+    };
+    const char* pos = block.begin;
+    while (pos < end) {
+        // the header up to its first space, as the line-by-line reader cut it
+        const char* header_end = line_end(pos, end);
+        const char* space = static_cast<const char*>(std::memchr(pos, ' ', header_end - pos));
+        std::string name(pos + 1, space ? space : header_end);
+        const bool keep = (keep_prefix.empty() || name.compare(0, keep_prefix.length(), keep_prefix) == 0)
+            && (keep_seq.empty() || keep_seq.find(name) != keep_seq.end());
+        std::string seq;
+        if (fastq) {
+            const char* seq_begin = next_line(pos);
+            if (keep) {
+                seq.assign(seq_begin, line_end(seq_begin, end));
+            }
+            // skip the delimiter and quality lines
+            pos = next_line(next_line(next_line(seq_begin)));
+        } else {
+            const char* next = next_fasta_record(header_end, end);
+            if (keep && header_end < next) {
+                // each line copied once into place, its newline dropped
+                seq.resize(next - header_end);
+                char* out = &seq[0];
+                for (const char* line = header_end + 1; line < next; ) {
+                    const char* eol = line_end(line, next);
+                    std::memcpy(out, line, eol - line);
+                    out += eol - line;
+                    line = eol + 1;
+                }
+                seq.resize(out - seq.data());
+            }
+            pos = next;
+        }
+        block.records.emplace_back(std::move(name), std::move(seq));
+    }
+    std::string().swap(block.text);
+}
+
+// Parses the blocks read_blocks hands push on the given number of threads, and hands func
+// their sequences in the order they were pushed, on the calling thread; read_blocks runs on
+// a reader thread of its own
+inline void parse_seq_blocks(
+    const bool fastq,
+    const std::unordered_set<std::string>& keep_seq,
+    const std::string& keep_prefix,
+    const int threads,
+    const std::function<void(const std::function<void(seq_block_t*)>&)>& read_blocks,
+    const std::function<void(const std::string&, const std::string&)>& func) {
+
+    const int parsers = std::max(1, threads);
+    const uint64_t max_in_flight = 2 * parsers + 2;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<std::pair<uint64_t, seq_block_t*>> todo;
+    std::map<uint64_t, seq_block_t*> done;
+    uint64_t read_count = 0;
+    uint64_t delivered = 0;
+    bool reading = true;
+
+    auto push_block = [&](seq_block_t* block) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&]() { return read_count - delivered < max_in_flight; });
+        todo.emplace_back(read_count++, block);
+        changed.notify_all();
+    };
+
+    const int stage = sampling_profiler::thread_stage();
+    std::thread reader([&]() {
+        sampling_profiler::name_thread("fasta-in", stage);
+        read_blocks(push_block);
+        std::lock_guard<std::mutex> lock(mutex);
+        reading = false;
+        changed.notify_all();
+    });
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < parsers; ++i) {
+        workers.emplace_back([&, i]() {
+            sampling_profiler::name_thread("fasta", stage, i);
+            while (true) {
+                std::pair<uint64_t, seq_block_t*> job;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    changed.wait(lock, [&]() { return !todo.empty() || !reading; });
+                    if (todo.empty()) {
+                        return;
+                    }
+                    job = todo.front();
+                    todo.pop_front();
+                }
+                parse_seq_block(*job.second, fastq, keep_seq, keep_prefix);
+                std::lock_guard<std::mutex> lock(mutex);
+                done.emplace(job.first, job.second);
+                changed.notify_all();
+            }
+        });
+    }
+
+    while (true) {
+        seq_block_t* block = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&]() { return done.count(delivered) || (!reading && delivered == read_count); });
+            if (!done.count(delivered)) {
+                break;
+            }
+            block = done[delivered];
+            done.erase(delivered);
+        }
+        for (const auto& record : block->records) {
+            func(record.first, record.second);
+        }
+        delete block;
+        std::lock_guard<std::mutex> lock(mutex);
+        ++delivered;
+        changed.notify_all();
+    }
+
+    reader.join();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+// Reads an uncompressed FASTA/FASTQ file of size bytes through a read-only mapping, the
+// blocks handed to the parsers being views of it; false if it cannot be mapped
+inline bool for_each_seq_in_mapped_file(
     const std::string& filename,
+    const size_t size,
     const std::unordered_set<std::string>& keep_seq,
     const std::string& keep_prefix,
+    const int threads,
     const std::function<void(const std::string&, const std::string&)>& func) {
 
-    if ((!keep_seq.empty() || !keep_prefix.empty())
-          && fai_index_exists(filename)) {
-        // Use index
-        // Handle keep_prefix
-        std::unordered_set<std::string> found_seq;
-        auto faid = fai_load(filename.c_str());
-        if (!keep_prefix.empty()) {
-            // iterate over lines in the fai file
-            std::string line;
-            std::ifstream in(filename + ".fai");
-            while (std::getline(in, line)) {
-                std::string name = line.substr(0, line.find("\t"));
-                char* seq;
-                int64_t len = 0;
-                if (strncmp(name.c_str(), keep_prefix.c_str(), keep_prefix.size()) == 0
-                    || keep_seq.find(name) != keep_seq.end()) {
-                    found_seq.insert(name);
-                    seq = faidx_fetch_seq64(
-                        faid, name.c_str(), 0, INT_MAX, &len);
-                    func(name, std::string(seq, len));
-                    free(seq);
-                } else {
-                    func(name, "");
+    static const size_t block_size = 4 << 20;
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    madvise(mapping, size, MADV_SEQUENTIAL);
+    const char* const data = static_cast<const char*>(mapping);
+    const char* const end = data + size;
+    if (data[0] != '>' && data[0] != '@') {
+        std::cerr << "[wfmash::for_each_seq_in_file] unknown file format given to seqiter" << std::endl;
+        assert(false);
+        exit(1);
+    }
+    const bool fastq = data[0] == '@';
+
+    parse_seq_blocks(fastq, keep_seq, keep_prefix, threads, [&](const std::function<void(seq_block_t*)>& push) {
+        for (const char* pos = data; pos < end; ) {
+            const char* cut = std::min(pos + block_size, end);
+            if (fastq) {
+                // four lines to a record, as '@' may also start a quality line
+                cut = pos;
+                for (uint64_t lines = 0; cut < end && (cut - pos < (ptrdiff_t)block_size || lines % 4 != 0); ++lines) {
+                    cut = std::min(line_end(cut, end) + 1, end);
                 }
+            } else if (cut < end) {
+                cut = next_fasta_record(cut - 1, end);
             }
+            auto* block = new seq_block_t;
+            block->begin = pos;
+            block->end = cut;
+            push(block);
+            pos = cut;
         }
-        // Handle keep_seq
-        for (const auto& name : keep_seq) {
-            if (found_seq.find(name) == found_seq.end())
-            {
-                std::cerr << "[wfmash::for_each_seq_in_file] could not fetch " << name << " from index" << std::endl;
+    }, func);
+    munmap(mapping, size);
+    return true;
+}
+
+// Reads an unindexed FASTA/FASTQ, plain, gzip or BGZF, handing func the sequences in file
+// order: a reader thread inflates the file in blocks cut at record boundaries (BGZF on the
+// threads of htslib's pool), the given number of threads parse them, and the calling thread
+// delivers them. A plain file is mapped instead, sparing the copies of reading it in
+inline void for_each_seq_in_stream(
+    const std::string& filename,
+    const std::unordered_set<std::string>& keep_seq,
+    const std::string& keep_prefix,
+    const int threads,
+    const std::function<void(const std::string&, const std::string&)>& func) {
+
+    static const size_t block_size = 4 << 20;
+    BGZF* fp = bgzf_open(filename.c_str(), "r");
+    if (!fp) {
+        std::cerr << "[wfmash::for_each_seq_in_file] could not open " << filename << std::endl;
+        exit(1);
+    }
+    struct stat st;
+    if (bgzf_compression(fp) == 0 && stat(filename.c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        bgzf_close(fp);
+        if (for_each_seq_in_mapped_file(filename, st.st_size, keep_seq, keep_prefix, threads, func)) {
+            return;
+        }
+        fp = bgzf_open(filename.c_str(), "r");
+        if (!fp) {
+            std::cerr << "[wfmash::for_each_seq_in_file] could not open " << filename << std::endl;
+            exit(1);
+        }
+    }
+    if (threads > 1 && bgzf_compression(fp) == 2) {
+        bgzf_mt(fp, threads, 256);
+    }
+
+    // detect file type
+    std::string pending(block_size, '\0');
+    ssize_t n = bgzf_read(fp, &pending[0], block_size);
+    pending.resize(std::max<ssize_t>(n, 0));
+    if (pending.empty() || (pending[0] != '>' && pending[0] != '@')) {
+        std::cerr << "[wfmash::for_each_seq_in_file] unknown file format given to seqiter" << std::endl;
+        assert(false);
+        exit(1);
+    }
+    const bool fastq = pending[0] == '@';
+
+    parse_seq_blocks(fastq, keep_seq, keep_prefix, threads, [&](const std::function<void(seq_block_t*)>& push) {
+        auto push_text = [&](std::string text) {
+            auto* block = new seq_block_t;
+            block->text = std::move(text);
+            block->begin = block->text.data();
+            block->end = block->begin + block->text.size();
+            push(block);
+        };
+        size_t scanned = 0;
+        uint64_t lines = 0;
+        size_t cut = 0;
+        while (true) {
+            advance_records_end(pending, fastq, scanned, lines, cut);
+            if (cut > 0 && pending.size() >= block_size) {
+                std::string rest = pending.substr(cut);
+                pending.resize(cut);
+                push_text(std::move(pending));
+                pending = std::move(rest);
+                scanned = 0;
+                lines = 0;
+                cut = 0;
+                continue;
+            }
+            const size_t size = pending.size();
+            pending.resize(size + block_size);
+            n = bgzf_read(fp, &pending[size], block_size);
+            pending.resize(size + std::max<ssize_t>(n, 0));
+            if (n <= 0) {
+                break;
             }
         }
-        fai_destroy(faid); // Free FAI index
-    } else {
-        // no index available
-        // detect file type
-        bool input_is_fasta = false;
-        bool input_is_fastq = false;
-        std::string line;
-        igzstream in(filename.c_str());
-        std::getline(in, line);
-        if (line[0] == '>') {
-            input_is_fasta = true;
-        } else if (line[0] == '@') {
-            input_is_fastq = true;
-        } else {
-            std::cerr << "[wfmash::for_each_seq_in_file] unknown file format given to seqiter" << std::endl;
-            assert(false);
+        if (n < 0) {
+            std::cerr << "[wfmash::for_each_seq_in_file] failed reading " << filename << std::endl;
             exit(1);
         }
-        if (input_is_fasta) {
-            while (in.good()) {
-                std::string name = line.substr(1, line.find(" ")-1);
-                std::string seq;
-                bool keep = (keep_prefix.empty() || name.substr(0, keep_prefix.length()) == keep_prefix)
-                    && (keep_seq.empty() || keep_seq.find(name) != keep_seq.end());
-                while (std::getline(in, line)) {
-                    if (line[0] == '>') {
-                        // this is the header of the next sequence
-                        break;
-                    } else {
-                        if (keep) {
-                            seq.append(line);
-                        }
-                    }
-                }
-                func(name, seq);
+        if (!pending.empty()) {
+            push_text(std::move(pending));
+        }
+    }, func);
+    bgzf_close(fp);
+}
+
+void for_each_seq_in_file(
+    const std::string& filename,
+    const std::unordered_set<std::string>& keep_seq,
+    const std::string& keep_prefix,
+    const std::function<void(const std::string&, const std::string&)>& func,
+    const int threads = 1) {
+
+    std::shared_ptr<const fai_names_t> names;
+    if ((!keep_seq.empty() || !keep_prefix.empty())
+          && (names = fai_names_t::of(filename))) {
+        // Use index, visiting only the sequences with keep_prefix or named in keep_seq
+        std::vector<size_t> selected = names->named(keep_seq);
+        if (keep_seq.size() > selected.size()) {
+            std::unordered_set<std::string> found_seq;
+            for (const size_t i : selected) {
+                found_seq.insert(names->entries()[i].name);
             }
-        } else if (input_is_fastq) {
-            while (in.good()) {
-                std::string name = line.substr(1, line.find(" ")-1);
-                std::string seq;
-                bool keep = (keep_prefix.empty() || name.substr(0, keep_prefix.length()) == keep_prefix)
-                    && (keep_seq.empty() || keep_seq.find(name) != keep_seq.end());
-                std::getline(in, seq); // sequence
-                std::getline(in, line); // delimiter
-                std::getline(in, line); // quality
-                std::getline(in, line); // next header
-                func(name, keep ? seq : "");
+            for (const auto& name : keep_seq) {
+                if (found_seq.find(name) == found_seq.end())
+                {
+                    std::cerr << "[wfmash::for_each_seq_in_file] could not fetch " << name << " from index" << std::endl;
+                }
             }
         }
+        if (!keep_prefix.empty()) {
+            const std::vector<size_t> with_prefix = names->with_prefixes({keep_prefix});
+            std::vector<size_t> both;
+            std::set_union(selected.begin(), selected.end(), with_prefix.begin(), with_prefix.end(), std::back_inserter(both));
+            selected = std::move(both);
+        }
+        auto faid = fai_load(filename.c_str());
+        for (const size_t i : selected) {
+            const std::string& name = names->entries()[i].name;
+            int64_t len = 0;
+            char* seq = faidx_fetch_seq64(faid, name.c_str(), 0, INT_MAX, &len);
+            func(name, std::string(seq, len));
+            free(seq);
+        }
+        fai_destroy(faid); // Free FAI index
+    } else {
+        // no index available
+        for_each_seq_in_stream(filename, keep_seq, keep_prefix, threads, func);
     }
 }
 
@@ -128,6 +416,26 @@ void for_each_seq_in_file(
     for_each_seq_in_faidx_t(fai, seq_names, func);
     fai_destroy(fai);
 }
+
+// Sequence bytes as malloc'd by htslib, released with free()
+typedef std::unique_ptr<char[], decltype(&std::free)> seq_buffer_t;
+
+// Like for_each_seq_in_file, but hands the fetched buffer itself to func,
+// which takes ownership: the sequence is never copied
+inline void for_each_seq_buffer_in_file(
+    const std::string& filename,
+    const std::vector<std::string>& seq_names,
+    const std::function<void(const std::string&, seq_buffer_t, int64_t)>& func) {
+    faidx_t* fai = fai_load(filename.c_str());
+    for (const auto& seq_name : seq_names) {
+        int64_t len = 0;
+        char* seq = faidx_fetch_seq64(fai, seq_name.c_str(), 0, INT64_MAX, &len);
+        if (seq != nullptr) {
+            func(seq_name, seq_buffer_t(seq, &std::free), len);
+        }
+    }
+    fai_destroy(fai);
+}
 	
 void for_each_seq_in_file_filtered(
     const std::string& filename,
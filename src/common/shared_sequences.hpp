@@ -0,0 +1,177 @@
+#pragma once
+
+/**
+ * Sequences decoded by the mapping, kept 2-bit packed in memory for the alignment
+ *
+ * The sketching of the targets and the reading of the queries hand each whole sequence
+ * they decode to the shared set, which packs it as the packed stores do: uppercased, 4
+ * bases a byte, anything but ACGT kept as runs of N. Sequences are kept while their
+ * packed bytes fit the limit; past it the rest are left to be read from their FASTA, as
+ * are those the mapping never decodes. The aligner takes the sequences of its FASTAs
+ * from the set once the mapping is done.
+ */
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common/dna_kernels.hpp"
+
+namespace shared_sequences {
+
+struct NRun {
+    uint64_t start;
+    uint64_t end;                       // exclusive
+};
+
+struct Packed {
+    uint64_t length = 0;
+    std::vector<uint8_t> bases;         // 4 a byte, the first in the low bits; 0 under N
+    std::vector<NRun> runs;
+
+    uint64_t bytes() const {
+        return sizeof(Packed) + bases.capacity() + runs.capacity() * sizeof(NRun);
+    }
+};
+
+/**
+ * Pack len bases, of a sequence being packed from position from, a multiple of 4, onto
+ * bases and runs; with valid set they are taken as already uppercased and validated
+ */
+inline void pack(const char* seq, int64_t len, uint64_t from, std::vector<uint8_t>& bases,
+                 std::vector<NRun>& runs, size_t runsBegin, bool valid = false) {
+    const size_t begin = bases.size();
+    bases.resize(begin + (len + 3) / 4, 0);
+    uint8_t* packed = bases.data() + begin;
+    for (int64_t j = 0; j < len; ++j) {
+        const char base = valid ? seq[j] : dna_kernels::upper_valid_table[static_cast<uint8_t>(seq[j])];
+        uint8_t code = 0;
+        switch (base) {
+            case 'C': code = 1; break;
+            case 'G': code = 2; break;
+            case 'T': code = 3; break;
+            case 'N':
+                if (runs.size() > runsBegin && runs.back().end == from + j) {
+                    runs.back().end++;
+                } else {
+                    runs.push_back({from + j, from + j + 1});
+                }
+                break;
+            default: break;
+        }
+        packed[j >> 2] |= code << (2 * (j & 3));
+    }
+}
+
+// Pack the len bases of seq whole into packed
+inline void pack(const char* seq, int64_t len, Packed& packed) {
+    packed.length = len;
+    pack(seq, len, 0, packed.bases, packed.runs, 0);
+    packed.runs.shrink_to_fit();
+}
+
+// Decode a packed sequence into out, which has room for its length
+inline void unpack(const Packed& packed, char* out) {
+    static const std::array<std::array<char, 4>, 256> decoded = [] {
+        std::array<std::array<char, 4>, 256> t;
+        for (int b = 0; b < 256; ++b) {
+            for (int i = 0; i < 4; ++i) {
+                t[b][i] = "ACGT"[(b >> (2 * i)) & 3];
+            }
+        }
+        return t;
+    }();
+    const uint64_t whole = packed.length & ~uint64_t(3);
+    for (uint64_t pos = 0; pos < whole; pos += 4) {
+        std::memcpy(out + pos, decoded[packed.bases[pos >> 2]].data(), 4);
+    }
+    for (uint64_t pos = whole; pos < packed.length; ++pos) {
+        out[pos] = "ACGT"[(packed.bases[pos >> 2] >> (2 * (pos & 3))) & 3];
+    }
+    for (const NRun& run : packed.runs) {
+        std::memset(out + run.start, 'N', run.end - run.start);
+    }
+}
+
+typedef std::unordered_map<std::string, std::shared_ptr<const Packed>> Sequences;
+
+class Set {
+private:
+    std::atomic<uint64_t> limit_bytes{0};
+    uint64_t used_bytes = 0;
+    bool full = false;
+    std::mutex mutex;
+    std::unordered_map<std::string, Sequences> files;
+
+    bool has(const std::string& fasta, const std::string& name) {
+        const auto file = files.find(fasta);
+        return file != files.end() && file->second.count(name);
+    }
+
+public:
+    // 0 to keep none
+    void set_limit(uint64_t bytes) {
+        limit_bytes.store(bytes);
+    }
+
+    bool enabled() const {
+        return limit_bytes.load(std::memory_order_relaxed) > 0;
+    }
+
+    // Keep the sequence name of fasta, decoded as the len bases of seq, unless it is kept already
+    void add(const std::string& fasta, const std::string& name, const char* seq, int64_t len) {
+        if (!enabled()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (full || has(fasta, name)) {
+                return;
+            }
+        }
+        auto packed = std::make_shared<Packed>();
+        pack(seq, len, *packed);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (full || has(fasta, name)) {
+            return;
+        }
+        if (used_bytes + packed->bytes() > limit_bytes.load()) {
+            full = true;
+            std::cerr << "[wfmash] Sequences shared with the alignment reached their limit of " << limit_bytes.load()
+                      << " bytes at " << name << ", the rest will be read from their FASTA" << std::endl;
+            return;
+        }
+        used_bytes += packed->bytes();
+        files[fasta].emplace(name, std::move(packed));
+    }
+
+    // The sequences of fasta kept; the set keeps them for whoever takes them next
+    Sequences get(const std::string& fasta) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto file = files.find(fasta);
+        return file != files.end() ? file->second : Sequences();
+    }
+
+    // Drop every sequence kept, once all their users have taken them
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        files.clear();
+        used_bytes = 0;
+        full = false;
+    }
+};
+
+inline Set& shared() {
+    static Set set;
+    return set;
+}
+
+}
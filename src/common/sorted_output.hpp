@@ -0,0 +1,386 @@
+#pragma once
+
+/**
+ * PAF or SAM output sorted by target and position as it is written
+ *
+ * The writer of the output hands the sorter every byte it would write. Lines are gathered
+ * into a chunk of up to half the memory given, which once full is sorted and written to a
+ * run file in the background while the next one fills. At the end the runs are merged
+ * k-way into the output, in parallel passes of at most fanIn runs while there are more,
+ * so the output is written once without a separate sort reading it back. Output that fits
+ * in one chunk is sorted in memory, no run written.
+ *
+ * Lines are ordered by the rank of their target, as the writer ranks the target names,
+ * then by their start on it, then by their bytes, so the order does not depend on the one
+ * they were written in. Lines without a target or position, like unmapped SAM records,
+ * go last.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <ostream>
+#include <queue>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+namespace sorted_output {
+
+// Rank of a target by its name, in the order the output is sorted in
+typedef std::function<uint64_t(std::string_view)> target_rank_t;
+
+static constexpr size_t fanIn = 64;
+
+class Sorter {
+private:
+    struct Key {
+        uint64_t rank;
+        int64_t start;
+    };
+
+    struct Line {
+        Key key;
+        uint64_t offset;                // in the text of its chunk
+        uint64_t length;                // without its newline
+    };
+
+    struct Chunk {
+        std::string text;
+        std::vector<Line> lines;
+    };
+
+    std::string prefix;
+    uint64_t chunkBytes;
+    int threads;
+    bool sam;
+    target_rank_t rank;
+
+    Chunk chunk;
+    std::string partial;                // line split across the writes
+    std::vector<std::string> runs;
+    uint64_t runsCreated = 0;
+    std::unique_ptr<Chunk> spilling;
+    std::thread spiller;
+    std::atomic<bool> failed{false};
+
+    Key key(std::string_view line) const {
+        const size_t nameField = sam ? 2 : 5;
+        const size_t startField = sam ? 3 : 7;
+        std::string_view fields[8];
+        size_t count = 0;
+        for (size_t pos = 0; pos < line.size() && count <= startField;) {
+            size_t end = line.find_first_of(" \t", pos);
+            if (end == std::string_view::npos) {
+                end = line.size();
+            }
+            fields[count++] = line.substr(pos, end - pos);
+            pos = end + 1;
+        }
+        Key k{std::numeric_limits<uint64_t>::max(), std::numeric_limits<int64_t>::max()};
+        if (count > startField && fields[nameField] != "*") {
+            int64_t start = 0;
+            const std::string_view field = fields[startField];
+            if (std::from_chars(field.data(), field.data() + field.size(), start).ec == std::errc()) {
+                k.rank = rank(fields[nameField]);
+                k.start = start;
+            }
+        }
+        return k;
+    }
+
+    static bool before(const Key& a, std::string_view lineA, const Key& b, std::string_view lineB) {
+        return std::tie(a.rank, a.start, lineA) < std::tie(b.rank, b.start, lineB);
+    }
+
+    std::string runName() {
+        return prefix + "." + std::to_string(runsCreated++);
+    }
+
+    void addLine(std::string_view line) {
+        chunk.lines.push_back({key(line), chunk.text.size(), line.size()});
+        chunk.text.append(line);
+        chunk.text += '\n';
+        if (chunk.text.size() + chunk.lines.size() * sizeof(Line) >= chunkBytes) {
+            spill();
+        }
+    }
+
+    // Sort the lines of a chunk, in pieces on the threads merged pairwise
+    void sortChunk(Chunk& c) const {
+        const std::string& text = c.text;
+        auto less = [&](const Line& a, const Line& b) {
+            return before(a.key, std::string_view(text).substr(a.offset, a.length),
+                          b.key, std::string_view(text).substr(b.offset, b.length));
+        };
+        const size_t pieces = std::max<size_t>(1, std::min<size_t>(threads, c.lines.size() / 65536));
+        std::vector<size_t> bounds;
+        for (size_t i = 0; i <= pieces; ++i) {
+            bounds.push_back(c.lines.size() * i / pieces);
+        }
+        auto inParallel = [&](size_t count, const std::function<void(size_t)>& fn) {
+            std::vector<std::thread> workers;
+            for (size_t i = 1; i < count; ++i) {
+                workers.emplace_back(fn, i);
+            }
+            if (count > 0) {
+                fn(0);
+            }
+            for (auto& worker : workers) {
+                worker.join();
+            }
+        };
+        inParallel(pieces, [&](size_t i) {
+            std::sort(c.lines.begin() + bounds[i], c.lines.begin() + bounds[i + 1], less);
+        });
+        for (size_t width = 1; width < pieces; width *= 2) {
+            inParallel((pieces + 2 * width - 1) / (2 * width), [&](size_t i) {
+                const size_t first = 2 * width * i;
+                const size_t middle = std::min(first + width, pieces);
+                const size_t last = std::min(first + 2 * width, pieces);
+                std::inplace_merge(c.lines.begin() + bounds[first], c.lines.begin() + bounds[middle],
+                                   c.lines.begin() + bounds[last], less);
+            });
+        }
+    }
+
+    static void writeChunk(const Chunk& c, std::ostream& out) {
+        for (const Line& line : c.lines) {
+            out.write(c.text.data() + line.offset, line.length + 1);
+        }
+    }
+
+    // Sort the chunk and write it as a run in the background, after the run before
+    void spill() {
+        waitSpill();
+        spilling = std::make_unique<Chunk>(std::move(chunk));
+        chunk = Chunk();
+        const std::string run = runName();
+        runs.push_back(run);
+        spiller = std::thread([this, run]() {
+            sortChunk(*spilling);
+            std::ofstream out(run, std::ios::binary | std::ios::trunc);
+            writeChunk(*spilling, out);
+            out.close();
+            if (!out) {
+                failed = true;
+            }
+            spilling.reset();
+        });
+    }
+
+    void waitSpill() {
+        if (spiller.joinable()) {
+            spiller.join();
+        }
+    }
+
+    // Merge the sorted runs into out, false if one could not be read
+    bool mergeRuns(const std::vector<std::string>& files, std::ostream& out) const {
+        struct Cursor {
+            std::ifstream in;
+            std::string line;
+            Key key;
+        };
+        std::vector<std::unique_ptr<Cursor>> cursors;
+        auto next = [&](Cursor& c) {
+            if (!std::getline(c.in, c.line)) {
+                return false;
+            }
+            c.key = key(c.line);
+            return true;
+        };
+        auto after = [&](size_t a, size_t b) {
+            return before(cursors[b]->key, cursors[b]->line, cursors[a]->key, cursors[a]->line);
+        };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(after)> heap(after);
+        for (const std::string& file : files) {
+            cursors.push_back(std::make_unique<Cursor>());
+            cursors.back()->in.open(file, std::ios::binary);
+            if (!cursors.back()->in) {
+                return false;
+            }
+            if (next(*cursors.back())) {
+                heap.push(cursors.size() - 1);
+            }
+        }
+        while (!heap.empty()) {
+            const size_t i = heap.top();
+            heap.pop();
+            out.write(cursors[i]->line.data(), cursors[i]->line.size());
+            out.put('\n');
+            if (next(*cursors[i])) {
+                heap.push(i);
+            }
+        }
+        for (const auto& cursor : cursors) {
+            if (cursor->in.bad()) {
+                return false;
+            }
+        }
+        return bool(out);
+    }
+
+    void removeRuns() {
+        for (const std::string& run : runs) {
+            std::remove(run.c_str());
+        }
+        runs.clear();
+    }
+
+public:
+    /**
+     * Sort lines of PAF, or SAM if sam, in chunks of up to half of memory bytes, spilled to
+     * run files named from prefix
+     */
+    Sorter(const std::string& prefix, uint64_t memory, int threads, bool sam, target_rank_t rank)
+        : prefix(prefix), chunkBytes(std::max<uint64_t>(memory / 2, 1)), threads(std::max(threads, 1)),
+          sam(sam), rank(std::move(rank)) {}
+
+    ~Sorter() {
+        waitSpill();
+        removeRuns();
+    }
+
+    Sorter(const Sorter&) = delete;
+    Sorter& operator=(const Sorter&) = delete;
+
+    // Take text, the next bytes of the output; a line may be split across calls
+    void add(std::string_view text) {
+        for (size_t pos = 0; pos < text.size();) {
+            const size_t end = text.find('\n', pos);
+            if (end == std::string_view::npos) {
+                partial.append(text.substr(pos));
+                return;
+            }
+            if (partial.empty()) {
+                addLine(text.substr(pos, end - pos));
+            } else {
+                partial.append(text.substr(pos, end - pos));
+                addLine(partial);
+                partial.clear();
+            }
+            pos = end + 1;
+        }
+    }
+
+    /**
+     * Write the lines taken to out in order, false if a run could not be written or read
+     */
+    bool merge(std::ostream& out) {
+        if (!partial.empty()) {
+            addLine(partial);
+            partial.clear();
+        }
+        waitSpill();
+        if (runs.empty()) {
+            sortChunk(chunk);
+            writeChunk(chunk, out);
+            chunk = Chunk();
+            return !failed && bool(out);
+        }
+        if (!chunk.lines.empty()) {
+            spill();
+            waitSpill();
+        }
+        if (failed) {
+            return false;
+        }
+
+        // While there are more runs than are merged at once, groups of them are merged in parallel
+        while (runs.size() > fanIn) {
+            const size_t groups = (runs.size() + fanIn - 1) / fanIn;
+            std::vector<std::string> merged;
+            for (size_t g = 0; g < groups; ++g) {
+                merged.push_back(runName());
+            }
+            std::atomic<size_t> nextGroup{0};
+            std::vector<std::thread> workers;
+            for (int t = 0; t < std::min<int>(threads, groups); ++t) {
+                workers.emplace_back([&]() {
+                    for (size_t g = nextGroup++; g < groups; g = nextGroup++) {
+                        const std::vector<std::string> group(runs.begin() + g * fanIn,
+                                                             runs.begin() + std::min(runs.size(), (g + 1) * fanIn));
+                        std::ofstream run(merged[g], std::ios::binary | std::ios::trunc);
+                        if (!mergeRuns(group, run)) {
+                            failed = true;
+                        }
+                        run.close();
+                        if (!run) {
+                            failed = true;
+                        }
+                    }
+                });
+            }
+            for (auto& worker : workers) {
+                worker.join();
+            }
+            removeRuns();
+            runs = std::move(merged);
+            if (failed) {
+                return false;
+            }
+        }
+        const bool merged = mergeRuns(runs, out);
+        removeRuns();
+        return merged;
+    }
+};
+
+// Hands what is written to a sorter
+class sorting_streambuf : public std::streambuf {
+public:
+    explicit sorting_streambuf(Sorter& sorter) : sorter(sorter) {}
+
+protected:
+    int overflow(int c) override {
+        if (c != traits_type::eof()) {
+            const char ch = traits_type::to_char_type(c);
+            sorter.add(std::string_view(&ch, 1));
+        }
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        sorter.add(std::string_view(s, n));
+        return n;
+    }
+
+private:
+    Sorter& sorter;
+};
+
+// An output stream sorting what it writes to the stream it owns, once finished
+class sorted_ostream : public std::ostream {
+public:
+    sorted_ostream(std::unique_ptr<std::ostream> out, const std::string& prefix, uint64_t memory, int threads,
+                   bool sam, target_rank_t rank)
+        : std::ostream(nullptr), out(std::move(out)), sorter(prefix, memory, threads, sam, std::move(rank)), buf(sorter) {
+        rdbuf(&buf);
+    }
+
+    std::ostream& inner() {
+        return *out;
+    }
+
+    // Write the sorted lines to the inner stream, false if that failed
+    bool finish() {
+        return sorter.merge(*out);
+    }
+
+private:
+    std::unique_ptr<std::ostream> out;
+    Sorter sorter;
+    sorting_streambuf buf;
+};
+
+}
@@ -4,6 +4,7 @@
 #include <string>
 #include <sstream>
 #include "wflign.hpp"
+#include "wflign_record.hpp"
 
 namespace wflign {
 namespace wavefront {
@@ -18,6 +19,29 @@ void write_tag_and_md_string(
     const int64_t target_offset,
     const int64_t target_pointer_shift);
 
+// The SAM record write_alignment_sam writes, formatted into record in one pass over
+// the CIGAR; empty if the alignment is below min_identity
+std::string_view format_alignment_sam(
+    record_buffer_t& record,
+    const alignment_t& patch_aln,
+    const std::string& cigar_str,
+    const std::string& query_name,
+    const uint64_t& query_total_length,
+    const uint64_t& query_offset,
+    const uint64_t& query_length,
+    const bool& query_is_rev,
+    const std::string& target_name,
+    const uint64_t& target_total_length,
+    const uint64_t& target_offset,
+    const uint64_t& target_length,
+    const float& min_identity,
+    const float& mashmap_estimated_identity,
+    const bool& no_seq_in_sam,
+    const bool& emit_md_tag,
+    const char* query,
+    const char* target,
+    const int64_t& target_pointer_shift);
+
 void write_alignment_sam(
     std::ostream &out,
     const alignment_t& patch_aln,
@@ -39,6 +63,26 @@ void write_alignment_sam(
     const char* target,
     const int64_t& target_pointer_shift);
 
+// The PAF record write_alignment_paf writes, without its endline, formatted into record
+// in one pass over the CIGAR; empty if the alignment is not ok or below min_identity
+std::string_view format_alignment_paf(
+    record_buffer_t& record,
+    const alignment_t& aln,
+    const std::string& cigar_str,
+    const std::string& query_name,
+    const uint64_t& query_total_length,
+    const uint64_t& query_offset,
+    const uint64_t& query_length,
+    const bool& query_is_rev,
+    const std::string& target_name,
+    const uint64_t& target_total_length,
+    const uint64_t& target_offset,
+    const uint64_t& target_length,
+    const float& min_identity,
+    const float& mashmap_estimated_identity);
+
+// Write the record of format_alignment_paf to out, or add it to the sink of this thread
+// when it has one; false if there is no record
 bool write_alignment_paf(
     std::ostream& out,
     const alignment_t& aln,
@@ -91,6 +135,7 @@ void write_merged_alignment(
     const uint64_t& min_inversion_length,
     const int& min_wf_length,
     const int& max_dist_threshold,
+    const int& patching_threads,
 #ifdef WFA_PNG_TSV_TIMING
     const std::string* prefix_wavefront_plot_in_png,
     const uint64_t& wfplot_max_size,
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
 #include <string>
+#include <vector>
 
 namespace wflign {
 
@@ -93,4 +96,70 @@ inline char int_as_dna(int i) {
     }
 }
 
+/*
+* A sequence packed 2 bits a base, 32 bases a word, to compare runs of matches a word
+* at a time. Words holding anything but ACGT are flagged and compared on the bases
+* themselves, so the comparisons are exactly those of the characters. The sequence is
+* not copied and must outlive the packing.
+*/
+class packed_dna_t {
+public:
+    packed_dna_t(const char* seq, const uint64_t length) : seq(seq) {
+        words.assign(length / 32 + 2, 0);   // a word of padding for word_at
+        escaped_words.assign(length / 32 + 1, 0);
+        for (uint64_t i = 0; i < length; ++i) {
+            uint64_t code = 0;
+            switch (seq[i]) {
+                case 'A': code = 0; break;
+                case 'C': code = 1; break;
+                case 'G': code = 2; break;
+                case 'T': code = 3; break;
+                default: escaped_words[i >> 5] = 1; break;
+            }
+            words[i >> 5] |= code << (2 * (i & 31));
+        }
+    }
+
+    // number of equal bases from seq[pos] of this and other.seq[other_pos], up to max
+    uint64_t matches(const uint64_t pos, const packed_dna_t& other, const uint64_t other_pos, const uint64_t max) const {
+        uint64_t n = 0;
+        while (n < max) {
+            const uint64_t a = pos + n, b = other_pos + n;
+            const uint64_t len = std::min<uint64_t>(32, max - n);
+            if (escaped(a, len) || other.escaped(b, len)) {
+                for (uint64_t i = 0; i < len; ++i) {
+                    if (seq[a + i] != other.seq[b + i]) {
+                        return n + i;
+                    }
+                }
+            } else {
+                uint64_t diff = word_at(a) ^ other.word_at(b);
+                if (len < 32) {
+                    diff &= (1ULL << (2 * len)) - 1;
+                }
+                if (diff != 0) {
+                    return n + (__builtin_ctzll(diff) >> 1);
+                }
+            }
+            n += len;
+        }
+        return max;
+    }
+
+private:
+    // the 32 bases from pos
+    uint64_t word_at(const uint64_t pos) const {
+        const uint64_t w = pos >> 5, shift = 2 * (pos & 31);
+        return shift == 0 ? words[w] : (words[w] >> shift) | (words[w + 1] << (64 - shift));
+    }
+
+    bool escaped(const uint64_t pos, const uint64_t len) const {
+        return escaped_words[pos >> 5] | escaped_words[(pos + len - 1) >> 5];
+    }
+
+    const char* seq;
+    std::vector<uint64_t> words;
+    std::vector<uint8_t> escaped_words;
+};
+
 }
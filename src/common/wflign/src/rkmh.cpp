@@ -1,125 +1,262 @@
 #include "rkmh.hpp"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RKMH_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define RKMH_NEON 1
+#endif
+
 namespace rkmh {
 
-// Check a string (as a char*) for non-canonical DNA bases
-inline bool canonical(const char *x, int len) {
-    bool trip = false;
-    for (int i = 0; i < len; ++i) {
-        trip |= valid_dna[x[i]];
+// 2-bit code of each base, 4 for anything but ACGT
+static constexpr uint8_t nt2bit(const char c) {
+    switch (c) {
+        case 'A': case 'a': return 0;
+        case 'C': case 'c': return 1;
+        case 'G': case 'g': return 2;
+        case 'T': case 't': return 3;
+        default: return 4;
     }
-    return !trip;
-};
+}
 
-/* Reverse complement the string seq
- * (assumes seq is DNA, and returns non-ACTG letters as-is*/
+// Invertible 64-bit mix (MurmurHash3 finalizer) of a packed k-mer, high half kept
+static inline hash_t mix_packed_kmer(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return (hash_t)(x >> 32);
+}
 
-/* Reverse complement a C string
- * NB: does not check safety of string lengths.
- * NB: ret is modified to hold the reverse complement of seq.
- * */
+// Marks k-mers overlapping a non-ACGT base, or running off the sequence, in a block
+static constexpr hash_t no_hash = std::numeric_limits<hash_t>::max();
 
-inline void reverse_complement(const char *seq, char *ret, int len) {
+kmer_hashes_t::kmer_hashes_t(const char* seq, const uint64_t& length, const uint64_t& k,
+                             const uint64_t& block_size, const uint32_t max_blocks)
+    : seq(seq), length(length), k(std::min<uint64_t>(std::max<uint64_t>(k, 1), 32)),
+      block_size(std::max<uint64_t>(block_size, 1)),
+      max_blocks(std::max<uint32_t>(max_blocks, 1)),
+      slot_of_block((length + this->block_size - 1) / this->block_size, -1),
+      lru(this->max_blocks) {}
+
+const hash_t* kmer_hashes_t::block(const uint64_t& b) {
+    int32_t slot = slot_of_block[b];
+    if (slot < 0) {
+        if (block_of_slot.size() < max_blocks) {
+            slot = (int32_t)block_of_slot.size();
+            block_of_slot.push_back(b);
+            storage.resize(block_of_slot.size() * block_size);
+        } else {
+            slot = lru.least_recent();
+            slot_of_block[block_of_slot[slot]] = -1;
+            block_of_slot[slot] = b;
+        }
+        slot_of_block[b] = slot;
+
+        hash_t* hashes = storage.data() + slot * block_size;
+        std::fill(hashes, hashes + block_size, no_hash);
+        const uint64_t mask = k == 32 ? ~0ULL : (1ULL << (2 * k)) - 1;
+        const uint64_t first = b * block_size;
+        // Roll from the first start of the block until its last k-mer is in the window
+        const uint64_t end = std::min(length, first + block_size + k - 1);
+        uint64_t fwd = 0;
+        uint64_t valid = 0;
+        for (uint64_t p = first; p < end; ++p) {
+            const uint8_t c = nt2bit(seq[p]);
+            if (c > 3) {
+                valid = 0;
+                continue;
+            }
+            fwd = ((fwd << 2) | c) & mask;
+            if (++valid >= k) {
+                hashes[p + 1 - k - first] = mix_packed_kmer(fwd);
+            }
+        }
+    }
+    lru.touch(slot);
+    return storage.data() + slot * block_size;
+}
 
-    //assert(seq != ret);
-    if (ret == nullptr) {
-        ret = new char[len + 1];
+void kmer_hashes_t::sketch(const uint64_t& begin, const uint64_t& len, const uint64_t& sketch_size, sketch_t& out) {
+    out.size = 0;
+    const uint64_t end = std::min(length, begin + len);
+    if (end < begin + k) {
+        return;
+    }
+    // Starts of the k-mers within the range
+    const uint64_t last = end - k;
+    scratch.clear();
+    for (uint64_t b = begin / block_size; b <= last / block_size; ++b) {
+        const hash_t* hashes = block(b);
+        const uint64_t from = std::max(begin, b * block_size) - b * block_size;
+        const uint64_t to = std::min(last, (b + 1) * block_size - 1) - b * block_size;
+        for (uint64_t x = from; x <= to; ++x) {
+            if (hashes[x] != no_hash) {
+                scratch.push_back(hashes[x]);
+            }
+        }
     }
 
-    for (int i = len - 1; i >= 0; i--) {
-        ret[len - 1 - i] = (char) rev_arr[(int) seq[i] - 65];
+    // The s smallest distinct hashes; when repeats leave too few after the partial
+    // selection, fall back to sorting all of them
+    const uint64_t s = std::min<uint64_t>(sketch_size, sketch_t::max_size);
+    auto selected = scratch.end();
+    if (scratch.size() > s) {
+        std::nth_element(scratch.begin(), scratch.begin() + s, scratch.end());
+        std::sort(scratch.begin(), scratch.begin() + s);
+        selected = std::unique(scratch.begin(), scratch.begin() + s);
+        if ((uint64_t)(selected - scratch.begin()) < s) {
+            std::sort(scratch.begin(), scratch.end());
+            selected = std::unique(scratch.begin(), scratch.end());
+        }
+    } else {
+        std::sort(scratch.begin(), scratch.end());
+        selected = std::unique(scratch.begin(), scratch.end());
     }
-    ret[len] = '\0';
-};
+    out.size = std::min<uint64_t>(s, selected - scratch.begin());
+    std::copy(scratch.begin(), scratch.begin() + out.size, out.hashes);
+}
 
-/** Primary calc_hashes function **/
-/** Takes the string to be hashed, its length,
- *  a single kmer size, a pointer to hold the hashes,
- *  and an integer to hold the number of hashes.
- *
- *  Possibly thread safe:
- *      seq, len and k are not modified
- *      new [] operator is known threadsafe
- *      User must handle hashes and numhashes properly in calling function.
- **/
-inline void calc_hashes_(const char *seq, const uint64_t &len,
-                         const uint64_t &k, hash_t *&hashes, int numhashes) {
-    char reverse[k + 1];
-    char rhash[16];
-    char fhash[16];
-    for (int i = 0; i < numhashes; ++i) {
-        if (canonical(seq + i, k)) {
-            MurmurHash3_x64_128(seq + i, k, 42, &fhash);
-            hashes[i] = *((hash_t*)fhash);
-            //std::cerr << "hashes[" << i << "] = " << hashes[i] << std::endl;
+// Room for a sketch and for the block of k-mer hashes behind it per tile held
+uint32_t tile_sketches_t::capacity(const uint64_t& step_size, const int tiles, const uint64_t& max_bytes) {
+    const uint64_t per_tile = sizeof(sketch_t) + step_size * sizeof(hash_t);
+    return (uint32_t)std::max<uint64_t>(4, std::min<uint64_t>(std::max(tiles, 1), max_bytes / per_tile));
+}
+
+tile_sketches_t::tile_sketches_t(const char* seq, const uint64_t& length, const uint64_t& k,
+                                 const uint64_t& step_size, const int tiles, const uint64_t& max_bytes)
+    : max_sketches(capacity(step_size, tiles, max_bytes)),
+      hashes(seq, length, k, step_size, max_sketches),
+      slot_of_tile(std::max(tiles, 0), -1),
+      lru(max_sketches) {}
+
+const sketch_t& tile_sketches_t::get(const int v, const uint64_t& begin, const uint64_t& len, const uint64_t& sketch_size) {
+    int32_t slot = slot_of_tile[v];
+    if (slot < 0) {
+        if (sketches.size() < max_sketches) {
+            slot = (int32_t)sketches.size();
+            sketches.emplace_back();
+            tile_of_slot.push_back(v);
         } else {
-            hashes[i] = std::numeric_limits<hash_t>::max();
+            slot = lru.least_recent();
+            slot_of_tile[tile_of_slot[slot]] = -1;
+            tile_of_slot[slot] = v;
         }
+        slot_of_tile[v] = slot;
+        hashes.sketch(begin, len, sketch_size, sketches[slot]);
     }
-};
-
-/* Calculate all the hashes of the kmers length k of seq */
-inline std::vector<hash_t> calc_hashes(const char *seq,
-                                       const uint64_t& seq_length,
-                                       const uint64_t& k) {
-    int numhashes = seq_length - k;
-    std::vector<hash_t> ret(numhashes);
-    hash_t *hashes = ret.data();
-    calc_hashes_(seq, seq_length, k, hashes, numhashes);
-    return ret;
-};
+    lru.touch(slot);
+    return sketches[slot];
+}
 
 /*
-inline std::vector<hash_t> calc_hashes(const char *seq, const uint64_t &len, const uint64_t& k) {
-    std::vector<hash_t> ret;
-    std::vector<hash_t> t = calc_hashes(seq, len, k);
-    ret.insert(ret.end(), t.begin(), t.end());
-    return ret;
-};
-*/
-
-std::vector<hash_t> hash_sequence(const char* seq,
-                                  const uint64_t& len,
-                                  const uint64_t& k,
-                                  const uint64_t& sketch_size) {
-    std::vector<hash_t> hashes = calc_hashes(seq, len, k);
-    std::sort(hashes.begin(), hashes.end());
-    if (hashes.size() > sketch_size) {
-        hashes.erase(hashes.begin()+sketch_size, hashes.end());
+ * Sorted-set intersection: count the values two ascending, distinct arrays share.
+ *
+ * The vector kernels compare a block of each array against every rotation of the
+ * other's block, then step past whichever block ends lower (both when they end on the
+ * same value); a shared value is seen exactly once. The scalar merge finishes the tails.
+ */
+static uint64_t intersect_scalar(const hash_t* a, uint64_t na, const hash_t* b, uint64_t nb,
+                                 uint64_t i = 0, uint64_t j = 0, uint64_t common = 0) {
+    while (i < na && j < nb) {
+        if (a[i] == b[j]) {
+            ++i;
+            ++j;
+            ++common;
+        } else if (a[i] > b[j]) {
+            ++j;
+        } else {
+            ++i;
+        }
     }
-    // we remove non-canonical hashes which sort last
-    if (hashes.back() == std::numeric_limits<hash_t>::max()) {
-        hashes.erase(std::find(hashes.begin(), hashes.end(),
-                               std::numeric_limits<hash_t>::max()),
-                     hashes.end());
+    return common;
+}
+
+#ifdef RKMH_X86
+
+__attribute__((target("avx2")))
+static uint64_t intersect_avx2(const hash_t* a, uint64_t na, const hash_t* b, uint64_t nb) {
+    uint64_t i = 0, j = 0, common = 0;
+    const __m256i rotate = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+    while (i + 8 <= na && j + 8 <= nb) {
+        const __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i*)(b + j));
+        __m256i eq = _mm256_cmpeq_epi32(va, vb);
+        for (int r = 1; r < 8; ++r) {
+            vb = _mm256_permutevar8x32_epi32(vb, rotate);
+            eq = _mm256_or_si256(eq, _mm256_cmpeq_epi32(va, vb));
+        }
+        common += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(eq)));
+        const hash_t a_max = a[i + 7], b_max = b[j + 7];
+        if (a_max <= b_max) i += 8;
+        if (b_max <= a_max) j += 8;
     }
-    return hashes;
+    return intersect_scalar(a, na, b, nb, i, j, common);
 }
 
-float compare(const std::vector<hash_t>& alpha, const std::vector<hash_t>& beta, const uint64_t& k) {
-    int i = 0;
-    int j = 0;
+__attribute__((target("sse4.2")))
+static uint64_t intersect_sse42(const hash_t* a, uint64_t na, const hash_t* b, uint64_t nb) {
+    uint64_t i = 0, j = 0, common = 0;
+    while (i + 4 <= na && j + 4 <= nb) {
+        const __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        const __m128i vb = _mm_loadu_si128((const __m128i*)(b + j));
+        __m128i eq = _mm_cmpeq_epi32(va, vb);
+        eq = _mm_or_si128(eq, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1))));
+        eq = _mm_or_si128(eq, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))));
+        eq = _mm_or_si128(eq, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3))));
+        common += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(eq)));
+        const hash_t a_max = a[i + 3], b_max = b[j + 3];
+        if (a_max <= b_max) i += 4;
+        if (b_max <= a_max) j += 4;
+    }
+    return intersect_scalar(a, na, b, nb, i, j, common);
+}
 
-    uint64_t common = 0;
-    uint64_t denom = 0;
+#endif // RKMH_X86
 
-    while (i < alpha.size() && j < beta.size()) {
-        if (alpha[i] == beta[j]) {
-            i++;
-            j++;
-            common++;
-        } else if (alpha[i] > beta[j]) {
-            j++;
-        } else {
-            i++;
-        }
+#ifdef RKMH_NEON
 
-        denom++;
+static uint64_t intersect_neon(const hash_t* a, uint64_t na, const hash_t* b, uint64_t nb) {
+    uint64_t i = 0, j = 0, common = 0;
+    while (i + 4 <= na && j + 4 <= nb) {
+        const uint32x4_t va = vld1q_u32(a + i);
+        const uint32x4_t vb = vld1q_u32(b + j);
+        uint32x4_t eq = vceqq_u32(va, vb);
+        eq = vorrq_u32(eq, vceqq_u32(va, vextq_u32(vb, vb, 1)));
+        eq = vorrq_u32(eq, vceqq_u32(va, vextq_u32(vb, vb, 2)));
+        eq = vorrq_u32(eq, vceqq_u32(va, vextq_u32(vb, vb, 3)));
+        common += vaddvq_u32(vshrq_n_u32(eq, 31));
+        const hash_t a_max = a[i + 3], b_max = b[j + 3];
+        if (a_max <= b_max) i += 4;
+        if (b_max <= a_max) j += 4;
     }
+    return intersect_scalar(a, na, b, nb, i, j, common);
+}
+
+#endif // RKMH_NEON
+
+using intersect_fn_t = uint64_t (*)(const hash_t*, uint64_t, const hash_t*, uint64_t);
+
+static intersect_fn_t resolve_intersect() {
+#if defined(RKMH_X86)
+    if (__builtin_cpu_supports("avx2")) return intersect_avx2;
+    if (__builtin_cpu_supports("sse4.2")) return intersect_sse42;
+#elif defined(RKMH_NEON)
+    return intersect_neon;
+#endif
+    return [](const hash_t* a, uint64_t na, const hash_t* b, uint64_t nb) { return intersect_scalar(a, na, b, nb); };
+}
+
+float compare(const sketch_t& alpha, const sketch_t& beta, const uint64_t& k) {
+    static const intersect_fn_t intersect = resolve_intersect();
 
-    // complete the union operation
-    denom += alpha.size() - i;
-    denom += beta.size() - j;
+    const uint64_t common = intersect(alpha.hashes, alpha.size, beta.hashes, beta.size);
+    // Both sketches hold distinct hashes, so this is the size of their union
+    const uint64_t denom = alpha.size + beta.size - common;
 
     float distance = 0.0;
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <deque>
 #include <vector>
 #include <string>
 #include <iostream>
@@ -8,7 +9,6 @@
 #include <unordered_set>
 #include <math.h>
 #include <algorithm>
-#include "murmur3.hpp"
 
 // From Eric's https://github.com/edawson/rkmh
 
@@ -43,11 +43,112 @@ static char rev_arr[26] = {
 
 typedef uint32_t hash_t;
 
-std::vector<hash_t> hash_sequence(const char* seq,
-                                  const uint64_t& len,
-                                  const uint64_t& k,
-                                  const uint64_t& sketch_size);
+/*
+ * Bottom-s MinHash sketch: the smallest distinct k-mer hashes of a sequence, ascending.
+ * Held inline, so making one allocates nothing; sketches asked to be larger keep the
+ * max_size smallest.
+ */
+struct sketch_t {
+    static constexpr uint32_t max_size = 512;
+    uint32_t size = 0;
+    hash_t hashes[max_size];
+};
+
+/*
+ * Least recently used order of a fixed number of slots, as an intrusive list.
+ */
+class lru_slots_t {
+public:
+    explicit lru_slots_t(const uint32_t slots) : prev(slots, -1), next(slots, -1) {}
+
+    // make slot the most recently used one, adding it if not listed yet
+    void touch(const int32_t slot) {
+        if (slot == head) {
+            return;
+        }
+        if (prev[slot] >= 0 || slot == tail) {
+            unlink(slot);
+        }
+        prev[slot] = -1;
+        next[slot] = head;
+        if (head >= 0) {
+            prev[head] = slot;
+        }
+        head = slot;
+        if (tail < 0) {
+            tail = slot;
+        }
+    }
+
+    int32_t least_recent() const { return tail; }
+
+private:
+    void unlink(const int32_t slot) {
+        if (prev[slot] >= 0) next[prev[slot]] = next[slot]; else head = next[slot];
+        if (next[slot] >= 0) prev[next[slot]] = prev[slot]; else tail = prev[slot];
+        prev[slot] = next[slot] = -1;
+    }
+
+    std::vector<int32_t> prev;
+    std::vector<int32_t> next;
+    int32_t head = -1;
+    int32_t tail = -1;
+};
+
+/*
+ * Hashes of the k-mers (k <= 32) of one sequence, rolled over it a block of start
+ * positions at a time on first use. wflambda tiles overlap by half, so each block is
+ * shared by the tiles covering it instead of being hashed again for each. At most
+ * max_blocks blocks are held; the least recently used one makes room for the next.
+ */
+class kmer_hashes_t {
+public:
+    kmer_hashes_t(const char* seq, const uint64_t& length, const uint64_t& k,
+                  const uint64_t& block_size, const uint32_t max_blocks);
+
+    // sketch of the k-mers lying within seq[begin, begin + len)
+    void sketch(const uint64_t& begin, const uint64_t& len, const uint64_t& sketch_size, sketch_t& out);
+
+private:
+    const hash_t* block(const uint64_t& b);
+
+    const char* seq;
+    uint64_t length;
+    uint64_t k;
+    uint64_t block_size;
+    uint32_t max_blocks;
+    std::vector<int32_t> slot_of_block;         // -1 unless held
+    std::vector<uint64_t> block_of_slot;
+    std::vector<hash_t> storage;                // block_size hashes a slot
+    lru_slots_t lru;
+    std::vector<hash_t> scratch;
+};
+
+/*
+ * Sketches of the wflambda tiles along one sequence, by tile index, made on first use.
+ * Sketches and their k-mer hashes fit in max_bytes; once full, the least recently used
+ * sketch is dropped, which keeps the tiles near the diagonals wflambda is extending.
+ */
+class tile_sketches_t {
+public:
+    tile_sketches_t(const char* seq, const uint64_t& length, const uint64_t& k,
+                    const uint64_t& step_size, const int tiles, const uint64_t& max_bytes);
+
+    // sketch of tile v, seq[begin, begin + len), of up to sketch_size hashes; valid
+    // until the next call
+    const sketch_t& get(const int v, const uint64_t& begin, const uint64_t& len, const uint64_t& sketch_size);
+
+private:
+    static uint32_t capacity(const uint64_t& step_size, const int tiles, const uint64_t& max_bytes);
+
+    const uint32_t max_sketches;
+    kmer_hashes_t hashes;
+    std::vector<int32_t> slot_of_tile;          // -1 unless held
+    std::vector<int32_t> tile_of_slot;
+    std::deque<sketch_t> sketches;
+    lru_slots_t lru;
+};
 
-float compare(const std::vector<hash_t>& alpha, const std::vector<hash_t>& beta, const uint64_t& k);
+float compare(const sketch_t& alpha, const sketch_t& beta, const uint64_t& k);
 
 }
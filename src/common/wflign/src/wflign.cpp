@@ -1,5 +1,10 @@
 #include <cassert>
+#include <climits>
 #include <chrono>
+#include <atomic>
+#include <memory>
+#include <string_view>
+#include <thread>
 #include <string>
 
 #include "wflign.hpp"
@@ -15,6 +20,592 @@ namespace wavefront {
 * Configuration
 */
 #define MIN_WF_LENGTH            256
+#define PARALLEL_ANCHOR_K        32     // exact match at each split of a long pair
+#define PARALLEL_ANCHOR_TRIES    256    // query positions tried per split
+#define PARALLEL_ANCHOR_MIN_WINDOW 10000 // target bases searched to either side of the diagonal
+#define MIN_BAND_WIDTH           64     // diagonals a banded alignment starts with to either side
+#define HAMMING_WINDOW           256    // bases within which mismatches count as one cluster
+
+// Gap-affine penalties leave the second piece unset, so it is only compared when used
+static bool same_penalties(const wflign_penalties_t& a, const wflign_penalties_t& b, const bool two_pieces) {
+    return a.mismatch == b.mismatch
+        && a.gap_opening1 == b.gap_opening1
+        && a.gap_extension1 == b.gap_extension1
+        && (!two_pieces || (a.gap_opening2 == b.gap_opening2 && a.gap_extension2 == b.gap_extension2));
+}
+
+wflign_convex_aligner_t& wflign_aligners_t::convex(
+    const wflign_penalties_t& penalties,
+    const wfa::WFAligner::MemoryModel memory_model) {
+    auto& slot = convex_slots[memory_model == wfa::WFAligner::MemoryHigh ? 0 : 1];
+    if (!slot.aligner || !same_penalties(slot.penalties, penalties, true)) {
+        slot.aligner.reset(new wflign_convex_aligner_t(
+            0,  // match
+            penalties.mismatch,
+            penalties.gap_opening1,
+            penalties.gap_extension1,
+            penalties.gap_opening2,
+            penalties.gap_extension2,
+            wfa::WFAligner::Alignment,
+            memory_model));
+        slot.aligner->setHeuristicNone();
+        slot.penalties = penalties;
+    }
+    // Patching caps the steps of the alignment it runs and biWFA may band it or limit its
+    // memory; hand the aligner out uncapped and unbanded
+    slot.aligner->setMaxAlignmentSteps(INT_MAX);
+    slot.aligner->setHeuristicNone();
+    slot.aligner->set_memory_abort(UINT64_MAX);
+    return *slot.aligner;
+}
+
+wfa::WFAlignerGapAffine& wflign_aligners_t::wflambda(const wflign_penalties_t& penalties) {
+    if (!wflambda_slot.aligner || !same_penalties(wflambda_slot.penalties, penalties, false)) {
+        wflambda_slot.aligner.reset(new wfa::WFAlignerGapAffine(
+            penalties.mismatch,
+            penalties.gap_opening1,
+            penalties.gap_extension1,
+            wfa::WFAligner::Alignment,
+            wfa::WFAligner::MemoryUltralow));
+        wflambda_slot.penalties = penalties;
+    }
+    return *wflambda_slot.aligner;
+}
+
+wfa::WFAlignerGapAffine& wflign_aligners_t::segment(const wflign_penalties_t& penalties) {
+    if (!segment_slot.aligner || !same_penalties(segment_slot.penalties, penalties, false)) {
+        segment_slot.aligner.reset(new wfa::WFAlignerGapAffine(
+            penalties.mismatch,
+            penalties.gap_opening1,
+            penalties.gap_extension1,
+            wfa::WFAligner::Alignment,
+            wfa::WFAligner::MemoryHigh));
+        segment_slot.aligner->setHeuristicNone();
+        segment_slot.penalties = penalties;
+    }
+    return *segment_slot.aligner;
+}
+
+wflambda_tile_batch_t& wflign_aligners_t::tile_batch(const wflign_penalties_t& penalties) {
+    if (!tile_batch_slot.aligner || !same_penalties(tile_batch_slot.penalties, penalties, false)) {
+        tile_batch_slot.aligner.reset(new wflambda_tile_batch_t(
+            penalties.mismatch,
+            penalties.gap_opening1,
+            penalties.gap_extension1));
+        tile_batch_slot.penalties = penalties;
+    }
+    return *tile_batch_slot.aligner;
+}
+
+wfa::WFAlignerEdit& wflign_aligners_t::edit_score() {
+    if (!edit_score_aligner) {
+        // Score-only alignments keep only the wavefronts the next steps reach back to
+        edit_score_aligner.reset(new wfa::WFAlignerEdit(wfa::WFAligner::Score, wfa::WFAligner::MemoryHigh));
+        edit_score_aligner->setHeuristicNone();
+    }
+    return *edit_score_aligner;
+}
+
+wflign_aligners_t& wflign_aligners_t::for_this_thread() {
+    static thread_local wflign_aligners_t aligners;
+    return aligners;
+}
+
+/*
+* Score an alignment of the pair is expected to have from the mapping identity, each
+* difference costing a mismatch, plus the gap the length difference forces
+*/
+static double expected_alignment_score(
+    const uint64_t query_length,
+    const uint64_t target_length,
+    const float mashmap_estimated_identity,
+    const wflign_penalties_t& penalties) {
+    const double identity = std::max(0.0, std::min(1.0, (double)mashmap_estimated_identity));
+    const uint64_t length = std::max(query_length, target_length);
+    const uint64_t length_diff = std::max(query_length, target_length) - std::min(query_length, target_length);
+    const double gap_score = length_diff == 0 ? 0 : std::min(
+        penalties.gap_opening1 + (double)length_diff * penalties.gap_extension1,
+        penalties.gap_opening2 + (double)length_diff * penalties.gap_extension2);
+    return (1.0 - identity) * length * penalties.mismatch + gap_score + 1;
+}
+
+/*
+* Wavefront memory a full backtrace (MemoryHigh) alignment of the pair is predicted to
+* need. High memory keeps every wavefront up to the expected score, the one of score s spanning about 2s/e diagonals for
+* gap extension e, or the band_diagonals of a banded alignment if fewer, each with an
+* offset for each of the 5 components.
+*/
+uint64_t predicted_wavefront_memory(
+    const uint64_t query_length,
+    const uint64_t target_length,
+    const float mashmap_estimated_identity,
+    const wflign_penalties_t& penalties,
+    const uint64_t band_diagonals) {
+    const double score = expected_alignment_score(query_length, target_length, mashmap_estimated_identity, penalties);
+    const double gap_extension = std::max(1, std::min(penalties.gap_extension1, penalties.gap_extension2));
+    double diagonals = 2.0 * score / gap_extension + 1;
+    if (band_diagonals > 0) {
+        diagonals = std::min(diagonals, (double)band_diagonals);
+    }
+    const double cells = score * diagonals;
+    return (uint64_t)std::min(cells * 5 * sizeof(int32_t), 1.8e19);
+}
+
+/*
+* Largest score of an alignment of the pair that can still reach min_identity, INT_MAX
+* without a bound. The gap-compressed identity counts each mismatch and each gap as one
+* difference, so the matches, at most the shorter length m, allow (1 - t) / t * m of
+* them. Each is taken to cost the more of a mismatch and a one base gap, plus the gap
+* the length difference forces; alignments whose gaps are longer than that are lost.
+*/
+int max_alignment_score(
+    const uint64_t query_length,
+    const uint64_t target_length,
+    const float min_identity,
+    const wflign_penalties_t& penalties) {
+    if (min_identity <= 0 || min_identity > 1) {
+        return INT_MAX;
+    }
+    const uint64_t shorter = std::min(query_length, target_length);
+    const uint64_t length_diff = std::max(query_length, target_length) - shorter;
+    const double differences = std::ceil((1.0 - min_identity) / min_identity * shorter);
+    const double difference_score = std::max(penalties.mismatch, std::min(
+        penalties.gap_opening1 + penalties.gap_extension1, penalties.gap_opening2 + penalties.gap_extension2));
+    const double gap_score = length_diff == 0 ? 0 : std::min(
+        penalties.gap_opening1 + (double)length_diff * penalties.gap_extension1,
+        penalties.gap_opening2 + (double)length_diff * penalties.gap_extension2);
+    return (int)std::min(differences * difference_score + gap_score + 1, (double)INT_MAX);
+}
+
+/*
+* Half width of the band a banded alignment of the pair starts with, on each side of
+* the diagonals between its start and its end: the drift of a path on which a quarter
+* of the differences the mapping identity predicts are gaps of the same direction.
+*/
+static uint64_t initial_band_width(
+    const uint64_t query_length,
+    const uint64_t target_length,
+    const float mashmap_estimated_identity) {
+    const double identity = std::max(0.0, std::min(1.0, (double)mashmap_estimated_identity));
+    return std::max<uint64_t>(MIN_BAND_WIDTH, std::ceil((1.0 - identity) * std::min(query_length, target_length) / 4));
+}
+
+/*
+* End-to-end biWFA alignment of a pair, in the memory mode its predicted wavefronts
+* allow, as a run-length CIGAR string. False if WFA gave up.
+*
+* Banded, a full backtrace alignment only keeps the diagonals within a band around the
+* ones its start and end lie on, and is done again in a band twice as wide while the
+* path found touches an edge of it, scores worse than the mapping identity predicts or
+* is stopped by the score bound; a band that cut off the best path can leave a worse
+* one away from its edges. BiWFA measures the
+* diagonals of the pieces it splits the pair into from their own start, so a band only
+* applies to the full backtrace; a pair whose band no longer fits the budget is aligned
+* unbanded in ultralow memory.
+*/
+static bool biwfa_cigar(
+    const char* const query,
+    const uint64_t query_length,
+    const char* const target,
+    const uint64_t target_length,
+    const wflign_penalties_t& penalties,
+    const float mashmap_estimated_identity,
+    const uint64_t high_memory_budget,
+    const float min_identity,
+    const bool banded,
+    alignment_budget_t* budget,
+    std::string& cigar_str,
+    biwfa_telemetry_t* telemetry = nullptr) {
+    // Diagonal k is query (text) minus target (pattern) offset, from 0 to end_k
+    const int64_t end_k = (int64_t)query_length - (int64_t)target_length;
+    uint64_t band_width = banded ? initial_band_width(query_length, target_length, mashmap_estimated_identity) : 0;
+
+    // WFA cannot be stopped midway, so under a deadline the score is capped instead, from
+    // twice the expected one, and raised in rounds while the deadline leaves time for the
+    // next, each predicted to take four times the last
+    const int score_bound = max_alignment_score(query_length, target_length, min_identity, penalties);
+    int score_cap = budget && budget->timed()
+        ? (int)std::min<double>(INT_MAX / 2, std::max(1024.0, 2 * expected_alignment_score(query_length, target_length, mashmap_estimated_identity, penalties)))
+        : INT_MAX;
+    for (;;) {
+        if (budget && budget->past_deadline()) {
+            if (telemetry) {
+                telemetry->method = budget->exceeded.load();
+            }
+            return false;
+        }
+        int64_t band_min_k = std::min<int64_t>(0, end_k) - (int64_t)band_width;
+        int64_t band_max_k = std::max<int64_t>(0, end_k) + (int64_t)band_width;
+        if (band_min_k <= -(int64_t)target_length && band_max_k >= (int64_t)query_length) {
+            band_width = 0; // the band covers the whole matrix
+        }
+
+        // Full backtrace is much faster than BiWFA's recomputation for short or similar
+        // pairs, whose wavefronts fit the budget; the others are aligned in ultralow memory
+        const uint64_t predicted = predicted_wavefront_memory(query_length, target_length, mashmap_estimated_identity,
+                                                              penalties, band_width ? band_max_k - band_min_k + 1 : 0);
+        const wfa::WFAligner::MemoryModel memory_model =
+            predicted <= high_memory_budget ? wfa::WFAligner::MemoryHigh : wfa::WFAligner::MemoryUltralow;
+        if (memory_model != wfa::WFAligner::MemoryHigh) {
+            band_width = 0;
+        }
+
+        // Reuse this thread's WFA aligner with the provided penalties
+        wflign_convex_aligner_t& wf_aligner = wflign_aligners_t::for_this_thread().convex(penalties, memory_model);
+        if (band_width > 0) {
+            wf_aligner.setHeuristicBandedStatic((int)band_min_k, (int)band_max_k);
+        }
+        if (budget && budget->memory_bytes > 0) {
+            wf_aligner.set_memory_abort(budget->memory_bytes);
+        }
+
+        // Give up as soon as the score shows the alignment would fall below min_identity
+        wf_aligner.setMaxAlignmentSteps(std::min(score_bound, score_cap));
+
+        // Perform the alignment
+        const auto round_start = std::chrono::steady_clock::now();
+        const int status = wf_aligner.alignEnd2End(target, (int)target_length, query, (int)query_length);
+        if (status == wfa::WFAligner::StatusMaxStepsReached && score_cap < score_bound) {
+            if (std::chrono::steady_clock::now() + 4 * (std::chrono::steady_clock::now() - round_start) > budget->deadline) {
+                budget->exceed("timeout");
+            }
+            score_cap = std::min(INT_MAX / 2, score_cap) * 2;
+            continue;
+        }
+        if (band_width > 0 && status == wfa::WFAligner::StatusMaxStepsReached) {
+            band_width *= 2;
+            continue;
+        }
+        if (status == wfa::WFAligner::StatusOOM && budget) {
+            budget->exceed("memory-limit");
+        }
+        if (telemetry) {
+            telemetry->method = status == wfa::WFAligner::StatusOOM && budget ? "memory-limit"
+                : status == wfa::WFAligner::StatusMaxStepsReached ? "score-bound"
+                : band_width > 0 ? "banded-high"
+                : memory_model == wfa::WFAligner::MemoryHigh ? "biwfa-high" : "biwfa-ultralow";
+            telemetry->pieces = 1;
+            telemetry->score = status == 0 ? wf_aligner.getAlignmentScore() : 0;
+            telemetry->predicted_wavefront_bytes = predicted;
+            telemetry->wavefront_bytes = wf_aligner.wavefront_bytes();
+        }
+        if (status != 0) { // not WF_STATUS_SUCCESSFUL
+            return false;
+        }
+
+        char* cigar_ops;
+        int cigar_length;
+        wf_aligner.getAlignment(&cigar_ops, &cigar_length);
+        if (band_width > 0) {
+            // A path along an edge of the band may have been pushed there by it
+            bool confined = -wf_aligner.getAlignmentScore()
+                > expected_alignment_score(query_length, target_length, mashmap_estimated_identity, penalties);
+            int64_t k = 0;
+            for (int i = 0; i < cigar_length && !confined; ++i) {
+                k += cigar_ops[i] == 'I' ? 1 : cigar_ops[i] == 'D' ? -1 : 0;
+                confined = k <= band_min_k || k >= band_max_k;
+            }
+            if (confined) {
+                band_width *= 2;
+                continue;
+            }
+        }
+
+        // Run-length encode the aligner's CIGAR in place, without copying it per base
+        const wflign_cigar_t cigar = {cigar_ops, 0, cigar_length};
+        cigar_str = wfa_edit_cigar_to_string(cigar);
+        return true;
+    }
+}
+
+/*
+* Append a run-length CIGAR to another, joining the runs of the same operation that
+* meet at the boundary
+*/
+static void append_cigar(std::string& cigar, const std::string& piece) {
+    if (cigar.empty() || piece.empty()) {
+        cigar += piece;
+        return;
+    }
+    size_t first_len_end = 0;
+    while (first_len_end < piece.size() && std::isdigit((unsigned char)piece[first_len_end])) {
+        ++first_len_end;
+    }
+    const char first_op = piece[first_len_end];
+    if (cigar.back() != first_op) {
+        cigar += piece;
+        return;
+    }
+    size_t last_len_begin = cigar.size() - 1;
+    while (last_len_begin > 0 && std::isdigit((unsigned char)cigar[last_len_begin - 1])) {
+        --last_len_begin;
+    }
+    const uint64_t joined = std::stoull(cigar.substr(last_len_begin, cigar.size() - 1 - last_len_begin))
+        + std::stoull(piece.substr(0, first_len_end));
+    cigar.resize(last_len_begin);
+    cigar += std::to_string(joined);
+    cigar += piece.substr(first_len_end);
+}
+
+/*
+* The CIGAR of an alignment seen from its target: the query and target swap, insertions
+* becoming deletions, and with reverse the runs are read from the other end, the target
+* being the one on the reverse strand. The deletions at the ends, which the record trims,
+* are dropped and their bases returned, for the mirror to cover only the target aligned
+*/
+static std::string mirror_cigar(const std::string& cigar, const bool reverse,
+                                uint64_t& leading_deleted, uint64_t& trailing_deleted) {
+    std::vector<std::pair<uint64_t, char>> runs;
+    uint64_t len = 0;
+    for (const char c : cigar) {
+        if (std::isdigit((unsigned char)c)) {
+            len = len * 10 + (c - '0');
+        } else {
+            runs.emplace_back(len, c == 'I' ? 'D' : c == 'D' ? 'I' : c);
+            len = 0;
+        }
+    }
+    size_t begin = 0, end = runs.size();
+    leading_deleted = trailing_deleted = 0;
+    while (begin < end && runs[begin].second == 'I') {
+        leading_deleted += runs[begin++].first;
+    }
+    while (end > begin && runs[end - 1].second == 'I') {
+        trailing_deleted += runs[--end].first;
+    }
+    if (reverse) {
+        std::reverse(runs.begin() + begin, runs.begin() + end);
+    }
+    std::string mirrored;
+    for (size_t i = begin; i < end; ++i) {
+        mirrored += std::to_string(runs[i].first);
+        mirrored += runs[i].second;
+    }
+    return mirrored;
+}
+
+/*
+* Bases the two sequences share at their start, or their end with from_end, up to
+* length; compared a word at a time, the first differing byte being found from the
+* XOR of the words that differ (words are loaded little-endian)
+*/
+static uint64_t exact_match_length(
+    const char* const a,
+    const char* const b,
+    const uint64_t length,
+    const bool from_end) {
+    uint64_t matched = 0;
+    while (matched + sizeof(uint64_t) <= length) {
+        uint64_t x, y;
+        const uint64_t at = from_end ? length - matched - sizeof(uint64_t) : matched;
+        std::memcpy(&x, a + at, sizeof(x));
+        std::memcpy(&y, b + at, sizeof(y));
+        const uint64_t diff = x ^ y;
+        if (diff != 0) {
+            return matched + (from_end ? __builtin_clzll(diff) : __builtin_ctzll(diff)) / 8;
+        }
+        matched += sizeof(uint64_t);
+    }
+    while (matched < length) {
+        const uint64_t at = from_end ? length - matched - 1 : matched;
+        if (a[at] != b[at]) {
+            break;
+        }
+        ++matched;
+    }
+    return matched;
+}
+
+/*
+* Run-length CIGAR of a pair of equal lengths aligned without gaps, when its mismatches
+* are too sparse for gaps to do better: two gaps cost at least as much as the mismatches
+* that fit in their score, so no more than that many may fall within HAMMING_WINDOW
+* bases. False as soon as more do, the pair then being left to WFA.
+*/
+static bool hamming_cigar(
+    const char* const query,
+    const char* const target,
+    const uint64_t length,
+    const wflign_penalties_t& penalties,
+    std::string& cigar_str,
+    uint64_t& mismatches) {
+    const int gap_pair = 2 * std::min(penalties.gap_opening1 + penalties.gap_extension1,
+                                      penalties.gap_opening2 + penalties.gap_extension2);
+    const uint64_t max_cluster = std::max(1, gap_pair / std::max(1, penalties.mismatch));
+    std::vector<uint64_t> recent(max_cluster); // positions of the last mismatches, a ring
+    cigar_str.clear();
+    mismatches = 0;
+    uint64_t run_begin = 0;
+    uint64_t i = 0;
+    while (i < length) {
+        // Matching words are skipped whole
+        uint64_t q, t;
+        if (i + sizeof(uint64_t) <= length) {
+            std::memcpy(&q, query + i, sizeof(q));
+            std::memcpy(&t, target + i, sizeof(t));
+            if (q == t) {
+                i += sizeof(uint64_t);
+                continue;
+            }
+        }
+        if (query[i] == target[i]) {
+            ++i;
+            continue;
+        }
+        uint64_t& oldest = recent[mismatches % max_cluster];
+        if (mismatches >= max_cluster && i - oldest < HAMMING_WINDOW) {
+            return false;
+        }
+        oldest = i;
+        ++mismatches;
+        if (i > run_begin) {
+            cigar_str += std::to_string(i - run_begin) + "=";
+        }
+        uint64_t end = i + 1;
+        while (end < length && query[end] != target[end]) {
+            uint64_t& oldest_in_run = recent[mismatches % max_cluster];
+            if (mismatches >= max_cluster && end - oldest_in_run < HAMMING_WINDOW) {
+                return false;
+            }
+            oldest_in_run = end;
+            ++mismatches;
+            ++end;
+        }
+        cigar_str += std::to_string(end - i) + "X";
+        run_begin = end;
+        i = end;
+    }
+    if (length > run_begin) {
+        cigar_str += std::to_string(length - run_begin) + "=";
+    }
+    return true;
+}
+
+/*
+* Split points of a long pair, (query, target) positions that start an exact match of
+* PARALLEL_ANCHOR_K bases found once in the target window around where the diagonal of
+* the last anchor puts it, about every piece_length query bases, so the window follows
+* the chain of anchors as it drifts off the diagonal of the pair. Both coordinates increase.
+*/
+static std::vector<std::pair<uint64_t, uint64_t>> find_split_anchors(
+    const char* const query,
+    const uint64_t query_length,
+    const char* const target,
+    const uint64_t target_length,
+    const uint64_t piece_length) {
+    std::vector<std::pair<uint64_t, uint64_t>> anchors;
+    const uint64_t window = std::max<uint64_t>(PARALLEL_ANCHOR_MIN_WINDOW, piece_length / 8);
+    const std::string_view target_view(target, target_length);
+    uint64_t last_q = 0, last_t = 0;
+    for (uint64_t b = piece_length; b + piece_length / 2 < query_length; b += piece_length) {
+        for (uint64_t q = b; q < b + PARALLEL_ANCHOR_TRIES && q + PARALLEL_ANCHOR_K <= query_length; ++q) {
+            const std::string_view kmer(query + q, PARALLEL_ANCHOR_K);
+            if (kmer.find('N') != std::string_view::npos) {
+                continue;
+            }
+            const uint64_t expected = last_t + (uint64_t)((double)(q - last_q) * target_length / query_length);
+            const uint64_t lo = std::max(last_t + PARALLEL_ANCHOR_K, expected > window ? expected - window : 0);
+            const uint64_t hi = std::min(target_length, expected + window + PARALLEL_ANCHOR_K);
+            if (lo >= hi || q < last_q + PARALLEL_ANCHOR_K) {
+                continue;
+            }
+            const std::string_view range = target_view.substr(lo, hi - lo);
+            const size_t hit = range.find(kmer);
+            if (hit == std::string_view::npos || range.find(kmer, hit + 1) != std::string_view::npos) {
+                continue;
+            }
+            last_q = q;
+            last_t = lo + hit;
+            anchors.emplace_back(last_q, last_t);
+            break;
+        }
+    }
+    return anchors;
+}
+
+/*
+* Align a long pair as pieces cut at exact-match anchors, on up to `threads` threads,
+* and stitch their CIGARs. Each anchor starts the piece after it, so the pieces tile
+* both sequences and their CIGARs join into one end-to-end alignment; the boundary
+* runs, both matches, are merged. A piece matching exactly between collinear anchors
+* is taken as one match run without aligning it. False if no anchor was found or a piece failed,
+* each piece being bounded by min_identity on its own.
+*/
+static bool parallel_biwfa_cigar(
+    const char* const query,
+    const uint64_t query_length,
+    const char* const target,
+    const uint64_t target_length,
+    const wflign_penalties_t& penalties,
+    const float mashmap_estimated_identity,
+    const uint64_t high_memory_budget,
+    const float min_identity,
+    const bool banded,
+    alignment_budget_t* budget,
+    const uint64_t piece_length,
+    const int threads,
+    std::string& cigar_str,
+    biwfa_telemetry_t* telemetry) {
+    const auto anchors = find_split_anchors(query, query_length, target, target_length, piece_length);
+    if (anchors.empty()) {
+        return false;
+    }
+
+    std::vector<std::pair<uint64_t, uint64_t>> bounds;
+    bounds.emplace_back(0, 0);
+    bounds.insert(bounds.end(), anchors.begin(), anchors.end());
+    bounds.emplace_back(query_length, target_length);
+    const size_t pieces = bounds.size() - 1;
+
+    std::vector<std::string> piece_cigars(pieces);
+    std::vector<char> piece_ok(pieces, 0);
+    std::vector<biwfa_telemetry_t> piece_telemetry(telemetry ? pieces : 0);
+    std::atomic<size_t> next_piece(0);
+    auto align_pieces = [&]() {
+        for (size_t p = next_piece++; p < pieces && !(budget && budget->expired()); p = next_piece++) {
+            const uint64_t piece_query_length = bounds[p + 1].first - bounds[p].first;
+            if (piece_query_length == bounds[p + 1].second - bounds[p].second
+                && std::memcmp(query + bounds[p].first, target + bounds[p].second, piece_query_length) == 0) {
+                piece_cigars[p] = std::to_string(piece_query_length) + "=";
+                piece_ok[p] = true;
+                continue;
+            }
+            piece_ok[p] = biwfa_cigar(
+                query + bounds[p].first, bounds[p + 1].first - bounds[p].first,
+                target + bounds[p].second, bounds[p + 1].second - bounds[p].second,
+                penalties, mashmap_estimated_identity, high_memory_budget, min_identity, banded, budget, piece_cigars[p],
+                telemetry ? &piece_telemetry[p] : nullptr);
+        }
+    };
+    std::vector<std::thread> helpers;
+    for (size_t t = 1; t < std::min<size_t>(std::max(1, threads), pieces); ++t) {
+        helpers.emplace_back(align_pieces);
+    }
+    align_pieces();
+    for (auto& helper : helpers) {
+        helper.join();
+    }
+
+    if (telemetry) {
+        *telemetry = biwfa_telemetry_t();
+        telemetry->method = budget && budget->expired() ? budget->exceeded.load() : "parallel-biwfa";
+        telemetry->pieces = pieces;
+        for (const auto& piece : piece_telemetry) {
+            telemetry->score += piece.score;
+            telemetry->predicted_wavefront_bytes = std::max(telemetry->predicted_wavefront_bytes, piece.predicted_wavefront_bytes);
+            telemetry->wavefront_bytes = std::max(telemetry->wavefront_bytes, piece.wavefront_bytes);
+        }
+    }
+
+    cigar_str.clear();
+    for (size_t p = 0; p < pieces; ++p) {
+        if (!piece_ok[p]) {
+            return false;
+        }
+        append_cigar(cigar_str, piece_cigars[p]);
+    }
+    return true;
+}
 
 void do_biwfa_alignment(
     const std::string& query_name,
@@ -38,26 +629,100 @@ void do_biwfa_alignment(
     const float mashmap_estimated_identity,
     const int32_t chain_id,
     const int32_t chain_length,
-    const int32_t chain_pos) {
-    
-    // Create WFA aligner with the provided penalties
-    wfa::WFAlignerGapAffine2Pieces wf_aligner(
-        0,  // match
-        penalties.mismatch,
-        penalties.gap_opening1,
-        penalties.gap_extension1,
-        penalties.gap_opening2,
-        penalties.gap_extension2,
-        wfa::WFAligner::Alignment,
-        wfa::WFAligner::MemoryUltralow);
-    
-    wf_aligner.setHeuristicNone();
-    
-
-    // Perform the alignment
-    const int status = wf_aligner.alignEnd2End(target, (int)target_length, query, (int)query_length);
-    
-    if (status == 0) { // WF_STATUS_SUCCESSFUL
+    const int32_t chain_pos,
+    const uint64_t high_memory_budget,
+    const uint64_t parallel_min_length,
+    const int parallel_threads,
+    const bool banded,
+    const bool mirror,
+    alignment_budget_t* budget,
+    biwfa_telemetry_t* telemetry) {
+
+    std::string cigar_str;
+    bool aligned = false;
+
+    // Identical or gap-free pairs, common between haplotypes, need no WFA at all
+    uint64_t mismatches = 0;
+    if (query_length == target_length && query_length > 0
+        && hamming_cigar(query, target, query_length, penalties, cigar_str, mismatches)) {
+        aligned = true;
+        if (telemetry) {
+            *telemetry = biwfa_telemetry_t();
+            telemetry->method = mismatches == 0 ? "exact" : "hamming";
+            telemetry->pieces = 1;
+            telemetry->score = -(int64_t)mismatches * penalties.mismatch;
+        }
+    }
+
+    // WFA would extend the exact matches at both ends first, so they are taken as they
+    // are and only the core between them aligned. The core holds all the differences,
+    // so its identities are those of the pair rescaled to its length
+    const uint64_t shorter = std::min(query_length, target_length);
+    const uint64_t prefix = aligned ? 0 : exact_match_length(query, target, shorter, false);
+    const uint64_t suffix = aligned ? 0 : exact_match_length(query + query_length - (shorter - prefix),
+                                                             target + target_length - (shorter - prefix),
+                                                             shorter - prefix, true);
+    const char* const core_query = query + prefix;
+    const char* const core_target = target + prefix;
+    const uint64_t core_query_length = query_length - prefix - suffix;
+    const uint64_t core_target_length = target_length - prefix - suffix;
+    const uint64_t core_shorter = shorter - prefix - suffix;
+    double core_estimated_identity = mashmap_estimated_identity;
+    float core_min_identity = min_identity;
+    if (!aligned && core_shorter > 0 && core_shorter < shorter) {
+        core_estimated_identity = std::max(0.0, 1.0 - (1.0 - core_estimated_identity) * shorter / core_shorter);
+        if (min_identity > 0) {
+            core_min_identity = 1.0 / (1.0 + (1.0 - min_identity) / min_identity * shorter / core_shorter);
+        }
+    }
+
+    std::string core_cigar;
+    if (!aligned && core_shorter == 0) {
+        // What is left is a single gap, or nothing
+        if (core_query_length > 0) {
+            core_cigar = std::to_string(core_query_length) + "I";
+        } else if (core_target_length > 0) {
+            core_cigar = std::to_string(core_target_length) + "D";
+        }
+        aligned = true;
+        if (telemetry) {
+            *telemetry = biwfa_telemetry_t();
+            telemetry->method = "exact";
+            telemetry->pieces = 1;
+            telemetry->score = core_cigar.empty() ? 0 : -std::min(
+                penalties.gap_opening1 + (int64_t)(core_query_length + core_target_length) * penalties.gap_extension1,
+                penalties.gap_opening2 + (int64_t)(core_query_length + core_target_length) * penalties.gap_extension2);
+        }
+    }
+
+    // Long pairs are split at anchors and their pieces aligned, concurrently if threads
+    // allow, falling back to one alignment if they could not be split or a piece fell
+    // below min_identity; a pair that cannot reach min_identity is given up on, unreported.
+    // On one thread the pieces still fit the full backtrace budget where the pair did not
+    if (!aligned && parallel_min_length > 0 && std::max(core_query_length, core_target_length) >= parallel_min_length) {
+        aligned = parallel_biwfa_cigar(core_query, core_query_length, core_target, core_target_length,
+                                       penalties, core_estimated_identity, high_memory_budget, core_min_identity, banded,
+                                       budget, parallel_min_length / 2, parallel_threads, core_cigar, telemetry);
+    }
+    // A pair given up on its budget is left to the caller, which knows from the budget
+    if (!aligned && !(budget && budget->expired())) {
+        aligned = biwfa_cigar(core_query, core_query_length, core_target, core_target_length,
+                              penalties, core_estimated_identity, high_memory_budget, core_min_identity, banded,
+                              budget, core_cigar, telemetry);
+    }
+    if (!aligned && telemetry) {
+        telemetry->method = budget && budget->expired() ? budget->exceeded.load()
+            : std::string(telemetry->method) == "score-bound" ? "score-bound" : "failed";
+    }
+    if (aligned && cigar_str.empty()) {
+        cigar_str = prefix > 0 ? std::to_string(prefix) + "=" : "";
+        append_cigar(cigar_str, core_cigar);
+        if (suffix > 0) {
+            append_cigar(cigar_str, std::to_string(suffix) + "=");
+        }
+    }
+
+    if (aligned) {
         // Create alignment record on stack
         alignment_t aln;
         aln.ok = true;
@@ -66,25 +731,10 @@ void do_biwfa_alignment(
         aln.query_length = query_length;
         aln.target_length = target_length;
         aln.is_rev = false;
-        
-        // Copy alignment CIGAR
-        wflign_edit_cigar_copy(wf_aligner, &aln.edit_cigar);
 
-        // Convert WFA CIGAR to string format for potential swizzling
-        std::string cigar_str = wfa_edit_cigar_to_string(aln.edit_cigar);
-        // Try swizzling the CIGAR at both ends with debug enabled
-
-        std::string swizzled = try_swap_start_pattern(cigar_str, query, target, 0, 0);
-        if (swizzled != cigar_str) {
-            cigar_str = swizzled;
-        } else {
-        }
-
-        swizzled = try_swap_end_pattern(cigar_str, query, target, 0, 0);
-        if (swizzled != cigar_str) {
-            cigar_str = swizzled;
-        } else {
-        }
+        // Try swizzling the CIGAR at both ends, rewriting only the runs there
+        swizzle_cigar_start(cigar_str, query, query_length, target, target_length);
+        swizzle_cigar_end(cigar_str, query, query_length, target, target_length);
 
         // If the CIGAR changed, update coordinates and alignment
         //if (cigar_str != wfa_edit_cigar_to_string(aln.edit_cigar)) {
@@ -98,7 +748,7 @@ void do_biwfa_alignment(
         //wfa_string_to_edit_cigar(cigar_str, &aln.edit_cigar);
         // Write alignment
         if (paf_format_else_sam) {
-            write_alignment_paf(
+            const bool written = write_alignment_paf(
                 out,
                 aln,
                 cigar_str,
@@ -113,6 +763,29 @@ void do_biwfa_alignment(
                 target_length,
                 min_identity,
                 mashmap_estimated_identity);
+            // The pair aligned once stands for both directions of a symmetric all-vs-all;
+            // the mirror is written as if mapped from the target, the strand unchanged
+            if (mirror && written && query_name != target_name) {
+                uint64_t leading_deleted = 0, trailing_deleted = 0;
+                const std::string mirrored = mirror_cigar(cigar_str, query_is_rev, leading_deleted, trailing_deleted);
+                if (!mirrored.empty()) {
+                    write_alignment_paf(
+                        out,
+                        aln,
+                        mirrored,
+                        target_name,
+                        target_total_length,
+                        target_offset + leading_deleted,
+                        target_length - leading_deleted - trailing_deleted,
+                        query_is_rev,
+                        query_name,
+                        query_total_length,
+                        query_offset,
+                        query_length,
+                        min_identity,
+                        mashmap_estimated_identity);
+                }
+            }
         } else {
             // Write SAM output directly
             write_alignment_sam(
@@ -139,6 +812,82 @@ void do_biwfa_alignment(
     }
 }
 
+static void write_stats_paf(
+    std::ostream& out,
+    const std::string& query_name,
+    const uint64_t query_total_length,
+    const uint64_t query_offset,
+    const uint64_t query_length,
+    const bool query_is_rev,
+    const std::string& target_name,
+    const uint64_t target_total_length,
+    const uint64_t target_offset,
+    const uint64_t target_length,
+    const uint64_t matches,
+    const uint64_t block_length,
+    const int64_t distance,
+    const float mashmap_estimated_identity) {
+    const double block_identity = block_length > 0 ? (double)matches / (double)block_length : 0;
+    out << query_name << '\t' << query_total_length
+        << '\t' << query_offset << '\t' << query_offset + query_length
+        << '\t' << (query_is_rev ? '-' : '+')
+        << '\t' << target_name << '\t' << target_total_length
+        << '\t' << target_offset << '\t' << target_offset + target_length
+        << '\t' << matches << '\t' << block_length
+        << '\t' << std::round(float2phred(1.0 - block_identity))
+        << "\tbi:f:" << block_identity
+        << "\tmd:f:" << mashmap_estimated_identity
+        << "\ted:i:" << distance << '\n';
+}
+
+void do_biwfa_stats(
+    const std::string& query_name,
+    const char* const query,
+    const uint64_t query_total_length,
+    const uint64_t query_offset,
+    const uint64_t query_length,
+    const bool query_is_rev,
+    const std::string& target_name,
+    const char* const target,
+    const uint64_t target_total_length,
+    const uint64_t target_offset,
+    const uint64_t target_length,
+    std::ostream& out,
+    const float min_identity,
+    const float mashmap_estimated_identity,
+    const bool mirror,
+    biwfa_telemetry_t* telemetry) {
+    // The estimated block identity is 1 - distance / longer, so min_identity bounds the
+    // distance, and with it the steps the aligner takes
+    const uint64_t longer = std::max(query_length, target_length);
+    const int max_distance = (int)std::min<double>(INT_MAX, std::floor((1.0 - std::max(0.0f, min_identity)) * longer));
+
+    wfa::WFAligner& wf_aligner = wflign_aligners_t::for_this_thread().edit_score();
+    wf_aligner.setMaxAlignmentSteps(std::max(1, max_distance));
+    const int status = wf_aligner.alignEnd2End(target, (int)target_length, query, (int)query_length);
+    const int64_t distance = status == 0 ? std::abs(wf_aligner.getAlignmentScore()) : 0;
+    if (telemetry) {
+        *telemetry = biwfa_telemetry_t();
+        telemetry->method = status == wfa::WFAligner::StatusMaxStepsReached ? "score-bound"
+            : status == 0 ? "edit-score" : "failed";
+        telemetry->pieces = 1;
+        telemetry->score = -distance;
+    }
+    if (status != 0 || distance > max_distance) {
+        return;
+    }
+
+    const uint64_t matches = longer - std::min<uint64_t>(longer, distance);
+    write_stats_paf(out, query_name, query_total_length, query_offset, query_length, query_is_rev,
+                    target_name, target_total_length, target_offset, target_length,
+                    matches, longer, distance, mashmap_estimated_identity);
+    if (mirror && query_name != target_name) {
+        write_stats_paf(out, target_name, target_total_length, target_offset, target_length, query_is_rev,
+                        query_name, query_total_length, query_offset, query_length,
+                        matches, longer, distance, mashmap_estimated_identity);
+    }
+}
+
 /*
 * Configuration
 */
@@ -156,13 +905,6 @@ inline void decode_pair(uint64_t pair, int *v, int *h) {
     *v = (int)(pair >> 32);
     *h = (int)(pair & 0x00000000FFFFFFFF);
 }
-void clean_up_sketches(std::vector<std::vector<rkmh::hash_t>*> &sketches) {
-    // The C++ language guarantees that `delete p` will do nothing if p is equal to NULL
-    for (auto &s : sketches) {
-        delete s;
-        s = nullptr;
-    }
-}
 
 /*
 * Setup
@@ -191,7 +933,8 @@ WFlign::WFlign(
     const int erode_k,
     const int64_t chain_gap,
     const int min_inversion_length,
-    const int max_patching_score) {
+    const int max_patching_score,
+    const uint64_t wflambda_sketch_memory) {
     // Parameters
     this->segment_length = segment_length;
     this->min_identity = min_identity;
@@ -221,6 +964,11 @@ WFlign::WFlign(
     this->chain_gap = chain_gap;
     this->max_patching_score = max_patching_score;
     this->min_inversion_length = min_inversion_length;
+    this->wflambda_sketch_memory = wflambda_sketch_memory;
+    this->aligners = nullptr;
+    this->patching_threads = 1;
+    this->budget = nullptr;
+    this->adaptive_tiles = false;
     // Query
     this->query_name = nullptr;
     this->query = nullptr;
@@ -252,6 +1000,18 @@ WFlign::WFlign(
 /*
 * Output configuration
 */
+void WFlign::set_aligners(wflign_aligners_t* const aligners) {
+    this->aligners = aligners;
+}
+void WFlign::set_patching_threads(const int patching_threads) {
+    this->patching_threads = std::max(1, patching_threads);
+}
+void WFlign::set_budget(alignment_budget_t* const budget) {
+    this->budget = budget;
+}
+void WFlign::set_adaptive_tiles(const bool adaptive_tiles) {
+    this->adaptive_tiles = adaptive_tiles;
+}
 void WFlign::set_output(
     std::ostream* const out,
 #ifdef WFA_PNG_TSV_TIMING
@@ -283,105 +1043,200 @@ void WFlign::set_output(
 /*
 * WFlambda
 */
-int wflambda_extend_match(
+/*
+* Length of the wflambda tiles of a pair, from segment_length: up to four times as long
+* for near identical pairs of about the same length, whose tiles all align, and half as
+* long, down to 64bp, for divergent ones, whose differences a long tile would straddle.
+* The step between tiles is half a tile either way.
+*/
+static uint16_t adaptive_segment_length(
+    const uint16_t segment_length,
+    const float mashmap_estimated_identity,
+    const uint64_t query_length,
+    const uint64_t target_length) {
+    const double identity = mashmap_estimated_identity;
+    const double length_ratio = (double)std::min(query_length, target_length) / std::max<uint64_t>(1, std::max(query_length, target_length));
+    double scale = 1.0;
+    if (identity >= 0.995 && length_ratio >= 0.99) {
+        scale = 4.0;
+    } else if (identity >= 0.98 && length_ratio >= 0.98) {
+        scale = 2.0;
+    } else if (identity < 0.9) {
+        scale = 0.5;
+    }
+    const double length = std::max<double>(std::min<uint16_t>(segment_length, 64), segment_length * scale);
+    return (uint16_t)std::min<double>(UINT16_MAX, length);
+}
+// Bases of the tiles of cell (v,h)
+static void wflambda_tile_extent(
+    const wflign_extend_data_t* const extend_data,
     const int v,
     const int h,
-    void* arguments) {
-    // Extract arguments
-    wflign_extend_data_t* extend_data = (wflign_extend_data_t*)arguments;
-    // Expand arguments
+    int64_t& query_begin,
+    uint16_t& segment_length_to_use_q,
+    int64_t& target_begin,
+    uint16_t& segment_length_to_use_t) {
+    const WFlign& wflign = *(extend_data->wflign);
+    query_begin = v * extend_data->step_size;
+    target_begin = h * extend_data->step_size;
+    // The last fragment can be longer than segment_length_to_use (max 2*segment_length_to_use - 1)
+    segment_length_to_use_q = (v == extend_data->pattern_length - 1)
+            ? wflign.query_length - query_begin : extend_data->segment_length_to_use;
+    segment_length_to_use_t = (h == extend_data->text_length - 1)
+            ? wflign.target_length - target_begin : extend_data->segment_length_to_use;
+}
+// Align the tiles of the uncached cell (v,h) and cache the result as wflambda's
+// answer; a known mismatch was already aligned past its max score by the tile batch
+static bool wflambda_align_tile(
+    const int v,
+    const int h,
+    wflign_extend_data_t* const extend_data,
+    const bool known_mismatch) {
     const WFlign& wflign = *(extend_data->wflign);
-    const uint64_t query_length = wflign.query_length;
-    const uint64_t target_length = wflign.target_length;
-    const int step_size = extend_data->step_size;
-    const int segment_length_to_use = extend_data->segment_length_to_use;
-    const int pattern_length = extend_data->pattern_length;
-    const int text_length = extend_data->text_length;
-    robin_hood::unordered_flat_map<uint64_t,alignment_t*>& alignments = *(extend_data->alignments);
-    std::vector<std::vector<rkmh::hash_t>*>& query_sketches = *(extend_data->query_sketches);
-    std::vector<std::vector<rkmh::hash_t>*>& target_sketches = *(extend_data->target_sketches);
+    wflambda_tile_store_t& alignments = *(extend_data->alignments);
 #ifdef WFA_PNG_TSV_TIMING
     // wfplots
     const bool emit_png = extend_data->emit_png;
     robin_hood::unordered_set<uint64_t>& high_order_dp_matrix_mismatch = *(extend_data->high_order_dp_matrix_mismatch);
 #endif
-    // Check match
+    int64_t query_begin, target_begin;
+    uint16_t segment_length_to_use_q, segment_length_to_use_t;
+    wflambda_tile_extent(extend_data, v, h,
+                         query_begin, segment_length_to_use_q, target_begin, segment_length_to_use_t);
+
     bool is_a_match = false;
-    if (v >= 0 && h >= 0 && v < pattern_length && h < text_length) {
-        const uint64_t k = encode_pair(v, h);
-        const auto f = alignments.find(k); // high-level of WF-inception
-        if (f != alignments.end()) {
-            is_a_match = (alignments[k] != nullptr);
-        } else {
-            const int64_t query_begin = v * step_size;
-            const int64_t target_begin = h * step_size;
-
-            // The last fragment can be longer than segment_length_to_use (max 2*segment_length_to_use - 1)
-            const uint16_t segment_length_to_use_q =
-                    (v == pattern_length - 1) ? query_length - query_begin : segment_length_to_use;
-            const uint16_t segment_length_to_use_t =
-                    (h == text_length - 1) ? target_length - target_begin : segment_length_to_use;
-
-            auto *aln = new alignment_t();
-            const bool alignment_performed =
-                    do_wfa_segment_alignment(
-                            *wflign.query_name,
-                            wflign.query,
-                            query_sketches[v],
-                            wflign.query_length,
-                            query_begin,
-                            *wflign.target_name,
-                            wflign.target,
-                            target_sketches[h],
-                            wflign.target_length,
-                            target_begin,
-                            segment_length_to_use_q,
-                            segment_length_to_use_t,
-                            step_size,
-                            extend_data,
-                            *aln);
+    alignment_t& aln = alignments.next();
+    bool alignment_performed = true;
+    if (known_mismatch) {
+        aln.ok = false;
+    } else {
+        alignment_performed =
+                do_wfa_segment_alignment(
+                        *wflign.query_name,
+                        wflign.query,
+                        *(extend_data->query_sketches),
+                        v,
+                        wflign.query_length,
+                        query_begin,
+                        *wflign.target_name,
+                        wflign.target,
+                        *(extend_data->target_sketches),
+                        h,
+                        wflign.target_length,
+                        target_begin,
+                        segment_length_to_use_q,
+                        segment_length_to_use_t,
+                        extend_data->step_size,
+                        extend_data,
+                        aln);
+    }
 #ifdef WFA_PNG_TSV_TIMING
-            if (wflign.emit_tsv) {
-                // 0) Mis-match, alignment skipped
-                // 1) Mis-match, alignment performed
-                // 2) Match, alignment performed
-                *(wflign.out_tsv) << v << "\t" << h << "\t"
-                                  << (alignment_performed ? (aln->ok ? 2 : 1) : 0)
-                                  << std::endl;
-            }
+    if (wflign.emit_tsv) {
+        // 0) Mis-match, alignment skipped
+        // 1) Mis-match, alignment performed
+        // 2) Match, alignment performed
+        *(wflign.out_tsv) << v << "\t" << h << "\t"
+                          << (alignment_performed ? (aln.ok ? 2 : 1) : 0)
+                          << std::endl;
+    }
 #endif
 #ifdef WFA_PNG_TSV_TIMING
-            ++(extend_data->num_alignments);
+    ++(extend_data->num_alignments);
 #endif
-            if (alignment_performed) {
+    if (alignment_performed) {
 #ifdef WFA_PNG_TSV_TIMING
-                ++(extend_data->num_alignments_performed);
+        ++(extend_data->num_alignments_performed);
 #endif
-                if (aln->ok){
-                    is_a_match = true;
-                    alignments[k] = aln;
-                } else {
-                    alignments[k] = nullptr;
-                }
-            }
+        int32_t& slot = alignments.slot(v, h);
+        if (aln.ok){
+            is_a_match = true;
+            slot = alignments.keep_last();
+        } else {
+            slot = wflambda_tile_store_t::mismatch;
+        }
+    }
 #ifdef WFA_PNG_TSV_TIMING
-            else {
-                if (emit_png) {
-                    // Save only the mismatches, as they are not cached
-                    high_order_dp_matrix_mismatch.insert(encode_pair(v, h));
-                }
-            }
+    else {
+        if (emit_png) {
+            // Save only the mismatches, as they are not cached
+            high_order_dp_matrix_mismatch.insert(encode_pair(v, h));
+        }
+    }
 #endif
-            if (!is_a_match) {
-                delete aln;
-            }
-
-            if (extend_data->num_sketches_allocated > extend_data->max_num_sketches_in_memory) {
-                clean_up_sketches(query_sketches);
-                clean_up_sketches(target_sketches);
-                extend_data->num_sketches_allocated = 0;
-            }
-
+    if (!is_a_match) {
+        alignments.drop_last();
+    }
+    return is_a_match;
+}
+// wflambda asks for the cells of a diagonal one after another while they match, so
+// the uncached cells from (v,h) down the diagonal that pass the mash filter are scored
+// together by the tile batch. Mismatches are cached from their scores; matches are
+// aligned again for their CIGARs. The first cell failing the mash filter ends the run,
+// and is left to be evaluated (and not cached) when asked for, as before.
+static void wflambda_align_diagonal(
+    const int v,
+    const int h,
+    wflign_extend_data_t* const extend_data) {
+    typedef wflambda_tile_batch_t::tile_t tile_t;
+    wflambda_tile_store_t& alignments = *(extend_data->alignments);
+    tile_t tiles[wflambda_tile_batch_t::lanes];
+    int num_tiles = 0;
+    for (int d = 0; d < wflambda_tile_batch_t::lanes; ++d) {
+        const int cell_v = v + d, cell_h = h + d;
+        if (cell_v >= extend_data->pattern_length || cell_h >= extend_data->text_length
+            || alignments.slot(cell_v, cell_h) != wflambda_tile_store_t::unknown) {
+            break;
+        }
+        int64_t query_begin, target_begin;
+        uint16_t segment_length_to_use_q, segment_length_to_use_t;
+        wflambda_tile_extent(extend_data, cell_v, cell_h,
+                             query_begin, segment_length_to_use_q, target_begin, segment_length_to_use_t);
+        const float mash_dist = wfa_segment_mash_dist(
+                *(extend_data->query_sketches), cell_v, query_begin,
+                *(extend_data->target_sketches), cell_h, target_begin,
+                segment_length_to_use_q, segment_length_to_use_t, extend_data);
+        if (mash_dist > extend_data->max_mash_dist_to_evaluate) {
+            break;
+        }
+        tiles[num_tiles++] = {
+                extend_data->target_packed, (uint64_t)target_begin, segment_length_to_use_t,
+                extend_data->query_packed, (uint64_t)query_begin, segment_length_to_use_q,
+                wfa_segment_max_score(segment_length_to_use_q, segment_length_to_use_t, extend_data)};
+    }
+    if (num_tiles < 2) {
+        return; // nothing to batch
+    }
+    int scores[wflambda_tile_batch_t::lanes];
+    extend_data->tile_batch->align(tiles, num_tiles, scores);
+    for (int d = 0; d < num_tiles; ++d) {
+        wflambda_align_tile(v + d, h + d, extend_data, scores[d] < 0);
+    }
+}
+int wflambda_extend_match(
+    const int v,
+    const int h,
+    void* arguments) {
+    // Extract arguments
+    wflign_extend_data_t* extend_data = (wflign_extend_data_t*)arguments;
+    wflambda_tile_store_t& alignments = *(extend_data->alignments);
+    // Check match
+    bool is_a_match = false;
+    if (v >= 0 && h >= 0 && v < extend_data->pattern_length && h < extend_data->text_length) {
+        // Past the budget the tiles left are taken as mismatches, which wflambda crosses
+        // without aligning them, and the alignment is dropped once it is done
+        alignment_budget_t* const budget = extend_data->wflign->budget;
+        if (alignments.slot(v, h) == wflambda_tile_store_t::unknown && budget && budget->past_deadline()) {
+            return false;
+        }
+        // high-level of WF-inception
+        if (alignments.slot(v, h) == wflambda_tile_store_t::unknown && extend_data->tile_batch != nullptr) {
+            wflambda_align_diagonal(v, h, extend_data);
+        }
+        const int32_t slot = alignments.slot(v, h);
+        if (slot != wflambda_tile_store_t::unknown) {
+            is_a_match = (slot != wflambda_tile_store_t::mismatch);
+        } else {
+            is_a_match = wflambda_align_tile(v, h, extend_data, false);
         }
     } else if (h < 0 || v < 0) { // It can be removed using an edit-distance
         // mode as high-level of WF-inception
@@ -391,7 +1246,7 @@ int wflambda_extend_match(
 }
 
 int wflambda_trace_match(
-    robin_hood::unordered_flat_map<uint64_t,alignment_t*>& alignments,
+    wflambda_tile_store_t& alignments,
     wfa::WFAlignerGapAffine& wflambda_aligner,
     std::vector<alignment_t*>& trace,
     const int pattern_length,
@@ -411,8 +1266,7 @@ int wflambda_trace_match(
             case 'X': --v; --h; break;
             case 'M': {
                 // Add alignment to trace
-                uint64_t k = encode_pair(v,h);
-                alignment_t* aln = alignments[k];
+                alignment_t* aln = alignments.tile(alignments.slot(v,h));
                 trace.push_back(aln);
                 aln->keep = true;
                 ++num_alignments;
@@ -485,7 +1339,8 @@ void WFlign::wflign_affine_wavefront(
             target_name, target, target_total_length, target_offset, target_length,
             *out, wfa_convex_penalties, emit_md_tag, paf_format_else_sam, no_seq_in_sam,
             min_identity, wflign_max_len_minor, mashmap_estimated_identity,
-            -1, 1, 1); // Not part of a chain when using direct biWFA
+            -1, 1, 1, // Not part of a chain when using direct biWFA
+            BIWFA_HIGH_MEMORY_BUDGET, 0, 1, false, false, budget);
         return;
     }
 
@@ -561,6 +1416,9 @@ void WFlign::wflign_affine_wavefront(
         max_mash_dist_to_evaluate = wflign_max_mash_dist;
     }
 
+    // Aligners kept across alignments, whose penalties only change with the parameters
+    wflign_aligners_t& wf_aligners = aligners != nullptr ? *aligners : wflign_aligners_t::for_this_thread();
+
     // accumulate runs of matches in reverse order
     // then trim the cigars of successive mappings
     std::vector<alignment_t*> trace;
@@ -570,29 +1428,20 @@ void WFlign::wflign_affine_wavefront(
 
     if (!force_wflign) {
         wfa::WFAlignerGapAffine2Pieces* wf_aligner =
-                new wfa::WFAlignerGapAffine2Pieces(
-                        0,
-                        wfa_convex_penalties.mismatch,
-                        wfa_convex_penalties.gap_opening1,
-                        wfa_convex_penalties.gap_extension1,
-                        wfa_convex_penalties.gap_opening2,
-                        wfa_convex_penalties.gap_extension2,
-                        wfa::WFAligner::Alignment,
-                        wfa::WFAligner::MemoryUltralow);
-        wf_aligner->setHeuristicNone();
-        
+                &wf_aligners.convex(wfa_convex_penalties, wfa::WFAligner::MemoryUltralow);
+
         const int status = wf_aligner->alignEnd2End(target,(int)target_length,query,(int)query_length);
 
-        auto *aln = new alignment_t();
-        aln->j = 0;
-        aln->i = 0;
+        alignment_t aln;
+        aln.j = 0;
+        aln.i = 0;
 
-        aln->ok = (status == 0); // WF_ALIGN_SUCCESSFUL
+        aln.ok = (status == 0); // WF_ALIGN_SUCCESSFUL
 
         // fill the alignment info if we aligned
-        if (aln->ok) {
-            aln->query_length = query_length;
-            aln->target_length = target_length;
+        if (aln.ok) {
+            aln.query_length = query_length;
+            aln.target_length = target_length;
     #ifdef VALIDATE_WFA_WFLIGN
             if (!validate_cigar(wf_aligner->cigar, query, target,
                         segment_length_q, segment_length_t, aln.j, aln.i)) {
@@ -611,7 +1460,7 @@ void WFlign::wflign_affine_wavefront(
             }
     #endif
 
-            wflign_edit_cigar_copy(*wf_aligner,&aln->edit_cigar);
+            wflign_edit_cigar_copy(*wf_aligner,&aln.edit_cigar);
 
     #ifdef VALIDATE_WFA_WFLIGN
             if (!validate_cigar(aln.edit_cigar, query, target, segment_length_q,
@@ -623,7 +1472,7 @@ void WFlign::wflign_affine_wavefront(
     #endif
         }
 
-        trace.push_back(aln);
+        trace.push_back(&aln);
 
 #ifdef WFA_PNG_TSV_TIMING
         const long elapsed_time_wflambda_ms =
@@ -631,23 +1480,7 @@ void WFlign::wflign_affine_wavefront(
                         std::chrono::steady_clock::now() - start_time).count();
 #endif
 
-
-        // Free old aligner
-        delete wf_aligner;
-
-        // use biWFA for all patching
-        wf_aligner =
-                new wfa::WFAlignerGapAffine2Pieces(
-                        0,
-                        wfa_convex_penalties.mismatch,
-                        wfa_convex_penalties.gap_opening1,
-                        wfa_convex_penalties.gap_extension1,
-                        wfa_convex_penalties.gap_opening2,
-                        wfa_convex_penalties.gap_extension2,
-                        wfa::WFAligner::Alignment,
-                        wfa::WFAligner::MemoryUltralow);
-        wf_aligner->setHeuristicNone();
-
+        // use biWFA for all patching, reusing the aligner now its CIGAR is copied
         // write a merged alignment
         write_merged_alignment(
                 *out,
@@ -682,7 +1515,8 @@ void WFlign::wflign_affine_wavefront(
                 max_patching_score,
                 min_inversion_length,
                 MIN_WF_LENGTH,
-                wf_max_dist_threshold
+                wf_max_dist_threshold,
+                patching_threads
 #ifdef WFA_PNG_TSV_TIMING
                 ,
                 prefix_wavefront_plot_in_png,
@@ -691,9 +1525,6 @@ void WFlign::wflign_affine_wavefront(
                 out_patching_tsv
 #endif
                 );
-
-        // Free biWFA aligner
-        delete wf_aligner;
     } else {
 #ifdef WFA_PNG_TSV_TIMING
         if (emit_tsv) {
@@ -708,10 +1539,13 @@ void WFlign::wflign_affine_wavefront(
         }
 #endif
 
+        const uint16_t tile_length = adaptive_tiles
+                ? adaptive_segment_length(segment_length, mashmap_estimated_identity, query_length, target_length)
+                : segment_length;
         const uint16_t segment_length_to_use =
-                (query_length < segment_length || target_length < segment_length)
+                (query_length < tile_length || target_length < tile_length)
                 ? std::min(query_length, target_length)
-                : segment_length;
+                : tile_length;
 
         // set up our implicit matrix
         const uint8_t steps_per_segment = 2;
@@ -744,13 +1578,7 @@ void WFlign::wflign_affine_wavefront(
         //std::cerr << "max_mash_dist_to_evaluate " << max_mash_dist_to_evaluate << std::endl;
 
         // Configure the attributes of the wflambda-aligner
-        wfa::WFAlignerGapAffine* wflambda_aligner =
-                new wfa::WFAlignerGapAffine(
-                        wflambda_affine_penalties.mismatch,
-                        wflambda_affine_penalties.gap_opening1,
-                        wflambda_affine_penalties.gap_extension1,
-                        wfa::WFAligner::Alignment,
-                        wfa::WFAligner::MemoryUltralow);
+        wfa::WFAlignerGapAffine* wflambda_aligner = &wf_aligners.wflambda(wflambda_affine_penalties);
         wflambda_aligner->setHeuristicNone(); // It should help
         if (wflign_max_distance_threshold <= 0) {
             wflambda_aligner->setHeuristicWFmash(wflign_min_wavefront_length, (int) (2048.0 / (mashmap_estimated_identity*mashmap_estimated_identity)));
@@ -758,21 +1586,18 @@ void WFlign::wflign_affine_wavefront(
             wflambda_aligner->setHeuristicWFmash(wflign_min_wavefront_length, wflign_max_distance_threshold);
         }
 
-        // Save computed alignments in a pair-indexed map
-        robin_hood::unordered_flat_map<uint64_t,alignment_t*> alignments;
-        // Allocate vectors to store our sketches
-        std::vector<std::vector<rkmh::hash_t>*> query_sketches(pattern_length,nullptr);
-        std::vector<std::vector<rkmh::hash_t>*> target_sketches(text_length,nullptr);
-
-        // Allocate subsidiary WFAligner
-        wfa::WFAlignerGapAffine* wf_aligner =
-                new wfa::WFAlignerGapAffine(
-                        wfa_affine_penalties.mismatch,
-                        wfa_affine_penalties.gap_opening1,
-                        wfa_affine_penalties.gap_extension1,
-                        wfa::WFAligner::Alignment,
-                        wfa::WFAligner::MemoryHigh);
-        wf_aligner->setHeuristicNone();
+        // Save computed alignments by their cell; the trace points into the store
+        wflambda_tile_store_t alignments(pattern_length);
+        // Sketches of the tiles, from k-mer hashes shared by overlapping tiles; the least
+        // recently used ones make room once the budget is spent
+        rkmh::tile_sketches_t query_sketches(query, query_length, minhash_kmer_size, step_size, pattern_length, wflambda_sketch_memory / 2);
+        rkmh::tile_sketches_t target_sketches(target, target_length, minhash_kmer_size, step_size, text_length, wflambda_sketch_memory / 2);
+
+        // Subsidiary WFAligner
+        wfa::WFAlignerGapAffine* wf_aligner = &wf_aligners.segment(wfa_affine_penalties);
+        // Both sequences packed 2 bits a base for the tile batch's extend step
+        const packed_dna_t query_packed(query, query_length);
+        const packed_dna_t target_packed(target, target_length);
 
         // Save mismatches if wfplots are requested
         robin_hood::unordered_set<uint64_t> high_order_dp_matrix_mismatch;
@@ -792,6 +1617,9 @@ void WFlign::wflign_affine_wavefront(
         extend_data.query_sketches = &query_sketches;
         extend_data.target_sketches = &target_sketches;
         extend_data.wf_aligner = wf_aligner;
+        extend_data.tile_batch = &wf_aligners.tile_batch(wfa_affine_penalties);
+        extend_data.query_packed = &query_packed;
+        extend_data.target_packed = &target_packed;
 //        extend_data.wflambda_aligner = wflambda_aligner;
 //        extend_data.last_breakpoint_v = 0;
 //        extend_data.last_breakpoint_h = 0;
@@ -800,10 +1628,6 @@ void WFlign::wflign_affine_wavefront(
         extend_data.num_alignments = 0;
         extend_data.num_alignments_performed = 0;
 #endif
-        extend_data.num_sketches_allocated = 0;
-        // 128 MB of memory for sketches
-        extend_data.max_num_sketches_in_memory = 128 * 1024 * 1024
-            / (sizeof(std::vector<rkmh::hash_t>) + mash_sketch_rate * segment_length_to_use * sizeof(rkmh::hash_t));
 #ifdef WFA_PNG_TSV_TIMING
         extend_data.emit_png = !prefix_wavefront_plot_in_png->empty() && wfplot_max_size > 0;
         extend_data.high_order_dp_matrix_mismatch = &high_order_dp_matrix_mismatch;
@@ -824,10 +1648,6 @@ void WFlign::wflign_affine_wavefront(
 #endif
         }
 
-        // Free
-        delete wflambda_aligner;
-        delete wf_aligner;
-
 #ifdef WFA_PNG_TSV_TIMING
         if (extend_data.emit_png) {
             const int wfplot_vmin = 0, wfplot_vmax = pattern_length; //v_max;
@@ -866,11 +1686,8 @@ void WFlign::wflign_affine_wavefront(
                                                      source_width, source_height,
                                                      source_min_x, source_min_y);
 
-                for (const auto &p : alignments) {
-                    if (p.second != nullptr && p.second->keep) {
-                        int v, h;
-                        decode_pair(p.first, &v, &h);
-
+                alignments.for_each([&](const int v, const int h, const alignment_t* aln) {
+                    if (aln != nullptr && aln->keep) {
                         if (v >= wfplot_vmin & v <= wfplot_vmax && h >= wfplot_hmin && h <= wfplot_hmax) {
                             algorithms::xy_d_t xy0 = {
                                     (v * scale) - x_off,
@@ -884,7 +1701,7 @@ void WFlign::wflign_affine_wavefront(
                             plot_point(xy0, image, COLOR_WFA_MATCH);
                         }
                     }
-                }
+                });
 
                 auto bytes = image.to_bytes();
                 const std::string filename = *prefix_wavefront_plot_in_png +
@@ -898,10 +1715,7 @@ void WFlign::wflign_affine_wavefront(
                                                  source_width, source_height,
                                                  source_min_x, source_min_y);
 
-            for (const auto &p : alignments) {
-                int v, h;
-                decode_pair(p.first, &v, &h);
-
+            alignments.for_each([&](const int v, const int h, const alignment_t* aln) {
                 if (v >= wfplot_vmin & v <= wfplot_vmax && h >= wfplot_hmin && h <= wfplot_hmax) {
                     algorithms::xy_d_t xy0 = {
                             (v * scale) - x_off,
@@ -912,9 +1726,9 @@ void WFlign::wflign_affine_wavefront(
                              0, 0,
                              width, height);
 
-                    plot_point(xy0, image, p.second != nullptr ? COLOR_WFA_MATCH : COLOR_WFA_MISMATCH);
+                    plot_point(xy0, image, aln != nullptr ? COLOR_WFA_MATCH : COLOR_WFA_MISMATCH);
                 }
-            }
+            });
 
             for (auto high_order_DP_cell: high_order_dp_matrix_mismatch) {
                 int v, h;
@@ -943,12 +1757,7 @@ void WFlign::wflign_affine_wavefront(
 #endif
 
         // Clean alignments not to be kept (do not belong to the optimal alignment)
-        for (const auto &p : alignments) {
-            if (p.second != nullptr && !p.second->keep) {
-                delete p.second;
-                //p.second = nullptr;
-            }
-        }
+        alignments.release_unkept();
 #ifdef WFA_PNG_TSV_TIMING
         const long elapsed_time_wflambda_ms =
                 std::chrono::duration_cast<std::chrono::milliseconds>(
@@ -965,14 +1774,11 @@ void WFlign::wflign_affine_wavefront(
         << std::endl;
     #endif
 
-        clean_up_sketches(query_sketches);
-        clean_up_sketches(target_sketches);
-
         // todo: implement alignment identifier based on hash of the input, params,
         // and commit annotate each PAF record with it and the full alignment score
 
         // Trim alignments that overlap in the query
-        if (!trace.empty()) {
+        if (!trace.empty() && !(budget && budget->past_deadline())) {
     #ifdef VALIDATE_WFA_WFLIGN
             if (!trace.front()->validate(query, target)) {
                 std::cerr << "first traceback is wrong" << std::endl;
@@ -1106,16 +1912,7 @@ void WFlign::wflign_affine_wavefront(
             if (merge_alignments) {
                 // use biWFA for all patching
                 wfa::WFAlignerGapAffine2Pieces* wf_aligner =
-                        new wfa::WFAlignerGapAffine2Pieces(
-                                0,
-                                wfa_convex_penalties.mismatch,
-                                wfa_convex_penalties.gap_opening1,
-                                wfa_convex_penalties.gap_extension1,
-                                wfa_convex_penalties.gap_opening2,
-                                wfa_convex_penalties.gap_extension2,
-                                wfa::WFAligner::Alignment,
-                                wfa::WFAligner::MemoryUltralow);
-                wf_aligner->setHeuristicNone();
+                        &wf_aligners.convex(wfa_convex_penalties, wfa::WFAligner::MemoryUltralow);
 
                 // write a merged alignment
                 write_merged_alignment(
@@ -1151,7 +1948,8 @@ void WFlign::wflign_affine_wavefront(
                         max_patching_score,
                         min_inversion_length,
                         MIN_WF_LENGTH,
-                        wf_max_dist_threshold
+                        wf_max_dist_threshold,
+                        patching_threads
 #ifdef WFA_PNG_TSV_TIMING
                         ,
                         prefix_wavefront_plot_in_png,
@@ -1160,8 +1958,6 @@ void WFlign::wflign_affine_wavefront(
                         out_patching_tsv
 #endif
                 );
-
-                delete wf_aligner;
             } else {
                 // todo old implementation (and SAM format is not supported)
                 for (auto x = trace.rbegin(); x != trace.rend(); ++x) {
@@ -2,21 +2,30 @@
 #define WFLIGN_HPP_
 
 #include <algorithm>
+#include <atomic>
 #include <cctype>
 #include <charconv>
+#include <chrono>
 #include <cmath>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <deque>
 #include <vector>
 #include <sstream>
 #include <functional>
+#include <memory>
 #include <fstream>
 
 #include "wflign_alignment.hpp"
+extern "C" {
+#include "WFA2-lib/wavefront/wavefront_aligner.h"
+}
 
 #include "robin-hood-hashing/robin_hood.h"
 #include "dna.hpp"
 #include "rkmh.hpp"
+#include "wflign_tile_batch.hpp"
 
 /*
  * Configuration
@@ -24,6 +33,13 @@
 //#define WFLIGN_DEBUG true // for debugging messages
 //#define VALIDATE_WFA_WFLIGN
 
+// Predicted wavefront memory up to which biWFA pairs are aligned with full backtrace,
+// when the caller gives no budget of its own
+#define BIWFA_HIGH_MEMORY_BUDGET (256ULL << 20)
+
+// Memory for the tile sketches of one wflambda alignment, shared by query and target
+#define WFLAMBDA_SKETCH_MEMORY_BUDGET (128ULL << 20)
+
 #include "atomic_image.hpp"
 #include "lodepng/lodepng.h"
 
@@ -34,6 +50,55 @@
 namespace wflign {
     namespace wavefront {
 
+        /*
+        * Time and wavefront memory an alignment may take before it is given up on, for its
+        * caller to fall back to something cheaper; unlimited unless given. The pieces of a
+        * split pair share it, so once any runs out the others stop too
+        */
+        struct alignment_budget_t {
+            std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+            uint64_t memory_bytes = 0;              // wavefront bytes of one WFA alignment, 0 for no limit
+            std::atomic<const char*> exceeded{nullptr}; // "timeout" or "memory-limit" once given up on
+
+            alignment_budget_t() = default;
+            // seconds from now, 0 for no time limit
+            alignment_budget_t(const double seconds, const uint64_t memory_bytes)
+                : memory_bytes(memory_bytes) {
+                if (seconds > 0) {
+                    deadline = std::chrono::steady_clock::now()
+                        + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+                }
+            }
+            bool timed() const { return deadline != std::chrono::steady_clock::time_point::max(); }
+            bool expired() const { return exceeded.load(std::memory_order_relaxed) != nullptr; }
+            // whether the deadline has passed, which gives the alignment up
+            bool past_deadline() {
+                if (timed() && std::chrono::steady_clock::now() >= deadline) {
+                    exceed("timeout");
+                }
+                return expired();
+            }
+            void exceed(const char* reason) {
+                const char* none = nullptr;
+                exceeded.compare_exchange_strong(none, reason);
+            }
+        };
+
+        /*
+        * Cost of a biWFA alignment, for the alignment telemetry
+        */
+        struct biwfa_telemetry_t {
+            const char* method = "failed";          // exact, hamming, biwfa-high, banded-high, biwfa-ultralow,
+                                                    // parallel-biwfa or edit-score, score-bound when given up below min_identity,
+                                                    // timeout or memory-limit when given up on its budget, then
+                                                    // wflign-fallback or mapping-fallback for what was written instead
+            uint64_t pieces = 0;                    // pieces aligned, 1 unless split at anchors
+            int64_t score = 0;                      // WFA score, summed over the pieces
+            uint64_t predicted_wavefront_bytes = 0; // predicted full backtrace wavefronts, largest piece
+            uint64_t wavefront_bytes = 0;           // footprint of the aligner after the largest piece;
+                                                    // the thread's aligners are reused, so a high-water mark
+        };
+
         void do_biwfa_alignment(
             const std::string& query_name,
             char* const query,
@@ -56,7 +121,103 @@ namespace wflign {
             const float mashmap_estimated_identity,
             const int32_t chain_id,
             const int32_t chain_length,
-            const int32_t chain_pos);
+            const int32_t chain_pos,
+            const uint64_t high_memory_budget,
+            const uint64_t parallel_min_length,
+            const int parallel_threads,
+            const bool banded,
+            const bool mirror,
+            alignment_budget_t* budget,
+            biwfa_telemetry_t* telemetry = nullptr);
+
+        /*
+        * Write the PAF line of a pair with the statistics of its alignment and no CIGAR,
+        * from its edit distance in score-only WFA. Without the traceback the matches are
+        * taken as the longer length less the distance, as if every gap but the length
+        * difference were a mismatch, which at most undercounts them; the block is the
+        * longer length. A pair below min_identity is given up on, unwritten
+        */
+        void do_biwfa_stats(
+            const std::string& query_name,
+            const char* const query,
+            const uint64_t query_total_length,
+            const uint64_t query_offset,
+            const uint64_t query_length,
+            const bool query_is_rev,
+            const std::string& target_name,
+            const char* const target,
+            const uint64_t target_total_length,
+            const uint64_t target_offset,
+            const uint64_t target_length,
+            std::ostream& out,
+            const float min_identity,
+            const float mashmap_estimated_identity,
+            const bool mirror,
+            biwfa_telemetry_t* telemetry = nullptr);
+
+        /*
+        * Gap-affine 2-pieces aligner that reports the memory its wavefronts hold
+        */
+        class wflign_convex_aligner_t : public wfa::WFAlignerGapAffine2Pieces {
+        public:
+            using wfa::WFAlignerGapAffine2Pieces::WFAlignerGapAffine2Pieces;
+            uint64_t wavefront_bytes() { return wavefront_aligner_get_size(wfAligner); }
+            // abort an alignment once its wavefronts exceed bytes, UINT64_MAX for never
+            void set_memory_abort(const uint64_t bytes) {
+                wavefront_aligner_set_max_memory(wfAligner, wfAligner->system.max_memory_resident, bytes);
+            }
+        };
+
+        /*
+        * Every WFA aligner an alignment needs, owned by one thread and kept across
+        * alignments, so WFA's allocators and buffers are set up once rather than per
+        * mapping. WFAligner has no setter for its penalties, so an aligner is only
+        * rebuilt when they change; heuristics are left to the caller to set, and the
+        * convex aligners are handed out with no cap on their steps.
+        */
+        class wflign_aligners_t {
+        public:
+            // gap-affine 2-pieces aligner (biWFA, patching) in the given memory mode
+            wflign_convex_aligner_t& convex(
+                const wflign_penalties_t& penalties,
+                const wfa::WFAligner::MemoryModel memory_model);
+            // gap-affine aligner driving the wflambda tiles (low memory, match callback)
+            wfa::WFAlignerGapAffine& wflambda(const wflign_penalties_t& penalties);
+            // gap-affine aligner of single wflambda tiles (full backtrace)
+            wfa::WFAlignerGapAffine& segment(const wflign_penalties_t& penalties);
+            // score-only aligner of the wflambda tiles along a diagonal, a tile per lane
+            wflambda_tile_batch_t& tile_batch(const wflign_penalties_t& penalties);
+            // score-only edit distance aligner, for the statistics of a pair
+            wfa::WFAlignerEdit& edit_score();
+
+            // the aligners of the calling thread
+            static wflign_aligners_t& for_this_thread();
+
+        private:
+            template <typename Aligner>
+            struct slot_t {
+                std::unique_ptr<Aligner> aligner;
+                wflign_penalties_t penalties;
+            };
+            slot_t<wflign_convex_aligner_t> convex_slots[2];           // MemoryHigh, MemoryUltralow
+            slot_t<wfa::WFAlignerGapAffine> wflambda_slot;
+            slot_t<wfa::WFAlignerGapAffine> segment_slot;
+            slot_t<wflambda_tile_batch_t> tile_batch_slot;
+            std::unique_ptr<wfa::WFAlignerEdit> edit_score_aligner;
+        };
+
+        uint64_t predicted_wavefront_memory(
+            const uint64_t query_length,
+            const uint64_t target_length,
+            const float mashmap_estimated_identity,
+            const wflign_penalties_t& penalties,
+            const uint64_t band_diagonals = 0);
+
+        int max_alignment_score(
+            const uint64_t query_length,
+            const uint64_t target_length,
+            const float min_identity,
+            const wflign_penalties_t& penalties);
 
         class WFlign {
         public:
@@ -89,6 +250,15 @@ namespace wflign {
             int64_t chain_gap;
             int min_inversion_length;
             int max_patching_score;
+            uint64_t wflambda_sketch_memory;
+            // Aligners reused across alignments, the calling thread's unless set
+            wflign_aligners_t* aligners;
+            // Threads aligning the patches of a merged alignment
+            int patching_threads;
+            // Budget the alignment is given up on past, unlimited if null
+            alignment_budget_t* budget;
+            // Tiles sized by the identity and length ratio of each pair, segment_length the base
+            bool adaptive_tiles;
             // Query
             const std::string* query_name;
             char* query;
@@ -143,7 +313,16 @@ namespace wflign {
                     const int erode_k,
                     const int64_t chain_gap,
                     const int min_inversion_length,
-                    const int max_patching_score);
+                    const int max_patching_score,
+                    const uint64_t wflambda_sketch_memory = WFLAMBDA_SKETCH_MEMORY_BUDGET);
+            // Use aligners other than the calling thread's
+            void set_aligners(wflign_aligners_t* const aligners);
+            // Align the patches of merged alignments on several threads
+            void set_patching_threads(const int patching_threads);
+            // Give the alignment up once past the budget, writing nothing
+            void set_budget(alignment_budget_t* const budget);
+            // Size the wflambda tiles of each pair per adaptive_segment_length
+            void set_adaptive_tiles(const bool adaptive_tiles);
             // Set output configuration
             void set_output(
                     std::ostream* const out,
@@ -178,6 +357,76 @@ namespace wflign {
 
 } /* namespace wflign */
 
+/*
+* Tiles aligned by wflambda, indexed by their (v,h) cell
+*
+* wflambda only asks for cells near the diagonals its wavefronts reach, so each row v
+* keeps a dense run of slots spanning the columns asked for so far, grown on demand.
+* Tiles live in an arena freed in bulk with the store; the trace points into it.
+*/
+class wflambda_tile_store_t {
+public:
+    static constexpr int32_t unknown = -1;   // not aligned yet
+    static constexpr int32_t mismatch = -2;  // aligned, not a match
+
+    explicit wflambda_tile_store_t(const int pattern_length) : rows(pattern_length) {}
+
+    // slot of cell (v,h): unknown, mismatch, or the index of its tile
+    int32_t& slot(const int v, const int h) {
+        row_t& row = rows[v];
+        if (row.slots.empty()) {
+            row.begin = h;
+            row.slots.assign(1, unknown);
+        } else if (h < row.begin) {
+            const int grow = std::max(row.begin - h, (int)row.slots.size());
+            row.slots.insert(row.slots.begin(), grow, unknown);
+            row.begin -= grow;
+        } else if (h >= row.begin + (int)row.slots.size()) {
+            const int grow = std::max(h - row.begin - (int)row.slots.size() + 1, (int)row.slots.size());
+            row.slots.resize(row.slots.size() + grow, unknown);
+        }
+        return row.slots[h - row.begin];
+    }
+
+    // a fresh tile at the end of the arena, kept with keep_last() or dropped with drop_last()
+    alignment_t& next() { return tiles.emplace_back(); }
+    int32_t keep_last() const { return (int32_t)tiles.size() - 1; }
+    void drop_last() { tiles.pop_back(); }
+
+    alignment_t* tile(const int32_t index) { return &tiles[index]; }
+
+    // free the CIGARs of the tiles not in the trace, which are not looked at again
+    void release_unkept() {
+        for (auto& aln : tiles) {
+            if (!aln.keep) {
+                free(aln.edit_cigar.cigar_ops);
+                aln.edit_cigar.cigar_ops = nullptr;
+            }
+        }
+    }
+
+    // f(v, h, tile) for every cell aligned, tile being nullptr for mismatches
+    template <typename F>
+    void for_each(F f) {
+        for (int v = 0; v < (int)rows.size(); ++v) {
+            for (size_t x = 0; x < rows[v].slots.size(); ++x) {
+                const int32_t s = rows[v].slots[x];
+                if (s != unknown) {
+                    f(v, rows[v].begin + (int)x, s == mismatch ? nullptr : &tiles[s]);
+                }
+            }
+        }
+    }
+
+private:
+    struct row_t {
+        int begin = 0;
+        std::vector<int32_t> slots;
+    };
+    std::vector<row_t> rows;
+    std::deque<alignment_t> tiles;
+};
+
 /*
 * DTO ()
 */
@@ -194,11 +443,16 @@ typedef struct {
     float mash_sketch_rate;
     float inception_score_max_ratio;
     // Alignments and sketches
-    robin_hood::unordered_flat_map<uint64_t,alignment_t*>* alignments;
-    std::vector<std::vector<rkmh::hash_t>*>* query_sketches;
-    std::vector<std::vector<rkmh::hash_t>*>* target_sketches;
+    wflambda_tile_store_t* alignments;
+    rkmh::tile_sketches_t* query_sketches;
+    rkmh::tile_sketches_t* target_sketches;
     // Subsidiary WFAligner
     wfa::WFAlignerGapAffine* wf_aligner;
+    // Batch scoring the tiles along a diagonal ahead of wflambda (null to align one at a time)
+    wflign::wavefront::wflambda_tile_batch_t* tile_batch;
+    // Query and target packed 2 bits a base, read by the tile batch
+    const wflign::packed_dna_t* query_packed;
+    const wflign::packed_dna_t* target_packed;
 //    // Bidirectional
 //    wfa::WFAlignerGapAffine* wflambda_aligner;
 //    int last_breakpoint_v;
@@ -210,8 +464,6 @@ typedef struct {
     uint64_t num_alignments_performed;
 #endif
     // For performance improvements
-    uint64_t max_num_sketches_in_memory;
-    uint64_t num_sketches_allocated;
 #ifdef WFA_PNG_TSV_TIMING
     // wfplot
     bool emit_png;
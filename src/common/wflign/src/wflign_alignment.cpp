@@ -7,8 +7,43 @@
 #include <limits>
 #include <iterator>
 #include <cassert>
+#include <string>
 #include <vector>
 
+/*
+ * Run-length trace
+ */
+void wflign_rle_cigar_t::push(const char op, uint64_t length) {
+    bases += length;
+    if (length > 0 && !packed.empty() && (packed.back() & 0xf) == code_of(op)) {
+        const uint32_t room = max_run_length - length_of(packed.back());
+        const uint32_t added = (uint32_t)std::min<uint64_t>(room, length);
+        packed.back() += added << 4;
+        length -= added;
+    }
+    while (length > 0) {
+        const uint32_t run = (uint32_t)std::min<uint64_t>(max_run_length, length);
+        packed.push_back(pack(op, run));
+        length -= run;
+    }
+}
+
+void wflign_rle_cigar_t::append(const wflign_rle_cigar_t& other, const uint64_t from, const uint64_t to) {
+    uint64_t pos = 0;
+    for (const uint32_t run : other.packed) {
+        const uint64_t run_end = pos + length_of(run);
+        const uint64_t begin = std::max(pos, from);
+        const uint64_t end = std::min(run_end, to);
+        if (begin < end) {
+            push(op_of(run), end - begin);
+        }
+        if (run_end >= to) {
+            break;
+        }
+        pos = run_end;
+    }
+}
+
 /*
  * Wflign Alignment
  */
@@ -425,6 +460,17 @@ bool validate_trace(
 /*
  * Alignment-CIGAR Adaptors
  */
+bool validate_trace(
+        const wflign_rle_cigar_t& trace,
+        const char* query,
+        const char* target,
+        const uint64_t& query_aln_len,
+        const uint64_t& target_aln_len,
+        uint64_t j,
+        uint64_t i) {
+    std::vector<char> tracev = trace.expand();
+    return validate_trace(tracev, query, target, query_aln_len, target_aln_len, j, i);
+}
 char* alignment_to_cigar(
         const std::vector<char>& edit_cigar,
         const uint64_t& start_idx,
@@ -503,6 +549,76 @@ char* alignment_to_cigar(
 
     return cigar_;
 }
+char* alignment_to_cigar(
+        const wflign_rle_cigar_t& trace,
+        const uint64_t& start_idx,
+        const uint64_t& end_idx,
+        uint64_t& target_aligned_length,
+        uint64_t& query_aligned_length,
+        uint64_t& matches,
+        uint64_t& mismatches,
+        uint64_t& insertions,
+        uint64_t& inserted_bp,
+        uint64_t& deletions,
+        uint64_t& deleted_bp) {
+    // the runs of the trace in [start_idx, end_idx), those of the same operation joined
+    std::string cigar;
+    char last_op = 0;
+    uint64_t last_length = 0;
+    auto flush = [&]() {
+        switch (last_op) {
+            case 'M':
+                matches += last_length;
+                query_aligned_length += last_length;
+                target_aligned_length += last_length;
+                break;
+            case 'X':
+                mismatches += last_length;
+                query_aligned_length += last_length;
+                target_aligned_length += last_length;
+                break;
+            case 'I':
+                ++insertions;
+                inserted_bp += last_length;
+                query_aligned_length += last_length;
+                break;
+            case 'D':
+                ++deletions;
+                deleted_bp += last_length;
+                target_aligned_length += last_length;
+                break;
+            default:
+                return;
+        }
+        cigar += std::to_string(last_length);
+        // reassign 'M' to '=' for convenience
+        cigar += last_op == 'M' ? '=' : last_op;
+    };
+    uint64_t pos = 0;
+    for (const uint32_t run : trace.runs()) {
+        const uint64_t run_end = pos + wflign_rle_cigar_t::length_of(run);
+        const uint64_t begin = std::max(pos, start_idx);
+        const uint64_t end = std::min(run_end, end_idx);
+        if (begin < end) {
+            const char op = wflign_rle_cigar_t::op_of(run);
+            if (op != last_op) {
+                flush();
+                last_op = op;
+                last_length = 0;
+            }
+            last_length += end - begin;
+        }
+        if (run_end >= end_idx) {
+            break;
+        }
+        pos = run_end;
+    }
+    flush();
+
+    char *cigar_ = (char *)malloc(cigar.size() + 1);
+    std::memcpy(cigar_, cigar.c_str(), cigar.size() + 1);
+    return cigar_;
+}
 char* wfa_alignment_to_cigar(
         const wflign_cigar_t* const edit_cigar,
         uint64_t& target_aligned_length,
@@ -27,6 +27,105 @@ typedef struct {
     int gap_extension2;
 } wflign_penalties_t;
 
+/*
+ * Run-length trace: edit operations (M, X, I, D) as runs packed like BAM CIGARs, the
+ * length above the 4 bits of the operation, so a trace of any span takes a word per
+ * run where the expanded form takes a byte per base. Runs are never empty, and only
+ * follow one of the same operation when that one is full.
+ */
+class wflign_rle_cigar_t {
+public:
+    static constexpr uint32_t max_run_length = (1u << 28) - 1;
+
+    // The operations one at a time, expanding the runs as it goes
+    class const_iterator {
+    public:
+        const_iterator(const uint32_t* run, const uint32_t offset) : run(run), offset(offset) {}
+        char operator*() const { return op_of(*run); }
+        const_iterator& operator++() {
+            if (++offset == length_of(*run)) {
+                ++run;
+                offset = 0;
+            }
+            return *this;
+        }
+        const_iterator operator++(int) {
+            const_iterator it = *this;
+            ++*this;
+            return it;
+        }
+        bool operator==(const const_iterator& other) const { return run == other.run && offset == other.offset; }
+        bool operator!=(const const_iterator& other) const { return !(*this == other); }
+    private:
+        const uint32_t* run;
+        uint32_t offset;
+    };
+
+    static uint32_t code_of(const char op) {
+        switch (op) {
+            case 'M': return 7;     // BAM's =
+            case 'I': return 1;
+            case 'D': return 2;
+            default: return 8;      // X
+        }
+    }
+    static char op_of(const uint32_t run) {
+        switch (run & 0xf) {
+            case 7: return 'M';
+            case 1: return 'I';
+            case 2: return 'D';
+            default: return 'X';
+        }
+    }
+    static uint32_t pack(const char op, const uint32_t length) { return length << 4 | code_of(op); }
+    static uint32_t length_of(const uint32_t run) { return run >> 4; }
+
+    const std::vector<uint32_t>& runs() const { return packed; }
+    bool empty() const { return packed.empty(); }
+    uint64_t size() const { return bases; }     // in operations
+    char back() const { return op_of(packed.back()); }
+
+    const_iterator begin() const { return const_iterator(packed.data(), 0); }
+    const_iterator end() const { return const_iterator(packed.data() + packed.size(), 0); }
+
+    void push_back(const char op) {
+        if (!packed.empty() && (packed.back() & 0xf) == code_of(op)
+            && length_of(packed.back()) < max_run_length) {
+            packed.back() += 1 << 4;
+            ++bases;
+        } else {
+            push(op, 1);
+        }
+    }
+    // length operations op
+    void push(const char op, uint64_t length);
+    void pop_back() {
+        packed.back() -= 1 << 4;
+        if (length_of(packed.back()) == 0) {
+            packed.pop_back();
+        }
+        --bases;
+    }
+    // the operations [from, to) of other
+    void append(const wflign_rle_cigar_t& other, const uint64_t from = 0, const uint64_t to = UINT64_MAX);
+    void clear() {
+        packed.clear();
+        bases = 0;
+    }
+    std::vector<char> expand() const {
+        std::vector<char> ops;
+        ops.reserve(bases);
+        for (const uint32_t run : packed) {
+            ops.insert(ops.end(), length_of(run), op_of(run));
+        }
+        return ops;
+    }
+
+private:
+    std::vector<uint32_t> packed;
+    uint64_t bases = 0;
+};
+
 /*
  * Wflign Alignment
  */
@@ -112,6 +211,14 @@ bool validate_trace(
         const uint64_t& target_aln_len,
         uint64_t j,
         uint64_t i);
+bool validate_trace(
+        const wflign_rle_cigar_t& trace,
+        const char* query,
+        const char* target,
+        const uint64_t& query_aln_len,
+        const uint64_t& target_aln_len,
+        uint64_t j,
+        uint64_t i);
 /*
  * Alignment-CIGAR Adaptors
  */
@@ -127,6 +234,18 @@ char* alignment_to_cigar(
         uint64_t& inserted_bp,
         uint64_t& deletions,
         uint64_t& deleted_bp);
+char* alignment_to_cigar(
+        const wflign_rle_cigar_t& trace,
+        const uint64_t& start_idx,
+        const uint64_t& end_idx,
+        uint64_t& target_aligned_length,
+        uint64_t& query_aligned_length,
+        uint64_t& matches,
+        uint64_t& mismatches,
+        uint64_t& insertions,
+        uint64_t& inserted_bp,
+        uint64_t& deletions,
+        uint64_t& deleted_bp);
 char* wfa_alignment_to_cigar(
         const wflign_cigar_t* const edit_cigar,
         uint64_t& target_aligned_length,
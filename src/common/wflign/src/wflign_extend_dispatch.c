@@ -0,0 +1,120 @@
+/*
+ * Runtime choice of the WFA2 match-extension kernels for BUILD_RETARGETABLE builds.
+ *
+ * The vendored WFA2-lib picks its extend kernel at compile time, so a binary built for the
+ * x86-64 baseline would always run the scalar one. Retargetable builds instead take
+ * wavefront_extend_kernels.c and wavefront_extend_kernels_avx.c out of the WFA2 libraries
+ * and compile them here once per ISA (see ../CMakeLists.txt):
+ *   - the baseline build of wavefront_extend_kernels.c, with its packed kernels renamed to
+ *     wflign_extend_scalar_*,
+ *   - wavefront_extend_kernels_avx.c for AVX2, giving the *_avx2 kernels,
+ *   - wavefront_extend_kernels_avx.c for AVX-512 (F/CD/VL/BW), giving the *_avx512 kernels.
+ * This file then defines the entry points the rest of WFA2 calls, and forwards each call to
+ * the widest variant the running CPU supports. The vendored sources stay untouched.
+ */
+
+#include "wavefront/wavefront_extend_kernels.h"
+
+void wflign_extend_scalar_packed_end2end(
+    wavefront_aligner_t* const wf_aligner, wavefront_t* const mwavefront,
+    const int lo, const int hi);
+wf_offset_t wflign_extend_scalar_packed_end2end_max(
+    wavefront_aligner_t* const wf_aligner, wavefront_t* const mwavefront,
+    const int lo, const int hi);
+bool wflign_extend_scalar_packed_endsfree(
+    wavefront_aligner_t* const wf_aligner, wavefront_t* const mwavefront,
+    const int score, const int lo, const int hi);
+
+void wavefront_extend_matches_packed_end2end_avx2(
+    wavefront_aligner_t* const wf_aligner, wavefront_t* const mwavefront,
+    const int lo, const int hi);
+wf_offset_t wavefront_extend_matches_packed_end2end_max_avx2(
+    wavefront_aligner_t* const wf_aligner, wavefront_t* const mwavefront,
+    const int lo, const int hi);
+bool wavefront_extend_matches_packed_endsfree_avx2(
+    wavefront_aligner_t* const wf_aligner, wavefront_t* const mwavefront,
+    const int score, const int lo, const int hi);
+
+void wavefront_extend_matches_packed_end2end_avx512(
+    wavefront_aligner_t* const wf_aligner, wavefront_t* const mwavefront,
+    const int lo, const int hi);
+wf_offset_t wavefront_extend_matches_packed_end2end_max_avx512(
+    wavefront_aligner_t* const wf_aligner, wavefront_t* const mwavefront,
+    const int lo, const int hi);
+bool wavefront_extend_matches_packed_endsfree_avx512(
+    wavefront_aligner_t* const wf_aligner, wavefront_t* const mwavefront,
+    const int score, const int lo, const int hi);
+
+typedef enum {
+  wflign_extend_scalar = 0,
+  wflign_extend_avx2 = 1,
+  wflign_extend_avx512 = 2,
+} wflign_extend_isa_t;
+
+static wflign_extend_isa_t wflign_extend_isa_detect(void) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512cd") &&
+      __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512bw")) {
+    return wflign_extend_avx512;
+  }
+  if (__builtin_cpu_supports("avx2")) return wflign_extend_avx2;
+  return wflign_extend_scalar;
+}
+
+// Computed once; racing threads store the same value
+static volatile int wflign_extend_isa_detected = -1;
+static inline wflign_extend_isa_t wflign_extend_isa(void) {
+  if (__builtin_expect(wflign_extend_isa_detected < 0, 0)) {
+    wflign_extend_isa_detected = wflign_extend_isa_detect();
+  }
+  return (wflign_extend_isa_t)wflign_extend_isa_detected;
+}
+
+void wavefront_extend_matches_packed_end2end(
+    wavefront_aligner_t* const wf_aligner,
+    wavefront_t* const mwavefront,
+    const int lo,
+    const int hi) {
+  switch (wflign_extend_isa()) {
+    case wflign_extend_avx512:
+      wavefront_extend_matches_packed_end2end_avx512(wf_aligner, mwavefront, lo, hi);
+      break;
+    case wflign_extend_avx2:
+      wavefront_extend_matches_packed_end2end_avx2(wf_aligner, mwavefront, lo, hi);
+      break;
+    default:
+      wflign_extend_scalar_packed_end2end(wf_aligner, mwavefront, lo, hi);
+      break;
+  }
+}
+
+wf_offset_t wavefront_extend_matches_packed_end2end_max(
+    wavefront_aligner_t* const wf_aligner,
+    wavefront_t* const mwavefront,
+    const int lo,
+    const int hi) {
+  switch (wflign_extend_isa()) {
+    case wflign_extend_avx512:
+      return wavefront_extend_matches_packed_end2end_max_avx512(wf_aligner, mwavefront, lo, hi);
+    case wflign_extend_avx2:
+      return wavefront_extend_matches_packed_end2end_max_avx2(wf_aligner, mwavefront, lo, hi);
+    default:
+      return wflign_extend_scalar_packed_end2end_max(wf_aligner, mwavefront, lo, hi);
+  }
+}
+
+bool wavefront_extend_matches_packed_endsfree(
+    wavefront_aligner_t* const wf_aligner,
+    wavefront_t* const mwavefront,
+    const int score,
+    const int lo,
+    const int hi) {
+  switch (wflign_extend_isa()) {
+    case wflign_extend_avx512:
+      return wavefront_extend_matches_packed_endsfree_avx512(wf_aligner, mwavefront, score, lo, hi);
+    case wflign_extend_avx2:
+      return wavefront_extend_matches_packed_endsfree_avx2(wf_aligner, mwavefront, score, lo, hi);
+    default:
+      return wflign_extend_scalar_packed_endsfree(wf_aligner, mwavefront, score, lo, hi);
+  }
+}
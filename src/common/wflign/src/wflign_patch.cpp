@@ -1,7 +1,11 @@
+#include <atomic>
 #include <cstddef>
 #include <chrono>
 #include <cstdlib>
+#include <map>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <atomic_image.hpp>
 #include "rkmh.hpp"
 #include "wflign_patch.hpp"
@@ -159,15 +163,42 @@ namespace wflign {
 // order them and write them out
 // needed--- 0-cost deduplication of alignment regions (how????)
 //     --- trim the alignment back to the first 1/2 of the query
+float wfa_segment_mash_dist(
+        rkmh::tile_sketches_t& query_sketches,
+        const int v,
+        const int64_t& j,
+        rkmh::tile_sketches_t& target_sketches,
+        const int h,
+        const int64_t& i,
+        const uint16_t& segment_length_q,
+        const uint16_t& segment_length_t,
+        const wflign_extend_data_t* extend_data) {
+    // first make the sketches if we haven't yet; each is valid until its next get
+    const rkmh::sketch_t& query_sketch = query_sketches.get(
+            v, j, segment_length_q, (uint64_t)((float)segment_length_q * extend_data->mash_sketch_rate));
+    const rkmh::sketch_t& target_sketch = target_sketches.get(
+            h, i, segment_length_t, (uint64_t)((float)segment_length_t * extend_data->mash_sketch_rate));
+    return rkmh::compare(query_sketch, target_sketch, extend_data->minhash_kmer_size);
+}
+
+int wfa_segment_max_score(
+        const uint16_t& segment_length_q,
+        const uint16_t& segment_length_t,
+        const wflign_extend_data_t* extend_data) {
+    return (int)((float)std::max(segment_length_q, segment_length_t) * extend_data->inception_score_max_ratio);
+}
+
 bool do_wfa_segment_alignment(
         const std::string& query_name,
         const char* query,
-        std::vector<rkmh::hash_t>*& query_sketch,
+        rkmh::tile_sketches_t& query_sketches,
+        const int v,
         const uint64_t& query_length,
         const int64_t& j,
         const std::string& target_name,
         const char* target,
-        std::vector<rkmh::hash_t>*& target_sketch,
+        rkmh::tile_sketches_t& target_sketches,
+        const int h,
         const uint64_t& target_length,
         const int64_t& i,
         const uint16_t& segment_length_q,
@@ -183,23 +214,9 @@ bool do_wfa_segment_alignment(
         std::cerr << "i: " << i << " j: " << j << " segment_length_t: " << segment_length_t << " segment_length_q: " << segment_length_q << std::endl;
     }
     
-    // first make the sketches if we haven't yet
-    if (query_sketch == nullptr) {
-        query_sketch = new std::vector<rkmh::hash_t>();
-        *query_sketch = rkmh::hash_sequence(
-                query + j, segment_length_q, extend_data->minhash_kmer_size, (uint64_t)((float)segment_length_q * extend_data->mash_sketch_rate));
-        ++extend_data->num_sketches_allocated;
-    }
-    if (target_sketch == nullptr) {
-        target_sketch = new std::vector<rkmh::hash_t>();        
-        *target_sketch = rkmh::hash_sequence(
-                target + i, segment_length_t, extend_data->minhash_kmer_size, (uint64_t)((float)segment_length_t * extend_data->mash_sketch_rate));
-        ++extend_data->num_sketches_allocated;
-    }
-
     // first check if our mash dist is inbounds
-    const float mash_dist =
-            rkmh::compare(*query_sketch, *target_sketch, extend_data->minhash_kmer_size);
+    const float mash_dist = wfa_segment_mash_dist(
+            query_sketches, v, j, target_sketches, h, i, segment_length_q, segment_length_t, extend_data);
     //std::cerr << "mash_dist is " << mash_dist << std::endl;
 
     // this threshold is set low enough that we tend to randomly sample wflambda
@@ -211,7 +228,7 @@ bool do_wfa_segment_alignment(
         return false;
     } else {
         // if it is, we'll align
-        const int max_score = (int)((float)std::max(segment_length_q, segment_length_t) * extend_data->inception_score_max_ratio);
+        const int max_score = wfa_segment_max_score(segment_length_q, segment_length_t, extend_data);
 
         extend_data->wf_aligner->setMaxAlignmentSteps(max_score);
         const int status = extend_data->wf_aligner->alignEnd2End(
@@ -872,64 +889,78 @@ std::vector<alignment_t> do_progressive_wfa_patch_alignment(
     return alignments;
 }
 
-void erode_head(std::vector<char>& unpatched, uint64_t& query_pos, uint64_t& target_pos, int erode_k) {
+void erode_head(wflign_rle_cigar_t& unpatched, uint64_t& query_pos, uint64_t& target_pos, int erode_k) {
     int match_count = 0;
-    auto it = unpatched.begin();
+    uint64_t erased = 0;
     uint64_t query_erased = 0, target_erased = 0;
 
-    while (it != unpatched.end()) {
-        if (*it == 'M' || *it == 'X') {
-            match_count++;
-            if (match_count >= erode_k) {
+    for (const uint32_t run : unpatched.runs()) {
+        const char op = wflign_rle_cigar_t::op_of(run);
+        const uint64_t length = wflign_rle_cigar_t::length_of(run);
+        if (op == 'M' || op == 'X') {
+            // the erode_k-th match or mismatch stays, with all that follows
+            const uint64_t take = std::min<uint64_t>(length, std::max(0, erode_k - 1 - match_count));
+            query_pos += take;
+            target_pos += take;
+            query_erased += take;
+            target_erased += take;
+            erased += take;
+            if (take < length) {
                 break;
             }
-            query_pos++;
-            target_pos++;
-            query_erased++;
-            target_erased++;
+            match_count += take;
         } else {
             //match_count = 0;
-            if (*it == 'I') {
-                query_pos++;
-                query_erased++;
+            if (op == 'I') {
+                query_pos += length;
+                query_erased += length;
             }
-            if (*it == 'D') {
-                target_pos++;
-                target_erased++;
+            if (op == 'D') {
+                target_pos += length;
+                target_erased += length;
             }
+            erased += length;
         }
-        it++;
     }
 
     //std::cerr << "erode_head: eroded " << query_erased << " query and " << target_erased << " target" << std::endl;
     // Erase the eroded part
-    unpatched.erase(unpatched.begin(), it);
+    wflign_rle_cigar_t kept;
+    kept.append(unpatched, erased);
+    unpatched = std::move(kept);
 }
 
-void erode_tail(std::vector<char>& unpatched, uint64_t& query_end, uint64_t& target_end, int erode_k) {
+void erode_tail(wflign_rle_cigar_t& unpatched, uint64_t& query_end, uint64_t& target_end, int erode_k) {
     int match_count = 0;
-    auto it = unpatched.rbegin();
+    uint64_t erased = 0;
     uint64_t q_offset = 0, t_offset = 0;
 
-    while (it != unpatched.rend()) {
-        if (*it == 'M' || *it == 'X') {
-            match_count++;
-            if (match_count >= erode_k) {
+    const std::vector<uint32_t>& runs = unpatched.runs();
+    for (auto it = runs.rbegin(); it != runs.rend(); ++it) {
+        const char op = wflign_rle_cigar_t::op_of(*it);
+        const uint64_t length = wflign_rle_cigar_t::length_of(*it);
+        if (op == 'M' || op == 'X') {
+            const uint64_t take = std::min<uint64_t>(length, std::max(0, erode_k - 1 - match_count));
+            q_offset += take;
+            t_offset += take;
+            erased += take;
+            if (take < length) {
                 break;
             }
-            q_offset++;
-            t_offset++;
+            match_count += take;
         } else {
             //match_count = 0;
-            if (*it == 'I') q_offset++;
-            if (*it == 'D') t_offset++;
+            if (op == 'I') q_offset += length;
+            if (op == 'D') t_offset += length;
+            erased += length;
         }
-        it++;
     }
 
     // Erase the eroded part
     //std::cerr << "erode_tail: eroded " << q_offset << " query and " << t_offset << " target" << std::endl;
-    unpatched.erase(it.base(), unpatched.end());
+    wflign_rle_cigar_t kept;
+    kept.append(unpatched, 0, unpatched.size() - erased);
+    unpatched = std::move(kept);
     query_end -= q_offset;
     target_end -= t_offset;
 }
@@ -968,6 +999,7 @@ void write_merged_alignment(
         const uint64_t& min_inversion_length,
         const int& min_wf_length,
         const int& max_dist_threshold,
+        const int& patching_threads,
 #ifdef WFA_PNG_TSV_TIMING
         const std::string* prefix_wavefront_plot_in_png,
         const uint64_t& wfplot_max_size,
@@ -1016,7 +1048,7 @@ void write_merged_alignment(
       << std::endl;
 #endif
     // write trace into single cigar vector
-    std::vector<char> tracev;
+    wflign_rle_cigar_t tracev;
     std::vector<alignment_t> multi_patch_alns;
     {
         // patch: walk the cigar, patching directly when we have simultaneous
@@ -1026,7 +1058,7 @@ void write_merged_alignment(
 #define MAX_NUM_INDELS_TO_LOOK_AT 2
         auto distance_close_big_enough_indels =	
                 [](const uint32_t indel_len, auto iterator,	
-                   const std::vector<char> &trace,
+                   const wflign_rle_cigar_t &trace,
                    const uint16_t&max_dist_to_look_at) {	
                     const uint32_t min_indel_len_to_find = indel_len / 3;	
 
@@ -1091,13 +1123,14 @@ void write_merged_alignment(
                          &multi_patch_alns,
                          &convex_penalties,
                          &chain_gap, &max_patching_score, &min_inversion_length, &erode_k,
+                         &patching_threads,
                          &query_total_length  // Add this line to capture query_total_length
 #ifdef WFA_PNG_TSV_TIMING
                          ,&emit_patching_tsv,
                          &out_patching_tsv
 #endif
-            ](std::vector<char> &unpatched,
-              std::vector<char> &patched,
+            ](wflign_rle_cigar_t &unpatched,
+              wflign_rle_cigar_t &patched,
               const uint16_t &min_wfa_head_tail_patch_length,
               const uint16_t &min_wfa_patch_length,
               const uint16_t &max_dist_to_look_at,
@@ -1166,336 +1199,413 @@ void write_merged_alignment(
                     //std::cerr << std::endl;
                 } else {
                     // push back I and D to fill the gap
-                    for (uint64_t i = 0; i < query_start; ++i) {
-                        patched.push_back('I');
-                    }
-                    for (uint64_t i = 0; i < target_start; ++i) {
-                        patched.push_back('D');
-                    }
+                    patched.push('I', query_start);
+                    patched.push('D', target_start);
                 }
                 query_start = 0;
                 target_start = 0;
             }
 
-            // Patching in the middle
-            while (q != unpatched.end()) {
-                // get to the first matchn
-                while (q != unpatched.end() && (*q == 'M' || *q == 'X')) {
-                    /*
-                std::cerr << "q: " << query[query_pos] << " "
-                          << "t: " << target[target_pos - target_pointer_shift]
-                          << std::endl;
-                */
-                    if (query_pos >= query_length ||
-                        target_pos >= target_length) {
-                        std::cerr << "[wflign::wflign_affine_wavefront] "
-                                     "corrupted traceback (out of bounds) for "
-                                  << query_name << " " << query_offset << " "
-                                  << target_name << " " << target_offset
-                                  << std::endl;
-                        exit(1);
+            // query_pos, query_delta, target_pos, target_delta of a patch
+            typedef std::tuple<uint64_t, uint64_t, uint64_t, uint64_t> patch_region_t;
+            // Align the planned patches on up to patching_threads threads, each with an aligner
+            auto align_planned_patches = [&](const std::vector<patch_region_t>& regions,
+                                             std::map<patch_region_t, std::vector<alignment_t>>& alignments) {
+                std::vector<std::vector<alignment_t>> results(regions.size());
+                std::atomic<size_t> next_region(0);
+                auto align_regions = [&](wfa::WFAlignerGapAffine2Pieces& aligner) {
+                    for (size_t r = next_region++; r < regions.size(); r = next_region++) {
+                        results[r] = do_progressive_wfa_patch_alignment(
+                                query,
+                                std::get<0>(regions[r]),
+                                std::get<1>(regions[r]),
+                                target - target_pointer_shift,
+                                std::get<2>(regions[r]),
+                                std::get<3>(regions[r]),
+                                aligner,
+                                convex_penalties,
+                                chain_gap,
+                                max_patching_score,
+                                min_inversion_length,
+                                erode_k);
                     }
-
-                    if (*q == 'M') {
-                        if (query[query_pos] !=
-                            target[target_pos - target_pointer_shift]) {
-                            std::cerr << "[wflign::wflign_affine_wavefront] "
-                                         "corrupted traceback (M, but there is "
-                                         "a mismatch) for "
-                                      << query_name << " " << query_offset
-                                      << " " << target_name << " "
-                                      << target_offset << std::endl;
-                            exit(1);
-                        }
-                    } else {
-                        if (query[query_pos] ==
-                            target[target_pos - target_pointer_shift]) {
+                };
+                std::vector<std::thread> helpers;
+                for (size_t t = 1; t < std::min<size_t>(patching_threads, regions.size()); ++t) {
+                    helpers.emplace_back([&]() {
+                        align_regions(wflign_aligners_t::for_this_thread().convex(
+                                convex_penalties, wfa::WFAligner::MemoryUltralow));
+                    });
+                }
+                align_regions(wf_aligner);
+                for (auto& helper : helpers) {
+                    helper.join();
+                }
+                for (size_t r = 0; r < regions.size(); ++r) {
+                    alignments.emplace(regions[r], std::move(results[r]));
+                }
+            };
+
+            // Patching in the middle. With several patching threads a first pass plans
+            // the patches, walking the trace as if each of them succeeded, and aligns
+            // them on all threads; the second pass walks it for real and takes the
+            // planned alignment of every patch it meets that was planned. The others,
+            // where a failed or differently shaped patch moved the following ones, are
+            // aligned as they are met, so the trace is the same either way.
+            std::vector<patch_region_t> planned_regions;
+            std::map<patch_region_t, std::vector<alignment_t>> planned_patches;
+            const uint64_t middle_query_pos = query_pos;
+            const uint64_t middle_target_pos = target_pos;
+            wflign_rle_cigar_t planned_trace;
+            for (const bool planning : {true, false}) {
+                if (planning && patching_threads <= 1) {
+                    continue;
+                }
+                if (planning) {
+                    planned_trace = patched;
+                }
+                wflign_rle_cigar_t& trace_out = planning ? planned_trace : patched;
+                q = unpatched.begin();
+                query_pos = middle_query_pos;
+                target_pos = middle_target_pos;
+                query_delta = 0;
+                target_delta = 0;
+
+                while (q != unpatched.end()) {
+                    // get to the first matchn
+                    while (q != unpatched.end() && (*q == 'M' || *q == 'X')) {
+                        /*
+                    std::cerr << "q: " << query[query_pos] << " "
+                              << "t: " << target[target_pos - target_pointer_shift]
+                              << std::endl;
+                    */
+                        if (query_pos >= query_length ||
+                            target_pos >= target_length) {
                             std::cerr << "[wflign::wflign_affine_wavefront] "
-                                         "corrupted traceback (X, but there is "
-                                         "a match) for "
-                                      << query_name << " " << query_offset
-                                      << " " << target_name << " "
-                                      << target_offset << std::endl;
+                                         "corrupted traceback (out of bounds) for "
+                                      << query_name << " " << query_offset << " "
+                                      << target_name << " " << target_offset
+                                      << std::endl;
                             exit(1);
                         }
-                    }
-
-                    patched.push_back(*q);
-                    ++query_pos;
-                    ++target_pos;
-                    ++q;
-                }
 
-                // how long a gap?
-                while (q != unpatched.end() && *q == 'I') {
-                    ++query_delta;
-                    ++q;
-                }
-                while (q != unpatched.end() && *q == 'D') {
-                    ++target_delta;
-                    ++q;
-                }
+                        if (*q == 'M') {
+                            if (query[query_pos] !=
+                                target[target_pos - target_pointer_shift]) {
+                                std::cerr << "[wflign::wflign_affine_wavefront] "
+                                             "corrupted traceback (M, but there is "
+                                             "a mismatch) for "
+                                          << query_name << " " << query_offset
+                                          << " " << target_name << " "
+                                          << target_offset << std::endl;
+                                exit(1);
+                            }
+                        } else {
+                            if (query[query_pos] ==
+                                target[target_pos - target_pointer_shift]) {
+                                std::cerr << "[wflign::wflign_affine_wavefront] "
+                                             "corrupted traceback (X, but there is "
+                                             "a match) for "
+                                          << query_name << " " << query_offset
+                                          << " " << target_name << " "
+                                          << target_offset << std::endl;
+                                exit(1);
+                            }
+                        }
 
-                // how long was our last gap?
-                // if it's long enough, patch it
-                int32_t size_region_to_repatch = 0;
-                // unused!
-
-                {
-                    got_alignment = false;
-
-                    if ((size_region_to_repatch > 0 ||
-                         (query_delta > 0 && target_delta > 0) ||
-                         (query_delta > 2 || target_delta > 2) &&
-                                 (query_delta < wflign_max_len_major &&
-                                  target_delta < wflign_max_len_major) &&
-                                 (query_delta < wflign_max_len_minor ||
-                                  target_delta < wflign_max_len_minor))) {
-
-                        int32_t distance_close_indels = 
-                            (query_delta > 10 || target_delta > 10) ?	
-                            distance_close_big_enough_indels(std::max(query_delta, target_delta), q, unpatched, max_dist_to_look_at) :	
-                            -1;
-
-                        // Trigger the patching if there is a dropout
-                        // (consecutive Is and Ds) or if there is a close and
-                        // big enough indel forward
-                        if (size_region_to_repatch > 0 ||
-                            (query_delta > 0 && target_delta > 0) ||
-                            (query_delta > 2 || target_delta > 2) ||
-                            distance_close_indels > 0) {
-#ifdef WFLIGN_DEBUG
-                            // std::cerr << "query_delta " << query_delta <<
-                            // "\n"; std::cerr << "target_delta " << target_delta
-                            // << "\n"; std::cerr << "distance_close_indel " <<
-                            // distance_close_indel << "\n";
+                        trace_out.push_back(*q);
+                        ++query_pos;
+                        ++target_pos;
+                        ++q;
+                    }
 
-                            std::cerr << "[wflign::wflign_affine_wavefront] "
-                                         "patching in "
-                                      << query_name << " " << query_offset
-                                      << " @ " << query_pos << " - "
-                                      << query_delta << " " << target_name
-                                      << " " << target_offset << " @ "
-                                      << target_pos << " - " << target_delta
-                                      << std::endl;
-#endif
+                    // how long a gap?
+                    while (q != unpatched.end() && *q == 'I') {
+                        ++query_delta;
+                        ++q;
+                    }
+                    while (q != unpatched.end() && *q == 'D') {
+                        ++target_delta;
+                        ++q;
+                    }
 
-                            // if we are continuing a patch, we can't nibble
-                            // backward too much to avoid the risk of going in
-                            // endless loop
-                            if (size_region_to_repatch > 0) {
-                                // nibble backward
-                                while (!patched.empty() &&
-                                       size_region_to_repatch > 0) {
-                                    const auto &c = patched.back();
-                                    switch (c) {
-                                        case 'M':
-                                        case 'X':
-                                            --query_pos;
-                                            --target_pos;
-                                            ++query_delta;
-                                            ++target_delta;
-                                            break;
-                                        case 'I':
-                                            ++query_delta;
-                                            --query_pos;
-                                            break;
-                                        case 'D':
-                                            ++target_delta;
-                                            --target_pos;
-                                            break;
-                                        default:
-                                            break;
+                    // how long was our last gap?
+                    // if it's long enough, patch it
+                    int32_t size_region_to_repatch = 0;
+                    // unused!
+
+                    {
+                        got_alignment = false;
+
+                        if ((size_region_to_repatch > 0 ||
+                             (query_delta > 0 && target_delta > 0) ||
+                             (query_delta > 2 || target_delta > 2) &&
+                                     (query_delta < wflign_max_len_major &&
+                                      target_delta < wflign_max_len_major) &&
+                                     (query_delta < wflign_max_len_minor ||
+                                      target_delta < wflign_max_len_minor))) {
+
+                            int32_t distance_close_indels = 
+                                (query_delta > 10 || target_delta > 10) ?	
+                                distance_close_big_enough_indels(std::max(query_delta, target_delta), q, unpatched, max_dist_to_look_at) :	
+                                -1;
+
+                            // Trigger the patching if there is a dropout
+                            // (consecutive Is and Ds) or if there is a close and
+                            // big enough indel forward
+                            if (size_region_to_repatch > 0 ||
+                                (query_delta > 0 && target_delta > 0) ||
+                                (query_delta > 2 || target_delta > 2) ||
+                                distance_close_indels > 0) {
+    #ifdef WFLIGN_DEBUG
+                                // std::cerr << "query_delta " << query_delta <<
+                                // "\n"; std::cerr << "target_delta " << target_delta
+                                // << "\n"; std::cerr << "distance_close_indel " <<
+                                // distance_close_indel << "\n";
+
+                                std::cerr << "[wflign::wflign_affine_wavefront] "
+                                             "patching in "
+                                          << query_name << " " << query_offset
+                                          << " @ " << query_pos << " - "
+                                          << query_delta << " " << target_name
+                                          << " " << target_offset << " @ "
+                                          << target_pos << " - " << target_delta
+                                          << std::endl;
+    #endif
+
+                                // if we are continuing a patch, we can't nibble
+                                // backward too much to avoid the risk of going in
+                                // endless loop
+                                if (size_region_to_repatch > 0) {
+                                    // nibble backward
+                                    while (!trace_out.empty() &&
+                                           size_region_to_repatch > 0) {
+                                        const auto &c = trace_out.back();
+                                        switch (c) {
+                                            case 'M':
+                                            case 'X':
+                                                --query_pos;
+                                                --target_pos;
+                                                ++query_delta;
+                                                ++target_delta;
+                                                break;
+                                            case 'I':
+                                                ++query_delta;
+                                                --query_pos;
+                                                break;
+                                            case 'D':
+                                                ++target_delta;
+                                                --target_pos;
+                                                break;
+                                            default:
+                                                break;
+                                        }
+                                        trace_out.pop_back();
+                                        --size_region_to_repatch;
+                                    }
+                                } else {
+                                    // nibble backward if we're below the correct
+                                    // length
+                                    while (
+                                            !trace_out.empty() &&
+                                            (query_delta < (min_wfa_patch_length / 2) ||
+                                             target_delta <
+                                                     (min_wfa_patch_length / 2))) {
+                                        const auto &c = trace_out.back();
+                                        switch (c) {
+                                            case 'M':
+                                            case 'X':
+                                                --query_pos;
+                                                --target_pos;
+                                                ++query_delta;
+                                                ++target_delta;
+                                                break;
+                                            case 'I':
+                                                ++query_delta;
+                                                --query_pos;
+                                                break;
+                                            case 'D':
+                                                ++target_delta;
+                                                --target_pos;
+                                                break;
+                                            default:
+                                                break;
+                                        }
+                                        trace_out.pop_back();
                                     }
-                                    patched.pop_back();
-                                    --size_region_to_repatch;
                                 }
-                            } else {
-                                // nibble backward if we're below the correct
-                                // length
-                                while (
-                                        !patched.empty() &&
-                                        (query_delta < (min_wfa_patch_length / 2) ||
-                                         target_delta <
-                                                 (min_wfa_patch_length / 2))) {
-                                    const auto &c = patched.back();
+
+                                // nibble forward if we're below the correct length
+                                while (q != unpatched.end() &&
+                                       (query_delta < min_wfa_patch_length ||
+                                        target_delta < min_wfa_patch_length)) {
+                                    const auto &c = *q++;
                                     switch (c) {
                                         case 'M':
                                         case 'X':
-                                            --query_pos;
-                                            --target_pos;
                                             ++query_delta;
                                             ++target_delta;
                                             break;
                                         case 'I':
                                             ++query_delta;
-                                            --query_pos;
                                             break;
                                         case 'D':
                                             ++target_delta;
-                                            --target_pos;
                                             break;
                                         default:
                                             break;
                                     }
-                                    patched.pop_back();
-                                }
-                            }
 
-                            // nibble forward if we're below the correct length
-                            while (q != unpatched.end() &&
-                                   (query_delta < min_wfa_patch_length ||
-                                    target_delta < min_wfa_patch_length)) {
-                                const auto &c = *q++;
-                                switch (c) {
-                                    case 'M':
-                                    case 'X':
-                                        ++query_delta;
-                                        ++target_delta;
-                                        break;
-                                    case 'I':
-                                        ++query_delta;
-                                        break;
-                                    case 'D':
-                                        ++target_delta;
-                                        break;
-                                    default:
-                                        break;
+                                    --distance_close_indels;
                                 }
 
-                                --distance_close_indels;
-                            }
-
-                            // Nibble until the close, big enough indel is	
-                            // reached Important when the patching can't be	
-                            // computed correctly without including the next	
-                            // indel	
-                            while (q != unpatched.end() &&	
-                                   distance_close_indels > 0) {	
-                                const auto &c = *q++;	
-                                switch (c) {	
-                                    case 'M':	
-                                    case 'X':	
-                                        ++query_delta;	
-                                        ++target_delta;	
-                                        break;	
-                                    case 'I':	
-                                        ++query_delta;	
-                                        break;	
-                                    case 'D':	
-                                        ++target_delta;	
-                                        break;	
-                                    default:	
-                                        break;	
-                                }	
-
-                                --distance_close_indels;	
-                            }
+                                // Nibble until the close, big enough indel is	
+                                // reached Important when the patching can't be	
+                                // computed correctly without including the next	
+                                // indel	
+                                while (q != unpatched.end() &&	
+                                       distance_close_indels > 0) {	
+                                    const auto &c = *q++;	
+                                    switch (c) {	
+                                        case 'M':	
+                                        case 'X':	
+                                            ++query_delta;	
+                                            ++target_delta;	
+                                            break;	
+                                        case 'I':	
+                                            ++query_delta;	
+                                            break;	
+                                        case 'D':	
+                                            ++target_delta;	
+                                            break;	
+                                        default:	
+                                            break;	
+                                    }	
+
+                                    --distance_close_indels;	
+                                }
 
-                            // check forward if there are other Is/Ds to merge
-                            // in the current patch
-                            while (q != unpatched.end() &&
-                                   (*q == 'I' || *q == 'D') &&
-                                   ((query_delta < wflign_max_len_major &&
-                                     target_delta < wflign_max_len_major) &&
-                                    (query_delta < wflign_max_len_minor ||
-                                     target_delta < wflign_max_len_minor))) {
-                                const auto &c = *q++;
-                                if (c == 'I') {
-                                    ++query_delta;
-                                } else {
-                                    ++target_delta;
+                                // check forward if there are other Is/Ds to merge
+                                // in the current patch
+                                while (q != unpatched.end() &&
+                                       (*q == 'I' || *q == 'D') &&
+                                       ((query_delta < wflign_max_len_major &&
+                                         target_delta < wflign_max_len_major) &&
+                                        (query_delta < wflign_max_len_minor ||
+                                         target_delta < wflign_max_len_minor))) {
+                                    const auto &c = *q++;
+                                    if (c == 'I') {
+                                        ++query_delta;
+                                    } else {
+                                        ++target_delta;
+                                    }
                                 }
-                            }
 
-                            // check backward if there are other Is/Ds to merge
-                            // in the current patch it will eventually nibble
-                            // the Is/Ds left from the last patch
-                            while (!patched.empty() &&
-                                   (patched.back() == 'I' ||
-                                    patched.back() == 'D') &&
-                                   ((query_delta < wflign_max_len_major &&
-                                     target_delta < wflign_max_len_major) &&
-                                    (query_delta < wflign_max_len_minor ||
-                                     target_delta < wflign_max_len_minor))) {
-                                const auto &c = patched.back();
-                                if (c == 'I') {
-                                    ++query_delta;
-                                    --query_pos;
-                                } else {
-                                    ++target_delta;
-                                    --target_pos;
+                                // check backward if there are other Is/Ds to merge
+                                // in the current patch it will eventually nibble
+                                // the Is/Ds left from the last patch
+                                while (!trace_out.empty() &&
+                                       (trace_out.back() == 'I' ||
+                                        trace_out.back() == 'D') &&
+                                       ((query_delta < wflign_max_len_major &&
+                                         target_delta < wflign_max_len_major) &&
+                                        (query_delta < wflign_max_len_minor ||
+                                         target_delta < wflign_max_len_minor))) {
+                                    const auto &c = trace_out.back();
+                                    if (c == 'I') {
+                                        ++query_delta;
+                                        --query_pos;
+                                    } else {
+                                        ++target_delta;
+                                        --target_pos;
+                                    }
+                                    trace_out.pop_back();
                                 }
-                                patched.pop_back();
-                            }
 
-                            size_region_to_repatch = 0;
-                            {
-                                // WFA is only global
-                                auto patch_alignments = do_progressive_wfa_patch_alignment(
-                                        query,
-                                        query_pos,
-                                        query_delta,
-                                        target - target_pointer_shift,
-                                        target_pos,
-                                        target_delta,
-                                        wf_aligner,
-                                        convex_penalties,
-                                        chain_gap,
-                                        max_patching_score,
-                                        min_inversion_length,
-                                        erode_k);
-                                if (patch_alignments.size() == 1
-                                    && patch_alignments.front().ok
-                                    && !patch_alignments.front().is_rev) {
+                                size_region_to_repatch = 0;
+                                if (planning) {
+                                    planned_regions.emplace_back(query_pos, query_delta, target_pos, target_delta);
+                                    // as if aligned: the gaps of the region, then its matches
+                                    const uint64_t diagonal = std::min(query_delta, target_delta);
+                                    trace_out.push('I', query_delta - diagonal);
+                                    trace_out.push('D', target_delta - diagonal);
+                                    trace_out.push('M', diagonal);
                                     got_alignment = true;
-                                    auto& patch_aln = patch_alignments.front();
-                                    const int start_idx =
-                                        patch_aln.edit_cigar.begin_offset;
-                                    const int end_idx =
-                                        patch_aln.edit_cigar.end_offset;
-                                    for (int i = start_idx; i < end_idx; i++) {
-                                        patched.push_back(patch_aln.edit_cigar.cigar_ops[i]);
+                                } else {
+                                    // WFA is only global
+                                    std::vector<alignment_t> patch_alignments;
+                                    auto planned = planned_patches.find(
+                                            patch_region_t(query_pos, query_delta, target_pos, target_delta));
+                                    if (planned != planned_patches.end()) {
+                                        patch_alignments = std::move(planned->second);
+                                        planned_patches.erase(planned);
+                                    } else {
+                                        patch_alignments = do_progressive_wfa_patch_alignment(
+                                                query,
+                                                query_pos,
+                                                query_delta,
+                                                target - target_pointer_shift,
+                                                target_pos,
+                                                target_delta,
+                                                wf_aligner,
+                                                convex_penalties,
+                                                chain_gap,
+                                                max_patching_score,
+                                                min_inversion_length,
+                                                erode_k);
                                     }
-                                } else if (save_multi_patch_alns) {
-                                    for (auto& aln : patch_alignments) {
-                                        trim_alignment(aln);
-                                        multi_patch_alns.push_back(aln);
+                                    if (patch_alignments.size() == 1
+                                        && patch_alignments.front().ok
+                                        && !patch_alignments.front().is_rev) {
+                                        got_alignment = true;
+                                        auto& patch_aln = patch_alignments.front();
+                                        const int start_idx =
+                                            patch_aln.edit_cigar.begin_offset;
+                                        const int end_idx =
+                                            patch_aln.edit_cigar.end_offset;
+                                        for (int i = start_idx; i < end_idx; i++) {
+                                            trace_out.push_back(patch_aln.edit_cigar.cigar_ops[i]);
+                                        }
+                                    } else if (save_multi_patch_alns) {
+                                        for (auto& aln : patch_alignments) {
+                                            trim_alignment(aln);
+                                            multi_patch_alns.push_back(aln);
+                                        }
                                     }
-                                }
 
 #ifdef WFA_PNG_TSV_TIMING
-                                if (emit_patching_tsv) {
-                                    for (auto& aln : patch_alignments) {
-                                        *out_patching_tsv
-                                            << query_name << "\t" << query_pos << "\t" << query_pos + query_delta << "\t"
-                                            << target_name << "\t" << (target_pos - target_pointer_shift) << "\t" << (target_pos - target_pointer_shift + target_delta) << "\t"
-                                            << aln.ok << std::endl;
+                                    if (emit_patching_tsv) {
+                                        for (auto& aln : patch_alignments) {
+                                            *out_patching_tsv
+                                                << query_name << "\t" << query_pos << "\t" << query_pos + query_delta << "\t"
+                                                << target_name << "\t" << (target_pos - target_pointer_shift) << "\t" << (target_pos - target_pointer_shift + target_delta) << "\t"
+                                                << aln.ok << std::endl;
+                                        }
                                     }
-                                }
 #endif
+                                }
                             }
                         }
-                    }
 
-                    // add in stuff if we didn't align
-                    if (!got_alignment) {
-                        for (uint64_t i = 0; i < query_delta; ++i) {
-                            patched.push_back('I');
+                        // add in stuff if we didn't align
+                        if (!got_alignment) {
+                            trace_out.push('I', query_delta);
+                            trace_out.push('D', target_delta);
                         }
-                        for (uint64_t i = 0; i < target_delta; ++i) {
-                            patched.push_back('D');
-                        }
-                    }
 
-                    // std::cerr << "query_delta " << query_delta << std::endl;
-                    // std::cerr << "target_delta " << target_delta <<
-                    // std::endl;
-                    query_pos += query_delta;
-                    target_pos += target_delta;
+                        // std::cerr << "query_delta " << query_delta << std::endl;
+                        // std::cerr << "target_delta " << target_delta <<
+                        // std::endl;
+                        query_pos += query_delta;
+                        target_pos += target_delta;
+
+                        query_delta = 0;
+                        target_delta = 0;
+                    }
+                }
 
-                    query_delta = 0;
-                    target_delta = 0;
+                if (planning) {
+                    align_planned_patches(planned_regions, planned_patches);
                 }
             }
 
@@ -1573,9 +1683,9 @@ void write_merged_alignment(
         };
 
         {
-            std::vector<char> erodev;
+            wflign_rle_cigar_t erodev;
             {
-                std::vector<char> rawv;
+                wflign_rle_cigar_t rawv;
 
                 // copy
 #ifdef WFLIGN_DEBUG
@@ -1592,16 +1702,10 @@ void write_merged_alignment(
                         }
                         ++ok_alns;
                         if (query_end && aln.j > query_end) {
-                            const int len = aln.j - query_end;
-                            for (uint64_t i = 0; i < len; ++i) {
-                                rawv.push_back('I');
-                            }
+                            rawv.push('I', aln.j - query_end);
                         }
                         if (target_end && aln.i > target_end) {
-                            const int len = aln.i - target_end;
-                            for (uint64_t i = 0; i < len; ++i) {
-                                rawv.push_back('D');
-                            }
+                            rawv.push('D', aln.i - target_end);
                         }
                         uint64_t target_aligned_length = 0;
                         uint64_t query_aligned_length = 0;
@@ -1629,8 +1733,6 @@ void write_merged_alignment(
                         query_end = aln.j + query_aligned_length;
                         target_end = aln.i + target_aligned_length;
                     }
-                    // clean up
-                    delete *x;
                 }
 
 #ifdef VALIDATE_WFA_WFLIGN
@@ -1662,26 +1764,32 @@ void write_merged_alignment(
                           << erode_k << std::endl;
 #endif
 
-                // erode by removing matches < k
-                for (uint64_t i = 0; i < rawv.size();) {
-                    if (rawv[i] == 'M' || rawv[i] == 'X') {
+                // erode by removing matches < k, a stretch of them becoming as
+                // many deletions and insertions (ordered as the indels are sorted)
+                const std::vector<uint32_t>& raw_runs = rawv.runs();
+                for (uint64_t i = 0; i < raw_runs.size();) {
+                    const char op = wflign_rle_cigar_t::op_of(raw_runs[i]);
+                    if (op == 'M' || op == 'X') {
                         uint64_t j = i;
-                        while (++j < rawv.size() &&
-                               (rawv[j] == 'M' || rawv[j] == 'X')) {
+                        uint64_t length = 0;
+                        while (j < raw_runs.size() &&
+                               (wflign_rle_cigar_t::op_of(raw_runs[j]) == 'M' ||
+                                wflign_rle_cigar_t::op_of(raw_runs[j]) == 'X')) {
+                            length += wflign_rle_cigar_t::length_of(raw_runs[j++]);
                         }
-                        if (j - i < erode_k) {
-                            while (i < j) {
-                                erodev.push_back('D');
-                                erodev.push_back('I');
-                                ++i;
-                            }
+                        if (length < erode_k) {
+                            erodev.push('D', length);
+                            erodev.push('I', length);
+                            i = j;
                         } else {
                             while (i < j) {
-                                erodev.push_back(rawv[i++]);
+                                erodev.push(wflign_rle_cigar_t::op_of(raw_runs[i]),
+                                            wflign_rle_cigar_t::length_of(raw_runs[i]));
+                                ++i;
                             }
                         }
                     } else {
-                        erodev.push_back(rawv[i++]);
+                        erodev.push(op, wflign_rle_cigar_t::length_of(raw_runs[i++]));
                     }
                 }
             }
@@ -1800,29 +1908,37 @@ void write_merged_alignment(
         uint64_t trim_del_last;
 
         // 1.) sort initial ins/del to put del < ins
-        auto first_non_indel = tracev.begin();
-        while (first_non_indel != tracev.end() &&
-               (*first_non_indel == 'D' || *first_non_indel == 'I')) {
-            ++first_non_indel;
+        uint64_t initial_ins = 0, initial_dels = 0;
+        for (const uint32_t run : tracev.runs()) {
+            const char op = wflign_rle_cigar_t::op_of(run);
+            if (op == 'I') {
+                initial_ins += wflign_rle_cigar_t::length_of(run);
+            } else if (op == 'D') {
+                initial_dels += wflign_rle_cigar_t::length_of(run);
+            } else {
+                break;
+            }
+        }
+        {
+            wflign_rle_cigar_t sorted;
+            sorted.push('D', initial_dels);
+            sorted.push('I', initial_ins);
+            sorted.append(tracev, initial_ins + initial_dels);
+            tracev = std::move(sorted);
         }
-        std::sort(tracev.begin(), first_non_indel,
-                  [](char a, char b) { return a < b; });
         // 2.) find first non-D in tracev --> tracev_begin
         //   a.) add to target_start this count
-        auto first_non_del = tracev.begin();
-        while (first_non_del != tracev.end() && *first_non_del == 'D') {
-            ++first_non_del;
-        }
-        trim_del_first = std::distance(tracev.begin(), first_non_del);
+        trim_del_first = initial_dels;
         target_start += trim_del_first;
 
         // 3.) count D's at end of tracev --> tracev_end
         //   b.) subtract from target_end this count
-        auto last_non_del = tracev.rbegin();
-        while (last_non_del != tracev.rend() && *last_non_del == 'D') {
-            ++last_non_del;
+        trim_del_last = 0;
+        const std::vector<uint32_t>& trace_runs = tracev.runs();
+        for (auto run = trace_runs.rbegin();
+             run != trace_runs.rend() && wflign_rle_cigar_t::op_of(*run) == 'D'; ++run) {
+            trim_del_last += wflign_rle_cigar_t::length_of(*run);
         }
-        trim_del_last = std::distance(tracev.rbegin(), last_non_del);
         target_end -= trim_del_last;
 
         begin_offset = trim_del_first;
@@ -2069,7 +2185,26 @@ query_start : query_end)
                 "\tap:i:" + std::to_string(num_alignments_performed);
 #endif
 
-        if (paf_format_else_sam) {
+        std::vector<paf_record_t>* sink = paf_record_t::sink_for_this_thread();
+        if (paf_format_else_sam && sink) {
+            paf_record_t& record = sink->emplace_back();
+            record.query_name = query_name;
+            record.query_length = query_total_length;
+            record.query_start = query_offset + (query_is_rev ? query_length - query_end : query_start);
+            record.query_end = query_offset + (query_is_rev ? query_length - query_start : query_end);
+            record.reverse = query_is_rev;
+            record.target_name = target_name;
+            record.target_length = target_total_length;
+            record.target_start = target_offset - target_pointer_shift + target_start;
+            record.target_end = target_offset + target_end;
+            record.matches = cigar_matches;
+            record.block_length = cigar_matches + cigar_mismatches + cigar_inserted_bp + cigar_deleted_bp;
+            record.mapq = (int)std::round(float2phred(1.0 - block_identity));
+            record.gap_compressed_identity = gap_compressed_identity;
+            record.block_identity = block_identity;
+            record.estimated_identity = mashmap_estimated_identity;
+            record.cigar = cigarv;
+        } else if (paf_format_else_sam) {
             out << query_name << "\t" << query_total_length << "\t"
                 << query_offset +
                    (query_is_rev ? query_length - query_end : query_start)
@@ -2191,15 +2326,8 @@ query_start : query_end)
     // Clean up
     free(cigarv);
     
-    // Write SAM format alignments and clean up trace
+    // Write SAM format alignments; the trace belongs to the caller
     if (!paf_format_else_sam) {
-        // Clean up the trace alignments since we're done with them
-        for (auto* aln : trace) {
-            if (aln != nullptr) {
-                delete aln;
-            }
-        }
-        
         // Write the patch alignments
         for (auto& patch_aln : multi_patch_alns) {
             write_alignment_sam(
@@ -2238,7 +2366,11 @@ query_start : query_end)
                     mashmap_estimated_identity,
                     false,  // Don't add an endline after each alignment
                     true);  // This is a reverse complement alignment
-            if (wrote) {
+            if (wrote && paf_record_t::sink_for_this_thread()) {
+                paf_record_t& record = paf_record_t::sink_for_this_thread()->back();
+                record.multipatch = true;
+                record.inverted = patch_aln.is_rev;
+            } else if (wrote) {
                 // write tag indicating that this is a multipatch alignment
                 out << "\t" << "pt:Z:true" << "\t"
                     // and if the patch is inverted as well
@@ -2332,8 +2464,156 @@ void write_tag_and_md_string(
     }
 }
 
-void write_alignment_sam(
-    std::ostream &out,
+// The statistics of a CIGAR with the deletions at its ends trimmed, as trim_deletions
+// and process_compressed_cigar give them
+struct trimmed_cigar_stats_t {
+    size_t begin = 0;                   // the trimmed CIGAR, [begin, end) of the string
+    size_t end = 0;
+    uint64_t leading_deleted_bp = 0;
+    uint64_t matches = 0;
+    uint64_t mismatches = 0;
+    uint64_t insertions = 0;
+    uint64_t inserted_bp = 0;
+    uint64_t deletions = 0;
+    uint64_t deleted_bp = 0;
+    uint64_t refAlignedLength = 0;
+    uint64_t qAlignedLength = 0;
+};
+
+// The MD tag write_tag_and_md_string writes, built a run at a time
+class md_tag_builder_t {
+public:
+    md_tag_builder_t(record_buffer_t& out, const char* target, const int64_t target_start)
+        : out(out), target(target), t_off(target_start) {
+        out.append("MD:Z:");
+    }
+
+    void add(const char op, uint64_t len) {
+        if (last_len) {
+            if (last_op == op) {
+                len += last_len;
+            } else if (last_op == '=' || last_op == 'M') {
+                l_MD += last_len;
+                t_off += last_len;
+            } else if (last_op == 'X') {
+                for (uint64_t ii = 0; ii < last_len; ++ii) {
+                    out.append_uint(l_MD);
+                    out.append(target[t_off + ii]);
+                    l_MD = 0;
+                }
+                t_off += last_len;
+            } else if (last_op == 'D') {
+                out.append_uint(l_MD);
+                out.append('^');
+                out.append(std::string_view(target + t_off, last_len));
+                l_MD = 0;
+                t_off += last_len;
+            }
+        }
+        last_op = op;
+        last_len = len;
+    }
+
+    void finish() {
+        if (!last_len) {
+            return;
+        }
+        if (last_op == '=' || last_op == 'M') {
+            out.append_uint(last_len + l_MD);
+        } else if (last_op == 'X') {
+            for (uint64_t ii = 0; ii < last_len; ++ii) {
+                out.append_uint(l_MD);
+                out.append(target[t_off + ii]);
+                l_MD = 0;
+            }
+            out.append('0');
+        } else if (last_op == 'I') {
+            out.append_uint(l_MD);
+        } else if (last_op == 'D') {
+            out.append_uint(l_MD);
+            out.append('^');
+            out.append(std::string_view(target + t_off, last_len));
+            out.append('0');
+        }
+    }
+
+private:
+    record_buffer_t& out;
+    const char* target;
+    int64_t t_off;
+    uint64_t l_MD = 0;
+    char last_op = '\0';
+    uint64_t last_len = 0;
+};
+
+// One pass over the CIGAR for its trimmed statistics and, given md, the MD tag of the
+// trimmed CIGAR. Deletions are counted once a later operation shows they are not
+// trailing ones.
+static trimmed_cigar_stats_t scan_trimmed_cigar(const std::string& cigar, md_tag_builder_t* md) {
+    trimmed_cigar_stats_t stats;
+    bool trimmed_begun = false;
+    uint64_t pending_deletions = 0;
+    uint64_t pending_deleted_bp = 0;
+    size_t i = 0;
+    while (i < cigar.size()) {
+        uint64_t len = 0;
+        while (i < cigar.size() && std::isdigit(static_cast<unsigned char>(cigar[i]))) {
+            len = len * 10 + (cigar[i] - '0');
+            i++;
+        }
+        if (i >= cigar.size()) break;
+        const char op = cigar[i++];
+
+        if (op == 'D') {
+            if (!trimmed_begun) {
+                stats.leading_deleted_bp += len;
+                stats.begin = i;
+            } else {
+                ++pending_deletions;
+                pending_deleted_bp += len;
+            }
+            continue;
+        }
+        trimmed_begun = true;
+        if (pending_deletions) {
+            stats.deletions += pending_deletions;
+            stats.deleted_bp += pending_deleted_bp;
+            stats.refAlignedLength += pending_deleted_bp;
+            if (md) md->add('D', pending_deleted_bp);
+            pending_deletions = pending_deleted_bp = 0;
+        }
+        switch (op) {
+            case 'M':
+            case '=':
+                stats.matches += len;
+                stats.refAlignedLength += len;
+                stats.qAlignedLength += len;
+                break;
+            case 'X':
+                stats.mismatches += len;
+                stats.refAlignedLength += len;
+                stats.qAlignedLength += len;
+                break;
+            case 'I':
+                ++stats.insertions;
+                stats.inserted_bp += len;
+                stats.qAlignedLength += len;
+                break;
+            default:
+                break;
+        }
+        if (md) md->add(op, len);
+        stats.end = i;
+    }
+    if (!trimmed_begun) {
+        stats.end = stats.begin;
+    }
+    if (md) md->finish();
+    return stats;
+}
+
+std::string_view format_alignment_sam(
+    record_buffer_t& record,
     const alignment_t& patch_aln,
     const std::string& cigar_str,
     const std::string& query_name,
@@ -2355,208 +2635,256 @@ void write_alignment_sam(
 
     if (cigar_str == "") { std::cerr << "[wflign_patch] unsupported codepath" << std::endl; exit(1); }
 
-    uint64_t patch_matches = 0;
-    uint64_t patch_mismatches = 0;
-    uint64_t patch_insertions = 0;
-    uint64_t patch_inserted_bp = 0;
-    uint64_t patch_deletions = 0;
-    uint64_t patch_deleted_bp = 0;
-    uint64_t patch_refAlignedLength = 0;
-    uint64_t patch_qAlignedLength = 0;
-
-    process_compressed_cigar(
-        cigar_str,
-        patch_matches,
-        patch_mismatches,
-        patch_insertions,
-        patch_inserted_bp,
-        patch_deletions,
-        patch_deleted_bp,
-        patch_refAlignedLength,
-        patch_qAlignedLength);
-
-    // Trim deletions and get new coordinates
-    auto [trimmed_cigar, new_ref_start, new_ref_end, new_query_start, new_query_end] = 
-        trim_deletions(cigar_str, target_offset + patch_aln.i, target_offset + patch_aln.i + patch_refAlignedLength,
-                      query_offset + patch_aln.j, query_offset + patch_aln.j + patch_qAlignedLength);
-
-    // Recompute metrics with trimmed CIGAR
-    process_compressed_cigar(
-        trimmed_cigar,
-        patch_matches,
-        patch_mismatches,
-        patch_insertions,
-        patch_inserted_bp,
-        patch_deletions,
-        patch_deleted_bp,
-        patch_refAlignedLength,
-        patch_qAlignedLength);
-
-    char* patch_cigar = strdup(trimmed_cigar.c_str());
-
-    double patch_gap_compressed_identity = (double)patch_matches /
-        (double)(patch_matches + patch_mismatches + patch_insertions + patch_deletions);
-    double patch_block_identity = (double)patch_matches /
-        (double)(patch_matches + patch_mismatches + patch_inserted_bp + patch_deleted_bp);
+    // The MD tag goes last, so it is built alongside in a buffer of its own; its target
+    // start is the alignment's, as we are working on a subset of the target sequence
+    record_buffer_t& md_tag = record_buffer_t::for_this_thread(1);
+    md_tag.clear();
+    trimmed_cigar_stats_t stats;
+    if (emit_md_tag) {
+        md_tag_builder_t md(md_tag, target, 0 + patch_aln.i);
+        stats = scan_trimmed_cigar(cigar_str, &md);
+    } else {
+        stats = scan_trimmed_cigar(cigar_str, nullptr);
+    }
 
-    /*
-    const uint64_t query_start_pos =
-        (query_is_rev ? query_offset + query_length : query_offset);
-    const uint64_t query_end_pos =
-        (query_is_rev ? query_offset : query_offset + query_length);
-    */
+    double patch_gap_compressed_identity = (double)stats.matches /
+        (double)(stats.matches + stats.mismatches + stats.insertions + stats.deletions);
+    double patch_block_identity = (double)stats.matches /
+        (double)(stats.matches + stats.mismatches + stats.inserted_bp + stats.deleted_bp);
 
+    record.clear();
     if (patch_gap_compressed_identity >= min_identity) {
-
-        out << query_name << "\t"
-            << (query_is_rev ^ patch_aln.is_rev ? "16" : "0") << "\t"
-            << target_name << "\t"
-            << target_offset + patch_aln.i + 1 << "\t"
-            << std::round(float2phred(1.0 - patch_block_identity)) << "\t"
-            << patch_cigar << "\t"
-            << "*\t0\t0\t";
+        record.append(query_name);
+        record.append('\t');
+        record.append(query_is_rev ^ patch_aln.is_rev ? "16" : "0");
+        record.append('\t');
+        record.append(target_name);
+        record.append('\t');
+        record.append_uint(target_offset + patch_aln.i + 1);
+        record.append('\t');
+        record.append_double(std::round(float2phred(1.0 - patch_block_identity)));
+        record.append('\t');
+        record.append(std::string_view(cigar_str).substr(stats.begin, stats.end - stats.begin));
+        record.append("\t*\t0\t0\t");
 
         if (no_seq_in_sam) {
-            out << "*";
-        } else {
-            std::stringstream seq;
-            for (uint64_t p = patch_aln.j; p < patch_aln.j + patch_aln.query_length; ++p) {
-                seq << query[p];
-            }
-            if (patch_aln.is_rev) {
-                // reverse complement
-                out << reverse_complement(seq.str());
-            } else {
-                out << seq.str();
+            record.append('*');
+        } else if (patch_aln.is_rev) {
+            // reverse complement
+            for (uint64_t p = patch_aln.j + patch_aln.query_length; p > (uint64_t)patch_aln.j; --p) {
+                record.append(reverse_complement(query[p - 1]));
             }
+        } else {
+            record.append(std::string_view(query + patch_aln.j, patch_aln.query_length));
         }
-        out << "\t*\t"
-            << "NM:i:" << (patch_mismatches + patch_inserted_bp + patch_deleted_bp) << "\t"
-            << "gi:f:" << patch_gap_compressed_identity << "\t"
-            << "bi:f:" << patch_block_identity << "\t"
-            << "md:f:" << mashmap_estimated_identity;
-            //<< "\t" << "pt:Z:true" <<
-            //<< "\t" << "iv:Z:" << (patch_aln.is_rev ? "true" : "false");
+        record.append("\t*\tNM:i:");
+        record.append_uint(stats.mismatches + stats.inserted_bp + stats.deleted_bp);
+        record.append("\tgi:f:");
+        record.append_double(patch_gap_compressed_identity);
+        record.append("\tbi:f:");
+        record.append_double(patch_block_identity);
+        record.append("\tmd:f:");
+        record.append_double(mashmap_estimated_identity);
 
         if (emit_md_tag) {
-            out << "\t";
-
-            // target_start is 0, as we are working on a subset of the target sequence
-            write_tag_and_md_string(out, patch_cigar, 0, strlen(patch_cigar), 
-                                    0 + patch_aln.i,
-                                    target);
+            record.append('\t');
+            record.append(md_tag.view());
         }
 
-        out << "\n";
+        record.append('\n');
     }
+    return record.view();
+}
 
-    free(patch_cigar);
+void write_alignment_sam(
+    std::ostream &out,
+    const alignment_t& patch_aln,
+    const std::string& cigar_str,
+    const std::string& query_name,
+    const uint64_t& query_total_length,
+    const uint64_t& query_offset,
+    const uint64_t& query_length,
+    const bool& query_is_rev,
+    const std::string& target_name,
+    const uint64_t& target_total_length,
+    const uint64_t& target_offset,
+    const uint64_t& target_length,
+    const float& min_identity,
+    const float& mashmap_estimated_identity,
+    const bool& no_seq_in_sam,
+    const bool& emit_md_tag,
+    const char* query,
+    const char* target,
+    const int64_t& target_pointer_shift) {
+    const std::string_view sam = format_alignment_sam(
+        record_buffer_t::for_this_thread(), patch_aln, cigar_str, query_name, query_total_length,
+        query_offset, query_length, query_is_rev, target_name, target_total_length,
+        target_offset, target_length, min_identity, mashmap_estimated_identity,
+        no_seq_in_sam, emit_md_tag, query, target, target_pointer_shift);
+    out.write(sam.data(), sam.size());
 }
 
-bool write_alignment_paf(
-        std::ostream& out,
+// The coordinates, counts and identities of the PAF record of an alignment
+struct paf_span_t {
+    uint64_t query_start;
+    uint64_t query_end;
+    uint64_t target_start;
+    uint64_t target_end;
+    uint64_t matches;
+    uint64_t block_length;
+    double gap_compressed_identity;
+    double block_identity;
+    std::string_view cigar;     // trimmed, within cigar_str
+};
+
+// The span of the PAF record of an alignment, false if the alignment is not ok or below min_identity
+static bool alignment_paf_span(
+        paf_span_t& span,
         const alignment_t& aln,
         const std::string& cigar_str,
-        const std::string& query_name,
-        const uint64_t& query_total_length,
         const uint64_t& query_offset, // query offset on the forward strand
         const uint64_t& query_length, // used to compute the coordinates for reversed alignments
         const bool& query_is_rev, // if the base homology mapping is in the reverse complement orientation
+        const uint64_t& target_offset,
+        const float& min_identity) {
+    if (cigar_str == "") { std::cerr << "[wflign_patch] unsupported codepath" << std::endl; exit(1); }
+    if (!aln.ok) {
+        return false;
+    }
+    const trimmed_cigar_stats_t stats = scan_trimmed_cigar(cigar_str, nullptr);
+
+    size_t alignmentRefPos = aln.i + stats.leading_deleted_bp;
+    span.gap_compressed_identity =
+            (double)stats.matches /
+            (double)(stats.matches + stats.mismatches + stats.insertions + stats.deletions);
+    span.block_identity =
+            (double)stats.matches /
+            (double)(stats.matches + stats.mismatches + stats.inserted_bp + stats.deleted_bp);
+    if (!(span.gap_compressed_identity >= min_identity)) {
+        return false;
+    }
+    if (query_is_rev) {
+        span.query_start = query_offset + (query_length - aln.j - stats.qAlignedLength);
+        span.query_end = query_offset + (query_length - aln.j);
+    } else {
+        span.query_start = query_offset + aln.j;
+        span.query_end = query_offset + aln.j + stats.qAlignedLength;
+    }
+    span.target_start = target_offset + alignmentRefPos;
+    span.target_end = target_offset + alignmentRefPos + stats.refAlignedLength;
+    span.matches = stats.matches;
+    span.block_length = std::max(stats.refAlignedLength, stats.qAlignedLength);
+    span.cigar = std::string_view(cigar_str).substr(stats.begin, stats.end - stats.begin);
+    return true;
+}
+
+std::string_view format_alignment_paf(
+        record_buffer_t& record,
+        const alignment_t& aln,
+        const std::string& cigar_str,
+        const std::string& query_name,
+        const uint64_t& query_total_length,
+        const uint64_t& query_offset,
+        const uint64_t& query_length,
+        const bool& query_is_rev,
         const std::string& target_name,
         const uint64_t& target_total_length,
         const uint64_t& target_offset,
         const uint64_t& target_length, // unused
         const float& min_identity,
+        const float& mashmap_estimated_identity) {
+    record.clear();
+    paf_span_t span;
+    if (alignment_paf_span(span, aln, cigar_str, query_offset, query_length, query_is_rev, target_offset, min_identity)) {
+        record.append(query_name);
+        record.append('\t');
+        record.append_uint(query_total_length);
+        record.append('\t');
+        record.append_uint(span.query_start);
+        record.append('\t');
+        record.append_uint(span.query_end);
+        record.append('\t');
+        record.append(aln.is_rev ^ query_is_rev ? '-' : '+');
+        record.append('\t');
+        record.append(target_name);
+        record.append('\t');
+        record.append_uint(target_total_length);
+        record.append('\t');
+        record.append_uint(span.target_start);
+        record.append('\t');
+        record.append_uint(span.target_end);
+        record.append('\t');
+        record.append_uint(span.matches);
+        record.append('\t');
+        record.append_uint(span.block_length);
+        record.append('\t');
+        record.append_double(std::round(float2phred(1.0 - span.block_identity)));
+        record.append("\tgi:f:");
+        record.append_double(span.gap_compressed_identity);
+        record.append("\tbi:f:");
+        record.append_double(span.block_identity);
+        record.append("\tmd:f:");
+        record.append_double(mashmap_estimated_identity);
+        record.append("\tcg:Z:");
+        record.append(span.cigar);
+        record.append('\t');
+    }
+    return record.view();
+}
+
+bool write_alignment_paf(
+        std::ostream& out,
+        const alignment_t& aln,
+        const std::string& cigar_str,
+        const std::string& query_name,
+        const uint64_t& query_total_length,
+        const uint64_t& query_offset,
+        const uint64_t& query_length,
+        const bool& query_is_rev,
+        const std::string& target_name,
+        const uint64_t& target_total_length,
+        const uint64_t& target_offset,
+        const uint64_t& target_length,
+        const float& min_identity,
         const float& mashmap_estimated_identity,
         const bool& with_endline,
         const bool& is_rev_patch) {
-    bool ret = false;  // return true if we wrote the alignment
-    if (cigar_str == "") { std::cerr << "[wflign_patch] unsupported codepath" << std::endl; exit(1); }
-
-    if (aln.ok) {
-        uint64_t matches = 0;
-        uint64_t mismatches = 0;
-        uint64_t insertions = 0;
-        uint64_t inserted_bp = 0;
-        uint64_t deletions = 0;
-        uint64_t deleted_bp = 0;
-        uint64_t refAlignedLength = 0;
-        uint64_t qAlignedLength = 0;
-
-        process_compressed_cigar(
-            cigar_str,
-            matches,
-            mismatches,
-            insertions,
-            inserted_bp,
-            deletions,
-            deleted_bp,
-            refAlignedLength,
-            qAlignedLength);
-
-        // Trim deletions and get new coordinates
-        auto [trimmed_cigar, new_ref_start, new_ref_end, new_query_start, new_query_end] = 
-            trim_deletions(cigar_str, target_offset + aln.i, target_offset + aln.i + refAlignedLength,
-                         query_offset + aln.j, query_offset + aln.j + qAlignedLength);
-
-        // Recompute metrics with trimmed CIGAR
-        process_compressed_cigar(
-            trimmed_cigar,
-            matches,
-            mismatches,
-            insertions,
-            inserted_bp,
-            deletions,
-            deleted_bp,
-            refAlignedLength,
-            qAlignedLength);
-
-        char* cigar = strdup(trimmed_cigar.c_str());
-        size_t alignmentRefPos = new_ref_start - target_offset;
-        double gap_compressed_identity =
-                (double)matches /
-                (double)(matches + mismatches + insertions + deletions);
-        double block_identity =
-                (double)matches /
-                (double)(matches + mismatches + inserted_bp + deleted_bp);
-
-        if (gap_compressed_identity >= min_identity) {
-            uint64_t q_start, q_end;
-            if (query_is_rev) {
-                q_start = query_offset + (query_length - aln.j - qAlignedLength);
-                q_end = query_offset + (query_length - aln.j);
-            } else {
-                q_start = query_offset + aln.j;
-                q_end = query_offset + aln.j + qAlignedLength;
-            }
-
-            out << query_name << "\t" << query_total_length << "\t" << q_start
-                << "\t" << q_end << "\t"
-                << (aln.is_rev ^ query_is_rev ? "-" : "+") << "\t" << target_name << "\t"
-                << target_total_length << "\t"
-                << target_offset + alignmentRefPos << "\t"
-                << target_offset + alignmentRefPos + refAlignedLength << "\t"
-                << matches << "\t" << std::max(refAlignedLength, qAlignedLength)
-                << "\t" << std::round(float2phred(1.0 - block_identity)) << "\t"
-                //<< "as:i:" << aln.score << "\t"
-                << "gi:f:" << gap_compressed_identity << "\t"
-                << "bi:f:" << block_identity << "\t"
-                << "md:f:" << mashmap_estimated_identity << "\t"
-                //<< "\t" << "ma:i:" << matches
-                //<< "\t" << "mm:i:" << mismatches
-                //<< "\t" << "ni:i:" << insertions
-                //<< "\t" << "bi:i:" << inserted_bp
-                //<< "\t" << "nd:i:" << deletions
-                //<< "\t" << "bd:i:" << deleted_bp
-                << "cg:Z:" << cigar << "\t";
-            if (with_endline) {
-                out << std::endl;
-            }
-            ret = true;
+    if (std::vector<paf_record_t>* sink = paf_record_t::sink_for_this_thread()) {
+        paf_span_t span;
+        if (!alignment_paf_span(span, aln, cigar_str, query_offset, query_length, query_is_rev, target_offset, min_identity)) {
+            return false;
         }
-        free(cigar);
+        paf_record_t& record = sink->emplace_back();
+        record.query_name = query_name;
+        record.query_length = query_total_length;
+        record.query_start = span.query_start;
+        record.query_end = span.query_end;
+        record.reverse = aln.is_rev ^ query_is_rev;
+        record.target_name = target_name;
+        record.target_length = target_total_length;
+        record.target_start = span.target_start;
+        record.target_end = span.target_end;
+        record.matches = span.matches;
+        record.block_length = span.block_length;
+        record.mapq = (int)std::round(float2phred(1.0 - span.block_identity));
+        record.gap_compressed_identity = span.gap_compressed_identity;
+        record.block_identity = span.block_identity;
+        record.estimated_identity = mashmap_estimated_identity;
+        record.cigar = span.cigar;
+        return true;
+    }
+    const std::string_view paf = format_alignment_paf(
+        record_buffer_t::for_this_thread(), aln, cigar_str, query_name, query_total_length,
+        query_offset, query_length, query_is_rev, target_name, target_total_length,
+        target_offset, target_length, min_identity, mashmap_estimated_identity);
+    if (paf.empty()) {
+        return false;  // nothing written
     }
-    return ret;
+    out.write(paf.data(), paf.size());
+    if (with_endline) {
+        out << std::endl;
+    }
+    return true;
 }
 
 double float2phred(const double& prob) {
@@ -2569,20 +2897,26 @@ double float2phred(const double& prob) {
         return p;
 }
 
-void sort_indels(std::vector<char>& v) {
-    auto f = v.begin();
-    while (f != v.end()) {
-        auto j = f;
-        while (j != v.end() && (*j == 'D' || *j == 'I')) {
-            ++j;
-        }
-        if (j != f) {
-            std::sort(f, j, [](char a, char b) { return b < a; });
-            f = j;
+void sort_indels(wflign_rle_cigar_t& v) {
+    wflign_rle_cigar_t sorted;
+    uint64_t ins = 0, dels = 0;
+    for (const uint32_t run : v.runs()) {
+        const char op = wflign_rle_cigar_t::op_of(run);
+        if (op == 'I') {
+            ins += wflign_rle_cigar_t::length_of(run);
+        } else if (op == 'D') {
+            dels += wflign_rle_cigar_t::length_of(run);
         } else {
-            ++f;
+            // each stretch of indels as its insertions, then its deletions
+            sorted.push('I', ins);
+            sorted.push('D', dels);
+            ins = dels = 0;
+            sorted.push(op, wflign_rle_cigar_t::length_of(run));
         }
     }
+    sorted.push('I', ins);
+    sorted.push('D', dels);
+    v = std::move(sorted);
 }
 
     } /* namespace wavefront */
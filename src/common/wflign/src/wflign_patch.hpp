@@ -31,15 +31,35 @@
 namespace wflign {
     namespace wavefront {
 
+        // mash distance between the sketches of query tile v and target tile h
+        float wfa_segment_mash_dist(
+                rkmh::tile_sketches_t& query_sketches,
+                const int v,
+                const int64_t& j,
+                rkmh::tile_sketches_t& target_sketches,
+                const int h,
+                const int64_t& i,
+                const uint16_t& segment_length_q,
+                const uint16_t& segment_length_t,
+                const wflign_extend_data_t* extend_data);
+
+        // score a tile pair must align below to be a match
+        int wfa_segment_max_score(
+                const uint16_t& segment_length_q,
+                const uint16_t& segment_length_t,
+                const wflign_extend_data_t* extend_data);
+
         bool do_wfa_segment_alignment(
                 const std::string& query_name,
                 const char* query,
-                std::vector<rkmh::hash_t>*& query_sketch,
+                rkmh::tile_sketches_t& query_sketches,
+                const int v,
                 const uint64_t& query_length,
                 const int64_t& j,
                 const std::string& target_name,
                 const char* target,
-                std::vector<rkmh::hash_t>*& target_sketch,
+                rkmh::tile_sketches_t& target_sketches,
+                const int h,
                 const uint64_t& target_length,
                 const int64_t& i,
                 const uint16_t& segment_length_q,
@@ -80,7 +100,7 @@ namespace wflign {
             const int& erode_k);
 
         double float2phred(const double& prob);
-        void sort_indels(std::vector<char>& v);
+        void sort_indels(wflign_rle_cigar_t& v);
 
     } /* namespace wavefront */
 
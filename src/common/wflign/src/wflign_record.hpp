@@ -0,0 +1,102 @@
+#ifndef WFLIGN_RECORD_HPP_
+#define WFLIGN_RECORD_HPP_
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace wflign {
+namespace wavefront {
+
+/*
+* A reused buffer a PAF or SAM record is formatted in, to be written out at once. The
+* numbers are formatted with std::to_chars as a C locale ostream prints them, floating
+* point ones in its default 6 significant digits
+*/
+class record_buffer_t {
+public:
+    void clear() { used = 0; }
+    std::string_view view() const { return std::string_view(chars.data(), used); }
+
+    void append(const char c) {
+        reserve(1);
+        chars[used++] = c;
+    }
+    void append(const std::string_view s) {
+        reserve(s.size());
+        std::memcpy(chars.data() + used, s.data(), s.size());
+        used += s.size();
+    }
+    void append_uint(const uint64_t x) {
+        reserve(max_number_length);
+        used = std::to_chars(chars.data() + used, chars.data() + chars.size(), x).ptr - chars.data();
+    }
+    void append_int(const int64_t x) {
+        reserve(max_number_length);
+        used = std::to_chars(chars.data() + used, chars.data() + chars.size(), x).ptr - chars.data();
+    }
+    void append_double(const double x) {
+        reserve(max_number_length);
+        used = std::to_chars(chars.data() + used, chars.data() + chars.size(), x,
+                             std::chars_format::general, 6).ptr - chars.data();
+    }
+
+    // This thread's buffers; slot 0 holds records, slot 1 a tag built alongside one
+    static record_buffer_t& for_this_thread(const int slot = 0) {
+        thread_local record_buffer_t buffers[2];
+        return buffers[slot];
+    }
+
+private:
+    static constexpr size_t max_number_length = 32;
+
+    void reserve(const size_t n) {
+        if (used + n > chars.size()) {
+            chars.resize(std::max(2 * chars.size(), used + n + 256));
+        }
+    }
+
+    std::vector<char> chars;
+    size_t used = 0;
+};
+
+/*
+* A PAF record as its fields, for callers that take the alignments in memory. While a
+* thread has a sink set, the PAF records it aligns are added to it instead of being
+* written as text
+*/
+struct paf_record_t {
+    std::string query_name;
+    uint64_t query_length = 0;
+    uint64_t query_start = 0;
+    uint64_t query_end = 0;
+    bool reverse = false;
+    std::string target_name;
+    uint64_t target_length = 0;
+    uint64_t target_start = 0;
+    uint64_t target_end = 0;
+    uint64_t matches = 0;
+    uint64_t block_length = 0;
+    int mapq = 255;
+    double gap_compressed_identity = 0;     // gi:f:
+    double block_identity = 0;              // bi:f:
+    double estimated_identity = 0;          // md:f:, the identity the mapping estimated
+    std::string cigar;                      // cg:Z:, empty for a mapping written as it is
+    bool multipatch = false;                // pt:Z:true, a patch aligned apart from its record
+    bool inverted = false;                  // iv:Z:true, a patch on the other strand
+    std::string fallback;                   // fb:Z:, why the mapping is written as it is
+
+    static std::vector<paf_record_t>*& sink_for_this_thread() {
+        thread_local std::vector<paf_record_t>* sink = nullptr;
+        return sink;
+    }
+};
+
+} /* namespace wavefront */
+} /* namespace wflign */
+
+#endif /* WFLIGN_RECORD_HPP_ */
@@ -1,4 +1,5 @@
 #include "wflign_swizzle.hpp"
+#include <cstring>
 #include <iostream>
 
 namespace wflign {
@@ -298,6 +299,102 @@ std::string try_swap_end_pattern(
     return cigar;
 }
 
+// The run starting at i, moving i past it
+static bool cigar_run_after(
+    const std::string &cigar,
+    size_t &i,
+    uint64_t &count,
+    char &op) {
+    count = 0;
+    while (i < cigar.size() && std::isdigit(static_cast<unsigned char>(cigar[i]))) {
+        count = count * 10 + (cigar[i] - '0');
+        i++;
+    }
+    if (i >= cigar.size()) return false;
+    op = cigar[i++];
+    return true;
+}
+
+// The run ending at end, moving end back to its start
+static bool cigar_run_before(
+    const std::string &cigar,
+    size_t &end,
+    uint64_t &count,
+    char &op) {
+    if (end == 0 || std::isdigit(static_cast<unsigned char>(cigar[end - 1]))) return false;
+    op = cigar[--end];
+    count = 0;
+    uint64_t factor = 1;
+    while (end > 0 && std::isdigit(static_cast<unsigned char>(cigar[end - 1]))) {
+        count += (cigar[end - 1] - '0') * factor;
+        factor *= 10;
+        end--;
+    }
+    return true;
+}
+
+std::pair<size_t, size_t> swizzle_cigar_start(
+    std::string &cigar,
+    const char *query,
+    uint64_t query_length,
+    const char *target,
+    uint64_t target_length) {
+    size_t i = 0;
+    uint64_t N, Dlen;
+    char op1, op2;
+    if (!cigar_run_after(cigar, i, N, op1) || !cigar_run_after(cigar, i, Dlen, op2)
+        || op1 != '=' || op2 != 'D'
+        || N > query_length || Dlen + N > target_length
+        || std::memcmp(query, target + Dlen, N) != 0) {
+        return {0, 0};
+    }
+
+    // The matches now meet the run after the deletion
+    size_t next = i;
+    uint64_t count3;
+    char op3;
+    if (cigar_run_after(cigar, next, count3, op3) && op3 == '=') {
+        N += count3;
+        i = next;
+    }
+    const std::string swapped = std::to_string(Dlen) + "D" + std::to_string(N) + "=";
+    cigar.replace(0, i, swapped);
+    return {0, swapped.size()};
+}
+
+std::pair<size_t, size_t> swizzle_cigar_end(
+    std::string &cigar,
+    const char *query,
+    uint64_t query_length,
+    const char *target,
+    uint64_t target_length) {
+    size_t begin = cigar.size();
+    uint64_t N, Dlen;
+    char op1, op2;
+    if (!cigar_run_before(cigar, begin, N, op2) || !cigar_run_before(cigar, begin, Dlen, op1)
+        || op1 != 'D' || op2 != '='
+        || N > query_length || Dlen + N > target_length
+        || std::memcmp(query + query_length - N, target + target_length - N - Dlen, N) != 0) {
+        return {0, 0};
+    }
+    // As try_swap_end_pattern's verification of the swapped CIGAR, only an alignment of
+    // matches and deletions is swapped
+    if (cigar.find_first_not_of("0123456789=D") != std::string::npos) {
+        return {0, 0};
+    }
+
+    // The matches now meet the run before the deletion
+    size_t previous = begin;
+    uint64_t count3;
+    char op3;
+    if (cigar_run_before(cigar, previous, count3, op3) && op3 == '=') {
+        N += count3;
+        begin = previous;
+    }
+    cigar.replace(begin, std::string::npos, std::to_string(N) + "=" + std::to_string(Dlen) + "D");
+    return {begin, cigar.size()};
+}
+
 static std::string drop_leading_trailing_deletions_if_all_eq(
     const std::string &cigar) {
     std::vector<std::pair<int,int>> ops;
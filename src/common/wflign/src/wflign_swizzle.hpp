@@ -29,6 +29,24 @@ std::string try_swap_end_pattern(
     int64_t query_start,
     int64_t target_start);
 
+// In place forms of the two swaps for the CIGAR of an end-to-end alignment of query and
+// target. Only the runs at the swapped end are rewritten, joined with the run next to
+// them if it is one of the same operation; the returned [begin, end) is the part of the
+// CIGAR rewritten, empty when there was nothing to swap
+std::pair<size_t, size_t> swizzle_cigar_start(
+    std::string &cigar,
+    const char *query,
+    uint64_t query_length,
+    const char *target,
+    uint64_t target_length);
+
+std::pair<size_t, size_t> swizzle_cigar_end(
+    std::string &cigar,
+    const char *query,
+    uint64_t query_length,
+    const char *target,
+    uint64_t target_length);
+
 // Drop leading/trailing deletions if the rest is purely '='
 static std::string drop_leading_trailing_deletions_if_all_eq(
     const std::string &cigar);
@@ -0,0 +1,152 @@
+#include <algorithm>
+
+#include "wflign_tile_batch.hpp"
+
+namespace wflign {
+namespace wavefront {
+
+// Null offset; stays negative however many steps are added to it
+static constexpr int32_t OFFSET_NULL = -(1 << 28);
+
+wflambda_tile_batch_t::wflambda_tile_batch_t(
+    const int mismatch,
+    const int gap_opening,
+    const int gap_extension)
+    : mismatch(mismatch),
+      gap_opening(gap_opening),
+      gap_extension(gap_extension),
+      ring(std::max(mismatch, gap_opening + gap_extension) + 1),
+      wavefronts(ring) {}
+
+void wflambda_tile_batch_t::resize(const int max_pattern_length, const int max_text_length) {
+    if (-max_pattern_length >= k_min && max_text_length <= k_max) {
+        return;
+    }
+    k_min = std::min(k_min, -max_pattern_length);
+    k_max = std::max(k_max, max_text_length);
+    const size_t size = (size_t)ring * (k_max - k_min + 1);
+    m_offsets.assign(size, offsets_t{});
+    i_offsets.assign(size, offsets_t{});
+    d_offsets.assign(size, offsets_t{});
+}
+
+void wflambda_tile_batch_t::align(const tile_t* tiles, const int num_tiles, int* scores) {
+    const int n = std::min(num_tiles, lanes);
+    int max_pattern_length = 0, max_text_length = 0, max_score = 0;
+    offsets_t pattern_lengths, text_lengths;
+    for (int l = 0; l < lanes; ++l) {
+        // Unused lanes align two empty tiles, finishing at once
+        pattern_lengths[l] = l < n ? tiles[l].pattern_length : 0;
+        text_lengths[l] = l < n ? tiles[l].text_length : 0;
+        max_pattern_length = std::max(max_pattern_length, (int)pattern_lengths[l]);
+        max_text_length = std::max(max_text_length, (int)text_lengths[l]);
+        if (l < n) {
+            max_score = std::max(max_score, tiles[l].max_score);
+            scores[l] = -1;
+        }
+    }
+    resize(max_pattern_length, max_text_length);
+    const int width = k_max - k_min + 1;
+    const offsets_t null_offsets = offsets_t{} + OFFSET_NULL;
+
+    for (auto& wf : wavefronts) {
+        wf.exists = false;
+    }
+    int pending = n;
+    bool done[lanes];
+    for (int l = 0; l < lanes; ++l) {
+        done[l] = l >= n;
+    }
+
+    auto base = [&](const int s) { return (size_t)(s % ring) * width - k_min; };
+    // Offsets of a source wavefront at diagonal k, null outside its diagonals
+    auto fetch = [&](const std::vector<offsets_t>& offsets, const int s, const int k) -> const offsets_t& {
+        if (s < 0) return null_offsets;
+        const wavefront_t& wf = wavefronts[s % ring];
+        if (!wf.exists || k < wf.lo || k > wf.hi) return null_offsets;
+        return offsets[base(s) + k];
+    };
+
+    // Score 0: the start of diagonal 0
+    wavefronts[0] = {true, 0, 0};
+    m_offsets[base(0)] = offsets_t{};
+    i_offsets[base(0)] = null_offsets;
+    d_offsets[base(0)] = null_offsets;
+
+    for (int s = 0; s < max_score && pending > 0; ++s) {
+        wavefront_t& wf = wavefronts[s % ring];
+        if (s > 0) {
+            const int s_mismatch = s - mismatch;
+            const int s_open = s - gap_opening - gap_extension;
+            const int s_extend = s - gap_extension;
+            auto exists = [&](const int x) { return x >= 0 && wavefronts[x % ring].exists; };
+            wf.exists = false;
+            int lo = k_max + 1, hi = k_min - 1;
+            if (exists(s_mismatch)) {
+                lo = std::min(lo, wavefronts[s_mismatch % ring].lo);
+                hi = std::max(hi, wavefronts[s_mismatch % ring].hi);
+            }
+            for (const int x : {s_open, s_extend}) {
+                if (exists(x)) {
+                    lo = std::min(lo, wavefronts[x % ring].lo - 1);
+                    hi = std::max(hi, wavefronts[x % ring].hi + 1);
+                }
+            }
+            lo = std::max(lo, k_min);
+            hi = std::min(hi, k_max);
+            if (lo > hi) {
+                continue;
+            }
+            // All sources are less than ring scores back, so none shares this slot
+            const size_t b = base(s);
+            for (int k = lo; k <= hi; ++k) {
+                const offsets_t diagonal = offsets_t{} + k;
+                const offsets_t m_open_ins = fetch(m_offsets, s_open, k - 1);
+                const offsets_t i_ext = fetch(i_offsets, s_extend, k - 1);
+                offsets_t i = (m_open_ins > i_ext ? m_open_ins : i_ext) + 1;
+                const offsets_t m_open_del = fetch(m_offsets, s_open, k + 1);
+                const offsets_t d_ext = fetch(d_offsets, s_extend, k + 1);
+                offsets_t d = m_open_del > d_ext ? m_open_del : d_ext;
+                offsets_t m = fetch(m_offsets, s_mismatch, k) + 1;
+                m = m > i ? m : i;
+                m = m > d ? m : d;
+                // Offsets past either end of a lane's tiles are null
+                i = (i > text_lengths) | (i - diagonal > pattern_lengths) ? null_offsets : i;
+                d = (d > text_lengths) | (d - diagonal > pattern_lengths) ? null_offsets : d;
+                m = (m > text_lengths) | (m - diagonal > pattern_lengths) ? null_offsets : m;
+                m_offsets[b + k] = m;
+                i_offsets[b + k] = i;
+                d_offsets[b + k] = d;
+            }
+            wf = {true, lo, hi};
+        }
+        if (!wf.exists) {
+            continue;
+        }
+
+        // Extend the matches of every lane still aligning, then look for the ends
+        const size_t b = base(s);
+        for (int k = wf.lo; k <= wf.hi; ++k) {
+            offsets_t& m = m_offsets[b + k];
+            for (int l = 0; l < n; ++l) {
+                if (done[l] || m[l] < 0) continue;
+                const tile_t& tile = tiles[l];
+                const int v = m[l] - k, h = m[l];
+                m[l] += tile.pattern->matches(tile.pattern_begin + v, *tile.text, tile.text_begin + h,
+                                              std::min(tile.pattern_length - v, tile.text_length - h));
+            }
+        }
+        for (int l = 0; l < n; ++l) {
+            if (done[l]) continue;
+            const int k_end = tiles[l].text_length - tiles[l].pattern_length;
+            if (k_end >= wf.lo && k_end <= wf.hi && m_offsets[b + k_end][l] >= tiles[l].text_length) {
+                done[l] = true;
+                --pending;
+                scores[l] = s < tiles[l].max_score ? s : -1;
+            }
+        }
+    }
+}
+
+} /* namespace wavefront */
+} /* namespace wflign */
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "dna.hpp"
+
+namespace wflign {
+namespace wavefront {
+
+/*
+* Score-only gap-affine WFA of several wflambda tiles at once, one tile per SIMD lane
+*
+* Every lane runs the same score steps: the compute step of each diagonal is done for
+* all lanes in one vector operation, and the extend step walks each lane's diagonal
+* comparing the 2-bit packed sequences 32 bases a word. Scores are exact and follow WFAligner's end-to-end limit:
+* a tile reaching its end at a score below its max_score is a match. Only the scores
+* are computed; a match is aligned again by WFAligner for its CIGAR.
+*/
+class wflambda_tile_batch_t {
+public:
+    static constexpr int lanes = 8;
+
+    struct tile_t {
+        const packed_dna_t* pattern;    // target tile, as WFAligner's pattern
+        uint64_t pattern_begin;
+        int pattern_length;
+        const packed_dna_t* text;       // query tile, as WFAligner's text
+        uint64_t text_begin;
+        int text_length;
+        int max_score;
+    };
+
+    wflambda_tile_batch_t(const int mismatch, const int gap_opening, const int gap_extension);
+
+    // scores[l] is the score of tiles[l], or -1 when it reaches max_score first
+    void align(const tile_t* tiles, const int num_tiles, int* scores);
+
+private:
+    typedef int32_t offsets_t __attribute__((vector_size(4 * lanes)));
+
+    struct wavefront_t {
+        bool exists;
+        int lo;
+        int hi;
+    };
+
+    void resize(const int max_pattern_length, const int max_text_length);
+
+    const int mismatch;
+    const int gap_opening;
+    const int gap_extension;
+    const int ring;             // scores kept, enough to reach back to the sources
+    int k_min = 0;              // diagonals held, k = h - v
+    int k_max = -1;
+    std::vector<wavefront_t> wavefronts;            // by score modulo ring
+    std::vector<offsets_t> m_offsets, i_offsets, d_offsets;   // by ring slot, then k
+};
+
+} /* namespace wavefront */
+} /* namespace wflign */
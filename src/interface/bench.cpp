@@ -0,0 +1,605 @@
+/**
+ * Microbenchmarks of the mapping and alignment kernels of wfmash
+ *
+ * @file    bench.cpp
+ * @ingroup src
+ * @details Runs each kernel on synthetic sequences of a chosen divergence and repeat
+ *          content, repeated until it has run for a minimum time, and prints one TSV row
+ *          per kernel. Given the output of an earlier run as a baseline, it reports the
+ *          kernels that got slower than a tolerance and exits with 1 if any did.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "map/include/map_parameters.hpp"
+#include "map/include/base_types.hpp"
+#include "map/include/commonFunc.hpp"
+#include "map/include/winSketch.hpp"
+#include "map/include/computeMap.hpp"
+#include "map/include/filter.hpp"
+#include "map/include/parseCmdArgs.hpp"
+#include "map/include/stageProfile.hpp"
+
+#include "interface/parse_args.hpp"
+
+#include "align/include/align_parameters.hpp"
+#include "common/wflign/src/wflign.hpp"
+#include "common/wflign/src/wflign_swizzle.hpp"
+#include "common/wflign/src/alignment_printer.hpp"
+#include "common/progress.hpp"
+
+//External includes
+#include "common/args.hxx"
+
+namespace bench
+{
+  struct Options
+  {
+    uint64_t genomeLength;                  //bp of synthetic target, split into contigs
+    int contigs;                            //target contigs, each with a query copy
+    double divergence;                      //edits per base of the query copies
+    double repeatFraction;                  //fraction of the target in repeats
+    uint64_t alignLength;                   //bp of the long alignment pair
+    int pairs;                              //short pairs for CIGAR and PAF kernels
+    int threads;                            //threads of the whole mapping run
+    uint64_t seed;                          //seed of the sequence generator
+    double minTime;                         //seconds each kernel is repeated for
+    std::string filter;                     //run only kernels whose name contains this
+    std::string baseline;                   //earlier output to compare against
+    double tolerance;                       //slowdown over the baseline reported
+  };
+
+  // Time of one run of a kernel; setup done within an iteration is left out of it
+  template <typename Fn>
+  double timed(Fn&& fn)
+  {
+    const auto start = std::chrono::steady_clock::now();
+    fn();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  /**
+   * @brief   repeats the kernels and collects their rows
+   */
+  class Runner
+  {
+    public:
+
+      explicit Runner(const Options& options) : options(options)
+      {
+        if (!options.baseline.empty()) {
+          std::ifstream in(options.baseline);
+          if (!in) {
+            std::cerr << "[wfmash::bench] ERROR, unable to open baseline " << options.baseline << std::endl;
+            exit(1);
+          }
+          std::string line;
+          while (std::getline(in, line)) {
+            std::istringstream fields(line);
+            std::string name, unit;
+            uint64_t iterations;
+            double mean, best;
+            if (line.empty() || line[0] == '#' || !(fields >> name >> iterations >> mean >> best)) {
+              continue;
+            }
+            baseline[name] = best;
+          }
+        }
+        std::cout << "#kernel\titerations\tmean_seconds\tmin_seconds\tunits_per_second\tunit"
+                  << (baseline.empty() ? "" : "\tbaseline_ratio") << std::endl;
+      }
+
+      bool wants(const std::string& name) const
+      {
+        return name.find(options.filter) != std::string::npos;
+      }
+
+      /**
+       * @brief   run iteration once to warm up, then until minTime has passed; each run
+       *          returns the seconds it spent in the kernel and does units of work
+       * @return  the number of runs, the warm up included
+       */
+      uint64_t measure(const std::string& name, uint64_t units, const std::string& unit,
+                       const std::function<double()>& iteration)
+      {
+        iteration();
+        uint64_t iterations = 0;
+        double total = 0, best = std::numeric_limits<double>::max();
+        do {
+          const double seconds = iteration();
+          total += seconds;
+          best = std::min(best, seconds);
+          ++iterations;
+        } while (total < options.minTime);
+        row(name, iterations, total / iterations, best, best > 0 ? units / best : 0, unit);
+        return iterations + 1;
+      }
+
+      void row(const std::string& name, uint64_t iterations, double mean, double best, double rate, const std::string& unit)
+      {
+        std::cout << name << "\t" << iterations << "\t" << mean << "\t" << best << "\t" << rate << "\t" << unit;
+        auto it = baseline.find(name);
+        if (it != baseline.end() && it->second > 0) {
+          const double ratio = best / it->second;
+          std::cout << "\t" << ratio;
+          if (ratio > 1 + options.tolerance) {
+            regressions.push_back(name);
+          }
+        }
+        std::cout << std::endl;
+      }
+
+      const std::vector<std::string>& slower() const { return regressions; }
+
+    private:
+
+      const Options& options;
+      std::map<std::string, double> baseline;       //min seconds by kernel
+      std::vector<std::string> regressions;
+  };
+
+  /**
+   * @brief   synthetic target with interspersed and tandem repeats, and query copies of
+   *          it with controlled divergence, every other one reverse complemented
+   */
+  class Synthetic
+  {
+    public:
+
+      std::vector<std::string> targets;
+      std::vector<std::string> queries;
+
+      explicit Synthetic(const Options& options) : rng(options.seed)
+      {
+        std::vector<std::string> families;
+        for (int i = 0; i < 16; ++i) {
+          families.push_back(random(std::uniform_int_distribution<uint64_t>(300, 6000)(rng)));
+        }
+        const uint64_t contigLength = std::max<uint64_t>(options.genomeLength / options.contigs, 1);
+        for (int c = 0; c < options.contigs; ++c) {
+          std::string contig;
+          uint64_t repeatBases = 0;
+          while (contig.size() < contigLength) {
+            std::string chunk;
+            if (repeatBases < options.repeatFraction * contig.size()) {
+              if (std::bernoulli_distribution(0.7)(rng)) {
+                // copy of an old family, diverged from its consensus
+                chunk = mutate(families[rng() % families.size()], 0.1);
+              } else {
+                const std::string unit = random(std::uniform_int_distribution<uint64_t>(2, 50)(rng));
+                const uint64_t length = std::uniform_int_distribution<uint64_t>(100, 2000)(rng);
+                while (chunk.size() < length) {
+                  chunk += unit;
+                }
+              }
+              repeatBases += chunk.size();
+            } else {
+              chunk = random(std::uniform_int_distribution<uint64_t>(1, 5000)(rng));
+            }
+            contig += chunk;
+          }
+          contig.resize(contigLength);
+          std::string query = mutate(contig, options.divergence);
+          if (c % 2 == 1) {
+            query = reverseComplement(query);
+          }
+          targets.push_back(std::move(contig));
+          queries.push_back(std::move(query));
+        }
+      }
+
+      std::string random(uint64_t length)
+      {
+        static const char bases[] = "ACGT";
+        std::string seq(length, 'A');
+        for (auto& base : seq) {
+          base = bases[rng() & 3];
+        }
+        return seq;
+      }
+
+      // Copy of seq with divergence edits per base: 80% substitutions, the rest 1-5bp indels
+      std::string mutate(const std::string& seq, double divergence)
+      {
+        static const char bases[] = "ACGT";
+        std::uniform_real_distribution<double> uniform(0, 1);
+        std::string copy;
+        copy.reserve(seq.size() + seq.size() / 16);
+        for (uint64_t i = 0; i < seq.size(); ++i) {
+          if (uniform(rng) >= divergence) {
+            copy.push_back(seq[i]);
+            continue;
+          }
+          const double kind = uniform(rng);
+          const uint64_t length = 1 + rng() % 5;
+          if (kind < 0.8) {
+            char base = bases[rng() & 3];
+            while (base == seq[i]) {
+              base = bases[rng() & 3];
+            }
+            copy.push_back(base);
+          } else if (kind < 0.9) {
+            copy.push_back(seq[i]);
+            copy += random(length);
+          } else {
+            i += length - 1;
+          }
+        }
+        return copy;
+      }
+
+      static std::string reverseComplement(const std::string& seq)
+      {
+        std::string rc(seq.size(), 'N');
+        skch::CommonFunc::reverseComplement(seq.data(), &rc[0], seq.size());
+        return rc;
+      }
+
+      // A target piece of length bp and a diverged copy of it
+      std::pair<std::string, std::string> pair(uint64_t length, double divergence)
+      {
+        const std::string& contig = targets[rng() % targets.size()];
+        length = std::min<uint64_t>(length, contig.size());
+        const uint64_t start = rng() % (contig.size() - length + 1);
+        std::string target = contig.substr(start, length);
+        std::string query = mutate(target, divergence);
+        return {std::move(target), std::move(query)};
+      }
+
+    private:
+
+      std::mt19937_64 rng;
+  };
+
+  void writeFasta(const std::string& path, const std::string& prefix, const std::vector<std::string>& seqs)
+  {
+    std::ofstream out(path);
+    for (size_t i = 0; i < seqs.size(); ++i) {
+      out << ">" << prefix << i + 1 << "\n";
+      for (size_t pos = 0; pos < seqs[i].size(); pos += 80) {
+        out.write(seqs[i].data() + pos, std::min<size_t>(80, seqs[i].size() - pos)) << "\n";
+      }
+    }
+    if (!out) {
+      std::cerr << "[wfmash::bench] ERROR, unable to write " << path << std::endl;
+      exit(1);
+    }
+  }
+
+  // Parameters of wfmash -m on the synthetic files, as the command line sets them
+  void parameters(const Options& options, const std::string& target, const std::string& query,
+                  skch::Parameters& map_parameters, align::Parameters& align_parameters)
+  {
+    std::vector<std::string> args = {"wfmash-bench", target, query, "-m", "-t", std::to_string(options.threads)};
+    std::vector<char*> argv;
+    for (auto& arg : args) {
+      argv.push_back(&arg[0]);
+    }
+    yeet::Parameters yeet_parameters;
+    yeet::parse_args(argv.size(), argv.data(), map_parameters, align_parameters, yeet_parameters);
+    map_parameters.outFileName = "/dev/null";
+  }
+
+  void benchSketching(Runner& runner, const Synthetic& data, const skch::Parameters& param, skch::Sketch& sketch)
+  {
+    std::vector<std::string> queries = data.queries;
+    uint64_t bases = 0;
+    for (const auto& query : queries) {
+      bases += query.size();
+    }
+
+    std::vector<skch::MinmerInfo> minmers;
+    std::vector<skch::hash_t> hashes;
+    auto sketchFragments = [&](bool keep) {
+      for (auto& query : queries) {
+        for (uint64_t pos = 0; pos + param.segLength <= query.size(); pos += param.segLength) {
+          skch::CommonFunc::sketchSequence(minmers, &query[pos], param.segLength, param.kmerSize, param.alphabetSize,
+                                           param.sketchSize, 0, param.kmerHashEngine);
+          if (keep) {
+            for (const auto& minmer : minmers) {
+              hashes.push_back(minmer.hash);
+            }
+          }
+        }
+      }
+    };
+
+    if (runner.wants("map/sketchSequence")) {
+      runner.measure("map/sketchSequence", bases, "bp", [&]() { return timed([&]() { sketchFragments(false); }); });
+    }
+
+    if (runner.wants("map/reverseComplement")) {
+      std::vector<std::string> reversed = queries;
+      runner.measure("map/reverseComplement", bases, "bp", [&]() {
+        return timed([&]() {
+          for (size_t i = 0; i < queries.size(); ++i) {
+            skch::CommonFunc::reverseComplement(queries[i].data(), &reversed[i][0], queries[i].size());
+          }
+        });
+      });
+    }
+
+    if (runner.wants("map/findSeedIntervals")) {
+      sketchFragments(true);
+      std::vector<skch::boundPtr<skch::Sketch::SeedIter_t>> found;
+      found.reserve(hashes.size());
+      runner.measure("map/findSeedIntervals", hashes.size(), "hashes", [&]() {
+        found.clear();
+        return timed([&]() { sketch.findSeedIntervals(hashes, found); });
+      });
+    }
+  }
+
+  /**
+   * @brief   whole mapping runs, and the split of their time into the stages of the
+   *          stage profile: seed lookup (getSeedIntervalPoints), L1 sweep, L2
+   *          (computeL2MappedRegions), merge (mergeMappingsInRange), filter and output
+   */
+  void benchMapping(Runner& runner, const skch::Parameters& param, const std::string& tmp)
+  {
+    if (!runner.wants("map/Map")) {
+      return;
+    }
+    skch::profile::enable();
+    uint64_t bases = 0;
+    for (const auto& query : param.querySequences) {
+      bases += std::filesystem::file_size(query);
+    }
+    const uint64_t runs = runner.measure("map/Map", bases, "fasta_bytes", [&]() {
+      return timed([&]() { skch::Map mapper(param); });
+    });
+
+    const std::string report = tmp + "/stages.tsv";
+    if (!skch::profile::writeReport(report)) {
+      std::cerr << "[wfmash::bench] ERROR, unable to write " << report << std::endl;
+      exit(1);
+    }
+    std::ifstream in(report);
+    std::string section, name, calls, seconds, busiest;
+    while (std::getline(in, section, '\t') && std::getline(in, name, '\t') && std::getline(in, calls, '\t')
+           && std::getline(in, seconds, '\t') && std::getline(in, busiest)) {
+      if (section == "stage") {
+        const double perRun = std::stod(seconds) / runs;
+        runner.row("map/Map/" + name, runs, perRun, perRun, perRun > 0 ? bases / perRun : 0, "fasta_bytes");
+      }
+    }
+  }
+
+  void benchFilter(Runner& runner)
+  {
+    if (!runner.wants("map/liFilterAlgorithm")) {
+      return;
+    }
+    // Mappings of a 10Mbp query onto 10 targets, of 5-50kbp and identity 80-100%
+    std::mt19937_64 rng(1);
+    skch::MappingResultsVector_t mappings(100000);
+    for (auto& m : mappings) {
+      m = skch::MappingResult();
+      m.queryLen = 10000000;
+      m.queryStartPos = rng() % (m.queryLen - 50000);
+      m.queryEndPos = m.queryStartPos + 5000 + rng() % 45000;
+      m.refSeqId = rng() % 10;
+      m.refStartPos = rng() % 1000000;
+      m.refEndPos = m.refStartPos + (m.queryEndPos - m.queryStartPos);
+      m.blockLength = m.queryEndPos - m.queryStartPos;
+      m.blockNucIdentity = m.nucIdentity = 0.8 + 0.2 * (rng() % 1000) / 1000.0;
+      m.strand = skch::strnd::FWD;
+    }
+    progress_meter::ProgressMeter progress(UINT64_MAX, "[wfmash::bench] filtering");
+    skch::MappingResultsVector_t working;
+    runner.measure("map/liFilterAlgorithm", mappings.size(), "mappings", [&]() {
+      working = mappings;
+      return timed([&]() { skch::Filter::query::liFilterAlgorithm(working, 1, false, 0.95, progress); });
+    });
+  }
+
+  void benchAlignment(Runner& runner, const Options& options, Synthetic& data, const align::Parameters& param)
+  {
+    wflign_penalties_t penalties;
+    penalties.match = 0;
+    penalties.mismatch = param.wfa_patching_mismatch_score;
+    penalties.gap_opening1 = param.wfa_patching_gap_opening_score1;
+    penalties.gap_extension1 = param.wfa_patching_gap_extension_score1;
+    penalties.gap_opening2 = param.wfa_patching_gap_opening_score2;
+    penalties.gap_extension2 = param.wfa_patching_gap_extension_score2;
+    const float identity = 1 - options.divergence;
+
+    std::ostringstream out;
+    auto biwfa = [&](std::string& target, std::string& query, bool banded) {
+      wflign::wavefront::do_biwfa_alignment(
+          "query", &query[0], query.size(), 0, query.size(), false,
+          "target", &target[0], target.size(), 0, target.size(),
+          out, penalties, false, true, false, 0, param.wflign_max_len_minor, identity,
+          -1, 1, 1, param.wfa_high_memory_budget, 0, 1, banded, false, nullptr);
+    };
+
+    auto [target, query] = data.pair(options.alignLength, options.divergence);
+    if (runner.wants("align/do_biwfa_alignment")) {
+      runner.measure("align/do_biwfa_alignment", query.size(), "bp", [&]() {
+        out.str("");
+        return timed([&]() { biwfa(target, query, false); });
+      });
+    }
+
+    if (runner.wants("align/do_biwfa_alignment_banded")) {
+      runner.measure("align/do_biwfa_alignment_banded", query.size(), "bp", [&]() {
+        out.str("");
+        return timed([&]() { biwfa(target, query, true); });
+      });
+    }
+
+    if (runner.wants("align/wflign_affine_wavefront")) {
+      wflign::wavefront::WFlign wflign(
+          param.wflambda_segment_length, 0, true,
+          param.wfa_mismatch_score, param.wfa_gap_opening_score, param.wfa_gap_extension_score,
+          param.wfa_patching_mismatch_score,
+          param.wfa_patching_gap_opening_score1, param.wfa_patching_gap_extension_score1,
+          param.wfa_patching_gap_opening_score2, param.wfa_patching_gap_extension_score2,
+          identity,
+          param.wflign_mismatch_score, param.wflign_gap_opening_score, param.wflign_gap_extension_score,
+          param.wflign_max_mash_dist, param.wflign_min_wavefront_length, param.wflign_max_distance_threshold,
+          param.wflign_max_len_major, param.wflign_max_len_minor,
+          param.wflign_erode_k, param.chain_gap, param.wflign_min_inv_patch_len, param.wflign_max_patching_score);
+      wflign.set_output(
+          &out,
+#ifdef WFA_PNG_TSV_TIMING
+          false, nullptr, "", 0, false, nullptr,
+#endif
+          true, false, true, false);
+      runner.measure("align/wflign_affine_wavefront", query.size(), "bp", [&]() {
+        out.str("");
+        return timed([&]() {
+          wflign.wflign_affine_wavefront("query", &query[0], query.size(), 0, query.size(), false,
+                                         "target", &target[0], target.size(), 0, target.size());
+        });
+      });
+    }
+
+    if (!runner.wants("align/swizzle_cigar") && !runner.wants("align/write_alignment_paf")) {
+      return;
+    }
+    // Short pairs and the CIGARs biWFA gives them, as found in its PAF
+    std::vector<std::pair<std::string, std::string>> pairs;
+    std::vector<std::string> cigars;
+    uint64_t bases = 0;
+    for (int i = 0; i < options.pairs; ++i) {
+      pairs.push_back(data.pair(1000, options.divergence));
+      out.str("");
+      biwfa(pairs.back().first, pairs.back().second, false);
+      const std::string line = out.str();
+      const size_t tag = line.find("cg:Z:");
+      cigars.push_back(tag == std::string::npos ? "" : line.substr(tag + 5, line.find_first_of("\t\n", tag) - tag - 5));
+      bases += pairs.back().second.size();
+    }
+
+    if (runner.wants("align/swizzle_cigar")) {
+      std::vector<std::string> working(cigars.size());
+      runner.measure("align/swizzle_cigar", bases, "bp", [&]() {
+        for (size_t i = 0; i < cigars.size(); ++i) {
+          working[i].assign(cigars[i]);
+        }
+        return timed([&]() {
+          for (size_t i = 0; i < working.size(); ++i) {
+            const auto& [t, q] = pairs[i];
+            wflign::swizzle_cigar_start(working[i], q.data(), q.size(), t.data(), t.size());
+            wflign::swizzle_cigar_end(working[i], q.data(), q.size(), t.data(), t.size());
+          }
+        });
+      });
+    }
+
+    if (runner.wants("align/write_alignment_paf")) {
+      std::vector<alignment_t> alignments(pairs.size());
+      for (size_t i = 0; i < pairs.size(); ++i) {
+        alignments[i].ok = true;
+        alignments[i].j = 0;
+        alignments[i].i = 0;
+        alignments[i].query_length = pairs[i].second.size();
+        alignments[i].target_length = pairs[i].first.size();
+        alignments[i].is_rev = false;
+      }
+      const std::string queryName = "query", targetName = "target";
+      runner.measure("align/write_alignment_paf", pairs.size(), "records", [&]() {
+        out.str("");
+        return timed([&]() {
+          for (size_t i = 0; i < pairs.size(); ++i) {
+            const auto& [t, q] = pairs[i];
+            wflign::wavefront::write_alignment_paf(out, alignments[i], cigars[i], queryName, q.size(), 0, q.size(), false,
+                                                           targetName, t.size(), 0, t.size(), 0, identity);
+          }
+        });
+      });
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+    args::ArgumentParser parser("wfmash-bench: microbenchmarks of the mapping and alignment kernels");
+    args::HelpFlag help(parser, "help", "display this help menu", {'h', "help"});
+    args::ValueFlag<std::string> genome_length(parser, "INT", "bp of the synthetic target [2m]", {'l', "length"});
+    args::ValueFlag<int> contigs(parser, "INT", "contigs of the target [4]", {"contigs"});
+    args::ValueFlag<double> divergence(parser, "FLOAT", "edits per base of the query copies [0.05]", {'d', "divergence"});
+    args::ValueFlag<double> repeats(parser, "FLOAT", "fraction of the target in repeats [0.3]", {'r', "repeats"});
+    args::ValueFlag<std::string> align_length(parser, "INT", "bp of the long alignment pair [20k]", {"align-length"});
+    args::ValueFlag<int> pairs(parser, "INT", "short pairs for the CIGAR and PAF kernels [256]", {"pairs"});
+    args::ValueFlag<int> threads(parser, "INT", "threads of the whole mapping run [1]", {'t', "threads"});
+    args::ValueFlag<uint64_t> seed(parser, "INT", "seed of the sequence generator [42]", {"seed"});
+    args::ValueFlag<double> min_time(parser, "FLOAT", "seconds each kernel is repeated for [0.5]", {"min-time"});
+    args::ValueFlag<std::string> filter(parser, "STR", "run only the kernels whose name contains STR", {'f', "filter"});
+    args::ValueFlag<std::string> baseline(parser, "FILE", "compare with the output of an earlier run", {'b', "baseline"});
+    args::ValueFlag<double> tolerance(parser, "FLOAT", "with -b, report kernels slower than the baseline by this fraction [0.1]", {"tolerance"});
+
+    try {
+        parser.ParseCLI(argc, argv);
+    } catch (args::Help) {
+        std::cout << parser;
+        return 0;
+    } catch (args::ParseError& e) {
+        std::cerr << e.what() << std::endl;
+        std::cerr << parser;
+        return 1;
+    }
+
+    bench::Options options;
+    options.genomeLength = genome_length ? wfmash::handy_parameter(args::get(genome_length)) : 2000000;
+    options.contigs = contigs ? args::get(contigs) : 4;
+    options.divergence = divergence ? args::get(divergence) : 0.05;
+    options.repeatFraction = repeats ? args::get(repeats) : 0.3;
+    options.alignLength = align_length ? wfmash::handy_parameter(args::get(align_length)) : 20000;
+    options.pairs = pairs ? args::get(pairs) : 256;
+    options.threads = threads ? args::get(threads) : 1;
+    options.seed = seed ? args::get(seed) : 42;
+    options.minTime = min_time ? args::get(min_time) : 0.5;
+    options.filter = filter ? args::get(filter) : "";
+    options.baseline = baseline ? args::get(baseline) : "";
+    options.tolerance = tolerance ? args::get(tolerance) : 0.1;
+    if (options.genomeLength <= 0 || options.contigs <= 0 || options.alignLength <= 0 || options.pairs <= 0
+        || options.divergence < 0 || options.divergence >= 1 || options.repeatFraction < 0 || options.repeatFraction > 1) {
+        std::cerr << "[wfmash::bench] ERROR, lengths and counts must be positive, divergence in [0, 1) and repeats in [0, 1]" << std::endl;
+        return 1;
+    }
+
+    const std::string tmp = (std::filesystem::temp_directory_path() / ("wfmash-bench." + std::to_string(getpid()))).string();
+    std::filesystem::create_directories(tmp);
+    bench::Synthetic data(options);
+    const std::string target = tmp + "/target.fa", query = tmp + "/query.fa";
+    bench::writeFasta(target, "target", data.targets);
+    bench::writeFasta(query, "query", data.queries);
+
+    skch::Parameters map_parameters;
+    align::Parameters align_parameters;
+    bench::parameters(options, target, query, map_parameters, align_parameters);
+
+    bench::Runner runner(options);
+    if (runner.wants("map/sketchSequence") || runner.wants("map/reverseComplement") || runner.wants("map/findSeedIntervals")) {
+        skch::SequenceIdManager idManager(map_parameters.querySequences, map_parameters.refSequences,
+                                          map_parameters.query_prefix, {map_parameters.target_prefix},
+                                          std::string(1, map_parameters.prefix_delim));
+        skch::Sketch sketch(map_parameters, idManager, idManager.getTargetSequenceNames());
+        bench::benchSketching(runner, data, map_parameters, sketch);
+    }
+    bench::benchFilter(runner);
+    bench::benchMapping(runner, map_parameters, tmp);
+    bench::benchAlignment(runner, options, data, align_parameters);
+
+    std::filesystem::remove_all(tmp);
+
+    for (const auto& name : runner.slower()) {
+        std::cerr << "[wfmash::bench] " << name << " is slower than the baseline by more than "
+                  << options.tolerance * 100 << "%" << std::endl;
+    }
+    return runner.slower().empty() ? 0 : 1;
+}
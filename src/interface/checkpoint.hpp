@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace yeet {
+
+/**
+ * Files of a job run with --checkpoint PREFIX, which --resume takes up after it was
+ * killed:
+ *   PREFIX.params      the arguments and input sizes of the job, checked on resume
+ *   PREFIX.runs.N      the mappings against target subset N, with PREFIX.runs.N.idx
+ *                      indexing the queries done and, last, the end of the run
+ *   PREFIX.mappings    the final mappings, complete once PREFIX.mapped exists
+ *   PREFIX.aligned     the mapping records aligned and the output bytes they make up
+ */
+namespace checkpoint {
+
+// The arguments that make the output, less the thread count and --resume, and the sizes
+// of the input files, so a changed file is caught too
+inline std::string fingerprint(int argc, char** argv, const std::vector<std::string>& inputs) {
+    std::ostringstream out;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--resume") {
+            continue;
+        }
+        if (arg == "-t" || arg == "--threads") {
+            ++i;
+            continue;
+        }
+        if ((arg.rfind("-t", 0) == 0 && arg.size() > 2 && arg[2] != '-') || arg.rfind("--threads=", 0) == 0) {
+            continue;
+        }
+        out << "arg\t" << arg << "\n";
+    }
+    for (const auto& input : inputs) {
+        std::error_code ec;
+        const auto size = std::filesystem::file_size(input, ec);
+        out << "input\t" << input << "\t" << (ec ? 0 : size) << "\n";
+    }
+    return out.str();
+}
+
+inline std::string paramsFile(const std::string& prefix) { return prefix + ".params"; }
+inline std::string runsPrefix(const std::string& prefix) { return prefix + ".runs"; }
+inline std::string mappingsFile(const std::string& prefix) { return prefix + ".mappings"; }
+inline std::string mappedFile(const std::string& prefix) { return prefix + ".mapped"; }
+inline std::string alignedFile(const std::string& prefix) { return prefix + ".aligned"; }
+
+inline bool mapped(const std::string& prefix) {
+    return std::filesystem::exists(mappedFile(prefix));
+}
+
+/**
+ * @brief   start a new job at prefix, dropping the files of any job there before
+ */
+inline void start(const std::string& prefix, const std::string& params) {
+    namespace fs = std::filesystem;
+    const fs::path runs(runsPrefix(prefix));
+    const fs::path dir = runs.has_parent_path() ? runs.parent_path() : fs::path(".");
+    const std::string runName = runs.filename().string() + ".";
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(dir, ec)) {
+        if (entry.path().filename().string().rfind(runName, 0) == 0) {
+            fs::remove(entry.path(), ec);
+        }
+    }
+    for (const auto& file : {mappingsFile(prefix), mappedFile(prefix), alignedFile(prefix)}) {
+        fs::remove(file, ec);
+    }
+    std::ofstream out(paramsFile(prefix), std::ios::trunc);
+    out << params;
+    out.close();
+    if (!out) {
+        std::cerr << "[wfmash::checkpoint] ERROR, unable to write the checkpoint " << paramsFile(prefix) << std::endl;
+        exit(1);
+    }
+}
+
+/**
+ * @brief   check that the job at prefix was started with the same parameters
+ */
+inline void resume(const std::string& prefix, const std::string& params) {
+    std::ifstream in(paramsFile(prefix));
+    if (!in) {
+        std::cerr << "[wfmash::checkpoint] ERROR, --resume found no checkpoint " << paramsFile(prefix) << std::endl;
+        exit(1);
+    }
+    std::stringstream saved;
+    saved << in.rdbuf();
+    if (saved.str() != params) {
+        std::cerr << "[wfmash::checkpoint] ERROR, the checkpoint " << paramsFile(prefix)
+                  << " was made with other arguments or inputs; resume with those of the interrupted job (the thread count may differ)" << std::endl;
+        exit(1);
+    }
+}
+
+}
+
+}
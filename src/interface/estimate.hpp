@@ -0,0 +1,392 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include <htslib/faidx.h>
+
+#include "map/include/map_parameters.hpp"
+#include "map/include/computeMap.hpp"
+#include "map/include/winSketch.hpp"
+#include "align/include/align_parameters.hpp"
+#include "align/include/computeAlignments.hpp"
+#include "common/seqiter.hpp"
+#include "interface/temp_file.hpp"
+
+namespace yeet {
+
+/**
+ * Dry run of a mapping and alignment job, for --estimate. It maps a sample of the query
+ * bases against a sample of the targets with the parameters of the job, aligns a sample of
+ * the mappings, and scales the times and sizes measured to the whole job: index building
+ * with the target bases, mapping with the product of the query and target bases, and
+ * alignment and output with the mapped bases, which the -n filter bounds. The index memory
+ * is estimated from the target subsets of the job itself.
+ */
+class JobEstimate {
+public:
+    static constexpr uint64_t target_sample_bp = 20000000;     // target bases sampled
+    static constexpr uint64_t query_sample_bp = 2000000;       // query bases sampled
+    static constexpr uint64_t align_sample_bp = 4000000;       // mapped query bases aligned
+    static constexpr uint64_t query_window_min_bp = 100000;    // query bases of a sample window
+
+    JobEstimate(const skch::Parameters& map_parameters, const align::Parameters& align_parameters, bool approx_mapping)
+        : map_param(map_parameters), align_param(align_parameters), approx(approx_mapping) {}
+
+    /**
+     * Run the sample and print the estimates as TSV on stdout
+     */
+    void run() {
+        plan();
+        sample();
+        map_sample();
+        if (!approx) {
+            align_sample();
+        }
+        report();
+    }
+
+private:
+    struct Sequence {
+        std::string name;
+        uint64_t length;
+    };
+
+    const skch::Parameters& map_param;
+    const align::Parameters& align_param;
+    const bool approx;
+
+    std::vector<Sequence> targets;
+    std::vector<Sequence> queries;
+    uint64_t target_bp = 0;
+    uint64_t query_bp = 0;
+    size_t target_groups = 0;
+    std::vector<uint64_t> subset_lengths;
+
+    std::string target_fasta;
+    std::string query_fasta;
+    uint64_t sampled_target_bp = 0;
+    uint64_t sampled_query_bp = 0;
+
+    double index_seconds = 0;
+    double map_seconds = 0;
+    uint64_t mappings = 0;
+    uint64_t mapped_bp = 0;
+    uint64_t mapping_bytes = 0;
+    std::vector<std::string> mapping_lines;
+
+    double align_seconds = 0;
+    uint64_t aligned_bp = 0;
+    uint64_t alignment_bytes = 0;
+
+    static double seconds_since(const std::chrono::steady_clock::time_point& start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    static uint64_t file_size(const std::string& filename) {
+        std::ifstream in(filename, std::ios::binary | std::ios::ate);
+        return in ? uint64_t(in.tellg()) : 0;
+    }
+
+    // Split the targets into the subsets of the job and collect the sequences to sample
+    void plan() {
+        skch::Parameters p = map_param;
+        p.plan_only = true;
+        p.outFileName = "/dev/null";
+        p.binary_output = false;
+        p.bgzip_output = false;
+        skch::Map planner(p);
+        subset_lengths = planner.targetSubsetLengths();
+        const skch::SequenceIdManager& ids = planner.sequenceIds();
+        std::unordered_set<int> groups;
+        for (const skch::seqno_t id : ids.getTargetSequenceIds()) {
+            targets.push_back({std::string(ids.getSequenceName(id)), uint64_t(ids.getSequenceLength(id))});
+            target_bp += targets.back().length;
+            groups.insert(ids.getRefGroup(id));
+        }
+        target_groups = groups.size();
+        for (const skch::seqno_t id : ids.getQuerySequenceIds()) {
+            queries.push_back({std::string(ids.getSequenceName(id)), uint64_t(ids.getSequenceLength(id))});
+            query_bp += queries.back().length;
+        }
+        if (targets.empty() || queries.empty()) {
+            std::cerr << "[wfmash] ERROR, --estimate found no target or no query sequences to sample." << std::endl;
+            exit(1);
+        }
+    }
+
+    // Writes sequences of the FASTAs of the job to a sample FASTA
+    class SampleWriter {
+    public:
+        SampleWriter(const std::vector<std::string>& fastas, const std::string& filename) : out(filename) {
+            for (const auto& fasta : fastas) {
+                faidx_t* fai = fai_load(fasta.c_str());
+                if (!fai) {
+                    std::cerr << "[wfmash] ERROR, --estimate could not load the FASTA index of " << fasta << std::endl;
+                    exit(1);
+                }
+                fais.push_back(fai);
+            }
+        }
+        ~SampleWriter() {
+            for (auto* fai : fais) {
+                fai_destroy(fai);
+            }
+        }
+        // write bases [start, end) of name as a sequence called as
+        void write(const std::string& name, uint64_t start, uint64_t end, const std::string& as) {
+            for (auto* fai : fais) {
+                if (!faidx_has_seq(fai, name.c_str())) {
+                    continue;
+                }
+                int64_t got = 0;
+                char* seq = faidx_fetch_seq64(fai, name.c_str(), start, end - 1, &got);
+                if (!seq || got < 0) {
+                    std::cerr << "[wfmash] ERROR, --estimate could not read " << name << std::endl;
+                    exit(1);
+                }
+                out << ">" << as << "\n";
+                for (int64_t i = 0; i < got; i += 80) {
+                    out.write(seq + i, std::min<int64_t>(80, got - i));
+                    out << "\n";
+                }
+                free(seq);
+                return;
+            }
+            std::cerr << "[wfmash] ERROR, --estimate could not find " << name << " in the input FASTAs" << std::endl;
+            exit(1);
+        }
+        bool close() {
+            out.close();
+            return bool(out);
+        }
+    private:
+        std::ofstream out;
+        std::vector<faidx_t*> fais;
+    };
+
+    // Pick whole target sequences and windows of the queries at random, and write them out
+    void sample() {
+        std::mt19937_64 random(42);
+
+        std::vector<size_t> order(targets.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::shuffle(order.begin(), order.end(), random);
+        std::unordered_set<std::string> sampled_targets;
+        target_fasta = temp_file::create("wfmash-estimate-", ".targets.fa");
+        {
+            SampleWriter writer(map_param.refSequences, target_fasta);
+            for (size_t i = 0; i < order.size() && sampled_target_bp < std::min(target_bp, target_sample_bp); ++i) {
+                const Sequence& target = targets[order[i]];
+                writer.write(target.name, 0, target.length, target.name);
+                sampled_targets.insert(target.name);
+                sampled_target_bp += target.length;
+            }
+            if (!writer.close()) {
+                std::cerr << "[wfmash] ERROR, --estimate could not write " << target_fasta << std::endl;
+                exit(1);
+            }
+        }
+
+        // A window of a sampled target would map to itself under another name, so when
+        // self mappings are skipped those targets are not sampled as queries
+        std::vector<const Sequence*> candidates;
+        uint64_t candidate_bp = 0;
+        for (const auto& query : queries) {
+            if (!(map_param.skip_self && sampled_targets.count(query.name))) {
+                candidates.push_back(&query);
+                candidate_bp += query.length;
+            }
+        }
+        if (candidates.empty()) {
+            for (const auto& query : queries) {
+                candidates.push_back(&query);
+            }
+            candidate_bp = query_bp;
+        }
+
+        // Windows start at uniformly random bases of the candidates
+        const uint64_t window = std::max<uint64_t>(query_window_min_bp, 20 * uint64_t(map_param.segLength));
+        const uint64_t wanted = std::min(candidate_bp, query_sample_bp);
+        std::uniform_int_distribution<uint64_t> base(0, candidate_bp - 1);
+        query_fasta = temp_file::create("wfmash-estimate-", ".queries.fa");
+        {
+            SampleWriter writer(map_param.querySequences, query_fasta);
+            std::unordered_set<std::string> written;
+            for (int tries = 0; sampled_query_bp < wanted && tries < 100000; ++tries) {
+                uint64_t at = wanted == candidate_bp ? sampled_query_bp : base(random);
+                size_t q = 0;
+                while (at >= candidates[q]->length) {
+                    at -= candidates[q++]->length;
+                }
+                const Sequence& query = *candidates[q];
+                const uint64_t start = wanted == candidate_bp ? 0 : (at / window) * window;
+                const uint64_t end = wanted == candidate_bp ? query.length : std::min(query.length, start + window);
+                const std::string name = query.name + ":" + std::to_string(start) + "-" + std::to_string(end);
+                if (!written.insert(name).second) {
+                    continue;
+                }
+                writer.write(query.name, start, end, name);
+                sampled_query_bp += end - start;
+            }
+            if (!writer.close()) {
+                std::cerr << "[wfmash] ERROR, --estimate could not write " << query_fasta << std::endl;
+                exit(1);
+            }
+        }
+
+        for (const auto& fasta : seqiter::build_missing_fai({target_fasta, query_fasta})) {
+            std::cerr << "[wfmash] ERROR, --estimate could not index " << fasta << std::endl;
+            exit(1);
+        }
+        std::cerr << "[wfmash] Estimating from " << sampled_target_bp << "bp of " << target_bp << "bp of targets and "
+                  << sampled_query_bp << "bp of " << query_bp << "bp of queries" << std::endl;
+    }
+
+    skch::Parameters sample_parameters(const std::string& output) const {
+        skch::Parameters p = map_param;
+        p.refSequences = {target_fasta};
+        p.querySequences = {query_fasta};
+        p.query_list.clear();
+        p.target_list.clear();
+        p.index_by_size = std::numeric_limits<size_t>::max();
+        p.outFileName = output;
+        p.binary_output = false;
+        p.bgzip_output = false;
+        p.bgzip_index_file.clear();
+        p.query_sketch_file.clear();
+        p.mapping_spill_prefix.clear();
+        return p;
+    }
+
+    // Time the index of the sample targets alone, then the whole mapping of the sample
+    void map_sample() {
+        const std::string paf = temp_file::create("wfmash-estimate-", ".paf");
+        const skch::Parameters p = sample_parameters(paf);
+        {
+            skch::SequenceIdManager ids(p.querySequences, p.refSequences, p.query_prefix, {p.target_prefix},
+                                        std::string(1, p.prefix_delim));
+            const auto start = std::chrono::steady_clock::now();
+            skch::Sketch sketch(p, ids, ids.getTargetSequenceNames());
+            index_seconds = seconds_since(start);
+        }
+        {
+            const auto start = std::chrono::steady_clock::now();
+            skch::Map mapper(p);
+            map_seconds = std::max(0.0, seconds_since(start) - index_seconds);
+        }
+
+        std::ifstream in(paf);
+        std::string line;
+        while (std::getline(in, line)) {
+            if (line.empty()) {
+                continue;
+            }
+            ++mappings;
+            mapped_bp += mapping_span(line);
+            mapping_bytes += line.size() + 1;
+            mapping_lines.push_back(std::move(line));
+        }
+    }
+
+    // Time the alignment of a random sample of the mappings
+    void align_sample() {
+        if (mapping_lines.empty()) {
+            return;
+        }
+        std::mt19937_64 random(42);
+        std::shuffle(mapping_lines.begin(), mapping_lines.end(), random);
+        const std::string paf = temp_file::create("wfmash-estimate-", ".sample.paf");
+        {
+            std::ofstream out(paf);
+            for (const auto& line : mapping_lines) {
+                if (aligned_bp >= align_sample_bp) {
+                    break;
+                }
+                out << line << "\n";
+                aligned_bp += mapping_span(line);
+            }
+        }
+
+        align::Parameters p = align_param;
+        p.refSequences = {target_fasta};
+        p.querySequences = {query_fasta};
+        p.mashmapPafFile = paf;
+        p.pafOutputFile = temp_file::create("wfmash-estimate-", ".out");
+        p.bgzip_output = false;
+        p.bgzip_index_file.clear();
+        p.telemetry_file.clear();
+        const auto start = std::chrono::steady_clock::now();
+        {
+            align::Aligner aligner(p);
+            aligner.compute();
+        }
+        align_seconds = seconds_since(start);
+        alignment_bytes = file_size(p.pafOutputFile);
+    }
+
+    // query bases of a PAF line, its fourth field less its third
+    static uint64_t mapping_span(const std::string& line) {
+        size_t a = line.find('\t');
+        a = line.find('\t', a + 1);
+        const size_t b = line.find('\t', a + 1);
+        const size_t c = line.find('\t', b + 1);
+        return std::stoull(line.substr(b + 1, c - b - 1)) - std::stoull(line.substr(a + 1, b - a - 1));
+    }
+
+    void report() const {
+        const double target_scale = double(target_bp) / sampled_target_bp;
+        const double query_scale = double(query_bp) / std::max<uint64_t>(sampled_query_bp, 1);
+
+        // Each segment keeps -n mappings in each target group, so the query bases mapped
+        // grow with the targets only until the filter caps them
+        const double coverage = double(mapped_bp) / std::max<uint64_t>(sampled_query_bp, 1);
+        double full_coverage = coverage * target_scale;
+        if (map_param.filterMode != skch::filter::NONE) {
+            const double cap = double(map_param.numMappingsForSegment) * std::max<size_t>(target_groups, 1);
+            full_coverage = std::max(coverage, std::min(full_coverage, cap));
+        }
+        const double mapped_scale = coverage > 0 ? query_scale * full_coverage / coverage : 0;
+        const double full_mapped_bp = full_coverage * query_bp;
+
+        const double full_index_seconds = index_seconds * target_scale;
+        const double full_map_seconds = map_seconds * query_scale * target_scale;
+        const double full_align_seconds = aligned_bp > 0 ? align_seconds * full_mapped_bp / aligned_bp : 0;
+        const uint64_t index_bytes = skch::Map::peakIndexMemory(subset_lengths, map_param);
+
+        std::cout << "#quantity\tvalue" << std::endl;
+        std::cout << "threads\t" << map_param.threads << std::endl;
+        std::cout << "target_bp\t" << target_bp << std::endl;
+        std::cout << "query_bp\t" << query_bp << std::endl;
+        std::cout << "sampled_target_bp\t" << sampled_target_bp << std::endl;
+        std::cout << "sampled_query_bp\t" << sampled_query_bp << std::endl;
+        std::cout << "target_subsets\t" << subset_lengths.size() << std::endl;
+        std::cout << "index_seconds\t" << uint64_t(full_index_seconds) << std::endl;
+        std::cout << "map_seconds\t" << uint64_t(full_map_seconds) << std::endl;
+        if (!approx) {
+            std::cout << "align_seconds\t" << uint64_t(full_align_seconds) << std::endl;
+        }
+        std::cout << "total_seconds\t" << uint64_t(full_index_seconds + full_map_seconds + full_align_seconds) << std::endl;
+        std::cout << "index_peak_bytes\t" << index_bytes << std::endl;
+        std::cout << "mappings\t" << uint64_t(mappings * mapped_scale) << std::endl;
+        std::cout << "mapped_bp\t" << uint64_t(full_mapped_bp) << std::endl;
+        std::cout << "mapping_output_bytes\t" << uint64_t(mapping_bytes * mapped_scale) << std::endl;
+        if (!approx) {
+            std::cout << "alignment_output_bytes\t"
+                      << uint64_t(aligned_bp > 0 ? double(alignment_bytes) * full_mapped_bp / aligned_bp : 0) << std::endl;
+        }
+        std::cerr << "[wfmash] Estimated " << uint64_t(full_index_seconds + full_map_seconds + full_align_seconds)
+                  << "s on " << map_param.threads << " threads and " << skch::memory::humanBytes(index_bytes)
+                  << " of index memory" << std::endl;
+    }
+};
+
+}
@@ -13,14 +13,20 @@
 #include <chrono>
 #include <functional>
 #include <cstdio>
+#include <thread>
 
 #include "map/include/map_parameters.hpp"
 #include "map/include/base_types.hpp"
 #include "map/include/winSketch.hpp"
 #include "map/include/computeMap.hpp"
 #include "map/include/parseCmdArgs.hpp"
+#include "map/include/spacedSeedCache.hpp"
+#include "map/include/stageProfile.hpp"
+#include "map/include/memoryReport.hpp"
 
 #include "interface/parse_args.hpp"
+#include "interface/stream_channel.hpp"
+#include "interface/estimate.hpp"
 
 #include "align/include/align_parameters.hpp"
 #include "align/include/computeAlignments.hpp"
@@ -31,6 +37,41 @@
 //External includes
 #include "common/args.hxx"
 #include "common/ALeS.hpp"
+#include "common/sampling_profiler.hpp"
+
+// Writes the stage report of the mapping, if one was asked for
+static void writeStageReport(const skch::Parameters& map_parameters) {
+    if (map_parameters.stage_report_file.empty()) {
+        return;
+    }
+    if (skch::profile::writeReport(map_parameters.stage_report_file)) {
+        std::cerr << "[wfmash::mashmap] Stage report saved to: " << map_parameters.stage_report_file << std::endl;
+    } else {
+        std::cerr << "[wfmash::mashmap] WARNING, unable to write the stage report " << map_parameters.stage_report_file << std::endl;
+    }
+}
+
+// Writes the memory report of the run, if one was asked for
+static void writeMemoryReport(const skch::Parameters& map_parameters) {
+    if (map_parameters.memory_report_file.empty()) {
+        return;
+    }
+    if (skch::memory::writeReport(map_parameters.memory_report_file)) {
+        std::cerr << "[wfmash] Memory report saved to: " << map_parameters.memory_report_file << std::endl;
+    } else {
+        std::cerr << "[wfmash] WARNING, unable to write the memory report " << map_parameters.memory_report_file << std::endl;
+    }
+}
+
+// Stops the sampling profiler and writes its stacks, if a profile was asked for
+static void writeProfile(const skch::Parameters& map_parameters) {
+    if (map_parameters.profile_prefix.empty()) {
+        return;
+    }
+    if (!sampling_profiler::stop()) {
+        std::cerr << "[wfmash] WARNING, unable to write the profile " << map_parameters.profile_prefix << ".*.folded" << std::endl;
+    }
+}
 
 int main(int argc, char** argv) {
     /*
@@ -47,25 +88,103 @@ int main(int argc, char** argv) {
 
     //parameters.refSequences.push_back(ref);
 
+    if (!align_parameters.merge_align_shards.empty()) {
+        // The outputs of the --align-shard jobs are written as one, nothing aligned
+        std::ofstream out(align_parameters.pafOutputFile, std::ios::binary);
+        align::shards::merge(align_parameters.merge_align_shards, align_parameters.merge_align_shard_records, out);
+        std::cerr << "[wfmash::align] merged " << align_parameters.merge_align_shards.size() << " shard outputs" << std::endl;
+        return 0;
+    }
+
+    if (!map_parameters.memory_report_file.empty()) {
+        skch::memory::enable();
+    }
+
+    if (!map_parameters.profile_prefix.empty()) {
+        sampling_profiler::start(map_parameters.profile_prefix);
+    }
+
     //skch::parseandSave(argc, argv, cmd, parameters);
     if (!yeet_parameters.remapping) {
         skch::printCmdOptions(map_parameters);
 
         auto t0 = skch::Time::now();
 
-        if (map_parameters.use_spaced_seeds) {
-          std::cerr << "[wfmash::mashmap] Generating spaced seeds..." << std::endl;
-          uint32_t seed_weight = map_parameters.spaced_seed_params.weight;
-          uint32_t seed_count = map_parameters.spaced_seed_params.seed_count;
-          float similarity = map_parameters.spaced_seed_params.similarity;
-          uint32_t region_length = map_parameters.spaced_seed_params.region_length;
+        if (!map_parameters.stage_report_file.empty()) {
+          skch::profile::enable();
+        }
 
-          ales::spaced_seeds sps = ales::generate_spaced_seeds(seed_weight, seed_count, similarity, region_length);
+        const bool reading_index = !map_parameters.indexFilename.empty() && !map_parameters.create_index_only;
+        if (map_parameters.use_spaced_seeds && reading_index) {
+          // The index records the seeds it was built with, they are adopted when it is loaded
+          std::cerr << "[wfmash::mashmap] Using spaced seeds stored in the index" << std::endl;
+        } else if (map_parameters.use_spaced_seeds) {
+          const skch::ales_params& seed_params = map_parameters.spaced_seed_params;
+          const stdfs::path& seed_cache = map_parameters.spaced_seed_cache;
+
+          ales::spaced_seeds sps;
+          bool cached = !seed_cache.empty() && skch::SpacedSeedCache::lookup(seed_cache, seed_params, sps);
+          if (!cached) {
+            std::cerr << "[wfmash::mashmap] Generating spaced seeds..." << std::endl;
+            sps = ales::generate_spaced_seeds(seed_params.weight, seed_params.seed_count, seed_params.similarity, seed_params.region_length);
+          }
           std::chrono::duration<double> time_spaced_seeds = skch::Time::now() - t0;
           map_parameters.spaced_seed_sensitivity = sps.sensitivity;
           map_parameters.spaced_seeds =  sps.seeds;
           ales::printSpacedSeeds(map_parameters.spaced_seeds);
-          std::cerr << "[wfmash::mashmap] Generated spaced seeds in " << time_spaced_seeds.count() << "s (sensitivity: " << sps.sensitivity << ")" << std::endl;
+
+          size_t seed_span = 0;
+          for (const auto& sp : map_parameters.spaced_seeds) {
+            seed_span = std::max(seed_span, sp.length);
+          }
+          if (!skch::CommonFunc::SpacedSeeds::supported(map_parameters.spaced_seeds.size(), seed_span)) {
+            std::cerr << "[wfmash::mashmap] ERROR, spaced seeds may span at most "
+                      << skch::CommonFunc::SpacedSeeds::maxSpan << "bp (got " << seed_span << "bp)" << std::endl;
+            exit(1);
+          }
+          if (cached) {
+            std::cerr << "[wfmash::mashmap] Loaded spaced seeds from " << seed_cache << " (sensitivity: " << sps.sensitivity << ")" << std::endl;
+          } else {
+            std::cerr << "[wfmash::mashmap] Generated spaced seeds in " << time_spaced_seeds.count() << "s (sensitivity: " << sps.sensitivity << ")" << std::endl;
+            if (!seed_cache.empty() && !skch::SpacedSeedCache::store(seed_cache, seed_params, sps)) {
+              std::cerr << "[wfmash::mashmap] WARNING, unable to write spaced seed cache " << seed_cache << std::endl;
+            }
+          }
+        }
+
+        if (yeet_parameters.estimate) {
+            yeet::JobEstimate(map_parameters, align_parameters, yeet_parameters.approx_mapping).run();
+            writeProfile(map_parameters);
+            return 0;
+        }
+
+        if (yeet_parameters.stream_mappings) {
+            // Align each query's mappings while the later queries are mapped
+            align::printCmdOptions(align_parameters);
+            yeet::StreamChannel mappings;
+            std::thread aligner([&]() {
+                sampling_profiler::name_thread("aligner", sampling_profiler::ALIGN);
+                auto t1 = skch::Time::now();
+                align::Aligner alignObj(align_parameters);
+                alignObj.compute(mappings.reader());
+                std::chrono::duration<double> timeAlign = skch::Time::now() - t1;
+                std::cerr << "[wfmash::align] time spent computing the alignment: " << timeAlign.count() << " sec" << std::endl;
+            });
+
+            t0 = skch::Time::now();
+            {
+                skch::Map mapper = skch::Map(map_parameters, nullptr, &mappings.writer());
+            }
+            mappings.close();
+            std::chrono::duration<double> timeMapQuery = skch::Time::now() - t0;
+            std::cerr << "[wfmash::mashmap] Mapped query in " << timeMapQuery.count() << "s, results streamed to the aligner" << std::endl;
+            writeStageReport(map_parameters);
+
+            aligner.join();
+            std::cerr << "[wfmash::align] alignment results saved in: " << align_parameters.pafOutputFile << std::endl;
+            writeMemoryReport(map_parameters);
+            writeProfile(map_parameters);
+            return 0;
         }
 
         //Map the sequences in query file
@@ -75,8 +194,11 @@ int main(int argc, char** argv) {
 
         std::chrono::duration<double> timeMapQuery = skch::Time::now() - t0;
         std::cerr << "[wfmash::mashmap] Mapped query in " << timeMapQuery.count() << "s, results saved to: " << map_parameters.outFileName << std::endl;
+        writeStageReport(map_parameters);
 
         if (yeet_parameters.approx_mapping) {
+            writeMemoryReport(map_parameters);
+            writeProfile(map_parameters);
             return 0;
         }
      }
@@ -87,6 +209,7 @@ int main(int argc, char** argv) {
     align::Aligner alignObj(align_parameters);
     std::chrono::duration<double> timeRefRead = skch::Time::now() - t0;
     std::cerr << "[wfmash::align] time spent loading the reference index: " << timeRefRead.count() << " sec" << std::endl;
+    skch::memory::phase("aligner setup");
 
     //Compute the alignments
     alignObj.compute();
@@ -95,5 +218,6 @@ int main(int argc, char** argv) {
     std::cerr << "[wfmash::align] time spent computing the alignment: " << timeAlign.count() << " sec" << std::endl;
 
     std::cerr << "[wfmash::align] alignment results saved in: " << align_parameters.pafOutputFile << std::endl;
-
+    writeMemoryReport(map_parameters);
+    writeProfile(map_parameters);
 }
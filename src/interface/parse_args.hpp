@@ -8,11 +8,15 @@
 #include "map/include/map_parameters.hpp"
 #include "map/include/map_stats.hpp"
 #include "map/include/commonFunc.hpp"
+#include "map/include/winSketch.hpp"
+#include "map/include/hugePages.hpp"
 
 #include "align/include/align_parameters.hpp"
 
 #include "interface/temp_file.hpp"
+#include "interface/checkpoint.hpp"
 #include "common/utils.hpp"
+#include "common/fai_names.hpp"
 
 #include "wfmash_git_version.hpp"
 
@@ -26,6 +30,8 @@ namespace yeet {
 struct Parameters {
     bool approx_mapping = false;
     bool remapping = false;
+    bool stream_mappings = false;   // align the mappings as they are made, without a temporary PAF
+    bool estimate = false;          // map and align a sample of the job and print its estimated costs
     //bool align_input_paf = false;
 };
 
@@ -91,10 +97,30 @@ void parse_args(int argc,
     args::Positional<std::string> query_sequence_file(options_group, "query.fa", "query sequences (optional)");
     args::Group indexing_opts(options_group, "Indexing:");
     args::ValueFlag<std::string> write_index(indexing_opts, "FILE", "build and save index to FILE", {'W', "write-index"});
-    args::ValueFlag<std::string> read_index(indexing_opts, "FILE", "use pre-built index from FILE", {'I', "read-index"});
-    args::ValueFlag<std::string> index_by(indexing_opts, "SIZE", "target batch size for indexing [4G]", {'b', "batch"});
+    args::ValueFlag<std::string> read_index(indexing_opts, "FILE", "use pre-built index from FILE, or from all the comma-separated FILEs and index files of directories among them as one", {'I', "read-index"});
+    args::Flag update_index(indexing_opts, "", "with -W, add only the targets missing from an existing index FILE", {"update-index"});
+    args::Flag no_index_checksum(indexing_opts, "", "load indexes without checking the checksums of their sections, sparing a full read of each", {"no-index-checksum"});
+    args::Flag index_stats(indexing_opts, "", "with -I, print the windows per hash, table sizes, L1 hits per fragment and a suggested -F of each index subset as TSV, and exit; -W saves them to FILE.stats", {"index-stats"});
+    args::Flag compress_index(indexing_opts, "", "with -W, write a block-compressed index, smaller on disk and decoded in parallel on load", {"compress-index"});
+    args::ValueFlag<std::string> reusable_index(indexing_opts, "MAX", "with -W, sketch the -s segments as deeply as -s MAX at the -p given needs, so runs with -s up to MAX and any -p down to it derive their sketches from the index [off]", {"reusable-index"});
+    args::ValueFlag<std::string> index_subsets(indexing_opts, "LIST", "with -I, map against these comma-separated 0-based index subsets only", {"index-subsets"});
+    args::ValueFlag<std::string> shard(indexing_opts, "K/N", "with -m, map against target subsets K, K+N, K+2N, ... only, saving the mappings before the final filtering to --shard-mappings", {"shard"});
+    args::ValueFlag<std::string> shard_mappings(indexing_opts, "FILE", "where --shard saves its mappings", {"shard-mappings"});
+    args::ValueFlag<std::string> merge_shards(indexing_opts, "FILES", "with -m, filter and write the comma-separated --shard-mappings files of all N shards instead of mapping", {"merge-shards"});
+    args::ValueFlag<std::string> mapping_cache(indexing_opts, "FILE", "take up the mappings of the query and target pairs mapped by earlier runs from FILE, mapping only the pairs of new sequences, and save those of this run to it", {"mapping-cache"});
+    args::Flag serve(indexing_opts, "", "with -m, keep the index resident and map each indexed query FASTA path read from stdin, writing its PAF and a '#done PATH' line to stdout", {"serve"});
+    args::ValueFlag<std::string> prefetch_budget(indexing_opts, "SIZE", "load or build the next index subset while mapping the current one if it fits in SIZE bytes [0, off]", {"prefetch-budget"});
+    args::Flag index_warmup(indexing_opts, "", "fault the whole index in on all threads once loaded, before mapping against it", {"index-warmup"});
+    args::Flag lock_index(indexing_opts, "", "lock the loaded index in memory (mlock), faulting it in first; for --serve", {"lock-index"});
+    args::ValueFlag<std::string> index_by(indexing_opts, "SIZE", "target batch size for indexing, or auto to fit the index in --max-memory [4G]", {'b', "batch"});
     args::ValueFlag<int64_t> sketch_size(indexing_opts, "INT", "sketch size for MinHash [auto]", {'w', "sketch-size"});
     args::ValueFlag<int> kmer_size(indexing_opts, "INT", "k-mer size [15]", {'k', "kmer-size"});
+    args::Flag murmur_hash(indexing_opts, "", "hash k-mers with MurmurHash3 (legacy index format)", {"murmur-hash"});
+    args::ValueFlag<std::string> spaced_seed_params(indexing_opts, "W:C:S:L", "use C ALeS spaced seeds of weight W for similarity S over region length L", {"spaced-seeds"});
+    args::ValueFlag<std::string> spaced_seed_cache(indexing_opts, "FILE", "reuse spaced seeds generated by earlier runs, cached in FILE", {"spaced-seed-cache"});
+    args::ValueFlag<int> syncmer_size(indexing_opts, "INT", "sketch only closed syncmers, the k-mers whose smallest INT-mer starts or ends them, about 2 in k-INT+1 [off]", {"syncmers"});
+    args::Flag world_minimizers(indexing_opts, "", "sketch world minimizers, the k-mers hashing to the lowest sketch-size/(segment-length-k+1) of the hash space", {"world-minimizers"});
+    args::ValueFlag<double> dust_threshold(indexing_opts, "FLOAT", "pass over low-complexity k-mers, whose DUST score (pairs of equal triplets over their number - 1) is over FLOAT, e.g. 1.5 [off]", {"dust"});
 
     args::Group mapping_opts(options_group, "Mapping:");
     args::Flag approx_mapping(mapping_opts, "", "output approximate mappings (no alignment)", {'m', "approx-mapping"});
@@ -111,25 +137,81 @@ void parse_args(int argc,
     args::ValueFlag<std::string> target_list(mapping_opts, "FILE", "file containing list of target sequence names to use", {'R', "target-list"});
     args::ValueFlag<std::string> query_prefix(mapping_opts, "pfxs", "filter queries by comma-separated prefixes", {'Q', "query-prefix"});
     args::ValueFlag<std::string> query_list(mapping_opts, "FILE", "file containing list of query sequence names", {'A', "query-list"});
+    args::ValueFlag<std::string> target_regions(mapping_opts, "FILE", "index only the target intervals of this BED file", {"target-regions"});
+    args::ValueFlag<std::string> query_regions(mapping_opts, "FILE", "map only the query intervals of this BED file, reported in whole-sequence coordinates", {"query-regions"});
+    args::Flag dedup_queries(mapping_opts, "", "map and align queries of identical sequence once, reporting the results under each of their names", {"dedup-queries"});
+    args::Flag reuse_target_sketches(mapping_opts, "", "when self-mapping, take the segment sketches of each query from the windows of the target index being built instead of hashing it again, holding them until it is mapped", {"reuse-target-sketches"});
     args::Flag no_split(mapping_opts, "no-split", "map each sequence in one piece", {'N',"no-split"});
+    args::Flag stream_queries(mapping_opts, "", "with -m, read queries (FASTA/FASTQ, gzip allowed) as they come, without a .fai, and write each as soon as it is mapped", {"stream-queries"});
+    args::Flag pack_queries(mapping_opts, "", "keep the queries waiting to be mapped 2-bit packed, with their runs of N, decoding each when a thread takes it up; more of them fit in --queue-memory", {"pack-queries"});
+    args::Flag sketch_query_once(mapping_opts, "", "sketch all segments of a query in one pass over it, before they are mapped", {"sketch-query-once"});
+    args::Flag cache_query_sketches(mapping_opts, "", "sketch the queries once, caching their segment sketches in a temporary file to map against every further target subset", {"cache-query-sketches"});
+    args::Flag stream_output(mapping_opts, "", "with -m and a single target subset, write each query's mappings as soon as they are final, so a pipe reader can consume them during mapping", {"stream-output"});
+    args::Flag deterministic(mapping_opts, "", "write mappings streamed as each query is final in query order, so the output does not depend on thread timing, as it never does when all are written at the end", {"deterministic"});
+    args::Flag spill_mappings(mapping_opts, "", "write the mappings of each target subset to temporary run files and merge them query by query, instead of holding all of them in memory", {"spill-mappings"});
     args::ValueFlag<std::string> chain_gap(mapping_opts, "INT", "chain gap: max distance to chain mappings [2k]", {'c', "chain-gap"});
     args::ValueFlag<std::string> max_mapping_length(mapping_opts, "INT", "target mapping length [50k, 'inf' for unlimited]", {'P', "max-length"});
     args::ValueFlag<double> overlap_threshold(mapping_opts, "FLOAT", "max overlap with better mappings (1.0=keep all) [1.0]", {'O', "overlap"});
+    args::ValueFlag<std::string> sweep(mapping_opts, "FILE", "with -m, map once and write the mappings under the final filter settings of each line of FILE, OUTPUT [p=FLOAT] [n=INT] [c=INT] [O=FLOAT], to its OUTPUT instead of -o; unset ones are those given", {"sweep"});
+    args::ValueFlag<std::string> query_order(mapping_opts, "MODE", "read the queries against each target subset in FASTA order (input), grouped by the name after the last prefix delimiter, such as the chromosome (name), or by where they mapped against the earlier subsets (mapped), so queries mapped at once hit the same parts of the index [input]", {"query-order"});
+    args::Flag distance_matrix(mapping_opts, "", "with -m, write the shared minmers, Jaccard, containment and ANI estimates of each query and target pair over -p as TSV instead of mapping", {"distance-matrix"});
     args::Flag no_filter(mapping_opts, "", "disable mapping filtering", {'f', "no-filter"});
     args::Flag no_merge(mapping_opts, "", "disable merging of consecutive mappings", {'M', "no-merge"});
     args::ValueFlag<double> kmer_complexity(mapping_opts, "FLOAT", "minimum k-mer complexity threshold", {'J', "kmer-cmplx"});
     args::ValueFlag<std::string> hg_filter(mapping_opts, "numer,ani-Δ,conf", "hypergeometric filter params [1.0,0.0,99.9]", {"hg-filter"});
     args::ValueFlag<int> min_hits(mapping_opts, "INT", "minimum number of hits for L1 filtering [auto]", {'H', "l1-hits"});
-    args::ValueFlag<double> max_kmer_freq(mapping_opts, "FLOAT", "filter minimizers occurring > FLOAT of total [0.0002]", {'F', "filter-freq"});
+    args::Flag l2_bound(mapping_opts, "", "skip L2 scans of L1 candidates with fewer hits than each of the -n best mappings found", {"l2-bound"});
+    args::ValueFlag<std::string> max_kmer_freq(mapping_opts, "FLOAT|auto", "filter minimizers occurring > FLOAT of total, > FLOAT times if over 1, or at a cutoff chosen from the counts of each index: 'auto' at the knee of the windows kept against the L1 hits, 'auto:HITS' for at most HITS L1 hits per fragment [0.0002]", {'F', "filter-freq"});
+    args::Flag approx_kmer_freq(mapping_opts, "", "estimate minimizer frequencies for -F with a count-min sketch, using less memory", {"approx-filter-freq"});
+    args::Flag pangenome_index(mapping_opts, "", "count minimizer frequencies for -F per target prefix group (-Y), as copies per genome, and with -W write a compressed index coding each copy from the one before", {"pangenome-index"});
+    args::ValueFlag<double> query_seed_cap(mapping_opts, "FLOAT", "skip query minimizers hitting more than FLOAT x segment sketch size reference windows in L1 [0, off]", {"query-seed-cap"});
+    args::ValueFlag<std::string> guided_search(mapping_opts, "INT", "map each segment first within INT bp of where the segment before it mapped, searching the whole index only when that finds fewer than -n mappings [0, off]", {"guided-search"});
+    args::ValueFlag<int> coarse_to_fine(mapping_opts, "INT", "map each query first in segments INT times longer, then each segment within where the longer one holding it mapped, searching the whole index only when that finds fewer than -n mappings [0, off]", {"coarse-to-fine"});
+    args::ValueFlag<int> adaptive_segments(mapping_opts, "INT", "map up to INT segments as one where the segments before mapped uniquely and collinearly, back to one at a time near breakpoints or repeats [0, off]", {"adaptive-segments"});
 
     args::Group alignment_opts(options_group, "Alignment:");
-    args::ValueFlag<std::string> input_mapping(alignment_opts, "FILE", "input PAF file for alignment", {'i', "align-paf"});
+    args::ValueFlag<std::string> input_mapping(alignment_opts, "FILE", "input PAF or binary mapping file (--binary-mappings) for alignment, - for standard input", {'i', "align-paf"});
+    args::Flag pair_list(alignment_opts, "", "-i lists region pairs to align without mapping, a line each of query start end target start end [strand], 0-based half-open", {"pair-list"});
     args::ValueFlag<std::string> target_padding(alignment_opts, "INT", "padding around target sequence [0]", {'E', "target-padding"});
     args::ValueFlag<std::string> wfa_params(alignment_opts, "vals", 
         "scoring: mismatch, gap1(o,e), gap2(o,e) [6,6,2,26,1]", {'g', "wfa-params"});
+    args::ValueFlag<std::string> wfa_memory_budget(alignment_opts, "SIZE", "align with full WFA backtrace when the wavefronts are predicted to fit in SIZE bytes per thread, else in ultralow memory [256M]", {"wfa-memory-budget"});
+    args::ValueFlag<float> align_pct_identity(alignment_opts, "FLOAT", "drop alignments below FLOAT% gap-compressed identity, giving up on a biWFA alignment once its score rules it out [0, off]", {"min-identity"});
+    args::Flag longest_first(alignment_opts, "", "align the mappings longest and most divergent first, keeping the input order in the output", {"longest-first"});
+    args::Flag target_order(alignment_opts, "", "align the mappings by target and position, so neighbouring ones share fetched sequence, keeping the input order in the output; with --longest-first, the costliest target windows first", {"target-order"});
+    args::ValueFlag<std::string> parallel_align_length(alignment_opts, "SIZE", "split alignments of mappings at least SIZE long at exact anchors and align the pieces, on several threads if -t allows [0, off]", {"parallel-align-length"});
+    args::Flag banded_alignment(alignment_opts, "", "align in a band of diagonals around the mapping, sized from its identity and widened while the alignment reaches its edge", {"wfa-banded"});
+    args::Flag chain_alignment(alignment_opts, "", "align the segments of each mapping chain end to end, each starting where the one before it ends instead of at its own padded start", {"chain-align"});
+    args::Flag mirror_alignments(alignment_opts, "", "map only the lower triangular of all-vs-all (implies -L) and write each alignment twice, as it is and mirrored with query and target swapped", {"mirror-align"});
+    args::Flag stats_only(alignment_opts, "", "write PAF with the matches, block length and identity of each mapping from its score-only edit distance, without CIGARs; matches count at most one short per gap beyond the length difference", {"stats-only"});
+    args::Flag inversion_hints(alignment_opts, "", "try inverted patches only in the mappings with sketch elements voting for the other strand, per their iv:i: tag, rather than on every gap WFlign patches", {"inversion-hints"});
+    args::Flag force_wflign(alignment_opts, "", "force WFlign alignment", {"force-wflign"});
+    args::ValueFlag<int> patching_threads(alignment_opts, "INT", "align the patches of each WFlign alignment, under --force-wflign or as the fallback of --align-timeout and --align-memory-limit, on INT threads [1]", {"patching-threads"});
+    args::Flag adaptive_tiles(alignment_opts, "", "size the wflambda tiles of each mapping WFlign aligns by its identity and length ratio: up to 4x longer for near identical ones, half as long for divergent ones", {"adaptive-tiles"});
+    args::ValueFlag<double> dedup_overlap(alignment_opts, "FLOAT", "align the mappings of a query to a target on one strand that overlap by FLOAT of the shorter, on both, once as their union, clipping its CIGAR for each; in (0, 1], not with output in PAF order [off]", {"dedup-overlap"});
+    args::ValueFlag<double> identity_gate(alignment_opts, "FLOAT", "with --min-identity, skip aligning the mappings whose identity upper bound from the mapping is FLOAT% or more below it [off]", {"identity-gate"});
+    args::ValueFlag<double> align_timeout(alignment_opts, "SECS", "give up aligning a mapping after SECS seconds and realign it with wflign on 4x coarser tiles, or write the mapping tagged fb:Z: if that runs out of time too [0, off]", {"align-timeout"});
+    args::ValueFlag<std::string> align_memory_limit(alignment_opts, "SIZE", "give up aligning a mapping whose wavefronts exceed SIZE bytes, falling back as for --align-timeout [0, off]", {"align-memory-limit"});
+    args::ValueFlag<std::string> align_shard(alignment_opts, "K/N", "align only shard K of the N the input mappings are split into by estimated cost, saving where each of its records is in the output to --align-shard-records", {"align-shard"});
+    args::ValueFlag<std::string> align_shard_records(alignment_opts, "FILES", "where --align-shard saves its records, or the comma-separated records of the outputs --merge-align-shards merges", {"align-shard-records"});
+    args::ValueFlag<std::string> merge_align_shards(alignment_opts, "FILES", "write the comma-separated outputs of all N --align-shard jobs as one, in the order of the mappings, instead of aligning", {"merge-align-shards"});
+    args::Flag stream_mappings(alignment_opts, "", "align the mappings while the later queries are still mapped, handing them over in memory instead of through a temporary PAF", {"stream-align"});
+    args::ValueFlag<std::string> align_telemetry(alignment_opts, "FILE", "write the method, lengths, WFA score, wavefront memory, time and thread of each alignment to FILE as TSV", {"align-telemetry"});
+    args::Flag packed_sequences(alignment_opts, "", "read sequences from 2-bit packed copies of the FASTAs, built once as FASTA.wfpk", {"packed-sequences"});
+    args::Flag sequence_readahead(alignment_opts, "", "have the kernel read ahead the FASTA blocks of the mappings queued for alignment, for slow or network filesystems", {"readahead"});
+    args::ValueFlag<std::string> share_sequences(alignment_opts, "SIZE", "keep up to SIZE bytes of the sequences the mapping decodes, 2-bit packed, for the alignment to read instead of the FASTAs", {"share-sequences"});
+    args::ValueFlag<std::string> wflambda_sketch_memory(alignment_opts, "SIZE", "keep up to SIZE bytes of WFlambda tile sketches per thread, dropping the least recently used [128M]", {"wflambda-sketch-memory"});
 
     args::Group output_opts(options_group, "Output Format:");
     args::Flag sam_format(output_opts, "", "output in SAM format (PAF by default)", {'a', "sam"});
+    args::Flag bam_format(output_opts, "", "output SAM records as BAM, compressed on -t threads", {"bam"});
+    args::Flag cram_format(output_opts, "", "output SAM records as CRAM against the target FASTA", {"cram"});
+    args::Flag bgzip_output(output_opts, "", "compress the PAF or SAM output with bgzip (BGZF), on -t threads", {"bgzip"});
+    args::ValueFlag<std::string> bgzip_index(output_opts, "FILE", "with --bgzip, also write the .gzi index of the output to FILE", {"bgzip-index"});
+    args::ValueFlag<std::string> interval_index(output_opts, "FILE", "save an index of the query and target intervals of the PAF records to FILE, by their byte offsets in the output, or BGZF virtual offsets with --bgzip, whose .gzi is then saved beside FILE unless --bgzip-index is given", {"interval-index"});
+    args::Flag sort_output(output_opts, "", "write the PAF or SAM output sorted by target and position, spilling sorted runs to temporary files and merging them at the end", {"sort-output"});
+    args::ValueFlag<std::string> sort_memory(output_opts, "SIZE", "with --sort-output, hold up to SIZE bytes of output lines before spilling them [1G]", {"sort-memory"});
+    args::Flag binary_mappings(output_opts, "", "with -m, write the mappings as a binary mapping file, which -i/--align-paf reads back without parsing PAF", {"binary-mappings"});
     args::Flag emit_md_tag(output_opts, "", "output MD tag", {'d', "md-tag"});
     args::Flag no_seq_in_sam(output_opts, "", "omit sequence field in SAM output", {'q', "no-seq-sam"});
 
@@ -137,8 +219,22 @@ void parse_args(int argc,
 
     args::Group system_opts(options_group, "System:");
     args::ValueFlag<int> thread_count(system_opts, "INT", "number of threads [1]", {'t', "threads"});
+    args::Flag numa(system_opts, "", "interleave the index over NUMA nodes and spread the mapping threads over them", {"numa"});
+    args::Flag huge_pages(system_opts, "", "back the index and the packed sequences with transparent huge pages, for fewer TLB misses on large indexes", {"huge-pages"});
     args::ValueFlag<std::string> tmp_base(system_opts, "PATH", "base directory for temporary files [pwd]", {'B', "tmp-base"});
     args::Flag keep_temp_files(system_opts, "", "retain temporary files", {'Z', "keep-temp"});
+    args::ValueFlag<std::string> checkpoint(system_opts, "PREFIX", "keep the state of the job in PREFIX.* as it runs: the mappings against each target subset, query by query, and the alignment records written", {"checkpoint"});
+    args::Flag resume(system_opts, "", "with --checkpoint, resume the interrupted job with the same arguments, skipping the subsets, queries and records it completed; redirect the output with >> to append to it", {"resume"});
+    args::ValueFlag<std::string> queue_memory(system_opts, "SIZE", "hold at most SIZE bytes of sequence queued for or in mapping and alignment, 0 for no limit [4G]", {"queue-memory"});
+    args::ValueFlag<std::string> stage_report(system_opts, "FILE", "write the time spent in each mapping stage, its counters and the queue waits to FILE as TSV", {"stage-report"});
+    args::Flag cost_tags(system_opts, "", "tag each alignment with its seconds (at:f:) and method (am:Z:); with -m, each mapping with the seed hits (sh:i:), L1 candidates (l1:i:), L2 mappings (l2:i:) and seconds (mt:f:) of mapping its query", {"cost-tags"});
+    args::ValueFlag<std::string> slow_queries(system_opts, "FILE", "write the queries that took longest to map, with their fragments, seed hits, L1 candidates and L2 mappings, to FILE as TSV", {"slow-queries"});
+    args::ValueFlag<int> slow_query_count(system_opts, "N", "with --slow-queries, list the N slowest queries [20]", {"slow-query-count"});
+    args::ValueFlag<std::string> memory_report(system_opts, "FILE", "log the memory of the index and pipeline structures at each phase and write it to FILE as TSV", {"memory-report"});
+    args::ValueFlag<std::string> max_memory(system_opts, "SIZE", "memory the run may take, sizing -b as with -b auto [auto: the physical memory or cgroup limit]", {"max-memory"});
+    args::Flag memory_estimate(system_opts, "", "print the estimated index memory of each target subset for the -b, -w and -k given, and exit", {"memory-estimate"});
+    args::Flag estimate(system_opts, "", "map and align a sample of the job, print its estimated time, index memory and output size for the -t, -b, -s and -p given, and exit", {"estimate"});
+    args::ValueFlag<std::string> profile(system_opts, "PREFIX", "sample the stacks of all threads and write them per stage (index, map, align) to PREFIX.<stage>.folded for flame graphs", {"profile"});
 
 #ifdef WFA_PNG_TSV_TIMING
     args::Group debugging_opts(parser, "[ Debugging Options ]");
@@ -201,6 +297,13 @@ void parse_args(int argc,
 	if (query_list) {
 		map_parameters.query_list = args::get(query_list);
 	}
+
+    if (target_regions) {
+        map_parameters.target_regions = std::make_shared<skch::RegionSet>(args::get(target_regions));
+    }
+    if (query_regions) {
+        map_parameters.query_regions = std::make_shared<skch::RegionSet>(args::get(query_regions));
+    }
 	
 	if (query_prefix) {
 		map_parameters.query_prefix = skch::CommonFunc::split(args::get(query_prefix), ',');
@@ -288,11 +391,25 @@ void parse_args(int argc,
     align_parameters.wflign_max_distance_threshold = -1;
 
     align_parameters.emit_md_tag = args::get(emit_md_tag);
-    align_parameters.sam_format = args::get(sam_format);
+    if (bam_format && cram_format) {
+        std::cerr << "[wfmash] ERROR, skch::parseandSave, --bam and --cram cannot be combined." << std::endl;
+        exit(1);
+    }
+    align_parameters.bam_format = args::get(bam_format);
+    align_parameters.cram_format = args::get(cram_format);
+    align_parameters.sam_format = args::get(sam_format) || bam_format || cram_format;
+    if (bgzip_output && (bam_format || cram_format)) {
+        std::cerr << "[wfmash] ERROR, skch::parseandSave, --bgzip cannot be combined with --bam or --cram, which are compressed already." << std::endl;
+        exit(1);
+    }
+    if (bgzip_index && !bgzip_output) {
+        std::cerr << "[wfmash] ERROR, skch::parseandSave, --bgzip-index requires --bgzip." << std::endl;
+        exit(1);
+    }
     align_parameters.no_seq_in_sam = args::get(no_seq_in_sam);
-    args::Flag force_wflign(alignment_opts, "", "force WFlign alignment", {"force-wflign"});
     align_parameters.force_wflign = args::get(force_wflign);
     map_parameters.split = !args::get(no_split);
+    map_parameters.sketch_query_once = args::get(sketch_query_once);
     map_parameters.dropRand = false;//ToFix: !args::get(keep_ties);
     align_parameters.split = !args::get(no_split);
 
@@ -411,42 +528,77 @@ void parse_args(int argc,
         map_parameters.kmerSize = 15;
     }
 
-    //if (spaced_seed_params) {
-        //const std::string foobar = args::get(spaced_seed_params);
-
-        //// delimeters can be full colon (:) or a space
-        //char delimeter;
-        //if (foobar.find(' ') !=  std::string::npos) {
-            //delimeter = ' ';
-        //} else if (foobar.find(':') !=  std::string::npos) {
-            //delimeter = ':';
-        //} else {
-            //std::cerr << "[wfmash] ERROR, skch::parseandSave, wfmash expects either space or : for to seperate spaced seed params." << std::endl;
-            //exit(1);
-        //}
-
-        //const std::vector<std::string> p = skch::CommonFunc::split(foobar, delimeter);
-        //if (p.size() != 4) {
-            //std::cerr << "[wfmash] ERROR, skch::parseandSave, there should be four arguments for spaced seeds." << std::endl;
-            //exit(1);
-        //}
-
-        //const uint32_t seed_weight   = stoi(p[0]);
-        //const uint32_t seed_count    = stoi(p[1]);
-        //const float similarity       = stof(p[2]);
-        //const uint32_t region_length = stoi(p[3]);
-
-        //// Generate an ALeS params struct
-        //map_parameters.use_spaced_seeds = true;
-        //map_parameters.spaced_seed_params = skch::ales_params{seed_weight, seed_count, similarity, region_length};
-        //map_parameters.kmerSize = (int) seed_weight;
-    //} else {
-        //map_parameters.use_spaced_seeds = false;
-    //}
-    map_parameters.use_spaced_seeds = false;
+    if (spaced_seed_params) {
+        const std::string foobar = args::get(spaced_seed_params);
+
+        // delimeters can be full colon (:) or a space
+        char delimeter;
+        if (foobar.find(' ') !=  std::string::npos) {
+            delimeter = ' ';
+        } else if (foobar.find(':') !=  std::string::npos) {
+            delimeter = ':';
+        } else {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, wfmash expects either space or : for to seperate spaced seed params." << std::endl;
+            exit(1);
+        }
+
+        const std::vector<std::string> p = skch::CommonFunc::split(foobar, delimeter);
+        if (p.size() != 4) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, there should be four arguments for spaced seeds." << std::endl;
+            exit(1);
+        }
+
+        const uint32_t seed_weight   = stoi(p[0]);
+        const uint32_t seed_count    = stoi(p[1]);
+        const float similarity       = stof(p[2]);
+        const uint32_t region_length = stoi(p[3]);
+
+        if (seed_count == 0 || seed_count > skch::CommonFunc::SpacedSeeds::maxSeeds) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, the number of spaced seeds must be between 1 and "
+                      << skch::CommonFunc::SpacedSeeds::maxSeeds << "." << std::endl;
+            exit(1);
+        }
+
+        // Generate an ALeS params struct
+        map_parameters.use_spaced_seeds = true;
+        map_parameters.spaced_seed_params = skch::ales_params{seed_weight, seed_count, similarity, region_length};
+        map_parameters.kmerSize = (int) seed_weight;
+    } else {
+        map_parameters.use_spaced_seeds = false;
+    }
+
+    if (spaced_seed_cache) {
+        map_parameters.spaced_seed_cache = args::get(spaced_seed_cache);
+    }
+
+    if (syncmer_size) {
+        map_parameters.syncmer_size = args::get(syncmer_size);
+        if (map_parameters.syncmer_size <= 0 || map_parameters.syncmer_size >= map_parameters.kmerSize
+                || map_parameters.syncmer_size > skch::CommonFunc::Syncmers::maxSize) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --syncmers must be between 1 and the k-mer size - 1, at most "
+                      << skch::CommonFunc::Syncmers::maxSize << "." << std::endl;
+            exit(1);
+        }
+    }
+
+    if (dust_threshold) {
+        const double threshold = args::get(dust_threshold);
+        if (!(threshold > 0) || threshold > map_parameters.kmerSize) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --dust must be above 0 and at most the k-mer size." << std::endl;
+            exit(1);
+        }
+        map_parameters.dust_threshold = std::max<uint64_t>(1, std::llround(threshold * skch::CommonFunc::Dust::scale));
+    }
 
     align_parameters.kmerSize = map_parameters.kmerSize;
 
+    // The rolling 2-bit hasher packs a k-mer in one 64-bit word
+    if (murmur_hash || map_parameters.kmerSize > 32) {
+        map_parameters.kmerHashEngine = skch::kmer_hash::MURMUR3;
+    } else {
+        map_parameters.kmerHashEngine = skch::kmer_hash::ROLLING_2BIT;
+    }
+
 
 //    if (path_high_frequency_kmers && !args::get(path_high_frequency_kmers).empty()) {
 //        std::ifstream high_freq_kmers (args::get(path_high_frequency_kmers));
@@ -464,7 +616,15 @@ void parse_args(int argc,
 //        std::cerr << "[wfmash] INFO, skch::parseandSave, read " << map_parameters.high_freq_kmers.size() << " high frequency kmers." << std::endl;
 //    }
 
-    align_parameters.min_identity = 0; // disabled
+    if (align_pct_identity) {
+        if (args::get(align_pct_identity) < 0 || args::get(align_pct_identity) > 100) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --min-identity must be between 0 and 100." << std::endl;
+            exit(1);
+        }
+        align_parameters.min_identity = (float) (args::get(align_pct_identity)/100.0); // scale to [0,1]
+    } else {
+        align_parameters.min_identity = 0; // disabled
+    }
 
     args::ValueFlag<int> wflambda_segment_length(alignment_opts, "N", "WFlambda segment length [256]", {"wflambda-segment"});
     if (wflambda_segment_length) {
@@ -497,20 +657,157 @@ void parse_args(int argc,
         map_parameters.threads = 1;
         align_parameters.threads = 1;
     }
+    map_parameters.numa = args::get(numa);
+    map_parameters.huge_pages = args::get(huge_pages);
+    align_parameters.huge_pages = args::get(huge_pages);
+    if (huge_pages && !skch::hugePages::available()) {
+        std::cerr << "[wfmash] WARNING, transparent huge pages are disabled on this system, --huge-pages uses normal pages" << std::endl;
+    }
     // disable multi-fasta processing due to the memory inefficiency of samtools faidx readers
     // which require us to duplicate the in-memory indexes of large files for each thread
     // if aligner exhaustion is a problem, we could enable this
     align_parameters.multithread_fasta_input = false;
+    align_parameters.packed_sequences = args::get(packed_sequences);
+    align_parameters.sequence_readahead = args::get(sequence_readahead) && !packed_sequences;
+    if (share_sequences) {
+        const int64_t bytes = handy_parameter(args::get(share_sequences));
+        if (bytes <= 0) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --share-sequences takes a positive size." << std::endl;
+            exit(1);
+        }
+        if (approx_mapping || input_mapping || stream_mappings || packed_sequences) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --share-sequences needs the mapping and then the alignment in one run, "
+                      << "so it cannot be combined with -m/--approx-mapping, -i/--align-paf, --stream-align or --packed-sequences." << std::endl;
+            exit(1);
+        }
+        map_parameters.shared_sequence_bytes = bytes;
+        align_parameters.shared_sequences = true;
+    }
+    align_parameters.longest_first = args::get(longest_first);
+    align_parameters.target_order = args::get(target_order);
+    align_parameters.banded_alignment = args::get(banded_alignment);
+    align_parameters.chain_alignment = args::get(chain_alignment);
+    align_parameters.mirror_alignments = args::get(mirror_alignments);
+    if (mirror_alignments) {
+        if (approx_mapping || align_parameters.sam_format) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --mirror-align writes PAF alignments and cannot be combined with -m/--approx-mapping or SAM output." << std::endl;
+            exit(1);
+        }
+        map_parameters.lower_triangular = true;
+    }
+    if (identity_gate) {
+        if (!align_pct_identity || args::get(identity_gate) < 0) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --identity-gate needs --min-identity and a non-negative margin." << std::endl;
+            exit(1);
+        }
+        align_parameters.identity_gate_margin = args::get(identity_gate) / 100.0;
+    }
+    align_parameters.stats_only = args::get(stats_only);
+    align_parameters.wflambda_adaptive_tiles = args::get(adaptive_tiles);
+    if (patching_threads) {
+        if (args::get(patching_threads) < 1) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --patching-threads must be at least 1." << std::endl;
+            exit(1);
+        }
+        align_parameters.patching_threads = args::get(patching_threads);
+    }
+    align_parameters.inversion_hints = args::get(inversion_hints);
+    if (dedup_overlap) {
+        if (args::get(dedup_overlap) <= 0 || args::get(dedup_overlap) > 1) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --dedup-overlap must be a fraction in (0, 1]." << std::endl;
+            exit(1);
+        }
+        if (approx_mapping || align_parameters.sam_format || stats_only) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --dedup-overlap clips PAF alignments and cannot be combined with -m/--approx-mapping, SAM output or --stats-only." << std::endl;
+            exit(1);
+        }
+        align_parameters.cluster_overlap = args::get(dedup_overlap);
+    }
+    if (force_wflign && (stats_only || dedup_overlap)) {
+        std::cerr << "[wfmash] ERROR, skch::parseandSave, --force-wflign cannot be combined with --stats-only or --dedup-overlap, which align by biWFA." << std::endl;
+        exit(1);
+    }
+    if (stats_only && (approx_mapping || align_parameters.sam_format)) {
+        std::cerr << "[wfmash] ERROR, skch::parseandSave, --stats-only writes PAF alignments and cannot be combined with -m/--approx-mapping or SAM output." << std::endl;
+        exit(1);
+    }
+    if (align_telemetry) {
+        if (approx_mapping) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --align-telemetry cannot be combined with -m/--approx-mapping, which does not align." << std::endl;
+            exit(1);
+        }
+        align_parameters.telemetry_file = args::get(align_telemetry);
+    }
+
+    if (parallel_align_length) {
+        const int64_t length = handy_parameter(args::get(parallel_align_length));
+        if (length < 0) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, parallel alignment length must be a non-negative integer." << std::endl;
+            exit(1);
+        }
+        align_parameters.parallel_alignment_min_length = length;
+    } else {
+        align_parameters.parallel_alignment_min_length = 0;
+    }
+
+    align_parameters.alignment_timeout = 0;
+    if (align_timeout) {
+        align_parameters.alignment_timeout = args::get(align_timeout);
+        if (align_parameters.alignment_timeout < 0) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, alignment timeout must be a non-negative number of seconds." << std::endl;
+            exit(1);
+        }
+    }
+    align_parameters.alignment_memory_limit = 0;
+    if (align_memory_limit) {
+        const int64_t limit = handy_parameter(args::get(align_memory_limit));
+        if (limit < 0) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, alignment memory limit must be a non-negative integer." << std::endl;
+            exit(1);
+        }
+        align_parameters.alignment_memory_limit = limit;
+    }
+
+    if (wfa_memory_budget) {
+        const int64_t budget = handy_parameter(args::get(wfa_memory_budget));
+        if (budget < 0) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, WFA memory budget must be a non-negative integer." << std::endl;
+            exit(1);
+        }
+        align_parameters.wfa_high_memory_budget = budget;
+    } else {
+        align_parameters.wfa_high_memory_budget = 256ULL << 20;
+    }
+
+    if (wflambda_sketch_memory) {
+        const int64_t budget = handy_parameter(args::get(wflambda_sketch_memory));
+        if (budget <= 0) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, WFlambda sketch memory must be a positive integer." << std::endl;
+            exit(1);
+        }
+        align_parameters.wflambda_sketch_memory = budget;
+    } else {
+        align_parameters.wflambda_sketch_memory = 128ULL << 20;
+    }
 
     // Compute optimal window size for sketching
     {
         const int64_t ss = sketch_size && args::get(sketch_size) >= 0 ? args::get(sketch_size) : -1;
+        // A reusable index keeps the sketch the longest segments it serves take
+        int64_t sketchedLength = map_parameters.segLength;
+        if (reusable_index) {
+            sketchedLength = wfmash::handy_parameter(args::get(reusable_index));
+            if (!write_index || sketchedLength < map_parameters.segLength) {
+                std::cerr << "[wfmash] ERROR, skch::parseandSave, --reusable-index requires -W/--write-index and a length of at least -s." << std::endl;
+                exit(1);
+            }
+        }
         if (ss > 0) {
             map_parameters.sketchSize = ss;
         } else {
             const double md = 1 - map_parameters.percentageIdentity;
             double dens = 0.02 * (1 + (md / 0.05));
-            map_parameters.sketchSize = dens * (map_parameters.segLength - map_parameters.kmerSize);
+            map_parameters.sketchSize = dens * (sketchedLength - map_parameters.kmerSize);
         }
     }
 
@@ -533,9 +830,27 @@ void parse_args(int argc,
         map_parameters.hgNumerator = 1.0;  // Default value
     }
 
+    // Index the FASTAs that have no .fai yet, all at once
+    {
+        std::vector<std::string> fastas = map_parameters.refSequences;
+        if (!stream_queries) {
+            fastas.insert(fastas.end(), map_parameters.querySequences.begin(), map_parameters.querySequences.end());
+        }
+        for (const auto& fasta : fastas) {
+            if (seqiter::fai_missing(fasta)) {
+                std::cerr << "[wfmash] Building the FASTA index of " << fasta << std::endl;
+            }
+        }
+        for (const auto& fasta : seqiter::build_missing_fai(fastas)) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, could not index " << fasta
+                      << "; a compressed FASTA must be compressed with bgzip." << std::endl;
+            exit(1);
+        }
+    }
+
     // Create sequence ID manager for getting sequence info
     std::unique_ptr<skch::SequenceIdManager> idManager = std::make_unique<skch::SequenceIdManager>(
-        map_parameters.querySequences,
+        args::get(stream_queries) ? std::vector<std::string>() : map_parameters.querySequences,
         map_parameters.refSequences,
         std::vector<std::string>{map_parameters.query_prefix},
         std::vector<std::string>{map_parameters.target_prefix},
@@ -566,6 +881,7 @@ void parse_args(int argc,
     // Parse hypergeometric filter parameters
     map_parameters.stage1_topANI_filter = true;
     map_parameters.stage2_full_scan = true;
+    map_parameters.stage2_bound = args::get(l2_bound);
     
     if (hg_filter) {
         std::string hg_params = args::get(hg_filter);
@@ -597,23 +913,100 @@ void parse_args(int argc,
         map_parameters.minimum_hits = -1; // auto
     }
 
-    if (max_kmer_freq) {
-        map_parameters.max_kmer_freq = args::get(max_kmer_freq);
+    if (max_kmer_freq && args::get(max_kmer_freq).rfind("auto", 0) == 0) {
+        const std::string mode = args::get(max_kmer_freq);
+        map_parameters.auto_kmer_freq = true;
+        if (mode.size() > 4) {
+            const double budget = mode[4] == ':' ? std::atof(mode.c_str() + 5) : 0;
+            if (budget <= 0) {
+                std::cerr << "[wfmash] ERROR, skch::parseandSave, -F/--filter-freq takes auto or auto:HITS with HITS above 0." << std::endl;
+                exit(1);
+            }
+            map_parameters.kmer_hit_budget = budget;
+        }
+        if (args::get(approx_kmer_freq)) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, -F auto chooses its cutoff from exact counts and cannot be combined with --approx-filter-freq." << std::endl;
+            exit(1);
+        }
+    } else if (max_kmer_freq) {
+        const std::string value = args::get(max_kmer_freq);
+        char* end = nullptr;
+        const double freq = std::strtod(value.c_str(), &end);
+        if (value.empty() || *end != '\0' || !(freq >= 0)) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, -F/--filter-freq takes a non-negative number, auto or auto:HITS, got '" << value << "'." << std::endl;
+            exit(1);
+        }
+        map_parameters.max_kmer_freq = freq;
     } else {
         map_parameters.max_kmer_freq = 0.0002; // default filter fraction
     }
+    map_parameters.approx_kmer_freq = args::get(approx_kmer_freq);
+    map_parameters.pangenome_index = args::get(pangenome_index);
 
-    //if (window_minimizers) {
-        //map_parameters.world_minimizers = false;
-    //} else {
-        //map_parameters.world_minimizers = true;
-    //}
+    if (query_seed_cap) {
+        map_parameters.query_seed_cap = args::get(query_seed_cap);
+        if (map_parameters.query_seed_cap < 0) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --query-seed-cap must be non-negative." << std::endl;
+            exit(1);
+        }
+    }
 
-    if (read_index || write_index)
-    {
-      map_parameters.indexFilename = args::get(read_index);
+    if (guided_search) {
+        const int64_t window = wfmash::handy_parameter(args::get(guided_search));
+        if (window < 0) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --guided-search must be a non-negative length." << std::endl;
+            exit(1);
+        }
+        map_parameters.guided_search_window = window;
+    }
+
+    if (coarse_to_fine) {
+        map_parameters.coarse_factor = args::get(coarse_to_fine);
+        if (map_parameters.coarse_factor != 0 && map_parameters.coarse_factor < 2) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --coarse-to-fine must be 0 or at least 2." << std::endl;
+            exit(1);
+        }
+    }
+
+    if (adaptive_segments) {
+        map_parameters.adaptive_segment_factor = args::get(adaptive_segments);
+        if (map_parameters.adaptive_segment_factor != 0 && map_parameters.adaptive_segment_factor < 2) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --adaptive-segments must be 0 or at least 2." << std::endl;
+            exit(1);
+        }
+    }
+
+    map_parameters.world_minimizers = world_minimizers;
+
+    if (read_index) {
+        // A directory stands for the index files in it, by name
+        for (const auto& entry : skch::CommonFunc::split(args::get(read_index), ',')) {
+            if (!stdfs::is_directory(entry)) {
+                if (!stdfs::exists(entry)) {
+                    std::cerr << "[wfmash] ERROR, skch::parseandSave, index file " << entry << " does not exist." << std::endl;
+                    exit(1);
+                }
+                map_parameters.indexFiles.push_back(entry);
+                continue;
+            }
+            std::vector<stdfs::path> files;
+            for (const auto& file : stdfs::directory_iterator(entry)) {
+                if (file.is_regular_file() && skch::Sketch::isIndexFile(file.path())) {
+                    files.push_back(file.path());
+                }
+            }
+            if (files.empty()) {
+                std::cerr << "[wfmash] ERROR, skch::parseandSave, no index files in directory " << entry << "." << std::endl;
+                exit(1);
+            }
+            std::sort(files.begin(), files.end());
+            map_parameters.indexFiles.insert(map_parameters.indexFiles.end(), files.begin(), files.end());
+        }
+        map_parameters.indexFilename = map_parameters.indexFiles.front();
+    } else if (write_index) {
+        map_parameters.indexFilename = args::get(write_index);
     } else {
-      map_parameters.indexFilename = "";
+        map_parameters.indexFilename = "";
     }
 
     if (write_index) {
@@ -624,7 +1017,226 @@ void parse_args(int argc,
         map_parameters.create_index_only = false;
     }
 
-    if (index_by) {
+    if (update_index && !write_index) {
+        std::cerr << "[wfmash] ERROR, skch::parseandSave, --update-index requires -W/--write-index." << std::endl;
+        exit(1);
+    }
+    map_parameters.update_index = args::get(update_index);
+
+    if (compress_index && !write_index) {
+        std::cerr << "[wfmash] ERROR, skch::parseandSave, --compress-index requires -W/--write-index." << std::endl;
+        exit(1);
+    }
+    map_parameters.compress_index = args::get(compress_index) || (pangenome_index && write_index);
+    map_parameters.verify_index = !args::get(no_index_checksum);
+
+    if (index_stats) {
+        if (!read_index) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --index-stats requires -I/--read-index." << std::endl;
+            exit(1);
+        }
+        map_parameters.index_stats = true;
+    }
+
+    if (query_order) {
+        const std::string order = args::get(query_order);
+        if (order == "input") {
+            map_parameters.queryOrder = skch::query_order::INPUT;
+        } else if (order == "name") {
+            map_parameters.queryOrder = skch::query_order::NAME;
+        } else if (order == "mapped") {
+            map_parameters.queryOrder = skch::query_order::MAPPED;
+        } else {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --query-order must be input, name or mapped." << std::endl;
+            exit(1);
+        }
+    }
+
+    if (distance_matrix) {
+        if (!approx_mapping) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --distance-matrix requires -m/--approx-mapping." << std::endl;
+            exit(1);
+        }
+        if (serve || shard || merge_shards || stream_queries || query_regions || sweep || mapping_cache
+                || binary_mappings || write_index || index_stats) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --distance-matrix cannot be combined with --serve, --shard, --merge-shards, --stream-queries, --query-regions, --sweep, --mapping-cache, --binary-mappings, -W/--write-index or --index-stats." << std::endl;
+            exit(1);
+        }
+        map_parameters.distance_matrix = true;
+    }
+
+    if (index_subsets) {
+        if (!read_index) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --index-subsets requires -I/--read-index." << std::endl;
+            exit(1);
+        }
+        for (const auto& subset : skch::CommonFunc::split(args::get(index_subsets), ',')) {
+            const int64_t index = handy_parameter(subset);
+            if (index < 0) {
+                std::cerr << "[wfmash] ERROR, skch::parseandSave, index subsets must be non-negative integers." << std::endl;
+                exit(1);
+            }
+            map_parameters.index_subsets.push_back(index);
+        }
+    }
+
+    if (shard) {
+        const auto parts = skch::CommonFunc::split(args::get(shard), '/');
+        const int64_t index = parts.size() == 2 ? handy_parameter(parts[0]) : -1;
+        const int64_t count = parts.size() == 2 ? handy_parameter(parts[1]) : -1;
+        if (index < 0 || count < 1 || index >= count) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --shard takes K/N with 0 <= K < N." << std::endl;
+            exit(1);
+        }
+        if (!approx_mapping || !shard_mappings) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --shard requires -m/--approx-mapping and --shard-mappings." << std::endl;
+            exit(1);
+        }
+        if (serve || stream_queries || spill_mappings || write_index) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --shard cannot be combined with --serve, --stream-queries, --spill-mappings or -W/--write-index." << std::endl;
+            exit(1);
+        }
+        map_parameters.shard_index = index;
+        map_parameters.shard_count = count;
+        map_parameters.shard_mappings = args::get(shard_mappings);
+    }
+
+    if (merge_shards) {
+        if (!approx_mapping || shard || serve) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --merge-shards requires -m/--approx-mapping and cannot be combined with --shard or --serve." << std::endl;
+            exit(1);
+        }
+        map_parameters.merge_shards = skch::CommonFunc::split(args::get(merge_shards), ',');
+    }
+
+    if (mapping_cache) {
+        if (shard || merge_shards || serve || stream_queries || spill_mappings || checkpoint || write_index) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --mapping-cache cannot be combined with --shard, --merge-shards, --serve, --stream-queries, --spill-mappings, --checkpoint or -W/--write-index." << std::endl;
+            exit(1);
+        }
+        if (map_parameters.lower_triangular || map_parameters.query_regions || map_parameters.target_regions) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --mapping-cache caches the pairs of whole sequences and cannot be combined with -L, --mirror-align, --query-regions or --target-regions." << std::endl;
+            exit(1);
+        }
+        map_parameters.mapping_cache = args::get(mapping_cache);
+    }
+
+    if (stream_queries) {
+        if (!approx_mapping) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --stream-queries requires -m/--approx-mapping." << std::endl;
+            exit(1);
+        }
+        if (serve || lower_triangular) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --stream-queries cannot be combined with --serve or -L/--lower-triangular." << std::endl;
+            exit(1);
+        }
+        map_parameters.stream_queries = true;
+    }
+
+    if (stream_output) {
+        if (!approx_mapping) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --stream-output requires -m/--approx-mapping." << std::endl;
+            exit(1);
+        }
+        if (serve || shard || spill_mappings) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --stream-output cannot be combined with --serve, --shard or --spill-mappings." << std::endl;
+            exit(1);
+        }
+        map_parameters.stream_output = true;
+    }
+
+    map_parameters.deterministic = args::get(deterministic);
+
+    if (dedup_queries) {
+        if (stream_queries || query_regions || lower_triangular) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --dedup-queries cannot be combined with --stream-queries, --query-regions or -L/--lower-triangular." << std::endl;
+            exit(1);
+        }
+        map_parameters.dedup_queries = true;
+        align_parameters.dedup_queries = true;
+    }
+
+    if (reuse_target_sketches) {
+        if (map_parameters.querySequences != map_parameters.refSequences) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --reuse-target-sketches requires the queries to be the targets (self-mapping)." << std::endl;
+            exit(1);
+        }
+        if (read_index || stream_queries || query_regions || target_regions) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --reuse-target-sketches cannot be combined with -I/--read-index, --stream-queries, --query-regions or --target-regions." << std::endl;
+            exit(1);
+        }
+        map_parameters.reuse_target_sketches = true;
+    }
+
+    if (binary_mappings) {
+        if (!approx_mapping) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --binary-mappings requires -m/--approx-mapping." << std::endl;
+            exit(1);
+        }
+        if (serve || stream_queries || bgzip_output) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --binary-mappings cannot be combined with --serve, --stream-queries or --bgzip." << std::endl;
+            exit(1);
+        }
+        map_parameters.binary_output = true;
+    }
+
+    if (serve) {
+        if (!approx_mapping) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --serve requires -m/--approx-mapping." << std::endl;
+            exit(1);
+        }
+        if (write_index) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --serve cannot be combined with -W/--write-index." << std::endl;
+            exit(1);
+        }
+        if (bgzip_output) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --serve cannot be combined with --bgzip." << std::endl;
+            exit(1);
+        }
+        map_parameters.serve_queries = true;
+    }
+
+    map_parameters.lock_index = args::get(lock_index);
+    map_parameters.pack_queries = args::get(pack_queries);
+    map_parameters.index_warmup = args::get(index_warmup) || map_parameters.lock_index;
+
+    if (prefetch_budget) {
+        const int64_t budget = handy_parameter(args::get(prefetch_budget));
+        if (budget < 0) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, prefetch budget must be a non-negative integer." << std::endl;
+            exit(1);
+        }
+        map_parameters.index_prefetch_budget = budget;
+    }
+
+    map_parameters.queue_memory = 4ULL << 30;
+    if (queue_memory) {
+        const int64_t bytes = handy_parameter(args::get(queue_memory));
+        if (bytes < 0) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, queue memory must be a non-negative integer." << std::endl;
+            exit(1);
+        }
+        map_parameters.queue_memory = bytes;
+    }
+    align_parameters.queue_memory = map_parameters.queue_memory;
+
+    if (max_memory) {
+        const int64_t bytes = handy_parameter(args::get(max_memory));
+        if (bytes <= 0) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --max-memory must be a positive size." << std::endl;
+            exit(1);
+        }
+        if (index_by && args::get(index_by) != "auto") {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --max-memory sizes -b itself and cannot be combined with a -b size." << std::endl;
+            exit(1);
+        }
+        map_parameters.max_memory = bytes;
+    }
+    map_parameters.index_by_auto = max_memory || (index_by && args::get(index_by) == "auto");
+
+    if (map_parameters.index_by_auto) {
+        map_parameters.index_by_size = std::numeric_limits<size_t>::max(); // set from the memory once the targets are known
+    } else if (index_by) {
         const int64_t index_size = handy_parameter(args::get(index_by));
         if (index_size < 0) {
             std::cerr << "[wfmash] ERROR, skch::parseandSave, index-by size must be a positive integer." << std::endl;
@@ -635,6 +1247,31 @@ void parse_args(int argc,
         map_parameters.index_by_size = std::numeric_limits<size_t>::max(); // Default to indexing all sequences
     }
 
+    // Only the final output is compressed; a temporary mapping file stays plain PAF
+    map_parameters.bgzip_output = bgzip_output && approx_mapping;
+    align_parameters.bgzip_output = bgzip_output && !approx_mapping;
+    if (bgzip_index) {
+        map_parameters.bgzip_index_file = args::get(bgzip_index);
+        align_parameters.bgzip_index_file = args::get(bgzip_index);
+    }
+    if (interval_index) {
+        if (align_parameters.sam_format || binary_mappings) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --interval-index indexes PAF and cannot be combined with SAM, BAM, CRAM or --binary-mappings output." << std::endl;
+            exit(1);
+        }
+        if (serve || shard || sweep || checkpoint) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --interval-index cannot be combined with --serve, --shard, --sweep or --checkpoint." << std::endl;
+            exit(1);
+        }
+        // The virtual offsets of a BGZF output are found through its .gzi
+        if (bgzip_output && !bgzip_index) {
+            map_parameters.bgzip_index_file = args::get(interval_index) + ".gzi";
+            align_parameters.bgzip_index_file = map_parameters.bgzip_index_file;
+        }
+        map_parameters.interval_index_file = approx_mapping ? args::get(interval_index) : "";
+        align_parameters.interval_index_file = approx_mapping ? "" : args::get(interval_index);
+    }
+
     if (approx_mapping) {
         map_parameters.outFileName = "/dev/stdout";
         yeet_parameters.approx_mapping = true;
@@ -656,17 +1293,169 @@ void parse_args(int argc,
 
         if (input_mapping) {
             // directly use the input PAF file
+            if (stream_mappings) {
+                std::cerr << "[wfmash] ERROR, skch::parseandSave, --stream-align cannot be combined with -i/--align-paf." << std::endl;
+                exit(1);
+            }
             yeet_parameters.remapping = true;
             map_parameters.outFileName = args::get(input_mapping);
             align_parameters.mashmapPafFile = args::get(input_mapping);
+            align_parameters.pair_list = args::get(pair_list);
+        } else if (stream_mappings) {
+            // the mappings are handed to the aligner in memory
+            yeet_parameters.stream_mappings = true;
+            map_parameters.outFileName = "(streamed to the aligner)";
+            align_parameters.mashmapPafFile = map_parameters.outFileName;
         } else {
-            // make a temporary mapping file
-            map_parameters.outFileName = temp_file::create();
+            // make a temporary mapping file, binary as only the aligner reads it, or one
+            // the checkpointed job keeps for a resume
+            map_parameters.outFileName = checkpoint ? checkpoint::mappingsFile(args::get(checkpoint)) : temp_file::create();
+            map_parameters.binary_output = true;
             align_parameters.mashmapPafFile = map_parameters.outFileName;
         }
         align_parameters.pafOutputFile = "/dev/stdout";
     }
 
+    if (pair_list && (!input_mapping || approx_mapping)) {
+        std::cerr << "[wfmash] ERROR, skch::parseandSave, --pair-list requires -i/--align-paf and cannot be combined with -m/--approx-mapping." << std::endl;
+        exit(1);
+    }
+
+    if (query_regions && (serve || stream_queries)) {
+        std::cerr << "[wfmash] ERROR, skch::parseandSave, --query-regions cannot be combined with --serve or --stream-queries." << std::endl;
+        exit(1);
+    }
+
+    if (cache_query_sketches) {
+        if (serve || stream_queries || query_regions) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --cache-query-sketches cannot be combined with --serve, --stream-queries or --query-regions." << std::endl;
+            exit(1);
+        }
+        map_parameters.query_sketch_file = temp_file::create("wfmash-", ".sketches");
+    }
+
+    if (sort_output) {
+        if (bam_format || cram_format || binary_mappings) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --sort-output cannot be combined with --bam, --cram or --binary-mappings; sort BAM and CRAM with samtools sort." << std::endl;
+            exit(1);
+        }
+        if (serve || shard || checkpoint || align_shard) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --sort-output cannot be combined with --serve, --shard, --checkpoint or --align-shard." << std::endl;
+            exit(1);
+        }
+        const std::string prefix = temp_file::create("wfmash-", ".sorted");
+        map_parameters.sort_output = approx_mapping;
+        align_parameters.sort_output = !approx_mapping;
+        map_parameters.sort_prefix = prefix;
+        align_parameters.sort_prefix = prefix;
+        if (sort_memory) {
+            const int64_t bytes = handy_parameter(args::get(sort_memory));
+            if (bytes <= 0) {
+                std::cerr << "[wfmash] ERROR, skch::parseandSave, --sort-memory must be a positive size." << std::endl;
+                exit(1);
+            }
+            map_parameters.sort_memory = bytes;
+            align_parameters.sort_memory = bytes;
+        }
+    } else if (sort_memory) {
+        std::cerr << "[wfmash] ERROR, skch::parseandSave, --sort-memory requires --sort-output." << std::endl;
+        exit(1);
+    }
+
+    if (spill_mappings) {
+        if (serve || stream_queries) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --spill-mappings cannot be combined with --serve or --stream-queries." << std::endl;
+            exit(1);
+        }
+        map_parameters.mapping_spill_prefix = temp_file::create("wfmash-", ".runs");
+    }
+
+    // Mappings read from standard input are read once, so nothing can read them again
+    if (input_mapping && args::get(input_mapping) == "-" && (checkpoint || align_shard)) {
+        std::cerr << "[wfmash] ERROR, skch::parseandSave, --checkpoint and --align-shard need -i/--align-paf to name a file, not standard input." << std::endl;
+        exit(1);
+    }
+
+    if (resume && !checkpoint) {
+        std::cerr << "[wfmash] ERROR, skch::parseandSave, --resume requires --checkpoint." << std::endl;
+        exit(1);
+    }
+    if (checkpoint) {
+        if (serve || stream_queries || stream_output || stream_mappings || shard || merge_shards || align_shard || merge_align_shards || write_index || estimate) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --checkpoint cannot be combined with --serve, --stream-queries, --stream-output, --stream-align, --shard, --merge-shards, --align-shard, --merge-align-shards, -W/--write-index or --estimate." << std::endl;
+            exit(1);
+        }
+        if (bam_format || cram_format || bgzip_output) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --checkpoint needs PAF or SAM output, which a resumed job appends to." << std::endl;
+            exit(1);
+        }
+        const std::string prefix = args::get(checkpoint);
+        std::vector<std::string> inputs = map_parameters.refSequences;
+        inputs.insert(inputs.end(), map_parameters.querySequences.begin(), map_parameters.querySequences.end());
+        if (input_mapping) {
+            inputs.push_back(args::get(input_mapping));
+        }
+        const std::string params = checkpoint::fingerprint(argc, argv, inputs);
+        if (resume) {
+            checkpoint::resume(prefix, params);
+        } else {
+            checkpoint::start(prefix, params);
+        }
+
+        // The mappings are kept per subset, in run files indexed as each query is done
+        map_parameters.checkpoint_prefix = prefix;
+        map_parameters.resume = resume;
+        map_parameters.mapping_spill_prefix = checkpoint::runsPrefix(prefix);
+        if (!approx_mapping) {
+            align_parameters.checkpoint_file = checkpoint::alignedFile(prefix);
+            align_parameters.resume = resume;
+        }
+        if (resume && checkpoint::mapped(prefix)) {
+            if (approx_mapping) {
+                std::cerr << "[wfmash] The mapping of " << prefix << " is complete, nothing to resume" << std::endl;
+                exit(0);
+            }
+            if (!input_mapping) {
+                std::cerr << "[wfmash] Resuming " << prefix << " at the alignment, the mapping being complete" << std::endl;
+                yeet_parameters.remapping = true;
+            }
+        }
+    }
+
+    if (align_shard) {
+        const auto parts = skch::CommonFunc::split(args::get(align_shard), '/');
+        const int64_t index = parts.size() == 2 ? handy_parameter(parts[0]) : -1;
+        const int64_t count = parts.size() == 2 ? handy_parameter(parts[1]) : -1;
+        if (index < 0 || count < 1 || index >= count) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --align-shard takes K/N with 0 <= K < N." << std::endl;
+            exit(1);
+        }
+        if (approx_mapping || !align_shard_records) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --align-shard requires --align-shard-records and cannot be combined with -m/--approx-mapping." << std::endl;
+            exit(1);
+        }
+        if (stream_mappings || merge_align_shards || bam_format || cram_format || bgzip_output) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --align-shard cannot be combined with --stream-align, --merge-align-shards, --bam, --cram or --bgzip." << std::endl;
+            exit(1);
+        }
+        align_parameters.align_shard_index = index;
+        align_parameters.align_shard_count = count;
+        align_parameters.align_shard_records = args::get(align_shard_records);
+    }
+
+    if (merge_align_shards) {
+        if (!align_shard_records) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --merge-align-shards requires the --align-shard-records of its outputs." << std::endl;
+            exit(1);
+        }
+        align_parameters.merge_align_shards = skch::CommonFunc::split(args::get(merge_align_shards), ',');
+        align_parameters.merge_align_shard_records = skch::CommonFunc::split(args::get(align_shard_records), ',');
+        if (align_parameters.merge_align_shard_records.size() != align_parameters.merge_align_shards.size()) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --merge-align-shards takes as many outputs as --align-shard-records files." << std::endl;
+            exit(1);
+        }
+    }
+
 #ifdef WFA_PNG_TSV_TIMING
     align_parameters.tsvOutputPrefix = (prefix_wavefront_info_in_tsv && !args::get(prefix_wavefront_info_in_tsv).empty())
             ? args::get(prefix_wavefront_info_in_tsv)
@@ -700,6 +1489,72 @@ void parse_args(int argc,
 
     map_parameters.numMappingsForShortSequence = 1;
 
+    if (sweep) {
+        if (!approx_mapping) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --sweep requires -m/--approx-mapping." << std::endl;
+            exit(1);
+        }
+        if (serve || shard || stream_queries || stream_output || spill_mappings || write_index) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --sweep cannot be combined with --serve, --shard, --stream-queries, --stream-output, --spill-mappings or -W/--write-index." << std::endl;
+            exit(1);
+        }
+        std::ifstream settings(args::get(sweep));
+        if (!settings) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, unable to read the sweep settings " << args::get(sweep) << "." << std::endl;
+            exit(1);
+        }
+        std::string line;
+        while (std::getline(settings, line)) {
+            std::istringstream fields(line);
+            skch::SweepSetting setting{"", map_parameters.percentageIdentity, map_parameters.numMappingsForSegment,
+                                       map_parameters.chain_gap, map_parameters.overlap_threshold};
+            if (!(fields >> setting.output) || setting.output[0] == '#') {
+                continue;
+            }
+            std::string field;
+            while (fields >> field) {
+                const size_t eq = field.find('=');
+                const std::string key = field.substr(0, eq);
+                const std::string value = eq == std::string::npos ? "" : field.substr(eq + 1);
+                bool valid = !value.empty();
+                if (valid && key == "p") {
+                    setting.percentageIdentity = std::stod(value) / 100.0;
+                    valid = setting.percentageIdentity >= 0.5 && setting.percentageIdentity <= 1.0;
+                } else if (valid && key == "n") {
+                    const int64_t n = wfmash::handy_parameter(value);
+                    setting.numMappingsForSegment = n;
+                    valid = n > 0;
+                } else if (valid && key == "c") {
+                    const int64_t c = wfmash::handy_parameter(value);
+                    setting.chain_gap = c;
+                    valid = c >= 0;
+                } else if (valid && key == "O") {
+                    setting.overlap_threshold = std::stod(value);
+                    valid = setting.overlap_threshold >= 0 && setting.overlap_threshold <= 1.0;
+                } else {
+                    valid = false;
+                }
+                if (!valid) {
+                    std::cerr << "[wfmash] ERROR, skch::parseandSave, invalid sweep setting " << field << " for " << setting.output
+                              << "; the settings are p=FLOAT (>= 50), n=INT (> 0), c=INT and O=FLOAT (0-1)." << std::endl;
+                    exit(1);
+                }
+            }
+            map_parameters.sweep.push_back(setting);
+        }
+        if (map_parameters.sweep.empty()) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, no sweep settings in " << args::get(sweep) << "." << std::endl;
+            exit(1);
+        }
+        // Mapped once under the most permissive of the settings, each filtered down from it
+        for (const auto& setting : map_parameters.sweep) {
+            map_parameters.percentageIdentity = std::min(map_parameters.percentageIdentity, setting.percentageIdentity);
+            map_parameters.numMappingsForSegment = std::max(map_parameters.numMappingsForSegment, setting.numMappingsForSegment);
+            map_parameters.chain_gap = std::max(map_parameters.chain_gap, setting.chain_gap);
+            map_parameters.overlap_threshold = std::max(map_parameters.overlap_threshold, setting.overlap_threshold);
+        }
+    }
+
 	map_parameters.legacy_output = false;
 
     //Check if files are valid
@@ -722,6 +1577,62 @@ void parse_args(int argc,
 
     temp_file::set_keep_temp(args::get(keep_temp_files));
 
+    if (stage_report) {
+        map_parameters.stage_report_file = args::get(stage_report);
+    }
+
+    if ((cost_tags || slow_queries) && (serve || stream_queries || shard || merge_shards)) {
+        std::cerr << "[wfmash] ERROR, skch::parseandSave, --cost-tags and --slow-queries cannot be combined with --serve, --stream-queries, --shard or --merge-shards." << std::endl;
+        exit(1);
+    }
+    if (cost_tags) {
+        if (approx_mapping && binary_mappings) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --cost-tags writes PAF tags and cannot be combined with --binary-mappings." << std::endl;
+            exit(1);
+        }
+        // The mappings an aligning run writes are binary, so only its alignments are tagged
+        map_parameters.cost_tags = approx_mapping;
+        align_parameters.cost_tags = !approx_mapping;
+    }
+    if (slow_queries) {
+        if (input_mapping) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --slow-queries cannot be combined with -i/--align-paf, which does not map." << std::endl;
+            exit(1);
+        }
+        map_parameters.slow_query_file = args::get(slow_queries);
+    }
+    if (slow_query_count) {
+        if (!slow_queries || args::get(slow_query_count) < 1) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --slow-query-count requires --slow-queries and a count of at least 1." << std::endl;
+            exit(1);
+        }
+        map_parameters.slow_query_count = args::get(slow_query_count);
+    }
+
+    if (memory_report) {
+        map_parameters.memory_report_file = args::get(memory_report);
+    }
+    if (memory_estimate) {
+        if (input_mapping || read_index || write_index) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --memory-estimate cannot be combined with -i, -I or -W." << std::endl;
+            exit(1);
+        }
+        map_parameters.memory_estimate = true;
+    }
+    if (estimate) {
+        if (input_mapping || read_index || write_index || serve || stream_queries || query_regions || merge_shards || shard || memory_estimate) {
+            std::cerr << "[wfmash] ERROR, skch::parseandSave, --estimate cannot be combined with -i, -I, -W, --serve, --stream-queries, --query-regions, --shard, --merge-shards or --memory-estimate." << std::endl;
+            exit(1);
+        }
+        if (tmp_base) {
+            temp_file::set_dir(args::get(tmp_base));
+        }
+        yeet_parameters.estimate = true;
+    }
+
+    if (profile) {
+        map_parameters.profile_prefix = args::get(profile);
+    }
 }
 
 }
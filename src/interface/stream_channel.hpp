@@ -0,0 +1,132 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <istream>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+
+namespace yeet {
+
+/**
+ * In-memory byte stream from one writing thread to one reading thread, carrying the
+ * mappings from the mapper to the aligner in place of a temporary PAF file.
+ * The writer's bytes are handed over in chunks of about chunk_bytes, or when it
+ * closes; the reader blocks until a chunk or the close arrives. Chunks are not
+ * bounded in number, so a mapper ahead of the aligner never waits on it.
+ */
+class StreamChannel {
+public:
+    static constexpr size_t chunk_bytes = 1 << 16;
+
+    StreamChannel() : out_buf(*this), in_buf(*this), out(&out_buf), in(&in_buf) {}
+
+    StreamChannel(const StreamChannel&) = delete;
+    StreamChannel& operator=(const StreamChannel&) = delete;
+
+    std::ostream& writer() { return out; }
+    std::istream& reader() { return in; }
+
+    // hand over what the writer has left and signal the end of the stream
+    void close() {
+        out.flush();
+        out_buf.hand_over();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        ready.notify_one();
+    }
+
+private:
+    void push(std::string&& chunk) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            chunks.push_back(std::move(chunk));
+        }
+        ready.notify_one();
+    }
+
+    bool pop(std::string& chunk) {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [&]() { return !chunks.empty() || closed; });
+        if (chunks.empty()) {
+            return false;
+        }
+        chunk = std::move(chunks.front());
+        chunks.pop_front();
+        return true;
+    }
+
+    class OutBuffer : public std::streambuf {
+    public:
+        explicit OutBuffer(StreamChannel& channel) : channel(channel) {}
+
+        void hand_over() {
+            if (!pending.empty()) {
+                channel.push(std::move(pending));
+                pending.clear();
+            }
+        }
+
+    protected:
+        int_type overflow(int_type c) override {
+            if (c != traits_type::eof()) {
+                pending.push_back(traits_type::to_char_type(c));
+                if (pending.size() >= chunk_bytes) hand_over();
+            }
+            return traits_type::not_eof(c);
+        }
+
+        std::streamsize xsputn(const char* s, std::streamsize n) override {
+            pending.append(s, n);
+            if (pending.size() >= chunk_bytes) hand_over();
+            return n;
+        }
+
+        // flushes (std::endl) leave small writes to gather into a chunk
+        int sync() override { return 0; }
+
+    private:
+        StreamChannel& channel;
+        std::string pending;
+    };
+
+    class InBuffer : public std::streambuf {
+    public:
+        explicit InBuffer(StreamChannel& channel) : channel(channel) {}
+
+    protected:
+        int_type underflow() override {
+            if (gptr() < egptr()) {
+                return traits_type::to_int_type(*gptr());
+            }
+            do {
+                if (!channel.pop(current)) {
+                    return traits_type::eof();
+                }
+            } while (current.empty());
+            char* data = &current[0];
+            setg(data, data, data + current.size());
+            return traits_type::to_int_type(*gptr());
+        }
+
+    private:
+        StreamChannel& channel;
+        std::string current;
+    };
+
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<std::string> chunks;
+    bool closed = false;
+
+    OutBuffer out_buf;
+    InBuffer in_buf;
+    std::ostream out;
+    std::istream in;
+};
+
+}
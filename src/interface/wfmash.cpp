@@ -0,0 +1,135 @@
+/**
+ * In-process API of libwfmash, see wfmash.hpp
+ */
+
+#include <algorithm>
+#include <mutex>
+#include <stdexcept>
+
+#include "interface/wfmash.hpp"
+
+#include "map/include/computeMap.hpp"
+#include "map/include/parseCmdArgs.hpp"
+
+#include "interface/parse_args.hpp"
+
+#include "align/include/computeAlignments.hpp"
+
+namespace wfmash {
+
+Options parse_options(const std::vector<std::string>& args) {
+    std::vector<std::string> words{"wfmash"};
+    words.insert(words.end(), args.begin(), args.end());
+    std::vector<char*> argv;
+    for (auto& word : words) {
+        argv.push_back(&word[0]);
+    }
+    argv.push_back(nullptr);
+
+    Options options;
+    yeet::Parameters yeet_parameters;
+    yeet::parse_args(int(words.size()), argv.data(), options.map, options.align, yeet_parameters);
+    return options;
+}
+
+Mapper::Mapper(const skch::Parameters& params) {
+    skch::Parameters p = params;
+    p.library_mode = true;
+    p.serve_queries = false;
+    p.stream_queries = false;
+    p.create_index_only = false;
+    p.plan_only = false;
+    p.memory_estimate = false;
+    p.index_stats = false;
+    p.distance_matrix = false;
+    p.query_sketch_file.clear();
+    p.mapping_spill_prefix.clear();
+    p.query_regions.reset();
+    if (!p.indexFilename.empty() && !stdfs::exists(p.indexFilename)) {
+        // An index asked for but not built yet is built in memory
+        p.indexFilename.clear();
+    }
+    merge_mappings = p.mergeMappings;
+    mapper = std::make_unique<skch::Map>(p);
+}
+
+Mapper::~Mapper() = default;
+
+void Mapper::map(const std::vector<std::pair<std::string, std::string>>& queries,
+                 const std::function<void(const skch::MappingResult&)>& on_mapping) {
+    std::mutex calls;
+    mapper->mapSequences(queries, [&](const skch::MappingResult& e) {
+        std::lock_guard<std::mutex> lock(calls);
+        on_mapping(e);
+    });
+}
+
+std::string_view Mapper::sequence_name(skch::seqno_t id) const {
+    return mapper->sequenceIds().getSequenceName(id);
+}
+
+skch::offset_t Mapper::sequence_length(skch::seqno_t id) const {
+    return mapper->sequenceIds().getSequenceLength(id);
+}
+
+Aligner::Aligner(const align::Parameters& params) : params(params) {
+    this->params.sam_format = false;
+    this->params.bam_format = false;
+    this->params.cram_format = false;
+    this->params.bgzip_output = false;
+    this->params.bgzip_index_file.clear();
+    this->params.telemetry_file.clear();
+    this->params.mirror_alignments = false;
+    // None of the options that rewrite or reorder the PAF lines, nor those that keep state
+    // across runs, apply to alignments taken as fields
+    this->params.stats_only = false;
+    this->params.cluster_overlap = 0;
+    this->params.dedup_queries = false;
+    this->params.cost_tags = false;
+    this->params.sort_output = false;
+    this->params.checkpoint_file.clear();
+    this->params.resume = false;
+    this->params.align_shard_count = 0;
+    this->params.align_shard_records.clear();
+    this->params.interval_index_file.clear();
+    this->params.pair_list = false;
+    this->params.emit_md_tag = false;
+}
+
+std::vector<Alignment> Aligner::align(const Mapper& mapper, const std::vector<skch::MappingResult>& mappings) const {
+    align::Aligner aligner(params);
+
+    // The rows of the mappings, as binaryMappingRow makes them of their binary records
+    auto sequenceId = [](uint32_t id, std::string_view name, const char* file) {
+        if (id == align::SequenceNames::missing) {
+            throw std::runtime_error("[wfmash::align] Error! Sequence " + std::string(name) + " is not in the " + file + " FASTA file");
+        }
+        return id;
+    };
+    std::vector<align::MappingBoundaryRow> rows(mappings.size());
+    for (size_t i = 0; i < mappings.size(); ++i) {
+        const skch::MappingResult& e = mappings[i];
+        align::MappingBoundaryRow& row = rows[i];
+        const std::string_view queryName = mapper.sequence_name(e.querySeqId);
+        const std::string_view refName = mapper.sequence_name(e.refSeqId);
+        row.qId = sequenceId(aligner.queryId(queryName), queryName, "query");
+        row.refId = sequenceId(aligner.refId(refName), refName, "target");
+        row.qStartPos = e.queryStartPos;
+        row.qEndPos = e.queryEndPos;
+        row.strand = e.strand == skch::strnd::REV ? skch::strnd::REV : skch::strnd::FWD;
+        row.chain_id = mapper.chained() ? e.splitMappingId : -1;
+        row.chain_pos = mapper.chained() ? e.chain_pos : 1;
+        row.chain_length = mapper.chained() ? e.chain_length : 1;
+        align::Aligner::setPaddedTargetRange(row, e.refStartPos, e.refEndPos, mapper.sequence_length(e.refSeqId),
+                                             params.target_padding);
+        row.mashmap_estimated_identity = e.nucIdentity;
+        row.mashmap_identity_upper_bound = e.nucIdentityUpperBound;
+        row.opposing_strand_votes = std::min(e.opposingStrandVotes, UINT16_MAX - 1);
+    }
+
+    std::vector<Alignment> alignments;
+    aligner.compute(rows, [&](Alignment& a) { alignments.push_back(std::move(a)); });
+    return alignments;
+}
+
+}
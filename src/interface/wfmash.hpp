@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "map/include/map_parameters.hpp"
+#include "align/include/align_parameters.hpp"
+#include "common/wflign/src/wflign_record.hpp"
+
+namespace skch { class Map; }
+
+/**
+ * In-process API of libwfmash, for tools that map and align without running wfmash and
+ * reading back its PAF. A Mapper builds or loads the index of its targets once and maps
+ * any number of batches of sequences held in memory against it; an Aligner aligns given
+ * mappings between sequences of its FASTA files.
+ */
+namespace wfmash {
+
+struct Options {
+    skch::Parameters map;
+    align::Parameters align;
+};
+
+/**
+ * Options of the wfmash command line, args being its arguments less the program name,
+ * such as {"target.fa", "-p", "90", "-s", "5k"}; exits on invalid arguments as wfmash does
+ */
+Options parse_options(const std::vector<std::string>& args);
+
+// An alignment as the fields of its PAF record
+using Alignment = wflign::wavefront::paf_record_t;
+
+/**
+ * The index of the targets of map.refSequences, built or loaded from map.indexFilename,
+ * against which batches of query sequences are mapped
+ */
+class Mapper {
+public:
+    explicit Mapper(const skch::Parameters& params);
+    ~Mapper();
+
+    Mapper(const Mapper&) = delete;
+    Mapper& operator=(const Mapper&) = delete;
+
+    /**
+     * Map the queries, pairs of name and sequence; each final mapping is passed to
+     * on_mapping, one at a time, once all of them are mapped
+     */
+    void map(const std::vector<std::pair<std::string, std::string>>& queries,
+             const std::function<void(const skch::MappingResult&)>& on_mapping);
+
+    // Name and length of a query or target by the sequence id of a mapping
+    std::string_view sequence_name(skch::seqno_t id) const;
+    skch::offset_t sequence_length(skch::seqno_t id) const;
+
+    // Whether the mappings are merged into chains, their chain fields then set
+    bool chained() const { return merge_mappings; }
+
+private:
+    std::unique_ptr<skch::Map> mapper;
+    bool merge_mappings;
+};
+
+/**
+ * Aligns mappings between the sequences of align.querySequences and align.refSequences
+ */
+class Aligner {
+public:
+    explicit Aligner(const align::Parameters& params);
+
+    /**
+     * The alignments of the mappings of mapper, in their order, as PAF records whatever
+     * the output options; throws if a sequence of theirs is not in the FASTA files
+     */
+    std::vector<Alignment> align(const Mapper& mapper, const std::vector<skch::MappingResult>& mappings) const;
+
+private:
+    align::Parameters params;
+};
+
+}
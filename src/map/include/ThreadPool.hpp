@@ -8,262 +8,225 @@
 #ifndef ThreadPool_h
 #define ThreadPool_h
 
-#include <pthread.h>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "map/include/blockingQueue.hpp"
 
 /**
- * @brief     generic thread pooling library using C++ pthreads
- * @details   dispatches input tasks to threads after any of them is available.
- *            maintains a thread safe output queue that guarantees that order of 
- *            output is same as input order
+ * @brief     generic thread pool whose outputs come out in the order of its inputs
+ * @details   task t lives in slot t % capacity of a ring, which holds its input until a
+ *            worker takes it and then its output until it is popped. The slot's sequence
+ *            tells the state apart: 2t while free for task t, 2t + 1 once its input is
+ *            queued and 2t + 2 once its output is ready; popping frees it for task
+ *            t + capacity. Inputs are queued and taken with compare-and-swap on the ring
+ *            positions, so no lock is taken and nothing is allocated per task; threads
+ *            only sleep when there is nothing for them to do.
  */
 template <class TypeInput, class TypeOutput>
 class ThreadPool
 {
   private:
 
-    struct OutputQueueNode
+    struct Slot
     {
-        // used to preserve input order when outputting
-        
-        OutputQueueNode * prev;
-        OutputQueueNode * next;
-        
-        TypeOutput * output;
-        bool ready;
+        std::atomic<uint64_t> sequence;
+        TypeInput* input;
+        TypeOutput* output;
     };
 
-    unsigned int threadCount;
-
-    pthread_t* threads;
+    const uint64_t capacity;
+    std::unique_ptr<Slot[]> ring;
+    std::atomic<uint64_t> enqueuePos{0};   // next task to queue
+    std::atomic<uint64_t> dequeuePos{0};   // next task a worker takes
+    uint64_t outputPos = 0;                // next task to pop, by the one consumer
 
     std::function<TypeOutput* (TypeInput*)> function;
-    TypeInput* inputCurrent;
-    OutputQueueNode * outputQueueNodeCurrent;
-
-    pthread_mutex_t* mutexInput;
-    pthread_mutex_t* mutexOutput;
+    std::vector<std::thread> threads;
+    std::atomic<bool> finished{false};
 
-    pthread_cond_t* condInput;
-    pthread_cond_t* condOutput;
+    skch::Wakeup inputReady;               // for idle workers
+    skch::Wakeup outputReady;              // for the consumer waiting on the next output
+    skch::Wakeup slotFreed;                // for producers waiting on a full ring
 
-    OutputQueueNode* outputQueueHead;
-    OutputQueueNode* outputQueueTail;
-
-    bool finished;
+    static uint64_t ringSize(unsigned int threadCount)
+    {
+      uint64_t size = 64;
+      while (size < 16 * uint64_t(threadCount))
+        size <<= 1;
+      return size;
+    }
 
   public:
-    
+
     /* Constructor */
     ThreadPool(std::function<TypeOutput* (TypeInput*)> functionNew, unsigned int threadCountNew)
       :
-        threadCount(threadCountNew),
+        capacity(ringSize(threadCountNew)),
+        ring(new Slot[capacity]),
         function(functionNew)
-  {
-    mutexInput = new pthread_mutex_t();
-    mutexOutput = new pthread_mutex_t();
-
-    condInput = new pthread_cond_t();
-    condOutput = new pthread_cond_t();
-
-    pthread_mutex_init(mutexInput, NULL);
-    pthread_mutex_init(mutexOutput, NULL);
-
-    pthread_cond_init(condInput, NULL);
-    pthread_cond_init(condOutput, NULL);
-
-    inputCurrent = 0;
-
-    outputQueueHead = 0;
-    outputQueueTail = 0;
-
-    finished = false;
-
-    threads = new pthread_t[threadCount];
-
-    for ( int i = 0; i < threadCount; i++ )
     {
-      pthread_create(&threads[i], NULL, &ThreadPool::thread, this);
+      for (uint64_t i = 0; i < capacity; i++)
+      {
+        ring[i].sequence.store(2 * i, std::memory_order_relaxed);
+      }
+      for (unsigned int i = 0; i < threadCountNew; i++)
+      {
+        threads.emplace_back([this]() { work(); });
+      }
     }
-  }
 
     /* Destructor */
     ~ThreadPool()
     {
-      pthread_mutex_lock(mutexInput);
-      finished = true;
-      pthread_cond_broadcast(condInput);
-      pthread_mutex_unlock(mutexInput);
-
-      for ( int i = 0; i < threadCount; i++ )
+      finished.store(true);
+      inputReady.notify();
+      for (auto& thread : threads)
       {
-        pthread_join(threads[i], NULL);
+        thread.join();
       }
-
-      delete [] threads;
-
-      while ( outputQueueHead != 0 )
+      // Outputs never popped
+      for (uint64_t t = outputPos; t < enqueuePos.load(); t++)
       {
-        OutputQueueNode * next = outputQueueHead->next;
-        delete outputQueueHead;
-        outputQueueHead = next;
+        Slot& slot = ring[t & (capacity - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) == 2 * t + 2)
+        {
+          delete slot.output;
+        }
       }
-
-      delete mutexInput;
-      delete mutexOutput;
-
-      delete condInput;
-      delete condOutput;
     }
 
-    /* Check if any thread has placed it's output in the queue */
+    /* Check if the next output in input order is ready */
     bool outputAvailable() const
     {
-      bool available;
-
-      pthread_mutex_lock(mutexOutput);
-      available = outputQueueHead != 0 && outputQueueHead->ready;
-      pthread_mutex_unlock(mutexOutput);
-
-      return available;
+      return outputPos < enqueuePos.load(std::memory_order_acquire)
+        && ring[outputPos & (capacity - 1)].sequence.load(std::memory_order_acquire) == 2 * outputPos + 2;
     }
 
-    /* Pop the output if available; Calling function is responsible for destructing output object later */
+    /* Wait for the next output in input order; Calling function is responsible for destructing output object later */
     TypeOutput* popOutputWhenAvailable()
     {
-      pthread_mutex_lock(mutexOutput);
-
-      if ( outputQueueHead == 0 )
+      if (outputPos >= enqueuePos.load(std::memory_order_acquire))
       {
         std::cerr << "ERROR: waiting for output when no output queued\n";
-        pthread_mutex_unlock(mutexOutput);
         return 0;
       }
-
-      while ( ! outputQueueHead->ready )
-      {
-        pthread_cond_wait(condOutput, mutexOutput);
-      }
-
-      TypeOutput * output = outputQueueHead->output;
-
-      OutputQueueNode * next = outputQueueHead->next;
-
-      if ( outputQueueTail == outputQueueHead )
+      Slot& slot = ring[outputPos & (capacity - 1)];
+      while (true)
       {
-        outputQueueTail = 0;
+        const uint64_t ticket = outputReady.ticket();
+        if (slot.sequence.load(std::memory_order_acquire) == 2 * outputPos + 2)
+          break;
+        outputReady.wait(ticket);
       }
-
-      delete outputQueueHead;
-      outputQueueHead = next;
-      pthread_mutex_unlock(mutexOutput);
-
+      TypeOutput* output = slot.output;
+      slot.sequence.store(2 * (outputPos + capacity), std::memory_order_release);
+      outputPos++;
+      slotFreed.notify();
       return output;
     }
 
-    /* Check if any of the threads is still running */
+    /* Check if any task is still queued, running or not popped */
     bool running() const
     {
-      bool running;
-
-      pthread_mutex_lock(mutexOutput);
-      running = outputQueueHead != 0;
-      pthread_mutex_unlock(mutexOutput);
+      return outputPos < enqueuePos.load(std::memory_order_acquire);
+    }
 
-      return running;
+    /* Check if every slot holds a task not yet popped, so the next input would wait for a pop */
+    bool full() const
+    {
+      return enqueuePos.load(std::memory_order_acquire) - outputPos >= capacity;
     }
 
-    /* Assign job to next available thread (wait if unavailable), thread will destruct the input */
+    /* Queue a task, waiting while the ring is full; a thread will destruct the input. The
+       outputs must be popped meanwhile, by another thread if the ring may be full */
     void runWhenThreadAvailable(TypeInput * input)
     {
-      pthread_mutex_lock(mutexInput);
-
-      while ( inputCurrent != 0 )
+      uint64_t pos = enqueuePos.load(std::memory_order_relaxed);
+      while (true)
       {
-        pthread_cond_wait(condInput, mutexInput);
+        const uint64_t ticket = slotFreed.ticket();
+        Slot& slot = ring[pos & (capacity - 1)];
+        const uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence == 2 * pos)
+        {
+          if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          {
+            slot.input = input;
+            slot.sequence.store(2 * pos + 1, std::memory_order_release);
+            inputReady.notify();
+            return;
+          }
+        }
+        else if (sequence < 2 * pos)
+        {
+          // The slot still holds the output of the task capacity before
+          slotFreed.wait(ticket);
+          pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+        else
+        {
+          pos = enqueuePos.load(std::memory_order_relaxed);
+        }
       }
+    }
 
-      inputCurrent = input;
+  private:
 
-      // enqueue output while input locked (to preserve order)
-      //
-      OutputQueueNode * outputQueueNode = new OutputQueueNode();
-      outputQueueNode->next = 0;
-      outputQueueNode->ready = false;
-      //
-      pthread_mutex_lock(mutexOutput);
-      //
-      if ( outputQueueHead == 0 )
-      {
-        outputQueueHead = outputQueueNode;
-      }
-      //
-      outputQueueNode->prev = outputQueueTail;
-      //
-      if ( outputQueueTail != 0 )
+    /* Take the next queued input, false if there is none right now */
+    bool take(uint64_t& task)
+    {
+      uint64_t pos = dequeuePos.load(std::memory_order_relaxed);
+      while (true)
       {
-        outputQueueTail->next = outputQueueNode;
+        const uint64_t sequence = ring[pos & (capacity - 1)].sequence.load(std::memory_order_acquire);
+        if (sequence == 2 * pos + 1)
+        {
+          if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          {
+            task = pos;
+            return true;
+          }
+        }
+        else if (sequence < 2 * pos + 1)
+        {
+          return false;
+        }
+        else
+        {
+          pos = dequeuePos.load(std::memory_order_relaxed);
+        }
       }
-      //
-      outputQueueTail = outputQueueNode;
-      //
-      pthread_mutex_unlock(mutexOutput);
-
-      outputQueueNodeCurrent = outputQueueNode;
-
-      pthread_mutex_unlock(mutexInput);
-      pthread_cond_broadcast(condInput);
     }
 
-  private:
-
     /* Main function that each thread executes */
-    static void * thread(void * arg)
+    void work()
     {
-      ThreadPool * threadPool = (ThreadPool *)arg;
-      TypeInput * input;
-      OutputQueueNode * outputQueueNode;
-
-      while ( ! threadPool->finished )
+      while (true)
       {
-        // wait for input
-        //
-        pthread_mutex_lock(threadPool->mutexInput);
-        //
-        while ( ! threadPool->finished && threadPool->inputCurrent == 0 )
+        const uint64_t ticket = inputReady.ticket();
+        uint64_t task = 0;
+        if (take(task))
         {
-          pthread_cond_wait(threadPool->condInput, threadPool->mutexInput);
+          Slot& slot = ring[task & (capacity - 1)];
+          TypeInput* input = slot.input;
+          slot.output = function(input);
+          delete input;
+          slot.sequence.store(2 * task + 2, std::memory_order_release);
+          outputReady.notify();
+          continue;
         }
-
-        if ( threadPool->finished )
+        if (finished.load())
         {
-          pthread_mutex_unlock(threadPool->mutexInput);
-          return 0;
+          return;
         }
-        //
-        input = threadPool->inputCurrent;
-        outputQueueNode = threadPool->outputQueueNodeCurrent;
-        threadPool->inputCurrent = 0;
-
-        pthread_mutex_unlock(threadPool->mutexInput);
-
-        pthread_cond_broadcast(threadPool->condInput);
-
-        // run function
-        //
-        outputQueueNode->output = threadPool->function(input);
-
-        delete input;
-
-        // signal output
-        //
-        outputQueueNode->ready = true;
-        //
-        pthread_mutex_lock(threadPool->mutexOutput);
-        pthread_cond_broadcast(threadPool->condOutput);
-        pthread_mutex_unlock(threadPool->mutexOutput);
+        inputReady.wait(ticket);
       }
-
-      return NULL;
     }
 };
 
@@ -10,7 +10,14 @@
 #include <tuple>
 #include <vector>
 #include <chrono>
+#include <cstdlib>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <memory>
 #include "common/progress.hpp"
+#include "common/shared_sequences.hpp"
+#include "map/include/radixSort.hpp"
 
 namespace skch
 {
@@ -74,6 +81,107 @@ namespace skch
     }
   };
 
+  //Compact MinmerInfo stored in the index when positions fit in 32 bits (24 instead of 32 bytes)
+  struct PackedMinmerInfo
+  {
+    hash_t hash;
+    uint32_t wpos;
+    uint32_t wpos_end;
+    uint32_t seqStrand;                       //seqId << 2 | (strand + 1)
+
+    static constexpr seqno_t maxSeqId = (1 << 30) - 1;
+
+    static bool fits(const MinmerInfo& m) {
+      return m.wpos >= 0 && m.wpos_end >= 0
+        && m.wpos <= std::numeric_limits<uint32_t>::max()
+        && m.wpos_end <= std::numeric_limits<uint32_t>::max()
+        && m.seqId >= 0 && m.seqId <= maxSeqId;
+    }
+
+    static PackedMinmerInfo pack(const MinmerInfo& m) {
+      return PackedMinmerInfo{m.hash, uint32_t(m.wpos), uint32_t(m.wpos_end),
+        (uint32_t(m.seqId) << 2) | uint32_t(m.strand + 1)};
+    }
+
+    MinmerInfo unpack(hash_t = 0) const {
+      return MinmerInfo{hash, offset_t(wpos), offset_t(wpos_end),
+        seqno_t(seqStrand >> 2), strand_t(int(seqStrand & 3) - 1)};
+    }
+  };
+
+  //Compact IntervalPoint stored in the index when positions fit in 32 bits (8 instead of 24 bytes);
+  //the hash is implied by the seed list holding the point
+  struct PackedIntervalPoint
+  {
+    uint32_t pos;
+    uint32_t seqSide;                         //seqId << 1 | (side == OPEN)
+
+    static constexpr seqno_t maxSeqId = std::numeric_limits<int32_t>::max();
+
+    static bool fits(const IntervalPoint& ip) {
+      return ip.pos >= 0 && ip.pos <= std::numeric_limits<uint32_t>::max() && ip.seqId >= 0;
+    }
+
+    static PackedIntervalPoint pack(const IntervalPoint& ip) {
+      return PackedIntervalPoint{uint32_t(ip.pos), (uint32_t(ip.seqId) << 1) | uint32_t(ip.side > 0)};
+    }
+
+    IntervalPoint unpack(hash_t hash) const {
+      return IntervalPoint{offset_t(pos), hash, seqno_t(seqSide >> 1), side_t((seqSide & 1) ? 1 : -1)};
+    }
+  };
+
+  /**
+   * @brief   random-access iterator over an index array held either in the wide or the
+   *          packed encoding, yielding wide records by value
+   * @details packed interval points are expanded with the hash of the seed list they belong to
+   */
+  template <class Wide, class Packed>
+  class IndexIterator
+  {
+    const Wide* wide = nullptr;
+    const Packed* packed = nullptr;
+    std::ptrdiff_t i = 0;
+    hash_t hash = 0;
+
+    public:
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = Wide;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const Wide*;
+    using reference = Wide;
+
+    struct ArrowProxy {
+      Wide value;
+      const Wide* operator->() const { return &value; }
+    };
+
+    IndexIterator() = default;
+    IndexIterator(const Wide* w, std::ptrdiff_t i) : wide(w), i(i) {}
+    IndexIterator(const Packed* p, std::ptrdiff_t i, hash_t h = 0) : packed(p), i(i), hash(h) {}
+
+    Wide operator*() const { return packed ? packed[i].unpack(hash) : wide[i]; }
+    Wide operator[](difference_type n) const { return *(*this + n); }
+    ArrowProxy operator->() const { return ArrowProxy{**this}; }
+
+    IndexIterator& operator++() { ++i; return *this; }
+    IndexIterator operator++(int) { IndexIterator t = *this; ++i; return t; }
+    IndexIterator& operator--() { --i; return *this; }
+    IndexIterator operator--(int) { IndexIterator t = *this; --i; return t; }
+    IndexIterator& operator+=(difference_type n) { i += n; return *this; }
+    IndexIterator& operator-=(difference_type n) { i -= n; return *this; }
+    IndexIterator operator+(difference_type n) const { IndexIterator t = *this; t.i += n; return t; }
+    IndexIterator operator-(difference_type n) const { IndexIterator t = *this; t.i -= n; return t; }
+    difference_type operator-(const IndexIterator& o) const { return i - o.i; }
+
+    bool operator==(const IndexIterator& o) const { return i == o.i; }
+    bool operator!=(const IndexIterator& o) const { return i != o.i; }
+    bool operator<(const IndexIterator& o) const { return i < o.i; }
+    bool operator>(const IndexIterator& o) const { return i > o.i; }
+    bool operator<=(const IndexIterator& o) const { return i <= o.i; }
+    bool operator>=(const IndexIterator& o) const { return i >= o.i; }
+  };
+
   template <class It>
   struct boundPtr {
     It it;
@@ -118,6 +226,21 @@ namespace skch
     NONE = 3                              //no filtering
   };
 
+  //k-mer hashing scheme used for sketching, recorded in the index
+  enum kmer_hash : int
+  {
+    MURMUR3 = 1,                          //MurmurHash3 over the k-mer bytes (legacy indexes)
+    ROLLING_2BIT = 2                      //invertible mix of rolling 2-bit packed k-mers
+  };
+
+  //order the queries are read and mapped in against a target subset
+  enum query_order : int
+  {
+    INPUT = 0,                            //that of the query FASTA
+    NAME = 1,                             //by the name after the last prefix delimiter, e.g. the chromosome
+    MAPPED = 2                            //by where each mapped best against the earlier subsets
+  };
+
   // Enum for tracking which side of an interval a point represents
   enum side : side_t
   {
@@ -164,12 +287,13 @@ namespace skch
     float nucIdentityUpperBound;                        //upper bound on identity (90% C.I.)
     int sketchSize;                                     //sketch size
     int conservedSketches;                              //count of conserved sketches
+    int opposingStrandVotes{0};                         //most shared sketch elements of a fragment voting for the other strand
     strand_t strand;                                    //strand
     int approxMatches;                                  //the approximate number of matches in the alignment
 
                                                         //--for split read mapping
 
-    long double kmerComplexity;                               // Estimated sequence complexity
+    float kmerComplexity;                               // Estimated sequence complexity
     int n_merged;                                       // how many mappings we've merged into this one
     offset_t splitMappingId;                            // To identify split mappings that are chained
     uint8_t discard;                                    // set to 1 for deletion
@@ -177,7 +301,7 @@ namespace skch
     bool selfMapFilter;                                 // set to true if a long-to-short mapping in all-vs-all mode (we report short as the query)
     double chainPairScore;                              // best score for potential chain pair
     int64_t chainPairId;                                // best partner mapping for potential chain pair
-    int32_t chain_id{-1};                               //unique ID for this chain (-1 if not part of chain)
+    int32_t chain_id{-1};                               //L2 chain of the mapping, numbered by its query fragment (-1 if not part of chain)
     int32_t chain_length{1};                            //total segments in chain (1 if not part of chain)
     int32_t chain_pos{1};                               //position in chain, 1-based (1 if not part of chain)
 
@@ -208,32 +332,73 @@ namespace skch
       return res;
     }
 
+    //well mixed 64-bit hash of the mapping's coordinates, uniform enough that thresholding
+    //it keeps the intended fraction of mappings
+    uint64_t coordinateHash() const {
+      auto mix = [](uint64_t x) {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+      };
+      uint64_t h = mix(uint64_t(uint32_t(refSeqId)) << 32 | uint32_t(querySeqId));
+      h = mix(h ^ uint64_t(refStartPos));
+      h = mix(h ^ uint64_t(refEndPos));
+      h = mix(h ^ uint64_t(queryStartPos));
+      h = mix(h ^ uint64_t(queryEndPos));
+      return mix(h ^ uint64_t(uint16_t(strand)));
+    }
+
   };
 
   typedef std::vector<MappingResult> MappingResultsVector_t;
 
+  /**
+   * @brief   sort mappings by a small key, a tuple of a few of their integer fields
+   * @details std::sort on the mappings themselves moves the whole wide struct at every
+   *          step. Here the keys, with the index of their mapping, are radix sorted and
+   *          the mappings moved once into place. As with std::sort, mappings with equal
+   *          keys may end up in any order.
+   */
+  template <typename KeyFn>
+  inline void sortMappingsByKey(MappingResultsVector_t& mappings, KeyFn key, int threads = 1)
+  {
+    radix::sortByKey(mappings, key, threads);
+  }
+
   //Vector type for storing MinmerInfo
   typedef std::vector<MinmerInfo> MinVec_Type;
 
-  //Container to save copy of kseq object
+  //Sequence bytes in a malloc'd buffer (as fetched by htslib), released with free()
+  typedef std::unique_ptr<char[], decltype(&std::free)> SeqBuffer;
+
+  //Container owning a sequence handed over by the reader
   struct InputSeqContainer
   {
     seqno_t seqId;                              //sequence id
     offset_t len;                               //sequence length
-    std::string seq;                            //sequence string
+    SeqBuffer seq;                              //sequence bytes
+    std::unique_ptr<shared_sequences::Packed> packed;       //with pack_queries, the sequence while queued, seq then empty
     std::string name;                        //sequence name
+    std::vector<std::vector<MinmerInfo>> fragmentSketches;  //fragment sketches replayed from a query sketch cache, seq is then empty
+    offset_t regionStart = 0;                   //start of seq in the query, when only a region of it is mapped
+    offset_t fullLen = 0;                       //length of the whole query in that case, else 0
+    uint64_t ordinal = 0;                       //position of the query in the order it was read
+    uint64_t budgetBytes = 0;                   //bytes held of the queue budget while queued and mapped
 
 
     /*
      * @brief               constructor
-     * @param[in] kseq_seq  complete read or reference sequence
-     * @param[in] kseq_id   sequence id name
+     * @param[in] s         complete read or reference sequence, ownership is taken
      * @param[in] len       length of sequence
+     * @param[in] name      sequence id name
+     * @param[in] id        sequence id
      */
-      InputSeqContainer(const std::string& s, const std::string& name, seqno_t id)
+      InputSeqContainer(SeqBuffer&& s, offset_t len, const std::string& name, seqno_t id)
           : seqId(id)
-          , len(s.length())
-          , seq(s)
+          , len(len)
+          , seq(std::move(s))
           , name(name) { }
   };
 
@@ -245,12 +410,13 @@ namespace skch
 
     /*
      * @brief               constructor
-     * @param[in] kseq_seq  complete read or reference sequence
-     * @param[in] kseq_id   sequence id name
+     * @param[in] s         complete read or reference sequence, ownership is taken
      * @param[in] len       length of sequence
+     * @param[in] name      sequence id name
+     * @param[in] id        sequence id
      */
-      InputSeqProgContainer(const std::string& s, const std::string& name, seqno_t id, progress_meter::ProgressMeter& pm)
-          : InputSeqContainer(s, name, id)
+      InputSeqProgContainer(SeqBuffer&& s, offset_t len, const std::string& name, seqno_t id, progress_meter::ProgressMeter& pm)
+          : InputSeqContainer(std::move(s), len, name, id)
           , progress(pm) { }
   };
 
@@ -269,6 +435,14 @@ namespace skch
     }
   };
 
+  //Range [start, end) of positions on a reference sequence
+  struct ReferenceRange
+  {
+    seqno_t seqId;
+    offset_t start;
+    offset_t end;
+  };
+
   //Information about fragment sequence during L1/L2 mapping
   template <typename MinmerVec>
     struct QueryMetaData
@@ -280,9 +454,12 @@ namespace skch
       int sketchSize;                     //sketch size
       std::string seqName;                //sequence name
       MinmerVec minmerTableQuery;         //Vector of minmers in the query
+      bool presketched = false;           //minmerTableQuery was filled before mapping
+      int skippedSeeds = 0;               //minmers left out of L1 for hitting too many reference windows
       MinmerVec seedHits;                 //Vector of minmers in the reference
       int refGroup;                       //Prefix group of sequence
       float kmerComplexity;                //Estimated sequence complexity
+      std::vector<ReferenceRange> guideRegions;  //Sorted, disjoint ranges the seeds are looked up in, all if empty
     };
 }
 
@@ -0,0 +1,128 @@
+/**
+ * @file    binaryMappings.hpp
+ * @brief   Binary mapping file, the mappings as fixed records the aligner reads without
+ *          parsing text
+ * @details The file starts with bmapMagic and the name table of the sequence ids the records
+ *          use, each name as its uint32 length and bytes after the uint64 count of names.
+ *          Each record follows as its uint32 length and a BinaryMapping, in host byte order;
+ *          a reader keeps the fields it knows of a longer record and skips the rest.
+ */
+
+#ifndef BINARY_MAPPINGS_HPP
+#define BINARY_MAPPINGS_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace skch
+{
+  // The first byte cannot start a PAF line, so a reader tells the formats apart by peeking
+  static constexpr char bmapMagic[8] = {'\x89', 'W', 'F', 'M', 'A', 'P', '\x01', '\n'};
+
+  struct BinaryMapping
+  {
+    int64_t queryStartPos;              //mapping start on the query, 0-based
+    int64_t queryEndPos;                //mapping end on the query, exclusive
+    int64_t refStartPos;                //mapping start on the reference, 0-based
+    int64_t refEndPos;                  //mapping end on the reference, exclusive
+    uint64_t queryLen;                  //length of the query sequence
+    uint64_t refLen;                    //length of the reference sequence
+    uint32_t querySeqId;                //query sequence, by its position in the name table
+    uint32_t refSeqId;                  //reference sequence, by its position in the name table
+    float nucIdentity;                  //estimated identity, between 0 and 1
+    int32_t chainId;                    //chain of the mapping, -1 if not part of a chain
+    int32_t chainPos;                   //position in the chain, 1-based
+    int32_t chainLength;                //mappings in the chain
+    int8_t strand;                      //strnd::FWD or strnd::REV
+    uint8_t padding[1];
+    uint16_t opposingStrandVotes;       //shared sketch elements voting for the other strand, plus one; 0 in files written before it was kept
+    float nucIdentityUpperBound;        //upper bound on the identity, 0 in files written before it was kept
+  };
+
+  /**
+   * @brief   write the magic and the name table of count sequences, nameOf(i) the name of id i
+   */
+  template <typename NameOf>
+  inline void writeBinaryMappingHeader(std::ostream& out, uint64_t count, NameOf&& nameOf)
+  {
+    out.write(bmapMagic, sizeof(bmapMagic));
+    out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    for (uint64_t i = 0; i < count; ++i) {
+      const auto& name = nameOf(i);
+      const uint32_t length = name.size();
+      out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+      out.write(name.data(), length);
+    }
+  }
+
+  inline void writeBinaryMapping(std::ostream& out, const BinaryMapping& mapping)
+  {
+    const uint32_t length = sizeof(mapping);
+    out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+    out.write(reinterpret_cast<const char*>(&mapping), sizeof(mapping));
+  }
+
+  /**
+   * @return  whether in starts with a binary mapping file rather than PAF; nothing is consumed
+   */
+  inline bool isBinaryMappingStream(std::istream& in)
+  {
+    return in.peek() == std::char_traits<char>::to_int_type(bmapMagic[0]);
+  }
+
+  /**
+   * @brief   read the magic and the name table
+   * @return  false if in does not start with a well formed header
+   */
+  inline bool readBinaryMappingHeader(std::istream& in, std::vector<std::string>& names)
+  {
+    char magic[sizeof(bmapMagic)];
+    uint64_t count = 0;
+    if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, bmapMagic, sizeof(magic)) != 0
+        || !in.read(reinterpret_cast<char*>(&count), sizeof(count))) {
+      return false;
+    }
+    names.clear();
+    for (uint64_t i = 0; i < count; ++i) {
+      uint32_t length = 0;
+      if (!in.read(reinterpret_cast<char*>(&length), sizeof(length))) {
+        return false;
+      }
+      std::string name(length, '\0');
+      if (!in.read(&name[0], length)) {
+        return false;
+      }
+      names.push_back(std::move(name));
+    }
+    return true;
+  }
+
+  /**
+   * @brief   read the next record
+   * @return  false at the end of the records; a truncated record also sets in's badbit
+   */
+  inline bool readBinaryMapping(std::istream& in, BinaryMapping& mapping)
+  {
+    uint32_t length = 0;
+    in.read(reinterpret_cast<char*>(&length), sizeof(length));
+    if (in.gcount() == 0) {
+      return false;
+    }
+    mapping = BinaryMapping();
+    const uint32_t known = std::min<uint32_t>(length, sizeof(mapping));
+    if (in.gcount() != sizeof(length)
+        || !in.read(reinterpret_cast<char*>(&mapping), known)
+        || in.ignore(length - known).gcount() != length - known) {
+      in.setstate(std::ios::badbit);
+      return false;
+    }
+    return true;
+  }
+}
+
+#endif
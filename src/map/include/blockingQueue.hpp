@@ -0,0 +1,209 @@
+/**
+ * @file    blockingQueue.hpp
+ * @brief   Bounded queue whose producers and consumers sleep until they can proceed
+ */
+
+#ifndef BLOCKING_QUEUE_HPP
+#define BLOCKING_QUEUE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "map/include/stageProfile.hpp"
+
+namespace skch
+{
+  /**
+   * @brief   Event count, for threads that wait on more than one source of work
+   * @details A waiter takes a ticket, checks all its sources, and calls wait(ticket) if
+   *          they are empty; any notify() after the ticket was taken wakes it. notify()
+   *          only takes the lock when a thread is waiting.
+   */
+  class Wakeup
+  {
+    public:
+
+      uint64_t ticket() const
+      {
+        return epoch.load();
+      }
+
+      void wait(uint64_t ticket)
+      {
+        waiters++;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          cv.wait(lock, [&]() { return epoch.load() != ticket; });
+        }
+        waiters--;
+      }
+
+      void notify()
+      {
+        epoch++;
+        if (waiters.load() > 0) {
+          { std::lock_guard<std::mutex> lock(mutex); }
+          cv.notify_all();
+        }
+      }
+
+    private:
+
+      std::atomic<uint64_t> epoch{0};
+      std::atomic<int> waiters{0};
+      std::mutex mutex;
+      std::condition_variable cv;
+  };
+
+  /**
+   * @brief   Bounded multi-producer multi-consumer queue with blocking push and pop
+   * @details The producers close() it once they are done; pop() then drains what is left
+   *          and returns false. A Wakeup given at construction is notified of every push
+   *          and of the close, for consumers that also wait on other work. A named queue
+   *          adds the time its threads wait to the profile, when profiling.
+   */
+  template <typename T>
+  class BlockingQueue
+  {
+    public:
+
+      explicit BlockingQueue(size_t capacity = 1024, Wakeup* consumers = nullptr, const std::string& name = std::string())
+        : capacity(capacity), consumers(consumers), waits(name.empty() ? nullptr : profile::queueWaits(name)) {}
+
+      void push(T item)
+      {
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          if (waits && items.size() >= capacity) {
+            const uint64_t start = profile::ticks();
+            notFull.wait(lock, [&]() { return items.size() < capacity; });
+            waits->pushWaits++;
+            waits->pushTicks += profile::ticks() - start;
+          } else {
+            notFull.wait(lock, [&]() { return items.size() < capacity; });
+          }
+          items.push_back(std::move(item));
+        }
+        notEmpty.notify_one();
+        if (consumers)
+          consumers->notify();
+      }
+
+      /**
+       * @brief   wait for an item
+       * @return  false once the queue is closed and empty
+       */
+      bool pop(T& item)
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (waits && items.empty() && !closed) {
+          const uint64_t start = profile::ticks();
+          notEmpty.wait(lock, [&]() { return !items.empty() || closed; });
+          waits->popWaits++;
+          waits->popTicks += profile::ticks() - start;
+        } else {
+          notEmpty.wait(lock, [&]() { return !items.empty() || closed; });
+        }
+        if (items.empty())
+          return false;
+        take(item, lock);
+        return true;
+      }
+
+      /**
+       * @return  false if the queue is empty right now
+       */
+      bool try_pop(T& item)
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (items.empty())
+          return false;
+        take(item, lock);
+        return true;
+      }
+
+      /**
+       * @brief   take up to max items at once, but no more than a 1/share of those queued,
+       *          so consumers sharing a short queue still get one each
+       * @return  false if the queue is empty right now
+       */
+      bool try_pop_some(std::vector<T>& out, size_t max, size_t share = 1)
+      {
+        out.clear();
+        std::unique_lock<std::mutex> lock(mutex);
+        if (items.empty())
+          return false;
+        const size_t count = std::min(max, (items.size() + share - 1) / share);
+        for (size_t i = 0; i < count; ++i) {
+          out.push_back(std::move(items.front()));
+          items.pop_front();
+        }
+        lock.unlock();
+        notFull.notify_all();
+        return true;
+      }
+
+      void close()
+      {
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          closed = true;
+        }
+        notEmpty.notify_all();
+        if (consumers)
+          consumers->notify();
+      }
+
+      /**
+       * @brief   make a closed and drained queue usable for another round of producers
+       */
+      void reopen()
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = false;
+      }
+
+      /**
+       * @return  items queued right now, for producers that adapt to how far behind the
+       *          consumers are
+       */
+      size_t size()
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        return items.size();
+      }
+
+      bool drained()
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        return closed && items.empty();
+      }
+
+    private:
+
+      void take(T& item, std::unique_lock<std::mutex>& lock)
+      {
+        item = std::move(items.front());
+        items.pop_front();
+        lock.unlock();
+        notFull.notify_one();
+      }
+
+      const size_t capacity;
+      Wakeup* consumers;
+      profile::QueueWaits* waits;         //null unless named and profiling
+      std::mutex mutex;
+      std::condition_variable notFull;
+      std::condition_variable notEmpty;
+      std::deque<T> items;
+      bool closed = false;
+  };
+}
+
+#endif
@@ -8,6 +8,7 @@
 
 #include <vector>
 #include <map>
+#include <array>
 #include <algorithm>
 #include <deque>
 #include <cmath>
@@ -19,6 +20,7 @@
 
 //Own includes
 #include "map/include/map_parameters.hpp"
+#include "common/dna_kernels.hpp"
 
 //External includes
 #include "common/murmur3.h"
@@ -48,46 +50,8 @@ namespace skch {
          * @note    assumes dest is pre-allocated
          */
         inline void reverseComplement(const char *src, char *dest, int length) {
-            for (int i = 0; i < length; i++) {
-                char base = src[i];
-
-                switch (base) {
-                    case 'A':
-                        base = 'T';
-                        break;
-                    case 'C':
-                        base = 'G';
-                        break;
-                    case 'G':
-                        base = 'C';
-                        break;
-                    case 'T':
-                        base = 'A';
-                        break;
-                    default:
-                        break;
-                }
-
-                dest[length - i - 1] = base;
-            }
+            dna_kernels::reverse_complement(src, dest, length);
         }
-        // Crazy hack char table to test for canonical bases
-    constexpr int valid_dna[127] = {
-        1,
-        1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 0, 1, 0, 1, 1, 1,
-        0, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 0, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 0, 1, 0, 1,
-        1, 1, 0, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 0, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1
-    };
 
     /**
      * @brief               convert DNA or AA alphabets to upper case, converting non-canonical DNA bases to N
@@ -95,17 +59,53 @@ namespace skch {
      * @param[in]   len     length of input sequence
      */
         inline void makeUpperCaseAndValidDNA(char *seq, offset_t len) {
-            for (int i = 0; i < len; i++) {
-                if (seq[i] > 96 && seq[i] < 123) {
-                    seq[i] -= 32;
-                }
+            dna_kernels::make_upper_valid_dna(seq, len);
+        }
 
-                if (valid_dna[seq[i]]) {
-                    seq[i] = 'N';
-                }
+        /**
+         * @brief   5-bit codes for the 20 standard amino acids (either case), 31 for everything else
+         */
+        constexpr std::array<uint8_t, 256> makeAa5BitTable() {
+            std::array<uint8_t, 256> t{};
+            for (auto& c : t) c = 31;
+            const char residues[] = "ACDEFGHIKLMNPQRSTVWY";
+            for (int i = 0; i < 20; ++i) {
+                t[static_cast<uint8_t>(residues[i])] = i;
+                t[static_cast<uint8_t>(residues[i] - 'A' + 'a')] = i;
+            }
+            return t;
+        }
+        constexpr std::array<uint8_t, 256> aa5bit = makeAa5BitTable();
+
+        /**
+         * @brief               convert amino acids to upper case, converting non-standard residues to X
+         * @param[in]   seq     pointer to input sequence
+         * @param[in]   len     length of input sequence
+         */
+        inline void makeUpperCaseAndValidProtein(char *seq, offset_t len) {
+            for (offset_t i = 0; i < len; ++i) {
+                const uint8_t code = aa5bit[static_cast<uint8_t>(seq[i])];
+                seq[i] = code == 31 ? 'X' : "ACDEFGHIKLMNPQRSTVWY"[code];
             }
         }
 
+        /**
+         * @brief   ambiguous residue of the alphabet, k-mers containing it are never sketched
+         */
+        inline char ambiguousResidue(int alphabetSize) {
+            return alphabetSize == 4 ? 'N' : 'X';
+        }
+
+        /**
+         * @brief   upper-case and validate seq for the alphabet (DNA if alphabetSize == 4, else protein)
+         */
+        inline void makeUpperCaseAndValid(char *seq, offset_t len, int alphabetSize) {
+            if (alphabetSize == 4)
+                makeUpperCaseAndValidDNA(seq, len);
+            else
+                makeUpperCaseAndValidProtein(seq, len);
+        }
+
 //        /**
 //       * @brief               convert DNA or AA alphabets to upper case
 //       * @param[in]   seq     pointer to input sequence
@@ -146,6 +146,419 @@ namespace skch {
             return hash;
         }
 
+        /**
+         * @brief   2-bit codes for canonical bases, 4 for everything else
+         */
+        constexpr std::array<uint8_t, 256> makeNt2BitTable() {
+            std::array<uint8_t, 256> t{};
+            for (auto& c : t) c = 4;
+            t['A'] = 0; t['C'] = 1; t['G'] = 2; t['T'] = 3;
+            t['a'] = 0; t['c'] = 1; t['g'] = 2; t['t'] = 3;
+            return t;
+        }
+        constexpr std::array<uint8_t, 256> nt2bit = makeNt2BitTable();
+
+        /**
+         * @brief   invertible 64-bit mix (MurmurHash3 finalizer) of a packed k-mer
+         * @details bijective on 64-bit words, so distinct k-mers with k <= 32 never collide,
+         *          and hash values stay uniform over the full hash_t range
+         */
+        inline hash_t mixPackedKmer(uint64_t x) {
+            x += 0x9e3779b97f4a7c15ULL;     // keep poly-A away from hash 0
+            x ^= x >> 33;
+            x *= 0xff51afd7ed558ccdULL;
+            x ^= x >> 33;
+            x *= 0xc4ceb9fe1a85ec53ULL;
+            x ^= x >> 33;
+            return x;
+        }
+
+        /**
+         * @brief   canonical k-mer hasher over a rolling 2-bit packed window
+         * @details both strands are updated with O(1) work per base, so no reverse
+         *          complement copy of the sequence is needed. Non-ACGT bases are packed
+         *          as A; callers skip k-mers overlapping an N as they do for MurmurHash3.
+         *          K > 0 fixes the k-mer size at compile time, K = 0 takes it at runtime.
+         */
+        template <int K = 0>
+        class RollingKmerHash {
+            static_assert(K >= 0 && K <= 32, "packed k-mers hold at most 32 bases");
+
+            static constexpr uint64_t maskFor(int k) { return k >= 32 ? ~0ULL : (1ULL << (2 * k)) - 1; }
+
+            uint64_t fwd = 0;
+            uint64_t rev = 0;
+            const uint64_t runtimeMask;
+            const int runtimeShift;
+
+            inline uint64_t mask() const { if constexpr (K > 0) return maskFor(K); else return runtimeMask; }
+            inline int shift() const { if constexpr (K > 0) return 2 * (K - 1); else return runtimeShift; }
+
+          public:
+            explicit RollingKmerHash(int kmerSize = K)
+                : runtimeMask(maskFor(kmerSize))
+                , runtimeShift(2 * (kmerSize - 1)) { }
+
+            inline void push(char base) {
+                const uint64_t c = nt2bit[static_cast<uint8_t>(base)] & 3;
+                fwd = ((fwd << 2) | c) & mask();
+                rev = (rev >> 2) | ((3 ^ c) << shift());
+            }
+
+            inline hash_t hashFwd() const { return mixPackedKmer(fwd); }
+            inline hash_t hashBwd() const { return mixPackedKmer(rev); }
+
+            inline uint64_t packedFwd() const { return fwd; }
+            inline uint64_t packedBwd() const { return rev; }
+        };
+
+        /**
+         * @brief   peptide hasher over a rolling 5-bit packed window of at most 12 residues
+         * @details proteins have a single strand, so only the forward word is kept.
+         *          Non-standard residues are packed as code 31; callers skip k-mers
+         *          overlapping an X.
+         */
+        class RollingPeptideHash {
+            uint64_t fwd = 0;
+            const uint64_t mask;
+
+          public:
+            static constexpr int maxKmerSize = 12;
+
+            explicit RollingPeptideHash(int kmerSize)
+                : mask((1ULL << (5 * std::min(kmerSize, maxKmerSize))) - 1) { }
+
+            inline void push(char residue) {
+                fwd = ((fwd << 5) | aa5bit[static_cast<uint8_t>(residue)]) & mask;
+            }
+
+            inline hash_t hash() const { return mixPackedKmer(fwd); }
+        };
+
+        /**
+         * @brief   true if the rolling 2-bit hasher can be used for these parameters
+         */
+        inline bool useRollingHash(int hashEngine, int kmerSize, int alphabetSize) {
+            return hashEngine == kmer_hash::ROLLING_2BIT && alphabetSize == 4 && kmerSize <= 32;
+        }
+
+        /**
+         * @brief   call f with std::integral_constant<int, K> for the k-mer sizes that get
+         *          their own sketching kernels (K = kmerSize), K = 0 for all others
+         */
+        template <typename F>
+        inline void dispatchKmerSize(int kmerSize, F&& f) {
+            switch (kmerSize) {
+                case 15: f(std::integral_constant<int, 15>{}); break;
+                case 17: f(std::integral_constant<int, 17>{}); break;
+                case 19: f(std::integral_constant<int, 19>{}); break;
+                case 21: f(std::integral_constant<int, 21>{}); break;
+                default: f(std::integral_constant<int, 0>{}); break;
+            }
+        }
+
+        /**
+         * @brief   a set of spaced seeds, all hashed in one pass over a rolling 2-bit window
+         * @details seeds are left-aligned in a window of span() <= 32 bases, packed by
+         *          RollingKmerHash. A seed masks its prefix of the window on the forward
+         *          strand and the same mask is applied to the reverse complement, so hashes
+         *          stay canonical. Masked words are salted per seed so seeds never share
+         *          hash values. Each position yields the smallest canonical hash over all
+         *          seeds, so minimizer selection costs the same as for plain k-mers; the
+         *          per-seed loop works on flat arrays without branches and is vectorized
+         *          across seeds by the compiler.
+         */
+        class SpacedSeeds {
+          public:
+            static constexpr int maxSeeds = 16;
+            static constexpr int maxSpan = 32;
+
+          private:
+            alignas(64) uint64_t mask[maxSeeds] = {};
+            alignas(64) uint64_t shift[maxSeeds] = {};
+            alignas(64) uint64_t salt[maxSeeds] = {};
+            int seedCount = 0;
+            int windowSpan = 0;
+
+          public:
+            /**
+             * @param[in]   seeds   seeds as strings of '1' (used) and '0' (ignored) positions
+             */
+            explicit SpacedSeeds(const std::vector<ales::spaced_seed>& seeds) {
+                seedCount = std::min<int>(seeds.size(), maxSeeds);
+                for (int s = 0; s < seedCount; ++s)
+                    windowSpan = std::max<int>(windowSpan, seeds[s].length);
+
+                for (int s = 0; s < seedCount; ++s) {
+                    const int len = seeds[s].length;
+                    for (int j = 0; j < len; ++j) {
+                        if (seeds[s].seed[j] == '1')
+                            mask[s] |= 3ULL << (2 * (len - 1 - j));
+                    }
+                    shift[s] = 2 * (windowSpan - len);
+                    salt[s] = 0x9e3779b97f4a7c15ULL * (s + 1);
+                }
+            }
+
+            // Seed count and window span supported by the packed kernel
+            static bool supported(int count, int span) {
+                return count > 0 && count <= maxSeeds && span <= maxSpan;
+            }
+
+            inline int count() const { return seedCount; }
+            inline int span() const { return windowSpan; }
+
+            /**
+             * @brief   hash every seed at the current window, keep the smallest
+             * @param[in]   window      rolling packed window of span() bases
+             * @param[out]  hashFwd     forward strand hash of the selected seed
+             * @param[out]  hashBwd     reverse strand hash of the selected seed
+             */
+            template <int K>
+            inline void hash(const RollingKmerHash<K>& window, hash_t& hashFwd, hash_t& hashBwd) const {
+                const uint64_t fwd = window.packedFwd();
+                const uint64_t rev = window.packedBwd();
+                alignas(64) hash_t seedFwd[maxSeeds];
+                alignas(64) hash_t seedBwd[maxSeeds];
+                alignas(64) hash_t seedMin[maxSeeds];
+                for (int s = 0; s < seedCount; ++s) {
+                    seedFwd[s] = mixPackedKmer(((fwd >> shift[s]) & mask[s]) ^ salt[s]);
+                    seedBwd[s] = mixPackedKmer((rev & mask[s]) ^ salt[s]);
+                    // Strand-symmetric seed hits carry no strand and are never selected
+                    seedMin[s] = seedFwd[s] == seedBwd[s]
+                        ? std::numeric_limits<hash_t>::max()
+                        : std::min(seedFwd[s], seedBwd[s]);
+                }
+
+                int best = 0;
+                for (int s = 1; s < seedCount; ++s) {
+                    if (seedMin[s] < seedMin[best]) best = s;
+                }
+                hashFwd = seedFwd[best];
+                hashBwd = seedBwd[best];
+            }
+        };
+
+        /**
+         * @brief   closed syncmer selection of the k-mers sketched
+         * @details a k-mer is a closed syncmer when the smallest of its s-mers, by canonical
+         *          hash, starts or ends it. That depends on the k-mer alone, not on its
+         *          neighbours, so a k-mer two sequences share is selected in both or in
+         *          neither, and its reverse complement with it; about 2 in k - s + 1 k-mers are
+         *          selected. The sketches are then taken over the selected k-mers only.
+         */
+        class Syncmers {
+          public:
+            static constexpr int maxSize = 31;
+
+          private:
+            int smerSize;
+
+          public:
+            explicit Syncmers(int size) : smerSize(size) {}
+
+            inline int size() const { return smerSize; }
+
+            /**
+             * @brief   flag the k-mers of an upper-cased DNA sequence that are syncmers
+             * @return  a flag per k-mer position, len - kmerSize + 1 of them
+             */
+            std::vector<uint8_t> select(const char* seq, offset_t len, int kmerSize) const {
+                const offset_t kmers = len - kmerSize + 1;
+                std::vector<uint8_t> selected(std::max<offset_t>(kmers, 0), 0);
+                if (kmers <= 0)
+                    return selected;
+
+                const offset_t smers = len - smerSize + 1;
+                std::vector<hash_t> hashes(smers);
+                RollingKmerHash<0> roller(smerSize);
+                for (int j = 0; j < smerSize - 1; j++)
+                    roller.push(seq[j]);
+                for (offset_t i = 0; i < smers; i++) {
+                    roller.push(seq[i + smerSize - 1]);
+                    hashes[i] = std::min(roller.hashFwd(), roller.hashBwd());
+                }
+
+                // Sliding minimum over the s-mers of each k-mer, ending with s-mer i
+                const offset_t last = kmerSize - smerSize;
+                std::vector<offset_t> window(smers);
+                size_t head = 0;
+                size_t tail = 0;
+                for (offset_t i = 0; i < smers; i++) {
+                    while (tail > head && hashes[window[tail - 1]] >= hashes[i])
+                        tail--;
+                    window[tail++] = i;
+                    const offset_t first = i - last;
+                    if (first < 0)
+                        continue;
+                    while (window[head] < first)
+                        head++;
+                    const hash_t smallest = hashes[window[head]];
+                    selected[first] = hashes[first] == smallest || hashes[i] == smallest;
+                }
+                return selected;
+            }
+        };
+
+        /**
+         * @brief   DUST low-complexity filter of the k-mers sketched
+         * @details A k-mer is low complexity when its triplets repeat: its DUST score, the
+         *          pairs of equal triplets over one less than their number, is over the
+         *          threshold. Homopolymers and tandem repeats of a short period score high,
+         *          random sequence about 0. The score of a k-mer depends on its own bases
+         *          alone, so slices and windows of a sequence mask just as the whole does.
+         */
+        class Dust {
+          public:
+            // Thousandths the index header keeps the threshold in
+            static constexpr uint64_t scale = 1000;
+
+          private:
+            uint64_t thousandths;
+
+          public:
+            explicit Dust(uint64_t thousandths) : thousandths(thousandths) {}
+
+            inline uint64_t threshold() const { return thousandths; }
+
+            /**
+             * @brief   triplet counts of the k-mers of one sequence as the sketching loop
+             *          slides over it, updated as each base enters and leaves
+             */
+            class Window {
+              private:
+                static constexpr uint8_t invalid = 64;
+
+                int span;
+                uint64_t maxPairs;                  //most pairs of equal triplets not masked
+                std::vector<uint8_t> triplets;      //by the position they end at, modulo their number
+                uint16_t counts[invalid + 1];
+                uint64_t pairs = 0;
+                offset_t next = 0;                  //position of the next base to enter
+                uint8_t code = 0;
+                int valid = 0;                      //bases since the last one not ACGT
+
+                void reset(offset_t pos) {
+                  std::fill(triplets.begin(), triplets.end(), invalid);
+                  std::fill(std::begin(counts), std::end(counts), 0);
+                  pairs = 0;
+                  next = pos;
+                  valid = 0;
+                }
+
+                void push(char c) {
+                  uint8_t base = 4;
+                  switch (c) {
+                    case 'A': base = 0; break;
+                    case 'C': base = 1; break;
+                    case 'G': base = 2; break;
+                    case 'T': base = 3; break;
+                    default: break;
+                  }
+                  valid = base < 4 ? valid + 1 : 0;
+                  code = ((code << 2) | (base & 3)) & 63;
+                  uint8_t& slot = triplets[next % triplets.size()];
+                  if (slot != invalid)
+                    pairs -= --counts[slot];
+                  slot = valid >= 3 ? code : invalid;
+                  if (slot != invalid)
+                    pairs += counts[slot]++;
+                  ++next;
+                }
+
+              public:
+                Window(const Dust& dust, int span)
+                  : span(span),
+                    maxPairs(dust.threshold() * std::max(1, span - 3) / scale),
+                    triplets(std::max(1, span - 2)) {
+                  reset(0);
+                }
+
+                /**
+                 * @brief   whether the k-mer of span bases at i of the upper-cased seq is low
+                 *          complexity; i must not decrease from one call to the next
+                 */
+                inline bool masked(const char* seq, offset_t i) {
+                  if (next < i)
+                    reset(i);
+                  for (const offset_t end = i + span; next < end; )
+                    push(seq[next]);
+                  return pairs > maxPairs;
+                }
+            };
+        };
+
+        /**
+         * @brief   log2(x) for x >= 1, at compile time: the exponent, then the mantissa in
+         *          [1, 2) by the atanh series of its natural log
+         */
+        constexpr double constexprLog2(double x) {
+            int exponent = 0;
+            while (x >= 2.0) { x /= 2.0; ++exponent; }
+            const double y = (x - 1.0) / (x + 1.0);
+            double term = y, ln = 0.0;
+            for (int n = 1; n < 40; n += 2) {
+                ln += term / n;
+                term *= y * y;
+            }
+            return exponent + 2.0 * ln / 0.69314718055994530942;
+        }
+
+        // Trinucleotides per window of the k-mer complexity estimate
+        constexpr int complexityWindow = 64;
+
+        /**
+         * @brief   entropy contributions c * log2(c) of the trinucleotide counts a window can
+         *          hold, 0 for c = 0
+         */
+        constexpr std::array<float, complexityWindow + 1> makeCountEntropyTable() {
+            std::array<float, complexityWindow + 1> t{};
+            for (int c = 2; c <= complexityWindow; ++c)
+                t[c] = float(c * constexprLog2(c));
+            return t;
+        }
+        constexpr std::array<float, complexityWindow + 1> countEntropy = makeCountEntropyTable();
+
+        /**
+         * @brief   k-mer complexity of a DNA sequence in [0, 1], in one pass over its 2-bit codes
+         * @details Shannon entropy of the trinucleotides of each window of 64, relative to its
+         *          most, log2 of their number; averaged over the windows, weighted by how many
+         *          trinucleotides they hold. Trinucleotides overlapping a non-ACGT base are
+         *          skipped. Homopolymers score 0, a period-4 repeat 1/3, random sequence about 0.86.
+         */
+        inline float kmerComplexity(const char* seq, offset_t len) {
+            uint8_t counts[complexityWindow] = {};
+            float entropy = 0, weight = 0;
+            int inWindow = 0;
+            // H = log2(n) - sum(c log2 c) / n, over at most log2(n), weighted by n
+            auto closeWindow = [&]() {
+                if (inWindow >= 2) {
+                    float sum = 0;
+                    for (int i = 0; i < complexityWindow; ++i)
+                        sum += countEntropy[counts[i]];
+                    const float maxEntropy = countEntropy[inWindow];    // n log2 n
+                    entropy += (maxEntropy - sum) / maxEntropy * inWindow;
+                    weight += inWindow;
+                }
+                std::fill(std::begin(counts), std::end(counts), 0);
+                inWindow = 0;
+            };
+            uint8_t code = 0;
+            int valid = 0;
+            for (offset_t i = 0; i < len; ++i) {
+                const uint8_t base = nt2bit[static_cast<uint8_t>(seq[i])];
+                valid = base < 4 ? valid + 1 : 0;
+                code = ((code << 2) | (base & 3)) & 63;
+                if (valid >= 3) {
+                    ++counts[code];
+                    if (++inWindow == complexityWindow)
+                        closeWindow();
+                }
+            }
+            closeWindow();
+            return weight > 0 ? entropy / weight : 0;
+        }
+
         /**
          * @brief		takes hash value of kmer and adjusts it based on kmer's weight
          *					this value will determine its order for minimizer selection
@@ -171,38 +584,37 @@ namespace skch {
 
 
         /**
-         * @brief       Compute the minimum s kmers for a string.
-         * @param[out]  minmerIndex     container storing sketched Kmers 
-         * @param[in]   seq                 pointer to input sequence
-         * @param[in]   len                 length of input sequence
-         * @param[in]   kmerSize
-         * @param[in]   s                   sketch size. 
-         * @param[in]   seqCounter          current sequence number, used while saving the position of minimizer
+         * @brief       Visit the canonical k-mers of an upper-cased DNA sequence, skipping
+         *              symmetric ones and those overlapping an N
+         * @details     K > 0 is the k-mer size fixed at compile time (rolling hash only),
+         *              K = 0 takes kmerSize at runtime
+         * @param[in]   rolling             hash with RollingKmerHash instead of MurmurHash3
+         * @param[in]   visit               called as visit(position, hash, strand) by position
          */
-        template <typename T>
-          inline void sketchSequence(
-              std::vector<T> &minmerIndex, 
-              char* seq, 
+        template <int K, typename Fn>
+          inline void forEachCanonicalKmer(
+              const char* seq, 
               offset_t len,
               int kmerSize, 
-              int alphabetSize,
-              int sketchSize,
-              seqno_t seqCounter)
+              bool rolling,
+              const SpacedSeeds* spacedSeeds,
+              Fn&& visit)
         {
-          makeUpperCaseAndValidDNA(seq, len);
-
-          //Compute reverse complement of seq
-          std::unique_ptr<char[]> seqRev(new char[len]);
-          //char* seqRev = new char[len];
-
-          if(alphabetSize == 4) //not protein
+          if constexpr (K > 0)
+            kmerSize = K;
+          RollingKmerHash<K> roller(kmerSize);
+
+          //Compute reverse complement of seq (only needed for MurmurHash3)
+          std::unique_ptr<char[]> seqRev;
+
+          if (rolling) {
+            for (int j = 0; j < kmerSize - 1 && j < len; j++)
+              roller.push(seq[j]);
+          } else {
+            seqRev.reset(new char[len]);
             CommonFunc::reverseComplement(seq, seqRev.get(), len);
+          }
 
-          // TODO cleanup
-          ankerl::unordered_dense::map<hash_t, MinmerInfo> sketched_vals;
-          std::vector<hash_t> sketched_heap;
-          sketched_heap.reserve(sketchSize+1);
-            
           // Get distance until last "N"
           int ambig_kmer_count = 0;
           for (int i = kmerSize - 1; i >= 0; i--)
@@ -222,92 +634,371 @@ namespace skch {
               ambig_kmer_count = kmerSize;
             }
             //Hash kmers
-            hash_t hashFwd = CommonFunc::getHash(seq + i, kmerSize); 
+            hash_t hashFwd;
             hash_t hashBwd;
 
-            if(alphabetSize == 4)
+            if (spacedSeeds)
+            {
+              roller.push(seq[i+kmerSize-1]);
+              spacedSeeds->hash(roller, hashFwd, hashBwd);
+            }
+            else if (rolling)
+            {
+              roller.push(seq[i+kmerSize-1]);
+              hashFwd = roller.hashFwd();
+              hashBwd = roller.hashBwd();
+            }
+            else
+            {
+              hashFwd = CommonFunc::getHash(seq + i, kmerSize);
               hashBwd = CommonFunc::getHash(seqRev.get() + len - i - kmerSize, kmerSize);
-            else  //proteins
-              hashBwd = std::numeric_limits<hash_t>::max();   //Pick a dummy high value so that it is ignored later
+            }
 
             //Consider non-symmetric kmers only
             if(hashBwd != hashFwd && ambig_kmer_count == 0)
             {
-              //Take minimum value of kmer and its reverse complement
-              hash_t currentKmer = std::min(hashFwd, hashBwd);
+              //Take minimum value of kmer and its reverse complement, and its strand
+              visit(i, std::min(hashFwd, hashBwd), hashFwd < hashBwd ? strnd::FWD : strnd::REV);
+            }
+            if (ambig_kmer_count > 0)
+            {
+              ambig_kmer_count--;
+            }
+          }
+        }
 
-              //Check the strand of this minimizer hash value
-              auto currentStrand = hashFwd < hashBwd ? strnd::FWD : strnd::REV;
+        /**
+         * @brief       Visit the k-mers of an upper-cased protein sequence not overlapping an X
+         * @details     single strand: every k-mer is FWD and no reverse hashes are computed.
+         *              Peptides of up to 12 residues are hashed from a rolling 5-bit window,
+         *              longer ones with MurmurHash3.
+         * @param[in]   visit               called as visit(position, hash, strand) by position
+         */
+        template <typename Fn>
+          inline void forEachPeptide(
+              const char* seq, 
+              offset_t len,
+              int kmerSize, 
+              Fn&& visit)
+        {
+          const bool rolling = kmerSize <= RollingPeptideHash::maxKmerSize;
+          RollingPeptideHash roller(kmerSize);
+          for (int j = 0; rolling && j < kmerSize - 1 && j < len; j++)
+            roller.push(seq[j]);
 
-              if (sketched_heap.size() < sketchSize || currentKmer <= sketched_heap.front())
-              {
-                if (sketched_heap.empty() || sketched_vals.find(currentKmer) == sketched_vals.end()) 
-                {
+          // Get distance until last "X"
+          int ambig_kmer_count = 0;
+          for (int i = std::min<offset_t>(kmerSize, len) - 1; i >= 0; i--)
+          {
+            if (seq[i] == 'X')
+            {
+              ambig_kmer_count = i+1;
+              break;
+            }
+          }
 
-                  // Add current hash to heap
-                  if (sketched_vals.size() < sketchSize || currentKmer < sketched_heap.front())  
-                  {
-                      sketched_vals[currentKmer] = MinmerInfo{currentKmer, i, i, seqCounter, currentStrand};
-                      sketched_heap.push_back(currentKmer);
-                      std::push_heap(sketched_heap.begin(), sketched_heap.end());
-                  }
+          for(offset_t i = 0; i < len - kmerSize + 1; i++)
+          {
+            if (seq[i+kmerSize-1] == 'X')
+            {
+              ambig_kmer_count = kmerSize;
+            }
 
-                  // Remove one if too large
-                  if (sketched_vals.size() > sketchSize) 
-                  {
-                      sketched_vals.erase(sketched_heap[0]);
-                      std::pop_heap(sketched_heap.begin(), sketched_heap.end());
-                      sketched_heap.pop_back();
-                  }
-                } 
-                else 
-                {
-                  // TODO these sketched values might never be useful, might save memory by deleting
-                  // extend the length of the window
-                  sketched_vals[currentKmer].wpos_end = i;
-                  sketched_vals[currentKmer].strand += currentStrand == strnd::FWD ? 1 : -1;
-                }
-              }
+            hash_t currentKmer;
+            if (rolling)
+            {
+              roller.push(seq[i+kmerSize-1]);
+              currentKmer = roller.hash();
+            }
+            else
+            {
+              currentKmer = CommonFunc::getHash(seq + i, kmerSize);
+            }
+
+            if (ambig_kmer_count == 0)
+            {
+              visit(i, currentKmer, strnd::FWD);
             }
             if (ambig_kmer_count > 0)
             {
               ambig_kmer_count--;
             }
           }
+        }
+
+        /**
+         * @brief       Visit the k-mers of an upper-cased, validated sequence that are sampled,
+         *              as visit(position, hash, strand) by position
+         * @param[in]   syncmers            if non-null, visit only the DNA k-mers it selects
+         * @param[in]   hashThreshold       visit only the k-mers hashing to at most this
+         * @param[in]   dust                if non-null, pass over the DNA k-mers it masks
+         * @return      span of the hashed k-mers or spaced seeds
+         */
+        template <typename Fn>
+          inline int forEachSampledKmer(
+              const char* seq, 
+              offset_t len,
+              int kmerSize, 
+              int alphabetSize,
+              int hashEngine,
+              const SpacedSeeds* spacedSeeds,
+              const Syncmers* syncmers,
+              hash_t hashThreshold,
+              Fn&& visit,
+              const Dust* dust = nullptr)
+        {
+          const bool dna = alphabetSize == 4;
+          const int span = dna && spacedSeeds ? spacedSeeds->span() : kmerSize;
+          const std::vector<uint8_t> selected = dna && syncmers ? syncmers->select(seq, len, span) : std::vector<uint8_t>();
+          std::unique_ptr<Dust::Window> lowComplexity(dna && dust ? new Dust::Window(*dust, span) : nullptr);
+          const auto sample = [&](offset_t i, hash_t hash, strand_t strand) {
+            if (hash <= hashThreshold && (selected.empty() || selected[i])
+                && !(lowComplexity && lowComplexity->masked(seq, i)))
+              visit(i, hash, strand);
+          };
+
+          if (!dna)
+          {
+            forEachPeptide(seq, len, kmerSize, sample);
+          }
+          // Spaced seeds are hashed from a rolling window spanning the longest seed
+          else if (spacedSeeds)
+          {
+            forEachCanonicalKmer<0>(seq, len, span, true, spacedSeeds, sample);
+          }
+          else if (useRollingHash(hashEngine, kmerSize, alphabetSize))
+          {
+            dispatchKmerSize(kmerSize, [&](auto k) {
+              forEachCanonicalKmer<decltype(k)::value>(seq, len, kmerSize, true, nullptr, sample);
+            });
+          }
+          else
+          {
+            forEachCanonicalKmer<0>(seq, len, kmerSize, false, nullptr, sample);
+          }
+          return span;
+        }
+
+        /**
+         * @brief       Upper-case and validate seq, then visit the k-mers sketchSequence
+         *              samples from it, as visit(position, hash, strand) by position
+         * @param[in]   syncmers            if non-null, visit only the DNA k-mers it selects
+         * @param[in]   hashThreshold       visit only the k-mers hashing to at most this
+         * @param[in]   dust                if non-null, pass over the DNA k-mers it masks
+         * @return      span of the hashed k-mers or spaced seeds
+         */
+        template <typename Fn>
+          inline int forEachSketchKmer(
+              char* seq, 
+              offset_t len,
+              int kmerSize, 
+              int alphabetSize,
+              int hashEngine,
+              const SpacedSeeds* spacedSeeds,
+              Fn&& visit,
+              const Syncmers* syncmers = nullptr,
+              hash_t hashThreshold = std::numeric_limits<hash_t>::max(),
+              const Dust* dust = nullptr)
+        {
+          makeUpperCaseAndValid(seq, len, alphabetSize);
+          return forEachSampledKmer(seq, len, kmerSize, alphabetSize, hashEngine, spacedSeeds, syncmers,
+                                    hashThreshold, visit, dust);
+        }
+
+        /**
+         * @brief       Hash threshold of world minimizers, sampling sketchSize of the k-mers
+         *              of a window of windowSize bases on average
+         * @details     DNA k-mers hash to the smaller hash of their two strands, twice as
+         *              likely to fall below a threshold
+         */
+        inline hash_t worldHashThreshold(int sketchSize, int windowSize, int kmerSize, int alphabetSize)
+        {
+          const long double density = (long double)sketchSize / std::max(1, windowSize - kmerSize + 1)
+                                      / (alphabetSize == 4 ? 2 : 1);
+          return density >= 1 ? std::numeric_limits<hash_t>::max()
+                              : hash_t(density * std::numeric_limits<hash_t>::max());
+        }
 
-          minmerIndex.resize(sketched_heap.size());
-          for (auto rev_it = minmerIndex.rbegin(); rev_it != minmerIndex.rend(); rev_it++)
+        /**
+         * @brief       Add a k-mer to a bottom-s sketch sorted by hash
+         * @details     At most sketchSize+1 entries live in the sketch, so lookups are a short
+         *              binary search and inserts a small memmove; no per-base map churn.
+         *              A k-mer already sketched extends its window to pos, and with
+         *              countStrand its strand becomes a vote settled by settleSketchStrands.
+         */
+        template <typename T>
+          inline void addToBottomSketch(
+              std::vector<T> &minmerIndex, 
+              int sketchSize,
+              hash_t currentKmer,
+              offset_t pos,
+              seqno_t seqCounter,
+              strand_t currentStrand,
+              bool countStrand)
+        {
+          if (minmerIndex.size() < sketchSize || currentKmer <= minmerIndex.back().hash)
           {
-            *rev_it = (std::move(sketched_vals[sketched_heap.front()]));
-            (*rev_it).strand = (*rev_it).strand > 0 ? strnd::FWD : ((*rev_it).strand == 0 ? strnd::AMBIG : strnd::REV);
+            auto it = std::lower_bound(minmerIndex.begin(), minmerIndex.end(), currentKmer,
+                [](const T& m, hash_t h) { return m.hash < h; });
+
+            if (it == minmerIndex.end() || it->hash != currentKmer)
+            {
+              minmerIndex.insert(it, MinmerInfo{currentKmer, pos, pos, seqCounter, currentStrand});
 
-            std::pop_heap(sketched_heap.begin(), sketched_heap.end());
-            sketched_heap.pop_back();
+              // Remove one if too large
+              if (minmerIndex.size() > sketchSize)
+                minmerIndex.pop_back();
+            }
+            else
+            {
+              // TODO these sketched values might never be useful, might save memory by deleting
+              // extend the length of the window
+              it->wpos_end = pos;
+              if (countStrand)
+                it->strand += currentStrand == strnd::FWD ? 1 : -1;
+            }
           }
-          return;
         }
-        
 
         /**
-         * @brief       Compute winnowed minmers from a given sequence and add to the index
-         * @param[out]  minmerIndex  table storing minmers and their position as we compute them
-         * @param[in]   seq             pointer to input sequence
-         * @param[in]   len             length of input sequence
+         * @brief       Turn the strand votes of a DNA sketch into FWD, REV or AMBIG
+         */
+        template <typename T>
+          inline void settleSketchStrands(std::vector<T> &minmerIndex)
+        {
+          for (auto& m : minmerIndex)
+          {
+            m.strand = m.strand > 0 ? strnd::FWD : (m.strand == 0 ? strnd::AMBIG : strnd::REV);
+          }
+        }
+
+        /**
+         * @brief       Compute the minimum s kmers for a string.
+         * @param[out]  minmerIndex     container storing sketched Kmers 
+         * @param[in]   seq                 pointer to input sequence
+         * @param[in]   len                 length of input sequence
          * @param[in]   kmerSize
-         * @param[in]   windowSize
-         * @param[in]   sketchSize      sketch size. 
-         * @param[in]   seqCounter      current sequence number, used while saving the position of minimizer
+         * @param[in]   s                   sketch size. 
+         * @param[in]   seqCounter          current sequence number, used while saving the position of minimizer
+         * @param[in]   hashEngine          k-mer hashing scheme (skch::kmer_hash)
+         * @param[in]   spacedSeeds         if non-null, hash these spaced seeds instead of k-mers
+         * @param[in]   syncmers            if non-null, sketch only the k-mers it selects
+         * @param[in]   hashThreshold       sketch only the k-mers hashing to at most this
+         * @param[in]   dust                if non-null, pass over the k-mers it masks
          */
         template <typename T>
-          inline void addMinmers(std::vector<T> &minmerIndex, 
-              char* seq, offset_t len,
+          inline void sketchSequence(
+              std::vector<T> &minmerIndex, 
+              char* seq, 
+              offset_t len,
+              int kmerSize, 
+              int alphabetSize,
+              int sketchSize,
+              seqno_t seqCounter,
+              int hashEngine,
+              const SpacedSeeds* spacedSeeds = nullptr,
+              const Syncmers* syncmers = nullptr,
+              hash_t hashThreshold = std::numeric_limits<hash_t>::max(),
+              const Dust* dust = nullptr)
+        {
+          // Bottom-s sketch kept directly in the output, sorted by hash
+          minmerIndex.clear();
+          minmerIndex.reserve(sketchSize + 1);
+          const bool dna = alphabetSize == 4;
+          forEachSketchKmer(seq, len, kmerSize, alphabetSize, hashEngine, spacedSeeds,
+              [&](offset_t i, hash_t hash, strand_t strand) {
+                addToBottomSketch(minmerIndex, sketchSize, hash, i, seqCounter, strand, dna);
+              }, syncmers, hashThreshold, dust);
+          if (dna)
+            settleSketchStrands(minmerIndex);
+        }
+
+        /**
+         * @brief       Sketch equal-length windows of one sequence in a single hashing pass,
+         *              each exactly as sketchSequence would sketch the window on its own
+         * @param[in]   windowStarts        offsets of the windows in seq, increasing
+         * @param[in]   windowLen           length of every window
+         * @param[in]   emit                called as emit(window, sketch) for each window in
+         *                                  order once its sketch is complete; may take the sketch
+         */
+        template <typename T, typename Fn>
+          inline void sketchSequenceWindows(
+              char* seq, 
+              offset_t len,
+              const std::vector<offset_t>& windowStarts,
+              offset_t windowLen,
               int kmerSize, 
+              int alphabetSize,
+              int sketchSize,
+              seqno_t seqCounter,
+              int hashEngine,
+              const SpacedSeeds* spacedSeeds,
+              Fn&& emit,
+              const Syncmers* syncmers = nullptr,
+              hash_t hashThreshold = std::numeric_limits<hash_t>::max(),
+              const Dust* dust = nullptr)
+        {
+          const bool dna = alphabetSize == 4;
+          const int span = dna && spacedSeeds ? spacedSeeds->span() : kmerSize;
+
+          // Windows [first, next) hold the k-mers seen so far
+          std::vector<std::vector<T>> sketches(windowStarts.size());
+          size_t first = 0;
+          size_t next = 0;
+          const auto advance = [&](offset_t pos) {
+            while (next < windowStarts.size() && windowStarts[next] <= pos)
+              sketches[next++].reserve(sketchSize + 1);
+            // A window is complete once pos is past its last k-mer
+            while (first < next && windowStarts[first] + windowLen - span < pos) {
+              if (dna)
+                settleSketchStrands(sketches[first]);
+              emit(first, sketches[first]);
+              std::vector<T>().swap(sketches[first++]);
+            }
+          };
+
+          forEachSketchKmer(seq, len, kmerSize, alphabetSize, hashEngine, spacedSeeds,
+              [&](offset_t i, hash_t hash, strand_t strand) {
+                advance(i);
+                for (size_t w = first; w < next; ++w)
+                  addToBottomSketch(sketches[w], sketchSize, hash, i - windowStarts[w], seqCounter, strand, dna);
+              }, syncmers, hashThreshold, dust);
+          advance(std::numeric_limits<offset_t>::max());
+        }
+        
+
+        /**
+         * @brief       Winnowing loop behind computeMinmerIntervals
+         * @details     K > 0 is the k-mer size fixed at compile time (rolling hash only),
+         *              K = 0 takes kmerSize at runtime
+         * @param[in]   rolling         hash with RollingKmerHash instead of MurmurHash3
+         */
+        template <int K, typename T>
+          inline void computeMinmerIntervalsKernel(std::vector<T> &minmerIndex,
+              const char* seq, offset_t len,
+              int kmerSize,
               int windowSize,
               int alphabetSize,
               int sketchSize,
               seqno_t seqCounter,
-              progress_meter::ProgressMeter* progress)
+              bool rolling,
+              progress_meter::ProgressMeter* progress,
+              offset_t windowOffset,
+              std::vector<T>* openMinmers,
+              const SpacedSeeds* spacedSeeds,
+              const Syncmers* syncmers,
+              const Dust* dust)
           {
+            const size_t firstRecord = minmerIndex.size();
+
+            if constexpr (K > 0)
+              kmerSize = K;
+
+            // Only the selected k-mers enter the windows, the others are hashed and passed over
+            const std::vector<uint8_t> selected = syncmers && alphabetSize == 4
+                ? syncmers->select(seq, len, kmerSize) : std::vector<uint8_t>();
+            std::unique_ptr<Dust::Window> lowComplexity(dust && alphabetSize == 4 ? new Dust::Window(*dust, kmerSize) : nullptr);
+
             /**
              * Double-ended queue (saves minimum at front end)
              * Saves pair of the minimizer and the position of hashed kmer in the sequence
@@ -323,17 +1014,35 @@ namespace skch {
             windowMap_t sortedWindow;
             std::vector<KmerInfo> heapWindow;
 
-            makeUpperCaseAndValidDNA(seq, len);
+            // Proteins have a single strand: no reverse hashes, every k-mer is FWD
+            const bool protein = alphabetSize != 4;
+            const bool peptideRolling = protein && kmerSize <= RollingPeptideHash::maxKmerSize;
+            const char ambiguous = ambiguousResidue(alphabetSize);
 
-            //Compute reverse complement of seq
-            std::unique_ptr<char[]> seqRev(new char[kmerSize]);
+            //Compute reverse complement of kmer (only needed for MurmurHash3 on DNA)
+            std::unique_ptr<char[]> seqRev;
+            if (!rolling && !protein)
+              seqRev.reset(new char[kmerSize]);
 
-            //if(alphabetSize == 4) //not protein
-              //CommonFunc::reverseComplement(seq, seqRev.get(), len);
-            
             // Get distance until last "N"
             int ambig_kmer_count = 0;
 
+            RollingKmerHash<K> roller(kmerSize);
+            RollingPeptideHash peptideRoller(kmerSize);
+
+            // A slice must see N's in its first k-1 bases, as the full sequence would
+            if (rolling || protein || windowOffset > 0)
+            {
+              for (int j = 0; j < kmerSize - 1 && j < len; j++)
+              {
+                if (rolling)
+                  roller.push(seq[j]);
+                else if (peptideRolling)
+                  peptideRoller.push(seq[j]);
+                if (seq[j] == ambiguous)
+                  ambig_kmer_count = j + 1;
+              }
+            }
 
             for(offset_t i = 0; i < len - kmerSize + 1; i++)
             {
@@ -356,23 +1065,44 @@ namespace skch {
               }
 
               //Hash kmers
-              hash_t hashFwd = CommonFunc::getHash(seq + i, kmerSize); 
+              hash_t hashFwd;
               hash_t hashBwd;
 
-              if(alphabetSize == 4) 
+              if (spacedSeeds)
+              {
+                roller.push(seq[i+kmerSize-1]);
+                spacedSeeds->hash(roller, hashFwd, hashBwd);
+              }
+              else if (rolling)
+              {
+                roller.push(seq[i+kmerSize-1]);
+                hashFwd = roller.hashFwd();
+                hashBwd = roller.hashBwd();
+              }
+              else if (protein)
               {
+                if (peptideRolling)
+                {
+                  peptideRoller.push(seq[i+kmerSize-1]);
+                  hashFwd = peptideRoller.hash();
+                }
+                else
+                  hashFwd = CommonFunc::getHash(seq + i, kmerSize);
+                hashBwd = hashFwd;
+              }
+              else
+              {
+                hashFwd = CommonFunc::getHash(seq + i, kmerSize);
                 CommonFunc::reverseComplement(seq + i, seqRev.get(), kmerSize);
                 hashBwd = CommonFunc::getHash(seqRev.get(), kmerSize);
               }
-              else  //proteins
-                hashBwd = std::numeric_limits<hash_t>::max();   //Pick a dummy high value so that it is ignored later
 
               //Take minimum value of kmer and its reverse complement
               hash_t currentKmer = std::min(hashFwd, hashBwd);
               
 
               //Check the strand of this minimizer hash value
-              auto currentStrand = hashFwd < hashBwd ? strnd::FWD : strnd::REV;
+              auto currentStrand = protein || hashFwd < hashBwd ? strnd::FWD : strnd::REV;
 
               //If front minimum is not in the current window, remove it
               if (!Q.empty() && std::get<2>(Q.front()) <  currentWindowId) 
@@ -411,12 +1141,14 @@ namespace skch {
                 Q.pop_front();
               }
 
-              if (seq[i+kmerSize-1] == 'N')
+              if (seq[i+kmerSize-1] == ambiguous)
               {
                 ambig_kmer_count = kmerSize;
               }
               //Consider non-symmetric kmers only
-              if(hashBwd != hashFwd && ambig_kmer_count == 0)
+              if((protein || hashBwd != hashFwd) && ambig_kmer_count == 0
+                  && (selected.empty() || selected[i])
+                  && !(lowComplexity && lowComplexity->masked(seq, i)))
               {
                 // Add current hash to window
                 Q.push_back(std::make_tuple(currentKmer, currentStrand, i)); 
@@ -511,13 +1243,164 @@ namespace skch {
             {
               if (iter->second.first.wpos != -1) 
               {
-                iter->second.first.wpos_end = len - kmerSize + 1;
-                minmerIndex.push_back(iter->second.first);
+                if (openMinmers)
+                {
+                  openMinmers->push_back(iter->second.first);
+                  openMinmers->back().wpos += windowOffset;
+                  openMinmers->back().wpos_end = -1;
+                }
+                else
+                {
+                  iter->second.first.wpos_end = len - kmerSize + 1;
+                  minmerIndex.push_back(iter->second.first);
+                }
               }
               std::advance(iter, 1);
               rank += 1;
             }
 
+            // Report positions in full sequence coordinates
+            if (windowOffset > 0)
+            {
+              for (auto it = minmerIndex.begin() + firstRecord; it != minmerIndex.end(); it++)
+              {
+                if (it->wpos >= 0) it->wpos += windowOffset;
+                if (it->wpos_end >= 0) it->wpos_end += windowOffset;
+              }
+            }
+          }
+
+        /**
+         * @brief       Compute raw winnowed minmer intervals over a range of windows
+         * @details     Intervals are appended to minmerIndex in the order they close, before
+         *              the clean-up done by finalizeMinmers. seq may be a slice of a longer
+         *              sequence starting at windowOffset: positions are then reported in the
+         *              coordinates of the full sequence. If openMinmers is given, intervals
+         *              still open after the last window are returned there (wpos set,
+         *              wpos_end = -1) instead of being closed at the end of the slice.
+         * @param[out]  minmerIndex     raw minmer intervals
+         * @param[in]   seq             pointer to input sequence (upper case, validated)
+         * @param[in]   len             length of input sequence
+         * @param[in]   kmerSize
+         * @param[in]   windowSize
+         * @param[in]   sketchSize      sketch size.
+         * @param[in]   seqCounter      current sequence number, used while saving the position of minimizer
+         * @param[in]   hashEngine      k-mer hashing scheme (skch::kmer_hash)
+         * @param[in]   windowOffset    position of seq within the full sequence
+         * @param[out]  openMinmers     if non-null, receives the intervals open at the end
+         * @param[in]   spacedSeeds     if non-null, hash these spaced seeds instead of k-mers
+         * @param[in]   syncmers        if non-null, sketch only the k-mers it selects
+         * @param[in]   dust            if non-null, pass over the k-mers it masks
+         */
+        template <typename T>
+          inline void computeMinmerIntervals(std::vector<T> &minmerIndex,
+              const char* seq, offset_t len,
+              int kmerSize,
+              int windowSize,
+              int alphabetSize,
+              int sketchSize,
+              seqno_t seqCounter,
+              int hashEngine,
+              progress_meter::ProgressMeter* progress,
+              offset_t windowOffset = 0,
+              std::vector<T>* openMinmers = nullptr,
+              const SpacedSeeds* spacedSeeds = nullptr,
+              const Syncmers* syncmers = nullptr,
+              const Dust* dust = nullptr)
+          {
+            // Spaced seeds are hashed from a rolling window spanning the longest seed
+            if (spacedSeeds)
+            {
+              computeMinmerIntervalsKernel<0>(minmerIndex, seq, len, spacedSeeds->span(), windowSize, alphabetSize,
+                  sketchSize, seqCounter, true, progress, windowOffset, openMinmers, spacedSeeds, syncmers, dust);
+            }
+            else if (useRollingHash(hashEngine, kmerSize, alphabetSize))
+            {
+              dispatchKmerSize(kmerSize, [&](auto k) {
+                computeMinmerIntervalsKernel<decltype(k)::value>(minmerIndex, seq, len, kmerSize, windowSize, alphabetSize,
+                    sketchSize, seqCounter, true, progress, windowOffset, openMinmers, nullptr, syncmers, dust);
+              });
+            }
+            else
+            {
+              computeMinmerIntervalsKernel<0>(minmerIndex, seq, len, kmerSize, windowSize, alphabetSize,
+                  sketchSize, seqCounter, false, progress, windowOffset, openMinmers, nullptr, syncmers, dust);
+            }
+          }
+
+        /**
+         * @brief       Sample the world minimizers of a sequence, or of a slice of one
+         * @details     a k-mer is a world minimizer when it hashes to at most threshold
+         *              (worldHashThreshold), whatever its neighbours, and belongs to every window
+         *              holding it. Each sampled k-mer is appended as the interval of those
+         *              windows, in position order and not yet merged (mergeWorldMinmers); the
+         *              k-mers starting at ownedEnd or later are left to the next slice.
+         * @param[in]   seq             upper-cased, validated sequence or slice
+         * @param[in]   windowOffset    position of seq within the full sequence
+         */
+        template <typename T>
+          inline void computeWorldMinmers(std::vector<T> &minmerIndex,
+              const char* seq, offset_t len,
+              offset_t ownedEnd,
+              int kmerSize,
+              int windowSize,
+              int alphabetSize,
+              hash_t threshold,
+              seqno_t seqCounter,
+              int hashEngine,
+              progress_meter::ProgressMeter* progress,
+              offset_t windowOffset,
+              const SpacedSeeds* spacedSeeds,
+              const Syncmers* syncmers,
+              const Dust* dust = nullptr)
+          {
+            const int span = alphabetSize == 4 && spacedSeeds ? spacedSeeds->span() : kmerSize;
+            forEachSampledKmer(seq, len, kmerSize, alphabetSize, hashEngine, spacedSeeds, syncmers, threshold,
+                [&](offset_t i, hash_t hash, strand_t strand) {
+                  if (i < ownedEnd) {
+                    const offset_t pos = windowOffset + i;
+                    minmerIndex.push_back(MinmerInfo{hash, std::max<offset_t>(0, pos + span - windowSize), pos + 1,
+                                                     seqCounter, strand});
+                  }
+                }, dust);
+            progress->increment(std::max<offset_t>(0, std::min<offset_t>(ownedEnd, len - span + 1)));
+          }
+
+        /**
+         * @brief       Join the sampled intervals of a hash that overlap or touch into one,
+         *              whose strand is the vote of theirs, as winnowing keeps one per hash
+         * @param[in,out]  minmerIndex  intervals of computeWorldMinmers for a whole sequence
+         */
+        template <typename T>
+          inline void mergeWorldMinmers(std::vector<T> &minmerIndex)
+          {
+            ankerl::unordered_dense::map<hash_t, size_t> latest;
+            size_t kept = 0;
+            for (size_t i = 0; i < minmerIndex.size(); ++i) {
+              const T mi = minmerIndex[i];
+              auto [it, added] = latest.try_emplace(mi.hash, kept);
+              T& open = minmerIndex[it->second];
+              if (!added && open.wpos_end >= mi.wpos) {
+                open.wpos_end = mi.wpos_end;
+                open.strand = std::clamp<int>(open.strand + mi.strand, -1024, 1024);
+              } else {
+                it->second = kept;
+                minmerIndex[kept++] = mi;
+              }
+            }
+            minmerIndex.resize(kept);
+          }
+
+        /**
+         * @brief       Clean up raw minmer intervals into the final per-sequence index
+         * @details     drops degenerate intervals, splits intervals longer than windowSize,
+         *              sorts by window position and removes duplicate windows
+         * @param[in,out]  minmerIndex  raw intervals from computeMinmerIntervals
+         * @param[in]      windowSize
+         */
+        template <typename T>
+          inline void finalizeMinmers(std::vector<T> &minmerIndex, int windowSize)
+          {
             //// TODO Not sure why these are occuring but they are a bug
             minmerIndex.erase(
                 std::remove_if(
@@ -529,7 +1412,7 @@ namespace skch {
 
             //// Split up windows longer than windowSize into chunks of windowSize or less
             std::vector<MinmerInfo> chunkedMIs;
-            std::for_each(minmerIndex.begin(), minmerIndex.end(), [&chunkedMIs, windowSize, kmerSize] (auto& mi) {
+            std::for_each(minmerIndex.begin(), minmerIndex.end(), [&chunkedMIs, windowSize] (auto& mi) {
               mi.strand = mi.strand < 0 ? (mi.strand == 0 ? strnd::AMBIG : strnd::REV) : strnd::FWD;
               if (mi.wpos_end > mi.wpos + windowSize) {
                 for (int chunk = 0; chunk < std::ceil(float(mi.wpos_end - mi.wpos) / float(windowSize)); chunk++) {
@@ -568,6 +1451,75 @@ namespace skch {
 
           }
 
+        /**
+         * @brief       Append the raw intervals of the next slice of a sequence
+         * @details     The slice must start at the last window of the previous slice, so
+         *              its state there matches an unsliced run. Intervals it opened at
+         *              that window continue ones left open by the previous slice and take
+         *              over their start position.
+         * @param[out]     minmerIndex     raw intervals of the sequence so far
+         * @param[in,out]  sliceIntervals  raw intervals of the slice
+         * @param[in,out]  sliceOpen       intervals left open by the slice
+         * @param[in]      prevOpen        intervals left open by the previous slice
+         * @param[in]      firstWindow     first window of the slice
+         */
+        template <typename T>
+          inline void stitchMinmerIntervals(std::vector<T> &minmerIndex,
+              std::vector<T> &sliceIntervals,
+              std::vector<T> &sliceOpen,
+              const std::vector<T> &prevOpen,
+              offset_t firstWindow)
+          {
+            ankerl::unordered_dense::map<hash_t, offset_t> openStart;
+            for (const auto& mi : prevOpen)
+              openStart[mi.hash] = mi.wpos;
+
+            auto carryOver = [&](T& mi) {
+              if (mi.wpos != firstWindow) return;
+              auto it = openStart.find(mi.hash);
+              if (it != openStart.end()) mi.wpos = it->second;
+            };
+            std::for_each(sliceIntervals.begin(), sliceIntervals.end(), carryOver);
+            std::for_each(sliceOpen.begin(), sliceOpen.end(), carryOver);
+
+            minmerIndex.insert(minmerIndex.end(), sliceIntervals.begin(), sliceIntervals.end());
+          }
+
+        /**
+         * @brief       Compute winnowed minmers from a given sequence and add to the index
+         * @param[out]  minmerIndex  table storing minmers and their position as we compute them
+         * @param[in]   seq             pointer to input sequence
+         * @param[in]   len             length of input sequence
+         * @param[in]   kmerSize
+         * @param[in]   windowSize
+         * @param[in]   sketchSize      sketch size. 
+         * @param[in]   seqCounter      current sequence number, used while saving the position of minimizer
+         * @param[in]   hashEngine      k-mer hashing scheme (skch::kmer_hash)
+         * @param[in]   spacedSeeds     if non-null, hash these spaced seeds instead of k-mers
+         * @param[in]   syncmers        if non-null, sketch only the k-mers it selects
+         * @param[in]   dust            if non-null, pass over the k-mers it masks
+         */
+        template <typename T>
+          inline void addMinmers(std::vector<T> &minmerIndex, 
+              char* seq, offset_t len,
+              int kmerSize, 
+              int windowSize,
+              int alphabetSize,
+              int sketchSize,
+              seqno_t seqCounter,
+              int hashEngine,
+              progress_meter::ProgressMeter* progress,
+              const SpacedSeeds* spacedSeeds = nullptr,
+              const Syncmers* syncmers = nullptr,
+              const Dust* dust = nullptr)
+          {
+            makeUpperCaseAndValid(seq, len, alphabetSize);
+            computeMinmerIntervals(minmerIndex, seq, len, kmerSize, windowSize,
+                alphabetSize, sketchSize, seqCounter, hashEngine, progress,
+                0, static_cast<std::vector<T>*>(nullptr), spacedSeeds, syncmers, dust);
+            finalizeMinmers(minmerIndex, windowSize);
+          }
+
         /**
           * @brief           Functor for comparing tuples by single index layer
           * @tparam layer    Tuple's index which is used for comparison
@@ -26,8 +26,12 @@ namespace fs = std::filesystem;
 #include <thread>
 #include <condition_variable>
 #include <mutex>
+#include <future>
+#include <functional>
+#include <cstring>
+#include <tuple>
 #include <sstream>
-#include "common/atomic_queue/atomic_queue.h"
+#include <map>
 
 //Own includes
 #include "map/include/base_types.hpp"
@@ -38,15 +42,32 @@ namespace fs = std::filesystem;
 #include "map/include/slidingMap.hpp"
 #include "map/include/MIIteratorL2.hpp"
 #include "map/include/filter.hpp"
+#include "map/include/blockingQueue.hpp"
+#include "map/include/workStealingPool.hpp"
+#include "map/include/mappingRuns.hpp"
+#include "map/include/mappingCache.hpp"
+#include "map/include/outputChunks.hpp"
+#include "map/include/binaryMappings.hpp"
+#include "map/include/numa.hpp"
+#include "map/include/stageProfile.hpp"
+#include "map/include/memoryReport.hpp"
 
 //External includes
 #include "common/seqiter.hpp"
 #include "common/progress.hpp"
+#include "common/int_kernels.hpp"
+#include "common/queue_budget.hpp"
+#include "common/shared_sequences.hpp"
+#include "common/sampling_profiler.hpp"
+#include "common/bgzfstream.hpp"
+#include "common/interval_index.hpp"
+#include "common/sorted_output.hpp"
 #include "map_stats.hpp"
 #include "robin-hood-hashing/robin_hood.h"
-// if we ever want to do the union-find chaining in parallel
+// if mappings of different chaining partitions ever need to be united concurrently
 //#include "common/dset64-gccAtomic.hpp"
-// this is for single-threaded use, but is more portable
+// this is for single-threaded use, but is more portable; parallel chaining partitions
+// unite disjoint sets of mappings, so they share it safely
 #include "common/dset64.hpp"
 //#include "assert.hpp"
 #include "gsl/gsl_randist.h"
@@ -55,9 +76,31 @@ namespace skch
 {
   struct QueryMappingOutput {
       std::string queryName;
+      seqno_t seqId = 0;                         // Query sequence id
+      uint64_t ordinal = 0;                      // Position of the query in the order it was read
       std::vector<MappingResult> results;        // Non-merged mappings
       std::vector<MappingResult> mergedResults;  // Maximally merged mappings  
-      std::mutex mutex;
+      std::vector<MappingResultsVector_t> fragmentResults;  // Mappings of each fragment, written by its worker
+      std::atomic<int> fragmentsRemaining{0};    // Fragments not yet mapped; the last one merges the query
+      bool incremental = false;                  // long query, merged in segments as its fragments are mapped
+      std::mutex segmentMutex;                   // guards the fields below, for incremental queries
+      std::vector<char> fragmentDone;
+      size_t frontier = 0;                       // fragments before it are moved to pending
+      MappingResultsVector_t pending;            // their mappings not yet merged, in query order
+      size_t pendingScanned = 0;                 // pending mappings already searched for a cut,
+      offset_t pendingMaxEnd = 0;                // and the largest end before the last of them
+      bool merging = false;                      // a worker is merging a segment
+      bool segmentsMerged = false;
+      InputSeqProgContainer* input = nullptr;    // Query being mapped, freed once its fragments are merged
+      std::string report;                        // Final PAF lines, when the worker already filtered the query
+      bool reported = false;
+      bool filtered = false;                     // the worker already filtered the query, the output thread formats it
+      struct CoarseGuide {
+          std::once_flag mapped;                 // by the first worker mapping a fragment within it
+          std::vector<ReferenceRange> regions;   // where the coarse segment mapped, padded
+      };
+      std::unique_ptr<CoarseGuide[]> coarseGuides;  // of each coarse segment, with --coarse-to-fine
+      std::unique_ptr<std::atomic<bool>[]> fragmentClaimed;  // by the worker mapping it, with --adaptive-segments
       progress_meter::ProgressMeter& progress;
       QueryMappingOutput(const std::string& name, const std::vector<MappingResult>& r, 
                         const std::vector<MappingResult>& mr, progress_meter::ProgressMeter& p)
@@ -73,7 +116,8 @@ namespace skch
       int refGroup;
       int fragmentIndex;
       QueryMappingOutput* output;
-      std::atomic<int>* fragments_processed;
+      std::vector<MinmerInfo> sketch;    // set with presketched when sketched with the whole query
+      bool presketched = false;
   };
 
   /**
@@ -113,6 +157,7 @@ namespace skch
         offset_t optimalStart;            //optimal start mapping position (begin iterator)
         offset_t optimalEnd;              //optimal end mapping position (end iterator)
         int sharedSketchSize;             //count of shared sketch elements
+        int opposingVotes;                //of those, the ones voting for the other strand
         strand_t strand;
       };
 
@@ -127,8 +172,35 @@ namespace skch
       // Sequence ID manager
       std::unique_ptr<SequenceIdManager> idManager;
 
+      // Spaced seeds hashed instead of k-mers, if enabled
+      std::unique_ptr<CommonFunc::SpacedSeeds> spacedSeeds;
+
+      // Selection of the k-mers sketched, if restricted to syncmers
+      std::unique_ptr<CommonFunc::Syncmers> syncmers;
+
+      // Low-complexity k-mers passed over, if masked
+      std::unique_ptr<CommonFunc::Dust> dust;
+
+      // Largest hash sketched, below the maximum when sampling world minimizers
+      hash_t sketchHashThreshold = std::numeric_limits<hash_t>::max();
+
+      // Bytes of the mappings kept across target subsets in the memory report
+      memory::Account memoryAccount;
+
+      // Indexes of the target subsets kept for serveQueries and mapSequences, and the
+      // sequences of each
+      std::vector<std::unique_ptr<skch::Sketch>> residentSketches;
+      std::vector<std::vector<std::string>> residentSubsets;
+
+      // Queries of the mapSequences call under way, and their ids
+      const std::vector<std::pair<std::string, std::string>>* memoryQueries = nullptr;
+      std::vector<seqno_t> memoryQueryIds;
+
+      // Lengths of the target subsets of a plan_only run
+      std::vector<uint64_t> plannedSubsetLengths;
+
       // Vectors to store query and target sequences
-      std::vector<std::string> querySequenceNames;
+      std::vector<seqno_t> querySequenceIds;
       std::vector<std::string> targetSequenceNames;
 
       typedef Sketch::MIIter_t MIIter_t;
@@ -137,6 +209,9 @@ namespace skch
       typedef std::function< void(const MappingResult&) > PostProcessResultsFn_t;
       PostProcessResultsFn_t processMappingResults;
 
+      //Stream the mappings are written to instead of param.outFileName, if given
+      std::ostream* mappingOut;
+
       //Container to store query sequence name and length
       //used only if one-to-one filtering is ON
       std::vector<ContigInfo> qmetadata;
@@ -145,24 +220,324 @@ namespace skch
       //for an L1 candidate if the best intersection size is i;
       std::vector<int> sketchCutoffs; 
 
+      //Position [i] is the identity upper bound of an L2 mapping sharing i of sketchSize
+      //sketch elements, the common case of a full query sketch
+      std::vector<float> identityUpperBounds;
+
+      //Identities and identity upper bounds of L2 mappings by shared and query sketch size
+      Stat::IdentityTable identityTable{param.sketchSize, param.kmerSize, skch::fixed::confidence_interval};
+
+      //Runs [first, second) of consecutive sequence ids in each group; seed lists are sorted
+      //by sequence id, so a query's own group is cut out of them by binary search
+      std::unordered_map<int, std::vector<std::pair<seqno_t, seqno_t>>> groupSeqRuns;
+
+      //Queries repeating the sequence of an earlier one, under param.dedup_queries, by the
+      //query mapped in their place; they are not read and are reported from its mappings
+      std::unordered_map<seqno_t, std::vector<seqno_t>> queryDuplicates;
+      std::unordered_set<seqno_t> duplicateQueries;
+
+      //Under param.reuse_target_sketches, the queries also indexed as targets, and the segment
+      //sketches of those of a subset being built, cut from its windows until they are mapped
+      std::unordered_set<seqno_t> targetSketchQueries;
+      std::unordered_map<seqno_t, std::vector<std::vector<MinmerInfo>>> targetSketches;
+      std::mutex targetSketchMutex;
+
       // Sequence ID manager
-      // Atomic queues for input and output
-      typedef atomic_queue::AtomicQueue<InputSeqProgContainer*, 1024, nullptr, true, true, false, false> input_atomic_queue_t;
-      typedef atomic_queue::AtomicQueue<QueryMappingOutput*, 1024, nullptr, true, true, false, false> merged_mappings_queue_t;
-      typedef atomic_queue::AtomicQueue<std::pair<seqno_t, MappingResultsVector_t*>*, 1024> aggregate_atomic_queue_t;
-      typedef atomic_queue::AtomicQueue<std::string*, 1024> writer_atomic_queue_t;
-      typedef atomic_queue::AtomicQueue<QueryMappingOutput*, 1024, nullptr, true, true, false, false> query_output_atomic_queue_t;
-      typedef atomic_queue::AtomicQueue<FragmentData*, 8192, nullptr, true, true, false, false> fragment_atomic_queue_t;
+      // Blocking queues for input and output
+      typedef BlockingQueue<InputSeqProgContainer*> input_queue_t;
+      typedef BlockingQueue<QueryMappingOutput*> merged_mappings_queue_t;
+      // A query's mappings queued for the final filtering, numbered in the order it is written
+      struct QueryTask
+      {
+          seqno_t querySeqId;
+          MappingResultsVector_t mappings;
+          uint64_t order;
+          offset_t chainIdBase;                  // first chain id of the query in the output
+      };
+      typedef BlockingQueue<QueryTask*> aggregate_queue_t;
+      typedef std::function<void(seqno_t, MappingResultsVector_t&&)> query_sink_t;
+      typedef BlockingQueue<std::string*> writer_queue_t;
+      typedef BlockingQueue<QueryMappingOutput*> query_output_queue_t;
+      typedef WorkStealingPool<FragmentData*> fragment_pool_t;
+
+      // Buffers a worker maps with, reused from one fragment or query to the next
+      struct MappingScratch
+      {
+          std::vector<IntervalPoint> intervalPoints;
+          std::vector<L1_candidateLocus_t> l1Mappings;
+          MappingResultsVector_t l2Mappings;
+          QueryMetaData<MinVec_Type> Q;
+          FragmentData fragment{};               // fragment of the small query being mapped
+          std::vector<InputSeqProgContainer*> inputs;  // queries popped together
+          seqno_t guideSeqId = -1;               // query and fragment last mapped, and where
+          int guideFragment = -1;                // it mapped, for the guided search of the
+          std::vector<ReferenceRange> guide;     // fragment after it
+          QueryMetaData<MinVec_Type> coarseQ;    // coarse segment mapped for --coarse-to-fine
+          seqno_t adaptSeqId = -1;               // query and fragment after the last mapped,
+          int adaptNext = -1;                    // fragments the next one may cover, 0 if the
+          int adaptFactor = 0;                   // last did not map uniquely, and its mapping,
+          MappingResult adaptLast{};             // for --adaptive-segments
+      };
+
+      // Temporaries of the L1 and L2 stages, one set per thread and kept from one fragment
+      // to the next, so a fragment allocates nothing once they have grown to the largest
+      struct MappingArena
+      {
+          std::vector<hash_t> queryHashes;
+          std::vector<boundPtr<Sketch::SeedIter_t>> seedLists;
+          std::vector<boundPtr<Sketch::SeedIter_t>> keptSeedLists;
+          std::vector<std::pair<seqno_t, seqno_t>> excludedTargets;
+          std::vector<IntervalPoint> sortedPoints;
+          std::vector<IntervalPoint> radixBuffer;
+          std::vector<int> stepOverlap;
+          std::vector<size_t> stepPoint;
+          std::vector<L1_candidateLocus_t> localOpts;
+          ankerl::unordered_dense::map<hash_t, int> l1HashFreq;
+          std::vector<L2_mapLocus_t> l2Loci;
+          std::vector<int> keptSketchSizes;
+          std::vector<MinmerInfo> slidingWindow;
+          ankerl::unordered_dense::map<hash_t, int> l2HashFreq;
+          SlideMapperBuffers slideMapper;
+          memory::Account account;
+
+          template <typename T>
+          static uint64_t bytesOf(const std::vector<T>& v) { return v.capacity() * sizeof(T); }
+
+          template <typename Map_t>
+          static uint64_t bytesOfMap(const Map_t& m) {
+              return m.values().capacity() * sizeof(typename Map_t::value_type) + m.bucket_count() * 8;
+          }
+
+          uint64_t bytes() const {
+              return bytesOf(queryHashes) + bytesOf(seedLists) + bytesOf(keptSeedLists) + bytesOf(excludedTargets)
+                  + bytesOf(sortedPoints) + bytesOf(radixBuffer) + bytesOf(stepOverlap) + bytesOf(stepPoint)
+                  + bytesOf(localOpts) + bytesOfMap(l1HashFreq) + bytesOf(l2Loci) + bytesOf(keptSketchSizes)
+                  + bytesOf(slidingWindow) + bytesOfMap(l2HashFreq)
+                  + bytesOf(slideMapper.minhashes) + bytesOf(slideMapper.rankBuckets);
+          }
+      };
+
+      static MappingArena& arena() {
+          thread_local MappingArena threadArena;
+          return threadArena;
+      }
+
+      // Queries queued at most, enough for short reads to keep the workers busy; the bytes
+      // of the longer ones are bounded by the queue budget instead
+      static constexpr size_t inputQueueCapacity = 1 << 16;
+
+      // Queues and counters shared by the threads mapping against one index subset
+      struct MappingPipeline
+      {
+          Wakeup work_ready;                     // new input or fragments for idle workers
+          input_queue_t input_queue{inputQueueCapacity, &work_ready, "input"};
+          fragment_pool_t fragment_pool;
+          merged_mappings_queue_t merged_queue{1024, nullptr, "merged"};
+          std::atomic<int> queries_in_flight{0}; // queries popped but not yet merged
+          bool streaming = false;                // merged queries are filtered and written one by one
+          const int workers;
+
+          MappingPipeline(int workers, int nodes) : fragment_pool(workers, &work_ready, nodes), workers(workers) {}
+      };
       
       // Track maximum chain ID seen across all subsets
       std::atomic<offset_t> maxChainIdSeen{0};
 
+      // Chain ids given out in the output so far. The ids of the subsets only tell chains of
+      // a query apart; each query's chains are renumbered by position from a base reserved
+      // as it is written, so with the queries written in order the ids do not depend on the
+      // thread timing
+      std::atomic<offset_t> chainIdsReported{0};
+
+      // Fragment sketches of the queries, written while mapping against the first target
+      // subset and replayed against the others, so each query is read and hashed once
+      std::ofstream querySketchOut;
+      std::mutex querySketchMutex;
+      bool recordQuerySketches = false;
+      bool replayQuerySketches = false;
+
+      // Run files of the per-subset mappings, when they are spilled to disk instead of gathered
+      std::unique_ptr<MappingRuns> mappingRuns;
+
+      // Queries a resumed job mapped against the current subset before it was interrupted
+      std::unordered_set<seqno_t> resumedQueries;
+
+      // Group of all the targets of the current subset, whose queries skip it, or -1
+      int subsetOnlyGroup = -1;
+
+      // Under param.mapping_cache, the cache entry of each query and target by sequence id,
+      // those whose pairs the cache holds, the runs of consecutive ids of those targets, cut
+      // out of the seeds of those queries, and the mappings of those pairs, until merged
+      std::vector<MappingCache::Sequence> cacheEntries;
+      std::vector<bool> cachedQuery;
+      std::vector<bool> cachedTarget;
+      std::vector<std::pair<seqno_t, seqno_t>> cachedTargetRuns;
+      std::vector<MappingResult> cachedMappings;
+      uint64_t cachedChainIds = 0;
+
+      // Whether all the targets of the current subset are cached, so cached queries skip it
+      bool subsetCached = false;
+
+      // Order the queries are read in against the current subset, empty for querySequenceIds
+      std::vector<seqno_t> queryReadOrder;
+
+      // Under param.distance_matrix, the sorted distinct minmer hashes of each query, in the
+      // order of querySequenceIds, sketched against the first subset
+      std::vector<std::vector<hash_t>> distanceQueryHashes;
+      bool distanceQueriesSketched = false;
+
+      // Under param.cost_tags or a slow query log, the counters and time of mapping each
+      // query, by its id; null otherwise
+      std::unique_ptr<profile::QueryCost[]> queryCosts;
+
+
+    /**
+     * @brief   map a fragment, and with --adaptive-segments those after it it covers, into
+     *          their slots of the query's output
+     * @return  fragments mapped from this one on, 0 if another worker covered it already
+     */
+    int mapFragment(FragmentData* fragment, MappingScratch& scratch) {
+        profile::QueryScope cost(queryCosts ? &queryCosts[fragment->seqId] : nullptr);
+        QueryMappingOutput* output = fragment->output;
+        if (!output->fragmentClaimed) {
+            mapOneFragment(fragment, scratch);
+            return 1;
+        }
+        const int first = fragment->fragmentIndex;
+        if (output->fragmentClaimed[first].exchange(true, std::memory_order_acq_rel)) {
+            return 0;
+        }
+
+        // Where the fragments before mapped uniquely and collinearly, the ones after this
+        // one not yet taken by another worker are covered with it, in one segment
+        int covered = 1;
+        if (scratch.adaptSeqId == fragment->seqId && scratch.adaptNext == first && scratch.adaptFactor > 1) {
+            while (covered < scratch.adaptFactor
+                   && offset_t(first + covered + 1) * param.segLength <= offset_t(fragment->fullLen)
+                   && !output->fragmentClaimed[first + covered].exchange(true, std::memory_order_acq_rel)) {
+                ++covered;
+            }
+        }
+        if (covered > 1 && mapCoveringSegment(fragment, covered, scratch)) {
+            return covered;
+        }
+
+        // Near a breakpoint or ambiguity, back to one segment per fragment
+        mapOneFragment(fragment, scratch);
+        adaptFrom(fragment, scratch);
+        for (int i = first + 1; i < first + covered; ++i) {
+            FragmentData next{fragment->seq + offset_t(i - first) * param.segLength, fragment->len, fragment->fullLen,
+                              fragment->seqId, fragment->seqName, fragment->refGroup, i, output};
+            mapOneFragment(&next, scratch);
+            adaptFrom(&next, scratch);
+        }
+        return covered;
+    }
+
+    // Identity above which a mapping is taken as one to extend segments along
+    static constexpr float adaptiveMinIdentity = 0.95;
+
+    // The only mapping of a fragment, if it has one and at high identity
+    const MappingResult* uniqueMapping(const MappingResultsVector_t& mappings) const {
+        if (mappings.size() != 1 || mappings.front().nucIdentity < std::max(param.percentageIdentity, adaptiveMinIdentity)) {
+            return nullptr;
+        }
+        return &mappings.front();
+    }
+
+    // Whether next, on the query right after prev, continues it on the reference
+    bool collinear(const MappingResult& prev, const MappingResult& next) const {
+        if (prev.refSeqId != next.refSeqId || prev.strand != next.strand) {
+            return false;
+        }
+        const offset_t gap = prev.strand == strnd::FWD ? next.refStartPos - prev.refEndPos
+                                                       : prev.refStartPos - next.refEndPos;
+        return std::abs(gap) <= param.segLength / 5;
+    }
+
+    // Extend or reset the fragments the next one may cover, from how this one mapped
+    void adaptFrom(const FragmentData* fragment, MappingScratch& scratch) {
+        const MappingResult* unique = uniqueMapping(fragment->output->fragmentResults[fragment->fragmentIndex]);
+        const bool follows = scratch.adaptSeqId == fragment->seqId && scratch.adaptNext == fragment->fragmentIndex
+            && scratch.adaptFactor > 0;
+        if (!unique) {
+            scratch.adaptFactor = 0;
+        } else if (follows && collinear(scratch.adaptLast, *unique)) {
+            scratch.adaptFactor = std::min(param.adaptive_segment_factor, std::max(2, scratch.adaptFactor * 2));
+        } else {
+            scratch.adaptFactor = 1;
+        }
+        if (unique) {
+            scratch.adaptLast = *unique;
+        }
+        scratch.adaptSeqId = fragment->seqId;
+        scratch.adaptNext = fragment->fragmentIndex + 1;
+    }
+
+    /**
+     * @brief   map the segment of covered fragments from fragment on as one, and split its
+     *          mapping into theirs if it continues the last one uniquely
+     * @return  false if it did not, leaving the fragments to be mapped one by one
+     */
+    bool mapCoveringSegment(FragmentData* fragment, int covered, MappingScratch& scratch) {
+        std::vector<IntervalPoint>& intervalPoints = scratch.intervalPoints;
+        std::vector<L1_candidateLocus_t>& l1Mappings = scratch.l1Mappings;
+        MappingResultsVector_t& l2Mappings = scratch.l2Mappings;
+        QueryMetaData<MinVec_Type>& Q = scratch.Q;
+        intervalPoints.clear();
+        l1Mappings.clear();
+        l2Mappings.clear();
+
+        const offset_t segmentLen = offset_t(covered) * param.segLength;
+        Q.seq = const_cast<char*>(fragment->seq);
+        Q.len = segmentLen;
+        Q.fullLen = fragment->fullLen;
+        Q.seqId = fragment->seqId;
+        Q.seqName = fragment->seqName;
+        Q.refGroup = fragment->refGroup;
+        Q.presketched = false;
+        profile::count(profile::ADAPTIVE_SEGMENTS, 1);
+        mapSingleQueryFrag(Q, intervalPoints, l1Mappings, l2Mappings);
+
+        const MappingResult* unique = uniqueMapping(l2Mappings);
+        if (!unique || !collinear(scratch.adaptLast, *unique)) {
+            profile::count(profile::ADAPTIVE_FALLBACKS, 1);
+            scratch.adaptFactor = 1;
+            return false;
+        }
+
+        // Each fragment gets its stretch of the segment's mapping, as if mapped alone
+        QueryMappingOutput* output = fragment->output;
+        for (int i = 0; i < covered; ++i) {
+            MappingResult e = *unique;
+            const offset_t offset = offset_t(i) * param.segLength;
+            e.chain_id = fragment->fragmentIndex + i;
+            e.chain_length = 1;
+            e.chain_pos = 1;
+            e.queryLen = fragment->fullLen;
+            e.queryStartPos = offset_t(e.chain_id) * param.segLength;
+            e.queryEndPos = e.queryStartPos + param.segLength;
+            e.refStartPos = unique->strand == strnd::FWD ? unique->refStartPos + offset
+                                                         : unique->refEndPos - offset - param.segLength;
+            e.refEndPos = e.refStartPos + param.segLength;
+            e.blockLength = param.segLength;
+            output->fragmentResults[e.chain_id].assign(1, e);
+        }
+        scratch.adaptLast = *unique;
+        scratch.adaptFactor = std::min(param.adaptive_segment_factor, scratch.adaptFactor * 2);
+        scratch.adaptNext = fragment->fragmentIndex + covered;
+        profile::count(profile::FRAGMENTS, covered);
+        output->progress.increment(segmentLen);
+        return true;
+    }
 
-    void processFragment(FragmentData* fragment, 
-                         std::vector<IntervalPoint>& intervalPoints,
-                         std::vector<L1_candidateLocus_t>& l1Mappings,
-                         MappingResultsVector_t& l2Mappings,
-                         QueryMetaData<MinVec_Type>& Q) {
+    // Map one fragment into its slot of the query's output
+    void mapOneFragment(FragmentData* fragment, MappingScratch& scratch) {
+        std::vector<IntervalPoint>& intervalPoints = scratch.intervalPoints;
+        std::vector<L1_candidateLocus_t>& l1Mappings = scratch.l1Mappings;
+        MappingResultsVector_t& l2Mappings = scratch.l2Mappings;
+        QueryMetaData<MinVec_Type>& Q = scratch.Q;
+        const std::vector<ReferenceRange>* coarse = fragment->output->coarseGuides ? &coarseGuideOf(fragment, scratch) : nullptr;
         intervalPoints.clear();
         l1Mappings.clear();
         l2Mappings.clear();
@@ -173,29 +548,167 @@ namespace skch
         Q.seqId = fragment->seqId;
         Q.seqName = fragment->seqName;
         Q.refGroup = fragment->refGroup;
+        Q.presketched = fragment->presketched;
+        if (Q.presketched) {
+            Q.minmerTableQuery.swap(fragment->sketch);
+        }
 
-        mapSingleQueryFrag(Q, intervalPoints, l1Mappings, l2Mappings);
+        // A guided fragment is looked for within its guide regions, and in the whole index
+        // only if it is not found there as often as it is to be reported
+        auto mapGuided = [&]() {
+            profile::count(profile::GUIDED_FRAGMENTS, 1);
+            mapSingleQueryFrag(Q, intervalPoints, l1Mappings, l2Mappings);
+            Q.guideRegions.clear();
+            if (l2Mappings.size() < param.numMappingsForSegment) {
+                profile::count(profile::GUIDED_FALLBACKS, 1);
+                intervalPoints.clear();
+                l1Mappings.clear();
+                l2Mappings.clear();
+                Q.presketched = Q.sketchSize > 0;   // the sketch is kept
+                mapSingleQueryFrag(Q, intervalPoints, l1Mappings, l2Mappings);
+            }
+        };
+        if (coarse && !coarse->empty()) {
+            // Within where the coarse segment holding it mapped
+            Q.guideRegions.assign(coarse->begin(), coarse->end());
+            mapGuided();
+        } else if (param.guided_search_window > 0 && scratch.guideSeqId == fragment->seqId
+            && scratch.guideFragment + 1 == fragment->fragmentIndex && !scratch.guide.empty()) {
+            // The fragment after one next to where that one mapped
+            Q.guideRegions.swap(scratch.guide);
+            mapGuided();
+        } else {
+            mapSingleQueryFrag(Q, intervalPoints, l1Mappings, l2Mappings);
+        }
+        if (param.guided_search_window > 0) {
+            guideFrom(l2Mappings, fragment, scratch);
+        }
+        profile::count(profile::FRAGMENTS, 1);
+        if (memory::enabled()) {
+            MappingArena& buffers = arena();
+            buffers.account.set(memory::MAPPING_SCRATCH, buffers.bytes()
+                + MappingArena::bytesOf(intervalPoints) + MappingArena::bytesOf(l1Mappings)
+                + MappingArena::bytesOf(l2Mappings) + MappingArena::bytesOf(Q.minmerTableQuery));
+        }
 
         std::for_each(l2Mappings.begin(), l2Mappings.end(), [&](MappingResult &e){
+            e.chain_id = fragment->fragmentIndex;
             e.queryLen = fragment->fullLen;
             e.queryStartPos = fragment->fragmentIndex * param.segLength;
             e.queryEndPos = e.queryStartPos + fragment->len;
         });
 
-        {
-            std::lock_guard<std::mutex> lock(fragment->output->mutex);
-            fragment->output->results.insert(fragment->output->results.end(), l2Mappings.begin(), l2Mappings.end());
-            // Initialize mergedResults with same mappings
-            if (param.mergeMappings && param.split) {
-                fragment->output->mergedResults.insert(fragment->output->mergedResults.end(), l2Mappings.begin(), l2Mappings.end());
+        // Each fragment owns its slot, so no lock is needed
+        auto output = fragment->output;
+        output->fragmentResults[fragment->fragmentIndex].assign(l2Mappings.begin(), l2Mappings.end());
+
+        // Update progress after processing the fragment
+        output->progress.increment(fragment->len);
+    }
+
+    // Neighborhoods of the best mappings of a fragment, for the guided search of the next one
+    void guideFrom(const MappingResultsVector_t& mappings, const FragmentData* fragment, MappingScratch& scratch) {
+        scratch.guideSeqId = fragment->seqId;
+        scratch.guideFragment = fragment->fragmentIndex;
+        scratch.guide.clear();
+        std::vector<const MappingResult*> best;
+        for (const auto& e : mappings) {
+            if (e.nucIdentity >= param.percentageIdentity) {
+                best.push_back(&e);
             }
         }
+        const size_t kept = std::min<size_t>(best.size(), param.numMappingsForSegment);
+        std::partial_sort(best.begin(), best.begin() + kept, best.end(),
+                          [](const MappingResult* a, const MappingResult* b) { return a->nucIdentity > b->nucIdentity; });
+        for (size_t i = 0; i < kept; ++i) {
+            scratch.guide.push_back({best[i]->refSeqId,
+                                     std::max<offset_t>(0, best[i]->refStartPos - param.guided_search_window),
+                                     best[i]->refEndPos + param.guided_search_window});
+        }
+        mergeGuide(scratch.guide);
+    }
 
-        // Update progress after processing the fragment
-        fragment->output->progress.increment(fragment->len);
+    // Sort guide regions and merge those overlapping, as restrictSeedTargets takes them
+    static void mergeGuide(std::vector<ReferenceRange>& guide) {
+        std::sort(guide.begin(), guide.end(), [](const ReferenceRange& a, const ReferenceRange& b) {
+            return std::tie(a.seqId, a.start) < std::tie(b.seqId, b.start);
+        });
+        size_t merged = 0;
+        for (size_t i = 0; i < guide.size(); ++i) {
+            if (merged > 0 && guide[merged - 1].seqId == guide[i].seqId
+                && guide[merged - 1].end >= guide[i].start) {
+                guide[merged - 1].end = std::max(guide[merged - 1].end, guide[i].end);
+            } else {
+                guide[merged++] = guide[i];
+            }
+        }
+        guide.resize(merged);
+    }
+
+    // Length of the coarse segments of --coarse-to-fine
+    offset_t coarseSegmentLength() const {
+        return param.segLength * param.coarse_factor;
+    }
+
+    // Coarse segments a query of len bases is cut into, the last one ending with it
+    offset_t coarseSegmentsOf(offset_t len) const {
+        return std::max<offset_t>(1, (len + coarseSegmentLength() - 1) / coarseSegmentLength());
+    }
+
+    /**
+     * @brief   regions the coarse segment holding a fragment mapped to, mapping it first if
+     *          no fragment within it has yet
+     * @details the coarse segment is sketched and mapped like a fragment, but with the
+     *          sketch size of one, so its minmers are as many times sparser as it is longer.
+     *          Its mappings, padded by its length, are the regions its fragments are looked
+     *          for in; none leaves them to the whole index
+     */
+    const std::vector<ReferenceRange>& coarseGuideOf(const FragmentData* fragment, MappingScratch& scratch) {
+        const offset_t coarseLen = coarseSegmentLength();
+        const offset_t fullLen = fragment->fullLen;
+        const offset_t fragmentStart = std::min<offset_t>(offset_t(fragment->fragmentIndex) * param.segLength,
+                                                          fullLen - fragment->len);
+        const offset_t index = std::min(fragmentStart / coarseLen, coarseSegmentsOf(fullLen) - 1);
+        auto& guide = fragment->output->coarseGuides[index];
+        std::call_once(guide.mapped, [&]() {
+            const offset_t end = std::min(fullLen, (index + 1) * coarseLen);
+            const offset_t start = std::max<offset_t>(0, end - coarseLen);
+            QueryMetaData<MinVec_Type>& Q = scratch.coarseQ;
+            Q.seq = const_cast<char*>(fragment->seq) - fragmentStart + start;
+            Q.len = end - start;
+            Q.fullLen = fullLen;
+            Q.seqId = fragment->seqId;
+            Q.seqName = fragment->seqName;
+            Q.refGroup = fragment->refGroup;
+            Q.presketched = false;
+            scratch.intervalPoints.clear();
+            scratch.l1Mappings.clear();
+            scratch.l2Mappings.clear();
+            profile::count(profile::COARSE_SEGMENTS, 1);
+            mapSingleQueryFrag(Q, scratch.intervalPoints, scratch.l1Mappings, scratch.l2Mappings);
+            for (const auto& e : scratch.l2Mappings) {
+                guide.regions.push_back({e.refSeqId, std::max<offset_t>(0, e.refStartPos - coarseLen),
+                                         e.refEndPos + coarseLen});
+            }
+            mergeGuide(guide.regions);
+        });
+        return guide.regions;
+    }
 
-        fragment->fragments_processed->fetch_add(1, std::memory_order_relaxed);
+    void processFragment(FragmentData* fragment, MappingScratch& scratch, MappingPipeline& pipeline) {
+        const int covered = mapFragment(fragment, scratch);
+        auto output = fragment->output;
+        const int fragmentIndex = fragment->fragmentIndex;
+        const bool incremental = output->incremental;
         delete fragment;
+        // The query is finished with the last of the fragments this worker covered at most
+        for (int i = fragmentIndex; i < fragmentIndex + covered; ++i) {
+            if (incremental) {
+                mergeMappedSegments(output, i, pipeline);
+            } else if (output->fragmentsRemaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                finishQuery(output, pipeline);
+            }
+        }
     }
       
     public:
@@ -205,14 +718,18 @@ namespace skch
        * @param[in] p           algorithm parameters
        * @param[in] refSketch   reference sketch
        * @param[in] f           optional user defined custom function to post process the reported mapping results
+       * @param[in] out         optional stream to write the mappings to instead of param.outFileName;
+       *                        with a single target subset each query is written once it is mapped
        */
       Map(skch::Parameters p,
-          PostProcessResultsFn_t f = nullptr) :
+          PostProcessResultsFn_t f = nullptr,
+          std::ostream* out = nullptr) :
         param(p),
         processMappingResults(f),
+        mappingOut(out),
         sketchCutoffs(std::min<double>(p.sketchSize, skch::fixed::ss_table_max) + 1, 1),
         idManager(std::make_unique<SequenceIdManager>(
-            p.querySequences,
+            p.stream_queries || p.library_mode ? std::vector<std::string>() : p.querySequences,
             p.refSequences,
             std::vector<std::string>{p.query_prefix},
             std::vector<std::string>{p.target_prefix},
@@ -222,10 +739,35 @@ namespace skch
         cached_segment_length(p.segLength),
         cached_minimum_hits(p.minimum_hits > 0 ? p.minimum_hits : Stat::estimateMinimumHitsRelaxed(p.sketchSize, p.kmerSize, p.percentageIdentity, skch::fixed::confidence_interval))
           {
+              queue_budget::shared().set_limit(param.queue_memory);
+              shared_sequences::shared().set_limit(param.shared_sequence_bytes);
+              if (param.use_spaced_seeds && !param.spaced_seeds.empty()) {
+                  spacedSeeds = std::make_unique<CommonFunc::SpacedSeeds>(param.spaced_seeds);
+              }
+              if (param.syncmer_size > 0) {
+                  syncmers = std::make_unique<CommonFunc::Syncmers>(param.syncmer_size);
+              }
+              if (param.dust_threshold > 0) {
+                  dust = std::make_unique<CommonFunc::Dust>(param.dust_threshold);
+              }
+              if (param.world_minimizers) {
+                  sketchHashThreshold = CommonFunc::worldHashThreshold(param.sketchSize, param.segLength, param.kmerSize, param.alphabetSize);
+              }
+
               // Initialize sequence names right after creating idManager
-              this->querySequenceNames = idManager->getQuerySequenceNames();
+              this->querySequenceIds = idManager->getQuerySequenceIds();
               this->targetSequenceNames = idManager->getTargetSequenceNames();
 
+              buildGroupSeqRuns();
+              findDuplicateQueries();
+              if (param.reuse_target_sketches) {
+                  for (const seqno_t seqId : querySequenceIds) {
+                      if (!duplicateQueries.count(seqId)) {
+                          targetSketchQueries.insert(seqId);
+                      }
+                  }
+              }
+
               // Calculate total target length
               uint64_t total_target_length = 0;
               size_t target_seq_count = targetSequenceNames.size();
@@ -238,14 +780,14 @@ namespace skch
 
               // Calculate total query length
               uint64_t total_query_length = 0;
-              for (const auto& seqName : querySequenceNames) {
-                  total_query_length += idManager->getSequenceLength(idManager->getSequenceId(seqName));
+              for (const seqno_t seqId : querySequenceIds) {
+                  total_query_length += idManager->getSequenceLength(seqId);
               }
 
               // Count unique groups
               std::unordered_set<int> query_groups, target_groups;
-              for (const auto& seqName : querySequenceNames) {
-                  query_groups.insert(idManager->getRefGroup(idManager->getSequenceId(seqName)));
+              for (const seqno_t seqId : querySequenceIds) {
+                  query_groups.insert(idManager->getRefGroup(seqId));
               }
               for (const auto& seqName : targetSequenceNames) {
                   target_groups.insert(idManager->getRefGroup(idManager->getSequenceId(seqName)));
@@ -256,45 +798,263 @@ namespace skch
               double avg_target_size_per_group = target_groups.size() ? (double)total_target_length / target_groups.size() : 0;
 
               std::cerr << "[wfmash::mashmap] " 
-                        << querySequenceNames.size() << " queries (" << total_query_length << "bp) in "
+                        << querySequenceIds.size() << " queries (" << total_query_length << "bp) in "
                         << query_groups.size() << " groups (≈" << std::fixed << std::setprecision(0) << avg_query_size_per_group << "bp/group)" << std::endl
                         << "[wfmash::mashmap] "
                         << target_seq_count << " targets (" << total_target_length << "bp) in "
                         << target_groups.size() << " groups (≈" << std::fixed << std::setprecision(0) << avg_target_size_per_group << "bp/group)" 
                         << std::endl;
 
-              if (p.stage1_topANI_filter) {
-                  this->setProbs();
+              if (!this->loadCutoffTables()) {
+                  if (p.stage1_topANI_filter) {
+                      this->setProbs();
+                  }
+                  this->setIdentityUpperBounds();
+                  this->saveCutoffTables();
+              }
+              if (!param.merge_shards.empty()) {
+                  this->mergeShards();
+              } else if (param.library_mode) {
+                  this->loadResidentIndex();
+              } else if (param.serve_queries) {
+                  this->serveQueries(std::cin, std::cout);
+              } else {
+                  this->mapQuery();
               }
-              this->mapQuery();
           }
 
-      // Removed populateIdManager() function
+      /**
+       * @brief   estimated peak bytes of the indices of target subsets of the given lengths,
+       *          built in turn, the next one prefetched while mapping against one if it fits
+       */
+      static uint64_t peakIndexMemory(const std::vector<uint64_t>& lengths, const skch::Parameters& p)
+      {
+        uint64_t peak = 0;
+        for (size_t i = 0; i < lengths.size(); ++i) {
+            const Sketch::MemoryEstimate estimate = Sketch::estimateMemory(lengths[i], p);
+            peak = std::max(peak, estimate.buildPeak);
+            if (i + 1 < lengths.size()) {
+                const Sketch::MemoryEstimate next = Sketch::estimateMemory(lengths[i + 1], p);
+                if (next.resident <= p.index_prefetch_budget) {
+                    peak = std::max(peak, estimate.resident + next.buildPeak);
+                }
+            }
+        }
+        return peak;
+      }
+
+      const SequenceIdManager& sequenceIds() const
+      {
+        return *idManager;
+      }
+
+      // Lengths of the target subsets, set by a run with param.plan_only
+      const std::vector<uint64_t>& targetSubsetLengths() const
+      {
+        return plannedSubsetLengths;
+      }
+
+      /**
+       * @brief     map sequences held in memory against the resident index of a Map built
+       *            with param.library_mode, calling onMapping with each final mapping
+       * @details   the queries are named and numbered as streamed ones, so a name may repeat
+       *            from one call to the next; onMapping is called from the output threads
+       *            once all the queries are mapped, and may be called concurrently
+       */
+      void mapSequences(const std::vector<std::pair<std::string, std::string>>& queries,
+                        PostProcessResultsFn_t onMapping)
+      {
+        memoryQueryIds.clear();
+        uint64_t total_seq_length = 0;
+        for (const auto& query : queries) {
+            memoryQueryIds.push_back(idManager->addStreamedQuery(query.first, query.second.size()));
+            total_seq_length += query.second.size();
+        }
+        memoryQueries = &queries;
+        processMappingResults = std::move(onMapping);
+
+        std::unordered_map<seqno_t, MappingResultsVector_t> combinedMappings;
+        for (size_t i = 0; i < residentSketches.size(); ++i) {
+            refSketch = residentSketches[i].get();
+            processSubset(i, residentSketches.size(), residentSubsets[i], total_seq_length, combinedMappings);
+        }
+        refSketch = nullptr;
+
+        // The mappings reach onMapping as they are written, the text itself is dropped
+        std::ostream discarded(nullptr);
+        writeCombinedMappings(combinedMappings, discarded);
+        memoryQueries = nullptr;
+        processMappingResults = nullptr;
+      }
 
       ~Map() = default;
 
       private:
-      void buildMetadataFromIndex() {
-          for (const auto& fileName : param.refSequences) {
-              faidx_t* fai = fai_load(fileName.c_str());
-              if (fai == nullptr) {
-                  std::cerr << "Error: Failed to load FASTA index for file " << fileName << std::endl;
-                  exit(1);
+      /**
+       * @brief   the group of every target of a subset under skip_self or skip_prefix, whose
+       *          queries would have all of them excluded, or -1 when they differ or none are skipped
+       */
+      int onlyGroup(const std::vector<std::string>& target_subset) const {
+          if (!(param.skip_self || param.skip_prefix) || target_subset.empty()) {
+              return -1;
+          }
+          const int group = idManager->getRefGroup(idManager->getSequenceId(target_subset.front()));
+          for (const auto& name : target_subset) {
+              if (idManager->getRefGroup(idManager->getSequenceId(name)) != group) {
+                  return -1;
+              }
+          }
+          return group;
+      }
+
+      void buildGroupSeqRuns() {
+          groupSeqRuns.clear();
+          for (seqno_t id = 0; id < seqno_t(idManager->size()); ++id) {
+              auto& runs = groupSeqRuns[idManager->getRefGroup(id)];
+              if (!runs.empty() && runs.back().second == id) {
+                  runs.back().second = id + 1;
+              } else {
+                  runs.emplace_back(id, id + 1);
               }
+          }
+      }
+
+      /**
+       * @brief   hash the len bases of sequence name of fai, false if it cannot be read
+       */
+      static bool hashSequence(faidx_t* fai, const std::string& name, offset_t len, uint64_t hash[2]) {
+          int64_t fetched = 0;
+          char* seq = faidx_fetch_seq64(fai, name.c_str(), 0, int64_t(len) - 1, &fetched);
+          if (seq == nullptr) {
+              return false;
+          }
+          // Hashed in pieces that fit the hash's int length, each seeded by the last
+          hash[0] = hash[1] = 0;
+          for (int64_t pos = 0; pos < fetched; pos += 1 << 30) {
+              MurmurHash3_x64_128(seq + pos, int(std::min<int64_t>(fetched - pos, 1 << 30)),
+                                  uint32_t(hash[0] ^ hash[1]), hash);
+          }
+          std::free(seq);
+          return true;
+      }
 
-              int nseq = faidx_nseq(fai);
-              for (int i = 0; i < nseq; ++i) {
-                  const char* seq_name = faidx_iseq(fai, i);
-                  int seq_len = faidx_seq_len(fai, seq_name);
-                  if (seq_len == -1) {
-                      std::cerr << "Error: Failed to get length for sequence " << seq_name << std::endl;
+      /**
+       * @brief   find the queries whose sequence repeats that of an earlier query, to report
+       *          them from its mappings instead of mapping them again
+       * @details only the queries sharing their length with another are read and hashed.
+       *          Under skip_self/skip_prefix a copy must also share the group of its original,
+       *          so both skip the same targets. Queries streamed, cut into regions or mapped
+       *          to a lower triangle are all mapped.
+       */
+      void findDuplicateQueries() {
+          queryDuplicates.clear();
+          duplicateQueries.clear();
+          if (!param.dedup_queries || param.querySequences.empty() || param.stream_queries
+              || param.query_regions || param.lower_triangular) {
+              return;
+          }
+          std::map<std::pair<offset_t, int>, std::vector<seqno_t>> candidates;
+          for (const seqno_t seqId : querySequenceIds) {
+              const int group = param.skip_self || param.skip_prefix ? idManager->getRefGroup(seqId) : 0;
+              candidates[{idManager->getSequenceLength(seqId), group}].push_back(seqId);
+          }
+          faidx_t* fai = nullptr;
+          for (const auto& candidate : candidates) {
+              const std::vector<seqno_t>& ids = candidate.second;
+              if (ids.size() < 2) {
+                  continue;
+              }
+              if (!fai) {
+                  fai = fai_load(param.querySequences[0].c_str());
+              }
+              std::map<std::pair<uint64_t, uint64_t>, seqno_t> firstOf;
+              for (const seqno_t seqId : ids) {
+                  uint64_t hash[2];
+                  if (!hashSequence(fai, std::string(idManager->getSequenceName(seqId)), candidate.first.first, hash)) {
                       continue;
                   }
-                  // Metadata is now handled by idManager, no need to push_back here
+                  auto first = firstOf.emplace(std::make_pair(hash[0], hash[1]), seqId).first;
+                  if (first->second != seqId) {
+                      queryDuplicates[first->second].push_back(seqId);
+                      duplicateQueries.insert(seqId);
+                  }
               }
-
+          }
+          if (fai) {
               fai_destroy(fai);
           }
+          if (!duplicateQueries.empty()) {
+              std::cerr << "[wfmash::mashmap] " << duplicateQueries.size() << " queries repeat the sequence of "
+                        << queryDuplicates.size() << " others, reported from their mappings" << std::endl;
+          }
+      }
+
+      /**
+       * @brief   starts of the segments a query of length len is mapped in: every segment
+       *          length, and a last one ending with the query
+       */
+      std::vector<offset_t> fragmentStartsOf(offset_t len) const {
+          std::vector<offset_t> fragmentStarts;
+          const offset_t noOverlapFragmentCount = len / param.segLength;
+          for (offset_t i = 0; i < noOverlapFragmentCount; i++) {
+              fragmentStarts.push_back(i * param.segLength);
+          }
+          if (noOverlapFragmentCount >= 1 && len % param.segLength != 0) {
+              fragmentStarts.push_back(len - param.segLength);
+          }
+          return fragmentStarts;
+      }
+
+      /**
+       * @brief   keep the segment sketches of a query indexed as a target, cut from the
+       *          minmers of its windows as the index is built
+       * @details a segment is the window starting where it does, so its sketch is the set of
+       *          minmers whose window interval holds that window. Intervals span at most a
+       *          window, so each segment only looks at those starting less than one before it.
+       */
+      void keepTargetSketches(const std::vector<MinmerInfo>& minmers) {
+          if (minmers.empty() || !targetSketchQueries.count(minmers.front().seqId)) {
+              return;
+          }
+          const seqno_t seqId = minmers.front().seqId;
+          const std::vector<offset_t> fragmentStarts = fragmentStartsOf(idManager->getSequenceLength(seqId));
+          std::vector<std::vector<MinmerInfo>> sketches(fragmentStarts.size());
+          auto first = minmers.begin();
+          for (size_t i = 0; i < fragmentStarts.size(); ++i) {
+              const offset_t start = fragmentStarts[i];
+              first = std::lower_bound(first, minmers.end(), start - param.segLength + 1,
+                                       [](const MinmerInfo& m, offset_t pos) { return m.wpos < pos; });
+              auto& sketch = sketches[i];
+              for (auto it = first; it != minmers.end() && it->wpos <= start; ++it) {
+                  if (it->wpos_end > start) {
+                      sketch.push_back(*it);
+                  }
+              }
+              std::sort(sketch.begin(), sketch.end(), [](const MinmerInfo& l, const MinmerInfo& r) { return l.hash < r.hash; });
+              sketch.erase(std::unique(sketch.begin(), sketch.end(),
+                                       [](const MinmerInfo& l, const MinmerInfo& r) { return l.hash == r.hash; }), sketch.end());
+              if (sketch.size() > size_t(param.sketchSize)) {
+                  sketch.resize(param.sketchSize);
+              }
+          }
+          std::lock_guard<std::mutex> lock(targetSketchMutex);
+          targetSketches[seqId] = std::move(sketches);
+      }
+
+      /**
+       * @brief   give a query the segment sketches kept from the target index, if any; one
+       *          replayed from the query sketch file has its own
+       */
+      void takeTargetSketches(InputSeqProgContainer* input) {
+          std::lock_guard<std::mutex> lock(targetSketchMutex);
+          auto found = targetSketches.find(input->seqId);
+          if (found == targetSketches.end()) {
+              return;
+          }
+          if (input->fragmentSketches.empty()) {
+              input->fragmentSketches = std::move(found->second);
+          }
+          targetSketches.erase(found);
       }
 
       public:
@@ -313,13 +1073,13 @@ namespace skch
             ss + 1,
             std::vector<double>(ss + 1.0)
         );
-        for (auto ci = 0; ci <= ss; ci++) 
+        parallelFor(ss + 1, [&](int ci)
         {
           for (double y = 0; y <= ci; y++) 
           {
             sketchProbs[ci][y] = gsl_ran_hypergeometric_pdf(y, ss, ss-ci, ci);
           }
-        }
+        });
         
         // Return true iff Pr(ANI_i >= ANI_max - deltaANI) >= min_p
         const auto distDiff = [this, &sketchProbs, deltaANI, min_p, ss] (int cmax, int ci) {
@@ -355,8 +1115,9 @@ namespace skch
         std::vector<int> ss_range(ss+1);
         std::iota (ss_range.begin(), ss_range.end(), 0);
 
-        for (auto cmax = 1; cmax <= ss; cmax++) 
+        parallelFor(ss, [&](int i)
         {
+          const int cmax = i + 1;
           // Binary search to find the lowest acceptable ci
           int ci = std::distance(
               ss_range.begin(),
@@ -377,20 +1138,164 @@ namespace skch
           if (sketchCutoffs[cmax] == 0) {
             sketchCutoffs[cmax] = 1;
           }
-        }
+        });
         //for (auto overlap = 1; overlap <= ss; overlap++) 
         //{
           //DEBUG_ASSERT(sketchCutoffs[overlap] <= overlap);
         //}
       }
 
+      /**
+       * @brief   tabulate the L2 identity upper bound of every shared sketch size of a full
+       *          query sketch, as doL2Mapping computes it
+       */
+      void setIdentityUpperBounds()
+      {
+        identityUpperBounds.resize(param.sketchSize + 1);
+        parallelFor(param.sketchSize + 1, [&](int shared)
+        {
+          identityUpperBounds[shared] = identityUpperBound(shared, param.sketchSize);
+        });
+      }
+
+      float identityUpperBound(int sharedSketchSize, int sketchSize) const
+      {
+        float mash_dist = Stat::j2md(1.0 * sharedSketchSize/sketchSize, param.kmerSize);
+        return 1 - Stat::md_lower_bound(mash_dist, sketchSize, param.kmerSize, skch::fixed::confidence_interval);
+      }
+
+      /**
+       * @brief   run fn(0) ... fn(n - 1) over the mapping threads
+       */
+      void parallelFor(int n, const std::function<void(int)>& fn) const
+      {
+        std::atomic<int> next(0);
+        std::vector<std::thread> threads;
+        const int stage = sampling_profiler::thread_stage();
+        for (int t = 0; t < std::min(std::max(param.threads, 1), n); ++t) {
+          threads.emplace_back([&, t]() {
+            sampling_profiler::name_thread("helper", stage, t);
+            for (int i = next++; i < n; i = next++)
+              fn(i);
+          });
+        }
+        for (auto& thread : threads)
+          thread.join();
+      }
+
+      /**
+       * Cutoff tables sidecar, next to the index as <index>.cutoffs:
+       *   magic cutoffTablesMagic, int sketchSize, int kmerSize, float percentageIdentity,
+       *   float ANIDiff, float ANIDiffConf, uint64_t hasSketchCutoffs,
+       *   uint64_t n, int sketchCutoffs[n], uint64_t m, float identityUpperBounds[m]
+       * It is only used when every key field matches.
+       */
+      static constexpr uint64_t cutoffTablesMagic = 0xDEADBEEFCAFEC0F1;
+
+      struct CutoffTablesKey
+      {
+        int sketchSize;
+        int kmerSize;
+        float percentageIdentity;
+        float ANIDiff;
+        float ANIDiffConf;
+        uint64_t hasSketchCutoffs;
+        bool operator==(const CutoffTablesKey& o) const {
+          return std::tie(sketchSize, kmerSize, percentageIdentity, ANIDiff, ANIDiffConf, hasSketchCutoffs)
+              == std::tie(o.sketchSize, o.kmerSize, o.percentageIdentity, o.ANIDiff, o.ANIDiffConf, o.hasSketchCutoffs);
+        }
+      };
+
+      CutoffTablesKey cutoffTablesKey() const
+      {
+        return CutoffTablesKey{int(param.sketchSize), param.kmerSize, param.percentageIdentity,
+                               param.ANIDiff, param.ANIDiffConf, param.stage1_topANI_filter};
+      }
+
+      std::string cutoffTablesFilename() const
+      {
+        return param.indexFilename.empty() ? std::string() : param.indexFilename.string() + ".cutoffs";
+      }
+
+      /**
+       * @brief   read the cutoff tables of these parameters from the index sidecar
+       * @return  false, leaving the tables as they were, if there is none for them
+       */
+      bool loadCutoffTables()
+      {
+        const std::string filename = cutoffTablesFilename();
+        if (filename.empty())
+          return false;
+        std::ifstream in(filename, std::ios::binary);
+        uint64_t magic = 0;
+        CutoffTablesKey key = {};
+        in.read((char*)&magic, sizeof(magic));
+        in.read((char*)&key.sketchSize, sizeof(key.sketchSize));
+        in.read((char*)&key.kmerSize, sizeof(key.kmerSize));
+        in.read((char*)&key.percentageIdentity, sizeof(key.percentageIdentity));
+        in.read((char*)&key.ANIDiff, sizeof(key.ANIDiff));
+        in.read((char*)&key.ANIDiffConf, sizeof(key.ANIDiffConf));
+        in.read((char*)&key.hasSketchCutoffs, sizeof(key.hasSketchCutoffs));
+        if (!in || magic != cutoffTablesMagic || !(key == cutoffTablesKey()))
+          return false;
+
+        uint64_t n = 0, m = 0;
+        std::vector<int> cutoffs;
+        std::vector<float> bounds;
+        in.read((char*)&n, sizeof(n));
+        if (!in || n != sketchCutoffs.size())
+          return false;
+        cutoffs.resize(n);
+        in.read((char*)cutoffs.data(), n * sizeof(int));
+        in.read((char*)&m, sizeof(m));
+        if (!in || m != uint64_t(param.sketchSize) + 1)
+          return false;
+        bounds.resize(m);
+        in.read((char*)bounds.data(), m * sizeof(float));
+        if (!in)
+          return false;
+
+        sketchCutoffs = std::move(cutoffs);
+        identityUpperBounds = std::move(bounds);
+        std::cerr << "[wfmash::mashmap] Loaded cutoff tables from " << filename << std::endl;
+        return true;
+      }
+
+      /**
+       * @brief   write the cutoff tables to the index sidecar for later runs, if there is an index
+       */
+      void saveCutoffTables() const
+      {
+        const std::string filename = cutoffTablesFilename();
+        if (filename.empty())
+          return;
+        std::ofstream out(filename, std::ios::binary);
+        const CutoffTablesKey key = cutoffTablesKey();
+        const uint64_t n = sketchCutoffs.size();
+        const uint64_t m = identityUpperBounds.size();
+        out.write((const char*)&cutoffTablesMagic, sizeof(cutoffTablesMagic));
+        out.write((const char*)&key.sketchSize, sizeof(key.sketchSize));
+        out.write((const char*)&key.kmerSize, sizeof(key.kmerSize));
+        out.write((const char*)&key.percentageIdentity, sizeof(key.percentageIdentity));
+        out.write((const char*)&key.ANIDiff, sizeof(key.ANIDiff));
+        out.write((const char*)&key.ANIDiffConf, sizeof(key.ANIDiffConf));
+        out.write((const char*)&key.hasSketchCutoffs, sizeof(key.hasSketchCutoffs));
+        out.write((const char*)&n, sizeof(n));
+        out.write((const char*)sketchCutoffs.data(), n * sizeof(int));
+        out.write((const char*)&m, sizeof(m));
+        out.write((const char*)identityUpperBounds.data(), m * sizeof(float));
+        if (!out) {
+          std::cerr << "[wfmash::mashmap] WARNING, unable to save cutoff tables to " << filename << std::endl;
+        }
+      }
+
       /**
        * @brief   parse over sequences in query file and map each on the reference
        */
-      void reader_thread(input_atomic_queue_t& input_queue,
-                         std::atomic<bool>& reader_done,
+      void reader_thread(input_queue_t& input_queue,
                          progress_meter::ProgressMeter& progress,
-                         SequenceIdManager& idManager) {
+                         SequenceIdManager& idManager,
+                         seqno_t firstTargetSeqId = std::numeric_limits<seqno_t>::min()) {
           // Define allowed_query_names here
           std::unordered_set<std::string> allowed_query_names;
           if (!param.query_list.empty()) {
@@ -401,99 +1306,480 @@ namespace skch
               }
           }
 
-          if (!param.querySequences.empty()) {
-              const auto& fileName = param.querySequences[0]; // Assume single query input file
+          // Under lower_triangular a query maps only to targets of lower ids, so none of the
+          // subset's above firstTargetSeqId; those queries are not read, aside from recording
+          // the sketches replayed against the later subsets. Nor are those a resumed job
+          // mapped against the subset before
+          const auto mapsToSubset = [&](seqno_t seqId) {
+              return (!param.lower_triangular || recordQuerySketches || seqId > firstTargetSeqId)
+                  && (subsetOnlyGroup < 0 || recordQuerySketches || idManager.getRefGroup(seqId) != subsetOnlyGroup)
+                  && (!subsetCached || recordQuerySketches || !cachedQuery[seqId])
+                  && !resumedQueries.count(seqId);
+          };
+
+          // Queries are numbered as they are read, for the output to keep their order
+          uint64_t ordinal = 0;
+          const auto enqueue = [&](InputSeqProgContainer* input) {
+              if (!mapsToSubset(input->seqId)) {
+                  progress.increment(input->len);
+                  delete input;
+                  return;
+              }
+              if (!targetSketchQueries.empty()) {
+                  takeTargetSketches(input);
+              }
+              if (param.pack_queries && input->seq) {
+                  packQuery(*input);
+              }
+              // The queries repeating it follow it in the output
+              const auto duplicates = queryDuplicates.find(input->seqId);
+              input->ordinal = ordinal;
+              ordinal += 1 + (duplicates != queryDuplicates.end() ? duplicates->second.size() : 0);
+              input->budgetBytes = queuedBytes(*input);
+              queue_budget::shared().acquire(input->budgetBytes);
+              input_queue.push(input);
+          };
+
+          if (memoryQueries) {
+              // Copied, as the mapping frees the sequence once the query is merged
+              for (size_t i = 0; i < memoryQueries->size(); ++i) {
+                  const auto& [seq_name, seq] = (*memoryQueries)[i];
+                  SeqBuffer buffer(static_cast<char*>(std::malloc(seq.size() + 1)), &std::free);
+                  std::memcpy(buffer.get(), seq.c_str(), seq.size() + 1);
+                  enqueue(new InputSeqProgContainer(std::move(buffer), seq.size(), seq_name, memoryQueryIds[i], progress));
+              }
+          } else if (replayQuerySketches) {
+              replayQuerySketchFile(enqueue, progress);
+          } else if (!param.querySequences.empty() && param.stream_queries) {
+              // Read the queries in file order, without a FASTA index, and number them as they come
               seqiter::for_each_seq_in_file(
-                  fileName,
-                  querySequenceNames,
+                  param.querySequences[0], std::unordered_set<std::string>(), "",
                   [&](const std::string& seq_name, const std::string& seq) {
-                      seqno_t seqId = idManager.getSequenceId(seq_name);
-                      auto input = new InputSeqProgContainer(seq, seq_name, seqId, progress);
-                      while (!input_queue.try_push(input)) {
-                          std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                      const bool prefixMatch = param.query_prefix.empty() || std::any_of(param.query_prefix.begin(), param.query_prefix.end(),
+                          [&](const std::string& prefix) { return seq_name.compare(0, prefix.size(), prefix) == 0; });
+                      if (!prefixMatch || (!allowed_query_names.empty() && !allowed_query_names.count(seq_name))) {
+                          return;
                       }
+                      shared_sequences::shared().add(param.querySequences[0], seq_name, seq.data(), seq.size());
+                      SeqBuffer buffer(static_cast<char*>(std::malloc(seq.size() + 1)), &std::free);
+                      std::memcpy(buffer.get(), seq.c_str(), seq.size() + 1);
+                      seqno_t seqId = idManager.addStreamedQuery(seq_name, seq.size());
+                      progress.total += seq.size();
+                      enqueue(new InputSeqProgContainer(std::move(buffer), seq.size(), seq_name, seqId, progress));
+                  }, param.threads);
+          } else if (!param.querySequences.empty() && param.query_regions) {
+              // Each interval of the BED is mapped as a query of its own, reported in the
+              // coordinates of the whole sequence
+              faidx_t* fai = fai_load(param.querySequences[0].c_str());
+              for (const seqno_t seqId : querySequenceIds) {
+                  const std::string seq_name(idManager.getSequenceName(seqId));
+                  const offset_t seqLength = idManager.getSequenceLength(seqId);
+                  if (!mapsToSubset(seqId)) {
+                      continue;
+                  }
+                  param.query_regions->forEach(seq_name, seqLength, [&](offset_t start, offset_t end) {
+                      int64_t len = 0;
+                      char* seq = faidx_fetch_seq64(fai, seq_name.c_str(), start, end - 1, &len);
+                      if (seq == nullptr) {
+                          return;
+                      }
+                      auto input = new InputSeqProgContainer(SeqBuffer(seq, &std::free), len, seq_name, seqId, progress);
+                      input->regionStart = start;
+                      input->fullLen = seqLength;
+                      enqueue(input);
                   });
+              }
+              fai_destroy(fai);
+          } else if (!param.querySequences.empty()) {
+              // Fetched by id, the names handed straight from the id manager
+              faidx_t* fai = fai_load(param.querySequences[0].c_str()); // Assume single query input file
+              for (const seqno_t seqId : queryReadOrder.empty() ? querySequenceIds : queryReadOrder) {
+                  if (!mapsToSubset(seqId) || duplicateQueries.count(seqId)) {
+                      progress.increment(idManager.getSequenceLength(seqId));
+                      continue;
+                  }
+                  const std::string_view seq_name = idManager.getSequenceName(seqId);
+                  int64_t len = 0;
+                  char* seq = faidx_fetch_seq64(fai, seq_name.data(), 0, INT64_MAX, &len);
+                  if (seq != nullptr) {
+                      shared_sequences::shared().add(param.querySequences[0], std::string(seq_name), seq, len);
+                      enqueue(new InputSeqProgContainer(SeqBuffer(seq, &std::free), len, std::string(seq_name), seqId, progress));
+                  }
+              }
+              fai_destroy(fai);
           }
-          reader_done.store(true);
+          input_queue.close();
       }
 
-      void worker_thread(input_atomic_queue_t& input_queue,
-                         fragment_atomic_queue_t& fragment_queue,
-                         merged_mappings_queue_t& merged_queue,
-                         progress_meter::ProgressMeter& progress,
-                         std::atomic<bool>& reader_done,
-                         std::atomic<bool>& workers_done) {
-          while (true) {
-              InputSeqProgContainer* input = nullptr;
-              if (input_queue.try_pop(input)) {
-                  auto output = mapModule(input, fragment_queue);
-                  //progress.increment(input->len / 4);
-                  while (!merged_queue.try_push(output)) {
-                      std::this_thread::sleep_for(std::chrono::milliseconds(10));
-                  }
-                  delete input;
-              } else if (reader_done.load() && input_queue.was_empty()) {
-                  break;
-              } else {
-                  std::this_thread::sleep_for(std::chrono::milliseconds(10));
-              }
+      // Bytes of a query counted against the queue budget: its sequence, packed or not, or
+      // the sketches replayed in its place
+      static uint64_t queuedBytes(const InputSeqContainer& input) {
+          uint64_t bytes = input.seq ? input.len : input.packed ? input.packed->bytes() : 0;
+          for (const auto& sketch : input.fragmentSketches) {
+              bytes += sketch.size() * sizeof(MinmerInfo);
           }
+          return bytes;
       }
 
-      void writer_thread(query_output_atomic_queue_t& output_queue,
-                         std::atomic<bool>& workers_done,
-                         seqno_t& totalReadsMapped,
-                         std::ofstream& outstrm,
-                         progress_meter::ProgressMeter& progress,
-                         MappingResultsVector_t& allReadMappings) {
-          int wait_count = 0;
+      /**
+       * @brief   keep a queued query 2-bit packed, as the shared sequences are, its bases
+       *          freed until unpackQuery brings them back
+       * @details the sketching upper-cases the bases and turns anything but ACGT to N, so
+       *          the packed bases, with their runs of N, sketch the same
+       */
+      static void packQuery(InputSeqContainer& input) {
+          input.packed.reset(new shared_sequences::Packed());
+          shared_sequences::pack(input.seq.get(), input.len, *input.packed);
+          input.seq.reset();
+      }
+
+      /**
+       * @brief   decode the bases of a packed query once it is taken up for mapping, its
+       *          fragments pointing into them until it is merged; counted against the
+       *          queue budget at their size from then on
+       */
+      static void unpackQuery(InputSeqContainer& input) {
+          SeqBuffer seq(static_cast<char*>(std::malloc(input.len + 1)), &std::free);
+          shared_sequences::unpack(*input.packed, seq.get());
+          seq[input.len] = '\0';
+          const uint64_t packedBytes = input.packed->bytes();
+          input.seq = std::move(seq);
+          input.packed.reset();
+          queue_budget::shared().force_acquire(input.len);
+          queue_budget::shared().release(packedBytes);
+          input.budgetBytes += input.len - packedBytes;
+      }
+
+      /**
+       * @brief   append the fragment sketches of a query to the query sketch file
+       * @details one record per query: id, length, name, then each fragment's minmers
+       */
+      void writeQuerySketches(seqno_t seqId, offset_t len, const std::string& name,
+                              const std::vector<std::vector<MinmerInfo>>& sketches)
+      {
+          std::lock_guard<std::mutex> lock(querySketchMutex);
+          const uint64_t nameLength = name.size();
+          const uint64_t fragmentCount = sketches.size();
+          querySketchOut.write(reinterpret_cast<const char*>(&seqId), sizeof(seqId));
+          querySketchOut.write(reinterpret_cast<const char*>(&len), sizeof(len));
+          querySketchOut.write(reinterpret_cast<const char*>(&nameLength), sizeof(nameLength));
+          querySketchOut.write(name.data(), nameLength);
+          querySketchOut.write(reinterpret_cast<const char*>(&fragmentCount), sizeof(fragmentCount));
+          for (const auto& sketch : sketches) {
+              const uint64_t size = sketch.size();
+              querySketchOut.write(reinterpret_cast<const char*>(&size), sizeof(size));
+              querySketchOut.write(reinterpret_cast<const char*>(sketch.data()), size * sizeof(MinmerInfo));
+          }
+      }
+
+      /**
+       * @brief   queue the queries recorded in the query sketch file, carrying their
+       *          fragment sketches instead of their sequence
+       */
+      void replayQuerySketchFile(const std::function<void(InputSeqProgContainer*)>& enqueue, progress_meter::ProgressMeter& progress)
+      {
+          std::ifstream in(param.query_sketch_file, std::ios::binary);
+          if (!in) {
+              std::cerr << "[wfmash::mashmap] ERROR, unable to read query sketches from " << param.query_sketch_file << std::endl;
+              exit(1);
+          }
+          seqno_t seqId;
+          offset_t len;
+          uint64_t nameLength;
+          uint64_t fragmentCount;
+          while (in.read(reinterpret_cast<char*>(&seqId), sizeof(seqId))) {
+              in.read(reinterpret_cast<char*>(&len), sizeof(len));
+              in.read(reinterpret_cast<char*>(&nameLength), sizeof(nameLength));
+              std::string name(nameLength, '\0');
+              in.read(&name[0], nameLength);
+              in.read(reinterpret_cast<char*>(&fragmentCount), sizeof(fragmentCount));
+              auto input = new InputSeqProgContainer(SeqBuffer(nullptr, &std::free), len, name, seqId, progress);
+              input->fragmentSketches.resize(fragmentCount);
+              for (auto& sketch : input->fragmentSketches) {
+                  uint64_t size = 0;
+                  in.read(reinterpret_cast<char*>(&size), sizeof(size));
+                  sketch.resize(size);
+                  in.read(reinterpret_cast<char*>(sketch.data()), size * sizeof(MinmerInfo));
+              }
+              if (!in) {
+                  std::cerr << "[wfmash::mashmap] ERROR, truncated query sketch file " << param.query_sketch_file << std::endl;
+                  exit(1);
+              }
+              enqueue(input);
+          }
+      }
+
+      /**
+       * @brief     map fragments until every query is mapped, its own first, then stolen
+       *            ones, splitting up a new query only when no fragment is left anywhere
+       * @details   queries_in_flight counts queries popped but not yet merged, so no worker
+       *            quits while another may still create fragments it could steal. An idle
+       *            worker sleeps until new input, new fragments or the last merge.
+       */
+      void worker_thread(int worker, MappingPipeline& pipeline) {
+          MappingScratch scratch;
+          profile::QueueWaits* idle = profile::queueWaits("work_ready");
+
           while (true) {
-              QueryMappingOutput* output = nullptr;
-              if (output_queue.try_pop(output)) {
-                  wait_count = 0;
-                  if(output->results.size() > 0)
-                      totalReadsMapped++;
-                  if (param.filterMode == filter::ONETOONE) {
-                      allReadMappings.insert(allReadMappings.end(), output->results.begin(), output->results.end());
-                  } else {
-                      reportReadMappings(output->results, output->queryName, outstrm);
+              const uint64_t ticket = pipeline.work_ready.ticket();
+              FragmentData* fragment = nullptr;
+              if (pipeline.fragment_pool.pop(worker, fragment) || pipeline.fragment_pool.steal(worker, fragment)) {
+                  processFragment(fragment, scratch, pipeline);
+                  continue;
+              }
+              // Queries are taken a batch at a time while the queue is deep, so a run of
+              // small ones costs one pop
+              pipeline.queries_in_flight.fetch_add(1);
+              if (pipeline.input_queue.try_pop_some(scratch.inputs, smallQueryBatch, pipeline.workers)) {
+                  pipeline.queries_in_flight.fetch_add(scratch.inputs.size() - 1);
+                  for (InputSeqProgContainer* input : scratch.inputs) {
+                      mapModule(input, worker, pipeline, scratch);
                   }
-                  delete output;
               } else {
-                  if (workers_done.load() && output_queue.was_empty()) {
-                      ++wait_count;
-                  }
-                  if (wait_count > 10) {
+                  pipeline.queries_in_flight.fetch_sub(1);
+                  if (pipeline.input_queue.drained() && pipeline.queries_in_flight.load() == 0) {
+                      pipeline.work_ready.notify();
                       break;
                   }
-                  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                  const uint64_t start = idle ? profile::ticks() : 0;
+                  pipeline.work_ready.wait(ticket);
+                  if (idle) {
+                      idle->popWaits++;
+                      idle->popTicks += profile::ticks() - start;
+                  }
               }
           }
       }
 
+      void writer_thread(query_output_queue_t& output_queue,
+                         seqno_t& totalReadsMapped,
+                         std::ofstream& outstrm,
+                         progress_meter::ProgressMeter& progress,
+                         MappingResultsVector_t& allReadMappings) {
+          QueryMappingOutput* output = nullptr;
+          while (output_queue.pop(output)) {
+              if(output->results.size() > 0)
+                  totalReadsMapped++;
+              if (param.filterMode == filter::ONETOONE) {
+                  allReadMappings.insert(allReadMappings.end(), output->results.begin(), output->results.end());
+              } else {
+                  reportReadMappings(output->results, output->queryName, outstrm,
+                                     chainIdsReported.fetch_add(output->results.size()));
+              }
+              delete output;
+          }
+      }
+
+      /**
+       * @brief   bp of targets an index subset may hold for the run to fit max_memory, or
+       *          the memory of the machine or its cgroup
+       * @details The bytes per base are those estimateMemory gives at the peak of building an
+       *          index, with the one before it resident when the next is prefetched. Queued
+       *          queries, and the mapping and alignment buffers of each thread, are held back
+       *          from the limit, along with a tenth of it for what is not accounted.
+       */
+      int64_t autoIndexBatchSize(uint64_t total_length) const
+      {
+        const uint64_t limit = param.max_memory ? param.max_memory : memory::availableBytes();
+        const uint64_t headroom = param.queue_memory + uint64_t(param.threads) * autoThreadHeadroom + limit / 10;
+        uint64_t usable = limit > headroom ? limit - headroom : limit / 4;
+        if (limit <= headroom) {
+            std::cerr << "[wfmash::mashmap] WARNING, " << memory::humanBytes(limit) << " of memory leaves no room past "
+                      << memory::humanBytes(headroom) << " for queues and buffers; sizing index subsets for "
+                      << memory::humanBytes(usable) << std::endl;
+        }
+
+        const uint64_t sample = 1ULL << 30;
+        const Sketch::MemoryEstimate estimate = Sketch::estimateMemory(sample, param);
+        const double perBase = double(estimate.buildPeak + (param.index_prefetch_budget > 0 ? estimate.resident : 0)) / sample;
+        const int64_t batch = std::max<int64_t>(autoMinimumBatch,
+            std::min<double>(std::numeric_limits<int64_t>::max(), usable / std::max(perBase, 1e-9)));
+        std::cerr << "[wfmash::mashmap] Sizing index subsets to " << batch << "bp for "
+                  << memory::humanBytes(usable) << " of " << memory::humanBytes(limit) << " of memory, "
+                  << memory::humanBytes(perBase * 1e6) << " per Mbp of " << total_length << "bp of targets" << std::endl;
+        return batch;
+      }
+
+      // Held back per thread by autoIndexBatchSize, and the least batch it gives
+      static constexpr uint64_t autoThreadHeadroom = 256ULL << 20;
+      static constexpr int64_t autoMinimumBatch = 1000000;
+
+      /**
+       * @brief   split the targets into as few subsets of at most index_by_size bp as it
+       *          takes, balanced by length
+       * @details index memory and query hits both scale with target length. Starting from
+       *          the least possible number of subsets, the targets are placed longest first
+       *          into the currently shortest subset, opening a new one when even that has no
+       *          room; a target longer than index_by_size gets a subset of its own.
+       *          Under skip_self or skip_prefix the targets of a group, such as a genome of
+       *          PanSN names, are placed together wherever they fit, so a subset holding one
+       *          group alone is skipped by the queries of that group; see subsetOnlyGroup.
+       *          Each subset keeps its targets, and the subsets their first target, in input order.
+       */
       std::vector<std::vector<std::string>> createTargetSubsets(const std::vector<std::string>& targetSequenceNames) {
+        uint64_t total_length = 0;
+        std::vector<uint64_t> lengths(targetSequenceNames.size());
+        for (size_t i = 0; i < targetSequenceNames.size(); ++i) {
+            lengths[i] = idManager->getSequenceLength(idManager->getSequenceId(targetSequenceNames[i]));
+            total_length += lengths[i];
+        }
+        if (lengths.empty()) {
+            return {};
+        }
+        if (param.index_by_auto) {
+            param.index_by_size = autoIndexBatchSize(total_length);
+        }
+        const uint64_t budget = std::max<uint64_t>(1, param.index_by_size);
+
+        // Units placed whole, as (length, targets): each target, or under group skipping
+        // each group that fits a subset, its targets in input order
+        std::vector<std::pair<uint64_t, std::vector<size_t>>> units;
+        if (param.skip_self || param.skip_prefix) {
+            std::map<int, std::pair<uint64_t, std::vector<size_t>>> groups;
+            for (size_t i = 0; i < targetSequenceNames.size(); ++i) {
+                auto& group = groups[idManager->getRefGroup(idManager->getSequenceId(targetSequenceNames[i]))];
+                group.first += lengths[i];
+                group.second.push_back(i);
+            }
+            for (auto& [id, group] : groups) {
+                if (group.first <= budget) {
+                    units.push_back(std::move(group));
+                } else {
+                    for (size_t i : group.second) {
+                        units.push_back({lengths[i], {i}});
+                    }
+                }
+            }
+        } else {
+            for (size_t i = 0; i < targetSequenceNames.size(); ++i) {
+                units.push_back({lengths[i], {i}});
+            }
+        }
+        std::sort(units.begin(), units.end(), [](const auto& a, const auto& b) {
+            return a.first != b.first ? a.first > b.first : a.second.front() < b.second.front();
+        });
+
+        const uint64_t count = std::min<uint64_t>(units.size(), total_length / budget + (total_length % budget != 0));
+        std::vector<std::vector<size_t>> members(std::max<uint64_t>(1, count));
+        // (length, subset), shortest subset on top
+        std::priority_queue<std::pair<uint64_t, size_t>, std::vector<std::pair<uint64_t, size_t>>, std::greater<>> shortest;
+        for (size_t j = 0; j < members.size(); ++j) {
+            shortest.emplace(0, j);
+        }
+        for (const auto& [unitLen, unit] : units) {
+            auto [length, j] = shortest.top();
+            if (length + unitLen > budget && !members[j].empty()) {
+                // No subset has room left
+                length = 0;
+                j = members.size();
+                members.emplace_back();
+            } else {
+                shortest.pop();
+            }
+            members[j].insert(members[j].end(), unit.begin(), unit.end());
+            shortest.emplace(length + unitLen, j);
+        }
+
+        for (auto& subset : members) {
+            std::sort(subset.begin(), subset.end());
+        }
+        std::sort(members.begin(), members.end());
+
         std::vector<std::vector<std::string>> target_subsets;
-        uint64_t current_subset_size = 0;
-        std::vector<std::string> current_subset;
+        for (const auto& subset : members) {
+            target_subsets.emplace_back();
+            for (size_t i : subset) {
+                target_subsets.back().push_back(targetSequenceNames[i]);
+            }
+        }
+        return target_subsets;
+      }
 
-        for (const auto& seqName : targetSequenceNames) {
-            seqno_t seqId = idManager->getSequenceId(seqName);
-            offset_t seqLen = idManager->getSequenceLength(seqId);
-            current_subset.push_back(seqName);
-            current_subset_size += seqLen;
+      /**
+       * @brief   subsets stored in the index file, in file order, restricted to those selected
+       *          with --index-subsets; an update may have added some since it was first built
+       * @details several index files are one index, their subsets numbered on from file to
+       *          file, so they must all hash the targets alike
+       */
+      std::vector<Sketch::IndexSubset> indexedTargetSubsets() {
+        const stdfs::path indexFilename = param.indexFilename;
+        const std::vector<stdfs::path> indexFiles = param.indexFiles.empty()
+            ? std::vector<stdfs::path>{indexFilename} : param.indexFiles;
+        std::vector<Sketch::IndexSubset> stored;
+        for (size_t f = 0; f < indexFiles.size(); ++f) {
+            const skch::Parameters previous = param;
+            param.indexFilename = indexFiles[f];
+            for (auto& subset : Sketch::scanIndex(param, *idManager)) {
+                subset.file = indexFiles[f];
+                stored.push_back(std::move(subset));
+            }
+            if (f > 0 && (param.kmerHashEngine != previous.kmerHashEngine
+                          || param.use_spaced_seeds != previous.use_spaced_seeds
+                          || param.spaced_seeds.size() != previous.spaced_seeds.size()
+                          || param.spaced_seed_sensitivity != previous.spaced_seed_sensitivity)) {
+                std::cerr << "[wfmash::mashmap] ERROR, index file " << indexFiles[f]
+                          << " hashes k-mers differently from " << indexFiles[0] << std::endl;
+                exit(1);
+            }
+        }
+        param.indexFilename = indexFilename;
+        std::vector<Sketch::IndexSubset> selected;
+        if (param.index_subsets.empty()) {
+            selected = std::move(stored);
+        } else {
+            for (uint64_t i : param.index_subsets) {
+                if (i >= stored.size()) {
+                    std::cerr << "Error: Index subset " << i << " requested, the index has " << stored.size() << " subsets." << std::endl;
+                    exit(1);
+                }
+                selected.push_back(stored[i]);
+            }
+        }
 
-            if (current_subset_size >= param.index_by_size || &seqName == &targetSequenceNames.back()) {
-                if (!current_subset.empty()) {
-                    target_subsets.push_back(current_subset);
+        std::unordered_set<std::string> targets(targetSequenceNames.begin(), targetSequenceNames.end());
+        for (const auto& subset : selected) {
+            for (const auto& seqName : subset.sequenceNames) {
+                if (!targets.count(seqName)) {
+                    std::cerr << "Error: Sequence " << seqName << " in the index is not among the target sequences." << std::endl;
+                    exit(1);
                 }
-                current_subset.clear();
-                current_subset_size = 0;
             }
         }
-        if (!current_subset.empty()) {
-            target_subsets.push_back(current_subset);
+        return selected;
+      }
+
+      /**
+       * @brief   subsets of the targets missing from the index being updated
+       * @details new sketches are filtered with the frequency cutoff the index was built with,
+       *          and drop the hashes it already filtered, so -F stays consistent across updates
+       */
+      std::vector<std::vector<std::string>> targetSubsetsToAdd() {
+        std::unordered_set<std::string> indexed;
+        uint64_t countThreshold = 0;
+        std::vector<hash_t> frequent;
+        for (const auto& subset : Sketch::scanIndex(param, *idManager)) {
+            indexed.insert(subset.sequenceNames.begin(), subset.sequenceNames.end());
+            countThreshold = std::max(countThreshold, subset.countThreshold);
+            frequent.insert(frequent.end(), subset.frequentHashes.begin(), subset.frequentHashes.end());
+        }
+        std::sort(frequent.begin(), frequent.end());
+        frequent.erase(std::unique(frequent.begin(), frequent.end()), frequent.end());
+
+        std::vector<std::string> newTargets;
+        for (const auto& seqName : targetSequenceNames) {
+            if (!indexed.count(seqName)) {
+                newTargets.push_back(seqName);
+            }
         }
-        return target_subsets;
+        std::cerr << "[wfmash::mashmap] Updating index: " << indexed.size() << " sequences already indexed, "
+                  << newTargets.size() << " to add" << std::endl;
+
+        if (countThreshold > 0) {
+            param.max_kmer_freq = countThreshold;
+            param.auto_kmer_freq = false;
+        }
+        param.frequent_hashes = std::move(frequent);
+        return createTargetSubsets(newTargets);
       }
 
       void mapQuery()
@@ -505,7 +1791,11 @@ namespace skch
         seqno_t totalReadsPickedForMapping = 0;
         seqno_t totalReadsMapped = 0;
 
-        std::ofstream outstrm(param.outFileName);
+        std::unique_ptr<std::ostream> outfile;
+        if (!mappingOut) {
+            outfile = openOutputFile();
+        }
+        std::ostream& outstrm = mappingOut ? *mappingOut : *outfile;
 
         // Get sequence names from ID manager
 
@@ -521,28 +1811,77 @@ namespace skch
 
         // Calculate total query length
         uint64_t total_query_length = 0;
-        for (const auto& seqName : querySequenceNames) {
-            total_query_length += idManager->getSequenceLength(idManager->getSequenceId(seqName));
+        for (const seqno_t seqId : querySequenceIds) {
+            total_query_length += idManager->getSequenceLength(seqId);
         }
 
-
-        // Initialize atomic queues and flags
-        input_atomic_queue_t input_queue;
-        merged_mappings_queue_t merged_queue;
-        fragment_atomic_queue_t fragment_queue;
-        writer_atomic_queue_t writer_queue;
-
-        this->querySequenceNames = idManager->getQuerySequenceNames();
+        this->querySequenceIds = idManager->getQuerySequenceIds();
         this->targetSequenceNames = idManager->getTargetSequenceNames();
 
         // Count the total number of sequences and sequence length
-        uint64_t total_seqs = querySequenceNames.size();
+        uint64_t total_seqs = querySequenceIds.size();
         uint64_t total_seq_length = 0;
-        for (const auto& seqName : querySequenceNames) {
-            total_seq_length += idManager->getSequenceLength(idManager->getSequenceId(seqName));
+        for (const seqno_t seqId : querySequenceIds) {
+            total_seq_length += idManager->getSequenceLength(seqId);
+        }
+        if (param.query_regions) {
+            total_seq_length = 0;
+            for (const seqno_t seqId : querySequenceIds) {
+                param.query_regions->forEach(std::string(idManager->getSequenceName(seqId)), idManager->getSequenceLength(seqId),
+                                             [&](offset_t start, offset_t end) { total_seq_length += end - start; });
+            }
         }
 
-        std::vector<std::vector<std::string>> target_subsets = createTargetSubsets(targetSequenceNames);
+        if (!param.mapping_cache.empty() && !param.create_index_only) {
+            loadMappingCache();
+        }
+        if (param.cost_tags || !param.slow_query_file.empty()) {
+            queryCosts.reset(new profile::QueryCost[idManager->size()]());
+        }
+
+        bool appendToIndex = false;
+        std::vector<std::vector<std::string>> target_subsets;
+        std::vector<uint64_t> target_subset_offsets;
+        std::vector<uint64_t> target_subset_bytes;
+        std::vector<stdfs::path> target_subset_files;
+        if (!param.indexFilename.empty() && !param.create_index_only) {
+            for (auto& subset : indexedTargetSubsets()) {
+                target_subsets.push_back(std::move(subset.sequenceNames));
+                target_subset_offsets.push_back(subset.offset);
+                target_subset_bytes.push_back(subset.size);
+                target_subset_files.push_back(std::move(subset.file));
+            }
+        } else if (param.update_index && stdfs::exists(param.indexFilename)) {
+            target_subsets = targetSubsetsToAdd();
+            appendToIndex = true;
+        } else {
+            target_subsets = createTargetSubsets(targetSequenceNames);
+        }
+
+        // A shard maps against every shard_count-th subset, starting from its own index
+        if (param.shard_count > 1 && !param.create_index_only) {
+            size_t kept = 0;
+            for (size_t i = 0; i < target_subsets.size(); ++i) {
+                if (i % param.shard_count != param.shard_index) {
+                    continue;
+                }
+                target_subsets[kept] = std::move(target_subsets[i]);
+                if (!target_subset_offsets.empty()) {
+                    target_subset_offsets[kept] = target_subset_offsets[i];
+                    target_subset_bytes[kept] = target_subset_bytes[i];
+                    target_subset_files[kept] = std::move(target_subset_files[i]);
+                }
+                ++kept;
+            }
+            target_subsets.resize(kept);
+            if (!target_subset_offsets.empty()) {
+                target_subset_offsets.resize(kept);
+                target_subset_bytes.resize(kept);
+                target_subset_files.resize(kept);
+            }
+            std::cerr << "[wfmash::mashmap] Shard " << param.shard_index << " of " << param.shard_count
+                      << " maps against " << kept << " target subsets" << std::endl;
+        }
 
         // Calculate and log subset statistics
         uint64_t total_subset_size = 0;
@@ -559,135 +1898,1226 @@ namespace skch
         }
         std::cerr << ", average size: " << std::fixed << std::setprecision(0) << avg_subset_size << "bp" << std::endl;
 
+        if (param.memory_estimate) {
+            printMemoryEstimate(target_subsets);
+            exit(0);
+        }
+        if (param.plan_only) {
+            plannedSubsetLengths = subsetLengths(target_subsets);
+            return;
+        }
+
+        // Queries are read once, so each must be final once mapped against the only subset
+        if (param.stream_queries && !param.create_index_only && target_subsets.size() > 1) {
+            std::cerr << "[wfmash::mashmap] ERROR, --stream-queries needs a single target subset, got "
+                      << target_subsets.size() << "; raise -b or select one with --index-subsets" << std::endl;
+            exit(1);
+        }
+
+        // Mappings read as they are made, by the aligner or a pipe reader, are written as soon
+        // as each query is final, which with a single subset is once it is mapped, unless
+        // one-to-one filtering needs every query first
+        const bool streamOutput = param.stream_queries
+            || ((mappingOut || param.stream_output) && target_subsets.size() == 1 && param.filterMode != filter::ONETOONE
+                && param.mapping_spill_prefix.empty() && param.shard_mappings.empty() && param.sweep.empty()
+                && param.mapping_cache.empty());
+        if (param.stream_output && !streamOutput && !param.create_index_only) {
+            std::cerr << "[wfmash::mashmap] WARNING, --stream-output needs a single target subset and no one-to-one filtering;"
+                      << " writing the mappings once all are made" << std::endl;
+        }
+
         typedef std::vector<MappingResult> MappingResultsVector_t;
         std::unordered_map<seqno_t, MappingResultsVector_t> combinedMappings;
+        if (!param.mapping_spill_prefix.empty() && !streamOutput && !param.create_index_only) {
+            mappingRuns.reset(new MappingRuns(param.mapping_spill_prefix, !param.checkpoint_prefix.empty()));
+        }
 
-        // Build index for the current subset
-        // Open the index file once
-        std::ifstream indexStream;
-        if (!param.indexFilename.empty() && !param.create_index_only) {
-            indexStream.open(param.indexFilename.string(), std::ios::binary);
-            if (!indexStream) {
-                std::cerr << "Error: Unable to open index file: " << param.indexFilename << std::endl;
+        // A resumed job adopts the runs of the subsets it completed before
+        std::vector<bool> subsetMapped(target_subsets.size(), false);
+        if (param.resume && mappingRuns) {
+            size_t adopted = 0;
+            for (size_t i = 0; i < target_subsets.size(); ++i) {
+                subsetMapped[i] = !target_subsets[i].empty() && mappingRuns->adoptRun(i);
+                adopted += subsetMapped[i];
+            }
+            std::cerr << "[wfmash::mashmap] Resuming " << param.checkpoint_prefix << ", " << adopted
+                      << " of " << target_subsets.size() << " target subsets already mapped" << std::endl;
+        }
+
+        // With every query cached, the subsets of cached targets alone have nothing to map
+        if (!cachedQuery.empty() && std::all_of(querySequenceIds.begin(), querySequenceIds.end(),
+                                                [&](seqno_t seqId) { return cachedQuery[seqId]; })) {
+            size_t skipped = 0;
+            for (size_t i = 0; i < target_subsets.size(); ++i) {
+                if (!subsetMapped[i] && std::all_of(target_subsets[i].begin(), target_subsets[i].end(), [&](const std::string& name) {
+                        return cachedTarget[idManager->getSequenceId(name)];
+                    })) {
+                    subsetMapped[i] = true;
+                    ++skipped;
+                }
+            }
+            std::cerr << "[wfmash::mashmap] Every query is cached, skipping " << skipped << " of "
+                      << target_subsets.size() << " target subsets with only cached targets" << std::endl;
+        }
+
+        // The statistics of the subsets written go beside the index, behind those of an updated one
+        std::ofstream statsOut;
+        if (param.create_index_only) {
+            const std::string statsFilename = param.indexFilename.string() + ".stats";
+            statsOut.open(statsFilename, appendToIndex ? std::ios::app : std::ios::trunc);
+            if (!statsOut) {
+                std::cerr << "[wfmash::mashmap] ERROR, unable to write index statistics to " << statsFilename << std::endl;
                 exit(1);
             }
+            if (!appendToIndex) {
+                statsOut << "#subset\tstat\tkey\tvalue" << std::endl;
+            }
+        } else if (param.index_stats) {
+            std::cout << "#subset\tstat\tkey\tvalue" << std::endl;
+        } else if (param.distance_matrix) {
+            outstrm << "#query\ttarget\tquery_hashes\ttarget_hashes\tshared\tjaccard\tcontainment\tani\tcontainment_ani\n";
+        }
+
+        // List the subsets at the head of a new index, or behind an updated one
+        if (param.create_index_only && !target_subsets.empty()) {
+            Sketch::writeIndexDirectory(param.indexFilename.string(), target_subsets, appendToIndex);
+            appendToIndex = true;
         }
 
+        const auto subsetLength = [this](const std::vector<std::string>& subset) {
+            uint64_t length = 0;
+            for (const auto& seqName : subset) {
+                length += idManager->getSequenceLength(idManager->getSequenceId(seqName));
+            }
+            return length;
+        };
+
+        const auto makeSketch = [&](size_t i, skch::Parameters p) {
+            if (!target_subset_files.empty()) {
+                p.indexFilename = target_subset_files[i];
+            }
+            return loadSubsetSketch(target_subsets[i], target_subset_offsets.empty() ? 0 : target_subset_offsets[i], std::move(p));
+        };
+
+        // Rough in-memory size of a subset index: its file size when loaded, else estimated
+        const auto indexBytes = [&](size_t i) -> uint64_t {
+            if (!param.indexFilename.empty()) {
+                return target_subset_bytes[i];
+            }
+            return Sketch::estimateMemory(subsetLength(target_subsets[i]), param).resident;
+        };
+
+        // Read and sketch the queries against the first subset only, replaying their sketches after
+        const bool cacheQuerySketches = !param.query_sketch_file.empty() && !param.create_index_only
+            && target_subsets.size() > 1;
+
         // For each subset of target sequences
-        uint64_t subset_count = 0;
+        std::future<skch::Sketch*> prefetched;
         std::cerr << "[wfmash::mashmap] Number of target subsets: " << target_subsets.size() << std::endl;
-        for (const auto& target_subset : target_subsets) {
+        for (uint64_t subset_count = 0; subset_count < target_subsets.size(); ++subset_count) {
+            const auto& target_subset = target_subsets[subset_count];
             if (target_subset.empty()) {
                 continue;  // Skip empty subsets
             }
+            if (subsetMapped[subset_count]) {
+                continue;
+            }
             // Calculate total length of sequences in this subset
-            uint64_t subset_length = 0;
-            for (const auto& seqName : target_subset) {
-                seqno_t seqId = idManager->getSequenceId(seqName);
-                subset_length += idManager->getSequenceLength(seqId);
-            }            
+            uint64_t subset_length = subsetLength(target_subset);
 
             if (param.create_index_only) {
                 // Save the index to a file
                 std::cerr << "[wfmash::mashmap] Building and saving index for subset " << subset_count << " with " << target_subset.size() << " sequences" << std::endl;
                 refSketch = new skch::Sketch(param, *idManager, target_subset);
                 std::string indexFilename = param.indexFilename.string();
-                bool append = (subset_count != 0); // Append if not the first subset
+                bool append = appendToIndex || subset_count != 0; // Append if not the first subset
                 refSketch->writeIndex(target_subset, indexFilename, append);
+                refSketch->writeStats(statsOut, subset_count);
                 std::cerr << "[wfmash::mashmap] Index created for subset " << subset_count 
                           << " and saved to " << indexFilename << std::endl;
             } else {
-                if (!param.indexFilename.empty()) {
+                if (prefetched.valid()) {
+                    refSketch = prefetched.get();
+                } else if (!param.indexFilename.empty()) {
                     // Load index from file
                     std::cerr << "[wfmash::mashmap] Loading index for subset " << subset_count << " with " << target_subset.size() << " sequences" << std::endl;
-                    refSketch = new skch::Sketch(param, *idManager, target_subset, &indexStream);
+                    refSketch = makeSketch(subset_count, param);
                 } else {
                     std::cerr << "[wfmash::mashmap] Building index for subset " << subset_count << " with " << target_subset.size() 
                              << " sequences (" << subset_length << " bp)" << std::endl;
-                    refSketch = new skch::Sketch(param, *idManager, target_subset);
+                    refSketch = makeSketch(subset_count, param);
+                }
+                if (param.index_stats) {
+                    refSketch->writeStats(std::cout, subset_count);
+                    delete refSketch;
+                    refSketch = nullptr;
+                    continue;
+                }
+                adoptIndexHashing(*refSketch);
+                memory::phase("index of subset " + std::to_string(subset_count));
+
+                // Overlap the next subset's index with mapping against this one
+                const uint64_t next = subset_count + 1;
+                if (next < target_subsets.size() && !target_subsets[next].empty() && !subsetMapped[next]
+                        && indexBytes(next) <= param.index_prefetch_budget) {
+                    std::cerr << "[wfmash::mashmap] " << (param.indexFilename.empty() ? "Building" : "Loading")
+                              << " index for subset " << next << " with " << target_subsets[next].size()
+                              << " sequences in the background" << std::endl;
+                    prefetched = std::async(std::launch::async, makeSketch, next, param);
+                }
+
+                if (param.distance_matrix) {
+                    writeDistances(*refSketch, outstrm, subset_count, target_subsets.size());
+                    delete refSketch;
+                    refSketch = nullptr;
+                    continue;
+                }
+
+                if (cacheQuerySketches && !replayQuerySketches) {
+                    querySketchOut.open(param.query_sketch_file, std::ios::binary | std::ios::trunc);
+                    if (!querySketchOut) {
+                        std::cerr << "[wfmash::mashmap] ERROR, unable to write query sketches to " << param.query_sketch_file << std::endl;
+                        exit(1);
+                    }
+                    recordQuerySketches = true;
+                }
+
+                // and skips the queries it mapped against the subset it was on, unless
+                // they are needed to record the query sketches
+                resumedQueries.clear();
+                if (param.resume && mappingRuns && !recordQuerySketches) {
+                    mappingRuns->resumeRun(subset_count, resumedQueries);
+                    if (!resumedQueries.empty()) {
+                        std::cerr << "[wfmash::mashmap] Resuming subset " << subset_count << ", "
+                                  << resumedQueries.size() << " queries already mapped" << std::endl;
+                    }
+                }
+
+                processSubset(subset_count, target_subsets.size(), target_subset, total_seq_length, combinedMappings,
+                              streamOutput ? &outstrm : nullptr);
+                resumedQueries.clear();
+                accountMappings(combinedMappings);
+                memory::phase("mapping against subset " + std::to_string(subset_count));
+
+                if (recordQuerySketches) {
+                    querySketchOut.close();
+                    if (!querySketchOut) {
+                        std::cerr << "[wfmash::mashmap] ERROR, unable to write query sketches to " << param.query_sketch_file << std::endl;
+                        exit(1);
+                    }
+                    recordQuerySketches = false;
+                    replayQuerySketches = true;
+                }
+            }
+
+            // Clean up the current refSketch
+            delete refSketch;
+            refSketch = nullptr;
+        }
+
+        replayQuerySketches = false;
+
+        if (param.create_index_only) {
+            std::cerr << "[wfmash::mashmap] All indices created successfully. Exiting." << std::endl;
+            sampling_profiler::stop();
+            exit(0);
+        }
+        if (param.index_stats) {
+            sampling_profiler::stop();
+            exit(0);
+        }
+        if (param.distance_matrix) {
+            outstrm.flush();
+            if (outfile) {
+                closeOutputFile(*outfile);
+            }
+            return;
+        }
+
+        if (!param.mapping_cache.empty()) {
+            mergeMappingCache(combinedMappings);
+        }
+        if (!param.shard_mappings.empty()) {
+            writeShardMappings(combinedMappings);
+        } else if (mappingRuns) {
+            writeSpilledMappings(*mappingRuns, outstrm);
+        } else if (!param.sweep.empty()) {
+            writeSweepMappings(combinedMappings);
+        } else if (!streamOutput) {
+            writeCombinedMappings(combinedMappings, outstrm);
+        }
+        outstrm.flush();
+        if (outfile) {
+            closeOutputFile(*outfile);
+        }
+        if (!param.slow_query_file.empty()) {
+            writeSlowQueries();
+        }
+        if (!param.checkpoint_prefix.empty()) {
+            // The runs of a checkpointed job go once its mappings are all out
+            markMapped();
+            if (mappingRuns) {
+                mappingRuns->discard();
+            }
+        }
+        mappingRuns.reset();
+        memory::phase("mapping output");
+      }
+
+      /**
+       * @brief   write the param.slow_query_count queries that took longest to map, with
+       *          their counters, to param.slow_query_file as TSV
+       */
+      void writeSlowQueries() const
+      {
+        std::vector<seqno_t> slowest = querySequenceIds;
+        const size_t count = std::min<size_t>(slowest.size(), param.slow_query_count);
+        std::partial_sort(slowest.begin(), slowest.begin() + count, slowest.end(), [&](seqno_t a, seqno_t b) {
+            return std::make_tuple(queryCosts[b].nanos.load(), a) < std::make_tuple(queryCosts[a].nanos.load(), b);
+        });
+
+        std::ofstream out(param.slow_query_file);
+        out << "#query\tlength\tseconds\tfragments\tseed_hits\tl1_candidates\tl2_mappings\n";
+        for (size_t i = 0; i < count; ++i) {
+            const profile::QueryCost& cost = queryCosts[slowest[i]];
+            out << idManager->getSequenceName(slowest[i]) << "\t" << idManager->getSequenceLength(slowest[i])
+                << "\t" << cost.seconds() << "\t" << cost.get(profile::FRAGMENTS)
+                << "\t" << cost.get(profile::SEED_INTERVAL_POINTS) << "\t" << cost.get(profile::L1_CANDIDATES)
+                << "\t" << cost.get(profile::L2_MAPPINGS) << "\n";
+        }
+        out.close();
+        if (!out) {
+            std::cerr << "[wfmash::mashmap] ERROR, unable to write the slow query log " << param.slow_query_file << std::endl;
+            exit(1);
+        }
+        std::cerr << "[wfmash::mashmap] Slowest " << count << " queries saved to: " << param.slow_query_file << std::endl;
+      }
+
+      /**
+       * @brief   mark the mapping of a checkpointed job done, its output complete
+       */
+      void markMapped() const
+      {
+        const std::string marker = param.checkpoint_prefix + ".mapped";
+        std::ofstream out(marker, std::ios::trunc);
+        out << "mapped\n";
+        out.close();
+        if (!out) {
+            std::cerr << "[wfmash::mashmap] ERROR, unable to write the checkpoint " << marker << std::endl;
+            exit(1);
+        }
+      }
+
+      /**
+       * @brief   set the bytes of the mappings kept across subsets in the memory report
+       */
+      void accountMappings(const std::unordered_map<seqno_t, MappingResultsVector_t>& combinedMappings)
+      {
+        if (!memory::enabled()) {
+            return;
+        }
+        uint64_t bytes = combinedMappings.bucket_count() * sizeof(void*);
+        for (const auto& [querySeqId, mappings] : combinedMappings) {
+            bytes += sizeof(std::pair<seqno_t, MappingResultsVector_t>) + sizeof(void*) + mappings.capacity() * sizeof(MappingResult);
+        }
+        memoryAccount.set(memory::MAPPINGS, bytes);
+      }
+
+      /**
+       * @brief   print the estimated index memory of each target subset as TSV, and the
+       *          peak over the run: an index being built, next to the one mapped against
+       *          when it is prefetched
+       */
+      std::vector<uint64_t> subsetLengths(const std::vector<std::vector<std::string>>& target_subsets) const
+      {
+        std::vector<uint64_t> lengths;
+        for (const auto& subset : target_subsets) {
+            uint64_t length = 0;
+            for (const auto& seqName : subset) {
+                length += idManager->getSequenceLength(idManager->getSequenceId(seqName));
+            }
+            lengths.push_back(length);
+        }
+        return lengths;
+      }
+
+      void printMemoryEstimate(const std::vector<std::vector<std::string>>& target_subsets)
+      {
+        const std::vector<uint64_t> lengths = subsetLengths(target_subsets);
+        const uint64_t peak = peakIndexMemory(lengths, param);
+        std::cout << "#subset\tsequences\tbp\tindex_bytes\tbuild_peak_bytes" << std::endl;
+        for (size_t i = 0; i < target_subsets.size(); ++i) {
+            const Sketch::MemoryEstimate estimate = Sketch::estimateMemory(lengths[i], param);
+            std::cout << i << "\t" << target_subsets[i].size() << "\t" << lengths[i] << "\t"
+                      << estimate.resident << "\t" << estimate.buildPeak << std::endl;
+        }
+        std::cout << "peak\t" << idManager->getTargetSequenceNames().size() << "\t"
+                  << std::accumulate(lengths.begin(), lengths.end(), uint64_t(0)) << "\t.\t" << peak << std::endl;
+        std::cerr << "[wfmash::mashmap] Estimated index memory at most " << memory::humanBytes(peak)
+                  << " with -b " << param.index_by_size << ", sketch size " << param.sketchSize
+                  << " and k-mer size " << param.kmerSize << std::endl;
+      }
+
+      /**
+       * @brief     open param.outFileName for the mappings, as BGZF if param.bgzip_output, or
+       *            as a binary mapping file headed by the sequence names if param.binary_output
+       * @details   the BGZF blocks are compressed on param.threads threads and written in order
+       */
+      std::unique_ptr<std::ostream> openOutputFile()
+      {
+        if (param.binary_output) {
+            auto out = std::make_unique<std::ofstream>(param.outFileName, std::ios::binary);
+            writeBinaryMappingHeader(*out, idManager->size(),
+                                     [&](uint64_t id) { return idManager->getSequenceName(id); });
+            return out;
+        }
+        std::unique_ptr<std::ostream> out;
+        if (!param.bgzip_output) {
+            out = std::make_unique<std::ofstream>(param.outFileName);
+        } else {
+            auto bgzf_out = std::make_unique<wfmash::obgzfstream>(param.outFileName, param.threads, param.bgzip_index_file);
+            if (!bgzf_out->is_open()) {
+                std::cerr << "[wfmash::mashmap] ERROR, could not open " << param.outFileName << " for bgzip output" << std::endl;
+                exit(1);
+            }
+            out = std::move(bgzf_out);
+        }
+        if (!param.interval_index_file.empty()) {
+            out = std::make_unique<interval_index::indexed_ostream>(std::move(out));
+        }
+        if (param.sort_output) {
+            // Targets rank by their ids, so in the order of the target FASTAs
+            out = std::make_unique<sorted_output::sorted_ostream>(
+                std::move(out), param.sort_prefix, param.sort_memory, param.threads, false,
+                [this](std::string_view name) { return uint64_t(idManager->getSequenceId(name)); });
+        }
+        return out;
+      }
+
+      // Finishes a BGZF output with its EOF block and index, writes out the lines of a sorted
+      // one and saves the interval index of an indexed one; plain files need nothing more
+      void closeOutputFile(std::ostream& out)
+      {
+        if (auto* sorted = dynamic_cast<sorted_output::sorted_ostream*>(&out)) {
+            if (!sorted->finish()) {
+                std::cerr << "[wfmash::mashmap] ERROR, failed sorting the output through " << param.sort_prefix << ".*" << std::endl;
+                exit(1);
+            }
+            closeOutputFile(sorted->inner());
+            return;
+        }
+        if (auto* indexed = dynamic_cast<interval_index::indexed_ostream*>(&out)) {
+            indexed->flush();
+            closeOutputFile(indexed->inner());
+            if (!indexed->records().write(param.interval_index_file, param.bgzip_output ? param.bgzip_index_file : "")) {
+                std::cerr << "[wfmash::mashmap] ERROR, failed writing the interval index " << param.interval_index_file << std::endl;
+                exit(1);
+            }
+            std::cerr << "[wfmash::mashmap] Interval index of " << indexed->records().size() << " mappings saved to: "
+                      << param.interval_index_file << std::endl;
+            return;
+        }
+        auto* bgzf_out = dynamic_cast<wfmash::obgzfstream*>(&out);
+        if (!bgzf_out) {
+            return;
+        }
+        bgzf_out->close();
+        if (!*bgzf_out) {
+            std::cerr << "[wfmash::mashmap] ERROR, failed writing the bgzip output " << param.outFileName << std::endl;
+            exit(1);
+        }
+      }
+
+      /**
+       * @brief                 load the index of a target subset, or build it when there is no index file
+       * @details               runs in the background when prefetching, so it takes its own copy
+       *                        of the parameters and opens its own index stream
+       * @param[in]   offset    position of the subset in the index file
+       */
+      skch::Sketch* loadSubsetSketch(const std::vector<std::string>& subset, uint64_t offset, skch::Parameters p)
+      {
+        // Spread the index over all nodes, as workers on every node read it
+        std::unique_ptr<numa::InterleaveScope> interleave(p.numa ? new numa::InterleaveScope : nullptr);
+        const int threads = p.threads;
+        const bool warmup = p.index_warmup;
+        const bool lock = p.lock_index;
+        skch::Sketch* sketch = nullptr;
+        if (!p.indexFilename.empty()) {
+            std::ifstream indexStream(p.indexFilename.string(), std::ios::binary);
+            if (!indexStream) {
+                std::cerr << "Error: Unable to open index file: " << p.indexFilename << std::endl;
+                exit(1);
+            }
+            indexStream.seekg(offset);
+            sketch = new skch::Sketch(std::move(p), *idManager, subset, &indexStream);
+        } else if (!targetSketchQueries.empty()) {
+            sketch = new skch::Sketch(std::move(p), *idManager, subset, nullptr,
+                                      [this](const Sketch::MI_Type& minmers) { keepTargetSketches(minmers); });
+        } else {
+            sketch = new skch::Sketch(std::move(p), *idManager, subset);
+        }
+        if (warmup) {
+            sketch->warmUp(threads, lock);
+        }
+        return sketch;
+      }
+
+      /**
+       * @brief     hash queries the same way as a loaded index
+       */
+      void adoptIndexHashing(const skch::Sketch& sketch)
+      {
+        if (!param.indexFilename.empty()) {
+            param.kmerHashEngine = sketch.getKmerHashEngine();
+            param.spaced_seeds = sketch.getSpacedSeeds();
+            param.use_spaced_seeds = !param.spaced_seeds.empty();
+            spacedSeeds.reset(param.use_spaced_seeds ? new CommonFunc::SpacedSeeds(param.spaced_seeds) : nullptr);
+            param.syncmer_size = sketch.getSyncmerSize();
+            syncmers.reset(param.syncmer_size > 0 ? new CommonFunc::Syncmers(param.syncmer_size) : nullptr);
+            param.dust_threshold = sketch.getDustThreshold();
+            dust.reset(param.dust_threshold > 0 ? new CommonFunc::Dust(param.dust_threshold) : nullptr);
+            param.world_minimizers = sketch.getWorldMinimizers();
+            sketchHashThreshold = param.world_minimizers
+                ? CommonFunc::worldHashThreshold(param.sketchSize, param.segLength, param.kmerSize, param.alphabetSize)
+                : std::numeric_limits<hash_t>::max();
+        }
+      }
+
+      /**
+       * @brief     filter the mappings gathered over all target subsets and write them out
+       */
+      void writeCombinedMappings(std::unordered_map<seqno_t, MappingResultsVector_t>& combinedMappings, std::ostream& outstrm)
+      {
+        // Get total count of mappings
+        uint64_t totalMappings = 0;
+        for (const auto& [querySeqId, mappings] : combinedMappings) {
+            totalMappings += mappings.size();
+        }
+
+        // Written in query id order, whatever the order of the map
+        std::vector<seqno_t> queryIds;
+        queryIds.reserve(combinedMappings.size());
+        for (const auto& [querySeqId, mappings] : combinedMappings) {
+            queryIds.push_back(querySeqId);
+        }
+        std::sort(queryIds.begin(), queryIds.end());
+
+        writeQueryMappings(totalMappings, 1024, outstrm, [&](const query_sink_t& queue) {
+            for (const seqno_t querySeqId : queryIds) {
+                queue(querySeqId, std::move(combinedMappings[querySeqId]));
+            }
+        });
+      }
+
+      /**
+       * @brief     the order to read the queries in against the next subset under
+       *            param.queryOrder, empty for that of querySequenceIds
+       * @details   workers map the queries read about together, so reading those that hit
+       *            the same targets together has them share the index regions, caches and
+       *            TLB entries they touch. By name, queries are grouped by what follows the
+       *            last prefix delimiter, '#' unless set, as the chromosomes of PanSN names.
+       *            By mapping, they follow the target and position of their longest mapping
+       *            against the earlier subsets, and the first subset, or the queries without
+       *            mappings after the others, fall back to the name order. Only the queries
+       *            fetched by id from their FASTA are reordered; the output is written in
+       *            query order whatever the reading order, unless streamed as mapped.
+       */
+      std::vector<seqno_t> readOrder(const std::unordered_map<seqno_t, MappingResultsVector_t>& combinedMappings) const
+      {
+        std::vector<seqno_t> order;
+        if (param.queryOrder == query_order::INPUT) {
+            return order;
+        }
+        const char delim = param.prefix_delim != '\0' ? param.prefix_delim : '#';
+        std::unordered_map<seqno_t, std::string_view> nameKey;
+        std::unordered_map<seqno_t, std::pair<seqno_t, offset_t>> mappedKey;
+        for (const seqno_t seqId : querySequenceIds) {
+            const std::string_view name = idManager->getSequenceName(seqId);
+            const size_t pos = name.rfind(delim);
+            nameKey[seqId] = pos == std::string_view::npos ? name : name.substr(pos + 1);
+            if (param.queryOrder != query_order::MAPPED) {
+                continue;
+            }
+            const auto found = combinedMappings.find(seqId);
+            if (found == combinedMappings.end() || found->second.empty()) {
+                continue;
+            }
+            const auto longest = std::max_element(found->second.begin(), found->second.end(),
+                [](const MappingResult& a, const MappingResult& b) { return a.blockLength < b.blockLength; });
+            mappedKey[seqId] = {longest->refSeqId, longest->refStartPos};
+        }
+        order = querySequenceIds;
+        std::stable_sort(order.begin(), order.end(), [&](seqno_t a, seqno_t b) {
+            const auto mappedA = mappedKey.find(a);
+            const auto mappedB = mappedKey.find(b);
+            if ((mappedA != mappedKey.end()) != (mappedB != mappedKey.end())) {
+                return mappedA != mappedKey.end();
+            }
+            if (mappedA != mappedKey.end() && mappedA->second != mappedB->second) {
+                return mappedA->second < mappedB->second;
+            }
+            return nameKey.at(a) < nameKey.at(b);
+        });
+        return order;
+      }
+
+      /**
+       * @brief     write the Jaccard, containment and ANI estimates of each query and the
+       *            targets of a subset sharing minmers with it, read off its posting lists
+       * @details   a query's minmers are those of the whole sequence, sketched with the
+       *            windows of the targets, once for all subsets. Each hash it shares counts
+       *            once for every target of the subset holding it, without the L1 and L2
+       *            stages. Hashes the frequency filter dropped are left out on both sides.
+       *            Under skip_self/skip_prefix a query skips the targets of its group, under
+       *            lower_triangular those of higher ids, and pairs under percentageIdentity
+       *            by both ANI estimates are not written.
+       */
+      void writeDistances(const skch::Sketch& sketch, std::ostream& out, uint64_t subset_count, uint64_t total_subsets)
+      {
+        uint64_t total_length = 0;
+        for (const seqno_t seqId : querySequenceIds) {
+            total_length += idManager->getSequenceLength(seqId);
+        }
+        progress_meter::ProgressMeter progress(
+            total_length,
+            "[wfmash::mashmap] distances ("
+            + std::to_string(subset_count + 1) + "/" + std::to_string(total_subsets) + ")");
+        if (!distanceQueriesSketched) {
+            distanceQueryHashes.assign(querySequenceIds.size(), {});
+        }
+        const std::unordered_map<seqno_t, uint64_t> targetHashes = sketch.distinctHashCounts();
+        const bool grouped = param.skip_self || param.skip_prefix;
+
+        std::vector<std::string> rows(querySequenceIds.size());
+        std::atomic<size_t> nextQuery{0};
+        const auto work = [&]() {
+            faidx_t* fai = distanceQueriesSketched ? nullptr : fai_load(param.querySequences[0].c_str());
+            std::unordered_map<seqno_t, uint64_t> shared;
+            std::vector<std::pair<seqno_t, uint64_t>> pairs;
+            for (size_t i; (i = nextQuery.fetch_add(1)) < querySequenceIds.size();) {
+                const seqno_t seqId = querySequenceIds[i];
+                const std::string name(idManager->getSequenceName(seqId));
+                auto& hashes = distanceQueryHashes[i];
+                if (fai) {
+                    int64_t len = 0;
+                    char* seq = faidx_fetch_seq64(fai, name.c_str(), 0, INT64_MAX, &len);
+                    if (seq != nullptr) {
+                        hashes = sketch.sequenceHashes(seq, len, &progress);
+                        std::free(seq);
+                    }
+                } else {
+                    progress.increment(idManager->getSequenceLength(seqId));
+                }
+
+                // Targets holding a hash follow one another in its interval points
+                shared.clear();
+                uint64_t queryKept = 0;
+                for (const hash_t hash : hashes) {
+                    skch::Sketch::SeedIter_t begin, end;
+                    if (!sketch.findSeedIntervals(hash, begin, end)) {
+                        queryKept += !sketch.isFrequent(hash);
+                        continue;
+                    }
+                    ++queryKept;
+                    seqno_t last = -1;
+                    for (auto it = begin; it != end; ++it) {
+                        const seqno_t target = (*it).seqId;
+                        if (target != last) {
+                            shared[target]++;
+                            last = target;
+                        }
+                    }
+                }
+
+                pairs.assign(shared.begin(), shared.end());
+                std::sort(pairs.begin(), pairs.end());
+                std::ostringstream row;
+                row << std::fixed << std::setprecision(6);
+                for (const auto& [target, count] : pairs) {
+                    if ((grouped && idManager->getRefGroup(target) == idManager->getRefGroup(seqId))
+                            || (param.lower_triangular && target >= seqId)) {
+                        continue;
+                    }
+                    const auto kept = targetHashes.find(target);
+                    const uint64_t targetKept = kept != targetHashes.end() ? kept->second : count;
+                    const double jaccard = double(count) / std::max<uint64_t>(1, queryKept + targetKept - count);
+                    const double containment = double(count) / std::max<uint64_t>(1, std::min(queryKept, targetKept));
+                    const double ani = 1.0 - Stat::j2md(jaccard, param.kmerSize);
+                    const double containmentAni = std::pow(containment, 1.0 / param.kmerSize);
+                    if (std::max(ani, containmentAni) < param.percentageIdentity) {
+                        continue;
+                    }
+                    row << name << '\t' << idManager->getSequenceName(target) << '\t' << queryKept << '\t' << targetKept
+                        << '\t' << count << '\t' << jaccard << '\t' << containment << '\t' << ani << '\t' << containmentAni << '\n';
+                }
+                rows[i] = row.str();
+            }
+            if (fai) {
+                fai_destroy(fai);
+            }
+        };
+        std::vector<std::thread> workers;
+        for (int t = 0; t < param.threads; ++t) {
+            workers.emplace_back(work);
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        distanceQueriesSketched = true;
+        progress.finish();
+
+        for (const auto& row : rows) {
+            out << row;
+        }
+      }
+
+      /**
+       * @brief     hash of the parameters the mappings of a pair before the final filtering
+       *            depend on, for a mapping cache to only be taken up by runs that agree on them
+       */
+      uint64_t mappingCacheParameters() const
+      {
+        std::ostringstream key;
+        key << param.kmerSize << ' ' << param.kmerHashEngine << ' ' << param.segLength << ' ' << param.block_length
+            << ' ' << param.chain_gap << ' ' << param.max_mapping_length << ' ' << param.percentageIdentity
+            << ' ' << param.sketchSize << ' ' << param.world_minimizers << ' ' << param.syncmer_size
+            << ' ' << param.use_spaced_seeds << ' ' << param.dust_threshold << ' ' << param.max_kmer_freq
+            << ' ' << param.auto_kmer_freq << ' ' << param.kmer_hit_budget
+            << ' ' << param.approx_kmer_freq << ' ' << param.pangenome_index << ' ' << param.minimum_hits
+            << ' ' << param.kmerComplexityThreshold << ' ' << param.stage1_topANI_filter << ' ' << param.stage2_full_scan
+            << ' ' << param.ANIDiff << ' ' << param.ANIDiffConf << ' ' << param.hgNumerator
+            << ' ' << param.filterMode << ' ' << param.numMappingsForSegment << ' ' << param.numMappingsForShortSequence
+            << ' ' << param.dropRand << ' ' << param.overlap_threshold << ' ' << param.sparsity_hash_threshold
+            << ' ' << param.split << ' ' << param.mergeMappings << ' ' << param.keep_low_pct_id
+            << ' ' << param.filterLengthMismatches << ' ' << param.skip_self << ' ' << param.skip_prefix
+            << ' ' << param.query_seed_cap << ' ' << param.guided_search_window
+            << ' ' << param.adaptive_segment_factor << ' ' << param.coarse_factor;
+        const std::string text = key.str();
+        uint64_t hash[2];
+        MurmurHash3_x64_128(text.data(), int(text.size()), 0, hash);
+        return hash[0];
+      }
+
+      /**
+       * @brief     read the mapping cache and find the queries and targets of this run whose
+       *            pairs it holds, keeping its mappings of those pairs to merge once mapped
+       * @details   sequences are hashed from their FASTA; a sequence repeated within the run or
+       *            the cache is mapped again, as are all pairs of a cache of other parameters.
+       *            A pair is cached when its query was a query and its target a target of the
+       *            cached run. Under skip_self/skip_prefix the cached run skipped the pairs of
+       *            a group, so a query whose group was split apart since is mapped again, and
+       *            the cached pairs of sequences grouped together since are dropped.
+       */
+      void loadMappingCache()
+      {
+        cacheEntries.assign(idManager->size(), MappingCache::Sequence{{0, 0}, 0, 0, -1});
+        const bool grouped = param.skip_self || param.skip_prefix;
+        const auto hashFrom = [&](const std::vector<std::string>& files, const std::vector<seqno_t>& ids, uint64_t role) {
+            std::vector<seqno_t> unhashed;
+            for (const seqno_t seqId : ids) {
+                if (cacheEntries[seqId].roles != 0) {
+                    cacheEntries[seqId].roles |= role;
+                } else {
+                    unhashed.push_back(seqId);
+                }
+            }
+            for (const auto& file : files) {
+                faidx_t* fai = unhashed.empty() ? nullptr : fai_load(file.c_str());
+                if (!fai) {
+                    continue;
+                }
+                size_t kept = 0;
+                for (const seqno_t seqId : unhashed) {
+                    auto& entry = cacheEntries[seqId];
+                    const std::string name(idManager->getSequenceName(seqId));
+                    if (faidx_has_seq(fai, name.c_str())
+                            && hashSequence(fai, name, idManager->getSequenceLength(seqId), entry.hash)) {
+                        entry.length = idManager->getSequenceLength(seqId);
+                        entry.roles = role;
+                        entry.group = grouped ? idManager->getRefGroup(seqId) : -1;
+                    } else {
+                        unhashed[kept++] = seqId;
+                    }
+                }
+                unhashed.resize(kept);
+                fai_destroy(fai);
+            }
+        };
+        std::vector<seqno_t> targetIds;
+        for (const auto& name : targetSequenceNames) {
+            targetIds.push_back(idManager->getSequenceId(name));
+        }
+        hashFrom(param.querySequences, querySequenceIds, MappingCache::QUERY);
+        hashFrom(param.refSequences, targetIds, MappingCache::TARGET);
+
+        cachedQuery.assign(idManager->size(), false);
+        cachedTarget.assign(idManager->size(), false);
+        cachedTargetRuns.clear();
+        cachedMappings.clear();
+        MappingCache cache;
+        if (!cache.read(param.mapping_cache)) {
+            std::cerr << "[wfmash::mashmap] No mapping cache at " << param.mapping_cache << ", mapping every pair" << std::endl;
+            return;
+        }
+        if (cache.parameters != mappingCacheParameters()) {
+            std::cerr << "[wfmash::mashmap] WARNING, mapping cache " << param.mapping_cache
+                      << " was made with other mapping parameters; mapping every pair and replacing it" << std::endl;
+            return;
+        }
+
+        // Where each sequence is in the other, by its hash and length, -1 if repeated
+        typedef std::tuple<uint64_t, uint64_t, uint64_t> key_t;
+        const auto keyOf = [](const MappingCache::Sequence& s) { return key_t(s.hash[0], s.hash[1], s.length); };
+        std::map<key_t, int64_t> inCache;
+        for (size_t i = 0; i < cache.sequences.size(); ++i) {
+            auto placed = inCache.emplace(keyOf(cache.sequences[i]), int64_t(i));
+            if (!placed.second) {
+                placed.first->second = -1;
+            }
+        }
+        std::map<key_t, int64_t> inRun;
+        for (size_t seqId = 0; seqId < cacheEntries.size(); ++seqId) {
+            if (cacheEntries[seqId].roles != 0) {
+                auto placed = inRun.emplace(keyOf(cacheEntries[seqId]), int64_t(seqId));
+                if (!placed.second) {
+                    placed.first->second = -1;
+                }
+            }
+        }
+        std::vector<seqno_t> runIdOf(cache.sequences.size(), -1);
+        for (const auto& [key, seqId] : inRun) {
+            const auto found = inCache.find(key);
+            if (seqId < 0 || found == inCache.end() || found->second < 0) {
+                continue;
+            }
+            runIdOf[found->second] = seqId;
+            const uint64_t roles = cache.sequences[found->second].roles & cacheEntries[seqId].roles;
+            cachedQuery[seqId] = roles & MappingCache::QUERY;
+            cachedTarget[seqId] = roles & MappingCache::TARGET;
+        }
+
+        if (grouped) {
+            // The groups of this run the cached targets of each cached run group are now in
+            std::unordered_map<int64_t, std::unordered_set<int>> regrouped;
+            for (size_t i = 0; i < cache.sequences.size(); ++i) {
+                if (runIdOf[i] >= 0 && cachedTarget[runIdOf[i]]) {
+                    regrouped[cache.sequences[i].group].insert(idManager->getRefGroup(runIdOf[i]));
+                }
+            }
+            for (size_t i = 0; i < cache.sequences.size(); ++i) {
+                const seqno_t seqId = runIdOf[i];
+                if (seqId < 0 || !cachedQuery[seqId]) {
+                    continue;
+                }
+                const auto groups = regrouped.find(cache.sequences[i].group);
+                if (groups != regrouped.end()
+                        && (groups->second.size() > 1 || !groups->second.count(idManager->getRefGroup(seqId)))) {
+                    cachedQuery[seqId] = false;
+                }
+            }
+        }
+
+        for (auto& m : cache.mappings) {
+            const seqno_t querySeqId = runIdOf[m.querySeqId];
+            const seqno_t refSeqId = runIdOf[m.refSeqId];
+            if (querySeqId < 0 || refSeqId < 0 || !cachedQuery[querySeqId] || !cachedTarget[refSeqId]
+                    || (grouped && idManager->getRefGroup(querySeqId) == idManager->getRefGroup(refSeqId))) {
+                continue;
+            }
+            m.querySeqId = querySeqId;
+            m.refSeqId = refSeqId;
+            cachedMappings.push_back(m);
+        }
+        cachedChainIds = cache.chainIds;
+
+        size_t queries = 0;
+        size_t targets = 0;
+        for (size_t seqId = 0; seqId < cachedTarget.size(); ++seqId) {
+            queries += cachedQuery[seqId];
+            targets += cachedTarget[seqId];
+            if (!cachedTarget[seqId]) {
+                continue;
+            }
+            if (!cachedTargetRuns.empty() && cachedTargetRuns.back().second == seqno_t(seqId)) {
+                cachedTargetRuns.back().second++;
+            } else {
+                cachedTargetRuns.emplace_back(seqId, seqId + 1);
+            }
+        }
+        std::cerr << "[wfmash::mashmap] Mapping cache " << param.mapping_cache << " holds the pairs of " << queries
+                  << " of " << querySequenceIds.size() << " queries and " << targets << " of " << targetIds.size()
+                  << " targets, " << cachedMappings.size() << " mappings taken up" << std::endl;
+      }
+
+      /**
+       * @brief     add the cached mappings to those just made, before the final filtering
+       *            meets them, and replace the cache with all of them
+       * @details   the cached chain ids are moved past this run's, as mergeShards does a shard's
+       */
+      void mergeMappingCache(std::unordered_map<seqno_t, MappingResultsVector_t>& combinedMappings)
+      {
+        const offset_t chainIdBase = maxChainIdSeen.load();
+        for (auto& m : cachedMappings) {
+            m.splitMappingId += chainIdBase;
+            combinedMappings[m.querySeqId].push_back(m);
+        }
+        maxChainIdSeen.store(chainIdBase + cachedChainIds);
+        std::vector<MappingResult>().swap(cachedMappings);
+
+        MappingCache cache;
+        cache.parameters = mappingCacheParameters();
+        cache.chainIds = maxChainIdSeen.load();
+        std::vector<int64_t> indexOf(cacheEntries.size(), -1);
+        for (size_t seqId = 0; seqId < cacheEntries.size(); ++seqId) {
+            if (cacheEntries[seqId].roles != 0) {
+                indexOf[seqId] = cache.sequences.size();
+                cache.sequences.push_back(cacheEntries[seqId]);
+            }
+        }
+        for (const auto& [querySeqId, mappings] : combinedMappings) {
+            for (const auto& m : mappings) {
+                if (indexOf[querySeqId] < 0 || indexOf[m.refSeqId] < 0) {
+                    continue;
+                }
+                cache.mappings.push_back(m);
+                cache.mappings.back().querySeqId = indexOf[querySeqId];
+                cache.mappings.back().refSeqId = indexOf[m.refSeqId];
+            }
+        }
+        cache.write(param.mapping_cache);
+        std::cerr << "[wfmash::mashmap] Mapping cache " << param.mapping_cache << " saved with "
+                  << cache.mappings.size() << " mappings" << std::endl;
+      }
+
+      static constexpr uint64_t shardMagic = 0x647261687368736dULL;  // "mshshard"
+
+      /**
+       * @brief     write this shard's mappings before the final filtering, for mergeShards
+       * @details   a header identifies the shard and the inputs it was run on; the query and
+       *            target sequence ids of the records only agree between runs on the same inputs
+       */
+      void writeShardMappings(std::unordered_map<seqno_t, MappingResultsVector_t>& combinedMappings)
+      {
+        std::ofstream out(param.shard_mappings, std::ios::binary);
+        const uint64_t header[] = {
+            shardMagic,
+            uint64_t(param.shard_index),
+            uint64_t(param.shard_count),
+            uint64_t(querySequenceIds.size()),
+            uint64_t(targetSequenceNames.size()),
+            uint64_t(maxChainIdSeen.load())};
+        out.write(reinterpret_cast<const char*>(header), sizeof(header));
+        for (const auto& [querySeqId, mappings] : combinedMappings) {
+            const uint64_t count = mappings.size();
+            out.write(reinterpret_cast<const char*>(&querySeqId), sizeof(querySeqId));
+            out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+            out.write(reinterpret_cast<const char*>(mappings.data()), count * sizeof(MappingResult));
+        }
+        out.close();
+        if (!out) {
+            std::cerr << "[wfmash::mashmap] ERROR, unable to write shard mappings to " << param.shard_mappings << std::endl;
+            exit(1);
+        }
+        std::cerr << "[wfmash::mashmap] Shard " << param.shard_index << " of " << param.shard_count
+                  << " mappings saved to " << param.shard_mappings << std::endl;
+      }
+
+      /**
+       * @brief     gather the mappings of every shard and apply the final filtering to
+       *            each query across all of them, as a single run would
+       * @details   chain ids are numbered per shard, so each shard's are moved past the
+       *            previous shards' before they meet in a query
+       */
+      void mergeShards()
+      {
+        std::unordered_map<seqno_t, MappingResultsVector_t> combinedMappings;
+        std::vector<bool> seen;
+        offset_t chainIdBase = 0;
+        for (const auto& fileName : param.merge_shards) {
+            std::ifstream in(fileName, std::ios::binary);
+            uint64_t header[6];
+            if (!in.read(reinterpret_cast<char*>(header), sizeof(header)) || header[0] != shardMagic) {
+                std::cerr << "[wfmash::mashmap] ERROR, " << fileName << " is not a shard mapping file" << std::endl;
+                exit(1);
+            }
+            const uint64_t shardIndex = header[1];
+            const uint64_t shardCount = header[2];
+            if (header[3] != querySequenceIds.size() || header[4] != targetSequenceNames.size()) {
+                std::cerr << "[wfmash::mashmap] ERROR, shard " << fileName << " was mapped on other query or target sequences" << std::endl;
+                exit(1);
+            }
+            if (seen.empty()) {
+                seen.assign(shardCount, false);
+            }
+            if (shardCount != seen.size() || shardIndex >= shardCount || seen[shardIndex]) {
+                std::cerr << "[wfmash::mashmap] ERROR, shard " << fileName << " (" << shardIndex << " of " << shardCount
+                          << ") does not fit the other shards" << std::endl;
+                exit(1);
+            }
+            seen[shardIndex] = true;
+
+            seqno_t querySeqId;
+            uint64_t count;
+            while (in.read(reinterpret_cast<char*>(&querySeqId), sizeof(querySeqId))) {
+                in.read(reinterpret_cast<char*>(&count), sizeof(count));
+                auto& mappings = combinedMappings[querySeqId];
+                const size_t begin = mappings.size();
+                mappings.resize(begin + count);
+                if (!in.read(reinterpret_cast<char*>(mappings.data() + begin), count * sizeof(MappingResult))) {
+                    std::cerr << "[wfmash::mashmap] ERROR, truncated shard mapping file " << fileName << std::endl;
+                    exit(1);
+                }
+                for (size_t i = begin; i < mappings.size(); ++i) {
+                    mappings[i].splitMappingId += chainIdBase;
                 }
-                std::atomic<bool> reader_done(false);
-                std::atomic<bool> workers_done(false);
-                std::atomic<bool> fragments_done(false);
-                processSubset(subset_count, target_subsets.size(), total_seq_length, input_queue, merged_queue, 
-                              fragment_queue, reader_done, workers_done, fragments_done, combinedMappings);
             }
-
-            // Clean up the current refSketch
-            delete refSketch;
-            refSketch = nullptr;
-            ++subset_count;
+            chainIdBase += header[5];
+        }
+        if (std::find(seen.begin(), seen.end(), false) != seen.end()) {
+            std::cerr << "[wfmash::mashmap] ERROR, " << std::count(seen.begin(), seen.end(), false)
+                      << " of " << seen.size() << " shards are missing from the merge" << std::endl;
+            exit(1);
         }
+        maxChainIdSeen.store(chainIdBase);
 
-        if (indexStream.is_open()) {
-            indexStream.close();
+        if (!param.sweep.empty()) {
+            writeSweepMappings(combinedMappings);
+            return;
         }
+        std::unique_ptr<std::ostream> outstrm = openOutputFile();
+        writeCombinedMappings(combinedMappings, *outstrm);
+        outstrm->flush();
+        closeOutputFile(*outstrm);
+      }
 
-        if (param.create_index_only) {
-            std::cerr << "[wfmash::mashmap] All indices created successfully. Exiting." << std::endl;
-            exit(0);
+      /**
+       * @brief     filter the mappings gathered over all target subsets once for each sweep
+       *            setting, writing each to its own output
+       * @details   the queries were mapped at the most permissive of the settings, finding a
+       *            superset of the mappings of each. A setting first drops those under its
+       *            identity, as its own mapping would have, then the final filtering merges
+       *            and filters the rest under its -n, -c and -O, with its chain ids numbered
+       *            as in a run of its own.
+       */
+      void writeSweepMappings(const std::unordered_map<seqno_t, MappingResultsVector_t>& combinedMappings)
+      {
+        const SweepSetting mapped{param.outFileName, param.percentageIdentity, param.numMappingsForSegment,
+                                  param.chain_gap, param.overlap_threshold};
+        const offset_t chainIdBase = chainIdsReported.load();
+        for (const SweepSetting& setting : param.sweep) {
+            param.outFileName = setting.output;
+            param.percentageIdentity = setting.percentageIdentity;
+            param.numMappingsForSegment = setting.numMappingsForSegment;
+            param.chain_gap = setting.chain_gap;
+            param.overlap_threshold = setting.overlap_threshold;
+            chainIdsReported.store(chainIdBase);
+
+            std::unordered_map<seqno_t, MappingResultsVector_t> mappings = combinedMappings;
+            if (!param.keep_low_pct_id) {
+                for (auto& [querySeqId, queryMappings] : mappings) {
+                    dropMappings(queryMappings, [&](const MappingResult& e) { return e.nucIdentity < param.percentageIdentity; });
+                }
+            }
+            std::unique_ptr<std::ostream> outstrm = openOutputFile();
+            writeCombinedMappings(mappings, *outstrm);
+            outstrm->flush();
+            closeOutputFile(*outstrm);
+            std::cerr << "[wfmash::mashmap] Sweep setting p=" << setting.percentageIdentity * 100 << " n=" << setting.numMappingsForSegment
+                      << " c=" << setting.chain_gap << " O=" << setting.overlap_threshold << " written to " << setting.output << std::endl;
         }
+        param.outFileName = mapped.output;
+        param.percentageIdentity = mapped.percentageIdentity;
+        param.numMappingsForSegment = mapped.numMappingsForSegment;
+        param.chain_gap = mapped.chain_gap;
+        param.overlap_threshold = mapped.overlap_threshold;
+      }
 
-        // Process combined mappings
-        std::atomic<bool> processing_done(false);
-        std::atomic<bool> workers_done(false);
-        std::atomic<bool> output_done(false);
-        aggregate_atomic_queue_t aggregate_queue;
+      /**
+       * @brief     filter the mappings spilled to the run files and write them out, reading
+       *            back one query at a time
+       * @details   the queue holds a few queries per thread, so memory is bounded by the
+       *            mappings of those queries rather than by the whole run
+       */
+      void writeSpilledMappings(MappingRuns& runs, std::ostream& outstrm)
+      {
+        writeQueryMappings(runs.mappings(), 2 * param.threads, outstrm, [&](const query_sink_t& queue) {
+            runs.mergeByQuery(queue);
+        });
+      }
 
-        // Get total count of mappings
-        uint64_t totalMappings = 0;
-        for (const auto& [querySeqId, mappings] : combinedMappings) {
-            totalMappings += mappings.size();
-        }
+      /**
+       * @brief     run the final filtering of each query enqueued by enqueue on every thread,
+       *            writing the results in the order they are enqueued
+       * @details   each thread formats its queries on its own and appends them, in order, to a
+       *            pooled chunk handed to the writer once full, so the output goes out in a few
+       *            large writes. A query's chain ids start past the mappings of the queries
+       *            before it, so they are set before it is filtered.
+       */
+      void writeQueryMappings(uint64_t totalMappings, size_t queueCapacity, std::ostream& outstrm,
+                              const std::function<void(const query_sink_t&)>& enqueue)
+      {
+        OutputChunkPool chunks(outputChunkSize);
+        writer_queue_t writer_queue(2 * param.threads + 2, nullptr, "writer");
+
+        // Process combined mappings
+        aggregate_queue_t aggregate_queue(queueCapacity, nullptr, "aggregate");
 
         // Initialize progress logger
         progress_meter::ProgressMeter progress(
             totalMappings * 2,
             "[wfmash::mashmap] merging and filtering");
 
+        // One-to-one filtering also needs the reference axis across all queries
+        std::unique_ptr<MappingCollector> collector(param.filterMode == filter::ONETOONE ? new MappingCollector : nullptr);
+        OrderedOutput ordered;
+        ordered.chunk = chunks.get();
+
         // Start worker threads
         std::vector<std::thread> workers;
         for (int i = 0; i < param.threads; ++i) {
-            workers.emplace_back(&Map::processCombinedMappingsThread, this, std::ref(aggregate_queue), std::ref(writer_queue), std::ref(processing_done), std::ref(progress));
+            workers.emplace_back([&, i]() {
+                sampling_profiler::name_thread("filter", sampling_profiler::MAP, i);
+                processCombinedMappingsThread(aggregate_queue, writer_queue, chunks, ordered, progress, collector.get());
+            });
         }
 
         // Start output thread
-        std::thread output_thread(&Map::outputThread, this, std::ref(outstrm), std::ref(writer_queue), std::ref(processing_done), std::ref(workers_done), std::ref(output_done));
+        std::thread output_thread([&]() {
+            sampling_profiler::name_thread("output", sampling_profiler::MAP);
+            outputThread(outstrm, writer_queue, chunks);
+        });
 
         // Enqueue tasks
-        for (auto& [querySeqId, mappings] : combinedMappings) {
-            auto* task = new std::pair<seqno_t, MappingResultsVector_t*>(querySeqId, &mappings);
-            while (!aggregate_queue.try_push(task)) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
-            }
-        }
+        uint64_t order = 0;
+        offset_t chainIdBase = chainIdsReported.load();
+        enqueue([&](seqno_t querySeqId, MappingResultsVector_t&& mappings) {
+            const offset_t queryChainIdBase = chainIdBase;
+            chainIdBase += mappings.size();
+            aggregate_queue.push(new QueryTask{querySeqId, std::move(mappings), order++, queryChainIdBase});
+        });
 
         // Signal that all tasks have been enqueued
-        processing_done.store(true);
+        aggregate_queue.close();
 
         // Wait for worker threads to finish
         for (auto& worker : workers) {
             worker.join();
         }
-
-        workers_done.store(true);
+        ChunkStream out(ordered.chunk);
+        handOverChunk(out, writer_queue, chunks, true);
+
+        if (collector) {
+            filterOneToOne(collector->mappings);
+            auto& mappings = collector->mappings;
+            chainIdBase = chainIdsReported.load();
+            out.reset(chunks.get());
+            for (auto begin = mappings.begin(), end = begin; begin != mappings.end(); begin = end) {
+                end = std::find_if(begin, mappings.end(), [&](const MappingResult& e) { return e.querySeqId != begin->querySeqId; });
+                MappingResultsVector_t queryMappings(begin, end);
+                chainIdBase += reportReadMappings(queryMappings, idManager->getSequenceName(begin->querySeqId), out, chainIdBase);
+                handOverChunk(out, writer_queue, chunks, false);
+            }
+            handOverChunk(out, writer_queue, chunks, true);
+        }
+        chainIdsReported.store(chainIdBase);
 
         // Wait for output thread to finish
-        while (!output_done.load()) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
-        }
+        writer_queue.close();
         output_thread.join();
 
         progress.finish();
 
       }
 
-      void processSubset(uint64_t subset_count, size_t total_subsets, uint64_t total_seq_length,
-                         input_atomic_queue_t& input_queue, merged_mappings_queue_t& merged_queue,
-                         fragment_atomic_queue_t& fragment_queue, std::atomic<bool>& reader_done,
-                         std::atomic<bool>& workers_done, std::atomic<bool>& fragments_done,
-                         std::unordered_map<seqno_t, MappingResultsVector_t>& combinedMappings)
+      /**
+       * @brief     keep the index of every target subset resident and map batches of queries
+       *            against it, one request per line of requests
+       * @details   a request is the path of an indexed query FASTA; its PAF is written to
+       *            replies followed by a "#done <path>" line, or an "#error <message>" line
+       *            if it cannot be mapped
+       */
+      /**
+       * @brief     build or load the index of every target subset and keep them resident,
+       *            for serveQueries and mapSequences
+       */
+      void loadResidentIndex()
+      {
+        std::vector<std::vector<std::string>> target_subsets;
+        std::vector<uint64_t> target_subset_offsets;
+        std::vector<stdfs::path> target_subset_files;
+        if (!param.indexFilename.empty()) {
+            for (auto& subset : indexedTargetSubsets()) {
+                target_subsets.push_back(std::move(subset.sequenceNames));
+                target_subset_offsets.push_back(subset.offset);
+                target_subset_files.push_back(std::move(subset.file));
+            }
+        } else {
+            target_subsets = createTargetSubsets(targetSequenceNames);
+            target_subset_offsets.assign(target_subsets.size(), 0);
+        }
+
+        for (size_t i = 0; i < target_subsets.size(); ++i) {
+            if (target_subsets[i].empty()) {
+                continue;
+            }
+            std::cerr << "[wfmash::mashmap] " << (param.indexFilename.empty() ? "Building" : "Loading")
+                      << " index for subset " << i << " with " << target_subsets[i].size() << " sequences" << std::endl;
+            skch::Parameters p = param;
+            if (!target_subset_files.empty()) {
+                p.indexFilename = target_subset_files[i];
+            }
+            residentSketches.emplace_back(loadSubsetSketch(target_subsets[i], target_subset_offsets[i], std::move(p)));
+            residentSubsets.push_back(std::move(target_subsets[i]));
+            adoptIndexHashing(*residentSketches.back());
+        }
+      }
+
+      void serveQueries(std::istream& requests, std::ostream& replies)
+      {
+        loadResidentIndex();
+        std::cerr << "[wfmash::mashmap] Serving queries against " << residentSketches.size() << " resident index subsets" << std::endl;
+
+        std::string request;
+        while (std::getline(requests, request)) {
+            request.erase(0, request.find_first_not_of(" \t\r"));
+            request.erase(request.find_last_not_of(" \t\r") + 1);
+            if (request.empty()) {
+                continue;
+            }
+            if (!seqiter::build_missing_fai({request}).empty() || !stdfs::exists(request + ".fai")) {
+                replies << "#error missing FASTA index " << request << ".fai" << std::endl;
+                continue;
+            }
+
+            idManager->resetQueries({request}, param.query_prefix, param.query_list);
+            buildGroupSeqRuns();
+            param.querySequences = {request};
+            querySequenceIds = idManager->getQuerySequenceIds();
+            findDuplicateQueries();
+
+            uint64_t total_seq_length = 0;
+            for (const seqno_t seqId : querySequenceIds) {
+                total_seq_length += idManager->getSequenceLength(seqId);
+            }
+
+            std::unordered_map<seqno_t, MappingResultsVector_t> combinedMappings;
+            for (size_t i = 0; i < residentSketches.size(); ++i) {
+                refSketch = residentSketches[i].get();
+                processSubset(i, residentSketches.size(), residentSubsets[i], total_seq_length, combinedMappings);
+            }
+            refSketch = nullptr;
+
+            writeCombinedMappings(combinedMappings, replies);
+            replies << "#done " << request << std::endl;
+        }
+      }
+
+      void processSubset(uint64_t subset_count, size_t total_subsets,
+                         const std::vector<std::string>& target_subset, uint64_t total_seq_length,
+                         std::unordered_map<seqno_t, MappingResultsVector_t>& combinedMappings,
+                         std::ostream* streamOut = nullptr)
       {
+          sampling_profiler::ScopedStage profile_stage(sampling_profiler::MAP);
           progress_meter::ProgressMeter progress(
               total_seq_length,
               "[wfmash::mashmap] mapping ("
@@ -696,29 +3126,54 @@ namespace skch
           // Create temporary storage for this subset's mappings
           std::unordered_map<seqno_t, MappingResultsVector_t> subsetMappings;
 
+          const int nodes = param.numa ? numa::nodeCount() : 1;
+          MappingPipeline pipeline(param.threads, nodes);
+          pipeline.streaming = streamOut != nullptr;
+          if (mappingRuns) {
+              mappingRuns->beginRun(subset_count);
+          }
+
+          seqno_t firstTargetSeqId = std::numeric_limits<seqno_t>::max();
+          for (const auto& name : target_subset) {
+              firstTargetSeqId = std::min(firstTargetSeqId, idManager->getSequenceId(name));
+          }
+          subsetOnlyGroup = onlyGroup(target_subset);
+          if (subsetOnlyGroup >= 0) {
+              std::cerr << "[wfmash::mashmap] Subset " << subset_count << " holds a single group, skipped by its queries" << std::endl;
+          }
+          queryReadOrder = readOrder(combinedMappings);
+          subsetCached = !cachedTarget.empty() && std::all_of(target_subset.begin(), target_subset.end(), [&](const std::string& name) {
+              return cachedTarget[idManager->getSequenceId(name)];
+          });
+
           // Launch reader thread
           std::thread reader([&]() {
-              reader_thread(input_queue, reader_done, progress, *idManager);
+              sampling_profiler::name_thread("reader", sampling_profiler::MAP);
+              reader_thread(pipeline.input_queue, progress, *idManager, firstTargetSeqId);
           });
 
-          std::vector<std::thread> fragment_workers;
-          for (int i = 0; i < param.threads; ++i) {
-              fragment_workers.emplace_back([&]() {
-                  fragment_thread(fragment_queue, fragments_done);
-              });
-          }
-
-          // Launch worker threads
+          // Launch worker threads, which share the fragments of all queries being mapped
           std::vector<std::thread> workers;
           for (int i = 0; i < param.threads; ++i) {
-              workers.emplace_back([&]() {
-                  worker_thread(input_queue, fragment_queue, merged_queue, progress, reader_done, workers_done);
+              workers.emplace_back([&, i]() {
+                  sampling_profiler::name_thread("map", sampling_profiler::MAP, i);
+                  worker_thread(i, pipeline);
               });
+              if (nodes > 1) {
+                  numa::pinToNode(workers.back(), i % nodes);
+              }
           }
 
-          // Launch aggregator thread with subset storage
+          // Launch aggregator thread with subset storage, or writing each query out as it is done
           std::thread aggregator([&]() {
-              aggregator_thread(merged_queue, workers_done, subsetMappings);
+              sampling_profiler::name_thread("aggregator", sampling_profiler::MAP);
+              if (streamOut) {
+                  streaming_output_thread(pipeline.merged_queue, *streamOut, progress);
+              } else if (mappingRuns) {
+                  spilling_aggregator_thread(pipeline.merged_queue, *mappingRuns);
+              } else {
+                  aggregator_thread(pipeline.merged_queue, subsetMappings);
+              }
           });
 
           // Wait for all threads to complete
@@ -727,14 +3182,12 @@ namespace skch
           for (auto& worker : workers) {
               worker.join();
           }
-          workers_done.store(true);
-          fragments_done.store(true);
-
-          for (auto& worker : fragment_workers) {
-              worker.join();
-          }
+          pipeline.merged_queue.close();
 
           aggregator.join();
+          if (mappingRuns) {
+              mappingRuns->endRun();
+          }
 
           // Filter mappings within this subset before merging with previous results
           for (auto& [querySeqId, mappings] : subsetMappings) {
@@ -751,14 +3204,46 @@ namespace skch
               }
           }
 
-          // Reset flags for next iteration
-          reader_done.store(false);
-          workers_done.store(false);
-          fragments_done.store(false);
-
           progress.finish();
       }
 
+      /**
+       * @brief               erase the mappings matching any of the filters in one pass
+       * @details             filters are tests on a single mapping, so several of them are fused
+       *                      into one compaction instead of a remove_if and erase each
+       */
+      template <typename Drop>
+      static void dropMappings(MappingResultsVector_t &readMappings, Drop&& drop)
+      {
+          readMappings.erase(
+              std::remove_if(readMappings.begin(), readMappings.end(), std::forward<Drop>(drop)),
+              readMappings.end());
+      }
+
+      // mapping with fewer than the target number of merged base mappings
+      bool isWeakMapping(const MappingResult &e, int64_t min_count) const
+      {
+          return e.blockLength < param.block_length //e.queryLen > e.blockLength
+              || e.n_merged < min_count;
+      }
+
+      // mapping whose identity and query/ref length don't agree
+      bool isFalseHighIdentity(const MappingResult &e) const
+      {
+          int64_t q_l = (int64_t)e.queryEndPos - (int64_t)e.queryStartPos;
+          int64_t r_l = (int64_t)e.refEndPos - (int64_t)e.refStartPos;
+          uint64_t delta = std::abs(r_l - q_l);
+          double len_id_bound = (1.0 - (double)delta/(((double)q_l+r_l)/2));
+          return len_id_bound < std::min(0.7, std::pow(param.percentageIdentity,3));
+      }
+
+      // mapping sparsified away by the hash of its coordinates
+      bool isSparsified(const MappingResult &e) const
+      {
+          return param.sparsity_hash_threshold < std::numeric_limits<uint64_t>::max()
+              && e.coordinateHash() > param.sparsity_hash_threshold;
+      }
+
       /**
        * @brief               helper to main mapping function
        * @details             filters mappings with fewer than the target number of merged base mappings
@@ -767,14 +3252,7 @@ namespace skch
        */
       void filterWeakMappings(MappingResultsVector_t &readMappings, int64_t min_count)
       {
-          readMappings.erase(
-              std::remove_if(readMappings.begin(),
-                             readMappings.end(),
-                             [&](MappingResult &e){
-                                 return e.blockLength < param.block_length //e.queryLen > e.blockLength
-                                     || e.n_merged < min_count;
-                             }),
-              readMappings.end());
+          dropMappings(readMappings, [&](const MappingResult &e){ return isWeakMapping(e, min_count); });
       }
 
       /**
@@ -785,17 +3263,7 @@ namespace skch
        */
       void filterFalseHighIdentity(MappingResultsVector_t &readMappings)
       {
-          readMappings.erase(
-              std::remove_if(readMappings.begin(),
-                             readMappings.end(),
-                             [&](MappingResult &e){
-                                 int64_t q_l = (int64_t)e.queryEndPos - (int64_t)e.queryStartPos;
-                                 int64_t r_l = (int64_t)e.refEndPos - (int64_t)e.refStartPos;
-                                 uint64_t delta = std::abs(r_l - q_l);
-                                 double len_id_bound = (1.0 - (double)delta/(((double)q_l+r_l)/2));
-                                 return len_id_bound < std::min(0.7, std::pow(param.percentageIdentity,3));
-                             }),
-              readMappings.end());
+          dropMappings(readMappings, [&](const MappingResult &e){ return isFalseHighIdentity(e); });
       }
 
       /**
@@ -808,13 +3276,7 @@ namespace skch
       void filterFailedSubMappings(MappingResultsVector_t &readMappings,
                                    const robin_hood::unordered_set<offset_t>& kept_chains)
       {
-          readMappings.erase(
-              std::remove_if(readMappings.begin(),
-                             readMappings.end(),
-                             [&](MappingResult &e){
-                                 return kept_chains.count(e.splitMappingId) == 0;
-                             }),
-              readMappings.end());
+          dropMappings(readMappings, [&](const MappingResult &e){ return kept_chains.count(e.splitMappingId) == 0; });
       }
 
       /**
@@ -827,13 +3289,7 @@ namespace skch
       void sparsifyMappings(MappingResultsVector_t &readMappings)
       {
           if (param.sparsity_hash_threshold < std::numeric_limits<uint64_t>::max()) {
-              readMappings.erase(
-                  std::remove_if(readMappings.begin(),
-                                 readMappings.end(),
-                                 [&](MappingResult &e){
-                                     return e.hash() > param.sparsity_hash_threshold;
-                                 }),
-                  readMappings.end());
+              dropMappings(readMappings, [&](const MappingResult &e){ return isSparsified(e); });
           }
       }
 
@@ -854,10 +3310,30 @@ namespace skch
           const SequenceIdManager& idManager,
           progress_meter::ProgressMeter& progress)
       {
-        filteredMappings.reserve(unfilteredMappings.size());
+        sortMappingsByKey(unfilteredMappings, [](const MappingResult& e) { return std::make_tuple(e.refSeqId, e.refStartPos); });
+
+        // Without groups the whole set is a single subrange, filtered in place rather than
+        // moved through tmpMappings and back
+        if (!param.skip_prefix && (param.filterMode == filter::MAP || param.filterMode == filter::ONETOONE))
+        {
+          filteredMappings = std::move(unfilteredMappings);
+          unfilteredMappings.clear();
+          sortMappingsByKey(filteredMappings, [](const MappingResult& e) { return std::make_tuple(e.queryStartPos, e.refSeqId, e.refStartPos); });
+          if (filter_ref)
+          {
+              skch::Filter::ref::filterMappings(filteredMappings, idManager, n_mappings, param.dropRand, param.overlap_threshold);
+          }
+          else
+          {
+              skch::Filter::query::filterMappings(filteredMappings, n_mappings, param.dropRand, param.overlap_threshold, progress);
+          }
+          sortMappingsByKey(filteredMappings, [](const MappingResult& e) {
+              return std::make_tuple(e.queryStartPos, e.refSeqId, e.refStartPos, e.strand);
+          });
+          return;
+        }
 
-        std::sort(unfilteredMappings.begin(), unfilteredMappings.end(), [](const auto& a, const auto& b) 
-            { return std::tie(a.refSeqId, a.refStartPos) < std::tie(b.refSeqId, b.refStartPos); });
+        filteredMappings.reserve(unfilteredMappings.size());
         auto subrange_begin = unfilteredMappings.begin();
         auto subrange_end = unfilteredMappings.begin();
         if (param.filterMode == filter::MAP || param.filterMode == filter::ONETOONE) 
@@ -880,8 +3356,7 @@ namespace skch
                 tmpMappings.end(), 
                 std::make_move_iterator(subrange_begin), 
                 std::make_move_iterator(subrange_end));
-            std::sort(tmpMappings.begin(), tmpMappings.end(), [](const auto& a, const auto& b) 
-                { return std::tie(a.queryStartPos, a.refSeqId, a.refStartPos) < std::tie(b.queryStartPos, b.refSeqId, b.refStartPos); });
+            sortMappingsByKey(tmpMappings, [](const MappingResult& e) { return std::make_tuple(e.queryStartPos, e.refSeqId, e.refStartPos); });
             if (filter_ref)
             {
                 skch::Filter::ref::filterMappings(tmpMappings, idManager, n_mappings, param.dropRand, param.overlap_threshold);
@@ -899,129 +3374,381 @@ namespace skch
           }
         }
         //Sort the mappings by query (then reference) position
-        std::sort(
-            filteredMappings.begin(), filteredMappings.end(),
-            [](const MappingResult &a, const MappingResult &b) {
-                return std::tie(a.queryStartPos, a.refSeqId, a.refStartPos, a.strand) 
-                    < std::tie(b.queryStartPos, b.refSeqId, b.refStartPos, b.strand);
-            });
+        sortMappingsByKey(filteredMappings, [](const MappingResult& e) {
+            return std::make_tuple(e.queryStartPos, e.refSeqId, e.refStartPos, e.strand);
+        });
       }
 
 
       /**
        * @brief               main mapping function given an input read
-       * @details             this function is run in parallel by multiple threads
-       * @param[in]   input   input read details
-       * @return              output object containing the mappings
+       * @details             splits the read into fragments and pushes them to this worker's
+       *                      deque, where any worker may take them; whichever maps the last
+       *                      one merges the read in finishQuery
+       * @param[in]   input   input read details, owned until the read is merged
        */
-      QueryMappingOutput* mapModule(InputSeqProgContainer* input,
-                                    fragment_atomic_queue_t& fragment_queue) {
+      void mapModule(InputSeqProgContainer* input,
+                     int worker,
+                     MappingPipeline& pipeline,
+                     MappingScratch& scratch) {
 
+        if (input->packed) {
+            unpackQuery(*input);
+        }
         QueryMappingOutput* output = new QueryMappingOutput{input->name, {}, {}, input->progress};
-        std::atomic<int> fragments_processed{0};
-        bool split_mapping = true;
+        output->seqId = input->seqId;
+        output->ordinal = input->ordinal;
+        output->input = input;
         int refGroup = this->idManager->getRefGroup(input->seqId);
 
+        const std::vector<offset_t> fragmentStarts = fragmentStartsOf(input->len);
+        // A query replayed from the sketch cache has no sequence to map coarsely
+        if (param.coarse_factor > 0 && input->seq && fragmentStarts.size() > 1) {
+            output->coarseGuides.reset(new QueryMappingOutput::CoarseGuide[coarseSegmentsOf(input->len)]);
+        }
+        if (param.adaptive_segment_factor > 0 && input->seq && fragmentStarts.size() > 1) {
+            output->fragmentClaimed.reset(new std::atomic<bool>[fragmentStarts.size()]());
+        }
+        if (!fragmentStarts.empty() && fragmentStarts.size() <= smallQueryMaxFragments) {
+            mapSmallQuery(output, fragmentStarts, refGroup, scratch, pipeline);
+            return;
+        }
+
         std::vector<FragmentData*> fragments;
-        int noOverlapFragmentCount = input->len / param.segLength;
+        // A query replayed from the sketch cache has no sequence, its fragments bring their sketch
+        char* seq = input->seq ? &(input->seq)[0u] : nullptr;
 
-        for (int i = 0; i < noOverlapFragmentCount; i++) {
+        for (size_t i = 0; i < fragmentStarts.size(); i++) {
             auto fragment = new FragmentData{
-                &(input->seq)[0u] + i * param.segLength,
+                seq ? seq + fragmentStarts[i] : nullptr,
                 static_cast<int>(param.segLength),
                 static_cast<int>(input->len),
                 input->seqId,
                 input->name,
                 refGroup,
-                i,
-                output,
-                &fragments_processed
+                static_cast<int>(i),
+                output
             };
             fragments.push_back(fragment);
         }
 
-        if (noOverlapFragmentCount >= 1 && input->len % param.segLength != 0) {
-            auto fragment = new FragmentData{
-                &(input->seq)[0u] + input->len - param.segLength,
-                static_cast<int>(param.segLength),
-                static_cast<int>(input->len),
-                input->seqId,
-                input->name,
-                refGroup,
-                noOverlapFragmentCount,
-                output,
-                &fragments_processed
-            };
-            fragments.push_back(fragment);
-            noOverlapFragmentCount++;
+        output->fragmentResults.resize(fragments.size());
+        output->fragmentsRemaining.store(fragments.size());
+        if (fragments.size() >= incrementalMergeMinFragments) {
+            output->incremental = true;
+            output->fragmentDone.assign(fragments.size(), 0);
+        }
+        if (fragments.empty()) {
+            finishQuery(output, pipeline);
+            return;
+        }
+
+        if (!input->fragmentSketches.empty()) {
+            // Sketches taken from the target index are recorded for the later subsets alike
+            if (recordQuerySketches) {
+                writeQuerySketches(input->seqId, input->len, input->name, input->fragmentSketches);
+            }
+            for (size_t i = 0; i < fragments.size(); i++) {
+                fragments[i]->sketch.swap(input->fragmentSketches[i]);
+                fragments[i]->presketched = true;
+            }
+            input->fragmentSketches.clear();
+            for (auto it = fragments.rbegin(); it != fragments.rend(); ++it) {
+                pipeline.fragment_pool.push(worker, *it);
+            }
+        } else if (param.sketch_query_once || recordQuerySketches) {
+            // Hash the query once; each fragment is scheduled as soon as its sketch is complete.
+            // The input may be merged and freed once its last fragment is pushed.
+            const seqno_t seqId = input->seqId;
+            const offset_t len = input->len;
+            const std::string name = input->name;
+            std::vector<std::vector<MinmerInfo>> recorded(recordQuerySketches ? fragments.size() : 0);
+            profile::StageTimer timer(profile::SKETCH);
+            CommonFunc::sketchSequenceWindows<MinmerInfo>(seq, len, fragmentStarts, param.segLength,
+                param.kmerSize, param.alphabetSize, param.sketchSize, seqId, param.kmerHashEngine, spacedSeeds.get(),
+                [&](size_t i, std::vector<MinmerInfo>& sketch) {
+                    if (recordQuerySketches) {
+                        recorded[i] = sketch;
+                    }
+                    fragments[i]->sketch.swap(sketch);
+                    fragments[i]->presketched = true;
+                    pipeline.fragment_pool.push(worker, fragments[i]);
+                }, syncmers.get(), sketchHashThreshold, dust.get());
+            if (recordQuerySketches) {
+                writeQuerySketches(seqId, len, name, recorded);
+            }
+        } else {
+            // Pushed last to first, so this worker maps the read from its start
+            for (auto it = fragments.rbegin(); it != fragments.rend(); ++it) {
+                pipeline.fragment_pool.push(worker, *it);
+            }
         }
+      }
+
+      //Fragments from which a query is merged in segments while it is mapped
+      static constexpr size_t incrementalMergeMinFragments = 1024;
+
+      //Fragments up to which a query is mapped whole by the worker that took it
+      static constexpr size_t smallQueryMaxFragments = 32;
+
+      //Queries a worker takes from the input queue at once
+      static constexpr size_t smallQueryBatch = 16;
+
+      /**
+       * @brief               map the fragments of a small query one after the other in the
+       *                      worker's scratch fragment, then merge it
+       * @details             nothing is allocated or scheduled per fragment; a query this short
+       *                      maps faster in one worker than spread over several
+       */
+      void mapSmallQuery(QueryMappingOutput* output,
+                         const std::vector<offset_t>& fragmentStarts,
+                         int refGroup,
+                         MappingScratch& scratch,
+                         MappingPipeline& pipeline) {
+        InputSeqProgContainer* input = output->input;
+        char* seq = input->seq ? &(input->seq)[0u] : nullptr;
+        output->fragmentResults.resize(fragmentStarts.size());
+
+        FragmentData* fragment = &scratch.fragment;
+        fragment->len = static_cast<int>(param.segLength);
+        fragment->fullLen = static_cast<int>(input->len);
+        fragment->seqId = input->seqId;
+        fragment->seqName = input->name;
+        fragment->refGroup = refGroup;
+        fragment->output = output;
+        auto mapAt = [&](size_t i, bool presketched) {
+            fragment->seq = seq ? seq + fragmentStarts[i] : nullptr;
+            fragment->fragmentIndex = static_cast<int>(i);
+            fragment->presketched = presketched;
+            mapFragment(fragment, scratch);
+        };
 
-        for (auto& fragment : fragments) {
-            while (!fragment_queue.try_push(fragment)) {
-                //std::this_thread::yield(); // too fast
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        if (!input->fragmentSketches.empty()) {
+            if (recordQuerySketches) {
+                writeQuerySketches(input->seqId, input->len, input->name, input->fragmentSketches);
+            }
+            for (size_t i = 0; i < fragmentStarts.size(); i++) {
+                fragment->sketch.swap(input->fragmentSketches[i]);
+                mapAt(i, true);
+            }
+            input->fragmentSketches.clear();
+        } else if (param.sketch_query_once || recordQuerySketches) {
+            std::vector<std::vector<MinmerInfo>> recorded(recordQuerySketches ? fragmentStarts.size() : 0);
+            {
+                profile::StageTimer timer(profile::SKETCH);
+                CommonFunc::sketchSequenceWindows<MinmerInfo>(seq, input->len, fragmentStarts, param.segLength,
+                    param.kmerSize, param.alphabetSize, param.sketchSize, input->seqId, param.kmerHashEngine, spacedSeeds.get(),
+                    [&](size_t i, std::vector<MinmerInfo>& sketch) {
+                        if (recordQuerySketches) {
+                            recorded[i] = sketch;
+                        }
+                        fragment->sketch.swap(sketch);
+                        mapAt(i, true);
+                    }, syncmers.get(), sketchHashThreshold, dust.get());
+            }
+            if (recordQuerySketches) {
+                writeQuerySketches(input->seqId, input->len, input->name, recorded);
+            }
+        } else {
+            for (size_t i = 0; i < fragmentStarts.size(); i++) {
+                mapAt(i, false);
             }
         }
+        finishQuery(output, pipeline);
+      }
 
-        // Wait for all fragments to be processed
-        while (fragments_processed.load(std::memory_order_relaxed) < noOverlapFragmentCount) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      /**
+       * @brief               chain and filter one segment of an incremental query and append
+       *                      the results to those of the earlier segments
+       */
+      void mergeSegment(QueryMappingOutput* output, MappingResultsVector_t& segment) {
+        if (segment.empty()) {
+            return;
         }
+        mappingBoundarySanityCheck(output->input, segment);
+        auto [nonMergedMappings, mergedMappings] = filterSubsetMappings(segment, output->progress, output->segmentsMerged);
+        output->results.insert(output->results.end(), nonMergedMappings.begin(), nonMergedMappings.end());
+        output->mergedResults.insert(output->mergedResults.end(), mergedMappings.begin(), mergedMappings.end());
+        output->segmentsMerged = true;
+      }
 
-        mappingBoundarySanityCheck(input, output->results);
-          
-        // Filter and get both merged and non-merged mappings
-        auto [nonMergedMappings, mergedMappings] = filterSubsetMappings(output->results, input->progress);
-        output->results = std::move(nonMergedMappings);
-        output->mergedResults = std::move(mergedMappings);
+      /**
+       * @brief               record a mapped fragment of an incremental query, and merge the
+       *                      segments of it that can no longer change
+       * @details             Fragment mappings start at position fragmentIndex * segLength, so
+       *                      the mapped fragments before the first unmapped one, in order, hold
+       *                      the query's mappings up to its start. A chain only extends to
+       *                      mappings starting at most chain_gap after one ends, and the filters
+       *                      only compare mappings that overlap on the query, so where no mapping
+       *                      ends within chain_gap of the next start the mappings before are
+       *                      chained and filtered as they would be with the whole query. One
+       *                      worker at a time merges; fragments mapped meanwhile are picked up
+       *                      by it, and it finishes the query once all are.
+       */
+      void mergeMappedSegments(QueryMappingOutput* output, int fragmentIndex, MappingPipeline& pipeline) {
+        std::unique_lock<std::mutex> lock(output->segmentMutex);
+        output->fragmentDone[fragmentIndex] = 1;
+        if (output->merging) {
+            return;
+        }
+        output->merging = true;
+        while (true) {
+            auto& pending = output->pending;
+            while (output->frontier < output->fragmentDone.size() && output->fragmentDone[output->frontier]) {
+                auto& slot = output->fragmentResults[output->frontier++];
+                pending.insert(pending.end(), slot.begin(), slot.end());
+                MappingResultsVector_t().swap(slot);
+            }
+            if (output->frontier == output->fragmentDone.size()) {
+                lock.unlock();
+                finishQuery(output, pipeline);
+                return;
+            }
+
+            // Last cut after which no mapping of the segment can chain or overlap. Cuts
+            // before the last mapping searched stay impossible, so the search resumes there.
+            const offset_t unmappedStart = offset_t(output->frontier) * param.segLength;
+            size_t cut = 0;
+            size_t i = output->pendingScanned > 0 ? output->pendingScanned - 1 : 0;
+            offset_t maxEnd = i > 0 ? output->pendingMaxEnd : std::numeric_limits<offset_t>::min();
+            for (; i < pending.size(); ++i) {
+                output->pendingMaxEnd = maxEnd;
+                maxEnd = std::max(maxEnd, pending[i].queryEndPos);
+                const offset_t next = i + 1 < pending.size() ? pending[i + 1].queryStartPos : unmappedStart;
+                if (maxEnd + param.chain_gap < next && (output->segmentsMerged || i + 1 >= 2)) {
+                    cut = i + 1;
+                }
+            }
+            output->pendingScanned = pending.size();
+            if (cut == 0) {
+                output->merging = false;
+                return;
+            }
 
-        return output;
+            MappingResultsVector_t segment(pending.begin(), pending.begin() + cut);
+            pending.erase(pending.begin(), pending.begin() + cut);
+            output->pendingScanned = 0;
+            lock.unlock();
+            mergeSegment(output, segment);
+            lock.lock();
+        }
       }
 
-      void fragment_thread(fragment_atomic_queue_t& fragment_queue,
-                           std::atomic<bool>& fragments_done) {
-          std::vector<IntervalPoint> intervalPoints;
-          std::vector<L1_candidateLocus_t> l1Mappings;
-          MappingResultsVector_t l2Mappings;
-          QueryMetaData<MinVec_Type> Q;
+      /**
+       * @brief               merge and filter the fragment mappings of a read, once all are
+       *                      mapped, and hand them to the aggregator
+       */
+      void finishQuery(QueryMappingOutput* output, MappingPipeline& pipeline) {
+        profile::count(profile::QUERIES, 1);
+        InputSeqProgContainer* input = output->input;
+        if (output->incremental) {
+            // The earlier segments are merged already
+            mergeSegment(output, output->pending);
+            MappingResultsVector_t().swap(output->pending);
+        } else {
+            size_t total = output->results.size();
+            for (const auto& fragmentMappings : output->fragmentResults) {
+                total += fragmentMappings.size();
+            }
+            // Slots are concatenated in fragment order, whichever worker mapped them
+            output->results.reserve(total);
+            for (auto& fragmentMappings : output->fragmentResults) {
+                output->results.insert(output->results.end(), fragmentMappings.begin(), fragmentMappings.end());
+            }
 
-          while (!fragments_done.load()) {
-              FragmentData* fragment = nullptr;
-              if (fragment_queue.try_pop(fragment)) {
-                  if (fragment) {
-                      processFragment(fragment, intervalPoints, l1Mappings, l2Mappings, Q);
-                  }
-              } else {
-                  std::this_thread::sleep_for(std::chrono::milliseconds(10));
-              }
-          }
+            mappingBoundarySanityCheck(input, output->results);
+
+            // Filter and get both merged and non-merged mappings
+            auto [nonMergedMappings, mergedMappings] = filterSubsetMappings(output->results, input->progress);
+            output->results = std::move(nonMergedMappings);
+            output->mergedResults = std::move(mergedMappings);
+        }
+        output->fragmentResults.clear();
+        output->fragmentResults.shrink_to_fit();
+
+        // A query region's mappings are reported on the whole query
+        if (input->fullLen) {
+            for (auto* mappings : {&output->results, &output->mergedResults}) {
+                for (auto& e : *mappings) {
+                    e.queryStartPos += input->regionStart;
+                    e.queryEndPos += input->regionStart;
+                    e.queryLen = input->fullLen;
+                }
+            }
+        }
+
+        output->input = nullptr;
+        queue_budget::shared().release(input->budgetBytes);
+        delete input;
+
+        // The queries repeating this one get copies of its mappings, on the same targets but
+        // for the copy of itself among them
+        const auto duplicates = queryDuplicates.find(output->seqId);
+        if (duplicates != queryDuplicates.end()) {
+            for (size_t i = 0; i < duplicates->second.size(); ++i) {
+                const seqno_t copyId = duplicates->second[i];
+                QueryMappingOutput* copy = new QueryMappingOutput{std::string(idManager->getSequenceName(copyId)),
+                                                                  output->results, output->mergedResults, output->progress};
+                copy->seqId = copyId;
+                copy->ordinal = output->ordinal + i + 1;
+                for (auto* mappings : {&copy->results, &copy->mergedResults}) {
+                    for (auto& e : *mappings) {
+                        e.querySeqId = copyId;
+                        e.refSeqId = e.refSeqId == output->seqId ? copyId : e.refSeqId == copyId ? output->seqId : e.refSeqId;
+                    }
+                }
+                pushMergedQuery(copy, pipeline);
+            }
+        }
+        pushMergedQuery(output, pipeline);
+        if (pipeline.queries_in_flight.fetch_sub(1) == 1) {
+            pipeline.work_ready.notify();
+        }
+      }
+
+      /**
+       * @brief               hand a merged query to the aggregator
+       * @details             once the single output thread falls a query per worker behind,
+       *                      the workers take over its filtering until it catches up, leaving
+       *                      it only the writing. Queries written in input order have their
+       *                      chain ids drawn in that order, by the output thread.
+       */
+      void pushMergedQuery(QueryMappingOutput* output, MappingPipeline& pipeline) {
+        if (pipeline.streaming && pipeline.merged_queue.size() >= size_t(pipeline.fragment_pool.workers())) {
+            auto& mappings = param.mergeMappings && param.split ? output->mergedResults : output->results;
+            if (param.deterministic) {
+                filterFinalQueryMappings(mappings, output->progress);
+                output->filtered = true;
+            } else {
+                output->report = finalQueryMappings(output->seqId, mappings, output->progress);
+                output->reported = true;
+            }
+        }
+        pipeline.merged_queue.push(output);
       }
 
       void processAggregatedMappings(const std::string& queryName, MappingResultsVector_t& mappings, progress_meter::ProgressMeter& progress) {
+          profile::StageTimer timer(profile::FILTER);
 
           // XXX we should fix this combined condition
-          if (param.mergeMappings && param.split) {
+          robin_hood::unordered_set<offset_t> kept_chains;
+          const bool merged = param.mergeMappings && param.split;
+          if (merged) {
               auto maximallyMergedMappings = mergeMappingsInRange(mappings, param.chain_gap, progress);
               filterMaximallyMerged(maximallyMergedMappings, param, progress);
-              robin_hood::unordered_set<offset_t> kept_chains;
               for (auto &mapping : maximallyMergedMappings) {
                   kept_chains.insert(mapping.splitMappingId);
               }
-              mappings.erase(
-                  std::remove_if(mappings.begin(), mappings.end(),
-                                 [&kept_chains](const MappingResult &mapping) {
-                                     return !kept_chains.count(mapping.splitMappingId);
-                                 }),
-                  mappings.end());
           } else {
               filterNonMergedMappings(mappings, param, progress);
           }
 
-          if (param.filterLengthMismatches) {
-              filterFalseHighIdentity(mappings);
-          }
-
-          sparsifyMappings(mappings);
+          // Failed chains, length mismatches and sparsification in one compaction
+          dropMappings(mappings, [&](MappingResult &mapping) {
+              return (merged && !kept_chains.count(mapping.splitMappingId))
+                  || (param.filterLengthMismatches && isFalseHighIdentity(mapping))
+                  || isSparsified(mapping);
+          });
 
           // Apply group filtering aggregated across all targets
           if (param.filterMode == filter::MAP || param.filterMode == filter::ONETOONE) {
@@ -1034,26 +3761,78 @@ namespace skch
       }
 
       void aggregator_thread(merged_mappings_queue_t& merged_queue,
-                             std::atomic<bool>& workers_done,
                              std::unordered_map<seqno_t, MappingResultsVector_t>& combinedMappings) {
-          while (true) {
-              QueryMappingOutput* output = nullptr;
-              if (merged_queue.try_pop(output)) {
-                  seqno_t querySeqId = idManager->getSequenceId(output->queryName);
-                  auto& mappings = param.mergeMappings && param.split ? output->mergedResults : output->results;
-                  // Chain IDs are already compacted in mapModule
-                  combinedMappings[querySeqId].insert(
-                      combinedMappings[querySeqId].end(),
-                      mappings.begin(),
-                      mappings.end()
-                  );
-                  delete output;
-              } else if (workers_done.load() && merged_queue.was_empty()) {
-                  break;
+          QueryMappingOutput* output = nullptr;
+          while (merged_queue.pop(output)) {
+              seqno_t querySeqId = output->seqId;
+              auto& mappings = param.mergeMappings && param.split ? output->mergedResults : output->results;
+              // Chain IDs are already compacted in mapModule
+              combinedMappings[querySeqId].insert(
+                  combinedMappings[querySeqId].end(),
+                  mappings.begin(),
+                  mappings.end()
+              );
+              delete output;
+          }
+      }
+
+      /**
+       * @brief     append each query's mappings to the run file of this subset as it is merged
+       */
+      void spilling_aggregator_thread(merged_mappings_queue_t& merged_queue, MappingRuns& runs) {
+          QueryMappingOutput* output = nullptr;
+          while (merged_queue.pop(output)) {
+              runs.add(output->seqId, param.mergeMappings && param.split ? output->mergedResults : output->results);
+              delete output;
+          }
+      }
+
+      /**
+       * @brief     with a single target subset, filter and write each query's mappings as
+       *            soon as they are merged instead of gathering them for the final pass
+       * @details   with param.deterministic, a query merged before those read ahead of it
+       *            waits for them, so the queries are written in the order they were read
+       */
+      void streaming_output_thread(merged_mappings_queue_t& merged_queue,
+                                   std::ostream& outstrm,
+                                   progress_meter::ProgressMeter& progress) {
+          const auto write = [&](QueryMappingOutput* output) {
+              profile::StageTimer timer(profile::OUTPUT);
+              auto& mappings = param.mergeMappings && param.split ? output->mergedResults : output->results;
+              if (output->reported) {
+                  outstrm << output->report;
+              } else if (output->filtered) {
+                  reportReadMappings(mappings, output->queryName, outstrm, chainIdsReported.fetch_add(mappings.size()));
+              } else {
+                  outstrm << finalQueryMappings(output->seqId, mappings, progress);
+              }
+              delete output;
+          };
+          std::map<uint64_t, QueryMappingOutput*> parked;
+          uint64_t next = 0;
+          QueryMappingOutput* output = nullptr;
+          while (merged_queue.pop(output)) {
+              if (!param.deterministic) {
+                  write(output);
               } else {
-                  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                  parked.emplace(output->ordinal, output);
+                  while (!parked.empty() && parked.begin()->first == next) {
+                      write(parked.begin()->second);
+                      parked.erase(parked.begin());
+                      ++next;
+                  }
+              }
+              // A reader downstream sees the mappings once no more are waiting; while some
+              // are, the stream's buffer batches them. A slow reader blocks the writes,
+              // which fills the bounded queue and holds the workers back
+              if (merged_queue.size() == 0) {
+                  outstrm.flush();
               }
           }
+          for (auto& query : parked) {
+              write(query.second);
+          }
+          outstrm.flush();
       }
 
       /**
@@ -1080,7 +3859,8 @@ namespace skch
           else
           {
             //Report mapping
-            reportReadMappings(output->readMappings, output->qseqName, outstrm);
+            reportReadMappings(output->readMappings, output->qseqName, outstrm,
+                               chainIdsReported.fetch_add(output->readMappings.size()));
           }
 
           delete output;
@@ -1114,9 +3894,11 @@ namespace skch
 #endif
           //L1 Mapping
           doL1Mapping(Q, intervalPoints, l1Mappings);
+          profile::count(profile::L1_CANDIDATES, l1Mappings.size());
           if (l1Mappings.size() == 0) {
             return;
           }
+          profile::StageTimer timer(profile::L2);
 
 #ifdef ENABLE_TIME_PROFILE_L1_L2
           std::chrono::duration<double> timeSpentL1 = skch::Time::now() - t0;
@@ -1150,17 +3932,16 @@ namespace skch
             l1_begin = l1_end;
           }
 
+          profile::count(profile::L2_MAPPINGS, l2Mappings.size());
+
           // Sort output mappings
-          std::sort(l2Mappings.begin(), l2Mappings.end(), [](const auto& a, const auto& b) 
-              { return std::tie(a.refSeqId, a.refStartPos) < std::tie(b.refSeqId, b.refStartPos); });
+          sortMappingsByKey(l2Mappings, [](const MappingResult& e) { return std::make_tuple(e.refSeqId, e.refStartPos); });
 
           // Add chain information
-          // All mappings in this batch form a chain
-          int32_t chain_id = maxChainIdSeen.fetch_add(1, std::memory_order_relaxed);
+          // All mappings in this batch form a chain, numbered by the fragment in processFragment
           int32_t chain_length = l2Mappings.size();
           int32_t chain_pos = 1;
           for (auto& mapping : l2Mappings) {
-              mapping.chain_id = chain_id;
               mapping.chain_length = chain_length;
               mapping.chain_pos = chain_pos++;
           }
@@ -1182,8 +3963,12 @@ namespace skch
       template <typename Q_Info>
         void getSeedHits(Q_Info &Q)
         {
-          Q.minmerTableQuery.reserve(param.sketchSize + 1);
-          CommonFunc::sketchSequence(Q.minmerTableQuery, Q.seq, Q.len, param.kmerSize, param.alphabetSize, param.sketchSize, Q.seqId);
+          // Fragments sketched along with their whole query arrive with their sketch
+          if (!Q.presketched) {
+            profile::StageTimer timer(profile::SKETCH);
+            Q.minmerTableQuery.reserve(param.sketchSize + 1);
+            CommonFunc::sketchSequence(Q.minmerTableQuery, Q.seq, Q.len, param.kmerSize, param.alphabetSize, param.sketchSize, Q.seqId, param.kmerHashEngine, spacedSeeds.get(), syncmers.get(), sketchHashThreshold, dust.get());
+          }
           if(Q.minmerTableQuery.size() == 0) {
             Q.sketchSize = 0;
             return;
@@ -1192,8 +3977,15 @@ namespace skch
 #ifdef DEBUG
           int orig_len = Q.minmerTableQuery.size();
 #endif
-          const double max_hash_01 = (long double)(Q.minmerTableQuery.back().hash) / std::numeric_limits<hash_t>::max();
-          Q.kmerComplexity = (double(Q.minmerTableQuery.size()) / max_hash_01) / ((Q.len - param.kmerSize + 1)*2);
+          if (param.alphabetSize == 4 && Q.seq) {
+            Q.kmerComplexity = CommonFunc::kmerComplexity(Q.seq, Q.len);
+          } else {
+            // Proteins, and queries replayed from a sketch file without their bases: distinct
+            // k-mers estimated from the bottom-s sketch, relative to the k-mer positions on both strands
+            constexpr double hash_to_01 = 1.0 / 18446744073709551616.0;   // 2^-64
+            const double max_hash_01 = double(Q.minmerTableQuery.back().hash) * hash_to_01;
+            Q.kmerComplexity = (double(Q.minmerTableQuery.size()) / max_hash_01) / ((Q.len - param.kmerSize + 1)*2);
+          }
 
           // Removed frequent kmer filtering
 
@@ -1228,40 +4020,36 @@ namespace skch
             return;
 
           // Priority queue for sorting interval points
-          using IP_const_iterator = std::vector<IntervalPoint>::const_iterator;
-          std::vector<boundPtr<IP_const_iterator>> pq;
-          pq.reserve(Q.sketchSize);
+          MappingArena& buffers = arena();
+          auto& pq = buffers.seedLists;
+          pq.clear();
           constexpr auto heap_cmp = [](const auto& a, const auto& b) {return b < a;};
 
-          for(auto it = Q.minmerTableQuery.begin(); it != Q.minmerTableQuery.end(); it++)
-          {
-            //Check if hash value exists in the reference lookup index
-            const auto seedFind = refSketch->minmerPosLookupIndex.find(it->hash);
-
-            if(seedFind != refSketch->minmerPosLookupIndex.end())
-            {
-              pq.emplace_back(boundPtr<IP_const_iterator> {seedFind->second.cbegin(), seedFind->second.cend()});
-            }
+          //Look up which query hashes exist in the reference lookup index, all at once
+          std::vector<hash_t>& queryHashes = buffers.queryHashes;
+          queryHashes.clear();
+          for(auto it = Q.minmerTableQuery.begin(); it != Q.minmerTableQuery.end(); it++)
+            queryHashes.push_back(it->hash);
+          refSketch->findSeedIntervals(queryHashes, pq);
+          excludeSeedTargets(Q, pq);
+          if (!Q.guideRegions.empty())
+            restrictSeedTargets(Q, pq);
+
+          size_t seedHits = 0;
+          for (const auto& list : pq)
+            seedHits += list.end - list.it;
+
+          //Repetitive queries hit so many points that sorting them all beats merging the lists
+          if (seedHits >= seedSortMinPoints)
+          {
+            gatherSortedSeedIntervalPoints(Q, pq, seedHits, intervalPoints);
+            return;
           }
           std::make_heap(pq.begin(), pq.end(), heap_cmp);
 
           while(!pq.empty())
           {
-            const IP_const_iterator ip_it = pq.front().it;
-            //const auto& ref = this->sketch_metadata[ip_it->seqId];
-            const auto& ref_name = this->idManager->getSequenceName(ip_it->seqId);
-            //const auto& ref_len = this->idManager.getSeqLen(ip_it->seqId);
-            bool skip_mapping = false;
-            int queryGroup = idManager->getRefGroup(Q.seqId);
-            int targetGroup = idManager->getRefGroup(ip_it->seqId);
-
-            if (param.skip_self && queryGroup == targetGroup) skip_mapping = true;
-            if (param.skip_prefix && queryGroup == targetGroup) skip_mapping = true;
-            if (param.lower_triangular && Q.seqId <= ip_it->seqId) skip_mapping = true;
-    
-            if (!skip_mapping) {
-              intervalPoints.push_back(*ip_it);
-            }
+            intervalPoints.push_back(*pq.front().it);
             std::pop_heap(pq.begin(), pq.end(), heap_cmp);
             pq.back().it++;
             if (pq.back().it >= pq.back().end) 
@@ -1280,6 +4068,178 @@ namespace skch
         }
 
 
+      /**
+       * @brief                         cut the targets a query may not map to out of its seed
+       *                                lists, and drop the lists over the query's seed cap
+       * @details                       excluded targets are ranges of sequence ids, the query's
+       *                                own group under skip_self/skip_prefix and the ids from
+       *                                its own on under lower_triangular, so each is skipped
+       *                                by two binary searches in a list sorted by sequence id
+       * @param[in]       Q             query sequence information, skippedSeeds is set
+       * @param[in,out]   seedLists     interval point ranges of the query minmers; a list may
+       *                                be split into several ranges
+       */
+      template <typename Q_Info, typename SeedLists>
+        void excludeSeedTargets(Q_Info &Q, SeedLists& seedLists) const
+        {
+          std::vector<std::pair<seqno_t, seqno_t>>& excluded = arena().excludedTargets;
+          excluded.clear();
+          if (param.skip_self || param.skip_prefix) {
+            const auto& runs = groupSeqRuns.at(idManager->getRefGroup(Q.seqId));
+            excluded.assign(runs.begin(), runs.end());
+          }
+          if (param.lower_triangular) {
+            excluded.emplace_back(Q.seqId, std::numeric_limits<seqno_t>::max());
+          }
+          if (!cachedTargetRuns.empty() && cachedQuery[Q.seqId]) {
+            excluded.insert(excluded.end(), cachedTargetRuns.begin(), cachedTargetRuns.end());
+          }
+          std::sort(excluded.begin(), excluded.end());
+
+          //Satellite and centromeric queries contain minmers with huge reference lists, which
+          //would dominate L1 work; leave out those over the query's budget
+          const double maxPoints = param.query_seed_cap > 0
+            ? 2 * param.query_seed_cap * Q.sketchSize : std::numeric_limits<double>::max();
+          Q.skippedSeeds = 0;
+          if (excluded.empty() && maxPoints == std::numeric_limits<double>::max())
+            return;
+
+          const auto bySeqId = [](const IntervalPoint& ip, seqno_t seqId) { return ip.seqId < seqId; };
+          SeedLists& kept = arena().keptSeedLists;
+          kept.clear();
+          for (const auto& list : seedLists) {
+            const size_t firstPiece = kept.size();
+            size_t points = 0;
+            auto cursor = list.it;
+            for (const auto& range : excluded) {
+              if (cursor == list.end) break;
+              const auto lo = std::lower_bound(cursor, list.end, range.first, bySeqId);
+              const auto hi = std::lower_bound(lo, list.end, range.second, bySeqId);
+              if (lo != cursor) {
+                kept.push_back({cursor, lo});
+                points += lo - cursor;
+              }
+              cursor = hi;
+            }
+            if (cursor != list.end) {
+              kept.push_back({cursor, list.end});
+              points += list.end - cursor;
+            }
+            if (points > maxPoints) {
+              kept.resize(firstPiece);
+              Q.skippedSeeds++;
+            }
+          }
+          seedLists.swap(kept);
+        }
+
+      /**
+       * @brief                         cut the seed lists of a guided query down to the parts
+       *                                within its guide regions
+       * @details                       the regions are sorted and disjoint, like the lists by
+       *                                sequence id and position, so each costs two binary
+       *                                searches in a list
+       * @param[in]       Q             query sequence information
+       * @param[in,out]   seedLists     interval point ranges of the query minmers
+       */
+      template <typename Q_Info, typename SeedLists>
+        void restrictSeedTargets(const Q_Info &Q, SeedLists& seedLists) const
+        {
+          const auto before = [](const IntervalPoint& ip, const std::pair<seqno_t, offset_t>& at) {
+            return ip.seqId < at.first || (ip.seqId == at.first && ip.pos < at.second);
+          };
+          SeedLists& kept = arena().keptSeedLists;
+          kept.clear();
+          for (const auto& list : seedLists) {
+            auto cursor = list.it;
+            for (const auto& region : Q.guideRegions) {
+              if (cursor == list.end) break;
+              auto lo = std::lower_bound(cursor, list.end, std::make_pair(region.seqId, region.start), before);
+              auto hi = std::lower_bound(lo, list.end, std::make_pair(region.seqId, region.end), before);
+              cursor = hi;
+              // The points of a list alternate opening and closing its minmer's windows, so
+              // an interval the region cuts through is left out whole
+              if (lo != hi && lo->side == side::CLOSE) {
+                ++lo;
+              }
+              if (lo != hi && (hi - 1)->side == side::OPEN) {
+                --hi;
+              }
+              if (lo != hi) {
+                kept.push_back({lo, hi});
+              }
+            }
+          }
+          seedLists.swap(kept);
+        }
+
+      //Seed hits of a query above which getSeedIntervalPoints sorts instead of merging
+      static constexpr size_t seedSortMinPoints = 4096;
+
+      /**
+       * @brief                         collect the interval points of the seed lists in one
+       *                                buffer and radix sort them into the order of the heap
+       *                                merge
+       * @param[in]   Q                 query sequence information
+       * @param[in]   seedLists         interval point ranges of the query minmers
+       * @param[in]   seedHits          total interval points of seedLists
+       * @param[out]  intervalPoints    sorted interval points are appended here
+       */
+      template <typename Q_Info, typename SeedLists, typename Vec>
+        void gatherSortedSeedIntervalPoints(const Q_Info &Q, const SeedLists& seedLists, size_t seedHits, Vec& intervalPoints)
+        {
+          MappingArena& buffers = arena();
+          std::vector<IntervalPoint>& points = buffers.sortedPoints;
+          points.clear();
+          points.reserve(seedHits);
+          bool radixKeys = true;
+          for (const auto& list : seedLists) {
+            for (auto it = list.it; it != list.end; ++it) {
+              const IntervalPoint ip = *it;
+              radixKeys &= ip.pos >= 0 && ip.pos <= std::numeric_limits<uint32_t>::max() && ip.seqId >= 0;
+              points.push_back(ip);
+            }
+          }
+
+          if (radixKeys) {
+            radixSortIntervalPoints(points, buffers.radixBuffer);
+          } else {
+            std::stable_sort(points.begin(), points.end());
+          }
+          intervalPoints.insert(intervalPoints.end(), points.begin(), points.end());
+        }
+
+      /**
+       * @brief     stable LSD radix sort of interval points by (seqId, pos, side), the order
+       *            of IntervalPoint::operator<, for non-negative ids and 32-bit positions
+       */
+      static void radixSortIntervalPoints(std::vector<IntervalPoint>& points, std::vector<IntervalPoint>& buffer)
+      {
+        const auto key = [](const IntervalPoint& ip) {
+          return uint64_t(ip.seqId) << 33 | uint64_t(ip.pos) << 1 | uint64_t(ip.side > 0);
+        };
+
+        // Skip the byte passes on which every key agrees
+        uint64_t anyBits = 0, allBits = ~uint64_t(0);
+        for (const auto& ip : points) {
+          anyBits |= key(ip);
+          allBits &= key(ip);
+        }
+
+        buffer.resize(points.size());
+        for (int shift = 0; shift < 64; shift += 8) {
+          if ((((anyBits ^ allBits) >> shift) & 0xff) == 0)
+            continue;
+          size_t offsets[257] = {};
+          for (const auto& ip : points)
+            offsets[((key(ip) >> shift) & 0xff) + 1]++;
+          std::partial_sum(offsets, offsets + 257, offsets);
+          for (const auto& ip : points)
+            buffer[offsets[(key(ip) >> shift) & 0xff]++] = ip;
+          points.swap(buffer);
+        }
+      }
+
       template <typename Q_Info, typename IP_iter, typename Vec2>
         void computeL1CandidateRegions(
             Q_Info &Q, 
@@ -1292,10 +4252,16 @@ namespace skch
           std::cerr << "INFO, skch::Map:computeL1CandidateRegions, read id " << Q.seqId << std::endl;
 #endif
 
+          if (Q.len <= param.segLength
+              && computeL1CandidateRegionsBlocked(Q, ip_begin, ip_end, minimumHits, l1Mappings))
+            return;
+
           int overlapCount = 0;
           int strandCount = 0;
           int bestIntersectionSize = 0;
-          std::vector<L1_candidateLocus_t> localOpts;
+          MappingArena& buffers = arena();
+          std::vector<L1_candidateLocus_t>& localOpts = buffers.localOpts;
+          localOpts.clear();
 
           // Keep track of all minmer windows that intersect with [i, i+windowLen]
           int windowLen = std::max<offset_t>(0, Q.len - param.segLength);
@@ -1311,14 +4277,11 @@ namespace skch
 
           // Used to keep track of how many minmer windows for a particular hash are currently "open"
           // Only necessary when windowLen != 0.
-          std::unordered_map<hash_t, int> hash_to_freq;
+          auto& hash_to_freq = buffers.l1HashFreq;
+          hash_to_freq.clear();
 
           if (param.stage1_topANI_filter) {
-            double maxJaccard = refSketch->hgNumerator / static_cast<double>(Q.sketchSize);
-            double cutoff_j = Stat::md2j(1 - param.percentageIdentity + param.ANIDiff, param.kmerSize);
-            int minIntersectionSize = std::max(
-                static_cast<int>(cutoff_j * Q.sketchSize),
-                minimumHits);
+            int minIntersectionSize = topANIMinIntersection(Q, minimumHits);
 
             while (leadingIt != ip_end)
             {
@@ -1363,12 +4326,7 @@ namespace skch
               return;
             } else 
             {
-              minimumHits = std::max(
-                  sketchCutoffs[
-                    int(std::min(bestIntersectionSize, Q.sketchSize) 
-                      / std::max<double>(1, param.sketchSize / skch::fixed::ss_table_max))
-                  ],
-                  minIntersectionSize);
+              minimumHits = topANIMinimumHits(Q, bestIntersectionSize, minIntersectionSize);
             }
           } 
           
@@ -1470,24 +4428,166 @@ namespace skch
         if (in_candidate) {
           localOpts.push_back(l1_out);
         }
-        
 
-        // Join together proximal local opts
-        for (auto& l1_out : localOpts) 
+        joinL1LocalOpts(localOpts, clusterLen, l1Mappings);
+      }
+
+      /**
+       * @brief       computeL1CandidateRegions for a query no longer than a segment, so that
+       *              each candidate window is a single position, processed in blocks
+       * @details     the overlap after the points at one position is the prefix sum of the
+       *              +1/-1 sides of the sorted points up to them, computed in one pass without
+       *              hash bookkeeping. Candidates are then scanned a block of positions at a
+       *              time, skipping whole blocks below minimumHits outside of a candidate.
+       * @return      false without output if two sequences meet at the same position, which
+       *              the scalar sweep treats as one position
+       */
+      template <typename Q_Info, typename IP_iter, typename Vec2>
+        bool computeL1CandidateRegionsBlocked(
+            Q_Info &Q,
+            IP_iter ip_begin,
+            IP_iter ip_end,
+            int minimumHits,
+            Vec2 &l1Mappings)
         {
-          if (l1Mappings.empty() 
-              || l1_out.seqId != l1Mappings.back().seqId 
-              || l1_out.rangeStartPos > l1Mappings.back().rangeEndPos + clusterLen) 
-          {
-            l1Mappings.push_back(l1_out); 
-          } 
-          else 
+          const size_t numPoints = ip_end - ip_begin;
+          if (numPoints == 0)
+            return true;
+
+          // Overlap left after each position, and the first point at the position
+          MappingArena& buffers = arena();
+          std::vector<int>& stepOverlap = buffers.stepOverlap;
+          std::vector<size_t>& stepPoint = buffers.stepPoint;
+          stepOverlap.clear();
+          stepPoint.clear();
+          int overlapCount = 0;
+          stepPoint.push_back(0);
+          for (size_t i = 0; i + 1 < numPoints; ++i) {
+            overlapCount += ip_begin[i].side;
+            const bool newSeq = ip_begin[i + 1].seqId != ip_begin[i].seqId;
+            const bool newPos = ip_begin[i + 1].pos != ip_begin[i].pos;
+            if (newSeq && !newPos)
+              return false;
+            if (newSeq || newPos) {
+              stepOverlap.push_back(overlapCount);
+              stepPoint.push_back(i + 1);
+            }
+          }
+          stepOverlap.push_back(overlapCount + ip_begin[numPoints - 1].side);
+          const size_t numSteps = stepOverlap.size();
+
+          if (param.stage1_topANI_filter) {
+            const int minIntersectionSize = topANIMinIntersection(Q, minimumHits);
+            const int bestIntersectionSize = int_kernels::max_int32(stepOverlap.data(), numSteps);
+            if (bestIntersectionSize < minIntersectionSize)
+              return true;
+            minimumHits = topANIMinimumHits(Q, bestIntersectionSize, minIntersectionSize);
+          }
+
+          // Same candidate logic as the scalar sweep, which judges each position once the
+          // next one is reached
+          std::vector<L1_candidateLocus_t>& localOpts = buffers.localOpts;
+          localOpts.clear();
+          bool in_candidate = false;
+          L1_candidateLocus_t l1_out = {};
+          const auto judge = [&](int prevOverlap, SeqCoord prevPos) {
+            if (prevOverlap >= minimumHits) {
+              if (l1_out.seqId != prevPos.seqId && in_candidate) {
+                localOpts.push_back(l1_out);
+                l1_out = {};
+                in_candidate = false;
+              }
+              if (!in_candidate) {
+                l1_out.rangeStartPos = prevPos.pos;
+                l1_out.rangeEndPos = prevPos.pos;
+                l1_out.seqId = prevPos.seqId;
+                l1_out.intersectionSize = prevOverlap;
+                in_candidate = true;
+              } else if (param.stage2_full_scan) {
+                l1_out.intersectionSize = std::max(l1_out.intersectionSize, prevOverlap);
+                l1_out.rangeEndPos = prevPos.pos;
+              } else if (l1_out.intersectionSize < prevOverlap) {
+                l1_out.intersectionSize = prevOverlap;
+                l1_out.rangeStartPos = prevPos.pos;
+                l1_out.rangeEndPos = prevPos.pos;
+              }
+            } else {
+              if (in_candidate) {
+                localOpts.push_back(l1_out);
+                l1_out = {};
+              }
+              in_candidate = false;
+            }
+          };
+
+          constexpr size_t blockSteps = 64;
+          judge(0, SeqCoord{});
+          for (size_t step = 0; step + 1 < numSteps; ) {
+            if (!in_candidate && step % blockSteps == 0) {
+              const size_t blockEnd = std::min(step + blockSteps, numSteps - 1);
+              if (int_kernels::max_int32(stepOverlap.data() + step, blockEnd - step) < minimumHits) {
+                step = blockEnd;
+                continue;
+              }
+            }
+            const auto& ip = ip_begin[stepPoint[step]];
+            judge(stepOverlap[step], SeqCoord{ip.seqId, ip.pos});
+            ++step;
+          }
+          if (in_candidate) {
+            localOpts.push_back(l1_out);
+          }
+
+          joinL1LocalOpts(localOpts, param.segLength, l1Mappings);
+          return true;
+        }
+
+      /**
+       * @brief       hits an L1 candidate needs under stage1_topANI_filter before the sweep
+       */
+      template <typename Q_Info>
+        int topANIMinIntersection(const Q_Info &Q, int minimumHits) const
+        {
+          double cutoff_j = Stat::md2j(1 - param.percentageIdentity + param.ANIDiff, param.kmerSize);
+          return std::max(static_cast<int>(cutoff_j * Q.sketchSize) - Q.skippedSeeds, minimumHits);
+        }
+
+      /**
+       * @brief       hits an L1 candidate needs under stage1_topANI_filter, given the best
+       *              intersection size of the query
+       */
+      template <typename Q_Info>
+        int topANIMinimumHits(const Q_Info &Q, int bestIntersectionSize, int minIntersectionSize) const
+        {
+          return std::max(
+              sketchCutoffs[
+                int(std::min(bestIntersectionSize, Q.sketchSize)
+                  / std::max<double>(1, param.sketchSize / skch::fixed::ss_table_max))
+              ],
+              minIntersectionSize);
+        }
+
+      /**
+       * @brief       join local L1 optimums within clusterLen of each other into l1Mappings
+       */
+      template <typename Vec2>
+        void joinL1LocalOpts(const std::vector<L1_candidateLocus_t>& localOpts, int clusterLen, Vec2 &l1Mappings) const
+        {
+          for (auto& l1_out : localOpts) 
           {
-            l1Mappings.back().rangeEndPos = l1_out.rangeEndPos;
-            l1Mappings.back().intersectionSize = std::max(l1_out.intersectionSize, l1Mappings.back().intersectionSize);
+            if (l1Mappings.empty() 
+                || l1_out.seqId != l1Mappings.back().seqId 
+                || l1_out.rangeStartPos > l1Mappings.back().rangeEndPos + clusterLen) 
+            {
+              l1Mappings.push_back(l1_out); 
+            } 
+            else 
+            {
+              l1Mappings.back().rangeEndPos = l1_out.rangeEndPos;
+              l1Mappings.back().intersectionSize = std::max(l1_out.intersectionSize, l1Mappings.back().intersectionSize);
+            }
           }
         }
-      }
 
 
       /**
@@ -1512,7 +4612,12 @@ namespace skch
           }
 
           //2. Compute windows and sort
-          getSeedIntervalPoints(Q, intervalPoints);
+          {
+            profile::StageTimer timer(profile::SEED_LOOKUP);
+            getSeedIntervalPoints(Q, intervalPoints);
+          }
+          profile::count(profile::SEED_INTERVAL_POINTS, intervalPoints.size());
+          profile::StageTimer timer(profile::L1_SWEEP);
 
           //3. Compute L1 windows
           // Always respect the minimum hits parameter if set
@@ -1522,6 +4627,10 @@ namespace skch
                   cached_minimum_hits : 
                   Stat::estimateMinimumHitsRelaxed(Q.sketchSize, param.kmerSize, param.percentageIdentity, skch::fixed::confidence_interval));
 
+          // Skipped minmers cannot be hit, so do not demand them of the estimate
+          if (param.minimum_hits <= 0 && Q.skippedSeeds > 0)
+            minimumHits = std::max(1, minimumHits - Q.skippedSeeds);
+
           // For each "group"
           auto ip_begin = intervalPoints.begin();
           auto ip_end = intervalPoints.begin();
@@ -1545,61 +4654,6 @@ namespace skch
         }
 
 
-      /**
-       * @brief     Build metadata and reference groups for sequences
-       * @details   Read FAI files, sort sequences, and assign groups
-       */
-      void buildRefGroups() {
-          std::vector<std::tuple<std::string, size_t, offset_t>> seqInfoWithIndex;
-          size_t totalSeqs = 0;
-
-          for (const auto& fileName : param.refSequences) {
-              std::string faiName = fileName + ".fai";
-              std::ifstream faiFile(faiName);
-              
-              if (!faiFile.is_open()) {
-                  std::cerr << "Error: Unable to open FAI file: " << faiName << std::endl;
-                  exit(1);
-              }
-
-              std::string line;
-              while (std::getline(faiFile, line)) {
-                  std::istringstream iss(line);
-                  std::string seqName;
-                  offset_t seqLength;
-                  iss >> seqName >> seqLength;
-
-                  seqInfoWithIndex.emplace_back(seqName, totalSeqs++, seqLength);
-              }
-          }
-
-          std::sort(seqInfoWithIndex.begin(), seqInfoWithIndex.end());
-
-          std::vector<int> refGroups(totalSeqs);
-          // Removed as sketch_metadata is no longer used
-          int currentGroup = 0;
-          std::string prevPrefix;
-
-          for (const auto& [seqName, originalIndex, seqLength] : seqInfoWithIndex) {
-              std::string currPrefix = seqName.substr(0, seqName.find_last_of(param.prefix_delim));
-              
-              if (currPrefix != prevPrefix) {
-                  currentGroup++;
-                  prevPrefix = currPrefix;
-              }
-
-              refGroups[originalIndex] = currentGroup;
-              // Metadata is now handled by idManager, no need to push_back here
-          }
-
-          // Removed refIdGroup swap as it's no longer needed
-
-          if (totalSeqs == 0) {
-              std::cerr << "[wfmash::mashmap] ERROR: No sequences indexed!" << std::endl;
-              exit(1);
-          }
-      }
-
       /**
        * @brief                                 Revise L1 candidate regions to more precise locations
        * @param[in]   Q                         query sequence information
@@ -1610,21 +4664,46 @@ namespace skch
         void doL2Mapping(Q_Info &Q, L1_Iter l1_begin, L1_Iter l1_end, VecOut &l2Mappings)
         {
           ///2. Walk the read over the candidate regions and compute the jaccard similarity with minimum s sketches
-          std::vector<L2_mapLocus_t> l2_vec;
+          MappingArena& buffers = arena();
+          std::vector<L2_mapLocus_t>& l2_vec = buffers.l2Loci;
           double bestJaccardNumerator = 0;
+
+          // Shared sketch sizes of the best numMappingsForSegment mappings so far, as a min-heap
+          std::vector<int>& keptSketchSizes = buffers.keptSketchSizes;
+          keptSketchSizes.clear();
+          constexpr auto kept_cmp = std::greater<int>();
+
+          // Jaccard cutoff of the hypergeometric filter, from the global Jaccard numerator
+          double cutoff_j = 0;
+          if (param.stage1_topANI_filter)
+          {
+            double jaccardSimilarity = refSketch->hgNumerator / Q.sketchSize;
+            double mash_dist = Stat::j2md(jaccardSimilarity, param.kmerSize);
+            double cutoff_ani = std::max(0.0, (1 - mash_dist) - param.ANIDiff);
+            cutoff_j = Stat::md2j(1 - cutoff_ani, param.kmerSize);
+          }
+
           auto loc_iterator = l1_begin;
           while (loc_iterator != l1_end)
           {
             L1_candidateLocus_t& candidateLocus = *loc_iterator;
 
-            if (param.stage1_topANI_filter)
+            // The L1 intersection bounds the L2 shared sketch size of a candidate; one that
+            // cannot reach the worst kept mapping is not scanned
+            if (param.stage2_bound && !keptSketchSizes.empty()
+                && keptSketchSizes.size() >= param.numMappingsForSegment
+                && candidateLocus.intersectionSize < keptSketchSizes.front())
             {
-              // Use the global Jaccard numerator here
-              double jaccardSimilarity = refSketch->hgNumerator / Q.sketchSize;
-              double mash_dist = Stat::j2md(jaccardSimilarity, param.kmerSize);
-              double cutoff_ani = std::max(0.0, (1 - mash_dist) - param.ANIDiff);
-              double cutoff_j = Stat::md2j(1 - cutoff_ani, param.kmerSize);
+              if (param.stage1_topANI_filter)
+              {
+                break;  // Candidates are popped by decreasing intersection
+              }
+              loc_iterator++;
+              continue;
+            }
 
+            if (param.stage1_topANI_filter)
+            {
               double candidateJaccard = static_cast<double>(candidateLocus.intersectionSize) / Q.sketchSize;
 
               if (candidateJaccard < cutoff_j) 
@@ -1638,23 +4717,37 @@ namespace skch
 
             for (auto& l2 : l2_vec) 
             {
-              //Compute mash distance using calculated jaccard
-              float mash_dist = Stat::j2md(1.0 * l2.sharedSketchSize/Q.sketchSize, param.kmerSize);
-
-              float nucIdentity = (1 - mash_dist);
-              //float nucIdentityUpperBound = getANIUBfromJaccardNum(Q.sketchSize, l2.sharedSketchSize);
-              float nucIdentityUpperBound = 1 - Stat::md_lower_bound(mash_dist, Q.sketchSize, param.kmerSize, skch::fixed::confidence_interval);
+              //Mash distance of the calculated jaccard, and its confidence bound, from the tables
+              const bool tabulated = Q.sketchSize <= param.sketchSize;
+              float nucIdentity = tabulated
+                ? identityTable.identity(l2.sharedSketchSize, Q.sketchSize)
+                : 1 - Stat::j2md(1.0 * l2.sharedSketchSize/Q.sketchSize, param.kmerSize);
+              float nucIdentityUpperBound = Q.sketchSize == param.sketchSize
+                ? identityUpperBounds[l2.sharedSketchSize]
+                : tabulated ? identityTable.upperBound(l2.sharedSketchSize, Q.sketchSize)
+                : identityUpperBound(l2.sharedSketchSize, Q.sketchSize);
 
               //Report the alignment if it passes our identity threshold and,
               // if we are in all-vs-all mode, it isn't a self-mapping,
               // and if we are self-mapping, the query is shorter than the target
-              const auto& ref = this->idManager->getContigInfo(l2.seqId);
+              const offset_t refLength = this->idManager->getSequenceLength(l2.seqId);
               if((param.keep_low_pct_id && nucIdentityUpperBound >= param.percentageIdentity)
                   || nucIdentity >= param.percentageIdentity)
               {
                 //Track the best jaccard numerator
                 bestJaccardNumerator = std::max<double>(bestJaccardNumerator, l2.sharedSketchSize);
 
+                if (param.stage2_bound)
+                {
+                  keptSketchSizes.push_back(l2.sharedSketchSize);
+                  std::push_heap(keptSketchSizes.begin(), keptSketchSizes.end(), kept_cmp);
+                  if (keptSketchSizes.size() > param.numMappingsForSegment)
+                  {
+                    std::pop_heap(keptSketchSizes.begin(), keptSketchSizes.end(), kept_cmp);
+                    keptSketchSizes.pop_back();
+                  }
+                }
+
                 MappingResult res;
 
                 //Save the output
@@ -1670,12 +4763,13 @@ namespace skch
                   res.nucIdentityUpperBound = nucIdentityUpperBound;
                   res.sketchSize = Q.sketchSize;
                   res.conservedSketches = l2.sharedSketchSize;
+                  res.opposingStrandVotes = l2.opposingVotes;
                   res.blockLength = std::max(res.refEndPos - res.refStartPos, res.queryEndPos - res.queryStartPos);
                   res.approxMatches = std::round(res.nucIdentity * res.blockLength / 100.0);
                   res.strand = l2.strand; 
                   res.kmerComplexity = Q.kmerComplexity;
 
-                  res.selfMapFilter = ((param.skip_self || param.skip_prefix) && Q.fullLen > ref.len);
+                  res.selfMapFilter = ((param.skip_self || param.skip_prefix) && Q.fullLen > refLength);
 
                 } 
                 l2Mappings.push_back(res);
@@ -1712,7 +4806,8 @@ namespace skch
           //std::cerr << "INFO, skch::Map:computeL2MappedRegions, read id " << Q.seqName << "_" << Q.startPos << std::endl; 
 #endif
            
-          auto& minmerIndex = refSketch->minmerIndex;
+          const MIIter_t minmerBegin = refSketch->getMinmerIndexBegin();
+          const MIIter_t minmerEnd = refSketch->getMinmerIndexEnd();
 
           //candidateLocus.rangeStartPos -= param.segLength;
           //candidateLocus.rangeEndPos += param.segLength;
@@ -1721,11 +4816,12 @@ namespace skch
           const MinmerInfo first_minmer = MinmerInfo {0, candidateLocus.rangeStartPos - param.segLength - 1, 0, candidateLocus.seqId, 0};
 
           //const MinmerInfo first_minmer = MinmerInfo {0, candidateLocus.seqId, -1, 0, 0};
-          auto firstOpenIt = std::lower_bound(minmerIndex.begin(), minmerIndex.end(), first_minmer); 
+          auto firstOpenIt = std::lower_bound(minmerBegin, minmerEnd, first_minmer); 
 
           // Keeps track of the lowest end position
-          std::vector<skch::MinmerInfo> slidingWindow;
-          slidingWindow.reserve(Q.sketchSize);
+          MappingArena& buffers = arena();
+          std::vector<skch::MinmerInfo>& slidingWindow = buffers.slidingWindow;
+          slidingWindow.clear();
 
           // Used to make a min-heap
           constexpr auto heap_cmp = [](const skch::MinmerInfo& l, const skch::MinmerInfo& r) {return l.wpos_end > r.wpos_end;};
@@ -1738,10 +4834,11 @@ namespace skch
 
           // Used to keep track of how many minmer windows for a particular hash are currently "open"
           // Only necessary when windowLen != 0.
-          std::unordered_map<hash_t, int> hash_to_freq;
+          auto& hash_to_freq = buffers.l2HashFreq;
+          hash_to_freq.clear();
           
           // slideMap tracks the S(A or B) and S(A) and S(B)
-          SlideMapper<Q_Info> slideMap(Q);
+          SlideMapper<Q_Info> slideMap(Q, buffers.slideMapper);
 
           offset_t beginOptimalPos = 0;
           offset_t lastOptimalPos = 0;
@@ -1751,7 +4848,7 @@ namespace skch
           L2_mapLocus_t l2_out = {};
 
           // Set up the window
-          while (windowIt != minmerIndex.end() && windowIt->seqId == candidateLocus.seqId && windowIt->wpos < candidateLocus.rangeStartPos) 
+          while (windowIt != minmerEnd && windowIt->seqId == candidateLocus.seqId && windowIt->wpos < candidateLocus.rangeStartPos) 
           {
             if (windowIt->wpos_end > candidateLocus.rangeStartPos) 
             {
@@ -1768,7 +4865,7 @@ namespace skch
             windowIt++;
           }
 
-          while (windowIt != minmerIndex.end() && windowIt->seqId == candidateLocus.seqId && windowIt->wpos <= candidateLocus.rangeEndPos + windowLen) 
+          while (windowIt != minmerEnd && windowIt->seqId == candidateLocus.seqId && windowIt->wpos <= candidateLocus.rangeEndPos + windowLen) 
           {
             int prev_strand_votes = slideMap.strand_votes;
             bool inserted = false;
@@ -1835,6 +4932,7 @@ namespace skch
                 l2_out.meanOptimalPos =  (l2_out.optimalStart + l2_out.optimalEnd) / 2;
                 l2_out.seqId = windowIt->seqId;
                 l2_out.strand = prev_strand_votes >= 0 ? strnd::FWD : strnd::REV;
+                l2_out.opposingVotes = std::max(0, (l2_out.sharedSketchSize - std::abs(prev_strand_votes)) / 2);
                 if (l2_vec_out.empty() 
                     || l2_vec_out.back().optimalEnd + param.segLength < l2_out.optimalStart)
                 {
@@ -1843,6 +4941,7 @@ namespace skch
                 else 
                 {
                   l2_vec_out.back().optimalEnd = l2_out.optimalEnd;
+                  l2_vec_out.back().opposingVotes = std::max(l2_vec_out.back().opposingVotes, l2_out.opposingVotes);
                   l2_vec_out.back().meanOptimalPos = (l2_vec_out.back().optimalStart + l2_vec_out.back().optimalEnd) / 2;
                 }
                 l2_out = L2_mapLocus_t();
@@ -1858,6 +4957,7 @@ namespace skch
             l2_out.meanOptimalPos =  (l2_out.optimalStart + l2_out.optimalEnd) / 2;
             l2_out.seqId = std::prev(windowIt)->seqId;
             l2_out.strand = slideMap.strand_votes >= 0 ? strnd::FWD : strnd::REV;
+            l2_out.opposingVotes = std::max(0, (l2_out.sharedSketchSize - std::abs(slideMap.strand_votes)) / 2);
             if (l2_vec_out.empty() 
                 || l2_vec_out.back().optimalEnd + param.segLength < l2_out.optimalStart)
             {
@@ -1866,6 +4966,7 @@ namespace skch
             else 
             {
               l2_vec_out.back().optimalEnd = l2_out.optimalEnd;
+              l2_vec_out.back().opposingVotes = std::max(l2_vec_out.back().opposingVotes, l2_out.opposingVotes);
               l2_vec_out.back().meanOptimalPos = (l2_vec_out.back().optimalStart + l2_vec_out.back().optimalEnd) / 2;
             }
           }
@@ -1914,6 +5015,12 @@ namespace skch
           fragment.nucIdentity = std::accumulate(start, end, 0.0,
                                                  [](double sum, const MappingResult& e) { return sum + e.nucIdentity; }
               ) / fragment.n_merged;
+          fragment.nucIdentityUpperBound = std::accumulate(start, end, 0.0,
+                                                 [](double sum, const MappingResult& e) { return sum + e.nucIdentityUpperBound; }
+              ) / fragment.n_merged;
+          fragment.opposingStrandVotes = std::max_element(start, end,
+                                                 [](const MappingResult& a, const MappingResult& b) { return a.opposingStrandVotes < b.opposingStrandVotes; }
+              )->opposingStrandVotes;
 
           // Calculate mean kmer complexity
           fragment.kmerComplexity = std::accumulate(start, end, 0.0,
@@ -1993,24 +5100,28 @@ namespace skch
           }
       }
 
+      //Mapping count from which the partitions of a query are chained on several threads
+      static constexpr size_t parallelChainingMinMappings = 1 << 16;
+
       /**
        * @brief                       Merge fragment mappings by convolution of a 2D range over the alignment matrix
        * @param[in/out] readMappings  Mappings computed by Mashmap (L2 stage) for a read
        * @param[in]     max_dist      Distance to look in target and query
+       * @param[in]     segment       readMappings are a segment of a query with more mappings,
+       *                              chained even if it is a single one
        */
       template <typename VecIn>
       VecIn mergeMappingsInRange(VecIn &readMappings,
                                  int max_dist,
-                                 progress_meter::ProgressMeter& progress) {
-          if (!param.split || readMappings.size() < 2) return readMappings;
+                                 progress_meter::ProgressMeter& progress,
+                                 bool segment = false) {
+          if (!param.split || readMappings.size() < (segment ? 1 : 2)) return readMappings;
+          profile::StageTimer timer(profile::MERGE);
 
           //Sort the mappings by query position, then reference sequence id, then reference position
-          std::sort(
-              readMappings.begin(), readMappings.end(),
-              [](const MappingResult &a, const MappingResult &b) {
-                  return std::tie(a.queryStartPos, a.refSeqId, a.refStartPos, a.strand)
-                      < std::tie(b.queryStartPos, b.refSeqId, b.refStartPos, b.strand);
-              });
+          sortMappingsByKey(readMappings, [](const MappingResult& e) {
+              return std::make_tuple(e.queryStartPos, e.refSeqId, e.refStartPos, e.strand);
+          });
 
           //First assign a unique id to each split mapping in the sorted order
           for (auto it = readMappings.begin(); it != readMappings.end(); it++) {
@@ -2025,56 +5136,110 @@ namespace skch
           // this initializes everything
           auto disjoint_sets = dsets::DisjointSets(ufv.data(), ufv.size());
 
-          //Start the procedure to identify the chains
-          for (auto it = readMappings.begin(); it != readMappings.end(); it++) {
-              double best_score = std::numeric_limits<double>::max();
-              auto best_it2 = readMappings.end();
-              // we we merge only with the best-scored previous mapping in query space
-              if (it->chainPairScore != std::numeric_limits<double>::max()) {
-                  disjoint_sets.unite(it->splitMappingId, it->chainPairId);
-              }
-              for (auto it2 = std::next(it); it2 != readMappings.end(); it2++) {
-                  // If this mapping is for a different reference sequence, ignore
-                  if (it2->refSeqId != it->refSeqId) {
-                      continue;
-                  }
-                  //If this mapping is for exactly the same segment, ignore
-                  if (it2->queryStartPos == it->queryStartPos) {
-                      continue;
-                  }
-                  //If this mapping is too far from current mapping being evaluated in the query, stop finding a merge
-                  if (it2->queryStartPos > it->queryEndPos + max_dist) {
-                      break;
+          // A partner starts within max_dist after a mapping ends in the query, and near its
+          // end on the reference: near refStartPos of the partner on the forward strand, near
+          // refEndPos on the reverse. Index the mappings by reference sequence, strand and a
+          // max_dist wide cell of that position, then by query start, so each mapping only
+          // visits the mappings in the few cells its partner range overlaps.
+          const offset_t cell = std::max(1, max_dist);
+          const auto cellOf = [cell](offset_t pos) {
+              return pos >= 0 ? pos / cell : -((-pos + cell - 1) / cell);
+          };
+          typedef std::tuple<seqno_t, strand_t, offset_t, offset_t, size_t> RangeKey;
+          std::vector<RangeKey> rangeIndex;
+          rangeIndex.reserve(readMappings.size());
+          for (size_t i = 0; i < readMappings.size(); ++i) {
+              const auto& m = readMappings[i];
+              rangeIndex.emplace_back(m.refSeqId, m.strand, cellOf(m.strand == strnd::FWD ? m.refStartPos : m.refEndPos),
+                                      m.queryStartPos, i);
+          }
+          std::sort(rangeIndex.begin(), rangeIndex.end());
+
+          // Mappings only chain, and only compete for partners, within the same reference
+          // sequence and strand, so these partitions are chained independently; each unites
+          // only its own members, which keeps the union-find free of races between them
+          std::vector<std::pair<size_t, size_t>> partitions;
+          for (size_t begin = 0, end; begin < rangeIndex.size(); begin = end) {
+              end = begin + 1;
+              while (end < rangeIndex.size() && std::get<0>(rangeIndex[end]) == std::get<0>(rangeIndex[begin])
+                     && std::get<1>(rangeIndex[end]) == std::get<1>(rangeIndex[begin])) {
+                  ++end;
+              }
+              partitions.emplace_back(begin, end);
+          }
+
+          const auto chainPartition = [&](int p) {
+              const auto partBegin = rangeIndex.begin() + partitions[p].first;
+              const auto partEnd = rangeIndex.begin() + partitions[p].second;
+              std::vector<size_t> members;
+              members.reserve(partEnd - partBegin);
+              for (auto key = partBegin; key != partEnd; ++key) {
+                  members.push_back(std::get<4>(*key));
+              }
+              // in the sorted order of all mappings, on which earlier partner choices depend
+              std::sort(members.begin(), members.end());
+
+              for (size_t i : members) {
+                  auto it = readMappings.begin() + i;
+                  double best_score = std::numeric_limits<double>::max();
+                  size_t best = readMappings.size();
+                  // we we merge only with the best-scored previous mapping in query space
+                  if (it->chainPairScore != std::numeric_limits<double>::max()) {
+                      disjoint_sets.unite(it->splitMappingId, it->chainPairId);
                   }
-                  //If the next mapping is within range, we can potentially merge
-                  if (it2->strand == it->strand) {
-                      // Always calculate query distance the same way, as query always moves forward
-                      int64_t query_dist = it2->queryStartPos - it->queryEndPos;
-
-                      // Reference distance calculation depends on strand
-                      int64_t ref_dist;
-                      if (it->strand == strnd::FWD) {
-                          ref_dist = it2->refStartPos - it->refEndPos;
-                      } else {
-                          // For reverse complement, we need to invert the order
-                          ref_dist = it->refStartPos - it2->refEndPos;
-                      }
 
-                      // Check if the distance is within acceptable range
-                      if (query_dist >= 0 && ref_dist >= -param.segLength/5 && ref_dist <= max_dist) {
-                          double dist = std::sqrt(std::pow(query_dist, 2) + std::pow(ref_dist, 2));
-                          if (dist < max_dist && best_score > dist && it2->chainPairScore > dist) {
-                              best_it2 = it2;
-                              best_score = dist;
+                  // Partner position range on the reference, from ref_dist in [-segLength/5, max_dist]
+                  const offset_t refLow = it->strand == strnd::FWD ? it->refEndPos - param.segLength/5 : it->refStartPos - max_dist;
+                  const offset_t refHigh = it->strand == strnd::FWD ? it->refEndPos + max_dist : it->refStartPos + param.segLength/5;
+                  for (offset_t c = cellOf(refLow); c <= cellOf(refHigh); ++c) {
+                      auto cand = std::lower_bound(partBegin, partEnd, RangeKey(it->refSeqId, it->strand, c, it->queryEndPos, 0));
+                      for (; cand != partEnd && std::get<2>(*cand) == c && std::get<3>(*cand) <= it->queryEndPos + max_dist; ++cand) {
+                          const size_t j = std::get<4>(*cand);
+                          auto it2 = readMappings.begin() + j;
+                          //If this mapping is for exactly the same segment, ignore
+                          if (j <= i || it2->queryStartPos == it->queryStartPos) {
+                              continue;
+                          }
+                          // Always calculate query distance the same way, as query always moves forward
+                          int64_t query_dist = it2->queryStartPos - it->queryEndPos;
+
+                          // Reference distance calculation depends on strand
+                          int64_t ref_dist;
+                          if (it->strand == strnd::FWD) {
+                              ref_dist = it2->refStartPos - it->refEndPos;
+                          } else {
+                              // For reverse complement, we need to invert the order
+                              ref_dist = it->refStartPos - it2->refEndPos;
+                          }
+
+                          // Check if the distance is within acceptable range
+                          if (query_dist >= 0 && ref_dist >= -param.segLength/5 && ref_dist <= max_dist) {
+                              double dist = std::sqrt(std::pow(query_dist, 2) + std::pow(ref_dist, 2));
+                              // The first candidate in sorted order wins ties
+                              if (dist < max_dist && it2->chainPairScore > dist
+                                      && (best_score > dist || (best_score == dist && j < best))) {
+                                  best = j;
+                                  best_score = dist;
+                              }
                           }
                       }
                   }
+                  if (best != readMappings.size()) {
+                      readMappings[best].chainPairScore = best_score;
+                      readMappings[best].chainPairId = it->splitMappingId;
+                  }
               }
-              if (best_it2 != readMappings.end()) {
-                  best_it2->chainPairScore = best_score;
-                  best_it2->chainPairId = it->splitMappingId;
+              progress.increment(members.size());
+          };
+
+          // Queries are already mapped in parallel; only split one with a very large
+          // mapping set over threads of its own
+          if (readMappings.size() >= parallelChainingMinMappings && partitions.size() > 1) {
+              parallelFor(partitions.size(), chainPartition);
+          } else {
+              for (size_t p = 0; p < partitions.size(); ++p) {
+                  chainPartition(p);
               }
-              progress.increment(1);
           }
 
           // Assign the merged mapping ids
@@ -2083,13 +5248,9 @@ namespace skch
           }
 
           //Sort the mappings by post-merge split mapping id, then by query position, then by target position
-          std::sort(
-              readMappings.begin(),
-              readMappings.end(),
-              [](const MappingResult &a, const MappingResult &b) {
-                  return std::tie(a.splitMappingId, a.queryStartPos, a.refSeqId, a.refStartPos, a.strand)
-                      < std::tie(b.splitMappingId, b.queryStartPos, b.refSeqId, b.refStartPos, b.strand);
-              });
+          sortMappingsByKey(readMappings, [](const MappingResult& e) {
+              return std::make_tuple(e.splitMappingId, e.queryStartPos, e.refSeqId, e.refStartPos, e.strand);
+          });
 
           // Create maximallyMergedMappings with length restrictions
           MappingResultsVector_t maximallyMergedMappings;
@@ -2139,13 +5300,17 @@ namespace skch
                   
                   // Calculate averages for the fragment
                   double totalNucIdentity = 0.0;
+                  double totalNucIdentityUpperBound = 0.0;
                   double totalKmerComplexity = 0.0;
                   int totalConservedSketches = 0;
                   int totalSketchSize = 0;
+                  int opposingStrandVotes = 0;
                   int fragment_size = 0;
                   
                   for (auto subIt = fragment_start; subIt != std::next(fragment_end); ++subIt) {
                       totalNucIdentity += subIt->nucIdentity;
+                      totalNucIdentityUpperBound += subIt->nucIdentityUpperBound;
+                      opposingStrandVotes = std::max(opposingStrandVotes, subIt->opposingStrandVotes);
                       totalKmerComplexity += subIt->kmerComplexity;
                       totalConservedSketches += subIt->conservedSketches;
                       totalSketchSize += subIt->sketchSize;
@@ -2154,6 +5319,8 @@ namespace skch
     
                   mergedMapping.n_merged = fragment_size;
                   mergedMapping.nucIdentity = totalNucIdentity / fragment_size;
+                  mergedMapping.nucIdentityUpperBound = totalNucIdentityUpperBound / fragment_size;
+                  mergedMapping.opposingStrandVotes = opposingStrandVotes;
                   mergedMapping.kmerComplexity = totalKmerComplexity / fragment_size;
                   mergedMapping.conservedSketches = totalConservedSketches;
                   mergedMapping.sketchSize = totalSketchSize;
@@ -2244,11 +5411,13 @@ namespace skch
        * @param mappings Mappings to filter
        * @param param Algorithm parameters
        */
-      std::pair<MappingResultsVector_t, MappingResultsVector_t> filterSubsetMappings(MappingResultsVector_t& mappings, progress_meter::ProgressMeter& progress) {
+      std::pair<MappingResultsVector_t, MappingResultsVector_t> filterSubsetMappings(MappingResultsVector_t& mappings, progress_meter::ProgressMeter& progress,
+                                                                                     bool segment = false) {
           if (mappings.empty()) return {MappingResultsVector_t(), MappingResultsVector_t()};
+          profile::StageTimer timer(profile::FILTER);
           
           // Only merge once and keep both versions
-          auto maximallyMergedMappings = mergeMappingsInRange(mappings, param.chain_gap, progress);
+          auto maximallyMergedMappings = mergeMappingsInRange(mappings, param.chain_gap, progress, segment);
           
           // Process both merged and non-merged mappings
           if (param.mergeMappings && param.split) {
@@ -2257,6 +5426,10 @@ namespace skch
               filterNonMergedMappings(mappings, param, progress);
           }
 
+          // The reported mappings are final here, so sparsify them before they are gathered,
+          // spilled or filtered across subsets
+          sparsifyMappings(param.mergeMappings && param.split ? maximallyMergedMappings : mappings);
+
           // Build dense chain ID mapping
           std::unordered_map<offset_t, offset_t> id_map;
           offset_t next_id = 0;
@@ -2370,19 +5543,32 @@ namespace skch
        * @param[in]   readMappings      mapping results for single or multiple reads
        * @param[in]   queryName         input required if reporting one read at a time
        * @param[in]   outstrm           file output stream object
+       * @param[in]   chainIdBase       first chain id of these mappings in the output
+       * @return                        chain ids used, at most the number of mappings
        */
-      void reportReadMappings(MappingResultsVector_t &readMappings, const std::string &queryName,
-          std::ostream &outstrm)
+      offset_t reportReadMappings(MappingResultsVector_t &readMappings, std::string_view queryName,
+          std::ostream &outstrm, offset_t chainIdBase)
       {
+        profile::StageTimer timer(profile::OUTPUT);
+        profile::count(profile::REPORTED_MAPPINGS, readMappings.size());
+
+        // Renumber the chains from chainIdBase in the order of their first mapping along the
+        // query, rather than by the ids the threads that filtered them drew
+        sortMappingsByKey(readMappings, [](const MappingResult& e) {
+            return std::make_tuple(e.querySeqId, e.queryStartPos, e.refSeqId, e.refStartPos, e.strand);
+        });
+        robin_hood::unordered_flat_map<offset_t, offset_t> chainIds;
+        for (auto& e : readMappings) {
+            e.splitMappingId = chainIds.emplace(e.splitMappingId, chainIdBase + offset_t(chainIds.size())).first->second;
+        }
+
         // Sort mappings by chain ID and query position
-        std::sort(readMappings.begin(), readMappings.end(),
-            [](const MappingResult &a, const MappingResult &b) {
-                return std::tie(a.splitMappingId, a.queryStartPos)
-                    < std::tie(b.splitMappingId, b.queryStartPos);
-            });
+        sortMappingsByKey(readMappings, [](const MappingResult& e) {
+            return std::make_tuple(e.splitMappingId, e.queryStartPos);
+        });
 
         // Assign chain positions within each chain
-        int current_chain = -1;
+        offset_t current_chain = -1;
         int chain_pos = 0;
         int chain_length = 0;
         
@@ -2409,6 +5595,11 @@ namespace skch
             readMappings[i].chain_pos = chain_pos;
         }
 
+        if (param.binary_output) {
+          reportBinaryMappings(readMappings, queryName, outstrm);
+          return chainIds.size();
+        }
+
         //Print the results
         for(auto &e : readMappings)
         {
@@ -2438,6 +5629,16 @@ namespace skch
             } else {
               outstrm << sep << "chain:i:" << e.splitMappingId << "." << e.chain_pos << "." << e.chain_length;
             }
+            outstrm << sep << "ub:f:" << e.nucIdentityUpperBound
+                    << sep << "iv:i:" << e.opposingStrandVotes;
+            if (queryCosts) {
+              // Of the whole query, on each of its mappings
+              const profile::QueryCost& cost = queryCosts[e.querySeqId];
+              outstrm << sep << "sh:i:" << cost.get(profile::SEED_INTERVAL_POINTS)
+                      << sep << "l1:i:" << cost.get(profile::L1_CANDIDATES)
+                      << sep << "l2:i:" << cost.get(profile::L2_MAPPINGS)
+                      << sep << "mt:f:" << cost.seconds();
+            }
           } else
           {
             outstrm << sep << e.nucIdentity * 100.0;
@@ -2453,65 +5654,194 @@ namespace skch
           if(processMappingResults != nullptr)
             processMappingResults(e);
         }
+        return chainIds.size();
+      }
+
+      /**
+       * @brief                 write the mappings of a query, their chain positions assigned,
+       *                        as records of a binary mapping file
+       */
+      void reportBinaryMappings(const MappingResultsVector_t &readMappings, std::string_view queryName,
+          std::ostream &outstrm)
+      {
+        const seqno_t queryId = param.filterMode == filter::ONETOONE || readMappings.empty()
+            ? 0 : idManager->getSequenceId(queryName);
+        for(auto &e : readMappings)
+        {
+          BinaryMapping record;
+          record.queryStartPos = e.queryStartPos;
+          record.queryEndPos = e.queryEndPos;
+          record.refStartPos = e.refStartPos;
+          record.refEndPos = e.refEndPos;
+          record.queryLen = e.queryLen;
+          record.refLen = idManager->getSequenceLength(e.refSeqId);
+          record.querySeqId = param.filterMode == filter::ONETOONE ? e.querySeqId : queryId;
+          record.refSeqId = e.refSeqId;
+          record.nucIdentity = e.nucIdentity;
+          record.nucIdentityUpperBound = e.nucIdentityUpperBound;
+          record.opposingStrandVotes = std::min(e.opposingStrandVotes, UINT16_MAX - 1) + 1;
+          record.chainId = param.mergeMappings ? e.splitMappingId : -1;
+          record.chainPos = param.mergeMappings ? e.chain_pos : 1;
+          record.chainLength = param.mergeMappings ? e.chain_length : 1;
+          record.strand = e.strand;
+          std::memset(record.padding, 0, sizeof(record.padding));
+          writeBinaryMapping(outstrm, record);
+
+          if(processMappingResults != nullptr)
+            processMappingResults(e);
+        }
       }
 
     private:
-      void processCombinedMappingsThread(aggregate_atomic_queue_t& aggregate_queue, writer_atomic_queue_t& writer_queue, std::atomic<bool>& processing_done, progress_meter::ProgressMeter& progress) {
-          int wait_count = 0;
-          while (true) {
-              std::pair<seqno_t, MappingResultsVector_t*>* task = nullptr;
-              if (aggregate_queue.try_pop(task)) {
-                  wait_count = 0;
-                  auto querySeqId = task->first;
-                  auto& mappings = *(task->second);
-                  
-                  std::string queryName = idManager->getSequenceName(querySeqId);
-                  // Final filtering pass on pre-filtered mappings
-                  if (param.filterMode == filter::MAP || param.filterMode == filter::ONETOONE) {
-                      MappingResultsVector_t filteredMappings;
-                      filterByGroup(mappings, filteredMappings, param.numMappingsForSegment - 1, 
-                                  param.filterMode == filter::ONETOONE, *idManager, progress);
-                      mappings = std::move(filteredMappings);
-                  }
+      // Filtered mappings of all queries, gathered for a pass across them
+      struct MappingCollector
+      {
+          std::mutex mutex;
+          MappingResultsVector_t mappings;
+      };
 
-                  std::stringstream ss;
-                  reportReadMappings(mappings, queryName, ss);
-                  
-                  auto* output = new std::string(ss.str());
-                  while (!writer_queue.try_push(output)) {
-                      std::this_thread::sleep_for(std::chrono::milliseconds(10));
-                  }
-                  delete task;
+      // Bytes of formatted mappings a thread gathers before handing them to the writer
+      static constexpr size_t outputChunkSize = 1 << 20;
+
+      // Formatted queries waiting for those enqueued before them, and the chunk all are
+      // appended to in order
+      struct OrderedOutput
+      {
+          std::mutex mutex;
+          std::map<uint64_t, std::string> parked;
+          uint64_t next = 0;
+          std::string* chunk = nullptr;
+      };
+
+      void processCombinedMappingsThread(aggregate_queue_t& aggregate_queue, writer_queue_t& writer_queue, OutputChunkPool& chunks,
+                                         OrderedOutput& ordered, progress_meter::ProgressMeter& progress, MappingCollector* collector) {
+          std::string text;
+          ChunkStream out(&text);
+          QueryTask* task = nullptr;
+          while (aggregate_queue.pop(task)) {
+              filterFinalQueryMappings(task->mappings, progress);
+              if (collector) {
+                  std::lock_guard<std::mutex> lock(collector->mutex);
+                  collector->mappings.insert(collector->mappings.end(), task->mappings.begin(), task->mappings.end());
               } else {
-                  if (processing_done.load() && aggregate_queue.was_empty()) {
-                      ++wait_count;
-                  }
-                  if (wait_count > 10) {
-                      break;
-                  }
-                  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                  text.clear();
+                  reportReadMappings(task->mappings, idManager->getSequenceName(task->querySeqId), out, task->chainIdBase);
+                  appendInOrder(task->order, text, ordered, writer_queue, chunks);
+              }
+              delete task;
+          }
+      }
+
+      /**
+       * @brief     append the formatted query numbered order to the output chunk if every
+       *            query before it is, with those parked after it, else park it
+       */
+      void appendInOrder(uint64_t order, std::string& text, OrderedOutput& ordered, writer_queue_t& writer_queue, OutputChunkPool& chunks) {
+          std::lock_guard<std::mutex> lock(ordered.mutex);
+          if (order != ordered.next) {
+              ordered.parked.emplace(order, std::move(text));
+              text = std::string();
+              return;
+          }
+          const auto append = [&](const std::string& query) {
+              ordered.chunk->append(query);
+              if (chunks.full(*ordered.chunk)) {
+                  writer_queue.push(ordered.chunk);
+                  ordered.chunk = chunks.get();
               }
+              ++ordered.next;
+          };
+          append(text);
+          while (!ordered.parked.empty() && ordered.parked.begin()->first == ordered.next) {
+              append(ordered.parked.begin()->second);
+              ordered.parked.erase(ordered.parked.begin());
           }
       }
 
-      void outputThread(std::ofstream& outstrm, writer_atomic_queue_t& writer_queue, std::atomic<bool>& processing_done,
-                        std::atomic<bool>& workers_done, std::atomic<bool>& output_done) {
-          int wait_count = 0;
-          while (!output_done.load()) {
-              std::string* result = nullptr;
-              if (writer_queue.try_pop(result)) {
-                  wait_count = 0;
-                  outstrm << *result;
-                  delete result;
+      /**
+       * @brief     push the chunk of out to the writer once it is full, or at the last if
+       *            it holds anything, and give out a fresh one
+       */
+      void handOverChunk(ChunkStream& out, writer_queue_t& writer_queue, OutputChunkPool& chunks, bool last) {
+          std::string* chunk = out.chunk();
+          if (last) {
+              if (chunk->empty()) {
+                  chunks.put(chunk);
               } else {
-                  if (processing_done.load() && workers_done.load() && writer_queue.was_empty()) {
-                      ++wait_count;
-                  }
-                  if (wait_count > 10) {
-                      output_done.store(true);
-                  }
-                  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                  writer_queue.push(chunk);
+              }
+              out.reset(nullptr);
+          } else if (chunks.full(*chunk)) {
+              writer_queue.push(chunk);
+              out.reset(chunks.get());
+          }
+      }
+
+      /**
+       * @brief     one-to-one filtering along the reference axis over the mappings of all
+       *            queries, each reference sequence on its own thread
+       * @details   the sweep over a reference sequence never sees mappings of another, so
+       *            splitting by reference gives the result of one sweep over all of them
+       * @return    the surviving mappings, sorted by query
+       */
+      void filterOneToOne(MappingResultsVector_t& mappings)
+      {
+          sortMappingsByKey(mappings, [](const MappingResult& e) {
+              return std::make_tuple(e.refSeqId, e.querySeqId, e.queryStartPos, e.refStartPos, e.strand);
+          }, param.threads);
+          std::vector<std::pair<size_t, size_t>> refRanges;
+          for (size_t begin = 0, end; begin < mappings.size(); begin = end) {
+              end = begin + 1;
+              while (end < mappings.size() && mappings[end].refSeqId == mappings[begin].refSeqId) {
+                  ++end;
               }
+              refRanges.emplace_back(begin, end);
+          }
+
+          std::vector<MappingResultsVector_t> kept(refRanges.size());
+          parallelFor(refRanges.size(), [&](int r) {
+              kept[r].assign(mappings.begin() + refRanges[r].first, mappings.begin() + refRanges[r].second);
+              skch::Filter::ref::filterMappings(kept[r], *idManager, param.numMappingsForSegment - 1, param.dropRand, param.overlap_threshold);
+          });
+
+          mappings.clear();
+          for (auto& refMappings : kept) {
+              mappings.insert(mappings.end(), refMappings.begin(), refMappings.end());
+          }
+          sortMappingsByKey(mappings, [](const MappingResult& e) {
+              return std::make_tuple(e.querySeqId, e.queryStartPos, e.refSeqId, e.refStartPos, e.strand);
+          }, param.threads);
+      }
+
+      /**
+       * @brief     final filtering pass on the pre-filtered mappings of a query
+       * @return    the mappings as they are reported
+       */
+      std::string finalQueryMappings(seqno_t querySeqId, MappingResultsVector_t& mappings, progress_meter::ProgressMeter& progress) {
+          std::string_view queryName = idManager->getSequenceName(querySeqId);
+          filterFinalQueryMappings(mappings, progress);
+
+          std::stringstream ss;
+          reportReadMappings(mappings, queryName, ss, chainIdsReported.fetch_add(mappings.size()));
+          return ss.str();
+      }
+
+      void filterFinalQueryMappings(MappingResultsVector_t& mappings, progress_meter::ProgressMeter& progress) {
+          profile::StageTimer timer(profile::FILTER);
+          if (param.filterMode == filter::MAP || param.filterMode == filter::ONETOONE) {
+              MappingResultsVector_t filteredMappings;
+              filterByGroup(mappings, filteredMappings, param.numMappingsForSegment - 1, 
+                          param.filterMode == filter::ONETOONE, *idManager, progress);
+              mappings = std::move(filteredMappings);
+          }
+      }
+
+      void outputThread(std::ostream& outstrm, writer_queue_t& writer_queue, OutputChunkPool& chunks) {
+          std::string* chunk = nullptr;
+          while (writer_queue.pop(chunk)) {
+              profile::StageTimer timer(profile::OUTPUT);
+              outstrm.write(chunk->data(), chunk->size());
+              chunks.put(chunk);
           }
       }
 
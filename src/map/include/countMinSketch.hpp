@@ -0,0 +1,78 @@
+/**
+ * @file    countMinSketch.hpp
+ * @brief   Count-min sketch of minmer hash frequencies
+ */
+
+#ifndef COUNT_MIN_SKETCH_HPP
+#define COUNT_MIN_SKETCH_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
+
+#include "map/include/base_types.hpp"
+
+namespace skch
+{
+  /**
+   * @brief   Fixed-size approximate frequency table over minmer hashes
+   * @details depth rows of 2^widthBits counters, each row indexed by a different
+   *          multiplicative hash. An estimate is the smallest counter of its hash, so it
+   *          never undercounts. Concurrent add() calls from several threads are safe.
+   */
+  class CountMinSketch
+  {
+    public:
+
+      static constexpr int depth = 4;
+
+      /**
+       * @param[in] expectedItems   number of additions expected; rows get about one
+       *                            counter per two of them
+       */
+      explicit CountMinSketch(uint64_t expectedItems)
+      {
+        while (widthBits < 32 && (1ULL << (widthBits + 1)) < expectedItems)
+          widthBits++;
+        counters.reset(new std::atomic<uint32_t>[depth << widthBits]());
+      }
+
+      void add(hash_t hash)
+      {
+        for (int row = 0; row < depth; ++row) {
+          std::atomic<uint32_t>& counter = counters[cell(hash, row)];
+          if (counter.load(std::memory_order_relaxed) != std::numeric_limits<uint32_t>::max())
+            counter.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+
+      uint64_t estimate(hash_t hash) const
+      {
+        uint32_t count = std::numeric_limits<uint32_t>::max();
+        for (int row = 0; row < depth; ++row)
+          count = std::min(count, counters[cell(hash, row)].load(std::memory_order_relaxed));
+        return count;
+      }
+
+      uint64_t bytes() const
+      {
+        return (uint64_t(depth) << widthBits) * sizeof(uint32_t);
+      }
+
+    private:
+
+      uint64_t cell(hash_t hash, int row) const
+      {
+        static constexpr uint64_t multipliers[depth] = {
+          0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL};
+        return (uint64_t(row) << widthBits) + ((hash * multipliers[row]) >> (64 - widthBits));
+      }
+
+      int widthBits = 16;
+      std::unique_ptr<std::atomic<uint32_t>[]> counters;
+  };
+}
+
+#endif
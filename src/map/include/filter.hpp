@@ -30,6 +30,46 @@ namespace skch
    */
   namespace Filter
   {
+    /**
+     * @brief   plane sweep status: the ids of the segments under the sweep line, kept in a
+     *          flat sorted array
+     * @details behaves like std::set<int, Order>, including that an id equivalent to one
+     *          already present is not inserted and erasing removes the equivalent one. The
+     *          status is as deep as the mappings overlapping one position, where shifting a
+     *          contiguous array beats chasing tree nodes.
+     */
+    template <typename Order>
+    class SweepStatus
+    {
+      public:
+
+        typedef std::vector<int>::const_iterator iterator;
+
+        explicit SweepStatus(const Order& order) : order(order) {}
+
+        void insert(int id)
+        {
+          auto pos = std::lower_bound(ids.begin(), ids.end(), id, order);
+          if (pos == ids.end() || order(id, *pos))
+            ids.insert(pos, id);
+        }
+
+        void erase(int id)
+        {
+          auto pos = std::lower_bound(ids.begin(), ids.end(), id, order);
+          if (pos != ids.end() && !order(id, *pos))
+            ids.erase(pos);
+        }
+
+        iterator begin() const { return ids.begin(); }
+        iterator end() const { return ids.end(); }
+
+      private:
+
+        const Order& order;
+        std::vector<int> ids;
+    };
+
     /**
      * @namespace skch::filter::query
      * @brief     filter routines (best for query sequence)
@@ -41,14 +81,28 @@ namespace skch
       struct Helper
       {
         MappingResultsVector_t &vec;
-
-        Helper(MappingResultsVector_t &v) : vec(v) {}
+        std::vector<double> scores;     //score of each mapping, computed once for the sweep
+        std::vector<offset_t> starts;   //query intervals and reference ids, in flat arrays so
+        std::vector<offset_t> ends;     //the sweep does not touch the wide mappings
+        std::vector<seqno_t> refIds;
+
+        Helper(MappingResultsVector_t &v) : vec(v) {
+            scores.reserve(vec.size());
+            starts.reserve(vec.size());
+            ends.reserve(vec.size());
+            refIds.reserve(vec.size());
+            for (const auto& e : vec) {
+                scores.push_back(e.blockLength <= 0 || e.blockNucIdentity <= 0
+                    ? std::numeric_limits<double>::lowest()
+                    : e.blockNucIdentity * std::log(static_cast<double>(e.blockLength)));
+                starts.push_back(e.queryStartPos);
+                ends.push_back(e.queryEndPos);
+                refIds.push_back(e.refSeqId);
+            }
+        }
 
         double get_score(const int x) const {
-            if (vec[x].blockLength <= 0 || vec[x].blockNucIdentity <= 0) {
-                return std::numeric_limits<double>::lowest();
-            }
-            return vec[x].blockNucIdentity * std::log(static_cast<double>(vec[x].blockLength));
+            return scores[x];
         }
 
         //Greater than comparison by score and begin position
@@ -61,7 +115,7 @@ namespace skch
           auto x_score = get_score(x);
           auto y_score = get_score(y);
 
-          return std::tie(x_score, vec[x].queryStartPos, vec[x].refSeqId) > std::tie(y_score, vec[y].queryStartPos, vec[y].refSeqId);
+          return std::tie(x_score, starts[x], refIds[x]) > std::tie(y_score, starts[y], refIds[y]);
         }
 
         //Greater than comparison by score
@@ -78,17 +132,17 @@ namespace skch
 
         // compute the overlap of the two mappings
         double get_overlap(const int x, const int y) const {
-            offset_t overlap_start = std::max(vec[x].queryStartPos, vec[y].queryStartPos);
-            offset_t overlap_end = std::min(vec[x].queryEndPos, vec[y].queryEndPos);
+            offset_t overlap_start = std::max(starts[x], starts[y]);
+            offset_t overlap_end = std::min(ends[x], ends[y]);
             offset_t overlap_length = std::max(0, static_cast<int>(overlap_end - overlap_start));
-            offset_t x_length = vec[x].queryEndPos - vec[x].queryStartPos;
-            offset_t y_length = vec[y].queryEndPos - vec[y].queryStartPos;
+            offset_t x_length = ends[x] - starts[x];
+            offset_t y_length = ends[y] - starts[y];
             return static_cast<double>(overlap_length) / std::min(x_length, y_length);
         }
 
         /*
          * @brief                         mark the mappings with maximum score as good (on query seq)
-         * @tparam          Type          std::set type to save mappings (sweep line status container)
+         * @tparam          Type          sweep line status container, iterated in score order
          * @param[in/out]   L             container with mappings
          */
         template <typename Type>
@@ -185,13 +239,14 @@ namespace skch
           Helper obj (readMappings);
 
           //Plane sweep status
-          //binary search tree of segment ids, ordered by their scores
-          std::set <int, Helper> bst (obj);
+          //segment ids, ordered by their scores
+          SweepStatus<Helper> bst (obj);
 
           //Event point schedule
           //vector of triplets <position, event type, segment id>
           typedef std::tuple<offset_t, int, int> eventRecord_t;
-          std::vector <eventRecord_t>  eventSchedule (2*readMappings.size());
+          std::vector <eventRecord_t>  eventSchedule;
+          eventSchedule.reserve(2*readMappings.size());
 
           for(int i = 0; i < readMappings.size(); i++)
           {
@@ -199,7 +254,7 @@ namespace skch
             eventSchedule.emplace_back (readMappings[i].queryEndPos, event::END, i);
           }
 
-          std::sort(eventSchedule.begin(), eventSchedule.end());
+          radix::sortTuples(eventSchedule);
 
           //Execute the plane sweep algorithm
           for(auto it = eventSchedule.begin(); it!= eventSchedule.end();)
@@ -263,7 +318,7 @@ namespace skch
               eventSchedule.emplace_back (readMappings[i].queryEndPos, 0, event::END, i); // end should not be preferred
           }
 
-          std::sort(eventSchedule.begin(), eventSchedule.end());
+          radix::sortTuples(eventSchedule);
 
           //Execute the plane sweep algorithm
           for(auto it = eventSchedule.begin(); it!= eventSchedule.end();)
@@ -330,10 +385,22 @@ namespace skch
       struct Helper
       {
         MappingResultsVector_t &vec;
+        std::vector<double> scores;     //score of each mapping, computed once for the sweep
+        std::vector<offset_t> starts;   //reference intervals, in flat arrays
+        std::vector<offset_t> ends;
+
+        Helper(MappingResultsVector_t &v) : vec(v) {
+            scores.reserve(vec.size());
+            starts.reserve(vec.size());
+            ends.reserve(vec.size());
+            for (const auto& e : vec) {
+                scores.push_back(e.blockNucIdentity * log(e.blockLength));
+                starts.push_back(e.refStartPos);
+                ends.push_back(e.refEndPos);
+            }
+        }
 
-        Helper(MappingResultsVector_t &v) : vec(v) {}
-
-        double get_score(const int x) const {return vec[x].blockNucIdentity * log(vec[x].blockLength); }
+        double get_score(const int x) const {return scores[x]; }
 
         //Greater than comparison by score and begin position
         //used to define order in BST
@@ -345,7 +412,7 @@ namespace skch
           auto x_score = get_score(x);
           auto y_score = get_score(y);
 
-          return std::tie(x_score, vec[x].refStartPos) > std::tie(y_score, vec[y].refStartPos);
+          return std::tie(x_score, starts[x]) > std::tie(y_score, starts[y]);
         }
 
         //Greater than comparison by score
@@ -362,17 +429,17 @@ namespace skch
 
         // compute the overlap of the two mappings
         double get_overlap(const int x, const int y) const {
-            offset_t overlap_start = std::max(vec[x].refStartPos, vec[y].refStartPos);
-            offset_t overlap_end = std::min(vec[x].refEndPos, vec[y].refEndPos);
+            offset_t overlap_start = std::max(starts[x], starts[y]);
+            offset_t overlap_end = std::min(ends[x], ends[y]);
             offset_t overlap_length = std::max(0, static_cast<int>(overlap_end - overlap_start));
-            offset_t x_length = vec[x].refEndPos - vec[x].refStartPos;
-            offset_t y_length = vec[y].refEndPos - vec[y].refStartPos;
+            offset_t x_length = ends[x] - starts[x];
+            offset_t y_length = ends[y] - starts[y];
             return static_cast<double>(overlap_length) / std::min(x_length, y_length);
         }
 
         /**
          * @brief                         mark the mappings with maximum score as good (on query seq)
-         * @tparam          Type          std::set type to save mappings (sweep line status container)
+         * @tparam          Type          sweep line status container, iterated in score order
          * @param[in/out]   L             container with mappings
          */
           template <typename Type>
@@ -485,12 +552,13 @@ namespace skch
           Helper obj (readMappings);
 
           //Plane sweep status
-          //binary search tree of segment ids, ordered by their scores
-          std::set <int, Helper> bst (obj);
+          //segment ids, ordered by their scores
+          SweepStatus<Helper> bst (obj);
 
           //Event point schedule
           //vector of triplets <position, event type, segment id>
-          std::vector <eventRecord_t>  eventSchedule (2*readMappings.size());
+          std::vector <eventRecord_t>  eventSchedule;
+          eventSchedule.reserve(2*readMappings.size());
 
           for(int i = 0; i < readMappings.size(); i++)
           {
@@ -502,7 +570,7 @@ namespace skch
             eventSchedule.push_back (endEvent);
           }
 
-          std::sort(eventSchedule.begin(), eventSchedule.end());
+          radix::sortTuples(eventSchedule);
 
           //Execute the plane sweep algorithm
           for(auto it = eventSchedule.begin(); it!= eventSchedule.end();)
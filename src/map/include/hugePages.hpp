@@ -0,0 +1,75 @@
+/**
+ * @file    hugePages.hpp
+ * @brief   Transparent huge page backing of large read-mostly arrays on Linux
+ */
+
+#ifndef SKCH_HUGE_PAGES_HPP
+#define SKCH_HUGE_PAGES_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+namespace skch
+{
+  namespace hugePages
+  {
+    static constexpr size_t hugePageSize = size_t(2) << 20;
+
+    /**
+     * @return  false if the system has transparent huge pages disabled, or none
+     */
+    inline bool available()
+    {
+      std::ifstream enabled("/sys/kernel/mm/transparent_hugepage/enabled");
+      std::string modes;
+      return std::getline(enabled, modes) && modes.find("[never]") == std::string::npos;
+    }
+
+    /**
+     * @brief   back the huge pages wholly inside [data, data + bytes) with transparent huge
+     *          pages, collapsing those already touched where the kernel can (MADV_COLLAPSE,
+     *          Linux 6.1) and leaving them to khugepaged otherwise
+     * @details the index and the sequences are read at random positions while mapping, so
+     *          with 4K pages most lookups of a large index miss the TLB. Where huge pages are
+     *          unavailable or disabled the advice fails and the pages stay as they are.
+     * @return  false if the range was not advised
+     */
+    inline bool advise(const void* data, size_t bytes)
+    {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+      const uintptr_t begin = (reinterpret_cast<uintptr_t>(data) + hugePageSize - 1) & ~uintptr_t(hugePageSize - 1);
+      const uintptr_t end = (reinterpret_cast<uintptr_t>(data) + bytes) & ~uintptr_t(hugePageSize - 1);
+      if (data == nullptr || end <= begin) {
+        return false;
+      }
+      void* start = reinterpret_cast<void*>(begin);
+      if (madvise(start, end - begin, MADV_HUGEPAGE) != 0) {
+        return false;
+      }
+#ifdef MADV_COLLAPSE
+      madvise(start, end - begin, MADV_COLLAPSE);
+#endif
+      return true;
+#else
+      (void)data;
+      (void)bytes;
+      return false;
+#endif
+    }
+
+    template <typename T, typename A>
+    inline bool advise(const std::vector<T, A>& v)
+    {
+      return advise(v.data(), v.capacity() * sizeof(T));
+    }
+  }
+}
+
+#endif
@@ -7,12 +7,14 @@
 #define SKETCH_CONFIG_HPP
 
 #include <vector>
+#include <memory>
 #include <unordered_set>
 #include <filesystem>
 namespace stdfs = std::filesystem;
 
 #include "common/ALeS.hpp"
 #include "base_types.hpp"
+#include "regions.hpp"
 
 namespace skch
 {
@@ -25,6 +27,17 @@ struct ales_params {
   uint32_t region_length{};
 };
 
+/**
+ * @brief   final filter settings of a --sweep line, each written to its own output
+ */
+struct SweepSetting {
+  std::string output;
+  float percentageIdentity{};
+  uint32_t numMappingsForSegment{};
+  offset_t chain_gap{};
+  double overlap_threshold{};
+};
+
 /**
  * @brief   configuration parameters for building sketch
  *          expected to be initialized using command line arguments
@@ -32,6 +45,7 @@ struct ales_params {
 struct Parameters
 {
     int kmerSize;                                     //kmer size for sketching
+    int kmerHashEngine = kmer_hash::ROLLING_2BIT;     //k-mer hashing scheme (see skch::kmer_hash)
     offset_t segLength;                                //For split mapping case, this represents the fragment length
                                                       //for noSplit, it represents minimum read length to multimap
     offset_t block_length;                             // minimum (potentially merged) block to keep if we aren't split
@@ -42,6 +56,7 @@ struct Parameters
     float percentageIdentity;                         //user defined threshold for good similarity
     bool stage2_full_scan;                            //Instead of using the best intersection for a given candidate region, compute the minhash for every position in the window
     bool stage1_topANI_filter;                        //Use the ANI filter in stage 1
+    bool stage2_bound = false;                        //Skip L1 candidates that cannot beat the mappings kept for a segment
     float ANIDiff;                                    //ANI distance threshold below best mapping to retain in stage 1 filtering
     float ANIDiffConf;                                //Confidence of stage 1 ANI filtering threshold
     int filterMode;                                   //filtering mode in mashmap
@@ -49,13 +64,63 @@ struct Parameters
     uint32_t numMappingsForShortSequence;             //how many secondary alignments we keep for reads < segLength
     bool dropRand;                                    //drop mappings w/ same score until only numMappingsForSegment remain
     int threads;                                      //execution thread count
+    bool numa = false;                                //interleave the index over NUMA nodes and pin mapping threads to them
+    bool huge_pages = false;                          //back the index with transparent huge pages
+    bool index_warmup = false;                        //fault each loaded index in on all threads before mapping against it
+    bool lock_index = false;                          //lock each loaded index in memory, faulting it in first
+    bool pack_queries = false;                        //keep the queued queries 2-bit packed, decoded when taken up for mapping
+    std::string stage_report_file;                    //TSV for the times of the mapping stages and the waits of its queues, empty for none
+    bool cost_tags = false;                           //tag each mapping with the counters and time of mapping its query
+    std::string slow_query_file;                      //TSV of the queries that took longest to map and their counters, empty for none
+    int slow_query_count = 20;                        //queries listed in slow_query_file
+    std::string memory_report_file;                   //TSV for the bytes of the index and pipeline structures at each phase, empty for none
+    bool memory_estimate = false;                     //print the estimated index memory of each target subset and exit
+    bool plan_only = false;                           //split the targets into subsets and return without mapping
+    std::string profile_prefix;                       //prefix of the folded stacks sampled in each pipeline stage, empty for none
     std::vector<std::string> refSequences;            //reference sequence(s)
     std::vector<std::string> querySequences;          //query sequence(s)
     std::string outFileName;                          //output file name
+    bool bgzip_output = false;                        //write the output as BGZF, compressed on the threads
+    std::string bgzip_index_file;                     //with bgzip_output, where to save the .gzi index, empty for none
+    std::string interval_index_file;                  //where to save the interval index of the PAF output, empty for none
+    bool sort_output = false;                         //write the output sorted by target and position
+    std::string sort_prefix;                          //with sort_output, prefix of the sorted run files
+    uint64_t sort_memory = 1ULL << 30;                //with sort_output, bytes of lines held before spilling a run
+    bool binary_output = false;                       //write the mappings as a binary mapping file (binaryMappings.hpp) rather than PAF
     stdfs::path indexFilename;                        //output file name of index
+    std::vector<stdfs::path> indexFiles;              //with -I, the index files mapped against as one target set, indexFilename first
     bool overwrite_index;                             //overwrite index if it exists
     bool create_index_only;                           //only create index and exit
+    bool update_index = false;                        //add targets missing from an existing index to it
+    bool compress_index = false;                      //write the index as delta-coded varint blocks
+    bool verify_index = true;                         //check the section checksums of each sub-index loaded
+    bool index_stats = false;                         //with -I, print the statistics of each sub-index loaded and exit
+    bool distance_matrix = false;                     //write the minmer distance estimates of the query and target pairs instead of mapping
+    std::vector<uint64_t> index_subsets;              //0-based index subsets to map against, all if empty
+    int shard_index = 0;                              //this process maps the target subsets i with i % shard_count == shard_index
+    int shard_count = 1;                              //processes sharing the target subsets
+    std::string shard_mappings;                       //file for this shard's mappings before the final filtering
+    std::vector<std::string> merge_shards;            //shard mapping files to merge and filter instead of mapping
+    std::string mapping_cache;                        //file of the mappings of the pairs of earlier runs, taken up and replaced, empty for none
+    uint64_t index_prefetch_budget = 0;               //bytes the next subset's index may take while mapping, 0 to not overlap
+    uint64_t queue_memory = 0;                        //bytes of query sequence queued or mapping at once, 0 for no limit
+    uint64_t shared_sequence_bytes = 0;               //bytes of the sequences decoded kept packed for the alignment, 0 to keep none
     bool split;                                       //Split read mapping (done if this is true)
+    bool sketch_query_once = false;                   //sketch all fragments of a query in one hashing pass
+    std::string query_sketch_file;                    //file caching query fragment sketches across target subsets, empty to re-read the queries
+    std::string mapping_spill_prefix;                 //prefix of the per-subset mapping run files, empty to gather mappings in memory
+    std::string checkpoint_prefix;                    //keep the run files, indexed as queries are done, and mark the mapping done at this prefix
+    bool resume = false;                              //take up the runs of an interrupted job at checkpoint_prefix, skipping its done subsets and queries
+    bool serve_queries = false;                       //keep the index resident and map query files read from stdin
+    bool library_mode = false;                        //keep the index resident for the calls of the library API (interface/wfmash.hpp)
+    bool stream_queries = false;                      //read queries in file order without a FASTA index, writing each when mapped
+    bool dedup_queries = false;                       //map queries of the same sequence once, reporting its mappings under each name
+    int queryOrder = query_order::INPUT;              //order the queries are read in against each subset (see skch::query_order)
+    bool reuse_target_sketches = false;               //take the segment sketches of queries indexed as targets from their windows
+    bool stream_output = false;                       //write each query's mappings to the output as soon as they are final
+    bool deterministic = false;                       //write streamed queries in the order they are read, drawing their chain ids in it
+    std::shared_ptr<const RegionSet> query_regions;   //BED intervals of the queries to map, null to map them whole
+    std::shared_ptr<const RegionSet> target_regions;  //BED intervals of the targets to index, null to index them whole
     bool lower_triangular;                            // set to true if we should filter out half of the mappings
     bool skip_self;                                   //skip self mappings
     bool skip_prefix;                                 //skip mappings to sequences with the same prefix
@@ -79,15 +144,30 @@ struct Parameters
     ales_params spaced_seed_params;                   //
     double spaced_seed_sensitivity;                   //
     std::vector<ales::spaced_seed> spaced_seeds;      //
-    bool world_minimizers;
+    stdfs::path spaced_seed_cache;                    //file caching generated spaced seed sets
+    int syncmer_size = 0;                             //sketch only the closed syncmers of s-mers this long, 0 for all k-mers
+    bool world_minimizers = false;                    //sketch every k-mer hashing below a global threshold rather than bottom-s per window
+    uint64_t dust_threshold = 0;                      //pass over the DNA k-mers of a DUST score over this, in thousandths, 0 for none
     uint64_t sparsity_hash_threshold;                 // keep mappings that hash to <= this value
     double overlap_threshold;                         // minimum overlap for a mapping to be considered
+    std::vector<SweepSetting> sweep;                  // final filter settings to write the mappings under, mapped once at the most permissive; empty for none
 
     bool legacy_output;
     //std::unordered_set<std::string> high_freq_kmers;  //
     int64_t index_by_size = std::numeric_limits<int64_t>::max();  // Target total size of sequences for each index subset
+    bool index_by_auto = false;                       // Size the index subsets to fit max_memory, setting index_by_size
+    uint64_t max_memory = 0;                          // Bytes the run may take with index_by_auto, 0 for those of the machine or its cgroup
     int minimum_hits = -1;  // Minimum number of hits required for L1 filtering (-1 means auto)
     double max_kmer_freq = 0.0002;  // Maximum allowed k-mer frequency fraction (0-1) or count (>1)
+    bool auto_kmer_freq = false;  // Choose the count cutoff from the frequencies of each index built, setting max_kmer_freq
+    double kmer_hit_budget = 0;  // With auto_kmer_freq, L1 hits per fragment the cutoff may let through (0 = the knee)
+    bool approx_kmer_freq = false;  // Flag frequent k-mers with a count-min sketch instead of exact counts
+    bool pangenome_index = false;  // Count k-mer frequencies per prefix group, and delta-code a hash's copies across sequences
+    double query_seed_cap = 0;  // Skip query minmers hitting > this many reference windows per sketch element (0 = off)
+    offset_t guided_search_window = 0;  // Map a segment within this many bp of where the one before it mapped before searching the whole index (0 = off)
+    int adaptive_segment_factor = 0;  // Map up to this many segments as one where those before mapped uniquely and collinearly (0 = off)
+    int coarse_factor = 0;  // Map a segment within where the segment this many times longer holding it mapped before searching the whole index (0 = off)
+    std::vector<hash_t> frequent_hashes;  // Sorted hashes filtered by the index being updated, filtered again
 };
 
 
@@ -8,8 +8,11 @@
 
 #include <vector>
 #include <algorithm>
+#include <atomic>
 #include <deque>
 #include <cmath>
+#include <memory>
+#include <mutex>
 
 #ifdef USE_BOOST
     #include <boost/math/distributions/binomial.hpp>
@@ -256,6 +259,73 @@ namespace skch
 
       return optimalSketchSize;
     }
+
+    /**
+     * @brief   identity, and its upper bound, of an L2 mapping sharing i of s sketch
+     *          elements, for 0 <= i <= s <= maxSketchSize
+     * @details Both depend only on the two small integers, so they are kept instead of
+     *          computed from j2md and md_lower_bound for every mapping. A row is allocated
+     *          when its sketch size first comes up and its entries, negative until then,
+     *          are computed when first needed; concurrent callers may compute one twice,
+     *          to the same value.
+     */
+    class IdentityTable
+    {
+      public:
+
+        IdentityTable(int maxSketchSize, int k, float ci)
+          : k(k), ci(ci), rows(maxSketchSize + 1), owned(maxSketchSize + 1) {}
+
+        float identity(int shared, int s)
+        {
+          std::atomic<float>& entry = row(s)[2 * shared];
+          float value = entry.load(std::memory_order_relaxed);
+          if (value < 0) {
+            float mash_dist = j2md(1.0 * shared / s, k);
+            value = 1 - mash_dist;
+            entry.store(value, std::memory_order_relaxed);
+          }
+          return value;
+        }
+
+        float upperBound(int shared, int s)
+        {
+          std::atomic<float>& entry = row(s)[2 * shared + 1];
+          float value = entry.load(std::memory_order_relaxed);
+          if (value < 0) {
+            float mash_dist = j2md(1.0 * shared / s, k);
+            value = 1 - md_lower_bound(mash_dist, s, k, ci);
+            entry.store(value, std::memory_order_relaxed);
+          }
+          return value;
+        }
+
+      private:
+
+        std::atomic<float>* row(int s)
+        {
+          std::atomic<float>* r = rows[s].load(std::memory_order_acquire);
+          if (r == nullptr) {
+            std::lock_guard<std::mutex> lock(mutex);
+            r = rows[s].load(std::memory_order_relaxed);
+            if (r == nullptr) {
+              owned[s].reset(new std::atomic<float>[2 * (s + 1)]);
+              r = owned[s].get();
+              for (int i = 0; i < 2 * (s + 1); ++i) {
+                r[i].store(-1, std::memory_order_relaxed);
+              }
+              rows[s].store(r, std::memory_order_release);
+            }
+          }
+          return r;
+        }
+
+        const int k;
+        const float ci;
+        std::vector<std::atomic<std::atomic<float>*>> rows;
+        std::vector<std::unique_ptr<std::atomic<float>[]>> owned;
+        std::mutex mutex;
+    };
   }
 }
 
@@ -0,0 +1,110 @@
+/**
+ * @file    mappingCache.hpp
+ * @brief   Mappings of earlier runs kept by the content of their query and target sequences
+ */
+
+#ifndef MAPPING_CACHE_HPP
+#define MAPPING_CACHE_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "map/include/base_types.hpp"
+
+namespace skch
+{
+  /**
+   * @brief   Mappings of every query and target pair of a run, before the final filtering,
+   *          for a later run on some of the same sequences to take up
+   * @details The file lists the sequences of the run by the hash and length of their bases
+   *          and whether they were mapped as queries, indexed as targets or both, with their
+   *          group when the pairs within a group were skipped. Each mapping names its query
+   *          and target by their place in the list instead of by id, so it holds for any run
+   *          having those sequences, whatever their names or order. The mapping parameters
+   *          are kept as a hash; a cache of other parameters is not used. The file is
+   *          replaced whole, written beside it and renamed over it.
+   */
+  class MappingCache
+  {
+    public:
+
+      static constexpr uint64_t magic = 0x656863616368736dULL;  // "mshcache"
+      static constexpr uint64_t version = 1;
+
+      static constexpr uint64_t QUERY = 1;
+      static constexpr uint64_t TARGET = 2;
+
+      struct Sequence
+      {
+        uint64_t hash[2];
+        uint64_t length;
+        uint64_t roles;                                 //QUERY and TARGET bits of the run it was in
+        int64_t group;                                  //under skip_self/skip_prefix, its group in that run, else -1
+      };
+
+      uint64_t parameters = 0;                          //hash of the mapping parameters of the run
+      uint64_t chainIds = 0;                            //chain ids of the mappings are below this
+      std::vector<Sequence> sequences;
+      std::vector<MappingResult> mappings;              //querySeqId and refSeqId index sequences
+
+      /**
+       * @brief   read the cache of file, false if there is none
+       */
+      bool read(const std::string& file)
+      {
+        std::ifstream in(file, std::ios::binary);
+        if (!in) {
+          return false;
+        }
+        uint64_t header[6];
+        if (!in.read(reinterpret_cast<char*>(header), sizeof(header)) || header[0] != magic || header[1] != version) {
+          std::cerr << "[wfmash::mashmap] ERROR, " << file << " is not a mapping cache of this version" << std::endl;
+          exit(1);
+        }
+        parameters = header[2];
+        chainIds = header[3];
+        sequences.resize(header[4]);
+        mappings.resize(header[5]);
+        if (!in.read(reinterpret_cast<char*>(sequences.data()), sequences.size() * sizeof(Sequence))
+            || !in.read(reinterpret_cast<char*>(mappings.data()), mappings.size() * sizeof(MappingResult))) {
+          std::cerr << "[wfmash::mashmap] ERROR, truncated mapping cache " << file << std::endl;
+          exit(1);
+        }
+        for (const auto& m : mappings) {
+          if (uint64_t(m.querySeqId) >= sequences.size() || uint64_t(m.refSeqId) >= sequences.size()) {
+            std::cerr << "[wfmash::mashmap] ERROR, corrupt mapping cache " << file << std::endl;
+            exit(1);
+          }
+        }
+        return true;
+      }
+
+      /**
+       * @brief   replace file with this cache
+       */
+      void write(const std::string& file) const
+      {
+        const std::string partial = file + ".tmp";
+        std::ofstream out(partial, std::ios::binary | std::ios::trunc);
+        const uint64_t header[] = {magic, version, parameters, chainIds,
+                                   uint64_t(sequences.size()), uint64_t(mappings.size())};
+        out.write(reinterpret_cast<const char*>(header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(sequences.data()), sequences.size() * sizeof(Sequence));
+        out.write(reinterpret_cast<const char*>(mappings.data()), mappings.size() * sizeof(MappingResult));
+        out.close();
+        std::error_code ec;
+        if (!out || (std::filesystem::rename(partial, file, ec), ec)) {
+          std::cerr << "[wfmash::mashmap] ERROR, unable to write the mapping cache " << file << std::endl;
+          std::remove(partial.c_str());
+          exit(1);
+        }
+      }
+  };
+}
+
+#endif
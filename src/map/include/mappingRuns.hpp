@@ -0,0 +1,302 @@
+/**
+ * @file    mappingRuns.hpp
+ * @brief   Per-subset mapping run files, merged back query by query
+ */
+
+#ifndef MAPPING_RUNS_HPP
+#define MAPPING_RUNS_HPP
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <queue>
+#include <string>
+#include <tuple>
+#include <unordered_set>
+#include <vector>
+
+#include "map/include/base_types.hpp"
+
+namespace skch
+{
+  /**
+   * @brief   Mappings of every target subset kept on disk instead of in memory
+   * @details Each subset writes one run file, appending a query's mappings as soon as they
+   *          are merged, and indexes the record by query id. After the last subset the run
+   *          indices, sorted by query id, are merged k-way, so the mappings of one query are
+   *          gathered from all runs while no other query's are held.
+   *          Persistent runs, those of a checkpointed job, also append each query's record
+   *          to an index file once its mappings are written, queries without any included,
+   *          and end it with a record marking the run complete. They are left on disk for a
+   *          resumed job to adopt the complete runs and the done queries of a partial one.
+   */
+  class MappingRuns
+  {
+    public:
+
+      explicit MappingRuns(const std::string& prefix, bool persistent = false) : prefix(prefix), persistent(persistent) {}
+
+      ~MappingRuns()
+      {
+        if (!persistent) {
+          discard();
+        }
+      }
+
+      /**
+       * @brief   remove the run files
+       */
+      void discard()
+      {
+        for (auto& run : runs) {
+          std::remove(run.fileName.c_str());
+          if (persistent) {
+            std::remove(indexFileName(run.fileName).c_str());
+          }
+        }
+      }
+
+      /**
+       * @brief   start the run file of a subset, taking up what resumeRun found of it
+       */
+      void beginRun(uint64_t subset)
+      {
+        runs.emplace_back();
+        Run& run = runs.back();
+        run.subset = subset;
+        run.fileName = runFileName(subset);
+        written = 0;
+        auto mode = std::ios::binary | std::ios::trunc;
+        if (resumed && resumed->fileName == run.fileName) {
+          run.index = std::move(resumed->index);
+          written = resumedBytes;
+          for (const Record& record : run.index) {
+            mappingCount += record.count;
+          }
+          std::error_code ec;
+          std::filesystem::resize_file(run.fileName, written, ec);
+          mode = std::ios::binary | std::ios::app;
+        }
+        resumed.reset();
+        out.open(run.fileName, mode);
+        if (persistent) {
+          // Rewritten from the records kept, less any cut short or past the data
+          indexOut.open(indexFileName(run.fileName), std::ios::binary | std::ios::trunc);
+          for (const Record& record : run.index) {
+            indexOut.write(reinterpret_cast<const char*>(&record), sizeof(record));
+          }
+        }
+        if (!out || (persistent && !indexOut)) {
+          std::cerr << "[wfmash::mashmap] ERROR, unable to write mapping run file " << run.fileName << std::endl;
+          exit(1);
+        }
+      }
+
+      /**
+       * @brief   append one query's mappings to the current run
+       */
+      void add(seqno_t querySeqId, const MappingResultsVector_t& mappings)
+      {
+        if (mappings.empty() && !persistent) {
+          return;
+        }
+        out.write(reinterpret_cast<const char*>(mappings.data()), mappings.size() * sizeof(MappingResult));
+        const Record record = {querySeqId, written, mappings.size()};
+        runs.back().index.push_back(record);
+        written += mappings.size() * sizeof(MappingResult);
+        mappingCount += mappings.size();
+        if (persistent) {
+          // Indexed once its mappings are out, so a query indexed is a query done
+          out.flush();
+          indexOut.write(reinterpret_cast<const char*>(&record), sizeof(record));
+          indexOut.flush();
+        }
+      }
+
+      void endRun()
+      {
+        out.close();
+        if (persistent) {
+          const Record end = {0, written, runComplete};
+          indexOut.write(reinterpret_cast<const char*>(&end), sizeof(end));
+          indexOut.close();
+        }
+        if (!out || (persistent && !indexOut)) {
+          std::cerr << "[wfmash::mashmap] ERROR, unable to write mapping run file " << runs.back().fileName << std::endl;
+          exit(1);
+        }
+        sortIndex(runs.back().index);
+      }
+
+      /**
+       * @brief   true if a persistent run of the subset was completed, then adopted as is
+       */
+      bool adoptRun(uint64_t subset)
+      {
+        Run run;
+        run.subset = subset;
+        run.fileName = runFileName(subset);
+        if (!readIndex(run) || !run.complete) {
+          return false;
+        }
+        for (const Record& record : run.index) {
+          mappingCount += record.count;
+        }
+        sortIndex(run.index);
+        runs.push_back(std::move(run));
+        return true;
+      }
+
+      /**
+       * @brief   add the queries done in the partial persistent run of the subset to done,
+       *          for beginRun to append the others to it
+       */
+      void resumeRun(uint64_t subset, std::unordered_set<seqno_t>& done)
+      {
+        resumed.reset(new Run());
+        resumed->fileName = runFileName(subset);
+        readIndex(*resumed);
+        resumedBytes = 0;
+        for (const Record& record : resumed->index) {
+          resumedBytes = std::max(resumedBytes, record.offset + record.count * sizeof(MappingResult));
+          done.insert(record.querySeqId);
+        }
+      }
+
+      uint64_t mappings() const
+      {
+        return mappingCount;
+      }
+
+      /**
+       * @brief   call fn(querySeqId, mappings) for each query with mappings, in id order,
+       *          with its mappings of all runs in subset order
+       */
+      template <typename Fn>
+      void mergeByQuery(Fn&& fn)
+      {
+        // Adopted runs are read in turn with the new ones, by subset
+        std::stable_sort(runs.begin(), runs.end(), [](const Run& a, const Run& b) { return a.subset < b.subset; });
+        std::vector<std::unique_ptr<std::ifstream>> in;
+        for (auto& run : runs) {
+          in.emplace_back(new std::ifstream(run.fileName, std::ios::binary));
+          if (!*in.back()) {
+            std::cerr << "[wfmash::mashmap] ERROR, unable to read mapping run file " << run.fileName << std::endl;
+            exit(1);
+          }
+        }
+
+        // (query id, run, position in its index), smallest first
+        typedef std::tuple<seqno_t, size_t, size_t> Head;
+        std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+        for (size_t r = 0; r < runs.size(); ++r) {
+          if (!runs[r].index.empty()) {
+            heads.emplace(runs[r].index[0].querySeqId, r, 0);
+          }
+        }
+
+        while (!heads.empty()) {
+          const seqno_t querySeqId = std::get<0>(heads.top());
+          MappingResultsVector_t mappings;
+          while (!heads.empty() && std::get<0>(heads.top()) == querySeqId) {
+            auto [id, r, i] = heads.top();
+            heads.pop();
+            const Record& record = runs[r].index[i];
+            const size_t begin = mappings.size();
+            mappings.resize(begin + record.count);
+            in[r]->seekg(record.offset);
+            in[r]->read(reinterpret_cast<char*>(mappings.data() + begin), record.count * sizeof(MappingResult));
+            if (!*in[r]) {
+              std::cerr << "[wfmash::mashmap] ERROR, truncated mapping run file " << runs[r].fileName << std::endl;
+              exit(1);
+            }
+            if (i + 1 < runs[r].index.size()) {
+              heads.emplace(runs[r].index[i + 1].querySeqId, r, i + 1);
+            }
+          }
+          if (!mappings.empty()) {
+            fn(querySeqId, std::move(mappings));
+          }
+        }
+      }
+
+    private:
+
+      struct Record
+      {
+        seqno_t querySeqId;
+        uint64_t offset;
+        uint64_t count;
+      };
+
+      // Count of the record ending a complete persistent run, whose offset is the run's size
+      static constexpr uint64_t runComplete = std::numeric_limits<uint64_t>::max();
+
+      struct Run
+      {
+        uint64_t subset = 0;
+        std::string fileName;
+        std::vector<Record> index;
+        bool complete = false;
+      };
+
+      std::string runFileName(uint64_t subset) const
+      {
+        return prefix + "." + std::to_string(subset);
+      }
+
+      static std::string indexFileName(const std::string& runFileName)
+      {
+        return runFileName + ".idx";
+      }
+
+      static void sortIndex(std::vector<Record>& index)
+      {
+        std::sort(index.begin(), index.end(), [](const Record& a, const Record& b) {
+            return std::tie(a.querySeqId, a.offset) < std::tie(b.querySeqId, b.offset);
+        });
+      }
+
+      /**
+       * @brief   read the index file of a persistent run, false if there is none; the
+       *          records whose mappings did not all reach the run file are dropped
+       */
+      static bool readIndex(Run& run)
+      {
+        std::ifstream in(indexFileName(run.fileName), std::ios::binary);
+        if (!in) {
+          return false;
+        }
+        std::error_code ec;
+        const uint64_t size = std::filesystem::file_size(run.fileName, ec);
+        Record record;
+        while (in.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+          if (record.count == runComplete) {
+            run.complete = !ec && record.offset == size;
+            break;
+          }
+          if (ec || record.offset + record.count * sizeof(MappingResult) > size) {
+            break;
+          }
+          run.index.push_back(record);
+        }
+        return true;
+      }
+
+      std::string prefix;
+      bool persistent;
+      std::vector<Run> runs;
+      std::unique_ptr<Run> resumed;     // partial run taken up by the next beginRun
+      uint64_t resumedBytes = 0;
+      std::ofstream out;
+      std::ofstream indexOut;
+      uint64_t written = 0;
+      uint64_t mappingCount = 0;
+  };
+}
+
+#endif
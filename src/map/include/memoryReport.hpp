@@ -0,0 +1,215 @@
+/**
+ * @file    memoryReport.hpp
+ * @brief   Bytes held by the index and pipeline structures, logged at each phase
+ *          boundary and reported once the run is done
+ * @details Off unless enable() is called before the structures are built. The sizes are
+ *          estimates from the capacities of the containers, kept per pool as a current and a
+ *          peak count that their owners raise and lower as they grow and free them.
+ */
+
+#ifndef MEMORY_REPORT_HPP
+#define MEMORY_REPORT_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <unistd.h>
+
+namespace skch
+{
+  namespace memory
+  {
+    enum Pool : int { MINMER_INDEX, SEED_TABLE, FREQUENT_HASHES, INDEX_FILE, INDEX_BUILD, MAPPINGS,
+                      PACKED_SEQUENCES, ALIGN_RECORDS, MAPPING_SCRATCH, POOL_COUNT };
+
+    static constexpr const char* poolNames[POOL_COUNT] = {
+      "minmer_index", "seed_table", "frequent_hashes", "index_file", "index_build", "mappings",
+      "packed_sequences", "align_records", "mapping_scratch"};
+
+    struct Gauge
+    {
+      std::atomic<int64_t> bytes{0};
+      std::atomic<int64_t> peak{0};
+    };
+
+    // Sizes of the pools and of the process at a phase boundary
+    struct Phase
+    {
+      std::string name;
+      uint64_t rss;
+      uint64_t peakRss;
+      int64_t bytes[POOL_COUNT];
+    };
+
+    struct Registry
+    {
+      bool enabled = false;
+      Gauge pools[POOL_COUNT];
+      std::mutex mutex;
+      std::vector<Phase> phases;
+    };
+
+    inline Registry& registry()
+    {
+      static Registry r;
+      return r;
+    }
+
+    inline bool enabled()
+    {
+      return registry().enabled;
+    }
+
+    /**
+     * @brief   start accounting; called before any index is built or loaded
+     */
+    inline void enable()
+    {
+      registry().enabled = true;
+    }
+
+    inline void add(Pool pool, int64_t delta)
+    {
+      if (!enabled() || delta == 0) {
+        return;
+      }
+      Gauge& gauge = registry().pools[pool];
+      const int64_t now = gauge.bytes.fetch_add(delta) + delta;
+      int64_t peak = gauge.peak.load();
+      while (now > peak && !gauge.peak.compare_exchange_weak(peak, now)) {
+      }
+    }
+
+    /**
+     * @brief   bytes an owner holds in the pools, given back when it is destroyed
+     */
+    class Account
+    {
+      public:
+
+        Account() = default;
+        Account(const Account&) = delete;
+        Account& operator=(const Account&) = delete;
+
+        ~Account()
+        {
+          for (int pool = 0; pool < POOL_COUNT; ++pool) {
+            add(Pool(pool), -held[pool]);
+          }
+        }
+
+        void set(Pool pool, uint64_t bytes)
+        {
+          if (!enabled()) {
+            return;
+          }
+          add(pool, int64_t(bytes) - held[pool]);
+          held[pool] = bytes;
+        }
+
+      private:
+
+        int64_t held[POOL_COUNT] = {};
+    };
+
+    // Resident and peak resident bytes of the process
+    inline uint64_t residentBytes()
+    {
+      long pages = 0, resident = 0;
+      std::ifstream statm("/proc/self/statm");
+      return statm >> pages >> resident ? uint64_t(resident) * sysconf(_SC_PAGESIZE) : 0;
+    }
+
+    inline uint64_t peakResidentBytes()
+    {
+      struct rusage usage;
+      return getrusage(RUSAGE_SELF, &usage) == 0 ? uint64_t(usage.ru_maxrss) * 1024 : 0;
+    }
+
+    /**
+     * @brief   bytes the process may take: the least of the physical memory and the limits
+     *          of its cgroup, under cgroup v2 or v1 mounted at /sys/fs/cgroup
+     */
+    inline uint64_t availableBytes()
+    {
+      uint64_t bytes = uint64_t(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGESIZE);
+      for (const char* limitFile : {"/sys/fs/cgroup/memory.max", "/sys/fs/cgroup/memory/memory.limit_in_bytes"}) {
+        std::ifstream limit(limitFile);
+        uint64_t value = 0;
+        // "max" under v2, and a huge value under v1, when there is no limit
+        if (limit >> value && value > 0) {
+          bytes = std::min(bytes, value);
+        }
+      }
+      return bytes;
+    }
+
+    inline std::string humanBytes(double bytes)
+    {
+      static const char* units[] = {"B", "K", "M", "G", "T"};
+      int unit = 0;
+      while (bytes >= 1024 && unit < 4) {
+        bytes /= 1024;
+        ++unit;
+      }
+      char text[32];
+      snprintf(text, sizeof(text), unit == 0 ? "%.0f%s" : "%.1f%s", bytes, units[unit]);
+      return text;
+    }
+
+    /**
+     * @brief   record the pools at the end of phase name and log the ones in use
+     */
+    inline void phase(const std::string& name)
+    {
+      if (!enabled()) {
+        return;
+      }
+      Registry& r = registry();
+      Phase p{name, residentBytes(), peakResidentBytes(), {}};
+      std::string line = "[wfmash::memory] " + name + ": rss " + humanBytes(p.rss) + ", peak rss " + humanBytes(p.peakRss);
+      for (int pool = 0; pool < POOL_COUNT; ++pool) {
+        p.bytes[pool] = r.pools[pool].bytes.load();
+        if (p.bytes[pool] > 0) {
+          line += std::string(", ") + poolNames[pool] + " " + humanBytes(p.bytes[pool]);
+        }
+      }
+      std::lock_guard<std::mutex> lock(r.mutex);
+      r.phases.push_back(p);
+      std::cerr << line << std::endl;
+    }
+
+    /**
+     * @brief   write the phases as TSV, one row per phase and pool, then the peak of each pool
+     * @return  false if the file could not be written
+     */
+    inline bool writeReport(const std::string& filename)
+    {
+      Registry& r = registry();
+      std::ofstream out(filename);
+      out << "#phase\tname\tbytes\n";
+      for (const auto& p : r.phases) {
+        out << p.name << "\trss\t" << p.rss << "\n";
+        out << p.name << "\tpeak_rss\t" << p.peakRss << "\n";
+        for (int pool = 0; pool < POOL_COUNT; ++pool) {
+          out << p.name << "\t" << poolNames[pool] << "\t" << p.bytes[pool] << "\n";
+        }
+      }
+      out << "peak\tpeak_rss\t" << peakResidentBytes() << "\n";
+      for (int pool = 0; pool < POOL_COUNT; ++pool) {
+        out << "peak\t" << poolNames[pool] << "\t" << r.pools[pool].peak.load() << "\n";
+      }
+      out.close();
+      return bool(out);
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,147 @@
+/**
+ * @file    numa.hpp
+ * @brief   NUMA node discovery, memory interleaving and thread pinning on Linux
+ */
+
+#ifndef SKCH_NUMA_HPP
+#define SKCH_NUMA_HPP
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace skch
+{
+  namespace numa
+  {
+    /**
+     * @brief   parse a kernel cpu or node list such as "0-15,32-47"
+     */
+    inline std::vector<int> parseList(const std::string& list)
+    {
+      std::vector<int> ids;
+      std::stringstream ss(list);
+      std::string range;
+      while (std::getline(ss, range, ',')) {
+        if (range.empty() || range == "\n") {
+          continue;
+        }
+        const size_t dash = range.find('-');
+        const int first = std::stoi(range.substr(0, dash));
+        const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int id = first; id <= last; ++id) {
+          ids.push_back(id);
+        }
+      }
+      return ids;
+    }
+
+    /**
+     * @brief   ids of the online nodes, each with its cpus, from sysfs
+     * @return  empty where this is unknown, which callers treat as a single node
+     */
+    inline const std::vector<std::pair<int, std::vector<int>>>& nodes()
+    {
+      static const std::vector<std::pair<int, std::vector<int>>> online = []() {
+        std::vector<std::pair<int, std::vector<int>>> found;
+        std::ifstream onlineFile("/sys/devices/system/node/online");
+        std::string list;
+        if (onlineFile && std::getline(onlineFile, list)) {
+          for (int node : parseList(list)) {
+            std::ifstream cpuFile("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            std::string cpus;
+            if (cpuFile && std::getline(cpuFile, cpus) && !parseList(cpus).empty()) {
+              found.emplace_back(node, parseList(cpus));
+            }
+          }
+        }
+        return found;
+      }();
+      return online;
+    }
+
+    inline int nodeCount()
+    {
+      return std::max<int>(1, nodes().size());
+    }
+
+    /**
+     * @brief   interleave the pages the calling thread, and threads it starts, first touch
+     *          over all nodes while in scope; read-mostly data shared by every worker,
+     *          like the index, then gets the bandwidth of all nodes instead of one
+     */
+    class InterleaveScope
+    {
+      public:
+
+        InterleaveScope()
+        {
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+          if (nodes().size() < 2) {
+            return;
+          }
+          const int bits = 8 * sizeof(unsigned long);
+          std::vector<unsigned long> mask;
+          for (const auto& node : nodes()) {
+            if (mask.size() <= size_t(node.first / bits)) {
+              mask.resize(node.first / bits + 1, 0);
+            }
+            mask[node.first / bits] |= 1UL << (node.first % bits);
+          }
+          // The kernel reads one bit less than maxnode
+          active = syscall(SYS_set_mempolicy, mpolInterleave, mask.data(), mask.size() * bits + 1) == 0;
+#endif
+        }
+
+        ~InterleaveScope()
+        {
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+          if (active) {
+            syscall(SYS_set_mempolicy, mpolDefault, nullptr, 0);
+          }
+#endif
+        }
+
+        InterleaveScope(const InterleaveScope&) = delete;
+        InterleaveScope& operator=(const InterleaveScope&) = delete;
+
+      private:
+
+        static constexpr int mpolDefault = 0;
+        static constexpr int mpolInterleave = 3;
+        bool active = false;
+    };
+
+    /**
+     * @brief   restrict a thread to the cpus of the given position in nodes()
+     */
+    inline void pinToNode(std::thread& thread, int node)
+    {
+#ifdef __linux__
+      if (nodes().size() < 2) {
+        return;
+      }
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      for (int cpu : nodes()[node % nodes().size()].second) {
+        if (cpu < CPU_SETSIZE) {
+          CPU_SET(cpu, &cpus);
+        }
+      }
+      pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus);
+#endif
+    }
+  }
+}
+
+#endif
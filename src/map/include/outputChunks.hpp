@@ -0,0 +1,121 @@
+/**
+ * @file    outputChunks.hpp
+ * @brief   Pooled output chunks the mappings are formatted into, written out whole
+ */
+
+#ifndef OUTPUT_CHUNKS_HPP
+#define OUTPUT_CHUNKS_HPP
+
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+namespace skch
+{
+  /**
+   * @brief   Free list of output chunks, recycled between the formatting threads and the
+   *          writer so the buffers are allocated once per run rather than once per query
+   */
+  class OutputChunkPool
+  {
+    public:
+
+      explicit OutputChunkPool(size_t chunkSize) : chunkSize(chunkSize) {}
+
+      ~OutputChunkPool()
+      {
+        for (std::string* chunk : chunks) {
+          delete chunk;
+        }
+      }
+
+      /**
+       * @return  an empty chunk with room for chunkSize bytes
+       */
+      std::string* get()
+      {
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          if (!chunks.empty()) {
+            std::string* chunk = chunks.back();
+            chunks.pop_back();
+            return chunk;
+          }
+        }
+        std::string* chunk = new std::string;
+        chunk->reserve(chunkSize + chunkSize / 4);
+        return chunk;
+      }
+
+      void put(std::string* chunk)
+      {
+        chunk->clear();
+        std::lock_guard<std::mutex> lock(mutex);
+        chunks.push_back(chunk);
+      }
+
+      bool full(const std::string& chunk) const
+      {
+        return chunk.size() >= chunkSize;
+      }
+
+    private:
+
+      const size_t chunkSize;
+      std::mutex mutex;
+      std::vector<std::string*> chunks;
+  };
+
+  /**
+   * @brief   Output stream appending to a chunk, so the mappings are formatted in place
+   *          without a stringstream copy per query
+   */
+  class ChunkStream : public std::ostream
+  {
+    public:
+
+      explicit ChunkStream(std::string* chunk = nullptr) : std::ostream(nullptr), buf(chunk)
+      {
+        rdbuf(&buf);
+      }
+
+      void reset(std::string* chunk)
+      {
+        buf.chunk = chunk;
+      }
+
+      std::string* chunk() const
+      {
+        return buf.chunk;
+      }
+
+    private:
+
+      struct AppendBuf : public std::streambuf
+      {
+        explicit AppendBuf(std::string* chunk) : chunk(chunk) {}
+
+        int_type overflow(int_type c) override
+        {
+          if (c != traits_type::eof()) {
+            chunk->push_back(traits_type::to_char_type(c));
+          }
+          return traits_type::not_eof(c);
+        }
+
+        std::streamsize xsputn(const char* s, std::streamsize n) override
+        {
+          chunk->append(s, n);
+          return n;
+        }
+
+        std::string* chunk;
+      };
+
+      AppendBuf buf;
+  };
+}
+
+#endif
@@ -0,0 +1,101 @@
+/**
+ * @file    pageWarmup.hpp
+ * @brief   Pre-faulting and locking of the pages of memory regions, such as a loaded index
+ */
+
+#ifndef SKCH_PAGE_WARMUP_HPP
+#define SKCH_PAGE_WARMUP_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace skch
+{
+  namespace pages
+  {
+    typedef std::vector<std::pair<const void*, size_t>> Regions;
+
+    /**
+     * @brief   fault in every page of the regions, split between threads
+     * @details a mapped index is otherwise faulted in page by page by the first queries,
+     *          whose faults serialize in the kernel while the workers wait on them. The
+     *          kernel is told to read the pages ahead first, then each thread reads one byte
+     *          of each page of its share.
+     */
+    inline void prefault(const Regions& regions, int threads)
+    {
+      const size_t page = sysconf(_SC_PAGESIZE);
+      std::vector<std::pair<const volatile char*, size_t>> spans;   // first byte and pages
+      size_t totalPages = 0;
+      for (const auto& region : regions) {
+        if (region.first == nullptr || region.second == 0) {
+          continue;
+        }
+        const uintptr_t begin = reinterpret_cast<uintptr_t>(region.first) / page * page;
+        const uintptr_t end = reinterpret_cast<uintptr_t>(region.first) + region.second;
+        madvise(reinterpret_cast<void*>(begin), end - begin, MADV_WILLNEED);
+        spans.emplace_back(reinterpret_cast<const volatile char*>(begin), (end - begin + page - 1) / page);
+        totalPages += spans.back().second;
+      }
+      if (totalPages == 0) {
+        return;
+      }
+
+      // Thread t touches pages [t * share, (t + 1) * share) of the regions in turn
+      threads = std::max(1, std::min<int>(threads, totalPages));
+      const size_t share = (totalPages + threads - 1) / threads;
+      auto touch = [&](size_t first, size_t last) {
+        char sink = 0;
+        size_t skipped = 0;
+        for (const auto& span : spans) {
+          const size_t from = std::max(first, skipped);
+          const size_t to = std::min(last, skipped + span.second);
+          for (size_t p = from; p < to; ++p) {
+            sink ^= span.first[(p - skipped) * page];
+          }
+          skipped += span.second;
+        }
+        (void)sink;
+      };
+      std::vector<std::thread> touching;
+      for (int t = 1; t < threads; ++t) {
+        touching.emplace_back(touch, t * share, std::min(totalPages, (t + 1) * share));
+      }
+      touch(0, std::min(totalPages, share));
+      for (auto& thread : touching) {
+        thread.join();
+      }
+    }
+
+    /**
+     * @brief   lock the pages of the regions in memory, faulting them in
+     * @return  the regions locked, short of those the limit on locked memory refused
+     */
+    inline Regions lock(const Regions& regions)
+    {
+      Regions locked;
+      for (const auto& region : regions) {
+        if (region.first != nullptr && region.second > 0 && mlock(region.first, region.second) == 0) {
+          locked.push_back(region);
+        }
+      }
+      return locked;
+    }
+
+    inline void unlock(const Regions& regions)
+    {
+      for (const auto& region : regions) {
+        munlock(region.first, region.second);
+      }
+    }
+  }
+}
+
+#endif
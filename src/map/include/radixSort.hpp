@@ -0,0 +1,209 @@
+/**
+ * @file    radixSort.hpp
+ * @brief   LSD radix sort of vectors by tuples of integer (or floating point) fields
+ */
+
+#ifndef RADIX_SORT_HPP
+#define RADIX_SORT_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "common/sampling_profiler.hpp"
+
+namespace skch
+{
+  namespace radix
+  {
+    //Below this many elements a comparison sort is faster
+    static constexpr size_t radixSortMinSize = 256;
+
+    //Elements above which a pass is split over the threads given
+    static constexpr size_t parallelRadixMinSize = 1 << 20;
+
+    /**
+     * @brief   unsigned image of a key field with the same order
+     */
+    template <typename T>
+    inline typename std::enable_if<std::is_integral<T>::value, uint64_t>::type orderedBits(T x)
+    {
+      typedef typename std::make_unsigned<T>::type U;
+      if (std::is_signed<T>::value)
+        return uint64_t(U(x) ^ (U(1) << (8 * sizeof(T) - 1)));
+      return uint64_t(x);
+    }
+
+    template <typename T>
+    inline typename std::enable_if<std::is_enum<T>::value, uint64_t>::type orderedBits(T x)
+    {
+      return orderedBits(typename std::underlying_type<T>::type(x));
+    }
+
+    //Negative doubles have their bits reversed, the others their sign set; -0 is 0
+    inline uint64_t orderedBits(double x)
+    {
+      if (x == 0)
+        x = 0;
+      uint64_t bits;
+      std::memcpy(&bits, &x, sizeof(bits));
+      return bits >> 63 ? ~bits : bits | (uint64_t(1) << 63);
+    }
+
+    template <size_t W>
+    struct Record
+    {
+      std::array<uint64_t, W> words;    //key fields, most significant first
+      size_t index;
+    };
+
+    template <typename Tuple, size_t... I>
+    inline std::array<uint64_t, sizeof...(I)> keyWords(const Tuple& key, std::index_sequence<I...>)
+    {
+      return {{orderedBits(std::get<I>(key))...}};
+    }
+
+    /**
+     * @brief   one stable counting pass on byte `shift` of word `w`, split over `threads`
+     *          contiguous chunks, each with its own histogram, when there are many records
+     */
+    template <size_t W>
+    inline void countingPass(std::vector<Record<W>>& records, std::vector<Record<W>>& buffer,
+        size_t w, int shift, int threads)
+    {
+      const size_t n = records.size();
+      const size_t chunks = n >= parallelRadixMinSize ? std::max(1, threads) : 1;
+      const size_t chunkSize = (n + chunks - 1) / chunks;
+      std::vector<std::array<size_t, 256>> offsets(chunks);
+
+      auto forChunks = [&](auto fn) {
+        if (chunks == 1) {
+          fn(0);
+          return;
+        }
+        std::vector<std::thread> workers;
+        const int stage = sampling_profiler::thread_stage();
+        for (size_t c = 0; c < chunks; ++c)
+          workers.emplace_back([&fn, c, stage]() {
+            sampling_profiler::name_thread("sort", stage, c);
+            fn(c);
+          });
+        for (auto& worker : workers)
+          worker.join();
+      };
+
+      forChunks([&](size_t c) {
+        offsets[c].fill(0);
+        for (size_t i = c * chunkSize; i < std::min(n, (c + 1) * chunkSize); ++i)
+          offsets[c][(records[i].words[w] >> shift) & 0xff]++;
+      });
+
+      // Bucket by bucket, each chunk's part of it follows the chunks before
+      size_t total = 0;
+      for (size_t digit = 0; digit < 256; ++digit) {
+        for (size_t c = 0; c < chunks; ++c) {
+          const size_t count = offsets[c][digit];
+          offsets[c][digit] = total;
+          total += count;
+        }
+      }
+
+      forChunks([&](size_t c) {
+        auto& offset = offsets[c];
+        for (size_t i = c * chunkSize; i < std::min(n, (c + 1) * chunkSize); ++i)
+          buffer[offset[(records[i].words[w] >> shift) & 0xff]++] = records[i];
+      });
+      records.swap(buffer);
+    }
+
+    /**
+     * @brief   stable LSD radix sort of records by their words, skipping the bytes on which
+     *          every record agrees
+     */
+    template <size_t W>
+    inline void sortRecords(std::vector<Record<W>>& records, int threads = 1)
+    {
+      std::array<uint64_t, W> anyBits, allBits;
+      anyBits.fill(0);
+      allBits.fill(~uint64_t(0));
+      for (const auto& r : records) {
+        for (size_t w = 0; w < W; ++w) {
+          anyBits[w] |= r.words[w];
+          allBits[w] &= r.words[w];
+        }
+      }
+
+      std::vector<Record<W>> buffer(records.size());
+      for (size_t w = W; w-- > 0;) {
+        for (int shift = 0; shift < 64; shift += 8) {
+          if ((((anyBits[w] ^ allBits[w]) >> shift) & 0xff) != 0)
+            countingPass(records, buffer, w, shift, threads);
+        }
+      }
+    }
+
+    /**
+     * @brief   sort v ascending by key(e), a tuple of integer or floating point fields
+     * @details The (key, index) records are radix sorted and the elements moved once,
+     *          which is stable. Small vectors are comparison sorted by the same keys, where
+     *          elements with equal keys end up in unspecified order, as with std::sort.
+     */
+    template <typename T, typename KeyFn>
+    inline void sortByKey(std::vector<T>& v, KeyFn key, int threads = 1)
+    {
+      typedef typename std::decay<decltype(key(v.front()))>::type Key;
+      constexpr size_t W = std::tuple_size<Key>::value;
+      const size_t n = v.size();
+      if (n < 2)
+        return;
+
+      std::vector<size_t> order(n);
+      if (n < radixSortMinSize) {
+        std::vector<std::pair<Key, size_t>> keys;
+        keys.reserve(n);
+        for (size_t i = 0; i < n; ++i)
+          keys.emplace_back(key(v[i]), i);
+        std::sort(keys.begin(), keys.end(), [](const std::pair<Key, size_t>& a, const std::pair<Key, size_t>& b) {
+          return a.first < b.first;
+        });
+        for (size_t i = 0; i < n; ++i)
+          order[i] = keys[i].second;
+      } else {
+        std::vector<Record<W>> records(n);
+        for (size_t i = 0; i < n; ++i)
+          records[i] = {keyWords(key(v[i]), std::make_index_sequence<W>()), i};
+        sortRecords(records, threads);
+        for (size_t i = 0; i < n; ++i)
+          order[i] = records[i].index;
+      }
+
+      std::vector<T> sorted;
+      sorted.reserve(n);
+      for (size_t i : order)
+        sorted.push_back(std::move(v[i]));
+      v.swap(sorted);
+    }
+
+    /**
+     * @brief   sort a vector of tuples of integer or floating point fields ascending
+     */
+    template <typename Tuple>
+    inline void sortTuples(std::vector<Tuple>& v, int threads = 1)
+    {
+      if (v.size() < radixSortMinSize) {
+        std::sort(v.begin(), v.end());
+        return;
+      }
+      sortByKey(v, [](const Tuple& t) -> const Tuple& { return t; }, threads);
+    }
+  }
+}
+
+#endif
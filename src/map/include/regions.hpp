@@ -0,0 +1,105 @@
+/**
+ * @file    regions.hpp
+ * @brief   BED intervals of the sequences a mapping is restricted to
+ */
+
+#ifndef REGIONS_HPP
+#define REGIONS_HPP
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "map/include/base_types.hpp"
+
+namespace skch
+{
+  /**
+   * @brief   Intervals of a BED file, per sequence sorted by start and with the
+   *          overlapping and adjacent ones joined
+   */
+  class RegionSet
+  {
+    public:
+
+      typedef std::vector<std::pair<offset_t, offset_t>> intervals_t;   // [start, end)
+
+      /**
+       * @brief   read the intervals of a BED file; lines starting with '#', "track" or
+       *          "browser" are skipped
+       */
+      explicit RegionSet(const std::string& bedFile)
+      {
+        std::ifstream in(bedFile);
+        if (!in) {
+          std::cerr << "[wfmash::mashmap] ERROR, unable to open BED file " << bedFile << std::endl;
+          exit(1);
+        }
+        std::string line;
+        uint64_t lineNumber = 0;
+        while (std::getline(in, line)) {
+          ++lineNumber;
+          if (line.empty() || line[0] == '#' || line.compare(0, 5, "track") == 0 || line.compare(0, 7, "browser") == 0) {
+            continue;
+          }
+          std::istringstream fields(line);
+          std::string name;
+          int64_t start = -1, end = -1;
+          if (!(fields >> name >> start >> end) || start < 0 || end < start) {
+            std::cerr << "[wfmash::mashmap] ERROR, malformed interval on line " << lineNumber << " of " << bedFile << std::endl;
+            exit(1);
+          }
+          if (end > start) {
+            bySequence[name].emplace_back(start, end);
+          }
+        }
+        for (auto& [name, intervals] : bySequence) {
+          std::sort(intervals.begin(), intervals.end());
+          size_t kept = 0;
+          for (const auto& interval : intervals) {
+            if (kept > 0 && interval.first <= intervals[kept - 1].second) {
+              intervals[kept - 1].second = std::max(intervals[kept - 1].second, interval.second);
+            } else {
+              intervals[kept++] = interval;
+            }
+          }
+          intervals.resize(kept);
+        }
+      }
+
+      /**
+       * @return  the intervals of sequence name, or null if the BED has none
+       */
+      const intervals_t* of(const std::string& name) const
+      {
+        auto it = bySequence.find(name);
+        return it == bySequence.end() ? nullptr : &it->second;
+      }
+
+      /**
+       * @brief   call visit(start, end) for each interval of sequence name within its length
+       */
+      template <typename Visit>
+      void forEach(const std::string& name, offset_t length, Visit&& visit) const
+      {
+        if (const intervals_t* intervals = of(name)) {
+          for (const auto& [start, end] : *intervals) {
+            if (start < length) {
+              visit(start, std::min(end, length));
+            }
+          }
+        }
+      }
+
+    private:
+
+      std::unordered_map<std::string, intervals_t> bySequence;
+  };
+}
+
+#endif
@@ -4,23 +4,76 @@
 #include <unordered_map>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <stdexcept>
 #include <fstream>
 #include <sstream>
 #include <algorithm>
+#include <numeric>
 #include <unordered_set>
+#include <memory>
 #include "base_types.hpp"
+#include "common/fai_names.hpp"
+#include "common/ankerl/unordered_dense.hpp"
 
 namespace skch {
 
+/**
+ * Names, lengths and groups of the query and target sequences, numbered by id
+ *
+ * The names are kept once, NUL-terminated one after the other in a single arena, and
+ * looked up through a hash set of ids hashing the names they point at; the query and
+ * target roles are lists of ids into the same store.
+ */
 class SequenceIdManager {
 private:
-    std::unordered_map<std::string, seqno_t> sequenceNameToId;
-    std::vector<ContigInfo> metadata;
-    std::vector<std::string> querySequenceNames;
-    std::vector<std::string> targetSequenceNames;
+    // Hash and equality of ids by the names they have in the arena, also taking names
+    struct NameHash {
+        using is_transparent = void;
+        using is_avalanching = void;
+        const SequenceIdManager* names = nullptr;
+        uint64_t operator()(std::string_view name) const {
+            return ankerl::unordered_dense::hash<std::string_view>{}(name);
+        }
+        uint64_t operator()(seqno_t id) const {
+            return (*this)(names->storedName(id));
+        }
+    };
+    struct NameEqual {
+        using is_transparent = void;
+        const SequenceIdManager* names = nullptr;
+        bool operator()(seqno_t a, seqno_t b) const { return a == b; }
+        bool operator()(std::string_view a, seqno_t b) const { return a == names->storedName(b); }
+        bool operator()(seqno_t a, std::string_view b) const { return names->storedName(a) == b; }
+    };
+
+    std::string nameArena;
+    std::vector<uint64_t> nameOffsets{0};   // start of the name of each id, then the arena end
+    std::vector<offset_t> lengths;
+    std::vector<int> groups;
+    ankerl::unordered_dense::set<seqno_t, NameHash, NameEqual> nameIndex;
+    std::vector<seqno_t> querySequenceIds;
+    std::vector<seqno_t> targetSequenceIds;
     std::vector<std::string> allPrefixes;
     std::string prefixDelim;
+    std::unordered_map<std::string, int> groupIds;
+
+    // Queries registered while they are read, numbered after the store. Only the reader
+    // thread appends; entries and name bytes live in fixed blocks, so others may read
+    // published ids.
+    struct StreamedQuery {
+        const char* name;
+        uint32_t nameLength;
+        int groupId;
+        offset_t len;
+    };
+    static constexpr int streamedChunkBits = 16;
+    static constexpr size_t streamedNameBlock = 1 << 20;
+    std::vector<std::unique_ptr<StreamedQuery[]>> streamedChunks;
+    std::vector<std::unique_ptr<char[]>> streamedNames;
+    char* streamedNamesNext = nullptr;
+    size_t streamedNamesFree = 0;
+    seqno_t streamedCount = 0;
 
 public:
     SequenceIdManager(const std::vector<std::string>& queryFiles,
@@ -30,123 +83,177 @@ public:
                       const std::string& prefixDelim,
                       const std::string& queryList = "",
                       const std::string& targetList = "")
-        : prefixDelim(prefixDelim) {
+        : nameIndex(0, NameHash{this}, NameEqual{this}),
+          prefixDelim(prefixDelim) {
         allPrefixes = queryPrefixes;
         allPrefixes.insert(allPrefixes.end(), targetPrefixes.begin(), targetPrefixes.end());
         populateFromFiles(queryFiles, targetFiles, queryPrefixes, targetPrefixes, prefixDelim, queryList, targetList);
         buildRefGroups();
+        // Never reallocated, so readers of streamed queries need no lock
+        streamedChunks.reserve(1 << 16);
     }
 
-    seqno_t getSequenceId(const std::string& sequenceName) const {
-        auto it = sequenceNameToId.find(sequenceName);
-        if (it != sequenceNameToId.end()) {
-            return it->second;
-        }
-        throw std::runtime_error("Sequence name not found: " + sequenceName);
-    }
+    // The name index points back at this store
+    SequenceIdManager(const SequenceIdManager&) = delete;
+    SequenceIdManager& operator=(const SequenceIdManager&) = delete;
 
-    const ContigInfo& getContigInfo(seqno_t id) const {
-        if (id < static_cast<seqno_t>(metadata.size())) {
-            return metadata[id];
+    seqno_t getSequenceId(std::string_view sequenceName) const {
+        auto it = nameIndex.find(sequenceName);
+        if (it != nameIndex.end()) {
+            return *it;
         }
-        throw std::runtime_error("Invalid sequence ID: " + std::to_string(id));
+        throw std::runtime_error("Sequence name not found: " + std::string(sequenceName));
     }
 
-    const std::string& getSequenceName(seqno_t id) const {
-        return getContigInfo(id).name;
+    // The name of a sequence, NUL-terminated, so its data() may be handed to C APIs
+    std::string_view getSequenceName(seqno_t id) const {
+        if (id >= 0 && id < static_cast<seqno_t>(lengths.size())) {
+            return storedName(id);
+        }
+        const StreamedQuery& query = streamedQuery(id);
+        return std::string_view(query.name, query.nameLength);
     }
 
-    const offset_t& getSequenceLength(seqno_t id) const {
-        return getContigInfo(id).len;
+    offset_t getSequenceLength(seqno_t id) const {
+        if (id >= 0 && id < static_cast<seqno_t>(lengths.size())) {
+            return lengths[id];
+        }
+        return streamedQuery(id).len;
     }
 
     size_t size() const {
-        return metadata.size();
+        return lengths.size();
     }
 
-    const std::vector<ContigInfo>& getMetadata() const {
-        return metadata;
-    }
+    const std::vector<seqno_t>& getQuerySequenceIds() const { return querySequenceIds; }
+    const std::vector<seqno_t>& getTargetSequenceIds() const { return targetSequenceIds; }
 
-    const std::vector<std::string>& getQuerySequenceNames() const { return querySequenceNames; }
-    const std::vector<std::string>& getTargetSequenceNames() const { return targetSequenceNames; }
+    std::vector<std::string> getTargetSequenceNames() const {
+        std::vector<std::string> names;
+        names.reserve(targetSequenceIds.size());
+        for (const seqno_t id : targetSequenceIds) {
+            names.emplace_back(storedName(id));
+        }
+        return names;
+    }
 
     int getRefGroup(seqno_t seqId) const {
-        if (seqId < metadata.size()) {
-            return metadata[seqId].groupId;
+        if (seqId >= 0 && seqId < static_cast<seqno_t>(groups.size())) {
+            return groups[seqId];
         }
-        throw std::runtime_error("Invalid sequence ID: " + std::to_string(seqId));
+        return streamedQuery(seqId).groupId;
     }
 
-private:
+    // Register a query as it is read, without a name lookup or a FASTA index. Only one
+    // thread may call this; the returned id is safe to hand to other threads.
+    seqno_t addStreamedQuery(const std::string& sequenceName, offset_t length) {
+        const seqno_t streamed = streamedCount;
+        const size_t chunk = streamed >> streamedChunkBits;
+        if (chunk == streamedChunks.size()) {
+            if (streamedChunks.capacity() == chunk) {
+                std::cerr << "[SequenceIdManager::addStreamedQuery] ERROR: too many streamed queries" << std::endl;
+                exit(1);
+            }
+            streamedChunks.emplace_back(new StreamedQuery[1 << streamedChunkBits]);
+        }
+        // Names are copied into blocks that are never moved, a long one into its own
+        const size_t bytes = sequenceName.size() + 1;
+        if (bytes > streamedNamesFree) {
+            streamedNamesFree = std::max(bytes, streamedNameBlock);
+            streamedNames.emplace_back(new char[streamedNamesFree]);
+            streamedNamesNext = streamedNames.back().get();
+        }
+        char* name = streamedNamesNext;
+        std::copy(sequenceName.begin(), sequenceName.end(), name);
+        name[sequenceName.size()] = '\0';
+        streamedNamesNext += bytes;
+        streamedNamesFree -= bytes;
+        streamedChunks[chunk][streamed & ((1 << streamedChunkBits) - 1)] =
+            StreamedQuery{name, static_cast<uint32_t>(sequenceName.size()), groupOf(sequenceName), length};
+        streamedCount++;
+        return static_cast<seqno_t>(lengths.size()) + streamed;
+    }
 
-    void buildRefGroups() {
-        std::vector<std::tuple<std::string, size_t>> seqInfoWithIndex;
-        size_t totalSeqs = metadata.size();
+    // Replace the queries by those of queryFiles. Sequences seen before keep their ids, so
+    // an index built on this manager stays valid; new ones are numbered after them.
+    void resetQueries(const std::vector<std::string>& queryFiles,
+                      const std::vector<std::string>& queryPrefixes,
+                      const std::string& queryList = "") {
+        std::unordered_set<std::string> allowedQueryNames;
+        if (!queryList.empty()) readAllowedNames(queryList, allowedQueryNames);
 
-        for (size_t i = 0; i < totalSeqs; ++i) {
-            seqInfoWithIndex.emplace_back(metadata[i].name, i);
+        querySequenceIds.clear();
+        for (const auto& file : queryFiles) {
+            readFAI(file, queryPrefixes, prefixDelim, allowedQueryNames, true);
         }
+        buildRefGroups();
+    }
 
-        std::sort(seqInfoWithIndex.begin(), seqInfoWithIndex.end());
+private:
 
-        int currentGroup = 0;
-        std::unordered_map<std::string, int> groupMap;
+    std::string_view storedName(seqno_t id) const {
+        return std::string_view(nameArena.data() + nameOffsets[id], nameOffsets[id + 1] - nameOffsets[id] - 1);
+    }
 
-        for (const auto& [seqName, originalIndex] : seqInfoWithIndex) {
-            std::string groupKey;
+    const StreamedQuery& streamedQuery(seqno_t id) const {
+        const seqno_t streamed = id - static_cast<seqno_t>(lengths.size());
+        if (streamed >= 0 && streamed < streamedCount) {
+            return streamedChunks[streamed >> streamedChunkBits][streamed & ((1 << streamedChunkBits) - 1)];
+        }
+        throw std::runtime_error("Invalid sequence ID: " + std::to_string(id));
+    }
 
-            if (!allPrefixes.empty()) {
-                // Check if the sequence matches any of the specified prefixes
-                // The original commented out version breaks in clang with an OpenMP capture error
-                // auto it = std::find_if(allPrefixes.begin(), allPrefixes.end(), is_equal(prefix));
-                    // [&seqName](const std::string& prefix) { return seqName.compare(0, prefix.length(), prefix) == 0; });
+    void buildRefGroups() {
+        std::vector<seqno_t> byName(lengths.size());
+        std::iota(byName.begin(), byName.end(), 0);
+        std::sort(byName.begin(), byName.end(), [&](seqno_t a, seqno_t b) {
+            return storedName(a) < storedName(b);
+        });
+
+        groupIds.clear();
+        for (const seqno_t id : byName) {
+            groups[id] = groupOf(storedName(id));
+        }
+        if (lengths.empty()) {
+            std::cerr << "[SequenceIdManager::buildRefGroups] ERROR: No sequences indexed!" << std::endl;
+            exit(1);
+        }
+    }
 
-                for(auto prefix : allPrefixes) {
-                    if (seqName.compare(0, prefix.length(), prefix) == 0) {
-                        groupKey = prefix;
-                        break;
-                    }
-                }
-            }
+    // Group of a sequence name, numbering groups in the order they are first seen
+    int groupOf(std::string_view seqName) {
+        std::string_view groupKey;
 
-            if (groupKey.empty() && !prefixDelim.empty()) {
-                // Use prefix before last delimiter as group key
-                size_t pos = seqName.rfind(prefixDelim);
-                if (pos != std::string::npos) {
-                    groupKey = seqName.substr(0, pos);
+        if (!allPrefixes.empty()) {
+            // Check if the sequence matches any of the specified prefixes
+            for (const auto& prefix : allPrefixes) {
+                if (seqName.compare(0, prefix.length(), prefix) == 0) {
+                    groupKey = prefix;
+                    break;
                 }
             }
+        }
 
-            if (groupKey.empty()) {
-                // If no group key found, use the sequence name itself
-                groupKey = seqName;
-            }
-
-            if (groupMap.find(groupKey) == groupMap.end()) {
-                groupMap[groupKey] = ++currentGroup;
+        if (groupKey.empty() && !prefixDelim.empty()) {
+            // Use prefix before last delimiter as group key
+            size_t pos = seqName.rfind(prefixDelim);
+            if (pos != std::string_view::npos) {
+                groupKey = seqName.substr(0, pos);
             }
-            metadata[originalIndex].groupId = groupMap[groupKey];
-        }
-/*
-        // Debug output to verify grouping
-        for (size_t i = 0; i < metadata.size(); ++i) {
-            std::cerr << "[DEBUG group assignment] seq " << metadata[i].name 
-                      << " → group " << metadata[i].groupId << std::endl;
         }
-*/
-        if (totalSeqs == 0) {
-            std::cerr << "[SequenceIdManager::buildRefGroups] ERROR: No sequences indexed!" << std::endl;
-            exit(1);
+
+        if (groupKey.empty()) {
+            // If no group key found, use the sequence name itself
+            groupKey = seqName;
         }
-    }
 
-    std::string getPrefix(const std::string& s) const {
-        if (!prefixDelim.empty()) {
-            size_t pos = s.find(prefixDelim);
-            return (pos != std::string::npos) ? s.substr(0, pos) : s;
+        const std::string key(groupKey);
+        auto it = groupIds.find(key);
+        if (it == groupIds.end()) {
+            const int group = groupIds.size() + 1;
+            it = groupIds.emplace(key, group).first;
         }
-        return s;
+        return it->second;
     }
 
     void populateFromFiles(const std::vector<std::string>& queryFiles,
@@ -183,42 +290,66 @@ private:
                  const std::string& prefixDelim,
                  const std::unordered_set<std::string>& allowedNames,
                  bool isQuery) {
-        std::string faiName = fileName + ".fai";
-        std::ifstream faiFile(faiName);
-        if (!faiFile.is_open()) {
-            std::cerr << "Error: Unable to open FAI file: " << faiName << std::endl;
+        const auto fai = seqiter::fai_names_t::of(fileName);
+        if (!fai) {
+            std::cerr << "Error: Unable to open FAI file: " << fileName << ".fai" << std::endl;
             exit(1);
         }
 
-        std::string line;
-        while (std::getline(faiFile, line)) {
-            std::istringstream iss(line);
-            std::string seqName;
-            offset_t seqLength;
-            iss >> seqName >> seqLength;
-
-            bool prefixMatch = prefixes.empty() || std::any_of(prefixes.begin(), prefixes.end(),
-                [&](const std::string& prefix) { return seqName.compare(0, prefix.size(), prefix) == 0; });
+        // Only the entries a prefix or the name list selects are looked at
+        const auto& entries = fai->entries();
+        std::vector<size_t> selected;
+        if (!prefixes.empty()) {
+            selected = fai->with_prefixes(prefixes);
+            if (!allowedNames.empty()) {
+                selected.erase(std::remove_if(selected.begin(), selected.end(),
+                    [&](size_t i) { return allowedNames.find(entries[i].name) == allowedNames.end(); }), selected.end());
+            }
+        } else if (!allowedNames.empty()) {
+            selected = fai->named(allowedNames);
+        } else {
+            selected.resize(entries.size());
+            std::iota(selected.begin(), selected.end(), 0);
+        }
 
-            if (prefixMatch && (allowedNames.empty() || allowedNames.find(seqName) != allowedNames.end())) {
-                seqno_t seqId = addSequence(seqName, seqLength);
-                if (isQuery) {
-                    querySequenceNames.push_back(seqName);
-                } else {
-                    targetSequenceNames.push_back(seqName);
-                }
+        // The store grows once per file rather than per name
+        uint64_t nameBytes = 0;
+        for (const size_t i : selected) {
+            nameBytes += entries[i].name.size() + 1;
+        }
+        nameArena.reserve(nameArena.size() + nameBytes);
+        nameOffsets.reserve(nameOffsets.size() + selected.size());
+        lengths.reserve(lengths.size() + selected.size());
+        groups.reserve(groups.size() + selected.size());
+        nameIndex.reserve(nameIndex.size() + selected.size());
+        auto& roleIds = isQuery ? querySequenceIds : targetSequenceIds;
+        roleIds.reserve(roleIds.size() + selected.size());
+
+        for (const size_t i : selected) {
+            const std::string& seqName = entries[i].name;
+            const offset_t seqLength = entries[i].length;
+            seqno_t seqId = addSequence(seqName, seqLength);
+            if (isQuery) {
+                // A query reusing the name of an earlier one may differ in length
+                lengths[seqId] = seqLength;
+                querySequenceIds.push_back(seqId);
+            } else {
+                targetSequenceIds.push_back(seqId);
             }
         }
     }
 
     seqno_t addSequence(const std::string& sequenceName, offset_t length) {
-        auto it = sequenceNameToId.find(sequenceName);
-        if (it != sequenceNameToId.end()) {
-            return it->second;
+        auto it = nameIndex.find(std::string_view(sequenceName));
+        if (it != nameIndex.end()) {
+            return *it;
         }
-        seqno_t newId = metadata.size();
-        sequenceNameToId[sequenceName] = newId;
-        metadata.push_back(ContigInfo{sequenceName, length});
+        const seqno_t newId = lengths.size();
+        nameArena.append(sequenceName).push_back('\0');
+        nameOffsets.push_back(nameArena.size());
+        lengths.push_back(length);
+        groups.push_back(0);
+        nameIndex.insert(newId);
         return newId;
     }
 };
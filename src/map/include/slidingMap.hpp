@@ -20,6 +20,23 @@
 
 namespace skch
 {
+  //Metadata for the minmers saved in sliding ordered map during L2 stage
+  struct slidingMapContainerValueType
+  {
+    hash_t hash_val;
+    strand_t q_strand;
+    strand_t strand_vote;
+    unsigned int num_before_inc; // Number of hashes between this and the previous (including self)
+    bool active;
+  };
+
+  //Storage a SlideMapper works in, kept by its caller to reuse from one mapper to the next
+  struct SlideMapperBuffers
+  {
+    std::vector<slidingMapContainerValueType> minhashes;
+    std::vector<uint32_t> rankBuckets;
+  };
+
   /**
    * @class     skch::SlideMapper
    * @brief     L1 and L2 mapping stages
@@ -30,16 +47,6 @@ namespace skch
 
       private:
 
-        //Metadata for the minmers saved in sliding ordered map during L2 stage
-        struct slidingMapContainerValueType
-        {
-          hash_t hash_val;
-          strand_t q_strand;
-          strand_t strand_vote;
-          unsigned int num_before_inc; // Number of hashes between this and the previous (including self)
-          bool active;
-        };
-
         //Container type for saving read sketches during L1 and L2 both
         typedef Sketch::MI_Type MinVec_Type;
 
@@ -54,12 +61,17 @@ namespace skch
         //Ordered map to save unique sketch elements, and associated value as 
         //a pair of its occurrence in the query and the reference
         typedef std::vector<slidingMapContainerValueType> VecType;
-        VecType slidingWindowMinhashes;
+        VecType& slidingWindowMinhashes;
 
         //Iterator pointing to the last query minmer that is below rank sketch-size
         typename VecType::iterator pivot;
         typename VecType::size_type pivRank;
 
+        //rankBuckets[b] is the first query minmer whose hash >> rankShift is >= b, so a
+        //hash is located among about one query minmer instead of by binary search
+        std::vector<uint32_t>& rankBuckets;
+        int rankShift = 0;
+
 
       public:
 
@@ -79,14 +91,17 @@ namespace skch
         /**
          * @brief                 constructor
          * @param[in]   Q         query meta data
+         * @param[in]   buffers   storage the mapper is built in, overwritten
          */
-        SlideMapper(Q_Info &Q_) :
+        SlideMapper(Q_Info &Q_, SlideMapperBuffers& buffers) :
           Q(Q_),
-          slidingWindowMinhashes(Q.sketchSize + 1),
+          slidingWindowMinhashes(buffers.minhashes),
+          rankBuckets(buffers.rankBuckets),
           sharedSketchElements(0),
           intersectionSize(0),
           strand_votes(0)
         {
+          slidingWindowMinhashes.assign(Q.sketchSize + 1, slidingMapContainerValueType{});
           this->init();
         }
 
@@ -118,6 +133,33 @@ namespace skch
           //Point pivot to last element in the map
           this->pivot = std::prev(this->slidingWindowMinhashes.end());
           pivRank = slidingWindowMinhashes.size() - 1;
+
+          //A bottom-s sketch spans [0, largest hash], which the buckets divide evenly
+          const hash_t maxHash = slidingWindowMinhashes.back().hash_val;
+          int bucketBits = 1;
+          while ((1ULL << bucketBits) < Q.minmerTableQuery.size())
+            bucketBits++;
+          while (rankShift < 64 && (maxHash >> rankShift) >> bucketBits)
+            rankShift++;
+          rankBuckets.resize((1ULL << bucketBits) + 1);
+          for (uint64_t b = 0, i = 1; b < rankBuckets.size(); ++b) {
+            while (i < slidingWindowMinhashes.size() && (slidingWindowMinhashes[i].hash_val >> rankShift) < b)
+              i++;
+            rankBuckets[b] = i;
+          }
+        }
+
+        /**
+         * @brief       first query minmer with hash >= the given one, end if none
+         */
+        typename VecType::iterator locate(hash_t hash)
+        {
+          if (slidingWindowMinhashes.size() == 1 || hash > slidingWindowMinhashes.back().hash_val)
+            return slidingWindowMinhashes.end();
+          const uint64_t bucket = hash >> rankShift;
+          const auto last = slidingWindowMinhashes.begin() + rankBuckets[bucket + 1];
+          return std::lower_bound(slidingWindowMinhashes.begin() + rankBuckets[bucket], last, hash,
+              [](const slidingMapContainerValueType& a, hash_t b) {return a.hash_val < b;});
         }
 
       public:
@@ -125,10 +167,7 @@ namespace skch
         void insert_minmer(const skch::MinmerInfo& mi)
         {
           // Find where minmer goes in vector
-          auto insert_loc = std::lower_bound(
-              std::next(slidingWindowMinhashes.begin()), slidingWindowMinhashes.end(),
-              mi.hash,
-              [](const slidingMapContainerValueType& a, hash_t b) {return a.hash_val < b;});
+          auto insert_loc = locate(mi.hash);
 
           if (insert_loc == slidingWindowMinhashes.end()) 
           {
@@ -171,10 +210,7 @@ namespace skch
         void delete_minmer(const skch::MinmerInfo& mi)
         {
           // Find where minmer goes in vector
-          auto insert_loc = std::lower_bound(
-              std::next(slidingWindowMinhashes.begin()), slidingWindowMinhashes.end(),
-              mi.hash,
-              [](const slidingMapContainerValueType& a, hash_t b) {return a.hash_val < b;});
+          auto insert_loc = locate(mi.hash);
 
           if (insert_loc == slidingWindowMinhashes.end()) 
           {
@@ -0,0 +1,97 @@
+/**
+ * @file    spacedSeedCache.hpp
+ * @brief   On-disk cache of generated ALeS spaced seed sets
+ *
+ * One line per parameter set, tab separated:
+ *   weight  count  similarity  region_length  sensitivity  seed[,seed...]
+ * Lines are appended with a single write so concurrent runs sharing a cache
+ * file at worst generate the same set twice.
+ */
+
+#ifndef SPACED_SEED_CACHE_HPP
+#define SPACED_SEED_CACHE_HPP
+
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "map/include/map_parameters.hpp"
+#include "map/include/commonFunc.hpp"
+
+namespace skch
+{
+  namespace SpacedSeedCache
+  {
+    /**
+     * @brief   Copy a seed mask into storage that lives as long as the program,
+     *          like the seeds handed out by ALeS
+     */
+    inline ales::spaced_seed makeSeed(const std::string& mask)
+    {
+      return ales::spaced_seed{strdup(mask.c_str()), mask.size()};
+    }
+
+    /**
+     * @brief                   Look up the seed set generated for these parameters
+     * @param[in]   filename    cache file, a missing file is an empty cache
+     * @param[in]   key         spaced seed parameters
+     * @param[out]  sps         seeds and sensitivity, set on a hit
+     * @return                  true if the cache holds a set for key
+     */
+    inline bool lookup(const stdfs::path& filename, const ales_params& key, ales::spaced_seeds& sps)
+    {
+      std::ifstream in(filename);
+      std::string line;
+      while (std::getline(in, line))
+      {
+        std::istringstream fields(line);
+        ales_params p;
+        double sensitivity;
+        std::string masks;
+        if (!(fields >> p.weight >> p.seed_count >> p.similarity >> p.region_length >> sensitivity >> masks))
+          continue;
+        if (p.weight != key.weight || p.seed_count != key.seed_count
+            || p.similarity != key.similarity || p.region_length != key.region_length)
+          continue;
+
+        std::vector<ales::spaced_seed> seeds;
+        for (const auto& mask : CommonFunc::split(masks, ','))
+          seeds.push_back(makeSeed(mask));
+        if (seeds.size() != key.seed_count)
+          continue;
+
+        sps.seeds = std::move(seeds);
+        sps.sensitivity = sensitivity;
+        return true;
+      }
+      return false;
+    }
+
+    /**
+     * @brief                   Append a generated seed set to the cache
+     * @return                  false if the cache file could not be written
+     */
+    inline bool store(const stdfs::path& filename, const ales_params& key, const ales::spaced_seeds& sps)
+    {
+      std::ostringstream line;
+      line << std::setprecision(std::numeric_limits<float>::max_digits10)
+           << key.weight << '\t' << key.seed_count << '\t' << key.similarity << '\t' << key.region_length << '\t'
+           << std::setprecision(std::numeric_limits<double>::max_digits10) << sps.sensitivity << '\t';
+      for (size_t i = 0; i < sps.seeds.size(); ++i)
+        line << (i ? "," : "") << sps.seeds[i].seed;
+      line << '\n';
+
+      std::ofstream out(filename, std::ios::app);
+      const std::string record = line.str();
+      out.write(record.data(), record.size());
+      out.flush();
+      return bool(out);
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,294 @@
+/**
+ * @file    stageProfile.hpp
+ * @brief   Per-thread times and counters of the mapping stages, and the waits of the
+ *          queues between the threads, reported once the mapping is done
+ * @details Off unless enable() is called before the threads start; a disabled timer or
+ *          counter costs one branch. Each thread adds to its own slots, read only after
+ *          the threads joined, so nothing is shared while mapping. The counters are also
+ *          added to the costs of the query being mapped, when a QueryScope names one.
+ */
+
+#ifndef STAGE_PROFILE_HPP
+#define STAGE_PROFILE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace skch
+{
+  namespace profile
+  {
+    enum Stage : int { SKETCH, SEED_LOOKUP, L1_SWEEP, L2, MERGE, FILTER, OUTPUT, STAGE_COUNT };
+    enum Counter : int { QUERIES, FRAGMENTS, SEED_INTERVAL_POINTS, L1_CANDIDATES, L2_MAPPINGS, REPORTED_MAPPINGS,
+                         GUIDED_FRAGMENTS, GUIDED_FALLBACKS, COARSE_SEGMENTS,
+                         ADAPTIVE_SEGMENTS, ADAPTIVE_FALLBACKS, COUNTER_COUNT };
+
+    static constexpr const char* stageNames[STAGE_COUNT] = {
+      "sketch", "seed_lookup", "l1_sweep", "l2", "merge", "filter", "output"};
+    static constexpr const char* counterNames[COUNTER_COUNT] = {
+      "queries", "fragments", "seed_interval_points", "l1_candidates", "l2_mappings", "reported_mappings",
+      "guided_fragments", "guided_fallbacks", "coarse_segments",
+      "adaptive_segments", "adaptive_fallbacks"};
+
+    /**
+     * @return  the time stamp counter on x86, whose rate is calibrated against the steady
+     *          clock for the report; nanoseconds of the steady clock elsewhere
+     */
+    inline uint64_t ticks()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+      return __rdtsc();
+#else
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    struct ThreadStats
+    {
+      uint64_t stageTicks[STAGE_COUNT] = {};
+      uint64_t stageCalls[STAGE_COUNT] = {};
+      uint64_t counts[COUNTER_COUNT] = {};
+      int current = -1;                 //stage being timed, -1 for none
+      uint64_t since = 0;               //when the current stage was last resumed
+    };
+
+    // Waits of the producers on a full queue and of the consumers on an empty one
+    struct QueueWaits
+    {
+      std::atomic<uint64_t> pushWaits{0};
+      std::atomic<uint64_t> pushTicks{0};
+      std::atomic<uint64_t> popWaits{0};
+      std::atomic<uint64_t> popTicks{0};
+    };
+
+    struct Registry
+    {
+      bool enabled = false;
+      uint64_t startTicks = 0;
+      std::chrono::steady_clock::time_point startTime;
+      std::mutex mutex;
+      std::deque<ThreadStats> threads;                //stable, one per thread that was timed
+      std::map<std::string, QueueWaits> queues;       //by queue name, shared by its instances
+    };
+
+    inline Registry& registry()
+    {
+      static Registry r;
+      return r;
+    }
+
+    inline bool enabled()
+    {
+      return registry().enabled;
+    }
+
+    /**
+     * @brief   start profiling; called before any mapping thread starts
+     */
+    inline void enable()
+    {
+      Registry& r = registry();
+      r.enabled = true;
+      r.startTime = std::chrono::steady_clock::now();
+      r.startTicks = ticks();
+    }
+
+    inline ThreadStats& local()
+    {
+      thread_local ThreadStats* mine = nullptr;
+      if (!mine) {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        mine = &r.threads.emplace_back();
+      }
+      return *mine;
+    }
+
+    /**
+     * @brief   counters and mapping time of one query, summed over the threads mapping
+     *          its fragments and the subsets it is mapped against
+     */
+    struct QueryCost
+    {
+      std::atomic<uint64_t> counts[COUNTER_COUNT] = {};
+      std::atomic<uint64_t> nanos{0};
+
+      uint64_t get(Counter counter) const
+      {
+        return counts[counter].load(std::memory_order_relaxed);
+      }
+
+      double seconds() const
+      {
+        return nanos.load(std::memory_order_relaxed) * 1e-9;
+      }
+    };
+
+    // Costs of the query the thread maps, null outside a QueryScope
+    inline QueryCost*& currentQuery()
+    {
+      thread_local QueryCost* current = nullptr;
+      return current;
+    }
+
+    inline void count(Counter counter, uint64_t n)
+    {
+      if (enabled()) {
+        local().counts[counter] += n;
+      }
+      if (QueryCost* cost = currentQuery()) {
+        cost->counts[counter].fetch_add(n, std::memory_order_relaxed);
+      }
+    }
+
+    /**
+     * @brief   adds the counters of the scope, and its time on the steady clock, to the
+     *          costs of a query; nothing for a null query
+     */
+    class QueryScope
+    {
+      public:
+
+        explicit QueryScope(QueryCost* cost) : cost(cost)
+        {
+          if (!cost) {
+            return;
+          }
+          previous = currentQuery();
+          currentQuery() = cost;
+          start = std::chrono::steady_clock::now();
+        }
+
+        ~QueryScope()
+        {
+          if (!cost) {
+            return;
+          }
+          const auto spent = std::chrono::steady_clock::now() - start;
+          cost->nanos.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(spent).count(), std::memory_order_relaxed);
+          currentQuery() = previous;
+        }
+
+        QueryScope(const QueryScope&) = delete;
+        QueryScope& operator=(const QueryScope&) = delete;
+
+      private:
+
+        QueryCost* cost;
+        QueryCost* previous = nullptr;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    /**
+     * @return  the waits of the queues named name, or null when not profiling
+     */
+    inline QueueWaits* queueWaits(const std::string& name)
+    {
+      if (!enabled()) {
+        return nullptr;
+      }
+      Registry& r = registry();
+      std::lock_guard<std::mutex> lock(r.mutex);
+      return &r.queues[name];
+    }
+
+    /**
+     * @brief   times a stage for the scope of the timer, exclusively: a stage timed within
+     *          another pauses it, so nested stages are not counted twice
+     */
+    class StageTimer
+    {
+      public:
+
+        explicit StageTimer(Stage stage)
+        {
+          if (!enabled()) {
+            return;
+          }
+          stats = &local();
+          const uint64_t now = ticks();
+          previous = stats->current;
+          if (previous >= 0) {
+            stats->stageTicks[previous] += now - stats->since;
+          }
+          stats->current = stage;
+          stats->since = now;
+          stats->stageCalls[stage]++;
+        }
+
+        ~StageTimer()
+        {
+          if (!stats) {
+            return;
+          }
+          const uint64_t now = ticks();
+          stats->stageTicks[stats->current] += now - stats->since;
+          stats->current = previous;
+          stats->since = now;
+        }
+
+        StageTimer(const StageTimer&) = delete;
+        StageTimer& operator=(const StageTimer&) = delete;
+
+      private:
+
+        ThreadStats* stats = nullptr;
+        int previous = -1;
+    };
+
+    /**
+     * @brief   write the totals across threads as TSV: section, name, count, seconds, and
+     *          the seconds of the busiest thread for the stages
+     * @return  false if the file could not be written
+     */
+    inline bool writeReport(const std::string& filename)
+    {
+      Registry& r = registry();
+      if (!r.enabled) {
+        return true;
+      }
+      const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - r.startTime).count();
+      const uint64_t elapsedTicks = ticks() - r.startTicks;
+      const double secondsPerTick = elapsedTicks > 0 ? elapsed / elapsedTicks : 0;
+
+      std::ofstream out(filename);
+      out << "#section\tname\tcount\tseconds\tmax_thread_seconds\n";
+      out << "run\twall\t" << r.threads.size() << "\t" << elapsed << "\t.\n";
+      for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+        uint64_t calls = 0, total = 0, busiest = 0;
+        for (const auto& thread : r.threads) {
+          calls += thread.stageCalls[stage];
+          total += thread.stageTicks[stage];
+          busiest = std::max(busiest, thread.stageTicks[stage]);
+        }
+        out << "stage\t" << stageNames[stage] << "\t" << calls << "\t" << total * secondsPerTick
+            << "\t" << busiest * secondsPerTick << "\n";
+      }
+      for (int counter = 0; counter < COUNTER_COUNT; ++counter) {
+        uint64_t total = 0;
+        for (const auto& thread : r.threads) {
+          total += thread.counts[counter];
+        }
+        out << "counter\t" << counterNames[counter] << "\t" << total << "\t.\t.\n";
+      }
+      for (const auto& [name, waits] : r.queues) {
+        out << "queue_push_wait\t" << name << "\t" << waits.pushWaits.load() << "\t" << waits.pushTicks.load() * secondsPerTick << "\t.\n";
+        out << "queue_pop_wait\t" << name << "\t" << waits.popWaits.load() << "\t" << waits.popTicks.load() * secondsPerTick << "\t.\n";
+      }
+      out.close();
+      return bool(out);
+    }
+  }
+}
+
+#endif
@@ -9,11 +9,20 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <functional>
 #include <map>
+#include <numeric>
+#include <sstream>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 #include <filesystem>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 namespace fs = std::filesystem;
 
 //#include <zlib.h>
@@ -22,6 +31,11 @@ namespace fs = std::filesystem;
 #include "map/include/base_types.hpp"
 #include "map/include/map_parameters.hpp"
 #include "map/include/commonFunc.hpp"
+#include "map/include/countMinSketch.hpp"
+#include "map/include/memoryReport.hpp"
+#include "map/include/hugePages.hpp"
+#include "map/include/pageWarmup.hpp"
+#include "map/include/spacedSeedCache.hpp"
 #include "map/include/ThreadPool.hpp"
 
 //External includes
@@ -41,6 +55,8 @@ namespace fs = std::filesystem;
 #include "sequenceIds.hpp"
 #include "common/atomic_queue/atomic_queue.h"
 #include "common/progress.hpp"
+#include "common/sampling_profiler.hpp"
+#include "common/shared_sequences.hpp"
 #include <thread>
 #include <atomic>
 
@@ -77,36 +93,367 @@ namespace skch
       bool isInitialized = false;
 
       using MI_Type = std::vector< MinmerInfo >;
-      using MIIter_t = MI_Type::const_iterator;
+      using MIIter_t = IndexIterator<MinmerInfo, PackedMinmerInfo>;
+      using SeedIter_t = IndexIterator<IntervalPoint, PackedIntervalPoint>;
       using HF_Map_t = ankerl::unordered_dense::map<hash_t, uint64_t>;
 
       public:
         uint64_t total_seq_length = 0;
 
-      //Index for fast seed lookup (unordered_map)
-      /*
-       * [minmer #1] -> [pos1, pos2, pos3 ...]
-       * [minmer #2] -> [pos1, pos2...]
-       * ...
-       */
+      //Per-thread seed position lists while building, packed into the seed table afterwards
       //using MI_Map_t = google::dense_hash_map< MinmerMapKeyType, MinmerMapValueType >;
       //using MI_Map_t = phmap::flat_hash_map< MinmerMapKeyType, MinmerMapValueType >;
       //using MI_Map_t = absl::flat_hash_map< MinmerMapKeyType, MinmerMapValueType >;
       //using MI_Map_t = tsl::sparse_map< MinmerMapKeyType, MinmerMapValueType >;
       using MI_Map_t = ankerl::unordered_dense::map< MinmerMapKeyType, MinmerMapValueType >;
-      MI_Map_t minmerPosLookupIndex;
       MI_Type minmerIndex;
 
-      // Atomic queues for input and output
-      using input_queue_t = atomic_queue::AtomicQueue<InputSeqContainer*, 1024>;
-      using output_queue_t = atomic_queue::AtomicQueue<std::pair<uint64_t, MI_Type*>*, 1024>;
-      input_queue_t input_queue;
-      output_queue_t output_queue;
+      // Reference sequence sketched as one or more slices, shared by its slices
+      struct SketchSliceGroup {
+        SeqBuffer seq{nullptr, &std::free};
+        seqno_t seqId;
+        offset_t offset = 0;                    // start of the sketched region in its sequence
+        std::vector<offset_t> begins;           // start of each slice
+        std::vector<MI_Type> intervals;         // raw minmer intervals per slice
+        std::vector<MI_Type> open;              // intervals left open per slice
+        std::atomic<size_t> remaining;          // slices not yet sketched
+      };
+
+      struct SketchSlice {
+        std::shared_ptr<SketchSliceGroup> group;
+        size_t index;
+        offset_t begin;                         // first position (and window) of the slice
+        offset_t len;
+      };
+
+      // Sequences longer than about twice this many windows are sketched in slices
+      static constexpr offset_t sketchSliceLength = 4000000;
 
       double hgNumerator;
 
+      // Sub-index magic numbers: legacy indexes carry no k-mer hash engine field,
+      // hashed ones carry no spaced seeds, seeded ones are deserialized entry by
+      // entry and flat ones are memory-mapped and used in place
+      static constexpr uint64_t indexMagicLegacy = 0xDEADBEEFCAFEBABE;
+      static constexpr uint64_t indexMagicHashed = 0xDEADBEEFCAFEBAC2;
+      static constexpr uint64_t indexMagicSeeded = 0xDEADBEEFCAFEBAC3;
+      static constexpr uint64_t indexMagicFlat   = 0xDEADBEEFCAFEBAC4;
+
+      /**
+       * Index files written for several subsets open with a directory of them:
+       *   magic indexMagicDirectory, uint64_t numEntries, uint64_t nextDirectory,
+       *   then per subset uint64_t offset, uint64_t size, uint64_t numSequences and
+       *   length-prefixed sequence names.
+       * offset and size locate the sub-index in the file, 0 until it has been written.
+       * An update appends another directory and links it from nextDirectory of the last one.
+       */
+      static constexpr uint64_t indexMagicDirectory = 0xDEADBEEFCAFEBAD1;
+
+      /**
+       * @brief   k-mer hashing scheme of this sketch (taken from the index when loaded)
+       */
+      int getKmerHashEngine() const { return param.kmerHashEngine; }
+
+      /**
+       * @brief   spaced seeds of this sketch, empty when hashing k-mers (taken from the index when loaded)
+       */
+      const std::vector<ales::spaced_seed>& getSpacedSeeds() const { return param.spaced_seeds; }
+
+      /**
+       * @brief   s-mer size of the syncmers sketched, 0 for all k-mers (taken from the index when loaded)
+       */
+      int getSyncmerSize() const { return param.syncmer_size; }
+
+      /**
+       * @brief   DUST threshold of the k-mers masked, in thousandths, 0 for none (taken from the index when loaded)
+       */
+      uint64_t getDustThreshold() const { return param.dust_threshold; }
+
+      /**
+       * @brief   whether world minimizers were sketched (taken from the index when loaded)
+       */
+      bool getWorldMinimizers() const { return param.world_minimizers; }
+
+      /**
+       * @brief                 look up the interval points of a minmer hash
+       * @param[in]   hash
+       * @param[out]  begin     first interval point of the hash
+       * @param[out]  end       one past its last interval point
+       * @return                false if the hash is not in the index
+       */
+      bool findSeedIntervals(hash_t hash, SeedIter_t& begin, SeedIter_t& end) const
+      {
+        if (!seedFilterHas(seedFilterBlock(flatIndex.filter, flatIndex.filterShift, hash), hash))
+          return false;
+        // Hashes are uniform, so the top bits narrow the search to a handful of entries
+        const uint64_t bucket = hash >> flatIndex.bucketShift;
+        const hash_t* lo = flatIndex.hashes + flatIndex.buckets[bucket];
+        const hash_t* hi = flatIndex.hashes + flatIndex.buckets[bucket + 1];
+        const hash_t* it = std::lower_bound(lo, hi, hash);
+        if (it == hi || *it != hash)
+          return false;
+        const uint64_t idx = it - flatIndex.hashes;
+        begin = seedPoint(flatIndex.seedStarts[idx], hash);
+        end = seedPoint(flatIndex.seedStarts[idx + 1], hash);
+        return true;
+      }
+
+      /**
+       * @brief                 look up the interval points of many minmer hashes at once
+       * @details               the lookups are interleaved a batch at a time, stage by stage,
+       *                        prefetching what the next stage of every hash reads, so their
+       *                        cache misses overlap instead of stalling one after another. The
+       *                        seed filter, far smaller than the seed table, turns most hashes
+       *                        not in the index away before the buckets are read
+       * @param[in]   hashes
+       * @param[out]  found     interval point ranges of the hashes in the index, in the order
+       *                        of hashes; hashes not in the index are left out
+       */
+      void findSeedIntervals(const std::vector<hash_t>& hashes, std::vector<boundPtr<SeedIter_t>>& found) const
+      {
+        constexpr size_t batchSize = 32;
+        const hash_t* lo[batchSize];
+        const hash_t* hi[batchSize];
+        const uint64_t* blocks[batchSize];
+        hash_t batch[batchSize];
+        for (size_t first = 0; first < hashes.size(); first += batchSize) {
+          const size_t count = std::min(batchSize, hashes.size() - first);
+
+          for (size_t i = 0; i < count; ++i) {
+            blocks[i] = seedFilterBlock(flatIndex.filter, flatIndex.filterShift, hashes[first + i]);
+            __builtin_prefetch(blocks[i]);
+          }
+          size_t n = 0;
+          for (size_t i = 0; i < count; ++i) {
+            if (seedFilterHas(blocks[i], hashes[first + i]))
+              batch[n++] = hashes[first + i];
+          }
+
+          for (size_t i = 0; i < n; ++i)
+            __builtin_prefetch(flatIndex.buckets + (batch[i] >> flatIndex.bucketShift));
+          for (size_t i = 0; i < n; ++i) {
+            const uint64_t bucket = batch[i] >> flatIndex.bucketShift;
+            lo[i] = flatIndex.hashes + flatIndex.buckets[bucket];
+            hi[i] = flatIndex.hashes + flatIndex.buckets[bucket + 1];
+            __builtin_prefetch(lo[i]);
+            __builtin_prefetch(hi[i]);
+          }
+          for (size_t i = 0; i < n; ++i) {
+            const hash_t* it = std::lower_bound(lo[i], hi[i], batch[i]);
+            lo[i] = (it == hi[i] || *it != batch[i]) ? nullptr : it;
+            if (lo[i])
+              __builtin_prefetch(flatIndex.seedStarts + (it - flatIndex.hashes));
+          }
+          for (size_t i = 0; i < n; ++i) {
+            if (!lo[i])
+              continue;
+            const uint64_t idx = lo[i] - flatIndex.hashes;
+            found.push_back(boundPtr<SeedIter_t>{seedPoint(flatIndex.seedStarts[idx], batch[i]),
+                                                 seedPoint(flatIndex.seedStarts[idx + 1], batch[i])});
+          }
+        }
+      }
+
+      // 64-bit words of a block of the seed filter, one cache line
+      static constexpr uint64_t seedFilterWords = 8;
+
+      // Hashes of the index a block of the seed filter holds on average, at most: 8 to 16
+      // bits a hash, about 2% false positives at most
+      static constexpr uint64_t seedFilterBlockHashes = 64;
+
+      /**
+       * @brief     block of the seed filter holding the bits of hash, whose top bits after
+       *            remixing pick one of the 2^(64 - shift) blocks
+       */
+      static const uint64_t* seedFilterBlock(const uint64_t* filter, uint64_t shift, hash_t hash)
+      {
+        return filter + ((hash * 0x9E3779B97F4A7C15ULL) >> shift) * seedFilterWords;
+      }
+
+      /**
+       * @brief     the 6 bits of a block of the seed filter set for hash, 9 bits of a remix
+       *            of it each, as visit(word, mask); false once visit returns false
+       */
+      template <typename Fn>
+      static bool forEachSeedFilterBit(hash_t hash, Fn&& visit)
+      {
+        uint64_t bits = (hash ^ (hash >> 31)) * 0xBF58476D1CE4E5B9ULL;
+        for (int probe = 0; probe < 6; ++probe, bits >>= 9) {
+          if (!visit((bits >> 6) & 7, 1ULL << (bits & 63)))
+            return false;
+        }
+        return true;
+      }
+
+      /**
+       * @brief     false if hash is certainly not in the index, true if it may be
+       */
+      static bool seedFilterHas(const uint64_t* block, hash_t hash)
+      {
+        return forEachSeedFilterBit(hash, [&](uint64_t word, uint64_t mask) { return (block[word] & mask) != 0; });
+      }
+
+      /**
+       * @brief     size and fill the blocked Bloom filter of the numHashes hashes
+       */
+      static void fillSeedFilter(const hash_t* hashes, uint64_t numHashes,
+                                 std::vector<uint64_t>& filter, uint64_t& filterBits)
+      {
+        filterBits = 1;
+        while (filterBits < 40 && (numHashes / seedFilterBlockHashes >> filterBits) > 0)
+          filterBits++;
+        filter.assign(seedFilterWords << filterBits, 0);
+        for (uint64_t i = 0; i < numHashes; ++i) {
+          uint64_t* block = filter.data() + (seedFilterBlock(filter.data(), 64 - filterBits, hashes[i]) - filter.data());
+          forEachSeedFilterBit(hashes[i], [&](uint64_t word, uint64_t mask) { block[word] |= mask; return true; });
+        }
+      }
+
+      /**
+       * @brief     iterator at interval point i of the seed table, which belongs to hash
+       */
+      SeedIter_t seedPoint(uint64_t i, hash_t hash) const
+      {
+        return flatIndex.packed ? SeedIter_t(flatIndex.packedPoints, i, hash) : SeedIter_t(flatIndex.points, i);
+      }
+
+      /**
+       * @brief     minmerIndex, sorted by sequence and window position
+       */
+      MIIter_t getMinmerIndexBegin() const
+      {
+        return flatIndex.packed ? MIIter_t(flatIndex.packedMinmers, 0) : MIIter_t(flatIndex.minmers, 0);
+      }
+
       private:
 
+      // Magic number of the sub-index being read
+      uint64_t indexMagic = indexMagicFlat;
+
+      /**
+       * Seed lookup in compressed sparse row form, owned by a built (or stream-read) sketch:
+       * hashes holds the sorted distinct minmer hashes and hash i owns the interval points
+       * points[starts[i], starts[i + 1]). buckets[b] is the first hash whose top bucketBits
+       * bits are >= b. filter is a blocked Bloom filter of the hashes, 2^filterBits blocks of
+       * a cache line. Mapped indexes carry the same arrays in the file instead, the filter
+       * from version 8 on.
+       */
+      struct SeedTable
+      {
+        std::vector<hash_t> hashes;
+        std::vector<uint64_t> starts;
+        std::vector<uint64_t> buckets;
+        std::vector<uint64_t> filter;
+        uint64_t filterBits = 1;
+        std::vector<IntervalPoint> points;
+        std::vector<PackedIntervalPoint> packedPoints;
+        uint64_t bucketBits = 1;
+      } seedTable;
+
+      // minmerIndex in the packed encoding, replacing the wide one when it fits
+      std::vector<PackedMinmerInfo> packedMinmerIndex;
+
+      // Frequency filter cutoff and the sorted hashes it dropped, kept for index updates
+      uint64_t countThreshold = 0;
+      std::vector<hash_t> frequentHashes;
+
+      /**
+       * Flat sub-index layout, following the parameters at the next 64-byte boundary.
+       * All offsets are absolute file offsets of 64-byte aligned arrays:
+       *   minmers     MinmerInfo[numMinmers]     minmerIndex
+       *   hashes      hash_t[numHashes]          sorted distinct minmer hashes
+       *   seedStarts  uint64_t[numHashes + 1]    range of each hash in points
+       *   buckets     uint64_t[2^bucketBits + 1] first hash index per top-bits bucket
+       *   points      IntervalPoint[numPoints]   concatenated interval points of each hash
+       *   frequent    hash_t[numFrequent]        sorted hashes dropped by the frequency filter
+       *   filter      uint64_t[8 << filterBits]  blocked Bloom filter of the hashes, from version 8
+       * With packed set, minmers and points use PackedMinmerInfo and PackedIntervalPoint.
+       * countThreshold is the frequency filter cutoff; version 2 has neither it nor frequent.
+       * syncmerSize, from version 5, is the s-mer size of the closed syncmers sketched, 0 when
+       * every k-mer was. worldMinimizers, from version 6, is 1 when the windows hold world
+       * minimizers rather than their bottom-s sketches. dustThreshold, from version 7, is the
+       * DUST score over which k-mers were masked, in thousandths, 0 when none were. Without
+       * filterOffset, before version 8 or when compressed, the seed filter is built on loading.
+       *
+       * With compressed set (version 4), minmers and hashes instead hold independently
+       * decodable blocks of blockSize records, and seedStarts, buckets and points are unset:
+       *   minmers     uint64_t[minmer blocks + 1]      file offset of each block, then the blocks
+       *   hashes      uint64_t[2 * (seed blocks + 1)]  file offset and first point of each block,
+       *                                                then the blocks
+       * A minmer block codes each minmer as varints of its zigzag sequence id delta << 2 |
+       * strand + 1, its zigzag window position delta (from 0 on a new sequence) and window
+       * length, then its 8-byte hash. A seed block codes each hash as the varint delta from the
+       * previous hash of the block and its number of points, then each point as varints of its
+       * zigzag sequence id delta << 1 | side is open, and its zigzag position delta. That delta
+       * is from 0 on a new sequence, unless compressed is 2: pangenome indexes code it from the
+       * point before, in the previous sequence, which for a hash found once per haplotype is
+       * its copy at the homologous position of the previous haplotype.
+       */
+      // Sections of a flat sub-index with a checksum in its header
+      static constexpr uint64_t flatIndexSections = 8;
+
+      struct FlatIndexHeader
+      {
+        uint64_t version;
+        uint64_t packed;
+        uint64_t numMinmers;
+        uint64_t numHashes;
+        uint64_t numPoints;
+        uint64_t bucketBits;
+        uint64_t minmersOffset;
+        uint64_t hashesOffset;
+        uint64_t seedStartsOffset;
+        uint64_t bucketsOffset;
+        uint64_t pointsOffset;
+        uint64_t endOffset;
+        uint64_t countThreshold;
+        uint64_t numFrequent;
+        uint64_t frequentOffset;
+        uint64_t compressed;
+        uint64_t blockSize;
+        uint64_t syncmerSize;
+        uint64_t worldMinimizers;
+        uint64_t dustThreshold;
+        uint64_t filterBits;
+        uint64_t filterOffset;
+        uint64_t checksums[flatIndexSections];    //of the sections, per flatSections or compressedSections; unused ones 0
+      };
+      static constexpr uint64_t flatIndexVersion = 9;
+      static constexpr uint64_t checksumPieceSize = 1 << 24;
+      static constexpr uint64_t flatIndexAlignment = 64;
+      static constexpr uint64_t compressedIndexBlockSize = 4096;
+
+      // Read-only view of minmerIndex and the seed table, or of a whole flat sub-index when
+      // memory-mapped (or read in when mapping fails); only the arrays of one encoding are set
+      struct FlatIndexView
+      {
+        bool packed = false;
+        const MinmerInfo* minmers = nullptr;
+        const PackedMinmerInfo* packedMinmers = nullptr;
+        const hash_t* hashes = nullptr;
+        const uint64_t* seedStarts = nullptr;
+        const uint64_t* buckets = nullptr;
+        const uint64_t* filter = nullptr;
+        const IntervalPoint* points = nullptr;
+        const PackedIntervalPoint* packedPoints = nullptr;
+        uint64_t numMinmers = 0;
+        uint64_t numHashes = 0;
+        uint64_t numPoints = 0;
+        uint64_t bucketBits = 0;
+        uint64_t bucketShift = 64;
+        uint64_t filterShift = 63;
+        void* mapping = nullptr;
+        size_t mappingSize = 0;
+        std::unique_ptr<char[]> buffer;
+        size_t bufferSize = 0;
+      } flatIndex;
+
+      // Bytes of this sketch in the memory report
+      memory::Account memoryAccount;
+
+      // Index arrays locked in memory by warmUp
+      pages::Regions lockedRegions;
+
       /**
        * Keep list of minmers, sequence# , their position within seq , here while parsing sequence 
        * Note : position is local within each contig
@@ -120,6 +467,25 @@ namespace skch
       // Instance of the SequenceIdManager
       SequenceIdManager& idManager;
 
+      // Spaced seeds hashed instead of k-mers, if enabled
+      std::unique_ptr<CommonFunc::SpacedSeeds> spacedSeeds;
+
+      // Selection of the k-mers sketched, if restricted to syncmers
+      std::unique_ptr<CommonFunc::Syncmers> syncmers;
+
+      // Low-complexity k-mers passed over, if masked
+      std::unique_ptr<CommonFunc::Dust> dust;
+
+      public:
+
+      // Called with the minmers of each sequence as it is sketched, before frequency
+      // filtering, by the thread that sketched it
+      typedef std::function<void(const MI_Type&)> sketched_hook_t;
+
+      private:
+
+      sketched_hook_t sketchedHook;
+
       public:
 
       /**
@@ -129,15 +495,293 @@ namespace skch
       Sketch(skch::Parameters p,
              SequenceIdManager& idMgr,
              const std::vector<std::string>& targets = {},
-             std::ifstream* indexStream = nullptr)
+             std::ifstream* indexStream = nullptr,
+             sketched_hook_t onSketched = nullptr)
         : param(std::move(p)),
-          idManager(idMgr)
+          idManager(idMgr),
+          sketchedHook(std::move(onSketched))
       {
+        sampling_profiler::ScopedStage profile_stage(sampling_profiler::INDEX);
+        if (param.use_spaced_seeds && !param.spaced_seeds.empty()) {
+          spacedSeeds = std::make_unique<CommonFunc::SpacedSeeds>(param.spaced_seeds);
+        }
+        if (param.syncmer_size > 0) {
+          syncmers = std::make_unique<CommonFunc::Syncmers>(param.syncmer_size);
+        }
+        if (param.dust_threshold > 0) {
+          dust = std::make_unique<CommonFunc::Dust>(param.dust_threshold);
+        }
         if (indexStream) {
           readIndex(*indexStream, targets);
         } else {
           initialize(targets);
         }
+        accountMemory();
+      }
+
+      ~Sketch()
+      {
+        pages::unlock(lockedRegions);
+        releaseFlatIndex();
+      }
+
+      Sketch(const Sketch&) = delete;
+      Sketch& operator=(const Sketch&) = delete;
+
+      /**
+       * @brief   fault the whole index in on threads before mapping, and with lock keep it
+       *          in memory, for a service that must answer its first queries at full speed
+       */
+      void warmUp(int threads, bool lock)
+      {
+        const pages::Regions regions = indexRegions();
+        pages::prefault(regions, threads);
+        if (lock) {
+          lockedRegions = pages::lock(regions);
+          if (lockedRegions.size() < regions.size()) {
+            std::cerr << "[wfmash::mashmap] WARNING, unable to lock all of the index in memory, "
+                      << "the limit on locked memory (ulimit -l) may be too low" << std::endl;
+          }
+        }
+      }
+
+      // Location of a stored sub-index and what an index update needs to know about it
+      struct IndexSubset
+      {
+        std::vector<std::string> sequenceNames;
+        uint64_t offset = 0;                      // file offset of the sub-index
+        uint64_t size = 0;                        // bytes of the sub-index in the file
+        uint64_t countThreshold = 0;              // frequency filter cutoff, 0 if not recorded
+        std::vector<hash_t> frequentHashes;       // sorted hashes it filtered
+        stdfs::path file;                         // index file holding it, when read from several
+      };
+
+      /**
+       * @brief             list the sub-indexes of the index file without loading them
+       * @details           sub-indexes are found through the directory when the file has one,
+       *                    else by skipping over each in turn. Index parameters are checked
+       *                    against and adopted into p as when loading
+       */
+      static std::vector<IndexSubset> scanIndex(skch::Parameters& p, SequenceIdManager& idMgr)
+      {
+        std::ifstream inStream(p.indexFilename, std::ios::binary);
+        if (!inStream) {
+          std::cerr << "Error: Unable to open index file: " << p.indexFilename << std::endl;
+          exit(1);
+        }
+
+        Sketch scanner(idMgr);
+        scanner.param = p;
+        std::vector<IndexSubset> subsets;
+        if (hasIndexDirectory(inStream)) {
+          for (IndexSubset& entry : readIndexDirectory(inStream)) {
+            if (entry.offset == 0) {
+              std::cerr << "[wfmash::mashmap] WARNING, index subset of " << entry.sequenceNames.size()
+                        << " sequences was never written, skipping it" << std::endl;
+              continue;
+            }
+            inStream.seekg(entry.offset);
+            IndexSubset subset = scanner.scanSubIndex(inStream);
+            if (subset.sequenceNames != entry.sequenceNames) {
+              std::cerr << "[wfmash::mashmap] ERROR: Index directory does not match its subsets" << std::endl;
+              exit(1);
+            }
+            subsets.push_back(std::move(subset));
+          }
+        } else {
+          while (inStream.peek() != std::ifstream::traits_type::eof()) {
+            subsets.push_back(scanner.scanSubIndex(inStream));
+          }
+        }
+        p = scanner.param;
+        return subsets;
+      }
+
+      /**
+       * @brief             whether the file opens with the magic number of an index or of
+       *                    its directory
+       */
+      static bool isIndexFile(const stdfs::path& filename)
+      {
+        std::ifstream inStream(filename, std::ios::binary);
+        uint64_t magic_number = 0;
+        if (!inStream.read((char*)&magic_number, sizeof(magic_number))) {
+          return false;
+        }
+        return magic_number == indexMagicDirectory || magic_number == indexMagicLegacy
+            || magic_number == indexMagicHashed || magic_number == indexMagicSeeded
+            || magic_number == indexMagicFlat;
+      }
+
+      /**
+       * @brief             start the index file, or extend it when appending, with a directory
+       *                    of the subsets about to be written by writeIndex
+       * @details           a file being appended to that has no directory is left without one
+       */
+      static void writeIndexDirectory(const std::string& filename,
+                                      const std::vector<std::vector<std::string>>& subsets,
+                                      bool append)
+      {
+        uint64_t previous = 0;
+        if (append) {
+          std::ifstream inStream(filename, std::ios::binary);
+          if (!hasIndexDirectory(inStream))
+            return;
+          readIndexDirectory(inStream, &previous);
+        }
+
+        std::ofstream outStream(filename, std::ios::binary | (append ? std::ios::app : std::ios::trunc));
+        if (!outStream) {
+          std::cerr << "Error: Unable to open index file for writing: " << filename << std::endl;
+          exit(1);
+        }
+        outStream.seekp(0, std::ios::end);
+        const uint64_t directory = outStream.tellp();
+        const uint64_t header[3] = {indexMagicDirectory, subsets.size(), 0};
+        outStream.write((const char*)header, sizeof(header));
+        for (const auto& names : subsets) {
+          const uint64_t entry[3] = {0, 0, names.size()};
+          outStream.write((const char*)entry, sizeof(entry));
+          for (const auto& seqName : names) {
+            const uint64_t name_length = seqName.size();
+            outStream.write((const char*)&name_length, sizeof(name_length));
+            outStream.write(seqName.data(), name_length);
+          }
+        }
+        outStream.close();
+
+        if (append) {
+          patchIndexFile(filename, previous + 2 * sizeof(uint64_t), &directory, 1);
+        }
+      }
+
+      private:
+
+      static bool hasIndexDirectory(std::ifstream& inStream)
+      {
+        uint64_t magic_number = 0;
+        inStream.seekg(0);
+        inStream.read((char*)&magic_number, sizeof(magic_number));
+        inStream.clear();
+        inStream.seekg(0);
+        return magic_number == indexMagicDirectory;
+      }
+
+      /**
+       * @brief             read every entry of the directory chain opening inStream
+       * @param[out] last   offset of the last directory of the chain
+       * @param[out] fields file offset of the offset field of each entry
+       */
+      static std::vector<IndexSubset> readIndexDirectory(std::ifstream& inStream, uint64_t* last = nullptr,
+                                                         std::vector<uint64_t>* fields = nullptr)
+      {
+        std::vector<IndexSubset> entries;
+        uint64_t directory = 0;
+        do {
+          inStream.seekg(directory);
+          uint64_t header[3] = {};
+          inStream.read((char*)header, sizeof(header));
+          if (!inStream || header[0] != indexMagicDirectory) {
+            std::cerr << "[wfmash::mashmap] ERROR: Corrupt index directory" << std::endl;
+            exit(1);
+          }
+          for (uint64_t i = 0; i < header[1]; ++i) {
+            if (fields)
+              fields->push_back(inStream.tellg());
+            IndexSubset entry;
+            uint64_t num_sequences = 0;
+            inStream.read((char*)&entry.offset, sizeof(entry.offset));
+            inStream.read((char*)&entry.size, sizeof(entry.size));
+            inStream.read((char*)&num_sequences, sizeof(num_sequences));
+            for (uint64_t j = 0; j < num_sequences; ++j) {
+              uint64_t name_length = 0;
+              inStream.read((char*)&name_length, sizeof(name_length));
+              std::string seqName(name_length, '\0');
+              inStream.read(&seqName[0], name_length);
+              entry.sequenceNames.push_back(std::move(seqName));
+            }
+            entries.push_back(std::move(entry));
+          }
+          if (last)
+            *last = directory;
+          directory = header[2];
+        } while (directory);
+        return entries;
+      }
+
+      /**
+       * @brief             record where the sub-index of these sequences was written in the
+       *                    first directory entry still waiting for it, if the file has a directory
+       */
+      static void registerSubIndex(const std::string& filename, const std::vector<std::string>& sequenceNames,
+                                   uint64_t offset, uint64_t size)
+      {
+        std::ifstream inStream(filename, std::ios::binary);
+        if (!hasIndexDirectory(inStream))
+          return;
+        std::vector<uint64_t> fields;
+        const std::vector<IndexSubset> entries = readIndexDirectory(inStream, nullptr, &fields);
+        inStream.close();
+        for (size_t i = 0; i < entries.size(); ++i) {
+          if (entries[i].offset == 0 && entries[i].sequenceNames == sequenceNames) {
+            const uint64_t location[2] = {offset, size};
+            patchIndexFile(filename, fields[i], location, 2);
+            return;
+          }
+        }
+      }
+
+      static void patchIndexFile(const std::string& filename, uint64_t pos, const uint64_t* values, size_t count)
+      {
+        std::fstream stream(filename, std::ios::binary | std::ios::in | std::ios::out);
+        stream.seekp(pos);
+        stream.write((const char*)values, count * sizeof(uint64_t));
+        if (!stream) {
+          std::cerr << "Error: Unable to update index directory in " << filename << std::endl;
+          exit(1);
+        }
+      }
+
+      /**
+       * @brief             read the head of the sub-index at the stream position and leave the
+       *                    stream after it
+       */
+      IndexSubset scanSubIndex(std::ifstream& inStream)
+      {
+        IndexSubset subset;
+        subset.offset = inStream.tellg();
+        subset.sequenceNames = readSubIndexNames(inStream);
+        readParameters(inStream);
+        if (indexMagic == indexMagicFlat) {
+          const FlatIndexHeader header = readFlatIndexHeader(inStream);
+          adoptSyncmerSize(header.syncmerSize);
+          adoptWorldMinimizers(header.worldMinimizers);
+          adoptDustThreshold(header.dustThreshold);
+          subset.countThreshold = header.countThreshold;
+          subset.frequentHashes.resize(header.numFrequent);
+          inStream.seekg(header.frequentOffset);
+          inStream.read((char*)subset.frequentHashes.data(), header.numFrequent * sizeof(hash_t));
+          inStream.seekg(header.endOffset);
+        } else {
+          // Minmers, then the position list of each hash
+          typename MI_Type::size_type numMinmers = 0;
+          inStream.read((char*)&numMinmers, sizeof(numMinmers));
+          inStream.seekg(numMinmers * sizeof(MinmerInfo), std::ios::cur);
+          typename MI_Map_t::size_type numKeys = 0;
+          inStream.read((char*)&numKeys, sizeof(numKeys));
+          for (typename MI_Map_t::size_type i = 0; i < numKeys; ++i) {
+            typename MinmerMapValueType::size_type numPoints = 0;
+            inStream.seekg(sizeof(MinmerMapKeyType), std::ios::cur);
+            inStream.read((char*)&numPoints, sizeof(numPoints));
+            inStream.seekg(numPoints * sizeof(MinmerMapValueType::value_type), std::ios::cur);
+          }
+        }
+        if (!inStream) {
+          std::cerr << "[wfmash::mashmap] ERROR: Truncated index file" << std::endl;
+          exit(1);
+        }
+        subset.size = uint64_t(inStream.tellg()) - subset.offset;
+        return subset;
       }
 
     public:
@@ -175,201 +819,344 @@ namespace skch
               total_seq_length,
               "[wfmash::mashmap] computing sketch");
 
+          // With approximate filtering, minmers are counted by the threads sketching them
+          std::unique_ptr<CountMinSketch> approx_freqs;
+          if (param.approx_kmer_freq) {
+              approx_freqs = std::make_unique<CountMinSketch>(
+                  2 * param.sketchSize * total_seq_length / param.segLength);
+          }
+
           // Create the thread pool 
-          ThreadPool<InputSeqContainer, MI_Type> threadPool(
-              [this, &sketch_progress](InputSeqContainer* e) { 
-                  return buildHelper(e, &sketch_progress); 
+          ThreadPool<SketchSlice, MI_Type> threadPool(
+              [this, &sketch_progress, &approx_freqs](SketchSlice* e) { 
+                  MI_Type* output = buildHelper(e, &sketch_progress); 
+                  if (output && sketchedHook) {
+                      sketchedHook(*output);
+                  }
+                  if (output && approx_freqs) {
+                      for (const MinmerInfo& mi : *output) {
+                          approx_freqs->add(mi.hash);
+                      }
+                  }
+                  return output;
               }, 
               param.threads);
 
           size_t totalSeqProcessed = 0;
           size_t totalSeqSkipped = 0;
+          std::unordered_set<int> refGroups;
           size_t shortestSeqLength = std::numeric_limits<size_t>::max();
           
-          // Vector to store all thread outputs
-          std::vector<MI_Type*> threadOutputs;
+          // Thread outputs arrive in sequence order and go straight into minmerIndex
+          minmerIndex.clear();
+          const auto collect = [this](MI_Type* output) {
+              if (output) {
+                  minmerIndex.insert(minmerIndex.end(), output->begin(), output->end());
+                  delete output;
+              }
+          };
+
+          const auto sketchSequence = [&](const std::string& seq_name, seqiter::seq_buffer_t seq, int64_t len, offset_t offset) {
+              if (len >= param.segLength) {
+                  seqno_t seqId = idManager.getSequenceId(seq_name);
+                  refGroups.insert(idManager.getRefGroup(seqId));
+                  for (SketchSlice* slice : makeSketchSlices(std::move(seq), len, seqId, offset)) {
+                      // The ring holds the outputs until they are collected here
+                      while (threadPool.full()) {
+                          collect(threadPool.popOutputWhenAvailable());
+                      }
+                      threadPool.runWhenThreadAvailable(slice);
+
+                      while (threadPool.outputAvailable()) {
+                          collect(threadPool.popOutputWhenAvailable());
+                      }
+                  }
+                  totalSeqProcessed++;
+                  shortestSeqLength = std::min<size_t>(shortestSeqLength, len);
+              } else {
+                  totalSeqSkipped++;
+                  std::cerr << "WARNING, skch::Sketch::build, skipping short sequence: " << seq_name
+                           << (param.target_regions ? " region at " + std::to_string(offset) : std::string())
+                           << " (length: " << len << ")" << std::endl;
+              }
+          };
 
           for (const auto& fileName : param.refSequences) {
-              seqiter::for_each_seq_in_file(
+              if (param.target_regions) {
+                  // Only the intervals of the BED, in sequence and position order, so the
+                  // minmers still arrive sorted
+                  faidx_t* fai = fai_load(fileName.c_str());
+                  for (const auto& seq_name : target_names) {
+                      if (!faidx_has_seq(fai, seq_name.c_str())) {
+                          continue;
+                      }
+                      const offset_t seqLength = idManager.getSequenceLength(idManager.getSequenceId(seq_name));
+                      param.target_regions->forEach(seq_name, seqLength, [&](offset_t start, offset_t end) {
+                          int64_t len = 0;
+                          char* seq = faidx_fetch_seq64(fai, seq_name.c_str(), start, end - 1, &len);
+                          if (seq != nullptr) {
+                              sketchSequence(seq_name, seqiter::seq_buffer_t(seq, &std::free), len, start);
+                          }
+                      });
+                  }
+                  fai_destroy(fai);
+                  continue;
+              }
+              seqiter::for_each_seq_buffer_in_file(
                   fileName,
                   target_names,
-                  [&](const std::string& seq_name, const std::string& seq) {
-                      if (seq.length() >= param.segLength) {
-                          seqno_t seqId = idManager.getSequenceId(seq_name);
-                          threadPool.runWhenThreadAvailable(new InputSeqContainer(seq, seq_name, seqId));
-                          totalSeqProcessed++;
-                          shortestSeqLength = std::min(shortestSeqLength, seq.length());
-
-                          while (threadPool.outputAvailable()) {
-                              auto output = threadPool.popOutputWhenAvailable();
-                              threadOutputs.push_back(output);
-                          }
-                      } else {
-                          totalSeqSkipped++;
-                          std::cerr << "WARNING, skch::Sketch::build, skipping short sequence: " << seq_name 
-                                   << " (length: " << seq.length() << ")" << std::endl;
-                      }
+                  [&](const std::string& seq_name, seqiter::seq_buffer_t seq, int64_t len) {
+                      shared_sequences::shared().add(fileName, seq_name, seq.get(), len);
+                      sketchSequence(seq_name, std::move(seq), len, 0);
                   });
           }
 
           while (threadPool.running()) {
-              auto output = threadPool.popOutputWhenAvailable();
-              threadOutputs.push_back(output);
+              collect(threadPool.popOutputWhenAvailable());
           }
 
           // Make sure to finish first progress meter before starting the next
           sketch_progress.finish();
 
-          // Calculate total windows for index building progress
-          uint64_t total_windows = 0;
-          for (const auto& output : threadOutputs) {
-              total_windows += output->size();
-          }
+          // Total windows for index building progress
+          const uint64_t total_windows = minmerIndex.size();
 
           // Second progress meter for index building
           progress_meter::ProgressMeter index_progress(
               total_windows,
               "[wfmash::mashmap] building index");
 
-          // Parallel k-mer frequency counting
-          std::vector<HF_Map_t> thread_kmer_freqs(param.threads);
-          std::vector<std::thread> freq_threads;
-          
-          // Split outputs into chunks for parallel processing
-          size_t chunk_size = (threadOutputs.size() + param.threads - 1) / param.threads;
-          
-          for (size_t t = 0; t < param.threads; ++t) {
-              freq_threads.emplace_back([&, t]() {
-                  size_t start = t * chunk_size;
-                  size_t end = std::min(start + chunk_size, threadOutputs.size());
-                  
-                  for (size_t i = start; i < end; ++i) {
-                      for (const MinmerInfo& mi : *threadOutputs[i]) {
-                          thread_kmer_freqs[t][mi.hash]++;
-                      }
+          // Hash-partitioned index building: each partition owns a disjoint range of the
+          // hash space, so its frequencies and position lists need no merge across threads
+          int partition_bits = 0;
+          while ((size_t(1) << partition_bits) < param.threads)
+              partition_bits++;
+          const size_t num_partitions = size_t(1) << partition_bits;
+          const auto partition_of = [partition_bits](hash_t hash) -> size_t {
+              return partition_bits == 0 ? 0 : hash >> (64 - partition_bits);
+          };
+
+          const auto run_parallel = [this](const std::function<void(size_t)>& work) {
+              std::vector<std::thread> threads;
+              for (size_t t = 0; t < param.threads; ++t) {
+                  threads.emplace_back([&work, t]() {
+                      sampling_profiler::name_thread("index", sampling_profiler::INDEX, t);
+                      work(t);
+                  });
+              }
+              for (auto& thread : threads) {
+                  thread.join();
+              }
+          };
+
+          // A pangenome index counts the windows of a hash in each prefix group, one genome,
+          // and filters the hashes with too many copies in some group, against the windows
+          // of one group when given as a fraction
+          const bool per_group = param.pangenome_index;
+          const uint64_t num_groups = per_group ? std::max<size_t>(1, refGroups.size()) : 1;
+          const uint64_t min_occ = 10;
+          const uint64_t max_occ = std::numeric_limits<uint64_t>::max();
+          // With auto_kmer_freq the cutoff is only chosen once every partition is counted
+          const bool auto_threshold = param.auto_kmer_freq;
+          uint64_t count_threshold = param.max_kmer_freq <= 1.0
+              ? std::min(max_occ, std::max(min_occ, (uint64_t)(total_windows / num_groups * param.max_kmer_freq)))
+              : std::min(max_occ, std::max(min_occ, (uint64_t)param.max_kmer_freq));
+          const auto is_frequent = [&](uint64_t freq) {
+              return freq > count_threshold && freq > min_occ;
+          };
+          // Hashes with more copies than every group may hold, filtered without a group count
+          const auto is_frequent_overall = [&](uint64_t freq) {
+              return is_frequent(freq / num_groups);
+          };
+          // Most windows of the hash in one group, its seed list having a point opening each
+          const auto group_copies = [&](const MinmerMapValueType& pos_list) {
+              std::vector<int> groups;
+              for (const IntervalPoint& ip : pos_list) {
+                  if (ip.side == side::OPEN) {
+                      groups.push_back(idManager.getRefGroup(ip.seqId));
                   }
-              });
-          }
-          
-          for (auto& thread : freq_threads) {
-              thread.join();
-          }
-
-          // Merge frequency maps
-          HF_Map_t kmer_freqs;
-          for (const auto& thread_freq : thread_kmer_freqs) {
-              for (const auto& [hash, freq] : thread_freq) {
-                  kmer_freqs[hash] += freq;
               }
-          }
-
-          // Parallel index building
-          std::vector<MI_Map_t> thread_pos_indexes(param.threads);
-          std::vector<MI_Type> thread_minmer_indexes(param.threads);
-          std::vector<uint64_t> thread_total_kmers(param.threads, 0);
-          std::vector<uint64_t> thread_filtered_kmers(param.threads, 0);
-          std::vector<std::thread> index_threads;
-
-          for (size_t t = 0; t < param.threads; ++t) {
-              index_threads.emplace_back([&, t]() {
-                  size_t start = t * chunk_size;
-                  size_t end = std::min(start + chunk_size, threadOutputs.size());
-
-                  for (size_t i = start; i < end; ++i) {
-                      for (const MinmerInfo& mi : *threadOutputs[i]) {
-                          thread_total_kmers[t]++;
-                          
-                          auto freq_it = kmer_freqs.find(mi.hash);
-                          if (freq_it == kmer_freqs.end()) {
-                              continue;  // Should never happen
-                          }
-
-                          uint64_t freq = freq_it->second;
-                          uint64_t min_occ = 10;
-                          uint64_t max_occ = std::numeric_limits<uint64_t>::max();
-                          uint64_t count_threshold;
-                          
-                          if (param.max_kmer_freq <= 1.0) {
-                              count_threshold = std::min(max_occ, 
-                                                       std::max(min_occ, 
-                                                              (uint64_t)(total_windows * param.max_kmer_freq)));
-                          } else {
-                              count_threshold = std::min(max_occ,
-                                                       std::max(min_occ,
-                                                              (uint64_t)param.max_kmer_freq));
-                          }
-
-                          if (freq > count_threshold && freq > min_occ) {
-                              thread_filtered_kmers[t]++;
+              std::sort(groups.begin(), groups.end());
+              uint64_t most = 0;
+              for (auto it = groups.begin(); it != groups.end(); ) {
+                  const auto next = std::upper_bound(it, groups.end(), *it);
+                  most = std::max<uint64_t>(most, next - it);
+                  it = next;
+              }
+              return most;
+          };
+          // Hashes filtered by the index this build is added to stay filtered
+          const auto is_indexed_frequent = [this](hash_t hash) {
+              return std::binary_search(param.frequent_hashes.begin(), param.frequent_hashes.end(), hash);
+          };
+
+          // Split minmerIndex into one chunk per thread
+          const size_t chunk_size = (minmerIndex.size() + param.threads - 1) / param.threads;
+          const auto chunk_begin = [&](size_t t) { return std::min(t * chunk_size, minmerIndex.size()); };
+
+          // Scatter the minmers of every chunk by hash partition
+          std::vector<std::vector<std::vector<const MinmerInfo*>>> scattered(
+              param.threads, std::vector<std::vector<const MinmerInfo*>>(num_partitions));
+          run_parallel([&](size_t t) {
+              for (size_t i = chunk_begin(t); i < chunk_begin(t + 1); ++i) {
+                  scattered[t][partition_of(minmerIndex[i].hash)].push_back(&minmerIndex[i]);
+              }
+          });
+
+          // Count frequencies and build the seed lists of each partition in one pass; visiting
+          // chunks in order keeps every list sorted by sequence and position. A list only
+          // depends on the minmers of its own hash, so frequent hashes are dropped afterwards
+          // and only they outlive the partition's counts. With approximate filtering the
+          // count-min sketch already knows the frequent hashes and they are skipped instead,
+          // though a pangenome index still counts the others to check them group by group
+          std::vector<SeedTable> partition_seeds(num_partitions);
+          std::vector<std::vector<hash_t>> partition_frequent(num_partitions);
+          std::vector<uint64_t> partition_total_kmers(num_partitions, 0);
+          std::vector<uint64_t> partition_filtered_kmers(num_partitions, 0);
+          std::vector<HF_Map_t> partition_freqs(auto_threshold ? num_partitions : 0);
+          std::vector<std::vector<MI_Map_t>> partition_pos(auto_threshold ? num_partitions : 0);
+
+          // Drop the frequent hashes of a counted partition and pack its seed lists
+          const auto finish_partition = [&](size_t p, HF_Map_t& kmer_freqs, std::vector<MI_Map_t>& pos_index) {
+              for (const auto& [hash, freq] : kmer_freqs) {
+                  if (is_frequent(freq) && (!per_group || is_frequent(group_copies(pos_index.front()[hash])))) {
+                      partition_frequent[p].push_back(hash);
+                      partition_filtered_kmers[p] += freq;
+                      pos_index.front().erase(hash);
+                  }
+              }
+              memory::Account buildAccount;
+              if (memory::enabled()) {
+                  uint64_t bytes = kmer_freqs.size() * sizeof(std::pair<hash_t, uint64_t>) + kmer_freqs.bucket_count() * sizeof(uint64_t)
+                      + pos_index.front().size() * sizeof(std::pair<hash_t, MinmerMapValueType>) + pos_index.front().bucket_count() * sizeof(uint64_t);
+                  for (const auto& [hash, pos_list] : pos_index.front()) {
+                      bytes += pos_list.capacity() * sizeof(IntervalPoint);
+                  }
+                  buildAccount.set(memory::INDEX_BUILD, bytes);
+              }
+              std::sort(partition_frequent[p].begin(), partition_frequent[p].end());
+              partition_frequent[p].erase(
+                  std::unique(partition_frequent[p].begin(), partition_frequent[p].end()),
+                  partition_frequent[p].end());
+              partition_seeds[p] = packSeedLists(pos_index);
+          };
+
+          std::atomic<size_t> next_partition(0);
+          run_parallel([&](size_t) {
+              for (size_t p = next_partition++; p < num_partitions; p = next_partition++) {
+                  HF_Map_t kmer_freqs;
+                  std::vector<MI_Map_t> pos_index(1);
+                  for (size_t t = 0; t < param.threads; ++t) {
+                      for (const MinmerInfo* mi : scattered[t][p]) {
+                          if (is_indexed_frequent(mi->hash)
+                                  || (approx_freqs && is_frequent_overall(approx_freqs->estimate(mi->hash)))) {
+                              partition_frequent[p].push_back(mi->hash);
+                              partition_filtered_kmers[p]++;
                               continue;
                           }
+                          if (!approx_freqs || per_group) {
+                              kmer_freqs[mi->hash]++;
+                          }
 
-                          auto& pos_list = thread_pos_indexes[t][mi.hash];
+                          auto& pos_list = pos_index.front()[mi->hash];
                           if (pos_list.size() == 0 
-                                  || pos_list.back().hash != mi.hash 
-                                  || pos_list.back().pos != mi.wpos) {
-                              pos_list.push_back(IntervalPoint {mi.wpos, mi.hash, mi.seqId, side::OPEN});
-                              pos_list.push_back(IntervalPoint {mi.wpos_end, mi.hash, mi.seqId, side::CLOSE});
+                                  || pos_list.back().hash != mi->hash 
+                                  || pos_list.back().pos != mi->wpos) {
+                              pos_list.push_back(IntervalPoint {mi->wpos, mi->hash, mi->seqId, side::OPEN});
+                              pos_list.push_back(IntervalPoint {mi->wpos_end, mi->hash, mi->seqId, side::CLOSE});
                           } else {
-                              pos_list.back().pos = mi.wpos_end;
+                              pos_list.back().pos = mi->wpos_end;
                           }
-
-                          thread_minmer_indexes[t].push_back(mi);
-                          index_progress.increment(1);
                       }
-                      delete threadOutputs[i];
+                      partition_total_kmers[p] += scattered[t][p].size();
+                      index_progress.increment(scattered[t][p].size());
+                      std::vector<const MinmerInfo*>().swap(scattered[t][p]);
+                  }
+
+                  if (auto_threshold) {
+                      partition_freqs[p] = std::move(kmer_freqs);
+                      partition_pos[p] = std::move(pos_index);
+                  } else {
+                      finish_partition(p, kmer_freqs, pos_index);
+                  }
+              }
+          });
+          scattered.clear();
+
+          if (auto_threshold) {
+              // Hashes by their count of windows over all partitions; a pangenome index
+              // compares the cutoff with the copies in a group, so takes its share of one
+              std::map<uint64_t, uint64_t> histogram;
+              for (const auto& kmer_freqs : partition_freqs) {
+                  for (const auto& [hash, freq] : kmer_freqs) {
+                      histogram[freq]++;
+                  }
+              }
+              const uint64_t cutoff = kneeCutoff(std::vector<std::pair<uint64_t, uint64_t>>(histogram.begin(), histogram.end()),
+                                                 param.sketchSize, param.kmer_hit_budget);
+              count_threshold = std::max(min_occ, cutoff / num_groups);
+              param.max_kmer_freq = count_threshold;
+              std::cerr << "[wfmash::mashmap] Chose a frequency cutoff of " << count_threshold << " windows"
+                        << (param.kmer_hit_budget > 0 ? " for at most " + std::to_string((uint64_t)param.kmer_hit_budget) + " L1 hits per fragment"
+                                                      : std::string(" at the knee of the windows kept against the L1 hits"))
+                        << std::endl;
+              next_partition = 0;
+              run_parallel([&](size_t) {
+                  for (size_t p = next_partition++; p < num_partitions; p = next_partition++) {
+                      finish_partition(p, partition_freqs[p], partition_pos[p]);
+                      HF_Map_t().swap(partition_freqs[p]);
+                      std::vector<MI_Map_t>().swap(partition_pos[p]);
                   }
               });
           }
 
-          for (auto& thread : index_threads) {
-              thread.join();
-          }
+          uint64_t total_kmers = std::accumulate(partition_total_kmers.begin(), partition_total_kmers.end(), 0ULL);
+          uint64_t filtered_kmers = std::accumulate(partition_filtered_kmers.begin(), partition_filtered_kmers.end(), 0ULL);
 
-          // Merge results
-          uint64_t total_kmers = std::accumulate(thread_total_kmers.begin(), thread_total_kmers.end(), 0ULL);
-          uint64_t filtered_kmers = std::accumulate(thread_filtered_kmers.begin(), thread_filtered_kmers.end(), 0ULL);
+          // Partitions cover increasing hash ranges, so their tables concatenate in order
+          joinSeedTables(partition_seeds);
 
-          // Clear and resize main indexes
-          minmerPosLookupIndex.clear();
-          minmerIndex.clear();
-          
-          // Reserve approximate space
-          size_t total_minmers = 0;
-          for (const auto& thread_index : thread_minmer_indexes) {
-              total_minmers += thread_index.size();
-          }
-          minmerIndex.reserve(total_minmers);
-
-          // Merge position lookup indexes
-          for (auto& thread_pos_index : thread_pos_indexes) {
-              for (auto& [hash, pos_list] : thread_pos_index) {
-                  auto& main_pos_list = minmerPosLookupIndex[hash];
-                  main_pos_list.insert(main_pos_list.end(), pos_list.begin(), pos_list.end());
-              }
+          // Partitions are in hash order, so this stays sorted
+          countThreshold = count_threshold;
+          frequentHashes.clear();
+          for (const auto& frequent : partition_frequent) {
+              frequentHashes.insert(frequentHashes.end(), frequent.begin(), frequent.end());
           }
-
-          // Merge minmer indexes
-          for (auto& thread_index : thread_minmer_indexes) {
-              minmerIndex.insert(minmerIndex.end(), 
-                               std::make_move_iterator(thread_index.begin()),
-                               std::make_move_iterator(thread_index.end()));
+          std::vector<std::vector<hash_t>>().swap(partition_frequent);
+          approx_freqs.reset();
+          const auto is_filtered = [&](const MinmerInfo& mi) {
+              return std::binary_search(frequentHashes.begin(), frequentHashes.end(), mi.hash);
+          };
+
+          // Drop filtered minmers from minmerIndex in place: each thread compacts its own
+          // chunk, then the chunks are moved together in order
+          std::vector<size_t> chunk_kept(param.threads, 0);
+          run_parallel([&](size_t t) {
+              auto begin = minmerIndex.begin() + chunk_begin(t);
+              chunk_kept[t] = std::remove_if(begin, minmerIndex.begin() + chunk_begin(t + 1), is_filtered) - begin;
+          });
+          auto out = minmerIndex.begin();
+          for (size_t t = 0; t < param.threads; ++t) {
+              auto begin = minmerIndex.begin() + chunk_begin(t);
+              out = std::move(begin, begin + chunk_kept[t], out);
           }
+          minmerIndex.erase(out, minmerIndex.end());
           
           // Finish second progress meter
           index_progress.finish();
 
           uint64_t freq_cutoff;
           if (param.max_kmer_freq <= 1.0) {
-              freq_cutoff = std::max(1UL, (uint64_t)(total_windows * param.max_kmer_freq));
+              freq_cutoff = std::max(1UL, (uint64_t)(total_windows / num_groups * param.max_kmer_freq));
           } else {
               freq_cutoff = (uint64_t)param.max_kmer_freq;
           }
           std::cerr << "[wfmash::mashmap] Processed " << totalSeqProcessed << " sequences (" << totalSeqSkipped << " skipped, " << total_seq_length << " total bp), " 
-                    << minmerPosLookupIndex.size() << " unique hashes, " << minmerIndex.size() << " windows" << std::endl
+                    << seedTable.hashes.size() << " unique hashes, " << minmerIndex.size() << " windows" << std::endl
                     << "[wfmash::mashmap] Filtered " << filtered_kmers << "/" << total_kmers 
                     << " k-mers occurring > " << freq_cutoff << " times"
-                    << " (target: " << (param.max_kmer_freq <= 1.0 ? 
+                    << (per_group ? " in a group of " + std::to_string(num_groups) : std::string())
+                    << " (target: " << (auto_threshold ? std::string("auto") : param.max_kmer_freq <= 1.0 ? 
                                       ([&]() { 
                                           std::stringstream ss;
                                           ss << std::fixed << std::setprecision(2) << (param.max_kmer_freq * 100);
@@ -382,7 +1169,9 @@ namespace skch
         std::chrono::duration<double> timeRefSketch = skch::Time::now() - t0;
         std::cerr << "[wfmash::mashmap] reference index computed in " << timeRefSketch.count() << "s" << std::endl;
 
-        if (this->minmerIndex.size() == 0)
+        compactIndex();
+
+        if (flatIndex.numMinmers == 0)
         {
           std::cerr << "[wfmash::mashmap] ERROR, reference sketch is empty. "
                     << "Reference sequences shorter than the kmer size are not indexed" << std::endl;
@@ -390,124 +1179,666 @@ namespace skch
         }
       }
 
-      public:
+      public:
+
+      /**
+       * @brief     Split a reference sequence into slices that can be sketched concurrently
+       * @details   Sequences longer than a few slices worth of windows are cut into runs
+       *            of windows; each slice starts at the last window of the previous one so
+       *            the stitched minmers are identical to sketching the whole sequence.
+       *            Shorter sequences become a single slice.
+       */
+      std::vector<SketchSlice*> makeSketchSlices(SeqBuffer&& seq, offset_t len, seqno_t seqId, offset_t offset = 0)
+      {
+        auto group = std::make_shared<SketchSliceGroup>();
+        group->seq = std::move(seq);
+        group->seqId = seqId;
+        group->offset = offset;
+
+        const offset_t totalWindows = len - param.segLength + 1;
+        const offset_t sliceWindows = std::max<offset_t>(sketchSliceLength, 16 * param.segLength);
+
+        std::vector<SketchSlice*> slices;
+        if (totalWindows < 2 * sliceWindows) {
+          slices.push_back(new SketchSlice{group, 0, 0, len});
+        } else {
+          // Upper-case once up front, slices overlap and must not write concurrently
+          CommonFunc::makeUpperCaseAndValid(group->seq.get(), len, param.alphabetSize);
+          const size_t count = totalWindows / sliceWindows;
+          for (size_t i = 0; i < count; ++i) {
+            const offset_t firstWindow = i == 0 ? 0 : i * sliceWindows - 1;
+            const offset_t endWindow = i + 1 == count ? totalWindows : (i + 1) * sliceWindows;
+            slices.push_back(new SketchSlice{group, i, firstWindow,
+                endWindow - 1 + param.segLength - firstWindow});
+          }
+        }
+
+        for (const SketchSlice* slice : slices)
+          group->begins.push_back(slice->begin);
+        group->intervals.resize(slices.size());
+        group->open.resize(slices.size());
+        group->remaining = slices.size();
+        return slices;
+      }
+
+      /**
+       * @brief               function to compute minmers given a slice of a reference sequence
+       * @details             this function is run in parallel by multiple threads
+       * @param[in]   slice   slice of a reference sequence, deleted by the thread pool
+       * @return              minmers of the whole sequence once its last slice is done, else null
+       */
+      MI_Type* buildHelper(SketchSlice *slice, progress_meter::ProgressMeter* progress)
+      {
+        SketchSliceGroup& group = *slice->group;
+
+        if (param.world_minimizers) {
+          return worldHelper(slice, progress);
+        }
+
+        if (group.intervals.size() == 1) {
+          MI_Type* thread_output = new MI_Type();
+
+          //Compute minmers in reference sequence
+          skch::CommonFunc::addMinmers(
+                  *thread_output, 
+                  group.seq.get(), 
+                  slice->len, 
+                  param.kmerSize, 
+                  param.segLength, 
+                  param.alphabetSize, 
+                  param.sketchSize,
+                  group.seqId,
+                  param.kmerHashEngine,
+                  progress,
+                  spacedSeeds.get(),
+                  syncmers.get(),
+                  dust.get());
+
+          shiftMinmers(*thread_output, group.offset);
+          return thread_output;
+        }
+
+        const bool last = slice->index + 1 == group.intervals.size();
+        skch::CommonFunc::computeMinmerIntervals(
+                group.intervals[slice->index],
+                group.seq.get() + slice->begin,
+                slice->len,
+                param.kmerSize,
+                param.segLength,
+                param.alphabetSize,
+                param.sketchSize,
+                group.seqId,
+                param.kmerHashEngine,
+                progress,
+                slice->begin,
+                last ? nullptr : &group.open[slice->index],
+                spacedSeeds.get(),
+                syncmers.get(),
+                dust.get());
+
+        // The thread finishing the last outstanding slice stitches the sequence together
+        if (group.remaining.fetch_sub(1) != 1) {
+          return nullptr;
+        }
+
+        MI_Type* thread_output = new MI_Type(std::move(group.intervals[0]));
+        for (size_t i = 1; i < group.intervals.size(); ++i) {
+          skch::CommonFunc::stitchMinmerIntervals(
+                  *thread_output,
+                  group.intervals[i],
+                  group.open[i],
+                  group.open[i - 1],
+                  group.begins[i]);
+          MI_Type().swap(group.intervals[i]);
+        }
+        skch::CommonFunc::finalizeMinmers(*thread_output, param.segLength);
+
+        shiftMinmers(*thread_output, group.offset);
+        return thread_output;
+      }
+
+      /**
+       * @brief   buildHelper sampling world minimizers: each slice samples the k-mers it owns,
+       *          up to the first of the next slice, and the last one merges them
+       */
+      MI_Type* worldHelper(SketchSlice *slice, progress_meter::ProgressMeter* progress)
+      {
+        SketchSliceGroup& group = *slice->group;
+        const bool last = slice->index + 1 == group.intervals.size();
+        if (group.intervals.size() == 1) {
+          CommonFunc::makeUpperCaseAndValid(group.seq.get(), slice->len, param.alphabetSize);
+        }
+        skch::CommonFunc::computeWorldMinmers(
+                group.intervals[slice->index],
+                group.seq.get() + slice->begin,
+                slice->len,
+                last ? slice->len : group.begins[slice->index + 1] - slice->begin,
+                param.kmerSize,
+                param.segLength,
+                param.alphabetSize,
+                CommonFunc::worldHashThreshold(param.sketchSize, param.segLength, param.kmerSize, param.alphabetSize),
+                group.seqId,
+                param.kmerHashEngine,
+                progress,
+                slice->begin,
+                spacedSeeds.get(),
+                syncmers.get(),
+                dust.get());
+
+        if (group.remaining.fetch_sub(1) != 1) {
+          return nullptr;
+        }
+
+        MI_Type* thread_output = new MI_Type(std::move(group.intervals[0]));
+        for (size_t i = 1; i < group.intervals.size(); ++i) {
+          thread_output->insert(thread_output->end(), group.intervals[i].begin(), group.intervals[i].end());
+          MI_Type().swap(group.intervals[i]);
+        }
+        skch::CommonFunc::mergeWorldMinmers(*thread_output);
+        skch::CommonFunc::finalizeMinmers(*thread_output, param.segLength);
+
+        shiftMinmers(*thread_output, group.offset);
+        return thread_output;
+      }
+
+      // Minmers of a region, sketched on its own, to the positions of its sequence
+      static void shiftMinmers(MI_Type& minmers, offset_t offset)
+      {
+        if (offset == 0) {
+          return;
+        }
+        for (MinmerInfo& mi : minmers) {
+          mi.wpos += offset;
+          mi.wpos_end += offset;
+        }
+      }
+
+      /**
+       * @brief                 pack hash -> interval points maps into the seed table
+       * @param[in] posIndexes  hash -> interval points maps, released
+       */
+      void buildSeedTable(std::vector<MI_Map_t>& posIndexes)
+      {
+        seedTable = packSeedLists(posIndexes);
+        indexSeedBuckets(seedTable);
+      }
+
+      /**
+       * @brief                 sort seed position lists into the hashes, starts and points
+       *                        of a seed table, without its buckets
+       * @details               lists of a hash found in several maps are concatenated in map
+       *                        order; the maps are released
+       */
+      static SeedTable packSeedLists(std::vector<MI_Map_t>& posIndexes)
+      {
+        std::vector<std::pair<hash_t, uint32_t>> keys;
+        size_t numPoints = 0;
+        for (uint32_t t = 0; t < posIndexes.size(); ++t) {
+          for (const auto& [hash, pos_list] : posIndexes[t]) {
+            keys.emplace_back(hash, t);
+            numPoints += pos_list.size();
+          }
+        }
+        std::sort(keys.begin(), keys.end());
+
+        SeedTable table;
+        table.points.reserve(numPoints);
+        table.starts.push_back(0);
+        for (const auto& [hash, t] : keys) {
+          if (!table.hashes.empty() && table.hashes.back() != hash)
+            table.starts.push_back(table.points.size());
+          if (table.hashes.empty() || table.hashes.back() != hash)
+            table.hashes.push_back(hash);
+          const auto& pos_list = posIndexes[t].find(hash)->second;
+          table.points.insert(table.points.end(), pos_list.begin(), pos_list.end());
+        }
+        table.starts.push_back(table.points.size());
+        if (table.hashes.empty())
+          table.starts.resize(1);
+
+        std::vector<MI_Map_t>().swap(posIndexes);
+        return table;
+      }
+
+      /**
+       * @brief                 concatenate seed tables of increasing, disjoint hash ranges
+       *                        into the seed table, copying them in parallel
+       */
+      void joinSeedTables(std::vector<SeedTable>& parts)
+      {
+        std::vector<uint64_t> hashOffsets(parts.size() + 1, 0);
+        std::vector<uint64_t> pointOffsets(parts.size() + 1, 0);
+        for (size_t p = 0; p < parts.size(); ++p) {
+          hashOffsets[p + 1] = hashOffsets[p] + parts[p].hashes.size();
+          pointOffsets[p + 1] = pointOffsets[p] + parts[p].points.size();
+        }
+
+        SeedTable table;
+        table.hashes.resize(hashOffsets.back());
+        table.starts.resize(hashOffsets.back() + 1);
+        table.points.resize(pointOffsets.back());
+        table.starts.back() = pointOffsets.back();
+
+        std::atomic<size_t> next(0);
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < std::min<size_t>(param.threads, parts.size()); ++t) {
+          threads.emplace_back([&, t]() {
+            sampling_profiler::name_thread("index", sampling_profiler::INDEX, t);
+            for (size_t p = next++; p < parts.size(); p = next++) {
+              SeedTable& part = parts[p];
+              std::copy(part.hashes.begin(), part.hashes.end(), table.hashes.begin() + hashOffsets[p]);
+              std::copy(part.points.begin(), part.points.end(), table.points.begin() + pointOffsets[p]);
+              for (size_t i = 0; i < part.hashes.size(); ++i)
+                table.starts[hashOffsets[p] + i] = pointOffsets[p] + part.starts[i];
+              part = SeedTable();
+            }
+          });
+        }
+        for (auto& thread : threads)
+          thread.join();
+        std::vector<SeedTable>().swap(parts);
+
+        indexSeedBuckets(table);
+        seedTable = std::move(table);
+      }
+
+      /**
+       * @brief     size and fill the top-bits buckets of a seed table from its hashes
+       */
+      static void indexSeedBuckets(SeedTable& table)
+      {
+        // About eight hashes per bucket
+        table.bucketBits = 1;
+        while (table.bucketBits < 24 && (table.hashes.size() >> (table.bucketBits + 3)) > 0)
+          table.bucketBits++;
+        table.buckets.resize((1ULL << table.bucketBits) + 1);
+        for (uint64_t b = 0, i = 0; b < table.buckets.size(); ++b) {
+          while (i < table.hashes.size() && (table.hashes[i] >> (64 - table.bucketBits)) < b)
+            i++;
+          table.buckets[b] = i;
+        }
+        fillSeedFilter(table.hashes.data(), table.hashes.size(), table.filter, table.filterBits);
+      }
+
+      /**
+       * @brief     switch minmerIndex and the seed table to the packed encoding if every
+       *            position and sequence id fits, then point the index view at them
+       */
+      void compactIndex()
+      {
+        const bool packed =
+          std::all_of(minmerIndex.begin(), minmerIndex.end(), PackedMinmerInfo::fits)
+          && std::all_of(seedTable.points.begin(), seedTable.points.end(), PackedIntervalPoint::fits);
+        if (packed) {
+          packedMinmerIndex.resize(minmerIndex.size());
+          std::transform(minmerIndex.begin(), minmerIndex.end(), packedMinmerIndex.begin(), PackedMinmerInfo::pack);
+          MI_Type().swap(minmerIndex);
+          seedTable.packedPoints.resize(seedTable.points.size());
+          std::transform(seedTable.points.begin(), seedTable.points.end(), seedTable.packedPoints.begin(), PackedIntervalPoint::pack);
+          std::vector<IntervalPoint>().swap(seedTable.points);
+        }
+        viewOwnedIndex(packed);
+      }
+
+      /**
+       * @brief     point the index view at minmerIndex and the seed table, in the packed
+       *            or wide encoding
+       */
+      void viewOwnedIndex(bool packed)
+      {
+        flatIndex.packed = packed;
+        flatIndex.minmers = minmerIndex.data();
+        flatIndex.packedMinmers = packedMinmerIndex.data();
+        flatIndex.hashes = seedTable.hashes.data();
+        flatIndex.seedStarts = seedTable.starts.data();
+        flatIndex.buckets = seedTable.buckets.data();
+        flatIndex.points = seedTable.points.data();
+        flatIndex.packedPoints = seedTable.packedPoints.data();
+        flatIndex.numMinmers = packed ? packedMinmerIndex.size() : minmerIndex.size();
+        flatIndex.numHashes = seedTable.hashes.size();
+        flatIndex.numPoints = packed ? seedTable.packedPoints.size() : seedTable.points.size();
+        flatIndex.bucketBits = seedTable.bucketBits;
+        flatIndex.bucketShift = 64 - seedTable.bucketBits;
+        flatIndex.filter = seedTable.filter.data();
+        flatIndex.filterShift = 64 - seedTable.filterBits;
+        if (param.huge_pages) {
+          hugePages::advise(minmerIndex);
+          hugePages::advise(packedMinmerIndex);
+          hugePages::advise(seedTable.hashes);
+          hugePages::advise(seedTable.starts);
+          hugePages::advise(seedTable.filter);
+          hugePages::advise(seedTable.points);
+          hugePages::advise(seedTable.packedPoints);
+        }
+      }
+
+
+      /**
+       * @brief  Write sketch as tsv. TSV indexing is slower but can be debugged easier
+       */
+      void writeSketchTSV() 
+      {
+        std::ofstream outStream;
+        outStream.open(std::string(param.indexFilename) + ".tsv");
+        outStream << "seqId" << "\t" << "strand" << "\t" << "start" << "\t" << "end" << "\t" << "hash\n";
+        for (auto it = getMinmerIndexBegin(); it != getMinmerIndexEnd(); ++it) {
+          const MinmerInfo mi = *it;
+          outStream << mi.seqId << "\t" << std::to_string(mi.strand) << "\t" << mi.wpos << "\t" << mi.wpos_end << "\t" << mi.hash << "\n";
+        }
+        outStream.close(); 
+      }
+
+
+      /**
+       * @brief  Pad outStream with zeros up to the next flatIndexAlignment boundary
+       */
+      static uint64_t alignStream(std::ofstream& outStream)
+      {
+        static const char zeros[flatIndexAlignment] = {};
+        const uint64_t pos = outStream.tellp();
+        const uint64_t pad = (flatIndexAlignment - pos % flatIndexAlignment) % flatIndexAlignment;
+        outStream.write(zeros, pad);
+        return pos + pad;
+      }
+
+      static uint64_t alignOffset(uint64_t pos)
+      {
+        return (pos + flatIndexAlignment - 1) / flatIndexAlignment * flatIndexAlignment;
+      }
 
       /**
-       * @brief               function to compute minmers given input sequence object
-       * @details             this function is run in parallel by multiple threads
-       * @param[in]   input   input read details
-       * @return              output object containing the mappings
+       * @brief  Write minmerIndex and the seed lookup as flat arrays that can be mapped in place
        */
-      MI_Type* buildHelper(InputSeqContainer *input, progress_meter::ProgressMeter* progress)
+      void writeFlatIndex(std::ofstream& outStream)
       {
-        MI_Type* thread_output = new MI_Type();
-
-        //Compute minmers in reference sequence
-        skch::CommonFunc::addMinmers(
-                *thread_output, 
-                &(input->seq[0u]), 
-                input->len, 
-                param.kmerSize, 
-                param.segLength, 
-                param.alphabetSize, 
-                param.sketchSize,
-                input->seqId,
-                progress);
+        FlatIndexHeader header = {};
+        header.version = flatIndexVersion;
+        header.packed = flatIndex.packed;
+        header.numMinmers = flatIndex.numMinmers;
+        header.numHashes = flatIndex.numHashes;
+        header.numPoints = flatIndex.numPoints;
+        header.bucketBits = flatIndex.bucketBits;
+        header.countThreshold = countThreshold;
+        header.numFrequent = frequentHashes.size();
+        header.syncmerSize = std::max(param.syncmer_size, 0);
+        header.worldMinimizers = param.world_minimizers;
+        header.dustThreshold = param.dust_threshold;
+        if (param.compress_index) {
+          writeCompressedIndex(outStream, header);
+          return;
+        }
+        const uint64_t numBuckets = (1ULL << header.bucketBits) + 1;
+        const uint64_t minmerSize = header.packed ? sizeof(PackedMinmerInfo) : sizeof(MinmerInfo);
+        const uint64_t pointSize = header.packed ? sizeof(PackedIntervalPoint) : sizeof(IntervalPoint);
+
+        // Lay the arrays out after the header, each on an alignment boundary
+        const uint64_t headerOffset = alignStream(outStream);
+        header.minmersOffset = alignOffset(headerOffset + sizeof(header));
+        header.hashesOffset = alignOffset(header.minmersOffset + header.numMinmers * minmerSize);
+        header.seedStartsOffset = alignOffset(header.hashesOffset + header.numHashes * sizeof(hash_t));
+        header.bucketsOffset = alignOffset(header.seedStartsOffset + (header.numHashes + 1) * sizeof(uint64_t));
+        header.pointsOffset = alignOffset(header.bucketsOffset + numBuckets * sizeof(uint64_t));
+        header.frequentOffset = alignOffset(header.pointsOffset + header.numPoints * pointSize);
+        header.filterBits = 64 - flatIndex.filterShift;
+        header.filterOffset = alignOffset(header.frequentOffset + header.numFrequent * sizeof(hash_t));
+        header.endOffset = alignOffset(header.filterOffset + (seedFilterWords << header.filterBits) * sizeof(uint64_t));
+        sectionChecksums(flatSections(frequentHashes.data(), header.numFrequent,
+                                      (seedFilterWords << header.filterBits) * sizeof(uint64_t)),
+                         header.checksums);
+
+        outStream.write((char*)&header, sizeof(header));
+        alignStream(outStream);
+        outStream.write(header.packed ? (const char*)flatIndex.packedMinmers : (const char*)flatIndex.minmers,
+                        header.numMinmers * minmerSize);
+        alignStream(outStream);
+        outStream.write((char*)flatIndex.hashes, header.numHashes * sizeof(hash_t));
+        alignStream(outStream);
+        outStream.write((char*)flatIndex.seedStarts, (header.numHashes + 1) * sizeof(uint64_t));
+        alignStream(outStream);
+        outStream.write((char*)flatIndex.buckets, numBuckets * sizeof(uint64_t));
+        alignStream(outStream);
+        outStream.write(header.packed ? (const char*)flatIndex.packedPoints : (const char*)flatIndex.points,
+                        header.numPoints * pointSize);
+        alignStream(outStream);
+        outStream.write((char*)frequentHashes.data(), header.numFrequent * sizeof(hash_t));
+        alignStream(outStream);
+        outStream.write((const char*)flatIndex.filter, (seedFilterWords << header.filterBits) * sizeof(uint64_t));
+        alignStream(outStream);
+      }
 
-        return thread_output;
+      /**
+       * @brief  Write minmerIndex and the seed lookup as compressed blocks, encoded in parallel
+       * @param[in] header  flat index header with the counts filled in
+       */
+      void writeCompressedIndex(std::ofstream& outStream, FlatIndexHeader& header)
+      {
+        const uint64_t blockSize = compressedIndexBlockSize;
+        header.compressed = param.pangenome_index ? 2 : 1;
+        header.blockSize = blockSize;
+        const uint64_t minmerBlocks = (header.numMinmers + blockSize - 1) / blockSize;
+        const uint64_t seedBlocks = (header.numHashes + blockSize - 1) / blockSize;
+
+        std::vector<std::string> blocks(minmerBlocks + seedBlocks);
+        std::vector<uint64_t> blockChecksums(blocks.size());
+        parallelFor(blocks.size(), [&](uint64_t b) {
+          const uint64_t first = (b < minmerBlocks ? b : b - minmerBlocks) * blockSize;
+          if (b < minmerBlocks)
+            blocks[b] = encodeMinmerBlock(first, std::min(header.numMinmers, first + blockSize));
+          else
+            blocks[b] = encodeSeedBlock(first, std::min(header.numHashes, first + blockSize));
+          blockChecksums[b] = pieceChecksum(blocks[b].data(), blocks[b].size());
+        });
+
+        // Lay out the block tables and blocks, now that their sizes are known
+        std::vector<uint64_t> minmerTable(minmerBlocks + 1);
+        std::vector<uint64_t> seedTableEntries(2 * (seedBlocks + 1));
+        const uint64_t headerOffset = alignStream(outStream);
+        header.minmersOffset = alignOffset(headerOffset + sizeof(header));
+        uint64_t pos = header.minmersOffset + minmerTable.size() * sizeof(uint64_t);
+        for (uint64_t b = 0; b <= minmerBlocks; ++b) {
+          minmerTable[b] = pos;
+          if (b < minmerBlocks)
+            pos += blocks[b].size();
+        }
+        header.hashesOffset = alignOffset(pos);
+        pos = header.hashesOffset + seedTableEntries.size() * sizeof(uint64_t);
+        for (uint64_t b = 0; b <= seedBlocks; ++b) {
+          seedTableEntries[2 * b] = pos;
+          seedTableEntries[2 * b + 1] = flatIndex.seedStarts[std::min(header.numHashes, b * blockSize)];
+          if (b < seedBlocks)
+            pos += blocks[minmerBlocks + b].size();
+        }
+        header.frequentOffset = alignOffset(pos);
+        header.endOffset = alignOffset(header.frequentOffset + header.numFrequent * sizeof(hash_t));
+        sectionChecksums(compressedSections(minmerTable.data(), minmerBlocks, seedTableEntries.data(), seedBlocks,
+                                            frequentHashes.data(), header.numFrequent),
+                         header.checksums);
+        header.checksums[3] = combineChecksums(blockChecksums.data(), minmerBlocks);
+        header.checksums[4] = combineChecksums(blockChecksums.data() + minmerBlocks, seedBlocks);
+
+        outStream.write((char*)&header, sizeof(header));
+        alignStream(outStream);
+        outStream.write((char*)minmerTable.data(), minmerTable.size() * sizeof(uint64_t));
+        for (uint64_t b = 0; b < minmerBlocks; ++b)
+          outStream.write(blocks[b].data(), blocks[b].size());
+        alignStream(outStream);
+        outStream.write((char*)seedTableEntries.data(), seedTableEntries.size() * sizeof(uint64_t));
+        for (uint64_t b = minmerBlocks; b < blocks.size(); ++b)
+          outStream.write(blocks[b].data(), blocks[b].size());
+        alignStream(outStream);
+        outStream.write((char*)frequentHashes.data(), header.numFrequent * sizeof(hash_t));
+        alignStream(outStream);
       }
 
       /**
-       * @brief                 routine to handle thread's local minmer index
-       * @param[in] output      thread local minmer output
+       * @brief  Encode minmers [first, last) of minmerIndex as a compressed block
        */
+      std::string encodeMinmerBlock(uint64_t first, uint64_t last) const
+      {
+        std::string out;
+        MinmerInfo prev = {};
+        for (MIIter_t it = getMinmerIndexBegin() + first; it != getMinmerIndexBegin() + last; ++it) {
+          const MinmerInfo m = *it;
+          const int64_t seqDelta = int64_t(m.seqId) - prev.seqId;
+          putVarint(out, zigzag(seqDelta) << 2 | uint64_t(m.strand + 1));
+          putVarint(out, zigzag(m.wpos - (seqDelta ? 0 : prev.wpos)));
+          putVarint(out, zigzag(m.wpos_end - m.wpos));
+          out.append((const char*)&m.hash, sizeof(m.hash));
+          prev = m;
+        }
+        return out;
+      }
 
-      void buildHandleThreadOutput(MI_Type* contigMinmerIndex)
+      /**
+       * @brief  Encode hashes [first, last) of the seed table and their interval points as a
+       *         compressed block
+       */
+      std::string encodeSeedBlock(uint64_t first, uint64_t last) const
       {
-          // Count k-mer frequencies first
-          HF_Map_t kmer_freqs;
-          for (const auto& mi : *contigMinmerIndex) {
-              kmer_freqs[mi.hash]++;
+        std::string out;
+        hash_t prevHash = 0;
+        for (uint64_t i = first; i < last; ++i) {
+          const hash_t hash = flatIndex.hashes[i];
+          putVarint(out, hash - prevHash);
+          putVarint(out, flatIndex.seedStarts[i + 1] - flatIndex.seedStarts[i]);
+          prevHash = hash;
+          IntervalPoint prev = {};
+          for (SeedIter_t it = seedPoint(flatIndex.seedStarts[i], hash); it != seedPoint(flatIndex.seedStarts[i + 1], hash); ++it) {
+            const IntervalPoint ip = *it;
+            const int64_t seqDelta = int64_t(ip.seqId) - prev.seqId;
+            putVarint(out, zigzag(seqDelta) << 1 | uint64_t(ip.side > 0));
+            putVarint(out, zigzag(ip.pos - (seqDelta && !param.pangenome_index ? 0 : prev.pos)));
+            prev = ip;
           }
+        }
+        return out;
+      }
 
-          // This function is kept for compatibility but should not be used
-          // when parallel index building is enabled
-          for (MinmerInfo& mi : *contigMinmerIndex) {
-              // Skip high-frequency k-mers
-              auto freq_it = kmer_freqs.find(mi.hash);
-              if (freq_it != kmer_freqs.end() && freq_it->second > param.max_kmer_freq) {
-                  continue;
-              }
-
-              if (minmerPosLookupIndex[mi.hash].size() == 0 
-                      || minmerPosLookupIndex[mi.hash].back().hash != mi.hash 
-                      || minmerPosLookupIndex[mi.hash].back().pos != mi.wpos) {
-                  minmerPosLookupIndex[mi.hash].push_back(IntervalPoint {mi.wpos, mi.hash, mi.seqId, side::OPEN});
-                  minmerPosLookupIndex[mi.hash].push_back(IntervalPoint {mi.wpos_end, mi.hash, mi.seqId, side::CLOSE});
-              } else {
-                  minmerPosLookupIndex[mi.hash].back().pos = mi.wpos_end;
-              }
-          }
+      static void putVarint(std::string& out, uint64_t value)
+      {
+        for (; value >= 0x80; value >>= 7)
+          out.push_back(char(value | 0x80));
+        out.push_back(char(value));
+      }
 
-          // Only add k-mers that aren't too frequent
-          MI_Type filtered_minmers;
-          for (const auto& mi : *contigMinmerIndex) {
-              auto freq_it = kmer_freqs.find(mi.hash);
-              if (freq_it == kmer_freqs.end() || freq_it->second <= param.max_kmer_freq) {
-                  filtered_minmers.push_back(mi);
-              }
-          }
+      static uint64_t getVarint(const uint8_t*& in, const uint8_t* end)
+      {
+        uint64_t value = 0;
+        for (int shift = 0; in < end && shift < 64; shift += 7) {
+          const uint8_t byte = *in++;
+          value |= uint64_t(byte & 0x7f) << shift;
+          if (!(byte & 0x80))
+            return value;
+        }
+        corruptCompressedIndex();
+        return 0;
+      }
 
-          this->minmerIndex.insert(
-              this->minmerIndex.end(), 
-              std::make_move_iterator(filtered_minmers.begin()), 
-              std::make_move_iterator(filtered_minmers.end()));
+      static uint64_t zigzag(int64_t value) { return (uint64_t(value) << 1) ^ uint64_t(value >> 63); }
+      static int64_t unzigzag(uint64_t value) { return int64_t(value >> 1) ^ -int64_t(value & 1); }
 
-          delete contigMinmerIndex;
+      [[noreturn]] static void corruptCompressedIndex()
+      {
+        std::cerr << "[wfmash::mashmap] ERROR: Corrupt compressed index block" << std::endl;
+        exit(1);
       }
 
+      typedef std::vector<std::pair<const char*, uint64_t>> IndexSections;
 
       /**
-       * @brief  Write sketch as tsv. TSV indexing is slower but can be debugged easier
+       * @brief  Sections of an uncompressed flat sub-index in flatIndex, in checksum order
        */
-      void writeSketchTSV() 
+      IndexSections flatSections(const hash_t* frequent, uint64_t numFrequent, uint64_t filterBytes) const
       {
-        std::ofstream outStream;
-        outStream.open(std::string(param.indexFilename) + ".tsv");
-        outStream << "seqId" << "\t" << "strand" << "\t" << "start" << "\t" << "end" << "\t" << "hash\n";
-        for (auto& mi : this->minmerIndex) {
-          outStream << mi.seqId << "\t" << std::to_string(mi.strand) << "\t" << mi.wpos << "\t" << mi.wpos_end << "\t" << mi.hash << "\n";
-        }
-        outStream.close(); 
+        const uint64_t minmerSize = flatIndex.packed ? sizeof(PackedMinmerInfo) : sizeof(MinmerInfo);
+        const uint64_t pointSize = flatIndex.packed ? sizeof(PackedIntervalPoint) : sizeof(IntervalPoint);
+        return {
+          {flatIndex.packed ? (const char*)flatIndex.packedMinmers : (const char*)flatIndex.minmers, flatIndex.numMinmers * minmerSize},
+          {(const char*)flatIndex.hashes, flatIndex.numHashes * sizeof(hash_t)},
+          {(const char*)flatIndex.seedStarts, (flatIndex.numHashes + 1) * sizeof(uint64_t)},
+          {(const char*)flatIndex.buckets, ((1ULL << flatIndex.bucketBits) + 1) * sizeof(uint64_t)},
+          {flatIndex.packed ? (const char*)flatIndex.packedPoints : (const char*)flatIndex.points, flatIndex.numPoints * pointSize},
+          {(const char*)frequent, numFrequent * sizeof(hash_t)},
+          {(const char*)flatIndex.filter, filterBytes}};
+      }
+
+      /**
+       * @brief  Contiguous sections of a compressed flat sub-index, in checksum order; its
+       *         minmer and seed blocks follow as sections 3 and 4, each checksummed by block
+       */
+      static IndexSections compressedSections(const uint64_t* minmerTable, uint64_t minmerBlocks,
+                                              const uint64_t* seedTableEntries, uint64_t seedBlocks,
+                                              const hash_t* frequent, uint64_t numFrequent)
+      {
+        return {
+          {(const char*)minmerTable, (minmerBlocks + 1) * sizeof(uint64_t)},
+          {(const char*)seedTableEntries, 2 * (seedBlocks + 1) * sizeof(uint64_t)},
+          {(const char*)frequent, numFrequent * sizeof(hash_t)}};
       }
 
+      static uint64_t pieceChecksum(const void* data, uint64_t size)
+      {
+        uint64_t hash[2];
+        MurmurHash3_x64_128(data, (int)size, 0x9e3779b9, hash);
+        return hash[0];
+      }
+
+      static uint64_t combineChecksums(const uint64_t* pieces, uint64_t count)
+      {
+        return pieceChecksum(pieces, count * sizeof(uint64_t)) ^ count;
+      }
 
       /**
-       * @brief  Write sketch for quick loading
+       * @brief  Checksum each section into out, over pieces of checksumPieceSize bytes
+       *         hashed in parallel, so a section has the same checksum however it is laid out
        */
-      void writeSketchBinary(std::ofstream& outStream) 
+      void sectionChecksums(const IndexSections& sections, uint64_t* out) const
       {
-        typename MI_Type::size_type size = minmerIndex.size();
-        outStream.write((char*)&size, sizeof(size));
-        outStream.write((char*)&minmerIndex[0], minmerIndex.size() * sizeof(MinmerInfo));
+        std::vector<uint64_t> firstPiece(sections.size() + 1, 0);
+        for (size_t s = 0; s < sections.size(); ++s)
+          firstPiece[s + 1] = firstPiece[s] + (sections[s].second + checksumPieceSize - 1) / checksumPieceSize;
+        std::vector<uint64_t> pieces(firstPiece.back());
+        parallelFor(pieces.size(), [&](uint64_t p) {
+          const size_t s = std::upper_bound(firstPiece.begin(), firstPiece.end(), p) - firstPiece.begin() - 1;
+          const uint64_t offset = (p - firstPiece[s]) * checksumPieceSize;
+          pieces[p] = pieceChecksum(sections[s].first + offset, std::min(checksumPieceSize, sections[s].second - offset));
+        });
+        for (size_t s = 0; s < sections.size(); ++s)
+          out[s] = combineChecksums(pieces.data() + firstPiece[s], firstPiece[s + 1] - firstPiece[s]);
       }
 
       /**
-       * @brief  Write posList for quick loading
+       * @brief  Exit if a checksum of a sub-index read does not match the one it was written with
        */
-      void writePosListBinary(std::ofstream& outStream) 
+      static void verifyChecksums(const FlatIndexHeader& header, const uint64_t* actual, uint64_t count,
+                                  const char* const* names)
       {
-        typename MI_Map_t::size_type size = minmerPosLookupIndex.size();
-        outStream.write((char*)&size, sizeof(size));
+        for (uint64_t s = 0; s < count; ++s) {
+          if (actual[s] != header.checksums[s]) {
+            std::cerr << "[wfmash::mashmap] ERROR: Corrupt index, the checksum of its " << names[s]
+                      << " section does not match the one it was written with" << std::endl;
+            exit(1);
+          }
+        }
+      }
 
-        for (auto& [hash, ipVec] : minmerPosLookupIndex) 
-        {
-          MinmerMapKeyType key = hash;
-          outStream.write((char*)&key, sizeof(key));
-          typename MI_Type::size_type size = ipVec.size();
-          outStream.write((char*)&size, sizeof(size));
-          outStream.write((char*)&ipVec[0], ipVec.size() * sizeof(MinmerMapValueType::value_type));
+      /**
+       * @brief  Run fn(0) ... fn(n - 1) over the index threads
+       */
+      void parallelFor(uint64_t n, const std::function<void(uint64_t)>& fn) const
+      {
+        std::atomic<uint64_t> next(0);
+        std::vector<std::thread> threads;
+        const int stage = sampling_profiler::thread_stage();
+        for (uint64_t t = 0; t < std::min<uint64_t>(std::max(param.threads, 1), n); ++t) {
+          threads.emplace_back([&, t]() {
+            sampling_profiler::name_thread("helper", stage, t);
+            for (uint64_t i = next++; i < n; i = next++)
+              fn(i);
+          });
         }
+        for (auto& thread : threads)
+          thread.join();
       }
 
 
@@ -522,10 +1853,22 @@ namespace skch
        */
       void writeParameters(std::ofstream& outStream)
       {
-        // Write segment length, sketch size, and kmer size
+        // Write segment length, sketch size, kmer size and k-mer hash engine
         outStream.write((char*) &param.segLength, sizeof(param.segLength));
         outStream.write((char*) &param.sketchSize, sizeof(param.sketchSize));
         outStream.write((char*) &param.kmerSize, sizeof(param.kmerSize));
+        outStream.write((char*) &param.kmerHashEngine, sizeof(param.kmerHashEngine));
+
+        // Spaced seeds (count 0 if hashing k-mers) and their sensitivity, so loading needs no ALeS run
+        uint64_t num_seeds = spacedSeeds ? param.spaced_seeds.size() : 0;
+        outStream.write((char*) &num_seeds, sizeof(num_seeds));
+        decltype(param.spaced_seed_sensitivity) sensitivity = num_seeds ? param.spaced_seed_sensitivity : 0;
+        outStream.write((char*) &sensitivity, sizeof(sensitivity));
+        for (uint64_t i = 0; i < num_seeds; ++i) {
+          uint64_t seed_length = param.spaced_seeds[i].length;
+          outStream.write((char*) &seed_length, sizeof(seed_length));
+          outStream.write(param.spaced_seeds[i].seed, seed_length);
+        }
       }
 
 
@@ -545,17 +1888,22 @@ namespace skch
             std::cerr << "Error: Unable to open index file for writing: " << indexFilename << std::endl;
             exit(1);
         }
+        // Flat arrays are aligned in file offsets, so track the position when appending
+        outStream.seekp(0, std::ios::end);
+        const uint64_t offset = outStream.tellp();
         writeSubIndexHeader(outStream, target_subset);
         writeParameters(outStream);
-        writeSketchBinary(outStream);
-        writePosListBinary(outStream);
+        writeFlatIndex(outStream);
         // Removed writeFreqKmersBinary call
+        const uint64_t size = uint64_t(outStream.tellp()) - offset;
         outStream.close();
+
+        registerSubIndex(indexFilename.string(), target_subset, offset, size);
       }
 
       void writeSubIndexHeader(std::ofstream& outStream, const std::vector<std::string>& target_subset) 
       {
-        const uint64_t magic_number = 0xDEADBEEFCAFEBABE;
+        const uint64_t magic_number = indexMagicFlat;
         outStream.write(reinterpret_cast<const char*>(&magic_number), sizeof(magic_number));
         uint64_t num_sequences = target_subset.size();
         outStream.write(reinterpret_cast<const char*>(&num_sequences), sizeof(num_sequences));
@@ -599,6 +1947,8 @@ namespace skch
        */
       void readPosListBinary(std::ifstream& inStream) 
       {
+        std::vector<MI_Map_t> posIndexes(1);
+        MI_Map_t& minmerPosLookupIndex = posIndexes.front();
         typename MI_Map_t::size_type numKeys = 0;
         inStream.read((char*)&numKeys, sizeof(numKeys));
         minmerPosLookupIndex.reserve(numKeys);
@@ -613,6 +1963,7 @@ namespace skch
           minmerPosLookupIndex[key].resize(size);
           inStream.read((char*)&minmerPosLookupIndex[key][0], size * sizeof(MinmerMapValueType::value_type));
         }
+        buildSeedTable(posIndexes);
       }
 
 
@@ -629,17 +1980,72 @@ namespace skch
         inStream.read((char*) &index_sketchSize, sizeof(index_sketchSize));
         inStream.read((char*) &index_kmerSize, sizeof(index_kmerSize));
 
-        if (param.segLength != index_segLength 
-            || param.sketchSize != index_sketchSize
-            || param.kmerSize != index_kmerSize)
+        // Legacy indexes predate the hash engine field and always used MurmurHash3
+        decltype(param.kmerHashEngine) index_kmerHashEngine = kmer_hash::MURMUR3;
+        if (indexMagic != indexMagicLegacy) {
+          inStream.read((char*) &index_kmerHashEngine, sizeof(index_kmerHashEngine));
+        }
+
+        std::vector<ales::spaced_seed> index_spacedSeeds;
+        decltype(param.spaced_seed_sensitivity) index_seedSensitivity = 0;
+        if (indexMagic == indexMagicSeeded || indexMagic == indexMagicFlat) {
+          uint64_t num_seeds = 0;
+          inStream.read((char*) &num_seeds, sizeof(num_seeds));
+          inStream.read((char*) &index_seedSensitivity, sizeof(index_seedSensitivity));
+          for (uint64_t i = 0; i < num_seeds; ++i) {
+            uint64_t seed_length = 0;
+            inStream.read((char*) &seed_length, sizeof(seed_length));
+            std::string mask(seed_length, '\0');
+            inStream.read(&mask[0], seed_length);
+            index_spacedSeeds.push_back(SpacedSeedCache::makeSeed(mask));
+          }
+        }
+
+        // Longer segments and smaller sketches are derived from the index once it is read
+        indexSegLength = index_segLength;
+        indexSketchSize = index_sketchSize;
+        deriveSketch = param.kmerSize == index_kmerSize && param.segLength >= index_segLength
+            && param.sketchSize <= index_sketchSize
+            && (param.segLength != index_segLength || param.sketchSize != index_sketchSize);
+        if (!deriveSketch
+            && (param.segLength != index_segLength
+                || param.sketchSize != index_sketchSize
+                || param.kmerSize != index_kmerSize))
         {
           std::cerr << "[wfmash::mashmap] ERROR: Parameters of indexed sketch differ from current parameters" << std::endl;
           std::cerr << "[wfmash::mashmap] Index --> segLength=" << index_segLength
                     << " sketchSize=" << index_sketchSize << " kmerSize=" << index_kmerSize << std::endl;
           std::cerr << "[wfmash::mashmap] Current --> segLength=" << param.segLength
                     << " sketchSize=" << param.sketchSize << " kmerSize=" << param.kmerSize << std::endl;
+          std::cerr << "[wfmash::mashmap] An index also serves the same kmerSize with a larger segLength or a smaller sketchSize;"
+                    << " see --reusable-index" << std::endl;
           exit(1);
         }
+
+        // Queries must be hashed the same way as the index, whatever the CLI default
+        if (param.kmerHashEngine != index_kmerHashEngine) {
+          std::cerr << "[wfmash::mashmap] Index uses "
+                    << (index_kmerHashEngine == kmer_hash::MURMUR3 ? "MurmurHash3" : "rolling 2-bit")
+                    << " k-mer hashing, switching to it" << std::endl;
+          param.kmerHashEngine = index_kmerHashEngine;
+        }
+
+        // Likewise for spaced seeds, which also spares regenerating them
+        if (!index_spacedSeeds.empty()) {
+          if (!param.use_spaced_seeds) {
+            std::cerr << "[wfmash::mashmap] Index uses " << index_spacedSeeds.size()
+                      << " spaced seeds, switching to them" << std::endl;
+          }
+          param.use_spaced_seeds = true;
+          param.spaced_seeds = std::move(index_spacedSeeds);
+          param.spaced_seed_sensitivity = index_seedSensitivity;
+          spacedSeeds = std::make_unique<CommonFunc::SpacedSeeds>(param.spaced_seeds);
+        } else if (param.use_spaced_seeds) {
+          std::cerr << "[wfmash::mashmap] Index uses contiguous k-mers, not spaced seeds, switching to them" << std::endl;
+          param.use_spaced_seeds = false;
+          param.spaced_seeds.clear();
+          spacedSeeds.reset();
+        }
       }
 
 
@@ -654,19 +2060,523 @@ namespace skch
             exit(1);
         }
         readParameters(inStream);
-        readSketchBinary(inStream);
-        readPosListBinary(inStream);
+        if (indexMagic == indexMagicFlat) {
+          readFlatIndex(inStream);
+        } else {
+          adoptSyncmerSize(0);
+          adoptWorldMinimizers(false);
+          readSketchBinary(inStream);
+          readPosListBinary(inStream);
+          compactIndex();
+        }
         // Removed readFreqKmersBinary call
+        if (deriveSketch) {
+          deriveIndexSketch();
+        }
+      }
+
+      // Segment length and sketch size of the index read, and whether this run derives its own from them
+      offset_t indexSegLength = 0;
+      int indexSketchSize = 0;
+      bool deriveSketch = false;
+
+      /**
+       * @brief  replace the loaded index by the one of this run's longer segments or smaller
+       *         sketches
+       * @details A window of segLength covers the index windows starting up to segLength -
+       *          indexSegLength after it, and a hash among its lowest sketchSize ranks at
+       *          least as low in each of them, so within their lowest indexSketchSize. Its
+       *          sketch is thus the lowest sketchSize of the hashes whose index intervals
+       *          reach it. Frequent hashes stay filtered at the index's cutoff.
+       */
+      void deriveIndexSketch()
+      {
+        std::cerr << "[wfmash::mashmap] Deriving sketches of segLength=" << param.segLength << " sketchSize=" << param.sketchSize
+                  << " from the index of segLength=" << indexSegLength << " sketchSize=" << indexSketchSize << std::endl;
+        if (param.world_minimizers) {
+          std::cerr << "[wfmash::mashmap] ERROR: world minimizer indexes cannot be derived to other parameters" << std::endl;
+          exit(1);
+        }
+
+        // Minmers of each sequence are contiguous and in window order
+        std::vector<uint64_t> runStarts;
+        seqno_t lastSeq = -1;
+        for (uint64_t i = 0; i < flatIndex.numMinmers; ++i) {
+          const seqno_t seqId = (*(getMinmerIndexBegin() + i)).seqId;
+          if (runStarts.empty() || seqId != lastSeq) {
+            runStarts.push_back(i);
+            lastSeq = seqId;
+          }
+        }
+        runStarts.push_back(flatIndex.numMinmers);
+        std::vector<MI_Type> derived(runStarts.size() - 1);
+        parallelFor(derived.size(), [&](uint64_t r) {
+          deriveSequenceSketch(runStarts[r], runStarts[r + 1], derived[r]);
+        });
+        const uint64_t indexWindows = flatIndex.numMinmers;
+
+        releaseFlatIndex();
+        std::vector<PackedMinmerInfo>().swap(packedMinmerIndex);
+        MI_Type derivedIndex;
+        for (MI_Type& minmers : derived) {
+          derivedIndex.insert(derivedIndex.end(), minmers.begin(), minmers.end());
+          MI_Type().swap(minmers);
+        }
+        minmerIndex = std::move(derivedIndex);
+
+        // Seed lists by hash partition, each built from the minmers of its own hashes
+        int partitionBits = 0;
+        while ((1 << partitionBits) < param.threads)
+          partitionBits++;
+        std::vector<SeedTable> parts(size_t(1) << partitionBits);
+        parallelFor(parts.size(), [&](uint64_t p) {
+          std::vector<MI_Map_t> posIndex(1);
+          for (const MinmerInfo& mi : minmerIndex) {
+            if (partitionBits != 0 && (mi.hash >> (64 - partitionBits)) != p)
+              continue;
+            auto& pos_list = posIndex.front()[mi.hash];
+            if (pos_list.empty() || pos_list.back().pos != mi.wpos) {
+              pos_list.push_back(IntervalPoint {mi.wpos, mi.hash, mi.seqId, side::OPEN});
+              pos_list.push_back(IntervalPoint {mi.wpos_end, mi.hash, mi.seqId, side::CLOSE});
+            } else {
+              pos_list.back().pos = mi.wpos_end;
+            }
+          }
+          parts[p] = packSeedLists(posIndex);
+        });
+        joinSeedTables(parts);
+        compactIndex();
+        std::cerr << "[wfmash::mashmap] Derived " << flatIndex.numMinmers << " windows and " << flatIndex.numHashes
+                  << " unique hashes from " << indexWindows << " index windows" << std::endl;
+      }
+
+      /**
+       * @brief  derive the minmers of one sequence, [first, last) of the loaded index, into out
+       * @details The index intervals are moved to the run's windows, reaching back by the
+       *          difference of the segment lengths, and swept in order with the hashes live
+       *          at the current window kept sorted; kth marks the last of the lowest
+       *          sketchSize, and a hash opening or closing below it shifts it by one.
+       */
+      void deriveSequenceSketch(uint64_t first, uint64_t last, MI_Type& out) const
+      {
+        const seqno_t seqId = (*(getMinmerIndexBegin() + first)).seqId;
+        const offset_t windows = offset_t(idManager.getSequenceLength(seqId)) - param.segLength + 1;
+        if (windows <= 0) {
+          return;
+        }
+        const offset_t reach = param.segLength - indexSegLength;
+        struct Event
+        {
+          offset_t pos;
+          bool open;
+          hash_t hash;
+          strand_t strand;
+        };
+        std::vector<Event> events;
+        for (MIIter_t it = getMinmerIndexBegin() + first; it != getMinmerIndexBegin() + last; ++it) {
+          const MinmerInfo mi = *it;
+          const offset_t begin = std::max<offset_t>(0, mi.wpos - reach);
+          const offset_t end = std::min<offset_t>(mi.wpos_end, windows);
+          if (begin < end) {
+            events.push_back({begin, true, mi.hash, mi.strand});
+            events.push_back({end, false, mi.hash, mi.strand});
+          }
+        }
+        // Intervals closing at a window end before those opening at it
+        std::sort(events.begin(), events.end(), [](const Event& a, const Event& b) {
+          return std::tie(a.pos, a.open) < std::tie(b.pos, b.open);
+        });
+
+        const size_t sketchSize = std::max(param.sketchSize, 1);
+        std::map<hash_t, std::pair<uint64_t, strand_t>> live;     // count of intervals and strand
+        auto kth = live.end();
+        ankerl::unordered_dense::map<hash_t, offset_t> sketched;  // window each entered the sketch at
+        MI_Type intervals;
+        const auto enter = [&](hash_t hash, offset_t pos) { sketched[hash] = pos; };
+        const auto leave = [&](hash_t hash, strand_t strand, offset_t pos) {
+          const auto it = sketched.find(hash);
+          if (it->second < pos) {
+            intervals.push_back(MinmerInfo{hash, it->second, pos, seqId, strand});
+          }
+          sketched.erase(it);
+        };
+
+        for (const Event& e : events) {
+          if (e.open) {
+            auto [it, added] = live.try_emplace(e.hash, 0, e.strand);
+            it->second.first++;
+            if (!added) {
+              continue;
+            }
+            if (live.size() <= sketchSize) {
+              enter(e.hash, e.pos);
+              if (live.size() == sketchSize) {
+                kth = std::prev(live.end());
+              }
+            } else if (e.hash < kth->first) {
+              enter(e.hash, e.pos);
+              leave(kth->first, kth->second.second, e.pos);
+              kth = std::prev(kth);
+            }
+          } else {
+            auto it = live.find(e.hash);
+            if (--it->second.first > 0) {
+              continue;
+            }
+            if (live.size() > sketchSize) {
+              if (e.hash <= kth->first) {
+                leave(e.hash, it->second.second, e.pos);
+                kth = std::next(kth);
+                enter(kth->first, e.pos);
+              }
+            } else {
+              leave(e.hash, it->second.second, e.pos);
+              kth = live.end();
+            }
+            live.erase(it);
+          }
+        }
+
+        // Longer intervals split as finalizeMinmers does, then in window order without duplicates
+        for (const MinmerInfo& mi : intervals) {
+          for (offset_t start = mi.wpos; start < mi.wpos_end; start += param.segLength) {
+            out.push_back(MinmerInfo{mi.hash, start, std::min<offset_t>(start + param.segLength, mi.wpos_end), seqId, mi.strand});
+          }
+        }
+        std::sort(out.begin(), out.end(), [](const MinmerInfo& l, const MinmerInfo& r) {
+          return std::tie(l.wpos, l.wpos_end, l.hash) < std::tie(r.wpos, r.wpos_end, r.hash);
+        });
+        out.erase(std::unique(out.begin(), out.end(), [](const MinmerInfo& l, const MinmerInfo& r) {
+          return l.wpos == r.wpos && l.hash == r.hash;
+        }), out.end());
+      }
+
+      /**
+       * @brief  Map the flat arrays of the current sub-index and leave inStream after them
+       * @details the pages are shared with every other process mapping the same index,
+       *          nothing is deserialized. Falls back to reading the arrays if mmap fails.
+       */
+      void readFlatIndex(std::ifstream& inStream)
+      {
+        const FlatIndexHeader header = readFlatIndexHeader(inStream);
+        adoptSyncmerSize(header.syncmerSize);
+        adoptWorldMinimizers(header.worldMinimizers);
+        adoptDustThreshold(header.dustThreshold);
+        if (header.compressed) {
+          readCompressedIndex(inStream, header);
+          return;
+        }
+
+        // mmap offsets must be page aligned
+        const uint64_t page = sysconf(_SC_PAGESIZE);
+        const uint64_t mapOffset = header.minmersOffset / page * page;
+        const uint64_t mapSize = header.endOffset - mapOffset;
+
+        const char* base = nullptr;
+        const int fd = ::open(param.indexFilename.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && uint64_t(st.st_size) < header.endOffset) {
+          // A mapping past the end of the file faults when touched
+          std::cerr << "[wfmash::mashmap] ERROR: Truncated index file" << std::endl;
+          exit(1);
+        }
+        if (fd >= 0) {
+          void* mapping = mmap(nullptr, mapSize, PROT_READ, MAP_SHARED, fd, mapOffset);
+          ::close(fd);
+          if (mapping != MAP_FAILED) {
+            flatIndex.mapping = mapping;
+            flatIndex.mappingSize = mapSize;
+            base = static_cast<const char*>(mapping) - mapOffset;
+          }
+        }
+        if (!base) {
+          std::cerr << "[wfmash::mashmap] WARNING, unable to memory-map the index, reading it instead" << std::endl;
+          const uint64_t size = header.endOffset - header.minmersOffset;
+          flatIndex.buffer.reset(new char[size]);
+          flatIndex.bufferSize = size;
+          inStream.seekg(header.minmersOffset);
+          inStream.read(flatIndex.buffer.get(), size);
+          if (!inStream) {
+            std::cerr << "[wfmash::mashmap] ERROR: Truncated index file" << std::endl;
+            exit(1);
+          }
+          base = flatIndex.buffer.get() - header.minmersOffset;
+        }
+
+        if (param.huge_pages) {
+          // Taken by file mappings only where the kernel pages files in huge pages
+          if (flatIndex.mapping) {
+            hugePages::advise(flatIndex.mapping, flatIndex.mappingSize);
+          } else {
+            hugePages::advise(flatIndex.buffer.get(), flatIndex.bufferSize);
+          }
+        }
+
+        flatIndex.packed = header.packed;
+        if (flatIndex.packed) {
+          flatIndex.packedMinmers = reinterpret_cast<const PackedMinmerInfo*>(base + header.minmersOffset);
+          flatIndex.packedPoints = reinterpret_cast<const PackedIntervalPoint*>(base + header.pointsOffset);
+        } else {
+          flatIndex.minmers = reinterpret_cast<const MinmerInfo*>(base + header.minmersOffset);
+          flatIndex.points = reinterpret_cast<const IntervalPoint*>(base + header.pointsOffset);
+        }
+        flatIndex.hashes = reinterpret_cast<const hash_t*>(base + header.hashesOffset);
+        flatIndex.seedStarts = reinterpret_cast<const uint64_t*>(base + header.seedStartsOffset);
+        flatIndex.buckets = reinterpret_cast<const uint64_t*>(base + header.bucketsOffset);
+        flatIndex.numMinmers = header.numMinmers;
+        flatIndex.numHashes = header.numHashes;
+        flatIndex.numPoints = header.numPoints;
+        flatIndex.bucketBits = header.bucketBits;
+        flatIndex.bucketShift = 64 - header.bucketBits;
+        if (header.filterOffset) {
+          flatIndex.filter = reinterpret_cast<const uint64_t*>(base + header.filterOffset);
+          flatIndex.filterShift = 64 - header.filterBits;
+        } else {
+          fillSeedFilter(flatIndex.hashes, flatIndex.numHashes, seedTable.filter, seedTable.filterBits);
+          flatIndex.filter = seedTable.filter.data();
+          flatIndex.filterShift = 64 - seedTable.filterBits;
+        }
+
+        countThreshold = header.countThreshold;
+        const hash_t* frequent = reinterpret_cast<const hash_t*>(base + header.frequentOffset);
+        frequentHashes.assign(frequent, frequent + header.numFrequent);
+
+        if (header.version >= 9 && param.verify_index) {
+          static const char* const names[] = {"minmer", "hash", "seed start", "bucket", "interval point", "frequent hash", "seed filter"};
+          uint64_t actual[flatIndexSections] = {};
+          sectionChecksums(flatSections(frequent, header.numFrequent,
+                                        header.filterOffset ? (seedFilterWords << header.filterBits) * sizeof(uint64_t) : 0),
+                           actual);
+          verifyChecksums(header, actual, 7, names);
+        }
+
+        inStream.seekg(header.endOffset);
+      }
+
+      /**
+       * @brief  Read a compressed flat sub-index in one sequential read and decode its blocks
+       *         in parallel into minmerIndex and the seed table
+       */
+      void readCompressedIndex(std::ifstream& inStream, const FlatIndexHeader& header)
+      {
+        const uint64_t size = header.endOffset - header.minmersOffset;
+        std::unique_ptr<char[]> buffer(new char[size]);
+        inStream.seekg(header.minmersOffset);
+        inStream.read(buffer.get(), size);
+        if (!inStream) {
+          std::cerr << "[wfmash::mashmap] ERROR: Truncated index file" << std::endl;
+          exit(1);
+        }
+        const char* base = buffer.get() - header.minmersOffset;
+        const auto blockAt = [&](uint64_t offset) {
+          if (offset < header.minmersOffset || offset > header.endOffset)
+            corruptCompressedIndex();
+          return reinterpret_cast<const uint8_t*>(base + offset);
+        };
+
+        const uint64_t blockSize = header.blockSize;
+        const uint64_t minmerBlocks = (header.numMinmers + blockSize - 1) / blockSize;
+        const uint64_t seedBlocks = (header.numHashes + blockSize - 1) / blockSize;
+        const uint64_t* minmerTable = reinterpret_cast<const uint64_t*>(blockAt(header.minmersOffset));
+        const uint64_t* seedTableEntries = reinterpret_cast<const uint64_t*>(blockAt(header.hashesOffset));
+
+        if (header.version >= 9 && param.verify_index) {
+          static const char* const names[] = {"minmer block table", "seed block table", "frequent hash", "minmer block", "seed block"};
+          uint64_t actual[flatIndexSections] = {};
+          const hash_t* frequent = reinterpret_cast<const hash_t*>(blockAt(header.frequentOffset));
+          sectionChecksums(compressedSections(minmerTable, minmerBlocks, seedTableEntries, seedBlocks, frequent, header.numFrequent),
+                           actual);
+          verifyChecksums(header, actual, 3, names);
+          std::vector<uint64_t> blockChecksums(minmerBlocks + seedBlocks);
+          parallelFor(blockChecksums.size(), [&](uint64_t b) {
+            const uint64_t start = b < minmerBlocks ? minmerTable[b] : seedTableEntries[2 * (b - minmerBlocks)];
+            const uint64_t end = b < minmerBlocks ? minmerTable[b + 1] : seedTableEntries[2 * (b - minmerBlocks) + 2];
+            if (end < start)
+              corruptCompressedIndex();
+            blockChecksums[b] = pieceChecksum(blockAt(start), end - start);
+            blockAt(end);
+          });
+          actual[3] = combineChecksums(blockChecksums.data(), minmerBlocks);
+          actual[4] = combineChecksums(blockChecksums.data() + minmerBlocks, seedBlocks);
+          verifyChecksums(header, actual, 5, names);
+        }
+
+        const bool packed = header.packed;
+        const bool homologousDeltas = header.compressed == 2;
+        if (packed) {
+          packedMinmerIndex.resize(header.numMinmers);
+          seedTable.packedPoints.resize(header.numPoints);
+        } else {
+          minmerIndex.resize(header.numMinmers);
+          seedTable.points.resize(header.numPoints);
+        }
+        seedTable.hashes.resize(header.numHashes);
+        seedTable.starts.resize(header.numHashes + 1);
+
+        parallelFor(minmerBlocks + seedBlocks, [&](uint64_t b) {
+          if (b < minmerBlocks) {
+            const uint8_t* in = blockAt(minmerTable[b]);
+            const uint8_t* end = blockAt(minmerTable[b + 1]);
+            MinmerInfo m = {};
+            for (uint64_t i = b * blockSize; i < std::min(header.numMinmers, (b + 1) * blockSize); ++i) {
+              const uint64_t seqStrand = getVarint(in, end);
+              const int64_t seqDelta = unzigzag(seqStrand >> 2);
+              m.seqId += seqDelta;
+              m.strand = strand_t(int(seqStrand & 3) - 1);
+              m.wpos = (seqDelta ? 0 : m.wpos) + unzigzag(getVarint(in, end));
+              m.wpos_end = m.wpos + unzigzag(getVarint(in, end));
+              if (end - in < (std::ptrdiff_t)sizeof(m.hash))
+                corruptCompressedIndex();
+              std::memcpy(&m.hash, in, sizeof(m.hash));
+              in += sizeof(m.hash);
+              if (packed)
+                packedMinmerIndex[i] = PackedMinmerInfo::pack(m);
+              else
+                minmerIndex[i] = m;
+            }
+            if (in != end)
+              corruptCompressedIndex();
+          } else {
+            const uint64_t s = b - minmerBlocks;
+            const uint8_t* in = blockAt(seedTableEntries[2 * s]);
+            const uint8_t* end = blockAt(seedTableEntries[2 * s + 2]);
+            uint64_t point = seedTableEntries[2 * s + 1];
+            hash_t hash = 0;
+            for (uint64_t i = s * blockSize; i < std::min(header.numHashes, (s + 1) * blockSize); ++i) {
+              hash += getVarint(in, end);
+              const uint64_t count = getVarint(in, end);
+              if (count > header.numPoints - point)
+                corruptCompressedIndex();
+              seedTable.hashes[i] = hash;
+              seedTable.starts[i] = point;
+              IntervalPoint ip = {};
+              ip.hash = hash;
+              for (uint64_t last = point + count; point < last; ++point) {
+                const uint64_t seqSide = getVarint(in, end);
+                const int64_t seqDelta = unzigzag(seqSide >> 1);
+                ip.seqId += seqDelta;
+                ip.side = (seqSide & 1) ? side::OPEN : side::CLOSE;
+                ip.pos = (seqDelta && !homologousDeltas ? 0 : ip.pos) + unzigzag(getVarint(in, end));
+                if (packed)
+                  seedTable.packedPoints[point] = PackedIntervalPoint::pack(ip);
+                else
+                  seedTable.points[point] = ip;
+              }
+            }
+            if (in != end || point != seedTableEntries[2 * s + 3])
+              corruptCompressedIndex();
+          }
+        });
+        seedTable.starts.back() = header.numPoints;
+        indexSeedBuckets(seedTable);
+        viewOwnedIndex(packed);
+
+        countThreshold = header.countThreshold;
+        const hash_t* frequent = reinterpret_cast<const hash_t*>(base + header.frequentOffset);
+        frequentHashes.assign(frequent, frequent + header.numFrequent);
+
+        inStream.seekg(header.endOffset);
+      }
+
+      /**
+       * @brief  Sketch the k-mers the index was built from, queries having to be sketched alike
+       */
+      void adoptSyncmerSize(uint64_t size)
+      {
+        if (int(size) != std::max(param.syncmer_size, 0)) {
+          std::cerr << "[wfmash::mashmap] Index sketches "
+                    << (size ? "closed syncmers of " + std::to_string(size) + "-mers" : std::string("every k-mer"))
+                    << ", switching to it" << std::endl;
+          param.syncmer_size = size;
+          syncmers.reset(size ? new CommonFunc::Syncmers(size) : nullptr);
+        }
+      }
+
+      void adoptWorldMinimizers(bool world)
+      {
+        if (world != param.world_minimizers) {
+          std::cerr << "[wfmash::mashmap] Index sketches "
+                    << (world ? "world minimizers" : "bottom-s window sketches")
+                    << ", switching to it" << std::endl;
+          param.world_minimizers = world;
+        }
+      }
+
+      void adoptDustThreshold(uint64_t threshold)
+      {
+        if (threshold != param.dust_threshold) {
+          std::cerr << "[wfmash::mashmap] Index sketches "
+                    << (threshold ? "k-mers of a DUST score up to " + std::to_string(threshold / double(CommonFunc::Dust::scale))
+                                  : std::string("low-complexity k-mers"))
+                    << ", switching to it" << std::endl;
+          param.dust_threshold = threshold;
+          dust.reset(threshold ? new CommonFunc::Dust(threshold) : nullptr);
+        }
+      }
+
+      /**
+       * @brief  Read and check the header of the flat sub-index following the parameters
+       */
+      static FlatIndexHeader readFlatIndexHeader(std::ifstream& inStream)
+      {
+        const uint64_t pos = inStream.tellg();
+        inStream.seekg(alignOffset(pos));
+
+        FlatIndexHeader header = {};
+        inStream.read((char*)&header, offsetof(FlatIndexHeader, countThreshold));
+        if (header.version >= 3) {
+          inStream.read((char*)&header.countThreshold, offsetof(FlatIndexHeader, compressed) - offsetof(FlatIndexHeader, countThreshold));
+        }
+        if (header.version >= 4) {
+          inStream.read((char*)&header.compressed, offsetof(FlatIndexHeader, syncmerSize) - offsetof(FlatIndexHeader, compressed));
+        }
+        if (header.version >= 5) {
+          inStream.read((char*)&header.syncmerSize, offsetof(FlatIndexHeader, worldMinimizers) - offsetof(FlatIndexHeader, syncmerSize));
+        }
+        if (header.version >= 6) {
+          inStream.read((char*)&header.worldMinimizers, offsetof(FlatIndexHeader, dustThreshold) - offsetof(FlatIndexHeader, worldMinimizers));
+        }
+        if (header.version >= 7) {
+          inStream.read((char*)&header.dustThreshold, offsetof(FlatIndexHeader, filterBits) - offsetof(FlatIndexHeader, dustThreshold));
+        }
+        if (header.version >= 8) {
+          inStream.read((char*)&header.filterBits, offsetof(FlatIndexHeader, checksums) - offsetof(FlatIndexHeader, filterBits));
+        }
+        if (header.version >= 9) {
+          inStream.read((char*)header.checksums, sizeof(header.checksums));
+        }
+        if (!inStream || header.version < 2 || header.version > flatIndexVersion
+            || header.packed > 1 || header.bucketBits == 0 || header.bucketBits > 32
+            || header.compressed > 2 || (header.compressed && header.blockSize == 0)
+            || header.syncmerSize > CommonFunc::Syncmers::maxSize || header.worldMinimizers > 1
+            || (header.filterOffset && (header.filterBits == 0 || header.filterBits > 40))) {
+          std::cerr << "[wfmash::mashmap] ERROR: Unsupported or corrupt flat index layout" << std::endl;
+          exit(1);
+        }
+        if (header.version < 3) {
+          header.frequentOffset = header.endOffset;
+        }
+        return header;
       }
 
       bool readSubIndexHeader(std::ifstream& inStream, const std::vector<std::string>& targetSequenceNames) 
+      {
+        return readSubIndexNames(inStream) == targetSequenceNames;
+      }
+
+      /**
+       * @brief  Read the magic number and sequence names opening a sub-index
+       */
+      std::vector<std::string> readSubIndexNames(std::ifstream& inStream)
       {
         uint64_t magic_number = 0;
         inStream.read(reinterpret_cast<char*>(&magic_number), sizeof(magic_number));
-        if (magic_number != 0xDEADBEEFCAFEBABE) {
+        if (magic_number != indexMagicLegacy && magic_number != indexMagicHashed
+            && magic_number != indexMagicSeeded && magic_number != indexMagicFlat) {
             std::cerr << "Error: Invalid magic number in index file." << std::endl;
             exit(1);
         }
+        indexMagic = magic_number;
         uint64_t num_sequences = 0;
         inStream.read(reinterpret_cast<char*>(&num_sequences), sizeof(num_sequences));
         std::vector<std::string> sequenceNames;
@@ -678,7 +2588,7 @@ namespace skch
             sequenceNames.push_back(seqName);
         }
         
-        return sequenceNames == targetSequenceNames;
+        return sequenceNames;
       }
 
 
@@ -691,7 +2601,7 @@ namespace skch
        */
       bool isMinmerIndexEnd(const MIIter_t &it) const
       {
-        return it == this->minmerIndex.end();
+        return it == getMinmerIndexEnd();
       }
 
       /**
@@ -699,14 +2609,291 @@ namespace skch
        */
       MIIter_t getMinmerIndexEnd() const
       {
-        return this->minmerIndex.end();
+        return flatIndex.packed ? MIIter_t(flatIndex.packedMinmers, flatIndex.numMinmers)
+                                : MIIter_t(flatIndex.minmers, flatIndex.numMinmers);
       }
 
       void clear()
       {
-        minmerPosLookupIndex.clear();
         minmerIndex.clear();
+        packedMinmerIndex.clear();
         minmerFreqHistogram.clear();
+        releaseFlatIndex();
+        seedTable = SeedTable();
+        accountMemory();
+      }
+
+      // Approximate bytes of an index of length bp of targets, once built and at the peak of
+      // building it: about two minmers per sketch element of each segment, each with its
+      // interval points and, at most, its own hash and seed range
+      struct MemoryEstimate
+      {
+        uint64_t resident;
+        uint64_t buildPeak;
+      };
+
+      static MemoryEstimate estimateMemory(uint64_t length, const skch::Parameters& p)
+      {
+        const uint64_t minmers = 2 * uint64_t(p.sketchSize) * length / std::max<uint64_t>(p.segLength, 1);
+        const uint64_t resident = minmers * (sizeof(MinmerInfo) + 2 * sizeof(IntervalPoint) + sizeof(hash_t) + sizeof(uint64_t));
+        // while building, each minmer is also scattered by pointer, and each hash counted and
+        // given its position list in the hash maps of its partition
+        const uint64_t building = minmers * (sizeof(MinmerInfo*) + 2 * sizeof(IntervalPoint)
+                                             + sizeof(std::pair<hash_t, uint64_t>) + sizeof(std::pair<hash_t, MinmerMapValueType>)
+                                             + 2 * sizeof(uint64_t));
+        return {resident, resident + building};
+      }
+
+      /**
+       * @brief   for each occurrence cutoff at powers of 2, the fractions of the windows and
+       *          of the L1 hits the hashes occurring at most that often keep, and the hits a
+       *          fragment of sketchSize hashes draws from them
+       * @details A fragment samples about sketchSize of its windows' hashes, each found in
+       *          as many intervals as its occurrences, so the hits per hash are sum(n^2)/sum(n)
+       *          over the hashes kept occurring n times
+       * @param   histogram   the count of hashes occurring each number of times, by increasing
+       *                      occurrences
+       */
+      static void forEachCutoff(const std::vector<std::pair<uint64_t, uint64_t>>& histogram, int sketchSize,
+                                const std::function<void(uint64_t, double, double, double)>& fn)
+      {
+        long double windows = 0, hits = 0;
+        for (const auto& [n, count] : histogram) {
+          windows += (long double)n * count;
+          hits += (long double)n * n * count;
+        }
+        long double keptWindows = 0, keptHits = 0;
+        size_t i = 0;
+        for (uint64_t cutoff = 1; i < histogram.size(); cutoff *= 2) {
+          for (; i < histogram.size() && histogram[i].first <= cutoff; ++i) {
+            keptWindows += (long double)histogram[i].first * histogram[i].second;
+            keptHits += (long double)histogram[i].first * histogram[i].first * histogram[i].second;
+          }
+          fn(cutoff, (double)(keptWindows / std::max<long double>(windows, 1)), (double)(keptHits / std::max<long double>(hits, 1)),
+             (double)(sketchSize * keptHits / std::max<long double>(keptWindows, 1)));
+        }
+      }
+
+      /**
+       * @brief   the occurrence cutoff at the knee of the windows kept against the L1 hits,
+       *          maximizing their difference as fractions of the index without a cutoff, or
+       *          with hitBudget over 0 the highest whose fragments draw at most that many hits
+       */
+      static uint64_t kneeCutoff(const std::vector<std::pair<uint64_t, uint64_t>>& histogram, int sketchSize, double hitBudget)
+      {
+        uint64_t chosen = histogram.empty() ? 1 : histogram.back().first;
+        double bestGain = 0;
+        bool withinBudget = false;
+        forEachCutoff(histogram, sketchSize, [&](uint64_t cutoff, double windowFraction, double hitFraction, double fragmentHits) {
+          if (hitBudget > 0) {
+            if (fragmentHits <= hitBudget) {
+              chosen = cutoff;
+              withinBudget = true;
+            } else if (!withinBudget) {
+              chosen = 1;
+            }
+          } else if (windowFraction - hitFraction > bestGain) {
+            bestGain = windowFraction - hitFraction;
+            chosen = cutoff;
+          }
+        });
+        return chosen;
+      }
+
+      /**
+       * @brief   whether the frequency filter dropped hash from this sub-index
+       */
+      bool isFrequent(hash_t hash) const
+      {
+        return std::binary_search(frequentHashes.begin(), frequentHashes.end(), hash);
+      }
+
+      /**
+       * @brief   the sorted distinct minmer hashes of a whole sequence, sketched with the
+       *          windows of the targets; seq is uppercased in place
+       */
+      std::vector<hash_t> sequenceHashes(char* seq, offset_t len, progress_meter::ProgressMeter* progress) const
+      {
+        MI_Type minmers;
+        if (param.world_minimizers) {
+          CommonFunc::makeUpperCaseAndValid(seq, len, param.alphabetSize);
+          CommonFunc::computeWorldMinmers(minmers, seq, len, len, param.kmerSize, param.segLength, param.alphabetSize,
+                                          CommonFunc::worldHashThreshold(param.sketchSize, param.segLength, param.kmerSize, param.alphabetSize),
+                                          0, param.kmerHashEngine, progress, 0, spacedSeeds.get(), syncmers.get(), dust.get());
+        } else {
+          CommonFunc::addMinmers(minmers, seq, len, param.kmerSize, param.segLength, param.alphabetSize, param.sketchSize,
+                                 0, param.kmerHashEngine, progress, spacedSeeds.get(), syncmers.get(), dust.get());
+        }
+        std::vector<hash_t> hashes;
+        hashes.reserve(minmers.size());
+        for (const auto& m : minmers) {
+          hashes.push_back(m.hash);
+        }
+        std::sort(hashes.begin(), hashes.end());
+        hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
+        return hashes;
+      }
+
+      /**
+       * @brief   the count of distinct minmer hashes kept of each target sequence, by its id
+       */
+      std::unordered_map<seqno_t, uint64_t> distinctHashCounts() const
+      {
+        std::unordered_map<seqno_t, uint64_t> counts;
+        std::vector<hash_t> hashes;
+        const auto flush = [&](seqno_t seqId) {
+          std::sort(hashes.begin(), hashes.end());
+          counts[seqId] = std::unique(hashes.begin(), hashes.end()) - hashes.begin();
+          hashes.clear();
+        };
+        seqno_t current = -1;
+        for (auto it = getMinmerIndexBegin(); it != getMinmerIndexEnd(); ++it) {
+          const MinmerInfo m = *it;
+          if (m.seqId != current && current >= 0) {
+            flush(current);
+          }
+          current = m.seqId;
+          hashes.push_back(m.hash);
+        }
+        if (current >= 0) {
+          flush(current);
+        }
+        return counts;
+      }
+
+      /**
+       * @brief   write the statistics of this sub-index as TSV rows of subset, stat, key and
+       *          value: its sizes and the bytes of each table, percentiles and a log2
+       *          histogram of the windows per hash, and for occurrence cutoffs at powers of
+       *          2 the windows they keep and the L1 interval hits a fragment would draw
+       * @details The hits are those of forEachCutoff and the suggested cutoff is kneeCutoff's,
+       *          the one -F auto would choose.
+       */
+      void writeStats(std::ostream& out, uint64_t subset) const
+      {
+        std::vector<uint64_t> occurrences(flatIndex.numHashes);
+        for (uint64_t i = 0; i < flatIndex.numHashes; ++i) {
+          occurrences[i] = (flatIndex.seedStarts[i + 1] - flatIndex.seedStarts[i]) / 2;
+        }
+        std::sort(occurrences.begin(), occurrences.end());
+
+        auto row = [&](const char* stat, const std::string& key, auto value) {
+          out << subset << "\t" << stat << "\t" << key << "\t" << value << "\n";
+        };
+        row("count", "windows", flatIndex.numMinmers);
+        row("count", "hashes", flatIndex.numHashes);
+        row("count", "interval_points", flatIndex.numPoints);
+        row("count", "filtered_hashes", frequentHashes.size());
+        row("count", "count_threshold", countThreshold);
+
+        const char* sectionNames[] = {"minmers", "hashes", "seed_starts", "buckets",
+                                      "interval_points", "frequent_hashes", "seed_filter"};
+        const IndexSections sections = flatSections(frequentHashes.data(), frequentHashes.size(),
+                                                    (seedFilterWords << (64 - flatIndex.filterShift)) * sizeof(uint64_t));
+        uint64_t totalBytes = 0;
+        for (size_t i = 0; i < sections.size(); ++i) {
+          row("bytes", sectionNames[i], sections[i].second);
+          totalBytes += sections[i].second;
+        }
+        row("bytes", "total", totalBytes);
+
+        if (occurrences.empty()) {
+          out << std::flush;
+          return;
+        }
+        for (double p : {50.0, 90.0, 99.0, 99.9}) {
+          const uint64_t rank = std::min<uint64_t>(occurrences.size() - 1, p / 100 * occurrences.size());
+          std::ostringstream key;
+          key << "p" << p;
+          row("occurrences", key.str(), occurrences[rank]);
+        }
+        row("occurrences", "max", occurrences.back());
+
+        // Hashes and windows by the bin [2^b, 2^(b+1)) of their occurrences
+        std::vector<uint64_t> binHashes, binWindows;
+        long double windows = 0, hits = 0;
+        for (uint64_t n : occurrences) {
+          const size_t bin = 63 - __builtin_clzll(std::max<uint64_t>(n, 1));
+          if (bin >= binHashes.size()) {
+            binHashes.resize(bin + 1, 0);
+            binWindows.resize(bin + 1, 0);
+          }
+          binHashes[bin]++;
+          binWindows[bin] += n;
+          windows += n;
+          hits += (long double)n * n;
+        }
+        for (size_t b = 0; b < binHashes.size(); ++b) {
+          const std::string key = std::to_string(1ULL << b) + "-" + std::to_string((2ULL << b) - 1);
+          row("histogram_hashes", key, binHashes[b]);
+          row("histogram_windows", key, binWindows[b]);
+        }
+        row("l1_hits", "per_fragment", (double)(param.sketchSize * hits / std::max<long double>(windows, 1)));
+
+        // Kept windows and hits of the hashes occurring at most each cutoff
+        std::vector<std::pair<uint64_t, uint64_t>> histogram;
+        for (uint64_t n : occurrences) {
+          if (histogram.empty() || histogram.back().first != n) {
+            histogram.emplace_back(n, 0);
+          }
+          histogram.back().second++;
+        }
+        forEachCutoff(histogram, param.sketchSize, [&](uint64_t cutoff, double windowFraction, double, double fragmentHits) {
+          row("cutoff_windows", std::to_string(cutoff), windowFraction);
+          row("cutoff_l1_hits", std::to_string(cutoff), fragmentHits);
+        });
+        // as a count for -F, which takes 1 and under as a fraction
+        row("suggested", "max_kmer_freq", std::max<uint64_t>(kneeCutoff(histogram, param.sketchSize, 0), 2));
+        out << std::flush;
+      }
+
+      private:
+
+      // The arrays the index view reads, whether mapped, read in or owned
+      pages::Regions indexRegions() const
+      {
+        if (flatIndex.mapping) {
+          return {{flatIndex.mapping, flatIndex.mappingSize},
+                  {seedTable.filter.data(), seedTable.filter.size() * sizeof(uint64_t)}};
+        }
+        if (flatIndex.buffer) {
+          return {{flatIndex.buffer.get(), flatIndex.bufferSize},
+                  {seedTable.filter.data(), seedTable.filter.size() * sizeof(uint64_t)}};
+        }
+        return {{minmerIndex.data(), minmerIndex.size() * sizeof(MinmerInfo)},
+                {packedMinmerIndex.data(), packedMinmerIndex.size() * sizeof(PackedMinmerInfo)},
+                {seedTable.hashes.data(), seedTable.hashes.size() * sizeof(hash_t)},
+                {seedTable.starts.data(), seedTable.starts.size() * sizeof(uint64_t)},
+                {seedTable.buckets.data(), seedTable.buckets.size() * sizeof(uint64_t)},
+                {seedTable.filter.data(), seedTable.filter.size() * sizeof(uint64_t)},
+                {seedTable.points.data(), seedTable.points.size() * sizeof(IntervalPoint)},
+                {seedTable.packedPoints.data(), seedTable.packedPoints.size() * sizeof(PackedIntervalPoint)}};
+      }
+
+      void releaseFlatIndex()
+      {
+        if (flatIndex.mapping)
+          munmap(flatIndex.mapping, flatIndex.mappingSize);
+        flatIndex = FlatIndexView();
+      }
+
+      /**
+       * @brief   set the bytes of this sketch in the memory report from the capacities of its
+       *          tables; a memory-mapped index counts whole, as its pages may all be resident
+       */
+      void accountMemory()
+      {
+        if (!memory::enabled())
+          return;
+        memoryAccount.set(memory::MINMER_INDEX, minmerIndex.capacity() * sizeof(MinmerInfo)
+                                                + packedMinmerIndex.capacity() * sizeof(PackedMinmerInfo));
+        memoryAccount.set(memory::SEED_TABLE, seedTable.hashes.capacity() * sizeof(hash_t)
+                                              + (seedTable.starts.capacity() + seedTable.buckets.capacity()
+                                                 + seedTable.filter.capacity()) * sizeof(uint64_t)
+                                              + seedTable.points.capacity() * sizeof(IntervalPoint)
+                                              + seedTable.packedPoints.capacity() * sizeof(PackedIntervalPoint));
+        memoryAccount.set(memory::FREQUENT_HASHES, frequentHashes.capacity() * sizeof(hash_t));
+        memoryAccount.set(memory::INDEX_FILE, flatIndex.mapping ? flatIndex.mappingSize : flatIndex.bufferSize);
       }
 
     }; //End of class Sketch
@@ -0,0 +1,111 @@
+/**
+ * @file    workStealingPool.hpp
+ * @brief   Per-thread task deques with stealing between threads
+ */
+
+#ifndef WORK_STEALING_POOL_HPP
+#define WORK_STEALING_POOL_HPP
+
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "map/include/blockingQueue.hpp"
+
+namespace skch
+{
+  /**
+   * @brief   Task deques of a fixed set of worker threads
+   * @details Each worker pushes the tasks it creates to its own deque and takes them back
+   *          newest first, so it keeps working on what it just split up. A worker with an
+   *          empty deque steals the oldest task of another worker. Each deque has its own
+   *          lock, which is uncontended unless a steal happens on it. A Wakeup given at
+   *          construction is notified of every push, for idle workers to wait on.
+   *          With workers spread over nodes, worker i on node i % nodes, thieves try the
+   *          workers of their own node first, whose tasks' data is likely local.
+   */
+  template <typename Task>
+  class WorkStealingPool
+  {
+    public:
+
+      explicit WorkStealingPool(int workers, Wakeup* wakeup = nullptr, int nodes = 1)
+        : wakeup(wakeup), nodes(std::max(1, nodes))
+      {
+        for (int i = 0; i < workers; ++i)
+          lanes.emplace_back(new Lane);
+      }
+
+      int workers() const
+      {
+        return lanes.size();
+      }
+
+      void push(int worker, Task task)
+      {
+        Lane& lane = *lanes[worker];
+        {
+          std::lock_guard<std::mutex> lock(lane.mutex);
+          lane.tasks.push_back(std::move(task));
+        }
+        if (wakeup)
+          wakeup->notify();
+      }
+
+      /**
+       * @brief   take the newest task of worker's own deque
+       * @return  false if it is empty
+       */
+      bool pop(int worker, Task& task)
+      {
+        Lane& lane = *lanes[worker];
+        std::lock_guard<std::mutex> lock(lane.mutex);
+        if (lane.tasks.empty())
+          return false;
+        task = std::move(lane.tasks.back());
+        lane.tasks.pop_back();
+        return true;
+      }
+
+      /**
+       * @brief   take the oldest task of another worker, trying them in turn from worker + 1,
+       *          those on the same node before the others
+       * @return  false if every other deque is empty
+       */
+      bool steal(int worker, Task& task)
+      {
+        for (int local = 1; local >= 0; --local) {
+          for (int i = 1; i < workers(); ++i) {
+            const int victim = (worker + i) % workers();
+            if ((victim % nodes == worker % nodes) != bool(local)) {
+              continue;
+            }
+            Lane& lane = *lanes[victim];
+            std::lock_guard<std::mutex> lock(lane.mutex);
+            if (!lane.tasks.empty()) {
+              task = std::move(lane.tasks.front());
+              lane.tasks.pop_front();
+              return true;
+            }
+          }
+        }
+        return false;
+      }
+
+    private:
+
+      struct Lane
+      {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+      };
+
+      std::vector<std::unique_ptr<Lane>> lanes;
+      Wakeup* wakeup;
+      const int nodes;
+  };
+}
+
+#endif